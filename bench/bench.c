@@ -0,0 +1,572 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Microbenchmarks for the core data structures and kernels
+ * @desc Run with "python waf bench", or build/yabbt_bench directly:
+ *
+ *          yabbt_bench [-r runs] [name prefix]
+ *
+ *       One CSV line is written per benchmark and parameter set:
+ *
+ *          benchmark,params,ops,ns_per_op_min,ns_per_op_median,mb_per_s
+ *
+ *       Each is run several times; the minimum is what to compare between
+ *       builds, the median shows how noisy the machine was. mb_per_s is
+ *       from the minimum, and is 0 for benchmarks that aren't about bytes.
+ *       Inputs come from a fixed seed so every run does the same work.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bitfield.h"
+#include "chunkybar.h"
+#include "linked_list_hashmap.h"
+#include "pseudolru.h"
+#include "heap.h"
+#include "pwp_connection.h"
+#include "pwp_msghandler.h"
+
+#include "bt.h"
+#include "bt_sha1.h"
+#include "bt_selector_auto.h"
+#include "bt_selector_random.h"
+#include "bt_selector_rarestfirst.h"
+#include "bt_selector_sequential.h"
+#include "bt_selector_streaming.h"
+
+#define RUNS_MAX 32
+
+static int __runs = 5;
+static const char* __prefix = NULL;
+
+static uint64_t __seed;
+
+static unsigned long long __now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * xorshift64*; rand() isn't the same everywhere */
+static unsigned int __rand()
+{
+    __seed ^= __seed >> 12;
+    __seed ^= __seed << 25;
+    __seed ^= __seed >> 27;
+    return (unsigned int)((__seed * 2685821657736338717ULL) >> 32);
+}
+
+static void __srand()
+{
+    __seed = 88172645463325252ULL;
+}
+
+/**
+ * @return 1 if the benchmark was asked for */
+static int __wanted(const char* name)
+{
+    return !__prefix || 0 == strncmp(name, __prefix, strlen(__prefix));
+}
+
+static int __cmp_ull(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a,
+                       y = *(const unsigned long long*)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * Print the CSV line for these runs
+ * @param ops Operations done by each run
+ * @param bytes Bytes processed by each run; 0 if it's not about bytes */
+static void __report(const char* name, const char* params,
+                     unsigned long long ops, unsigned long long bytes,
+                     unsigned long long* ns)
+{
+    qsort(ns, __runs, sizeof(ns[0]), __cmp_ull);
+    if (0 == ns[0])
+        ns[0] = 1;
+    printf("%s,%s,%llu,%.2f,%.2f,%.2f\n", name, params, ops,
+           (double)ns[0] / ops, (double)ns[__runs / 2] / ops,
+           bytes ? (double)bytes / (1 << 20) / ((double)ns[0] / 1e9) : 0.0);
+    fflush(stdout);
+}
+
+static void __bench_chunkybar()
+{
+    const unsigned int max = 1u << 30, nblocks = 100000;
+    unsigned long long ns[RUNS_MAX];
+    unsigned int *offsets = malloc(nblocks * sizeof(unsigned int));
+    unsigned int i, o, l;
+    int r;
+    void* c;
+
+    if (!__wanted("chunky"))
+        return;
+
+    __srand();
+    for (i = 0; i < nblocks; i++)
+        offsets[i] = (__rand() % (max / (BT_BLOCK_SIZE))) * (BT_BLOCK_SIZE);
+
+    for (r = 0; r < __runs; r++)
+    {
+        c = chunky_new(max);
+        ns[r] = __now_ns();
+        for (i = 0; i < nblocks; i++)
+            chunky_mark_complete(c, offsets[i], BT_BLOCK_SIZE);
+        ns[r] = __now_ns() - ns[r];
+        chunky_free(c);
+    }
+    __report("chunky_mark_complete", "blocks=100000", nblocks, 0, ns);
+
+    c = chunky_new(max);
+    for (i = 0; i < nblocks; i++)
+        chunky_mark_complete(c, offsets[i], BT_BLOCK_SIZE);
+    for (r = 0; r < __runs; r++)
+    {
+        ns[r] = __now_ns();
+        for (i = 0; i < nblocks; i++)
+            chunky_get_incomplete(c, &o, &l, BT_BLOCK_SIZE);
+        ns[r] = __now_ns() - ns[r];
+    }
+    __report("chunky_get_incomplete", "chunks=100000", nblocks, 0, ns);
+    chunky_free(c);
+    free(offsets);
+}
+
+static unsigned long __hash_int(const void* k)
+{
+    return (unsigned long)k;
+}
+
+static long __cmp_int(const void* a, const void* b)
+{
+    return (long)a - (long)b;
+}
+
+static void __bench_hashmap()
+{
+    /* the hashmap holds fewer than 32768 entries */
+    const unsigned int sizes[] = { 1000, 30000 };
+    unsigned long long ns[RUNS_MAX];
+    unsigned int s, i, n;
+    unsigned long *keys;
+    char params[64];
+    hashmap_t* h;
+    int r;
+
+    if (!__wanted("hashmap"))
+        return;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        n = sizes[s];
+        keys = malloc(n * sizeof(unsigned long));
+        __srand();
+        for (i = 0; i < n; i++)
+            keys[i] = __rand() | 1;
+        sprintf(params, "keys=%u", n);
+
+        for (r = 0; r < __runs; r++)
+        {
+            h = hashmap_new(__hash_int, __cmp_int, 11);
+            ns[r] = __now_ns();
+            for (i = 0; i < n; i++)
+                hashmap_put(h, (void*)keys[i], (void*)keys[i]);
+            ns[r] = __now_ns() - ns[r];
+            hashmap_free(h);
+        }
+        __report("hashmap_put", params, n, 0, ns);
+
+        h = hashmap_new(__hash_int, __cmp_int, 11);
+        for (i = 0; i < n; i++)
+            hashmap_put(h, (void*)keys[i], (void*)keys[i]);
+        for (r = 0; r < __runs; r++)
+        {
+            ns[r] = __now_ns();
+            for (i = 0; i < n; i++)
+                hashmap_get(h, (void*)keys[(i * 7919) % n]);
+            ns[r] = __now_ns() - ns[r];
+        }
+        __report("hashmap_get", params, n, 0, ns);
+        hashmap_free(h);
+        free(keys);
+    }
+}
+
+static int __cmp_lru(const void* a, const void* b)
+{
+    return (unsigned long)a < (unsigned long)b ? -1 :
+        (unsigned long)a > (unsigned long)b ? 1 : 0;
+}
+
+static void __bench_pseudolru()
+{
+    const unsigned int sizes[] = { 1000, 100000 };
+    unsigned long long ns[RUNS_MAX];
+    unsigned int s, i, n;
+    unsigned long *keys;
+    char params[64];
+    pseudolru_t* l;
+    int r;
+
+    if (!__wanted("pseudolru"))
+        return;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        n = sizes[s];
+        keys = malloc(n * sizeof(unsigned long));
+        __srand();
+        for (i = 0; i < n; i++)
+            keys[i] = __rand() | 1;
+        sprintf(params, "keys=%u", n);
+
+        for (r = 0; r < __runs; r++)
+        {
+            l = pseudolru_new(__cmp_lru);
+            ns[r] = __now_ns();
+            for (i = 0; i < n; i++)
+                pseudolru_put(l, (void*)keys[i], (void*)keys[i]);
+            ns[r] = __now_ns() - ns[r];
+            pseudolru_free(l);
+        }
+        __report("pseudolru_put", params, n, 0, ns);
+        free(keys);
+    }
+}
+
+static int __cmp_heap(const void* a, const void* b, const void* udata)
+{
+    return __cmp_lru(b, a);
+}
+
+static void __bench_heap()
+{
+    const unsigned int sizes[] = { 1000, 100000 };
+    unsigned long long ns[RUNS_MAX], ns_poll[RUNS_MAX];
+    unsigned int s, i, n;
+    unsigned long *items;
+    char params[64];
+    heap_t* h;
+    int r;
+
+    if (!__wanted("heap"))
+        return;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        n = sizes[s];
+        items = malloc(n * sizeof(unsigned long));
+        __srand();
+        for (i = 0; i < n; i++)
+            items[i] = __rand() | 1;
+        sprintf(params, "items=%u", n);
+
+        for (r = 0; r < __runs; r++)
+        {
+            h = heap_new(__cmp_heap, NULL);
+            ns[r] = __now_ns();
+            for (i = 0; i < n; i++)
+                heap_offer(h, (void*)items[i]);
+            ns[r] = __now_ns() - ns[r];
+            ns_poll[r] = __now_ns();
+            for (i = 0; i < n; i++)
+                heap_poll(h);
+            ns_poll[r] = __now_ns() - ns_poll[r];
+            heap_free(h);
+        }
+        __report("heap_offer", params, n, 0, ns);
+        __report("heap_poll", params, n, 0, ns_poll);
+        free(items);
+    }
+}
+
+static void __bench_sha1()
+{
+    const unsigned int len = 1 << 18, npieces = 16;
+    unsigned long long ns[RUNS_MAX];
+    char hash[20], *hashes[4], digests[4][20], params[64];
+    const void* data[4];
+    unsigned int lens[4], i;
+    unsigned char* buf;
+    int r, accel, on;
+
+    if (!__wanted("sha1"))
+        return;
+
+    buf = malloc(len * 4);
+    __srand();
+    for (i = 0; i < len * 4; i++)
+        buf[i] = __rand();
+    for (i = 0; i < 4; i++)
+    {
+        hashes[i] = digests[i];
+        data[i] = buf + len * i;
+        lens[i] = len;
+    }
+
+    for (accel = 0; accel <= 1; accel++)
+    {
+        on = bt_sha1_set_acceleration(accel);
+        if (accel && !on)
+            continue;
+        sprintf(params, "piece_len=%u accel=%d", len, on);
+
+        for (r = 0; r < __runs; r++)
+        {
+            ns[r] = __now_ns();
+            for (i = 0; i < npieces; i++)
+                bt_sha1(hash, buf, len);
+            ns[r] = __now_ns() - ns[r];
+        }
+        __report("sha1", params, npieces,
+                 (unsigned long long)npieces * len, ns);
+
+        for (r = 0; r < __runs; r++)
+        {
+            ns[r] = __now_ns();
+            for (i = 0; i < npieces / 4; i++)
+                bt_sha1_multi(4, hashes, data, lens);
+            ns[r] = __now_ns() - ns[r];
+        }
+        __report("sha1_multi", params, npieces,
+                 (unsigned long long)npieces * len, ns);
+    }
+    bt_sha1_set_acceleration(1);
+    free(buf);
+}
+
+static int __pushblock(void *udata, void *peer, bt_block_t *block,
+                       const void *data)
+{
+    return 1;
+}
+
+static unsigned char* __put32(unsigned char* p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static void __bench_msghandler()
+{
+    const unsigned int nmsgs = 64, msg_len = 4 + 9 + (BT_BLOCK_SIZE),
+                       reads[] = { 1400, 16384, 65536 };
+    unsigned long long ns[RUNS_MAX];
+    unsigned int i, s, len = nmsgs * msg_len, off;
+    unsigned char *buf, *p;
+    char params[64];
+    void *pc, *mh;
+    int r;
+
+    if (!__wanted("pwp_msghandler"))
+        return;
+
+    /* PIECE messages, the bulk of what is read */
+    buf = calloc(1, len);
+    for (i = 0, p = buf; i < nmsgs; i++)
+    {
+        p = __put32(p, 9 + (BT_BLOCK_SIZE));
+        *p++ = PWP_MSGTYPE_PIECE;
+        p = __put32(p, i);
+        p = __put32(p, 0);
+        p += BT_BLOCK_SIZE;
+    }
+
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .pushblock = __pushblock
+                       }), NULL);
+    pwp_conn_set_piece_info(pc, nmsgs, BT_BLOCK_SIZE);
+    mh = pwp_msghandler_new(pc);
+
+    for (s = 0; s < sizeof(reads) / sizeof(reads[0]); s++)
+    {
+        sprintf(params, "read_len=%u", reads[s]);
+        for (r = 0; r < __runs; r++)
+        {
+            ns[r] = __now_ns();
+            for (off = 0; off < len; off += reads[s])
+                pwp_msghandler_dispatch_from_buffer(mh, (char*)buf + off,
+                                                    len - off < reads[s] ?
+                                                    len - off : reads[s]);
+            ns[r] = __now_ns() - ns[r];
+        }
+        __report("pwp_msghandler_dispatch_from_buffer", params, nmsgs, len,
+                 ns);
+    }
+
+    pwp_msghandler_release(mh);
+    pwp_conn_release(pc);
+    free(buf);
+}
+
+typedef struct
+{
+    const char* name;
+    bt_pieceselector_i i;
+
+    /* NULL if the selector has nothing to free */
+    void (*free)(void* r);
+} selector_t;
+
+static selector_t __selectors[] = {
+    { "auto", {
+        .new = bt_auto_selector_new,
+        .add_peer = bt_auto_selector_add_peer,
+        .peer_share_pieces = bt_auto_selector_peer_share_pieces,
+        .peer_giveback_piece = bt_auto_selector_giveback_piece,
+        .poll_piece = bt_auto_selector_poll_best_piece },
+      bt_auto_selector_free },
+    { "random", {
+        .new = bt_random_selector_new,
+        .add_peer = bt_random_selector_add_peer,
+        .peer_have_bitfield = bt_random_selector_peer_have_bitfield,
+        .peer_giveback_piece = bt_random_selector_giveback_piece,
+        .poll_piece = bt_random_selector_poll_best_piece },
+      bt_random_selector_free },
+    { "rarestfirst", {
+        .new = bt_rarestfirst_selector_new,
+        .add_peer = bt_rarestfirst_selector_add_peer,
+        .peer_share_pieces = bt_rarestfirst_selector_peer_share_pieces,
+        .peer_giveback_piece = bt_rarestfirst_selector_giveback_piece,
+        .poll_piece = bt_rarestfirst_selector_poll_best_piece },
+      bt_rarestfirst_selector_free },
+    { "sequential", {
+        .new = bt_sequential_selector_new,
+        .add_peer = bt_sequential_selector_add_peer,
+        .peer_have_piece = bt_sequential_selector_peer_have_piece,
+        .peer_giveback_piece = bt_sequential_selector_giveback_piece,
+        .poll_piece = bt_sequential_selector_poll_best_piece },
+      NULL },
+    { "streaming", {
+        .new = bt_streaming_selector_new,
+        .add_peer = bt_streaming_selector_add_peer,
+        .peer_share_pieces = bt_streaming_selector_peer_share_pieces,
+        .peer_giveback_piece = bt_streaming_selector_giveback_piece,
+        .poll_piece = bt_streaming_selector_poll_best_piece },
+      bt_streaming_selector_free },
+};
+
+/**
+ * Poll pieces for each peer in turn. Each peer has each piece with a
+ * chance of one half, so rarity varies. Polled pieces are given back
+ * between runs, outside of the timing */
+static void __bench_selector(selector_t* s, int npieces, int npeers)
+{
+    const int npolls = 10000;
+    unsigned long long ns[RUNS_MAX];
+    int nwords = (npieces + 63) / 64, i, j, r, *polled;
+    uint64_t* words = malloc(sizeof(uint64_t) * nwords * npeers);
+    char* peers = malloc(npeers);
+    char params[64];
+    void* sel;
+
+    polled = malloc(npolls * sizeof(int));
+    __srand();
+    for (i = 0; i < nwords * npeers; i++)
+        words[i] = ((uint64_t)__rand() << 32) | __rand();
+    if (npieces % 64)
+        for (i = 0; i < npeers; i++)
+            words[i * nwords + nwords - 1] &= (1ull << (npieces % 64)) - 1;
+
+    sel = s->i.new(npieces);
+    for (i = 0; i < npeers; i++)
+    {
+        uint64_t* w = words + i * nwords;
+
+        s->i.add_peer(sel, peers + i);
+        if (s->i.peer_share_pieces)
+            s->i.peer_share_pieces(sel, peers + i, w, npieces);
+        else if (s->i.peer_have_bitfield)
+            s->i.peer_have_bitfield(sel, peers + i, w, npieces);
+        else
+            for (j = 0; j < npieces; j++)
+                if (w[j / 64] & (1ull << (j % 64)))
+                    s->i.peer_have_piece(sel, peers + i, j);
+    }
+
+    for (r = 0; r < __runs; r++)
+    {
+        ns[r] = __now_ns();
+        for (i = 0; i < npolls; i++)
+            polled[i] = s->i.poll_piece(sel, peers + i % npeers);
+        ns[r] = __now_ns() - ns[r];
+
+        for (i = 0; i < npolls; i++)
+            if (-1 != polled[i])
+                s->i.peer_giveback_piece(sel, peers + i % npeers, polled[i]);
+    }
+
+    sprintf(params, "selector=%s npieces=%d npeers=%d",
+            s->name, npieces, npeers);
+    __report("poll_piece", params, npolls, 0, ns);
+
+    if (s->free)
+        s->free(sel);
+    free(polled);
+    free(peers);
+    free(words);
+}
+
+static void __bench_selectors()
+{
+    const int npieces[] = { 10000, 100000, 1000000 },
+              npeers[] = { 10, 100, 1000 };
+    unsigned int s, i, j;
+
+    if (!__wanted("poll_piece"))
+        return;
+
+    for (s = 0; s < sizeof(__selectors) / sizeof(__selectors[0]); s++)
+        for (i = 0; i < sizeof(npieces) / sizeof(npieces[0]); i++)
+            for (j = 0; j < sizeof(npeers) / sizeof(npeers[0]); j++)
+                __bench_selector(&__selectors[s], npieces[i], npeers[j]);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-r") && i + 1 < argc)
+        {
+            __runs = atoi(argv[++i]);
+            if (__runs < 1)
+                __runs = 1;
+            else if (RUNS_MAX < __runs)
+                __runs = RUNS_MAX;
+        }
+        else
+            __prefix = argv[i];
+    }
+
+    printf("benchmark,params,ops,ns_per_op_min,ns_per_op_median,mb_per_s\n");
+    __bench_chunkybar();
+    __bench_hashmap();
+    __bench_pseudolru();
+    __bench_heap();
+    __bench_sha1();
+    __bench_msghandler();
+    __bench_selectors();
+    return 0;
+}
@@ -0,0 +1,331 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Replay captured wire traffic into a torrent
+ * @desc Built by "python waf bench", but not run by it; it needs a
+ *       capture from network_adapter_libuv_set_capture:
+ *
+ *          yabbt_replay capture [-n pieces] [-p piece_len]
+ *                       [-t periodic_ms] [-i infohash]
+ *
+ *       The torrent has to match the one captured, or the peers'
+ *       bitfields are refused. The infohash is read from the first
+ *       handshake in the capture unless it's given.
+ *       Data is fed in as fast as the torrent takes it, with the
+ *       torrent's clock following the capture's timestamps, so timers
+ *       fire as they did. What we send is thrown away.
+ *       The piece hashes aren't known, so completed pieces fail to
+ *       validate; expect "error validating piece" lines before the CSV.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bt.h"
+#include "bt_capture.h"
+#include "bt_diskmem.h"
+#include "bt_piece_db.h"
+#include "bt_selector_auto.h"
+#include "bt_session.h"
+
+#include "config.h"
+#include "pwp_handshaker.h"
+
+/* the torrent's clock doesn't start at 0; see __now_us */
+#define CLOCK_BASE_US 3600000000ULL
+
+typedef struct
+{
+    void* session;
+    void* dm;
+
+    /* capture time of the current record */
+    unsigned long long us;
+    unsigned long long periodic_us, last_periodic_us;
+
+    unsigned long long bytes;
+    int nperiodics;
+} replay_t;
+
+typedef struct
+{
+    char hs[68];
+    unsigned int len;
+    void* nethandle;
+} prescan_t;
+
+static double __wall_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int __prescan_connection(void *caller, void* nethandle, char *ip,
+                                int port)
+{
+    prescan_t* p = caller;
+
+    if (!p->nethandle)
+        p->nethandle = nethandle;
+    return p->nethandle == nethandle;
+}
+
+static int __prescan_data(void *caller, void* nethandle, const char* buf,
+                          unsigned int len)
+{
+    prescan_t* p = caller;
+
+    if (sizeof(p->hs) - p->len < len)
+        len = sizeof(p->hs) - p->len;
+    memcpy(p->hs + p->len, buf, len);
+    p->len += len;
+    return p->len < sizeof(p->hs);
+}
+
+static void __prescan_failed(void *caller, void* nethandle)
+{
+}
+
+static unsigned long long __get_time_us(void* udata)
+{
+    return CLOCK_BASE_US + ((replay_t*)udata)->us;
+}
+
+static int __send(void* caller, void **udata, void* conn_ctx,
+                  const char *send_data, const int len)
+{
+    return 1;
+}
+
+static int __sendv(void* caller, void **udata, void* conn_ctx,
+                   const bt_iovec_t* iov, const int iovcnt)
+{
+    return 1;
+}
+
+/**
+ * The capture is the only traffic there is, so we don't dial out */
+static int __connect(void* caller, void **udata, void **nethandle,
+                     const char *host, const int port,
+                     int (*func_process_data) (void *, void*,
+                                               const char*, unsigned int),
+                     int (*func_process_connection) (void *, void*, char *,
+                                                     int),
+                     void (*func_connection_failed) (void *, void*))
+{
+    return 0;
+}
+
+static int __data(void *caller, void* nethandle, const char* buf,
+                  unsigned int len)
+{
+    replay_t* r = caller;
+
+    r->bytes += len;
+    return bt_session_dispatch_from_buffer(r->session, nethandle, buf, len);
+}
+
+static int __connection(void *caller, void* nethandle, char *ip, int port)
+{
+    return bt_session_peer_connect(((replay_t*)caller)->session, nethandle,
+                                   ip, port);
+}
+
+static void __failed(void *caller, void* nethandle)
+{
+    replay_t* r = caller;
+
+    bt_dm_peer_connect_fail(r->dm, nethandle);
+    bt_session_peer_disconnect(r->session, nethandle);
+}
+
+static void __time(void *caller, unsigned long long us)
+{
+    replay_t* r = caller;
+
+    r->us = us;
+    if (r->last_periodic_us + r->periodic_us <= us)
+    {
+        r->last_periodic_us = us;
+        r->nperiodics++;
+        bt_session_periodic(r->session);
+    }
+}
+
+static void* __torrent(replay_t* r, const char* infohash, int npieces,
+                       int piece_len)
+{
+    void *dm = bt_dm_new(), *cfg = bt_dm_get_config(dm), *dc, *db;
+    char val[32], hash[20];
+    int i;
+
+    config_set_va(cfg, "npieces", "%d", npieces);
+    config_set_va(cfg, "piece_length", "%d", piece_len);
+    sprintf(val, "%.20s", infohash);
+    config_set(cfg, "infohash", val);
+    config_set(cfg, "my_peerid", bt_generate_peer_id());
+
+    bt_dm_set_cbs(dm, &((bt_dm_cbs_t) {
+                        .peer_connect = __connect,
+                        .peer_send = __send,
+                        .peer_sendv = __sendv,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved,
+                        .handshaker_get_error = pwp_handshaker_get_error,
+                        .send_handshake = pwp_send_handshake,
+                        .get_time_us = __get_time_us
+                    }), r);
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, piece_len);
+    db = bt_piecedb_new();
+    bt_piecedb_set_diskstorage(db, bt_diskmem_get_blockrw(dc), dc);
+    bt_dm_set_piece_db(dm, &((bt_piecedb_i){.get_piece = bt_piecedb_get }),
+                       db);
+    bt_piecedb_increase_piece_space(db,
+                                    (unsigned long long)npieces * piece_len);
+    memset(hash, 0, sizeof(hash));
+    for (i = 0; i < npieces; i++)
+        bt_piecedb_add_with_hash_and_size(db, hash, piece_len);
+
+    /* after the pieces, as the selector checks them */
+    bt_dm_set_piece_selector(dm,
+                             &((bt_pieceselector_i) {
+                                   .new = bt_auto_selector_new,
+                                   .peer_giveback_piece =
+                                       bt_auto_selector_giveback_piece,
+                                   .have_piece = bt_auto_selector_have_piece,
+                                   .remove_peer =
+                                       bt_auto_selector_remove_peer,
+                                   .add_peer = bt_auto_selector_add_peer,
+                                   .peer_have_piece =
+                                       bt_auto_selector_peer_have_piece,
+                                   .peer_have_bitfield =
+                                       bt_auto_selector_peer_have_bitfield,
+                                   .peer_share_pieces =
+                                       bt_auto_selector_peer_share_pieces,
+                                   .get_npeers = bt_auto_selector_get_npeers,
+                                   .get_npieces =
+                                       bt_auto_selector_get_npieces,
+                                   .get_memory =
+                                       bt_auto_selector_get_memory,
+                                   .get_availability =
+                                       bt_auto_selector_get_availability_stats,
+                                   .poll_piece =
+                                       bt_auto_selector_poll_best_piece
+                               }), NULL);
+    return dm;
+}
+
+int main(int argc, char **argv)
+{
+    int i, npieces = 1024, piece_len = 1 << 18, periodic_ms = 100, nrecords;
+    const char *path = NULL, *infohash = NULL;
+    prescan_t p;
+    replay_t r;
+    double start, secs;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ('-' != argv[i][0])
+        {
+            path = argv[i];
+            continue;
+        }
+
+        if (argc <= i + 1)
+        {
+            fprintf(stderr, "%s needs a value\n", argv[i]);
+            return 1;
+        }
+
+        if (0 == strcmp(argv[i], "-n"))
+            npieces = atoi(argv[i + 1]);
+        else if (0 == strcmp(argv[i], "-p"))
+            piece_len = atoi(argv[i + 1]);
+        else if (0 == strcmp(argv[i], "-t"))
+            periodic_ms = atoi(argv[i + 1]);
+        else if (0 == strcmp(argv[i], "-i"))
+            infohash = argv[i + 1];
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (!path)
+    {
+        fprintf(stderr, "usage: %s capture [-n pieces] [-p piece_len] "
+                "[-t periodic_ms] [-i infohash]\n", argv[0]);
+        return 1;
+    }
+
+    if (!infohash)
+    {
+        memset(&p, 0, sizeof(p));
+        if (-1 == bt_capture_replay(path,
+                                    &((bt_capture_replay_i) {
+                                        .process_data = __prescan_data,
+                                        .process_connection =
+                                            __prescan_connection,
+                                        .connection_failed = __prescan_failed
+                                    }), &p))
+        {
+            fprintf(stderr, "%s isn't a capture\n", path);
+            return 1;
+        }
+
+        if (p.len < 48)
+        {
+            fprintf(stderr, "no handshake in %s; use -i\n", path);
+            return 1;
+        }
+        infohash = p.hs + 28;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.periodic_us = (unsigned long long)periodic_ms * 1000;
+    r.session = bt_session_new();
+    bt_session_set_clock(r.session, __get_time_us, &r);
+    r.dm = __torrent(&r, infohash, npieces, piece_len);
+    bt_session_add_torrent(r.session, r.dm);
+
+    start = __wall_seconds();
+    nrecords = bt_capture_replay(path,
+                                 &((bt_capture_replay_i) {
+                                     .process_data = __data,
+                                     .process_connection = __connection,
+                                     .connection_failed = __failed,
+                                     .record_time = __time
+                                 }), &r);
+    secs = __wall_seconds() - start;
+
+    if (-1 == nrecords)
+    {
+        fprintf(stderr, "%s isn't a capture\n", path);
+        return 1;
+    }
+
+    printf("records,bytes,capture_seconds,periodics,seconds,mb_per_s\n");
+    printf("%d,%llu,%.3f,%d,%.3f,%.1f\n",
+           nrecords, r.bytes, r.us / 1e6, r.nperiodics, secs,
+           0 < secs ? r.bytes / secs / 1e6 : 0);
+    bt_session_free(r.session);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Swarm runs over each piece selector and seed choker
+ * @desc Run with "python waf bench_scenarios", or build/yabbt_scenarios
+ *       directly, with yabbt_swarm's options.
+ *
+ *       Every selector is run with the seeds on the seeding choker, and
+ *       with the seeds super-seeding. Leechers are always on the leeching
+ *       choker. Each run has the same seed, so it's the configuration
+ *       alone that differs.
+ *       Writes a CSV header and a line for each run, then tables of the
+ *       mean completion tick and CPU per MB to stderr.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bt.h"
+#include "bt_selector_auto.h"
+#include "bt_selector_random.h"
+#include "bt_selector_rarestfirst.h"
+#include "bt_selector_sequential.h"
+#include "bt_selector_streaming.h"
+#include "mock_swarm.h"
+
+typedef struct
+{
+    const char* name;
+    bt_pieceselector_i i;
+} selector_t;
+
+static selector_t __selectors[] = {
+    { "auto", {
+        .new = bt_auto_selector_new,
+        .peer_giveback_piece = bt_auto_selector_giveback_piece,
+        .have_piece = bt_auto_selector_have_piece,
+        .remove_peer = bt_auto_selector_remove_peer,
+        .add_peer = bt_auto_selector_add_peer,
+        .peer_have_piece = bt_auto_selector_peer_have_piece,
+        .peer_have_bitfield = bt_auto_selector_peer_have_bitfield,
+        .peer_share_pieces = bt_auto_selector_peer_share_pieces,
+        .get_npeers = bt_auto_selector_get_npeers,
+        .get_npieces = bt_auto_selector_get_npieces,
+        .get_memory = bt_auto_selector_get_memory,
+        .get_availability = bt_auto_selector_get_availability_stats,
+        .poll_piece = bt_auto_selector_poll_best_piece } },
+    { "random", {
+        .new = bt_random_selector_new,
+        .peer_giveback_piece = bt_random_selector_giveback_piece,
+        .have_piece = bt_random_selector_have_piece,
+        .remove_peer = bt_random_selector_remove_peer,
+        .add_peer = bt_random_selector_add_peer,
+        .peer_have_piece = bt_random_selector_peer_have_piece,
+        .peer_have_bitfield = bt_random_selector_peer_have_bitfield,
+        .get_npeers = bt_random_selector_get_npeers,
+        .get_npieces = bt_random_selector_get_npieces,
+        .get_memory = bt_random_selector_get_memory,
+        .poll_piece = bt_random_selector_poll_best_piece } },
+    { "rarestfirst", {
+        .new = bt_rarestfirst_selector_new,
+        .peer_giveback_piece = bt_rarestfirst_selector_giveback_piece,
+        .have_piece = bt_rarestfirst_selector_have_piece,
+        .remove_peer = bt_rarestfirst_selector_remove_peer,
+        .add_peer = bt_rarestfirst_selector_add_peer,
+        .peer_have_piece = bt_rarestfirst_selector_peer_have_piece,
+        .peer_have_bitfield = bt_rarestfirst_selector_peer_have_bitfield,
+        .peer_share_pieces = bt_rarestfirst_selector_peer_share_pieces,
+        .get_npeers = bt_rarestfirst_selector_get_npeers,
+        .get_npieces = bt_rarestfirst_selector_get_npieces,
+        .get_memory = bt_rarestfirst_selector_get_memory,
+        .get_availability = bt_rarestfirst_selector_get_availability_stats,
+        .poll_piece = bt_rarestfirst_selector_poll_best_piece } },
+    { "sequential", {
+        .new = bt_sequential_selector_new,
+        .peer_giveback_piece = bt_sequential_selector_giveback_piece,
+        .have_piece = bt_sequential_selector_have_piece,
+        .remove_peer = bt_sequential_selector_remove_peer,
+        .add_peer = bt_sequential_selector_add_peer,
+        .peer_have_piece = bt_sequential_selector_peer_have_piece,
+        .get_npeers = bt_sequential_selector_get_npeers,
+        .get_npieces = bt_sequential_selector_get_npieces,
+        .get_memory = bt_sequential_selector_get_memory,
+        .poll_piece = bt_sequential_selector_poll_best_piece } },
+    { "streaming", {
+        .new = bt_streaming_selector_new,
+        .peer_giveback_piece = bt_streaming_selector_giveback_piece,
+        .have_piece = bt_streaming_selector_have_piece,
+        .remove_peer = bt_streaming_selector_remove_peer,
+        .add_peer = bt_streaming_selector_add_peer,
+        .peer_have_piece = bt_streaming_selector_peer_have_piece,
+        .peer_have_bitfield = bt_streaming_selector_peer_have_bitfield,
+        .peer_share_pieces = bt_streaming_selector_peer_share_pieces,
+        .get_npeers = bt_streaming_selector_get_npeers,
+        .get_npieces = bt_streaming_selector_get_npieces,
+        .get_memory = bt_streaming_selector_get_memory,
+        .get_availability = bt_streaming_selector_get_availability_stats,
+        .poll_piece = bt_streaming_selector_poll_best_piece } },
+};
+
+#define NSELECTORS (int)(sizeof(__selectors) / sizeof(__selectors[0]))
+
+/* the seeds' choking; the value is mock_swarm_params_t's super_seeding */
+static const char* __chokers[] = { "seeding", "super_seeding" };
+
+#define NCHOKERS (int)(sizeof(__chokers) / sizeof(__chokers[0]))
+
+static void __table(const char* title, mock_swarm_results_t* r, int cpu)
+{
+    int i, j;
+
+    fprintf(stderr, "\n%-12s", title);
+    for (j = 0; j < NCHOKERS; j++)
+        fprintf(stderr, " %14s", __chokers[j]);
+    fprintf(stderr, "\n");
+
+    for (i = 0; i < NSELECTORS; i++)
+    {
+        fprintf(stderr, "%-12s", __selectors[i].name);
+        for (j = 0; j < NCHOKERS; j++)
+        {
+            mock_swarm_results_t* x = &r[i * NCHOKERS + j];
+
+            if (-1 == x->ticks)
+                fprintf(stderr, " %14s", "incomplete");
+            else
+                fprintf(stderr, " %14.1f",
+                        cpu ? x->cpu_us_per_mb : x->mean_ticks);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    mock_swarm_params_t p = {
+        .nclients = 100,
+        .npieces = 32,
+        .piece_len = 1 << 15,
+        .seed_percent = 5,
+        .npeers = 20,
+        .latency = 2,
+        .bandwidth = 1 << 16,
+        .tick_ms = 10,
+        .seed = 1,
+        .max_ticks = 20000
+    };
+    mock_swarm_results_t r[NSELECTORS * NCHOKERS];
+    int i, j, failed = 0;
+
+    for (i = 1; i + 1 < argc; i += 2)
+    {
+        int v = atoi(argv[i + 1]);
+
+        if (0 == strcmp(argv[i], "-n"))
+            p.nclients = v;
+        else if (0 == strcmp(argv[i], "-m"))
+            p.npieces = v;
+        else if (0 == strcmp(argv[i], "-p"))
+            p.piece_len = v;
+        else if (0 == strcmp(argv[i], "-s"))
+            p.seed_percent = v;
+        else if (0 == strcmp(argv[i], "-c"))
+            p.npeers = v;
+        else if (0 == strcmp(argv[i], "-l"))
+            p.latency = v;
+        else if (0 == strcmp(argv[i], "-b"))
+            p.bandwidth = v;
+        else if (0 == strcmp(argv[i], "-k"))
+            p.tick_ms = v;
+        else if (0 == strcmp(argv[i], "-r"))
+            p.seed = v;
+        else if (0 == strcmp(argv[i], "-t"))
+            p.max_ticks = v;
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    printf("selector,choker,clients,pieces,piece_len,completed,ticks,"
+           "mean_ticks,sim_seconds,cpu_us_per_mb,duplicate_bytes,"
+           "seed_uploaded_bytes\n");
+    for (i = 0; i < NSELECTORS; i++)
+        for (j = 0; j < NCHOKERS; j++)
+        {
+            mock_swarm_results_t* x = &r[i * NCHOKERS + j];
+
+            p.selector = &__selectors[i].i;
+            p.super_seeding = j;
+            if (!mock_swarm_run(&p, x))
+                failed = 1;
+            printf("%s,%s,%d,%d,%d,%d,%d,%.1f,%.3f,%.1f,%llu,%llu\n",
+                   __selectors[i].name, __chokers[j], p.nclients,
+                   p.npieces, p.piece_len, x->ncompleted, x->ticks,
+                   x->mean_ticks, x->sim_seconds, x->cpu_us_per_mb,
+                   x->duplicate_bytes, x->seed_uploaded_bytes);
+            fflush(stdout);
+        }
+
+    __table("mean ticks", r, 0);
+    __table("cpu us/MB", r, 1);
+    return failed;
+}
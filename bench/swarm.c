@@ -0,0 +1,89 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Swarm load scenario on the mock network
+ * @desc Run with "python waf bench", or build/yabbt_swarm directly:
+ *
+ *          yabbt_swarm [-n clients] [-m pieces] [-p piece_len]
+ *                      [-s seed_percent] [-c peers_per_client]
+ *                      [-l latency_ticks] [-b bytes_per_tick]
+ *                      [-k ms_per_tick] [-r seed] [-t max_ticks]
+ *
+ *       Writes a CSV header and one line of results. ticks is -1 if a
+ *       client didn't complete within max_ticks.
+ *       The clients run on virtual time, so a seed always gives the same
+ *       ticks and duplicates; -k 0 puts them on the wall clock.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bt.h"
+#include "mock_swarm.h"
+
+int main(int argc, char **argv)
+{
+    mock_swarm_params_t p = {
+        .nclients = 500,
+        .npieces = 32,
+        .piece_len = 1 << 15,
+        .seed_percent = 5,
+        .npeers = 20,
+        .latency = 2,
+        .bandwidth = 1 << 16,
+        .tick_ms = 10,
+        .seed = 1,
+        .max_ticks = 10000
+    };
+    mock_swarm_results_t r;
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2)
+    {
+        int v = atoi(argv[i + 1]);
+
+        if (0 == strcmp(argv[i], "-n"))
+            p.nclients = v;
+        else if (0 == strcmp(argv[i], "-m"))
+            p.npieces = v;
+        else if (0 == strcmp(argv[i], "-p"))
+            p.piece_len = v;
+        else if (0 == strcmp(argv[i], "-s"))
+            p.seed_percent = v;
+        else if (0 == strcmp(argv[i], "-c"))
+            p.npeers = v;
+        else if (0 == strcmp(argv[i], "-l"))
+            p.latency = v;
+        else if (0 == strcmp(argv[i], "-b"))
+            p.bandwidth = v;
+        else if (0 == strcmp(argv[i], "-k"))
+            p.tick_ms = v;
+        else if (0 == strcmp(argv[i], "-r"))
+            p.seed = v;
+        else if (0 == strcmp(argv[i], "-t"))
+            p.max_ticks = v;
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    mock_swarm_run(&p, &r);
+    printf("clients,pieces,piece_len,seed_percent,peers,latency,bandwidth,"
+           "completed,ticks,mean_ticks,seconds,sim_seconds,cpu_us_per_mb,"
+           "duplicate_bytes,peak_rss_kb\n");
+    printf("%d,%d,%d,%d,%d,%u,%u,%d,%d,%.1f,%.3f,%.3f,%.1f,%llu,%ld\n",
+           p.nclients, p.npieces, p.piece_len, p.seed_percent, p.npeers,
+           p.latency, p.bandwidth, r.ncompleted, r.ticks, r.mean_ticks,
+           r.seconds, r.sim_seconds, r.cpu_us_per_mb, r.duplicate_bytes,
+           r.peak_rss_kb);
+    return r.ncompleted == p.nclients ? 0 : 1;
+}
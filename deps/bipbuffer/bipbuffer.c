@@ -122,6 +122,37 @@ unsigned char *bipbuf_poll(bipbuf_t* me, const unsigned int size)
     return end;
 }
 
+unsigned char *bipbuf_reserve(bipbuf_t* me, unsigned int *size)
+{
+    *size = bipbuf_get_unused_size(me);
+    if (0 == *size)
+        return NULL;
+
+    return (unsigned char*)me->data +
+        (1 == me->b_inuse ? me->b_end : me->a_end);
+}
+
+void bipbuf_commit(bipbuf_t* me, const unsigned int size)
+{
+    if (1 == me->b_inuse)
+        me->b_end += size;
+    else
+        me->a_end += size;
+}
+
+void bipbuf_compact(bipbuf_t* me)
+{
+    unsigned int used;
+
+    if (1 == me->b_inuse || 0 == me->a_start)
+        return;
+
+    used = me->a_end - me->a_start;
+    memmove(me->data, (unsigned char*)me->data + me->a_start, used);
+    me->a_start = 0;
+    me->a_end = used;
+}
+
 int bipbuf_get_size(const bipbuf_t* me)
 {
     return me->size;
@@ -46,6 +46,22 @@ unsigned char *bipbuf_peek(const bipbuf_t* me, const unsigned int len);
  */
 unsigned char *bipbuf_poll(bipbuf_t* me, const unsigned int size);
 
+/**
+ * Get pointer to unused space, to write into directly rather than through
+ * bipbuf_offer. What's written is added with bipbuf_commit
+ * @param size Set to the number of bytes that can be written
+ * @return NULL if there's no space */
+unsigned char *bipbuf_reserve(bipbuf_t* me, unsigned int *size);
+
+/**
+ * This many bytes were written into the space from bipbuf_reserve */
+void bipbuf_commit(bipbuf_t* me, const unsigned int size);
+
+/**
+ * Move region A to the start of the buffer, so that the unused space
+ * follows the data in one run. Does nothing while region B is in use */
+void bipbuf_compact(bipbuf_t* me);
+
 int bipbuf_get_size(const bipbuf_t* me);
 
 void bipbuf_free(bipbuf_t* me);
@@ -32,8 +32,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdint.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "bitfield.h"
 
+enum {
+    __AND,
+    __ANDNOT,
+    __OR
+};
+
 unsigned int __bytes_required_for_bits(unsigned int bits)
 {
     return (0u < (bits % 8u) ? 1u : 0u) + (bits / 8u);
@@ -49,7 +59,7 @@ void bitfield_init(bitfield_t * me, const unsigned int nbits)
 
 bitfield_t* bitfield_new(const unsigned int nbits)
 {
-    bitfield_t* me = malloc(sizeof(bitfield_t*));
+    bitfield_t* me = malloc(sizeof(bitfield_t));
     bitfield_init(me, nbits);
     return me;
 }
@@ -63,8 +73,8 @@ void bitfield_clone(bitfield_t * me, bitfield_t * clone)
 
 void bitfield_free(bitfield_t* me)
 {
-    free(me);
     free(me->bits);
+    free(me);
 }
 
 void bitfield_mark(bitfield_t * me, const unsigned int bit)
@@ -105,6 +115,157 @@ unsigned int bitfield_get_length(bitfield_t * me)
     return me->size;
 }
 
+static uint64_t __load64(const unsigned char* p)
+{
+    uint64_t w;
+
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static uint64_t __op(uint64_t a, uint64_t b, int op)
+{
+    switch (op)
+    {
+    case __AND: return a & b;
+    case __ANDNOT: return a & ~b;
+    default: return a | b;
+    }
+}
+
+#if defined(__SSE2__)
+static __m128i __op128(__m128i a, __m128i b, int op)
+{
+    switch (op)
+    {
+    case __AND: return _mm_and_si128(a, b);
+    case __ANDNOT: return _mm_andnot_si128(b, a);
+    default: return _mm_or_si128(a, b);
+    }
+}
+#endif
+
+/**
+ * Combine a bitfield with another, sixteen bytes at a time with SSE2, then
+ * a word at a time, then a byte */
+static void __combine(bitfield_t * me, const bitfield_t * other, int op)
+{
+    unsigned int nbits = me->size < other->size ? me->size : other->size,
+                 n = nbits / 8u, i = 0;
+    unsigned char* a = me->bits;
+    const unsigned char* b = other->bits;
+
+#if defined(__SSE2__)
+    for (; i + 16u <= n; i += 16u)
+        _mm_storeu_si128((__m128i*)(a + i),
+                         __op128(_mm_loadu_si128((const __m128i*)(a + i)),
+                                 _mm_loadu_si128((const __m128i*)(b + i)),
+                                 op));
+#endif
+
+    for (; i + 8u <= n; i += 8u)
+    {
+        uint64_t w = __op(__load64(a + i), __load64(b + i), op);
+
+        memcpy(a + i, &w, sizeof(w));
+    }
+
+    for (; i < n; i++)
+        a[i] = __op(a[i], b[i], op);
+
+    /* the leading bits of a byte only partly shared */
+    if (0u < nbits % 8u)
+    {
+        unsigned char mask = 0xffu << (8u - nbits % 8u);
+
+        a[n] = (a[n] & ~mask) | (__op(a[n], b[n], op) & mask);
+    }
+}
+
+void bitfield_and(bitfield_t * me, const bitfield_t * other)
+{
+    __combine(me, other, __AND);
+}
+
+void bitfield_andnot(bitfield_t * me, const bitfield_t * other)
+{
+    __combine(me, other, __ANDNOT);
+}
+
+void bitfield_or(bitfield_t * me, const bitfield_t * other)
+{
+    __combine(me, other, __OR);
+}
+
+unsigned int bitfield_count(const bitfield_t * me)
+{
+    unsigned int n = __bytes_required_for_bits(me->size), i = 0, count = 0;
+
+    for (; i + 8u <= n; i += 8u)
+        count += __builtin_popcountll(__load64(me->bits + i));
+    for (; i < n; i++)
+        count += __builtin_popcount(me->bits[i]);
+    return count;
+}
+
+/**
+ * @return the first bit of the byte that is on; b mustn't be 0 */
+static unsigned int __first_set(unsigned char b)
+{
+    return __builtin_clz(b) - (sizeof(unsigned int) - 1u) * 8u;
+}
+
+int bitfield_next_set(const bitfield_t * me, const unsigned int bit)
+{
+    unsigned int n = __bytes_required_for_bits(me->size), i, found;
+    unsigned char b;
+
+    if (me->size <= bit)
+        return -1;
+
+    i = bit / 8u;
+    b = me->bits[i] & (0xffu >> (bit % 8u));
+    while (0 == b)
+    {
+        /* skip a word of nothing at a time */
+        for (i++; i + 8u <= n && 0 == __load64(me->bits + i); i += 8u)
+            ;
+        if (n <= i)
+            return -1;
+        b = me->bits[i];
+    }
+
+    found = i * 8u + __first_set(b);
+    return found < me->size ? (int)found : -1;
+}
+
+void bitfield_forall_set(const bitfield_t * me, void* udata,
+                         void (*run)(void* udata, unsigned int bit))
+{
+    unsigned int n = __bytes_required_for_bits(me->size), i = 0;
+
+    while (i < n)
+    {
+        unsigned char b;
+
+        if (i + 8u <= n && 0 == __load64(me->bits + i))
+        {
+            i += 8u;
+            continue;
+        }
+
+        for (b = me->bits[i]; b;)
+        {
+            unsigned int j = __first_set(b);
+
+            b &= ~(0x80u >> j);
+            if (i * 8u + j < me->size)
+                run(udata, i * 8u + j);
+        }
+        i++;
+    }
+}
+
 char *bitfield_str(bitfield_t * me)
 {
     char *str = malloc(me->size + 1);
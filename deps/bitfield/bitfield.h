@@ -41,6 +41,38 @@ int bitfield_is_marked(bitfield_t * me, const unsigned int bit);
  * @return size of bitfield in bits */
 unsigned int bitfield_get_length(bitfield_t * bf);
 
+/**
+ * Set-level operations. Bits are in wire order, the first bit being the
+ * most significant of the first byte, and are worked on a word at a time.
+ * Only the bits both bitfields have are changed */
+
+/**
+ * Keep the bits that are on in other as well */
+void bitfield_and(bitfield_t * me, const bitfield_t * other);
+
+/**
+ * Turn off the bits that are on in other */
+void bitfield_andnot(bitfield_t * me, const bitfield_t * other);
+
+/**
+ * Turn on the bits that are on in other */
+void bitfield_or(bitfield_t * me, const bitfield_t * other);
+
+/**
+ * @return number of bits that are on */
+unsigned int bitfield_count(const bitfield_t * me);
+
+/**
+ * Set bits can be iterated with:
+ *  for (i = bitfield_next_set(bf, 0); 0 <= i; i = bitfield_next_set(bf, i + 1))
+ * @return the first bit from bit onwards that is on; -1 if there's none */
+int bitfield_next_set(const bitfield_t * me, const unsigned int bit);
+
+/**
+ * Run over the bits that are on, in order */
+void bitfield_forall_set(const bitfield_t * me, void* udata,
+                         void (*run)(void* udata, unsigned int bit));
+
 /**
  * Output bitfield to new string
  * @return string representation of the bitfield (string is null terminated) */
@@ -209,6 +209,16 @@ void bitstream_write_string(
     *b += len;
 }
 
+void bitstream_write_bytes(
+    char **b,
+    const void* data,
+    unsigned int len
+)
+{
+    memcpy(*b, data, len);
+    *b += len;
+}
+
 void bitstream_read_string(
     char **b,
     char* out_string,
@@ -49,6 +49,16 @@ void bitstream_write_string(
     const char* string,
     unsigned int len);
 
+/**
+ * Write out raw bytes to bitstream. Unlike bitstream_write_string the data
+ * may contain NULs. Increment b by len
+ * @param data Bytes to be written
+ * @param len Number of bytes */
+void bitstream_write_bytes(
+    char **b,
+    const void* data,
+    unsigned int len);
+
 /**
  * Read uint32 from bitstream.
  * Increment b by 4 
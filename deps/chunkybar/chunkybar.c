@@ -1,3 +1,10 @@
+/**
+ * Linked list backed chunkybar
+ * Not built when CHUNKYBAR_SKIPLIST is defined; see chunkybar_skiplist.c
+ */
+
+#ifndef CHUNKYBAR_SKIPLIST
+
 #include <assert.h>
 #include <setjmp.h>
 #include <stdlib.h>
@@ -215,7 +222,8 @@ void chunky_mark_incomplete(
                 me->first_chunk = this->next;
                 free(this);
                 this = me->first_chunk;
-                if (!this) break;
+                /* the new first chunk still needs checking */
+                continue;
             }
         }
         /*
@@ -378,3 +386,5 @@ void chunky_print_contents(const chunkybar_t * me)
         printf("%d to %d\n", b->offset, b->offset + b->len);
     }
 }
+
+#endif /* CHUNKYBAR_SKIPLIST */
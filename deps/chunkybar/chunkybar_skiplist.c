@@ -0,0 +1,398 @@
+/**
+ * Skiplist backed chunkybar
+ * Same API and semantics as the linked list chunkybar, but mark, have and
+ * get_incomplete are O(log n) in the number of chunks rather than O(n).
+ * Built instead of chunkybar.c when CHUNKYBAR_SKIPLIST is defined.
+ */
+
+#ifdef CHUNKYBAR_SKIPLIST
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chunkybar.h"
+
+#define MAX_LEVEL 16
+
+typedef struct var_chunk_s var_chunk_t;
+
+struct var_chunk_s
+{
+    unsigned int offset;
+    unsigned int len;
+    int level;
+    var_chunk_t *next[];
+};
+
+typedef struct
+{
+    /* sentinel. Only the next pointers are used */
+    var_chunk_t *head;
+    int level;
+    int nchunks;
+    uint32_t seed;
+} skiplist_t;
+
+static unsigned int __capmax(
+    unsigned int val,
+    unsigned int max
+)
+{
+    if (max < val)
+    {
+        return max;
+    }
+    else
+    {
+        return val;
+    }
+}
+
+static var_chunk_t* __chunk_new(int level, unsigned int offset,
+                                unsigned int len)
+{
+    var_chunk_t *b;
+
+    b = calloc(1, sizeof(var_chunk_t) + level * sizeof(var_chunk_t*));
+    b->offset = offset;
+    b->len = len;
+    b->level = level;
+    return b;
+}
+
+/**
+ * Each level holds a quarter of the chunks of the level below */
+static int __random_level(skiplist_t* sl)
+{
+    int level = 1;
+
+    for (;;)
+    {
+        /* xorshift; keeps us off the global rand() state */
+        sl->seed ^= sl->seed << 13;
+        sl->seed ^= sl->seed >> 17;
+        sl->seed ^= sl->seed << 5;
+        if (MAX_LEVEL == level || (sl->seed & 3))
+            return level;
+        level++;
+    }
+}
+
+/**
+ * Find the last chunk on each level whose offset is less than offset
+ * (or equal to it, if inclusive)
+ * @return the chunk on the bottom level; the head if there is none */
+static var_chunk_t* __find(skiplist_t* sl, unsigned int offset, int inclusive,
+                           var_chunk_t** update)
+{
+    var_chunk_t *b = sl->head;
+    int i;
+
+    for (i = sl->level - 1; 0 <= i; i--)
+    {
+        while (b->next[i] && (b->next[i]->offset < offset ||
+                              (inclusive && b->next[i]->offset == offset)))
+            b = b->next[i];
+        if (update)
+            update[i] = b;
+    }
+
+    return b;
+}
+
+static var_chunk_t* __insert(skiplist_t* sl, unsigned int offset,
+                             unsigned int len)
+{
+    var_chunk_t *update[MAX_LEVEL], *b;
+    int i, level;
+
+    __find(sl, offset, 0, update);
+
+    level = __random_level(sl);
+    for (i = sl->level; i < level; i++)
+        update[i] = sl->head;
+    if (sl->level < level)
+        sl->level = level;
+
+    b = __chunk_new(level, offset, len);
+    for (i = 0; i < level; i++)
+    {
+        b->next[i] = update[i]->next[i];
+        update[i]->next[i] = b;
+    }
+    sl->nchunks++;
+    return b;
+}
+
+static void __remove(skiplist_t* sl, var_chunk_t* b)
+{
+    var_chunk_t *update[MAX_LEVEL];
+    int i;
+
+    __find(sl, b->offset, 0, update);
+    for (i = 0; i < b->level; i++)
+        update[i]->next[i] = b->next[i];
+    while (1 < sl->level && !sl->head->next[sl->level - 1])
+        sl->level--;
+    sl->nchunks--;
+    free(b);
+}
+
+void *chunky_new(const unsigned int max)
+{
+    chunkybar_t *me;
+    skiplist_t *sl;
+
+    me = calloc(1, sizeof(chunkybar_t));
+    me->max = max;
+    sl = calloc(1, sizeof(skiplist_t));
+    sl->head = __chunk_new(MAX_LEVEL, 0, 0);
+    sl->level = 1;
+    sl->seed = 2463534242u;
+    me->first_chunk = sl;
+
+    assert(me);
+    return me;
+}
+
+void chunky_free(
+    void *ra
+)
+{
+    chunkybar_t *me = ra;
+    skiplist_t *sl = me->first_chunk;
+    var_chunk_t *b, *prev;
+
+    for (b = sl->head; b; )
+    {
+        prev = b;
+        b = b->next[0];
+        free(prev);
+    }
+
+    free(sl);
+    free(me);
+}
+
+void chunky_set_max(chunkybar_t* me, const unsigned int max)
+{
+    me->max = max;
+}
+
+void chunky_mark_all_incomplete(chunkybar_t * me)
+{
+    chunky_mark_incomplete(me,0,me->max);
+}
+
+int chunky_get_num_chunks(const chunkybar_t * me)
+{
+    return ((skiplist_t*)me->first_chunk)->nchunks;
+}
+
+void chunky_mark_complete(
+    chunkybar_t * me,
+    const unsigned int offset,
+    const unsigned int len
+)
+{
+    skiplist_t *sl = me->first_chunk;
+    var_chunk_t *prev, *this;
+
+    prev = __find(sl, offset, 1, NULL);
+
+    /* The left chunk eats/touches this new one...
+     * |00000LLN00000|;
+     * |00000LLNL0000|
+     * Combine the old with new */
+    if (prev != sl->head && offset <= prev->offset + prev->len)
+    {
+        if (prev->offset + prev->len < offset + len)
+            prev->len = (offset + len) - prev->offset;
+    }
+    else
+    {
+        prev = __insert(sl, offset, len);
+    }
+
+    /* prev will feast! */
+    while ((this = prev->next[0]) &&
+           this->offset <= prev->offset + prev->len)
+    {
+        /* not eaten */
+        if (!(this->offset + this->len <= prev->offset + prev->len))
+            prev->len = (this->offset + this->len) - prev->offset;
+        __remove(sl, this);
+    }
+}
+
+void chunky_mark_incomplete(
+    chunkybar_t * me,
+    const unsigned int offset,
+    const unsigned int len
+)
+{
+    skiplist_t *sl = me->first_chunk;
+    var_chunk_t *this, *next;
+
+    /* only the chunk before offset can overlap the start of the range */
+    this = __find(sl, offset, 0, NULL);
+    if (this == sl->head)
+        this = this->next[0];
+
+    for (; this && this->offset <= offset + len; this = next)
+    {
+        next = this->next[0];
+
+        /*  whole chunk gets eaten */
+        if (offset <= this->offset &&
+                this->offset + this->len <= offset + len)
+        {
+            __remove(sl, this);
+        }
+        /*
+         * In the middle
+         * |00000LXL00000|
+         */
+        else if (this->offset < offset &&
+                offset + len < this->offset + this->len)
+        {
+            unsigned int end = this->offset + this->len;
+
+            this->len = offset - this->offset;
+            __insert(sl, offset + len, end - (offset + len));
+            break;
+        }
+        /*
+         * swallow left
+         * |00000XLL00000|
+         */
+        else if (this->offset < offset + len &&
+                offset + len < this->offset + this->len)
+        {
+            /* the offset moves forward, but stays below the next chunk's
+             * offset, so the chunk keeps its place in the list */
+            this->len -= offset+len - this->offset;
+            this->offset = offset+len;
+        }
+        /*
+         * swallow right
+         * |00000LLX00000|
+         */
+        else if (this->offset < offset &&
+                offset < this->offset + this->len &&
+                this->offset + this->len <= offset + len)
+        {
+            this->len = offset - this->offset;
+        }
+    }
+}
+
+int chunky_is_complete(const chunkybar_t * me)
+{
+    const var_chunk_t *b;
+
+    b = ((skiplist_t*)me->first_chunk)->head->next[0];
+    return b && !b->next[0] && b->len == me->max;
+}
+
+void chunky_get_incomplete(
+    const chunkybar_t * me,
+    unsigned int *offset,
+    unsigned int *len,
+    const unsigned int max
+)
+{
+    const var_chunk_t *b;
+
+    *offset = *len = 0;
+    b = ((skiplist_t*)me->first_chunk)->head->next[0];
+
+    if (!b)
+    {
+        *offset = 0;
+        *len = max;
+    }
+    else
+    {
+        if (b->offset != 0)
+        {
+            *offset = 0;
+
+            if (b->next[0])
+            {
+                *len = b->next[0]->offset - b->offset;
+            }
+            else
+            {
+                *len = b->offset;
+            }
+        }
+        else if (!b->next[0])
+        {
+            *offset = b->len;
+            *len = max;
+        }
+        else
+        {
+            *offset = 0 + b->len;
+            *len = b->next[0]->offset - b->len;
+        }
+    }
+
+    *len = __capmax(*len, max);
+
+    /*  make sure we aren't going over the boundary */
+    if (me->max < *offset + *len)
+    {
+        *len = me->max - *offset;
+    }
+}
+
+unsigned int chunky_get_nbytes_completed(
+    const chunkybar_t * me
+)
+{
+    const var_chunk_t *b;
+    unsigned int nbytes;
+
+    for (b = ((skiplist_t*)me->first_chunk)->head->next[0], nbytes = 0;
+         b; b = b->next[0])
+    {
+        nbytes += b->len;
+    }
+
+    return nbytes;
+}
+
+int chunky_have(
+    const chunkybar_t * me,
+    const unsigned int offset,
+    const unsigned int len
+)
+{
+    skiplist_t *sl = me->first_chunk;
+    const var_chunk_t *b;
+
+    /* chunks don't overlap, so only the last chunk starting at or before
+     * offset can contain the range */
+    b = __find(sl, offset, 1, NULL);
+    if (b == sl->head)
+        return 0;
+    return offset + len <= b->offset + b->len;
+}
+
+void chunky_print_contents(const chunkybar_t * me)
+{
+    const var_chunk_t *b;
+
+    for (b = ((skiplist_t*)me->first_chunk)->head->next[0]; b;
+         b = b->next[0])
+    {
+        printf("%d to %d\n", b->offset, b->offset + b->len);
+    }
+}
+
+#endif /* CHUNKYBAR_SKIPLIST */
@@ -147,6 +147,7 @@ int config_set_with_desc(config_t* cfg, const char *key, const char *val, const
 	item->key = keybuf;
 	item->val = valbuf;
 	item->desc = descbuf;
+	cfg->version++;
 
 	return 0;
 }
@@ -212,6 +213,21 @@ int config_get_int(config_t* cfg, const char *key)
     return 0;
 }
 
+/* for sizes in bytes, which can be past what an int holds */
+unsigned long long config_get_ull(config_t* cfg, const char *key)
+{
+    char* val;
+
+    if (!cfg) return 0;
+
+    if ((val = config_get(cfg,key)))
+    {
+        return strtoull(val, NULL, 10);
+    }
+
+    return 0;
+}
+
 static int config_set_with_level(config_t* cfg, const char *level, const char *key, const char *val)
 {
 	char *tmp;
@@ -36,6 +36,9 @@
 typedef struct {
     void *config;
     char errmsg[BUFSIZ];
+
+    /* bumped on every config_set, so callers can cache parsed values */
+    unsigned int version;
 } config_t;
 
 
@@ -51,6 +54,7 @@ int   config_set_with_desc(config_t* cfg, const char *key, const char *val, cons
 void  config_lock(config_t* cfg, const char *key);
 char *config_get(config_t* cfg, const char *key);
 int   config_get_int(config_t* cfg, const char *key);
+unsigned long long config_get_ull(config_t* cfg, const char *key);
 void  config_print(config_t* cfg);
 void  config_free(config_t* cfg);
 int   config_get_default_path(config_t* cfg, char *buf, size_t n, const char *dir, const char *file);
@@ -52,6 +52,10 @@ typedef struct
 {
     time_t time;
     heap_t *heap;
+
+    /* NULL for time(NULL) */
+    unsigned long (*get_time) (void *);
+    void *clock_udata;
 } eventtimer_t;
 
 typedef struct
@@ -100,6 +104,18 @@ void eventtimer_push_event(
     heap_offer(tk->heap, ev);
 }
 
+void eventtimer_set_clock(
+    void *ti,
+    unsigned long (*get_time) (void *),
+    void *udata
+)
+{
+    eventtimer_t *tk = ti;
+
+    tk->get_time = get_time;
+    tk->clock_udata = udata;
+}
+
 void eventtimer_step(
     void *ti
 )
@@ -107,7 +123,7 @@ void eventtimer_step(
     eventtimer_t *tk = ti;
     event_t *ev;
 
-    tk->time = time(NULL);
+    tk->time = tk->get_time ? tk->get_time(tk->clock_udata) : time(NULL);
 
     /* poll all due events */
     for (
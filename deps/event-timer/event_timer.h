@@ -13,6 +13,14 @@ void eventtimer_push_event(
     void *udata,
     void (*func) (void *));
 
+/**
+ * Read the time from this clock instead of time(NULL)
+ * @param get_time seconds since an arbitrary start; NULL for time(NULL) */
+void eventtimer_set_clock(
+    void *ti,
+    unsigned long (*get_time) (void *),
+    void *udata);
+
 /**
  * Poll any events that need to be triggered */
 void eventtimer_step(void *ti);
@@ -76,6 +76,12 @@ hashmap_t *hashmap_new(
     return h;
 }
 
+unsigned long hashmap_get_memory(const hashmap_t * h)
+{
+    /* chained nodes are allocated one per entry that collided */
+    return sizeof(hashmap_t) + (h->arraySize + h->count) * sizeof(node_t);
+}
+
 int hashmap_count(const hashmap_t * h)
 {
     return h->count;
@@ -36,6 +36,10 @@ hashmap_t *hashmap_new(
  * @return number of items within hash */
 int hashmap_count(const hashmap_t * hmap);
 
+/**
+ * @return bytes used by the hash, not counting what the entries point at */
+unsigned long hashmap_get_memory(const hashmap_t * hmap);
+
 /**
  * @return size of the array used within hash */
 int hashmap_size(
@@ -47,6 +47,18 @@ void *meanqueue_new(
     return qu;
 }
 
+void meanqueue_init(
+    meanqueue_t * qu,
+    int *vals,
+    const int size
+)
+{
+    memset(qu, 0, sizeof(meanqueue_t));
+    memset(vals, 0, size * sizeof(int));
+    qu->vals = vals;
+    qu->size = size;
+}
+
 void meanqueue_free(
     meanqueue_t * qu
 )
@@ -70,7 +82,7 @@ void meanqueue_offer(
 }
 
 float meanqueue_get_value(
-    meanqueue_t * qu
+    const meanqueue_t * qu
 )
 {
     return qu->mean;
@@ -16,6 +16,14 @@ void *meanqueue_new(
     const int size
 );
 
+/**
+ * Initialise a queue the caller holds, with vals as its storage */
+void meanqueue_init(
+    meanqueue_t * qu,
+    int *vals,
+    const int size
+);
+
 void meanqueue_free(
     meanqueue_t * qu
 );
@@ -31,7 +39,7 @@ void meanqueue_offer(
 /**
  * @return mean of ints within queue */
 float meanqueue_get_value(
-    meanqueue_t * qu
+    const meanqueue_t * qu
 );
 
 #endif /* MEANQUEUE_H */
@@ -21,40 +21,45 @@
 #include "pwp_connection.h"
 #include "pwp_local.h"
 #include "bitstream.h"
-#include "chunkybar.h"
+
+/* the length prefix and message id */
+#define PWP_BITFIELD_HEADER 5
+
+void pwp_bitfield_msg_init(pwp_bitfield_msg_t* bf, int npieces)
+{
+    char *ptr;
+
+    bf->npieces = npieces;
+    bf->msg = calloc(1, PWP_BITFIELD_HEADER + (npieces + 7) / 8);
+    ptr = bf->msg;
+    bitstream_write_uint32(&ptr, fe(1 + (npieces + 7) / 8));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_BITFIELD);
+}
+
+void pwp_bitfield_msg_release(pwp_bitfield_msg_t* bf)
+{
+    free(bf->msg);
+    bf->msg = NULL;
+    bf->npieces = 0;
+}
+
+void pwp_bitfield_msg_mark(pwp_bitfield_msg_t* bf, int piece_idx)
+{
+    assert(0 <= piece_idx && piece_idx < bf->npieces);
+    bf->msg[PWP_BITFIELD_HEADER + piece_idx / 8] |= 0x80 >> (piece_idx % 8);
+}
+
+int pwp_bitfield_msg_len(const pwp_bitfield_msg_t* bf)
+{
+    return PWP_BITFIELD_HEADER + (bf->npieces + 7) / 8;
+}
 
 int pwp_send_bitfield(
-        int npieces,
-        void* pieces_completed,
+        const pwp_bitfield_msg_t* bf,
         func_send_f send_cb,
         void* cb_ctx,
         void* peer_udata
         )
 {
-    // TODO: replace 1000
-    char data[1000], *ptr;
-    uint32_t size;
-
-    ptr = data;
-    size = sizeof(uint32_t) + sizeof(char) + (npieces / 8) +
-        ((npieces % 8 == 0) ? 0 : 1);
-    bitstream_write_uint32(&ptr, fe(size - sizeof(uint32_t)));
-    bitstream_write_byte(&ptr, PWP_MSGTYPE_BITFIELD);
-
-    /*  for all pieces set bit = 1 if we have the completed piece */
-    int i;
-    unsigned char bits;
-    for (bits = 0, i = 0; i < npieces; i++)
-    {
-        bits |= chunky_have(pieces_completed, i, 1) << (7 - (i % 8));
-        /* ...up to eight bits, write to byte */
-        if (((i + 1) % 8 == 0) || npieces - 1 == i)
-        {
-            bitstream_write_byte(&ptr, (char)bits);
-            bits = 0;
-        }
-    }
-
-    return send_cb(cb_ctx, peer_udata, data, size);
+    return send_cb(cb_ctx, peer_udata, bf->msg, pwp_bitfield_msg_len(bf));
 }
-
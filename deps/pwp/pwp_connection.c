@@ -14,6 +14,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
+#include <ctype.h>
 
 /* for uint32_t */
 #include <stdint.h>
@@ -24,8 +26,6 @@
 #include "bitfield.h"
 #include "pwp_connection.h"
 #include "pwp_local.h"
-#include "linked_list_hashmap.h"
-#include "linked_list_queue.h"
 #include "chunkybar.h"
 #include "bitstream.h"
 
@@ -46,12 +46,36 @@
     PWP_MSGTYPE_BITFIELD == (m) ? "BITFIELD" :\
     PWP_MSGTYPE_REQUEST == (m) ? "REQUEST" :\
     PWP_MSGTYPE_PIECE == (m) ? "PIECE" :\
-    PWP_MSGTYPE_CANCEL == (m) ? "CANCEL" : "none"\
+    PWP_MSGTYPE_CANCEL == (m) ? "CANCEL" :\
+    PWP_MSGTYPE_HAVE_ALL == (m) ? "HAVE_ALL" :\
+    PWP_MSGTYPE_HAVE_NONE == (m) ? "HAVE_NONE" :\
+    PWP_MSGTYPE_EXTENDED == (m) ? "EXTENDED" : "none"\
 
-static unsigned long __req_hash(const void *obj)
+/**
+ * Carve memory out of the connection's arena, so that a connection that
+ * stays small costs one allocation. Once the arena is used up we fall back
+ * to malloc */
+static void* __arena_alloc(pwp_conn_private_t* me, size_t bytes)
 {
-    const bt_block_t *req = obj;
-    return req->piece_idx + req->len + req->offset;
+    void* p;
+
+    bytes = (bytes + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    if (sizeof(me->arena) - me->arena_used < bytes)
+        return malloc(bytes);
+    p = (char*)me->arena + me->arena_used;
+    me->arena_used += bytes;
+    return p;
+}
+
+/**
+ * Free memory from __arena_alloc. Arena memory stays used until the
+ * connection is released */
+static void __arena_free(pwp_conn_private_t* me, void* p)
+{
+    char* a = (char*)me->arena;
+
+    if ((char*)p < a || a + sizeof(me->arena) <= (char*)p)
+        free(p);
 }
 
 static long __req_cmp(const void *obj, const void *other)
@@ -64,6 +88,161 @@ static long __req_cmp(const void *obj, const void *other)
     return 1;
 }
 
+/**
+ * Mix the piece index and offset so that the blocks of one piece spread
+ * out over the table */
+static unsigned int __reqs_hash(const bt_block_t *b)
+{
+    uint64_t k = ((uint64_t)b->piece_idx << 32) | b->offset;
+
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (unsigned int)k;
+}
+
+/**
+ * Find the slot holding this block, or the empty slot where it would go.
+ * Empty slots have zero length */
+static request_t* __reqs_slot(const request_table_t* t, const bt_block_t *b)
+{
+    unsigned int mask = t->size - 1, i;
+
+    for (i = __reqs_hash(b) & mask; 0 != t->slots[i].blk.len;
+         i = (i + 1) & mask)
+        if (0 == __req_cmp(&t->slots[i].blk, b))
+            break;
+    return &t->slots[i];
+}
+
+static request_t* __reqs_get(const request_table_t* t, const bt_block_t *b)
+{
+    request_t *r;
+
+    if (0 == t->count)
+        return NULL;
+    r = __reqs_slot(t, b);
+    return 0 == r->blk.len ? NULL : r;
+}
+
+/**
+ * Double the table once it is half full to keep probes short */
+static void __reqs_grow(pwp_conn_private_t* me, request_table_t* t)
+{
+    request_t *old = t->slots;
+    unsigned int i, size = t->size;
+
+    t->size = 0 == size ? PWP_CONN_REQS_SIZE : size * 2;
+    t->slots = __arena_alloc(me, t->size * sizeof(request_t));
+    memset(t->slots, 0, t->size * sizeof(request_t));
+    t->count = 0;
+    for (i = 0; i < size; i++)
+        if (0 != old[i].blk.len)
+        {
+            *__reqs_slot(t, &old[i].blk) = old[i];
+            t->count++;
+        }
+    __arena_free(me, old);
+}
+
+static request_t* __reqs_put(pwp_conn_private_t* me, request_table_t* t,
+                             int tick, const bt_block_t *b, int split)
+{
+    request_t *r;
+
+    assert(0 < b->len);
+    if (t->size <= (t->count + 1) * 2)
+        __reqs_grow(me, t);
+    r = __reqs_slot(t, b);
+    if (0 == r->blk.len)
+        t->count++;
+    else
+        t->nsplit -= r->split;
+    r->tick = tick;
+    r->blk = *b;
+    r->split = split;
+    t->nsplit += split;
+    return r;
+}
+
+/**
+ * Remove the request, shifting back the entries that probed past it so
+ * that we don't need tombstones
+ * @return 1 if the block was pending; 0 otherwise */
+static int __reqs_remove(request_table_t* t, const bt_block_t *b)
+{
+    unsigned int mask = t->size - 1, i, j;
+    request_t *r;
+
+    if (!(r = __reqs_get(t, b)))
+        return 0;
+
+    t->nsplit -= r->split;
+    i = r - t->slots;
+    for (j = (i + 1) & mask; 0 != t->slots[j].blk.len; j = (j + 1) & mask)
+    {
+        unsigned int home = __reqs_hash(&t->slots[j].blk) & mask;
+
+        /* move it back if its home isn't between the hole and it */
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].blk.len = 0;
+    t->count--;
+    return 1;
+}
+
+/**
+ * Copy pending requests out so the table can be changed while walking them
+ * @return number of requests copied */
+static unsigned int __reqs_copy(const request_table_t* t, request_t* out)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < t->size; i++)
+        if (0 != t->slots[i].blk.len)
+            out[n++] = t->slots[i];
+    return n;
+}
+
+static request_t* __reqs_fifo_push(pwp_conn_private_t* me, request_fifo_t* f,
+                                   int tick, const bt_block_t *b)
+{
+    request_t *r;
+
+    if (f->count == f->size)
+    {
+        unsigned int i, size = 0 == f->size ? PWP_CONN_REQS_SIZE : f->size * 2;
+        request_t *items = __arena_alloc(me, size * sizeof(request_t));
+
+        for (i = 0; i < f->count; i++)
+            items[i] = f->items[(f->head + i) % f->size];
+        __arena_free(me, f->items);
+        f->items = items;
+        f->size = size;
+        f->head = 0;
+    }
+
+    r = &f->items[(f->head + f->count++) % f->size];
+    r->tick = tick;
+    r->blk = *b;
+    return r;
+}
+
+static request_t* __reqs_fifo_peek(const request_fifo_t* f)
+{
+    return 0 == f->count ? NULL : &f->items[f->head];
+}
+
+static void __reqs_fifo_poll(request_fifo_t* f)
+{
+    f->head = (f->head + 1) % f->size;
+    f->count--;
+}
+
 static void __log(pwp_conn_private_t * me, const char *format, ...)
 {
     char buffer[1000];
@@ -81,6 +260,23 @@ static void __log(pwp_conn_private_t * me, const char *format, ...)
     me->cb.log(me->cb_ctx, me->peer_udata, buffer);
 }
 
+/**
+ * Hand the message to the trace callback. It's much cheaper than
+ * formatting a log line, so traced messages aren't logged
+ * @param sent 1 if we're sending it; 0 if we've read it
+ * @return 1 if traced */
+static int __trace(pwp_conn_private_t * me, int sent, int msg_type,
+                   unsigned int piece_idx, unsigned int offset,
+                   unsigned int len)
+{
+    if (NULL == me->cb.trace)
+        return 0;
+
+    me->cb.trace(me->cb_ctx, me->peer_udata, sent, msg_type, piece_idx,
+                 offset, len);
+    return 1;
+}
+
 static void __disconnect(pwp_conn_private_t * me, const char *reason, ...)
 {
     char buffer[128];
@@ -96,6 +292,12 @@ static void __disconnect(pwp_conn_private_t * me, const char *reason, ...)
        (void)me->cb.disconnect(me->cb_ctx, me->peer_udata, buffer);
 }
 
+static void __mark_sent(pwp_conn_private_t * me)
+{
+    if (me->cb.get_time_ms)
+        me->sent_ms = me->cb.get_time_ms(me->cb_ctx);
+}
+
 static int __send_to_peer(pwp_conn_private_t * me, void *data, const int len)
 {
     int ret;
@@ -108,6 +310,64 @@ static int __send_to_peer(pwp_conn_private_t * me, void *data, const int len)
         __disconnect(me, "peer dropped connection");
         return 0;
     }
+    __mark_sent(me);
+    return 1;
+}
+
+/**
+ * Send a control message, holding it if we're corked */
+static int __send_msg(pwp_conn_private_t * me, void *data, const int len)
+{
+    if (!me->corked)
+        return __send_to_peer(me, data, len);
+
+    if (sizeof(me->out) - me->out_len < (unsigned int)len &&
+        0 == pwp_conn_flush((pwp_conn_t*)me))
+        return 0;
+
+    memcpy(me->out + me->out_len, data, len);
+    me->out_len += len;
+    return 1;
+}
+
+int pwp_conn_flush(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    unsigned int len = me->out_len;
+
+    if (0 == len)
+        return 1;
+
+    me->out_len = 0;
+    return __send_to_peer(me, me->out, len);
+}
+
+void pwp_conn_cork(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    me->corked++;
+}
+
+int pwp_conn_uncork(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    assert(0 < me->corked);
+    if (0 < --me->corked)
+        return 1;
+    return pwp_conn_flush(me_);
+}
+
+static int __sendv_to_peer(pwp_conn_private_t * me, const bt_iovec_t *iov,
+                           const int iovcnt)
+{
+    if (0 == me->cb.sendv(me->cb_ctx, me->peer_udata, iov, iovcnt))
+    {
+        __disconnect(me, "peer dropped connection");
+        return 0;
+    }
+    __mark_sent(me);
     return 1;
 }
 
@@ -123,10 +383,13 @@ void pwp_conn_set_peer(pwp_conn_t* me_, void * peer)
     me->peer_udata = peer;
 }
 
+static void __seed_wehave(pwp_conn_private_t* me);
+
 void pwp_conn_set_progress(pwp_conn_t* me_, void* counter)
 {
     pwp_conn_private_t *me = (void*)me_;
     me->pieces_completed = counter;
+    __seed_wehave(me);
 }
 
 void *pwp_conn_new(void* mem)
@@ -136,103 +399,209 @@ void *pwp_conn_new(void* mem)
     if (mem)
     {
         me = mem;
+        me->owns_mem = 0;
     }
     else if (!(me = calloc(1, sizeof(pwp_conn_private_t))))
     {
         perror("out of memory");
         exit(0);
     }
-
-    me->bytes_drate = meanqueue_new(10);
-    me->bytes_urate = meanqueue_new(10);
-    me->recv_reqs = hashmap_new(__req_hash, __req_cmp, 100);
-    me->peer_reqs = llqueue_new();
-    me->reqs = llqueue_new();
+    else
+        me->owns_mem = 1;
+
+    me->arena_used = 0;
+    meanqueue_init(&me->bytes_drate, me->bytes_drate_vals,
+                   PWP_CONN_RATE_SAMPLES);
+    meanqueue_init(&me->bytes_urate, me->bytes_urate_vals,
+                   PWP_CONN_RATE_SAMPLES);
+    me->recv_reqs.slots = NULL;
+    me->recv_reqs.size = 0;
+    me->recv_reqs.count = 0;
+    me->recv_reqs.nsplit = 0;
+    me->recv_reqs_order.items = NULL;
+    me->recv_reqs_order.size = 0;
+    me->recv_reqs_order.head = 0;
+    me->recv_reqs_order.count = 0;
+    memset(&me->peer_reqs, 0, sizeof(request_table_t));
+    memset(&me->peer_reqs_order, 0, sizeof(request_fifo_t));
+    me->peer_reqs_seq = 0;
+    memset(&me->reqs, 0, sizeof(request_fifo_t));
     me->req_lock = NULL;
     me->state.flags = PC_IM_CHOKING | PC_PEER_CHOKING;
-    me->pieces_peerhas = chunky_new(0);
+    me->pieces_peerhas = NULL;
+    me->pieces_peerhas_nwords = 0;
+    me->pieces_peerhas_count = 0;
+    me->pieces_wehave = NULL;
+    me->npieces_wanted = 0;
+    me->corked = 0;
+    me->out_len = 0;
+    me->max_pending_requests = 10;
+    me->rtt_ms = 0;
+    me->rtt_min_ms = UINT_MAX;
+    me->srtt_ms = 0;
+    me->rttvar_ms = 0;
+    me->last_block_ms = -1;
+    me->snubbed = 0;
+    me->sent_ms = 0;
+    me->nallowed_fast = 0;
+    me->nsuggested = 0;
+    me->peer_ut_pex = 0;
+    me->peer_listen_port = 0;
+    memset(&me->drate, 0, sizeof(rate_meter_t));
+    memset(&me->urate, 0, sizeof(rate_meter_t));
+    me->rate_window_ms = PWP_CONN_RATE_WINDOW_MS;
     return me;
 }
 
 static void __expunge_their_pending_reqs(pwp_conn_private_t* me)
 {
-    while (0 < llqueue_count(me->peer_reqs))
-    {
-        free(llqueue_poll(me->peer_reqs));
-    }
+    /* keep the memory for when the peer is unchoked */
+    if (me->peer_reqs.slots)
+        memset(me->peer_reqs.slots, 0, me->peer_reqs.size * sizeof(request_t));
+    me->peer_reqs.count = 0;
+    me->peer_reqs_order.head = 0;
+    me->peer_reqs_order.count = 0;
 }
 
 static void __expunge_my_pending_reqs(pwp_conn_private_t* me)
 {
     request_t *r;
-    hashmap_iterator_t iter;
-
-    void* rem;
-    rem = llqueue_new();
-
-    for (hashmap_iterator(me->recv_reqs, &iter);
-         (r = hashmap_iterator_next_value(me->recv_reqs, &iter));)
-    {
-        llqueue_offer(rem, r);
-#if 0
-        r = hashmap_remove(me->recv_reqs, &r->blk);
-        if (me->cb.peer_giveback_block)
-            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-        free(r);
-#endif
-    }
 
-#if 1
-   while (llqueue_count(rem) > 0)
+    /* we're done with the table; no need to remove one at a time */
+    for (r = me->recv_reqs.slots;
+         r < me->recv_reqs.slots + me->recv_reqs.size; r++)
     {
-        r = llqueue_poll(rem);
-        r = hashmap_remove(me->recv_reqs, &r->blk);
+        bt_block_t b = r->blk;
 
-        assert(r);
+        if (0 == b.len)
+            continue;
 
+        r->blk.len = 0;
         if (me->cb.peer_giveback_block)
-            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-        free(r);
+            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &b);
     }
-
-    llqueue_free(rem);
-#endif
+    me->recv_reqs.count = 0;
+    me->recv_reqs.nsplit = 0;
+    me->recv_reqs_order.count = 0;
 }
 
-static void __expunge_my_old_pending_reqs(pwp_conn_private_t* me)
+/**
+ * Time out what is left of this request
+ * The request may have been split by partially received pieces, so the
+ * remaining parts made in the same tick are found by range */
+static int __expunge_request(pwp_conn_private_t* me, const request_t* old)
 {
+    request_table_t *t = &me->recv_reqs;
     request_t *r;
-    hashmap_iterator_t iter;
-    void* rem;
+    unsigned int i;
+    int n = 0;
+
+    if ((r = __reqs_get(t, &old->blk)))
+    {
+        bt_block_t b = r->blk;
 
-    rem = llqueue_new();
+        /* requested again since; that request has its own entry */
+        if (r->tick != old->tick)
+            return 0;
 
-    for (hashmap_iterator(me->recv_reqs, &iter);
-         (r = hashmap_iterator_next_value(me->recv_reqs, &iter));)
+        __reqs_remove(t, &b);
+        me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &b);
+        return 1;
+    }
+
+    /* it was received */
+    if (0 == t->nsplit)
+        return 0;
+
+    /* removal shifts later entries back into this slot, so only move on
+     * when we keep the request */
+    for (i = 0; i < t->size;)
     {
-        if (r && 10 < me->state.tick - r->tick)
+        bt_block_t b = t->slots[i].blk;
+
+        if (0 == b.len ||
+            !t->slots[i].split ||
+            t->slots[i].tick != old->tick ||
+            b.piece_idx != old->blk.piece_idx ||
+            b.offset < old->blk.offset ||
+            old->blk.offset + old->blk.len < b.offset + b.len)
         {
-#if 0
-            hashmap_remove(me->recv_reqs, &r->blk);
-            me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-            free(r);
-#endif
-            llqueue_offer(rem, r);
+            i++;
+            continue;
         }
+
+        __reqs_remove(t, &b);
+        me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &b);
+        n++;
     }
 
-#if 1
-    while (llqueue_count(rem) > 0)
+    return n;
+}
+
+int pwp_conn_get_request_timeout(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    unsigned int t;
+
+    if (0 == me->srtt_ms)
+        return PWP_CONN_REQ_TIMEOUT_MS;
+
+    t = me->srtt_ms + 4 * me->rttvar_ms;
+    if (t < PWP_CONN_REQ_TIMEOUT_MIN_MS)
+        return PWP_CONN_REQ_TIMEOUT_MIN_MS;
+    if (PWP_CONN_REQ_TIMEOUT_MAX_MS < t)
+        return PWP_CONN_REQ_TIMEOUT_MAX_MS;
+    return t;
+}
+
+/**
+ * @return 1 if this request has been waiting too long; otherwise 0 */
+static int __request_is_old(pwp_conn_private_t* me, const request_t* r)
+{
+    /* without a clock we can only count ticks */
+    if (!me->cb.get_time_ms)
+        return 10 < me->state.tick - r->tick;
+
+    return (unsigned int)pwp_conn_get_request_timeout((pwp_conn_t*)me) <
+        me->cb.get_time_ms(me->cb_ctx) - r->ms;
+}
+
+static void __expunge_my_old_pending_reqs(pwp_conn_private_t* me)
+{
+    request_t *r;
+
+    /* requests are queued by age, so we only need to look at the head */
+    while ((r = __reqs_fifo_peek(&me->recv_reqs_order)) &&
+           __request_is_old(me, r))
     {
-        r = llqueue_poll(rem);
-        r = hashmap_remove(me->recv_reqs, &r->blk);
+        request_t old = *r;
 
+        __reqs_fifo_poll(&me->recv_reqs_order);
+        if (0 == me->recv_reqs.count)
+            continue;
         assert(me->cb.peer_giveback_block);
-        me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, &r->blk);
-        free(r);
+        if (0 < __expunge_request(me, &old))
+            me->snubbed = 1;
     }
-    llqueue_free(rem);
-#endif
+}
+
+void pwp_conn_set_seed_mode(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (me->state.flags & PC_SEED_MODE)
+        return;
+
+    if (pwp_conn_im_interested(me_))
+        pwp_conn_set_im_uninterested(me_);
+    __expunge_my_pending_reqs(me);
+    __arena_free(me, me->recv_reqs.slots);
+    __arena_free(me, me->recv_reqs_order.items);
+    __arena_free(me, me->reqs.items);
+    memset(&me->recv_reqs, 0, sizeof(request_table_t));
+    memset(&me->recv_reqs_order, 0, sizeof(request_fifo_t));
+    memset(&me->reqs, 0, sizeof(request_fifo_t));
+    me->state.flags |= PC_SEED_MODE;
 }
 
 void pwp_conn_release(pwp_conn_t* me_)
@@ -241,9 +610,142 @@ void pwp_conn_release(pwp_conn_t* me_)
 
     __expunge_their_pending_reqs(me);
     __expunge_my_pending_reqs(me);
-    hashmap_free(me->recv_reqs);
-    llqueue_free(me->peer_reqs);
-    free(me_);
+    __arena_free(me, me->recv_reqs.slots);
+    __arena_free(me, me->recv_reqs_order.items);
+    __arena_free(me, me->peer_reqs.slots);
+    __arena_free(me, me->peer_reqs_order.items);
+    __arena_free(me, me->reqs.items);
+    __arena_free(me, me->pieces_peerhas);
+    __arena_free(me, me->pieces_wehave);
+    if (me->owns_mem)
+        free(me_);
+}
+
+static uint64_t* __words_grow(pwp_conn_private_t* me, uint64_t* old,
+                              int nold, int nwords)
+{
+    uint64_t* w = __arena_alloc(me, nwords * sizeof(uint64_t));
+
+    if (old)
+        memcpy(w, old, nold * sizeof(uint64_t));
+    memset(w + nold, 0, (nwords - nold) * sizeof(uint64_t));
+    __arena_free(me, old);
+    return w;
+}
+
+/**
+ * @return bytes of the block if it's outside the arena; otherwise 0 */
+static unsigned long __heap_bytes(const pwp_conn_private_t* me, const void* p,
+                                  unsigned long bytes)
+{
+    const char* a = (const char*)me->arena;
+
+    if (!p || (a <= (const char*)p && (const char*)p < a + sizeof(me->arena)))
+        return 0;
+    return bytes;
+}
+
+unsigned long pwp_conn_get_memory(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+
+    return sizeof(pwp_conn_private_t) +
+        __heap_bytes(me, me->recv_reqs.slots,
+                     me->recv_reqs.size * sizeof(request_t)) +
+        __heap_bytes(me, me->recv_reqs_order.items,
+                     me->recv_reqs_order.size * sizeof(request_t)) +
+        __heap_bytes(me, me->peer_reqs.slots,
+                     me->peer_reqs.size * sizeof(request_t)) +
+        __heap_bytes(me, me->peer_reqs_order.items,
+                     me->peer_reqs_order.size * sizeof(request_t)) +
+        __heap_bytes(me, me->reqs.items, me->reqs.size * sizeof(request_t)) +
+        __heap_bytes(me, me->pieces_peerhas,
+                     me->pieces_peerhas_nwords * sizeof(uint64_t)) +
+        __heap_bytes(me, me->pieces_wehave,
+                     me->pieces_peerhas_nwords * sizeof(uint64_t));
+}
+
+/**
+ * Make sure the peer's piece words, and ours, cover npieces */
+static void __peerhas_grow(pwp_conn_private_t* me, const int npieces)
+{
+    int nwords = (npieces + 63) / 64;
+
+    if (nwords <= me->pieces_peerhas_nwords)
+        return;
+
+    me->pieces_peerhas = __words_grow(me, me->pieces_peerhas,
+                                      me->pieces_peerhas_nwords, nwords);
+    me->pieces_wehave = __words_grow(me, me->pieces_wehave,
+                                     me->pieces_peerhas_nwords, nwords);
+    me->pieces_peerhas_nwords = nwords;
+}
+
+/**
+ * Count the pieces the peer has that we don't */
+static void __count_wanted(pwp_conn_private_t* me)
+{
+    int i;
+
+    me->npieces_wanted = 0;
+    for (i = 0; i < me->pieces_peerhas_nwords; i++)
+        me->npieces_wanted +=
+            __builtin_popcountll(me->pieces_peerhas[i] & ~me->pieces_wehave[i]);
+}
+
+/**
+ * Take the pieces we have from the progress counter */
+static void __seed_wehave(pwp_conn_private_t* me)
+{
+    int i;
+
+    if (!me->pieces_completed)
+        return;
+
+    __peerhas_grow(me, me->num_pieces);
+    if (me->pieces_wehave)
+        memset(me->pieces_wehave, 0,
+               me->pieces_peerhas_nwords * sizeof(uint64_t));
+    for (i = 0; i < me->num_pieces; i++)
+        if (chunky_have(me->pieces_completed, i, 1))
+            me->pieces_wehave[i / 64] |= (uint64_t)1 << (i % 64);
+    __count_wanted(me);
+}
+
+/**
+ * Tell the peer whether it has anything we want, if that has changed */
+static void __update_interest(pwp_conn_private_t* me)
+{
+    if (0 < me->npieces_wanted && !(me->state.flags & PC_IM_INTERESTED))
+        pwp_conn_set_im_interested((pwp_conn_t*)me);
+    else if (0 == me->npieces_wanted && (me->state.flags & PC_IM_INTERESTED))
+        pwp_conn_set_im_uninterested((pwp_conn_t*)me);
+}
+
+void pwp_conn_we_have_piece(pwp_conn_t* me_, const int piece_idx)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    uint64_t bit = (uint64_t)1 << (piece_idx % 64);
+
+    if (me->num_pieces <= piece_idx || piece_idx < 0)
+        return;
+
+    __peerhas_grow(me, piece_idx + 1);
+    if (me->pieces_wehave[piece_idx / 64] & bit)
+        return;
+
+    me->pieces_wehave[piece_idx / 64] |= bit;
+    if (me->pieces_peerhas[piece_idx / 64] & bit)
+    {
+        me->npieces_wanted--;
+        __update_interest(me);
+    }
+}
+
+int pwp_conn_get_npieces_wanted(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->npieces_wanted;
 }
 
 void pwp_conn_set_piece_info(pwp_conn_t* me_, int num_pieces, int piece_len)
@@ -252,6 +754,22 @@ void pwp_conn_set_piece_info(pwp_conn_t* me_, int num_pieces, int piece_len)
 
     me->num_pieces = num_pieces;
     me->piece_len = piece_len;
+
+    /* sized up front so that the words can be shared */
+    __peerhas_grow(me, num_pieces);
+    __seed_wehave(me);
+}
+
+const uint64_t* pwp_conn_get_peer_pieces(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->pieces_peerhas;
+}
+
+int pwp_conn_get_npeer_pieces(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->pieces_peerhas_count;
 }
 
 void pwp_conn_set_cbs(pwp_conn_t* me_, pwp_conn_cbs_t* funcs, void* cb_ctx)
@@ -295,19 +813,49 @@ void pwp_conn_set_im_interested(pwp_conn_t* me_)
 {
     pwp_conn_private_t *me = (void*)me_;
 
+    if (me->state.flags & PC_SEED_MODE)
+        return;
+
     if (pwp_conn_send_statechange(me_, PWP_MSGTYPE_INTERESTED))
     {
         me->state.flags |= PC_IM_INTERESTED;
     }
 }
 
+void pwp_conn_set_im_uninterested(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (pwp_conn_send_statechange(me_, PWP_MSGTYPE_UNINTERESTED))
+    {
+        me->state.flags &= ~PC_IM_INTERESTED;
+    }
+}
+
 void pwp_conn_choke_peer(pwp_conn_t* me_)
 {
     pwp_conn_private_t *me = (void*)me_;
 
     me->state.flags |= PC_IM_CHOKING;
-    __expunge_their_pending_reqs(me);
     pwp_conn_send_statechange(me_, PWP_MSGTYPE_CHOKE);
+
+    /* with the Fast extension the choke doesn't reject them for us */
+    if (me->state.flags & PC_FAST_EXTENSION)
+    {
+        request_t *r;
+
+        while ((r = __reqs_fifo_peek(&me->peer_reqs_order)))
+        {
+            request_t q = *r;
+
+            __reqs_fifo_poll(&me->peer_reqs_order);
+            if ((r = __reqs_get(&me->peer_reqs, &q.blk)) &&
+                r->tick == q.tick)
+                pwp_conn_send_reject(me_, &q.blk);
+        }
+    }
+
+    __expunge_their_pending_reqs(me);
 }
 
 void pwp_conn_unchoke_peer(pwp_conn_t* me_)
@@ -321,13 +869,19 @@ void pwp_conn_unchoke_peer(pwp_conn_t* me_)
 int pwp_conn_get_download_rate(const pwp_conn_t* me_ __attribute__((__unused__)))
 {
     const pwp_conn_private_t *me = (void*)me_;
-    return meanqueue_get_value(me->bytes_drate);
+
+    if (me->cb.get_time_ms)
+        return (int)me->drate.rate;
+    return meanqueue_get_value(&me->bytes_drate);
 }
 
 int pwp_conn_get_upload_rate(const pwp_conn_t* me_ __attribute__((__unused__)))
 {
     const pwp_conn_private_t *me = (void*)me_;
-    return meanqueue_get_value(me->bytes_urate);
+
+    if (me->cb.get_time_ms)
+        return (int)me->urate.rate;
+    return meanqueue_get_value(&me->bytes_urate);
 }
 
 int pwp_conn_send_statechange(pwp_conn_t* me_, const unsigned char msg_type)
@@ -338,9 +892,10 @@ int pwp_conn_send_statechange(pwp_conn_t* me_, const unsigned char msg_type)
     bitstream_write_uint32(&ptr, fe(1));
     bitstream_write_byte(&ptr, msg_type);
 
-    __log(me, "send,%s", pwp_msgtype_to_string(msg_type));
+    if (!__trace(me, 1, msg_type, 0, 0, 0))
+        __log(me, "send,%s", pwp_msgtype_to_string(msg_type));
 
-    if (!__send_to_peer(me, data, 5))
+    if (!__send_msg(me, data, 5))
     {
         return 0;
     }
@@ -348,16 +903,109 @@ int pwp_conn_send_statechange(pwp_conn_t* me_, const unsigned char msg_type)
     return 1;
 }
 
+static void __meter_add(pwp_conn_private_t* me, rate_meter_t* m,
+                        unsigned int bytes)
+{
+    if (!m->started && me->cb.get_time_ms)
+    {
+        m->last_ms = me->cb.get_time_ms(me->cb_ctx);
+        m->started = 1;
+    }
+    m->bytes += bytes;
+}
+
+/**
+ * Fold the bytes since the last sample into the average. Each sample is
+ * weighted by the time it covers, so that irregular sampling is fine */
+static void __meter_sample(pwp_conn_private_t* me, rate_meter_t* m)
+{
+    unsigned int now = me->cb.get_time_ms(me->cb_ctx), dt;
+    double w;
+
+    if (!m->started)
+    {
+        m->last_ms = now;
+        m->started = 1;
+        return;
+    }
+
+    if (0 == (dt = now - m->last_ms))
+        return;
+
+    w = dt < me->rate_window_ms ? (double)dt / me->rate_window_ms : 1.0;
+    m->rate += w * ((double)m->bytes * 1000 / dt - m->rate);
+    m->bytes = 0;
+    m->last_ms = now;
+}
+
+static void __piece_sent(pwp_conn_private_t* me, const bt_block_t * req)
+{
+    me->bytes_uploaded_this_period += req->len;
+    __meter_add(me, &me->urate, req->len);
+    if (!__trace(me, 1, PWP_MSGTYPE_PIECE, req->piece_idx, req->offset,
+                  req->len))
+        __log(me, "send,piece,piece_idx=%d offset=%d len=%d",
+              req->piece_idx, req->offset, req->len);
+}
+
 void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
 {
     pwp_conn_private_t *me = (void*)me_;
     char *data = NULL;
     char *ptr;
     unsigned int size;
+    char hdr[13];
 
     assert(NULL != me);
     assert(NULL != me->cb.write_block_to_stream);
 
+    /* messages we've held go first */
+    if (0 == pwp_conn_flush(me_))
+        return;
+
+    ptr = hdr;
+    bitstream_write_uint32(&ptr, fe(9 + req->len));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_PIECE);
+    bitstream_write_uint32(&ptr, fe(req->piece_idx));
+    bitstream_write_uint32(&ptr, fe(req->offset));
+
+    /* payload goes straight from the file to the socket */
+    if (me->cb.send_block_from_file)
+    {
+        switch (me->cb.send_block_from_file(me->cb_ctx, me->peer_udata,
+                                            hdr, 13, req))
+        {
+        case 0:
+            break;
+        case -1:
+            __disconnect(me, "peer dropped connection");
+            return;
+        default:
+            __mark_sent(me);
+            __piece_sent(me, req);
+            return;
+        }
+    }
+
+    /* header and block go out as is */
+    if (me->cb.sendv && me->cb.get_block_data)
+    {
+        const void *blkdata;
+
+        if ((blkdata = me->cb.get_block_data(me->cb_ctx, req)))
+        {
+            bt_iovec_t iov[2];
+
+            iov[0].base = hdr;
+            iov[0].len = 13;
+            iov[1].base = blkdata;
+            iov[1].len = req->len;
+            __sendv_to_peer(me, iov, 2);
+            __piece_sent(me, req);
+            return;
+        }
+    }
+
     /* prepare buf */
     size = 4 + 1 + 4 + 4 + req->len;
     if (!(data = malloc(size)))
@@ -389,8 +1037,7 @@ void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
     }
 #endif
 
-    __log(me, "send,piece,piece_idx=%d offset=%d len=%d",
-          req->piece_idx, req->offset, req->len);
+    __piece_sent(me, req);
 
     free(data);
 }
@@ -403,8 +1050,9 @@ int pwp_conn_send_have(pwp_conn_t* me_, const int piece_idx)
     bitstream_write_uint32(&ptr, fe(5));
     bitstream_write_byte(&ptr, PWP_MSGTYPE_HAVE);
     bitstream_write_uint32(&ptr, fe(piece_idx));
-    __send_to_peer(me, data, 5+4);
-    __log(me, "send,have,piece_idx=%d", piece_idx);
+    __send_msg(me, data, 5+4);
+    if (!__trace(me, 1, PWP_MSGTYPE_HAVE, piece_idx, 0, 0))
+        __log(me, "send,have,piece_idx=%d", piece_idx);
     return 1;
 }
 
@@ -419,9 +1067,11 @@ void pwp_conn_send_request(pwp_conn_t* me_, const bt_block_t * request)
     bitstream_write_uint32(&ptr, fe(request->piece_idx));
     bitstream_write_uint32(&ptr, fe(request->offset));
     bitstream_write_uint32(&ptr, fe(request->len));
-    __send_to_peer(me, data, 13+4);
-    __log(me, "send,request,piece_idx=%d offset=%d len=%d",
-          request->piece_idx, request->offset, request->len);
+    __send_msg(me, data, 13+4);
+    if (!__trace(me, 1, PWP_MSGTYPE_REQUEST, request->piece_idx,
+                  request->offset, request->len))
+        __log(me, "send,request,piece_idx=%d offset=%d len=%d",
+              request->piece_idx, request->offset, request->len);
 }
 
 void pwp_conn_send_cancel(pwp_conn_t* me_, bt_block_t * cancel)
@@ -435,9 +1085,380 @@ void pwp_conn_send_cancel(pwp_conn_t* me_, bt_block_t * cancel)
     bitstream_write_uint32(&ptr, fe(cancel->piece_idx));
     bitstream_write_uint32(&ptr, fe(cancel->offset));
     bitstream_write_uint32(&ptr, fe(cancel->len));
-    __send_to_peer(me, data, 17);
-    __log(me, "send,cancel,piece_idx=%d offset=%d len=%d",
-          cancel->piece_idx, cancel->offset, cancel->len);
+    __send_msg(me, data, 17);
+    if (!__trace(me, 1, PWP_MSGTYPE_CANCEL, cancel->piece_idx,
+                  cancel->offset, cancel->len))
+        __log(me, "send,cancel,piece_idx=%d offset=%d len=%d",
+              cancel->piece_idx, cancel->offset, cancel->len);
+}
+
+void pwp_conn_send_reject(pwp_conn_t* me_, const bt_block_t * reject)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    char data[32], *ptr;
+
+    ptr = data;
+    bitstream_write_uint32(&ptr, fe(13));
+    bitstream_write_byte(&ptr, PWP_MSGTYPE_REJECT);
+    bitstream_write_uint32(&ptr, fe(reject->piece_idx));
+    bitstream_write_uint32(&ptr, fe(reject->offset));
+    bitstream_write_uint32(&ptr, fe(reject->len));
+    __send_msg(me, data, 17);
+    if (!__trace(me, 1, PWP_MSGTYPE_REJECT, reject->piece_idx,
+                  reject->offset, reject->len))
+        __log(me, "send,reject,piece_idx=%d offset=%d len=%d",
+              reject->piece_idx, reject->offset, reject->len);
+}
+
+void pwp_conn_enable_fast_extension(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->state.flags |= PC_FAST_EXTENSION;
+}
+
+void pwp_conn_enable_extension_protocol(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->state.flags |= PC_EXTENDED;
+}
+
+int pwp_conn_peer_supports_pex(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return 0 != me->peer_ut_pex;
+}
+
+int pwp_conn_get_peer_listen_port(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->peer_listen_port;
+}
+
+/**
+ * Send a message that may not fit the cork buffer, after what's held */
+static int __send_large_msg(pwp_conn_private_t * me, void *data,
+                            const int len)
+{
+    if (len <= (int)sizeof(me->out))
+        return __send_msg(me, data, len);
+    if (0 == pwp_conn_flush((pwp_conn_t*)me))
+        return 0;
+    return __send_to_peer(me, data, len);
+}
+
+/**
+ * Start an extended message; the length is filled in by __extended_end
+ * @return where the payload goes */
+static char* __extended_start(char* data, int ext_id)
+{
+    data[4] = PWP_MSGTYPE_EXTENDED;
+    data[5] = ext_id;
+    return data + 6;
+}
+
+static int __extended_end(char* data, char* end)
+{
+    char* ptr = data;
+    int len = end - data;
+
+    bitstream_write_uint32(&ptr, fe(len - 4));
+    return len;
+}
+
+int pwp_conn_send_extended_handshake(pwp_conn_t* me_, int listen_port)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    char data[128], *ptr;
+
+    if (!(me->state.flags & PC_EXTENDED))
+        return 0;
+
+    ptr = __extended_start(data, PWP_EXTENDED_HANDSHAKE);
+    ptr += sprintf(ptr, "d1:md6:ut_pexi%dee", PWP_EXTENDED_UT_PEX);
+    if (0 < listen_port)
+        ptr += sprintf(ptr, "1:pi%de", listen_port);
+    ptr += sprintf(ptr, "1:v10:yabtorrente");
+    if (!__trace(me, 1, PWP_MSGTYPE_EXTENDED, PWP_EXTENDED_HANDSHAKE, 0, 0))
+        __log(me, "send,extended,handshake");
+    return __send_msg(me, data, __extended_end(data, ptr));
+}
+
+/**
+ * @return 1 if the address is an IPv4 one mapped into IPv6 */
+static int __pex_addr_is_v4(const unsigned char* addr)
+{
+    static const unsigned char v4mapped[12] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    return !memcmp(addr, v4mapped, sizeof(v4mapped));
+}
+
+/**
+ * Write a bencoded string of the compact form of the addresses of one
+ * family, and optionally a string of as many zero flags */
+static char* __pex_write_list(char* ptr, const char* key, const char* fkey,
+                              const unsigned char* addrs, int n, int v4)
+{
+    int i, count = 0;
+
+    for (i = 0; i < n; i++)
+        if (v4 == __pex_addr_is_v4(addrs + i * PWP_PEX_ADDR_LEN))
+            count++;
+
+    ptr += sprintf(ptr, "%d:%s%d:", (int)strlen(key), key,
+                   count * (v4 ? 6 : 18));
+    for (i = 0; i < n; i++)
+    {
+        const unsigned char* a = addrs + i * PWP_PEX_ADDR_LEN;
+
+        if (v4 != __pex_addr_is_v4(a))
+            continue;
+        memcpy(ptr, v4 ? a + 12 : a, v4 ? 6 : 18);
+        ptr += v4 ? 6 : 18;
+    }
+
+    if (fkey)
+    {
+        ptr += sprintf(ptr, "%d:%s%d:", (int)strlen(fkey), fkey, count);
+        memset(ptr, 0, count);
+        ptr += count;
+    }
+    return ptr;
+}
+
+int pwp_conn_send_pex(pwp_conn_t* me_,
+                      const unsigned char* added, int nadded,
+                      const unsigned char* dropped, int ndropped)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    /* every address IPv6, with its flag, and the keys */
+    char data[6 + 2 * PWP_PEX_MAX * (PWP_PEX_ADDR_LEN + 1) + 128], *ptr;
+
+    if (!(me->state.flags & PC_EXTENDED) || !me->peer_ut_pex)
+        return 0;
+
+    if (PWP_PEX_MAX < nadded)
+        nadded = PWP_PEX_MAX;
+    if (PWP_PEX_MAX < ndropped)
+        ndropped = PWP_PEX_MAX;
+
+    /* keys in sorted order */
+    ptr = __extended_start(data, me->peer_ut_pex);
+    *ptr++ = 'd';
+    ptr = __pex_write_list(ptr, "added", "added.f", added, nadded, 1);
+    ptr = __pex_write_list(ptr, "added6", "added6.f", added, nadded, 0);
+    ptr = __pex_write_list(ptr, "dropped", NULL, dropped, ndropped, 1);
+    ptr = __pex_write_list(ptr, "dropped6", NULL, dropped, ndropped, 0);
+    *ptr++ = 'e';
+    assert(ptr - data <= (int)sizeof(data));
+
+    if (!__trace(me, 1, PWP_MSGTYPE_EXTENDED, me->peer_ut_pex, 0, 0))
+        __log(me, "send,extended,pex added=%d dropped=%d", nadded, ndropped);
+    return __send_large_msg(me, data, __extended_end(data, ptr));
+}
+
+/**
+ * @param n Set to the string's length
+ * @return the bencoded string's bytes; NULL if p isn't a string */
+static const char* __bdecode_str(const char* p, const char* end,
+                                 unsigned int* n)
+{
+    unsigned long len = 0;
+
+    if (end <= p || !isdigit((unsigned char)*p))
+        return NULL;
+    for (; p < end && isdigit((unsigned char)*p); p++)
+        if ((unsigned long)(end - p) < (len = len * 10 + (*p - '0')))
+            return NULL;
+    if (end <= p || ':' != *p++ || (unsigned long)(end - p) < len)
+        return NULL;
+    *n = len;
+    return p;
+}
+
+/**
+ * @return 1 if p is a bencoded integer, which is put in v */
+static int __bdecode_int(const char* p, const char* end, long* v)
+{
+    char num[24];
+    const char* e;
+
+    if (end <= p || 'i' != *p || !(e = memchr(p, 'e', end - p)) ||
+        (int)sizeof(num) <= e - p - 1 || e == p + 1)
+        return 0;
+    memcpy(num, p + 1, e - p - 1);
+    num[e - p - 1] = '\0';
+    *v = strtol(num, NULL, 10);
+    return 1;
+}
+
+/**
+ * Read past a bencoded value
+ * @return what follows it; NULL if it's malformed */
+static const char* __bdecode_skip(const char* p, const char* end, int depth)
+{
+    unsigned int n;
+
+    if (end <= p || 32 < depth)
+        return NULL;
+
+    switch (*p)
+    {
+    case 'i':
+        return (p = memchr(p, 'e', end - p)) ? p + 1 : NULL;
+    case 'l':
+    case 'd':
+        for (p++; p && p < end && 'e' != *p;)
+            p = __bdecode_skip(p, end, depth + 1);
+        return p && p < end ? p + 1 : NULL;
+    default:
+        return (p = __bdecode_str(p, end, &n)) ? p + n : NULL;
+    }
+}
+
+/**
+ * @return the value of the bencoded dictionary's key; NULL if it doesn't
+ *  have it */
+static const char* __bdecode_dict_get(const char* p, const char* end,
+                                      const char* key)
+{
+    unsigned int klen = strlen(key), n;
+    const char* k;
+
+    if (end <= p || 'd' != *p)
+        return NULL;
+
+    for (p++; p && p < end && 'e' != *p;)
+    {
+        if (!(k = __bdecode_str(p, end, &n)))
+            return NULL;
+        p = k + n;
+        if (n == klen && !memcmp(k, key, n))
+            return p;
+        p = __bdecode_skip(p, end, 1);
+    }
+    return NULL;
+}
+
+static void __read_extended_handshake(pwp_conn_private_t* me, const char* p,
+                                      const char* end)
+{
+    const char* v;
+    long n;
+
+    if ((v = __bdecode_dict_get(p, end, "m")) &&
+        (v = __bdecode_dict_get(v, end, "ut_pex")) &&
+        __bdecode_int(v, end, &n) && 0 <= n && n < 256)
+        me->peer_ut_pex = n;
+
+    if ((v = __bdecode_dict_get(p, end, "p")) &&
+        __bdecode_int(v, end, &n) && 0 < n && n < 65536)
+        me->peer_listen_port = n;
+
+    if (!__trace(me, 0, PWP_MSGTYPE_EXTENDED, PWP_EXTENDED_HANDSHAKE, 0, 0))
+        __log(me, "read,extended,handshake ut_pex=%d port=%d",
+              me->peer_ut_pex, me->peer_listen_port);
+}
+
+/**
+ * Read the compact addresses of one family into PWP_PEX_ADDR_LEN byte
+ * addresses, while there's room
+ * @return number of addresses now in addrs */
+static int __pex_read_list(const char* p, const char* end, const char* key,
+                           int v4, unsigned char* addrs, int n)
+{
+    int size = v4 ? 6 : 18;
+    unsigned int len;
+    const char* v;
+
+    if (!(v = __bdecode_dict_get(p, end, key)) ||
+        !(v = __bdecode_str(v, end, &len)))
+        return n;
+
+    for (; (unsigned int)size <= len && n < PWP_PEX_MAX;
+         v += size, len -= size, n++)
+    {
+        unsigned char* a = addrs + n * PWP_PEX_ADDR_LEN;
+
+        if (v4)
+        {
+            memset(a, 0, 10);
+            a[10] = a[11] = 0xff;
+            memcpy(a + 12, v, 6);
+        }
+        else
+            memcpy(a, v, 18);
+    }
+    return n;
+}
+
+static void __read_pex(pwp_conn_private_t* me, const char* p, const char* end)
+{
+    unsigned char added[PWP_PEX_MAX * PWP_PEX_ADDR_LEN],
+                  dropped[PWP_PEX_MAX * PWP_PEX_ADDR_LEN];
+    int nadded, ndropped;
+
+    nadded = __pex_read_list(p, end, "added", 1, added, 0);
+    nadded = __pex_read_list(p, end, "added6", 0, added, nadded);
+    ndropped = __pex_read_list(p, end, "dropped", 1, dropped, 0);
+    ndropped = __pex_read_list(p, end, "dropped6", 0, dropped, ndropped);
+
+    if (!__trace(me, 0, PWP_MSGTYPE_EXTENDED, PWP_EXTENDED_UT_PEX, 0, 0))
+        __log(me, "read,extended,pex added=%d dropped=%d", nadded, ndropped);
+
+    if (me->cb.peer_exchange && (nadded || ndropped))
+        me->cb.peer_exchange(me->cb_ctx, me->peer_udata, added, nadded,
+                             dropped, ndropped);
+}
+
+void pwp_conn_extended(pwp_conn_t* me_, const char* payload,
+                       unsigned int len)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    /* without the handshake bit set, it isn't a message we know */
+    if (!(me->state.flags & PC_EXTENDED) || 0 == len)
+        return;
+
+    switch ((unsigned char)payload[0])
+    {
+    case PWP_EXTENDED_HANDSHAKE:
+        __read_extended_handshake(me, payload + 1, payload + len);
+        break;
+    case PWP_EXTENDED_UT_PEX:
+        __read_pex(me, payload + 1, payload + len);
+        break;
+    default:
+        break;
+    }
+}
+
+const int* pwp_conn_get_allowed_fast(const pwp_conn_t* me_, int* n)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+
+    *n = me->nallowed_fast;
+    return me->allowed_fast;
+}
+
+const int* pwp_conn_get_suggested(const pwp_conn_t* me_, int* n)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+
+    *n = me->nsuggested;
+    return me->suggested;
+}
+
+/**
+ * @return 1 if we may request this piece while choked */
+static int __is_allowed_fast(const pwp_conn_private_t* me, const int idx)
+{
+    int i;
+
+    for (i = 0; i < me->nallowed_fast; i++)
+        if (me->allowed_fast[i] == idx)
+            return 1;
+    return 0;
 }
 
 void pwp_conn_set_state(pwp_conn_t* me_, const int state)
@@ -462,10 +1483,17 @@ int pwp_conn_mark_peer_has_piece(pwp_conn_t* me_, const int piece_idx)
         return 0;
     }
 
-    /* remember that they have this piece */
-    chunky_mark_complete(me->pieces_peerhas, piece_idx, 1);
+    /* remember that they have this piece; only news is passed on */
+    __peerhas_grow(me, piece_idx + 1);
+    if (pwp_conn_peer_has_piece(me_, piece_idx))
+        return 1;
+    me->pieces_peerhas[piece_idx / 64] |= (uint64_t)1 << (piece_idx % 64);
+    me->pieces_peerhas_count++;
+    if (!(me->pieces_wehave[piece_idx / 64] >> (piece_idx % 64) & 1))
+        me->npieces_wanted++;
     if (me->cb.peer_have_piece)
         me->cb.peer_have_piece(me->cb_ctx, me->peer_udata, piece_idx);
+    __update_interest(me);
 
     return 1;
 }
@@ -483,19 +1511,25 @@ static void __req_fit(bt_block_t * request, const unsigned int piece_len)
 int pwp_conn_get_npending_requests(const pwp_conn_t* me_)
 {
     const pwp_conn_private_t * me = (void*)me_;
-    return hashmap_count(me->recv_reqs);
+    return me->recv_reqs.count;
+}
+
+int pwp_conn_get_nqueued_requests(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t * me = (void*)me_;
+    return me->reqs.count;
 }
 
 int pwp_conn_get_npending_peer_requests(const pwp_conn_t* me_)
 {
     const pwp_conn_private_t * me = (void*)me_;
-    return llqueue_count(me->peer_reqs);
+    return me->peer_reqs.count;
 }
 
 void pwp_conn_request_block_from_peer(pwp_conn_t* me_, bt_block_t * blk)
 {
     pwp_conn_private_t * me = (void*)me_;
-    request_t *req;
+    request_t *r;
 
 #if 0
     /*  drop meaningless blocks */
@@ -503,14 +1537,19 @@ void pwp_conn_request_block_from_peer(pwp_conn_t* me_, bt_block_t * blk)
         return;
 #endif
 
-    __req_fit(blk, me->piece_len);
+    __req_fit(blk, me->piece_len);
+
+    /* in endgame a block can be offered to us again; ask for it once */
+    if (__reqs_get(&me->recv_reqs, blk))
+        return;
+
     pwp_conn_send_request(me_, blk);
 
     /* remember that we requested it */
-    req = malloc(sizeof(request_t));
-    req->tick = me->state.tick;
-    memcpy(&req->blk, blk, sizeof(bt_block_t));
-    hashmap_put(me->recv_reqs, &req->blk, req);
+    r = __reqs_put(me, &me->recv_reqs, me->state.tick, blk, 0);
+    r->ms = me->cb.get_time_ms ? me->cb.get_time_ms(me->cb_ctx) : 0;
+    __reqs_fifo_push(me, &me->recv_reqs_order, me->state.tick,
+                     blk)->ms = r->ms;
 
 #if 0 /*  debugging */
     printf("request block: %d %d %d",
@@ -536,22 +1575,25 @@ void pwp_conn_connect_failed(pwp_conn_t* me_)
 static void* __offer_block(void* me_, void* b)
 {
     pwp_conn_private_t *me = (void*)me_;
-    bt_block_t *b_new;
 
-    /* TODO: replace with mempool/arena */
-    b_new = malloc(sizeof(bt_block_t));
-    memcpy(b_new,b,sizeof(bt_block_t));
-    llqueue_offer(me->reqs, b_new);
+    __reqs_fifo_push(me, &me->reqs, 0, b);
     return NULL;
 }
 
-static void* __poll_block(
-        void* me_,
-        void* unused __attribute__((__unused__)))
+/**
+ * Take the oldest block to request
+ * @param b Where the block is copied to
+ * @return b; NULL if there are none */
+static void* __poll_block(void* me_, void* b)
 {
     pwp_conn_private_t *me = (void*)me_;
+    request_t *r;
 
-    return llqueue_poll(me->reqs);
+    if (!(r = __reqs_fifo_peek(&me->reqs)))
+        return NULL;
+    memcpy(b, &r->blk, sizeof(bt_block_t));
+    __reqs_fifo_poll(&me->reqs);
+    return b;
 }
 
 void pwp_conn_offer_block(pwp_conn_t* me_, bt_block_t *b)
@@ -559,38 +1601,173 @@ void pwp_conn_offer_block(pwp_conn_t* me_, bt_block_t *b)
     pwp_conn_private_t* me = (void*)me_;
 
     assert(me->cb.call_exclusively);
+    if (me->state.flags & PC_SEED_MODE)
+        return;
     me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, b, __offer_block);
 }
 
-static void __process_requests(pwp_conn_private_t* me)
+typedef struct
+{
+    const bt_block_t *b;
+    int n;
+} __blocks_t;
+
+static void* __offer_blocks(void* me_, void* b_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    __blocks_t *b = b_;
+    int i;
+
+    for (i = 0; i < b->n; i++)
+        __reqs_fifo_push(me, &me->reqs, 0, &b->b[i]);
+    return NULL;
+}
+
+void pwp_conn_offer_blocks(pwp_conn_t* me_, const bt_block_t *b, int n)
+{
+    pwp_conn_private_t* me = (void*)me_;
+    __blocks_t blks = { .b = b, .n = n };
+
+    assert(me->cb.call_exclusively);
+    if (0 < n && !(me->state.flags & PC_SEED_MODE))
+        me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, &blks,
+                                __offer_blocks);
+}
+
+/**
+ * Send up to max of the queued requests */
+static void __process_requests(pwp_conn_private_t* me, int max)
 {
-    void *b;
+    bt_block_t b;
+    int n, sent = 0;
 
     /* TODO: probably want to split the request into smaller requests */
-    b = me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, NULL, __poll_block);
-    pwp_conn_request_block_from_peer((pwp_conn_t*)me, b);
-    free(b);
+    if (!pwp_conn_im_choked((pwp_conn_t*)me))
+    {
+        while (sent < max &&
+               me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, &b,
+                                       __poll_block))
+        {
+            pwp_conn_request_block_from_peer((pwp_conn_t*)me, &b);
+            sent++;
+        }
+        return;
+    }
+
+    /* choked; only allowed fast blocks can go. The rest wait their turn */
+    for (n = me->reqs.count; 0 < n && sent < max; n--)
+    {
+        if (!me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, &b,
+                                     __poll_block))
+            return;
+        if (__is_allowed_fast(me, b.piece_idx))
+        {
+            pwp_conn_request_block_from_peer((pwp_conn_t*)me, &b);
+            sent++;
+            continue;
+        }
+        me->cb.call_exclusively(me, me->cb_ctx, &me->req_lock, &b,
+                                __offer_block);
+    }
 }
 
-void pwp_conn_periodic(pwp_conn_t* me_)
+void pwp_conn_tick(pwp_conn_t* me_)
 {
     pwp_conn_private_t *me = (void*)me_;
 
     me->state.tick++;
 
-    __expunge_my_old_pending_reqs(me);
+    if (!(me->state.flags & PC_SEED_MODE))
+        __expunge_my_old_pending_reqs(me);
+}
 
-    if (pwp_conn_flag_is_set(me_, PC_UNCONTACTABLE_PEER))
+void pwp_conn_sample_rates(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    meanqueue_offer(&me->bytes_drate, me->bytes_downloaded_this_period);
+    meanqueue_offer(&me->bytes_urate, me->bytes_uploaded_this_period);
+    me->bytes_downloaded_this_period = 0;
+    me->bytes_uploaded_this_period = 0;
+
+    if (me->cb.get_time_ms)
     {
-        goto cleanup;
+        __meter_sample(me, &me->drate);
+        __meter_sample(me, &me->urate);
+    }
+
+    if (UINT_MAX != me->rtt_min_ms)
+    {
+        me->rtt_ms = me->rtt_min_ms;
+        me->rtt_min_ms = UINT_MAX;
+    }
+}
+
+int pwp_conn_get_rtt(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->rtt_ms;
+}
+
+void pwp_conn_set_rate_window(pwp_conn_t* me_, unsigned int ms)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->rate_window_ms = 0 == ms ? 1 : ms;
+}
+
+void pwp_conn_set_max_pending_requests(pwp_conn_t* me_, int n)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    me->max_pending_requests = n;
+}
+
+int pwp_conn_send_keepalive(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    char data[4], *ptr = data;
+
+    bitstream_write_uint32(&ptr, fe(0));
+
+    __log(me, "send,keepalive");
+
+    if (!__send_msg(me, data, 4))
+    {
+        return 0;
     }
 
-    /* Send one pending request to the peer */
-    if (0 < llqueue_count(me->peer_reqs))
+    return 1;
+}
+
+int pwp_conn_send_pending_piece(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+    request_t *r;
+
+    while ((r = __reqs_fifo_peek(&me->peer_reqs_order)))
+    {
+        request_t q = *r;
+
+        __reqs_fifo_poll(&me->peer_reqs_order);
+
+        /* cancelled, or queued again further back */
+        if (!(r = __reqs_get(&me->peer_reqs, &q.blk)) || r->tick != q.tick)
+            continue;
+
+        __reqs_remove(&me->peer_reqs, &q.blk);
+        pwp_conn_send_piece(me_, &q.blk);
+        return q.blk.len;
+    }
+
+    return 0;
+}
+
+void pwp_conn_service(pwp_conn_t* me_)
+{
+    pwp_conn_private_t *me = (void*)me_;
+
+    if (pwp_conn_flag_is_set(me_, PC_UNCONTACTABLE_PEER))
     {
-        bt_block_t* b = llqueue_poll(me->peer_reqs);
-        pwp_conn_send_piece(me_, b);
-        free(b);
+        goto cleanup;
     }
 
     /* unchoke interested peer */
@@ -602,19 +1779,23 @@ void pwp_conn_periodic(pwp_conn_t* me_)
         }
     }
 
-    if (pwp_conn_im_interested(me_))
+    if (pwp_conn_im_interested(me_) && !(me->state.flags & PC_SEED_MODE))
     {
-        if (pwp_conn_im_choked(me_))
+        if (pwp_conn_im_choked(me_) && 0 == me->nallowed_fast)
         {
             goto cleanup;
         }
 
         int end, ii;
         
-        // TODO: turn 10 into configuration value
         /*  max out pipeline */
-        end = 10 - pwp_conn_get_npending_requests(me_);
-        for (ii = 0; ii < end; ii++)
+        end = me->max_pending_requests - pwp_conn_get_npending_requests(me_);
+        if (me->cb.pollblocks)
+        {
+            if (0 < end)
+                me->cb.pollblocks(me->cb_ctx, me->peer_udata, end);
+        }
+        else for (ii = 0; ii < end; ii++)
         {
             if (0 == me->cb.pollblock(me->cb_ctx, me->peer_udata))
             {
@@ -622,34 +1803,39 @@ void pwp_conn_periodic(pwp_conn_t* me_)
             }
         }
 
-        if (0 < llqueue_count(me->reqs))
-            __process_requests(me);
-    }
-    else
-    {
-        pwp_conn_set_im_interested(me_);
+        /* fill the pipeline; a full one waits, whatever is queued */
+        if (0 < me->reqs.count && 0 < end)
+            __process_requests(me, end);
     }
 
 #if 0 /* debugging */
     printf("pending requests: %lx %d %d\n",
             me, pwp_conn_get_npending_requests(me),
-            llqueue_count(me->peer_reqs));
+            me->peer_reqs.count);
 #endif
 
-    /*  measure transfer rate */
-    meanqueue_offer(me->bytes_drate, me->bytes_downloaded_this_period);
-    meanqueue_offer(me->bytes_urate, me->bytes_uploaded_this_period);
-    me->bytes_downloaded_this_period = 0;
-    me->bytes_uploaded_this_period = 0;
-
 cleanup:
     return;
 }
 
+void pwp_conn_periodic(pwp_conn_t* me_)
+{
+    pwp_conn_cork(me_);
+    pwp_conn_tick(me_);
+    if (!pwp_conn_flag_is_set(me_, PC_UNCONTACTABLE_PEER))
+        pwp_conn_send_pending_piece(me_);
+    pwp_conn_service(me_);
+    pwp_conn_sample_rates(me_);
+    pwp_conn_uncork(me_);
+}
+
 int pwp_conn_peer_has_piece(pwp_conn_t* me_, const int piece_idx)
 {
     pwp_conn_private_t *me = (void*)me_;
-    return chunky_have(me->pieces_peerhas, piece_idx, 1);
+
+    if (piece_idx < 0 || me->pieces_peerhas_nwords * 64 <= piece_idx)
+        return 0;
+    return (me->pieces_peerhas[piece_idx / 64] >> (piece_idx % 64)) & 1;
 }
 
 void pwp_conn_keepalive(pwp_conn_t* me_ __attribute__((__unused__)))
@@ -661,16 +1847,21 @@ void pwp_conn_choke(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,choke");
+    if (!__trace(me, 0, PWP_MSGTYPE_CHOKE, 0, 0, 0))
+        __log(me, "read,choke");
     me->state.flags |= PC_PEER_CHOKING;
-    __expunge_my_pending_reqs(me);
+
+    /* with the Fast extension each request is rejected or served */
+    if (!(me->state.flags & PC_FAST_EXTENSION))
+        __expunge_my_pending_reqs(me);
 }
 
 void pwp_conn_unchoke(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,unchoke");
+    if (!__trace(me, 0, PWP_MSGTYPE_UNCHOKE, 0, 0, 0))
+        __log(me, "read,unchoke");
     me->state.flags &= ~PC_PEER_CHOKING;
 }
 
@@ -678,7 +1869,8 @@ void pwp_conn_interested(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,interested");
+    if (!__trace(me, 0, PWP_MSGTYPE_INTERESTED, 0, 0, 0))
+        __log(me, "read,interested");
     me->state.flags |= PC_PEER_INTERESTED;
 }
 
@@ -686,7 +1878,8 @@ void pwp_conn_uninterested(pwp_conn_t* me_)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,uninterested");
+    if (!__trace(me, 0, PWP_MSGTYPE_UNINTERESTED, 0, 0, 0))
+        __log(me, "read,uninterested");
     me->state.flags &= ~PC_PEER_INTERESTED;
 }
 
@@ -694,19 +1887,169 @@ void pwp_conn_have(pwp_conn_t* me_, msg_have_t* have)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,have,piece_idx=%d", have->piece_idx);
+    if (!__trace(me, 0, PWP_MSGTYPE_HAVE, have->piece_idx, 0, 0))
+        __log(me, "read,have,piece_idx=%d", have->piece_idx);
 
+    /* this tells the peer we're interested if we don't have the piece */
     if (1 == pwp_conn_mark_peer_has_piece(me_, have->piece_idx))
     {
 //      assert(pwp_conn_peer_has_piece(me, piece_idx));
     }
+}
+
+/**
+ * Let the caller know of the peer's pieces, up to npieces */
+static void __announce_peerhas(pwp_conn_private_t* me, const int npieces)
+{
+    int ii;
+
+    if (me->cb.peer_have_bitfield)
+    {
+        me->cb.peer_have_bitfield(me->cb_ctx, me->peer_udata,
+                                  me->pieces_peerhas, npieces);
+    }
+    else if (me->cb.peer_have_piece)
+    {
+        for (ii = 0; ii < npieces; ii++)
+            if (pwp_conn_peer_has_piece((pwp_conn_t*)me, ii))
+                me->cb.peer_have_piece(me->cb_ctx, me->peer_udata, ii);
+    }
+}
+
+/**
+ * The bitfield (or HAVE_ALL/HAVE_NONE) comes first and only once, so that
+ * it can be announced as all news
+ * @return 1 if the peer may send us one now */
+static int __bitfield_ok(pwp_conn_private_t* me)
+{
+    if (me->state.flags & PC_BITFIELD_RECEIVED)
+    {
+        __disconnect(me, "peer sent bitfield twice");
+        return 0;
+    }
+
+    if (0 < me->pieces_peerhas_count)
+    {
+        __disconnect(me, "peer sent bitfield after have");
+        return 0;
+    }
+
+    me->state.flags |= PC_BITFIELD_RECEIVED;
+    return 1;
+}
+
+/**
+ * @return 1 if the peer may send us this Fast extension message */
+static int __fast_msg_ok(pwp_conn_private_t* me, const char* msg)
+{
+    if (me->state.flags & PC_FAST_EXTENSION)
+        return 1;
+    __disconnect(me, "peer sent %s without the fast extension", msg);
+    return 0;
+}
+
+void pwp_conn_have_all(pwp_conn_t* me_)
+{
+    pwp_conn_private_t* me = (void*)me_;
+    int ii;
+
+    if (!__trace(me, 0, PWP_MSGTYPE_HAVE_ALL, 0, 0, 0))
+        __log(me, "read,have_all");
+
+    if (!__fast_msg_ok(me, "HAVE_ALL"))
+        return;
+
+    if (!__bitfield_ok(me))
+        return;
+
+    __peerhas_grow(me, me->num_pieces);
+    for (ii = 0; ii < me->num_pieces / 64; ii++)
+        me->pieces_peerhas[ii] = ~(uint64_t)0;
+    if (me->num_pieces % 64)
+        me->pieces_peerhas[ii] = ((uint64_t)1 << (me->num_pieces % 64)) - 1;
+    me->pieces_peerhas_count = me->num_pieces;
+    __count_wanted(me);
+
+    __announce_peerhas(me, me->num_pieces);
+    __update_interest(me);
+}
+
+void pwp_conn_have_none(pwp_conn_t* me_)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    if (!__trace(me, 0, PWP_MSGTYPE_HAVE_NONE, 0, 0, 0))
+        __log(me, "read,have_none");
+
+    if (!__fast_msg_ok(me, "HAVE_NONE"))
+        return;
+
+    if (!__bitfield_ok(me))
+        return;
+}
+
+void pwp_conn_reject(pwp_conn_t* me_, bt_block_t *reject)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    if (!__trace(me, 0, PWP_MSGTYPE_REJECT, reject->piece_idx,
+                  reject->offset, reject->len))
+        __log(me, "read,reject,piece_idx=%d offset=%d length=%d",
+              reject->piece_idx, reject->offset, reject->len);
+
+    if (!__fast_msg_ok(me, "REJECT_REQUEST"))
+        return;
+
+    /* free the pipeline slot now rather than when it times out */
+    if (__reqs_remove(&me->recv_reqs, reject) &&
+        me->cb.peer_giveback_block)
+        me->cb.peer_giveback_block(me->cb_ctx, me->peer_udata, reject);
+}
 
-    /* tell the peer we are intested if we don't have this piece */
-    if (!chunky_have(me->pieces_completed, have->piece_idx, 1))
+void pwp_conn_allowed_fast(pwp_conn_t* me_, msg_have_t* allowed)
+{
+    pwp_conn_private_t* me = (void*)me_;
+
+    if (!__trace(me, 0, PWP_MSGTYPE_ALLOWED_FAST, allowed->piece_idx, 0, 0))
+        __log(me, "read,allowed_fast,piece_idx=%d", allowed->piece_idx);
+
+    if (!__fast_msg_ok(me, "ALLOWED_FAST"))
+        return;
+
+    if (me->num_pieces <= (int)allowed->piece_idx ||
+        __is_allowed_fast(me, allowed->piece_idx) ||
+        PWP_CONN_FAST_SET_MAX == me->nallowed_fast)
+        return;
+
+    me->allowed_fast[me->nallowed_fast++] = allowed->piece_idx;
+}
+
+void pwp_conn_suggest(pwp_conn_t* me_, msg_have_t* suggest)
+{
+    pwp_conn_private_t* me = (void*)me_;
+    int i;
+
+    if (!__trace(me, 0, PWP_MSGTYPE_SUGGEST, suggest->piece_idx, 0, 0))
+        __log(me, "read,suggest,piece_idx=%d", suggest->piece_idx);
+
+    if (!__fast_msg_ok(me, "SUGGEST_PIECE"))
+        return;
+
+    if (me->num_pieces <= (int)suggest->piece_idx)
+        return;
+
+    for (i = 0; i < me->nsuggested; i++)
+        if (me->suggested[i] == (int)suggest->piece_idx)
+            return;
+
+    /* the oldest suggestion makes way */
+    if (PWP_CONN_FAST_SET_MAX == me->nsuggested)
     {
-        // TODO: do we need to be interested if we are already?
-        pwp_conn_set_im_interested(me_);
+        memmove(me->suggested, me->suggested + 1,
+                (PWP_CONN_FAST_SET_MAX - 1) * sizeof(int));
+        me->nsuggested--;
     }
+    me->suggested[me->nsuggested++] = suggest->piece_idx;
 }
 
 void pwp_conn_bitfield(pwp_conn_t* me_, msg_bitfield_t* bitfield)
@@ -725,37 +2068,84 @@ void pwp_conn_bitfield(pwp_conn_t* me_, msg_bitfield_t* bitfield)
     }
 #endif
 
-    if (pwp_conn_flag_is_set(me_, PC_BITFIELD_RECEIVED))
-    {
-        __disconnect(me, "peer sent bitfield twice");
-    }
+    if (!__bitfield_ok(me))
+        return;
 
-    me->state.flags |= PC_BITFIELD_RECEIVED;
+    int ii, npieces;
+    const unsigned char* bits = bitfield->bf->bits;
 
-    int ii;
+    npieces = me->num_pieces;
+    if ((int)bitfield->bf->size < npieces)
+        npieces = bitfield->bf->size;
 
-    for (ii = 0; ii < me->num_pieces; ii++)
+    /* fold the wire bytes (MSB first) into our words a byte at a time */
+    __peerhas_grow(me, npieces);
+    for (ii = 0; ii < (npieces + 7) / 8; ii++)
     {
-        if (bitfield_is_marked(bitfield->bf, ii))
-            pwp_conn_mark_peer_has_piece(me_, ii);
+        unsigned char b = bits[ii];
+        uint64_t w = 0;
+        int j;
+
+        if (0 == b)
+            continue;
+
+        for (j = 0; j < 8; j++)
+            if (b & (0x80 >> j))
+                w |= 1u << j;
+        if (npieces < ii * 8 + 8)
+            w &= (1u << (npieces - ii * 8)) - 1;
+        me->pieces_peerhas[ii / 8] |= w << (ii % 8 * 8);
     }
 
+    for (ii = 0; ii < (npieces + 63) / 64; ii++)
+        me->pieces_peerhas_count += __builtin_popcountll(me->pieces_peerhas[ii]);
+    __count_wanted(me);
+
+    __announce_peerhas(me, npieces);
+    __update_interest(me);
+
     //char *str;
     //str = bitfield_str(&me->state.have_bitfield);
     //__log(me, "read,bitfield,%s", str);
     //free(str);
 }
 
+/**
+ * Drop cancelled requests from the ring */
+static void __peer_reqs_compact(pwp_conn_private_t* me)
+{
+    request_fifo_t *f = &me->peer_reqs_order;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < f->count; i++)
+    {
+        request_t q = f->items[(f->head + i) % f->size], *r;
+
+        if ((r = __reqs_get(&me->peer_reqs, &q.blk)) && r->tick == q.tick)
+            f->items[(f->head + n++) % f->size] = q;
+    }
+    f->count = n;
+}
+
 int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
 {
     pwp_conn_private_t* me = (void*)me_;
 
-    __log(me, "read,request,piece_idx=%d offset=%d len=%d",
-          r->piece_idx, r->offset, r->len);
+    if (!__trace(me, 0, PWP_MSGTYPE_REQUEST, r->piece_idx, r->offset,
+                  r->len))
+        __log(me, "read,request,piece_idx=%d offset=%d len=%d",
+              r->piece_idx, r->offset, r->len);
 
     /* check that the client doesn't request when they are choked */
     if (pwp_conn_im_choking(me_))
     {
+        /* the request may have crossed our choke; we must answer it */
+        if (me->state.flags & PC_FAST_EXTENSION)
+        {
+            pwp_conn_send_reject(me_, r);
+            return 1;
+        }
+
         __disconnect(me, "peer requested when they were choked");
         return 0;
     }
@@ -810,11 +2200,22 @@ int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
 
     /* Append block to our pending request queue. */
     /* Don't append the block twice. */
-    if (!llqueue_get_item_via_cmpfunction(me->peer_reqs,r,(void*)__req_cmp))
+    if (!__reqs_get(&me->peer_reqs, r))
     {
-        bt_block_t* b = malloc(sizeof(bt_block_t));
-        memcpy(b,r, sizeof(bt_block_t));
-        llqueue_offer(me->peer_reqs,b);
+        int seq = me->peer_reqs_seq++;
+
+        /* don't let a peer grow the ring by cancelling and re-requesting */
+        if (4 * (me->peer_reqs.count + PWP_CONN_REQS_SIZE) <
+            me->peer_reqs_order.count)
+            __peer_reqs_compact(me);
+
+        __reqs_put(me, &me->peer_reqs, seq, r, 0);
+        __reqs_fifo_push(me, &me->peer_reqs_order, seq, r);
+
+        /* the queue is served a request per tick, so there's time to read
+         * the block in before we get to it */
+        if (me->cb.prefetch_block)
+            me->cb.prefetch_block(me->cb_ctx, r);
     }
 
     return 1;
@@ -823,21 +2224,119 @@ int pwp_conn_request(pwp_conn_t* me_, bt_block_t *r)
 void pwp_conn_cancel(pwp_conn_t* me_, bt_block_t *cancel)
 {
     pwp_conn_private_t* me = (void*)me_;
-    bt_block_t *removed;
 
-    __log(me, "read,cancel,piece_idx=%d offset=%d length=%d",
-          cancel->piece_idx, cancel->offset, cancel->len);
+    if (!__trace(me, 0, PWP_MSGTYPE_CANCEL, cancel->piece_idx,
+                  cancel->offset, cancel->len))
+        __log(me, "read,cancel,piece_idx=%d offset=%d length=%d",
+              cancel->piece_idx, cancel->offset, cancel->len);
 
-    removed = llqueue_remove_item_via_cmpfunction(
-            me->peer_reqs, cancel, (void*)__req_cmp);
-    free(removed);
+    /* with the Fast extension a cancelled request is still answered */
+    if (__reqs_remove(&me->peer_reqs, cancel) &&
+        (me->state.flags & PC_FAST_EXTENSION))
+        pwp_conn_send_reject(me_, cancel);
 //  queue_remove(peer->request_queue);
 }
 
 int pwp_conn_block_request_is_pending(void* pc, bt_block_t *b)
 {
     pwp_conn_private_t* me = pc;
-    return NULL != hashmap_get(me->recv_reqs, b);
+    return NULL != __reqs_get(&me->recv_reqs, b);
+}
+
+int pwp_conn_get_pending_request(const pwp_conn_t* me_, unsigned int* iter,
+                                 bt_block_t* b, unsigned int* age_ms)
+{
+    const pwp_conn_private_t* me = (const void*)me_;
+    const request_fifo_t* f = &me->recv_reqs_order;
+
+    for (; *iter < f->count; (*iter)++)
+    {
+        const request_t* q = &f->items[(f->head + *iter) % f->size];
+        const request_t* r;
+
+        /* the queue keeps requests that have since arrived or been
+         * cancelled, and the halves of a split request aren't in it */
+        if (!(r = __reqs_get(&me->recv_reqs, &q->blk)) ||
+            r->tick != q->tick || r->split)
+            continue;
+
+        *b = r->blk;
+        *age_ms = me->cb.get_time_ms ?
+            me->cb.get_time_ms(me->cb_ctx) - r->ms : 0;
+        (*iter)++;
+        return 1;
+    }
+
+    return 0;
+}
+
+int pwp_conn_cancel_request(pwp_conn_t* me_, const bt_block_t *b)
+{
+    pwp_conn_private_t* me = (void*)me_;
+    bt_block_t cancel = *b;
+
+    if (!__reqs_remove(&me->recv_reqs, b))
+        return 0;
+
+    pwp_conn_send_cancel(me_, &cancel);
+    return 1;
+}
+
+/**
+ * Fold a reply's latency into the smoothed estimate (RFC 6298) */
+static void __rtt_sample(pwp_conn_private_t* me, unsigned int rtt)
+{
+    unsigned int err;
+
+    /* 0 means no estimate */
+    if (0 == rtt)
+        rtt = 1;
+
+    if (0 == me->srtt_ms)
+    {
+        me->srtt_ms = rtt;
+        me->rttvar_ms = rtt / 2;
+        return;
+    }
+
+    err = me->srtt_ms < rtt ? rtt - me->srtt_ms : me->srtt_ms - rtt;
+    me->rttvar_ms = (3 * me->rttvar_ms + err) / 4;
+    me->srtt_ms = (7 * me->srtt_ms + rtt) / 8;
+    if (0 == me->srtt_ms)
+        me->srtt_ms = 1;
+}
+
+int pwp_conn_get_last_block_latency(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->last_block_ms;
+}
+
+int pwp_conn_get_srtt(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->srtt_ms;
+}
+
+int pwp_conn_get_rttvar(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->rttvar_ms;
+}
+
+int pwp_conn_is_snubbed(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+    return me->snubbed;
+}
+
+unsigned int pwp_conn_get_send_idle_ms(const pwp_conn_t* me_)
+{
+    const pwp_conn_private_t *me = (void*)me_;
+
+    if (0 == me->sent_ms || !me->cb.get_time_ms)
+        return UINT_MAX;
+    return me->cb.get_time_ms(me->cb_ctx) - me->sent_ms;
 }
 
 /**
@@ -845,17 +2344,30 @@ int pwp_conn_block_request_is_pending(void* pc, bt_block_t *b)
  * Remove the request represented by this block */
 static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block_t *pb)
 {
-    request_t *r;
-    void *add;
+    request_t *add, *req;
+    unsigned int i, n;
+
+    me->last_block_ms = -1;
 
     /* remove pending request */
-    if ((r = hashmap_remove(me->recv_reqs, &pb)))
+    if ((req = __reqs_get(&me->recv_reqs, pb)))
     {
-        free(r);
+        /* a whole reply to a request times the round trip */
+        if (!req->split && me->cb.get_time_ms)
+        {
+            unsigned int rtt = me->cb.get_time_ms(me->cb_ctx) - req->ms;
+
+            if (rtt < me->rtt_min_ms)
+                me->rtt_min_ms = rtt;
+            __rtt_sample(me, rtt);
+            me->last_block_ms = rtt;
+        }
+        __reqs_remove(&me->recv_reqs, pb);
         return;
     }
 
-    add = llqueue_new();
+    if (0 == me->recv_reqs.count)
+        return;
 
 #if 0
         /* ensure that the peer is sending us a piece we requested */
@@ -866,30 +2378,22 @@ static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block
         return 0;
 #endif
 
-    hashmap_iterator_t iter;
-    for (hashmap_iterator(me->recv_reqs, &iter);
-         (r = hashmap_iterator_next_value(me->recv_reqs, &iter));)
-    {
-        llqueue_offer(add,r);
-    }
+    add = malloc(me->recv_reqs.count * sizeof(request_t));
+    n = __reqs_copy(&me->recv_reqs, add);
 
     /* find out if this block is part of another request */
-    while (llqueue_count(add) > 0)
+    for (i = 0; i < n; i++)
     {
-        bt_block_t *rb;
-
-        r = llqueue_poll(add);
-        rb = &r->blk;
+        request_t *r = &add[i];
+        bt_block_t *rb = &r->blk;
 
-        if (r->blk.piece_idx != pb->piece_idx) continue;
+        if (rb->piece_idx != pb->piece_idx) continue;
 
         /*  piece completely eats request */
         if (pb->offset <= rb->offset &&
             rb->offset + rb->len <= pb->offset + pb->len)
         {
-            r = hashmap_remove(me->recv_reqs, &r->blk);
-            assert(r);
-            free(r);
+            __reqs_remove(&me->recv_reqs, rb);
         }
         /*
          * Piece in the middle
@@ -898,52 +2402,47 @@ static void __conn_remove_pending_request(pwp_conn_private_t* me, const bt_block
         else if (rb->offset < pb->offset &&
                 pb->offset + pb->len < rb->offset + rb->len)
         {
-            request_t *n;
+            bt_block_t nb;
 
-            n = malloc(sizeof(request_t));
-            n->tick = r->tick;
-            n->blk.piece_idx = rb->piece_idx;
-            n->blk.offset = pb->offset + pb->len;
-            n->blk.len = rb->len - pb->len - (pb->offset - rb->offset);
-            assert((int)n->blk.len != 0);
-            assert((int)n->blk.len > 0);
-            hashmap_put(me->recv_reqs, &n->blk, n);
-            assert(n->blk.len > 0);
+            nb.piece_idx = rb->piece_idx;
+            nb.offset = pb->offset + pb->len;
+            nb.len = rb->len - pb->len - (pb->offset - rb->offset);
+            assert((int)nb.len > 0);
+            __reqs_put(me, &me->recv_reqs, r->tick, &nb, 1);
 
-            hashmap_remove(me->recv_reqs, &r->blk);
+            __reqs_remove(&me->recv_reqs, rb);
 
             rb->len = pb->offset - rb->offset;
             assert((int)rb->len > 0);
-            hashmap_put(me->recv_reqs, &r->blk, r);
-            assert(rb->len > 0);
+            __reqs_put(me, &me->recv_reqs, r->tick, rb, 1);
         }
         /*  piece splits it on the left side */
         else if (rb->offset < pb->offset + pb->len &&
             pb->offset + pb->len < rb->offset + rb->len)
         {
-            hashmap_remove(me->recv_reqs, &r->blk);
+            __reqs_remove(&me->recv_reqs, rb);
 
-            /*  resize and return to hashmap */
+            /*  resize and return to table */
             rb->len -= (pb->offset + pb->len) - rb->offset;
             rb->offset = pb->offset + pb->len;
             assert((int)rb->len > 0);
-            hashmap_put(me->recv_reqs, &r->blk, r);
+            __reqs_put(me, &me->recv_reqs, r->tick, rb, 1);
         }
         /*  piece splits it on the right side */
         else if (rb->offset < pb->offset &&
             pb->offset < rb->offset + rb->len &&
             rb->offset + rb->len <= pb->offset + pb->len)
         {
-            hashmap_remove(me->recv_reqs, &r->blk);
+            __reqs_remove(&me->recv_reqs, rb);
 
-            /*  resize and return to hashmap */
+            /*  resize and return to table */
             rb->len = pb->offset - rb->offset;
             assert((int)rb->len > 0);
-            hashmap_put(me->recv_reqs, &r->blk, r);
+            __reqs_put(me, &me->recv_reqs, r->tick, rb, 1);
         }
     }
 
-    llqueue_free(add);
+    free(add);
 }
 
 int pwp_conn_piece(pwp_conn_t* me_, msg_piece_t *p)
@@ -952,14 +2451,18 @@ int pwp_conn_piece(pwp_conn_t* me_, msg_piece_t *p)
 
     assert(me->cb.pushblock);
 
-    __log(me, "read,piece,piece_idx=%d offset=%d length=%d",
-          p->blk.piece_idx,
-          p->blk.offset,
-          p->blk.len);
+    if (!__trace(me, 0, PWP_MSGTYPE_PIECE, p->blk.piece_idx,
+                  p->blk.offset, p->blk.len))
+        __log(me, "read,piece,piece_idx=%d offset=%d length=%d",
+              p->blk.piece_idx,
+              p->blk.offset,
+              p->blk.len);
 
     __conn_remove_pending_request(me, &p->blk);
+    me->snubbed = 0;
     me->cb.pushblock(me->cb_ctx, me->peer_udata, &p->blk, p->data);
     me->bytes_downloaded_this_period += p->blk.len;
+    __meter_add(me, &me->drate, p->blk.len);
     return 1;
 }
 
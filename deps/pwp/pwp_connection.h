@@ -1,6 +1,8 @@
 #ifndef PWP_CONNECTION_H
 #define PWP_CONNECTION_H
 
+#include <stdint.h>
+
 typedef void* pwp_conn_t;
 
 #ifndef HAVE_BT_BLOCK_T
@@ -13,6 +15,17 @@ typedef struct
 } bt_block_t;
 #endif
 
+#ifndef HAVE_BT_IOVEC_T
+#define HAVE_BT_IOVEC_T
+/**
+ * One buffer of a vectored send */
+typedef struct
+{
+    const void* base;
+    unsigned int len;
+} bt_iovec_t;
+#endif
+
 typedef void *(*func_getpiece_f)(
         void *udata,
         unsigned int piece);
@@ -22,6 +35,10 @@ typedef void (*func_write_block_to_stream_f)(
         bt_block_t *blk,
         char **msg);
 
+/**
+ * @return milliseconds since some fixed point */
+typedef unsigned int (*func_get_time_ms_f)(void *udata);
+
 #ifndef HAVE_FUNC_LOG
 #define HAVE_FUNC_LOG
 typedef void (
@@ -35,6 +52,25 @@ typedef void (
 );
 #endif
 
+/**
+ * A message was sent or read
+ * @param sent 1 if we sent it; 0 if we read it
+ * @param msg_type PWP_MSGTYPE_*
+ * @param piece_idx, offset, len The message's block, where it has one.
+ *  HAVE, SUGGEST and ALLOWED_FAST only set piece_idx, and EXTENDED sets
+ *  it to the extended message id */
+typedef void (
+    *func_trace_f
+)    (
+    void *udata,
+    void *peer,
+    int sent,
+    int msg_type,
+    unsigned int piece_idx,
+    unsigned int offset,
+    unsigned int len
+);
+
 typedef int (
     *func_pollblock_f
 )   (
@@ -42,6 +78,14 @@ typedef int (
     void *peer
 );
 
+typedef int (
+    *func_pollblocks_f
+)   (
+    void *udata,
+    void *peer,
+    int max
+);
+
 typedef int (
     *func_pushblock_f
 )   (
@@ -60,6 +104,48 @@ typedef int (
     const int len
 );
 
+/**
+ * Send these buffers, in order, as if they were one */
+typedef int (
+    *func_sendv_f
+)   (
+    void *udata,
+    const void *peer,
+    const bt_iovec_t *iov,
+    const int iovcnt
+);
+
+/**
+ * @return pointer to the block's data; NULL if it can't be sent uncopied */
+typedef const void *(
+    *func_get_block_data_f
+)   (
+    void *udata,
+    const bt_block_t *blk
+);
+
+/**
+ * Send the header followed by the block's data, read from the file
+ * @return 1 if sent; 0 if the block can't be sent this way; -1 on error */
+typedef int (
+    *func_send_block_from_file_f
+)   (
+    void *udata,
+    const void *peer,
+    const void *hdr,
+    const int hdr_len,
+    const bt_block_t *blk
+);
+
+/**
+ * The peer has asked for this block; we'll be reading it soon */
+typedef void (
+    *func_prefetch_request_f
+)   (
+    void *udata,
+    const bt_block_t *blk
+);
+
 typedef int (
     *func_disconnect_f
 )   (
@@ -84,6 +170,33 @@ typedef void (
     int piece
 );
 
+/**
+ * A peer exchange (BEP 11) message has arrived
+ * @param added, dropped Peers the sender has connected to, and has
+ *  dropped, each PWP_PEX_ADDR_LEN bytes */
+typedef void (
+    *func_peer_exchange_f
+)   (
+    void *udata,
+    void *peer,
+    const unsigned char* added,
+    int nadded,
+    const unsigned char* dropped,
+    int ndropped
+);
+
+/**
+ * @param words Pieces the peer has; piece i is bit i%64 of words[i/64]
+ * @param npieces Number of pieces words covers */
+typedef void (
+    *func_peerbitfield_f
+)   (
+    void *udata,
+    void *peer,
+    const uint64_t* words,
+    int npieces
+);
+
 typedef int (
     *func_lock_f
 )   (
@@ -115,6 +228,13 @@ typedef int (
 #define PC_PEER_CHOKING ((unsigned int)1<<8)
 #define PC_PEER_INTERESTED ((unsigned int)1<<9)
 #define PC_FAILED_CONNECTION ((unsigned int)1<<10)
+/*  both ends support the Fast extension (BEP 6) */
+#define PC_FAST_EXTENSION ((unsigned int)1<<11)
+/*  both ends support the extension protocol (BEP 10) */
+#define PC_EXTENDED ((unsigned int)1<<12)
+/*  we have every piece, so nothing is requested of the peer; see
+ *  pwp_conn_set_seed_mode */
+#define PC_SEED_MODE ((unsigned int)1<<13)
 
 typedef enum
 {
@@ -127,15 +247,50 @@ typedef enum
     PWP_MSGTYPE_REQUEST = 6,
     PWP_MSGTYPE_PIECE = 7,
     PWP_MSGTYPE_CANCEL = 8,
+    /* Fast extension (BEP 6) */
+    PWP_MSGTYPE_SUGGEST = 13,
+    PWP_MSGTYPE_HAVE_ALL = 14,
+    PWP_MSGTYPE_HAVE_NONE = 15,
+    PWP_MSGTYPE_REJECT = 16,
+    PWP_MSGTYPE_ALLOWED_FAST = 17,
+    /* extension protocol (BEP 10) */
+    PWP_MSGTYPE_EXTENDED = 20,
 } pwp_msg_type_e;
 
+/* extended message ids: the handshake, and the id we give ut_pex */
+#define PWP_EXTENDED_HANDSHAKE 0
+#define PWP_EXTENDED_UT_PEX 1
+
+/* largest extended message we'll read */
+#define PWP_EXTENDED_MAX_BYTES 16384
+
+/* a peer exchange address: IPv6, or IPv4 mapped into IPv6, then the port,
+ * all big endian. The same as bt_addr_pack's */
+#define PWP_PEX_ADDR_LEN 18
+
+/* most peers added, and dropped, in one peer exchange message */
+#define PWP_PEX_MAX 50
+
+/* most ALLOWED_FAST and SUGGEST pieces we remember per peer */
+#define PWP_CONN_FAST_SET_MAX 16
+
 /**
  * Create a new connection
+ * The connection's request tables and piece words are carved out of an
+ * arena within it, so a connection costs one allocation until it outgrows
+ * the arena
  * @param if non-null, use this as memory for the connection */
 void *pwp_conn_new(void* mem);
 
+/**
+ * Free the connection. Memory given to pwp_conn_new is left to the caller */
 void pwp_conn_release(pwp_conn_t* pco);
 
+/**
+ * @return bytes held by the connection, including what has outgrown its
+ *  arena */
+unsigned long pwp_conn_get_memory(const pwp_conn_t* pco);
+
 /**
  * @return peer user data */
 void *pwp_conn_get_peer(pwp_conn_t* pco);
@@ -160,10 +315,64 @@ int pwp_conn_im_interested(pwp_conn_t* pco);
 
 void pwp_conn_unchoke(pwp_conn_t* pco);
 
+/**
+ * Transfer rates.
+ * With a get_time_ms callback these are bytes per second, averaged over
+ * the rate window however often pwp_conn_sample_rates is called.
+ * Otherwise they are the mean bytes per sample over the last 10 samples
+ * @return bytes per second */
 int pwp_conn_get_download_rate(const pwp_conn_t* pco);
 
 int pwp_conn_get_upload_rate(const pwp_conn_t* pco);
 
+/**
+ * Set the time constant of the transfer rate averages
+ * @param ms Milliseconds; defaults to 10 seconds */
+void pwp_conn_set_rate_window(pwp_conn_t* pco, unsigned int ms);
+
+/**
+ * Round trip time of our block requests.
+ * This is the quickest reply seen in the last rate sample period, so that
+ * the peer's queueing of our requests doesn't inflate it.
+ * @return milliseconds; 0 if not yet known */
+int pwp_conn_get_rtt(const pwp_conn_t* pco);
+
+/**
+ * Time from our request to the arrival of the last PIECE, eg. for the
+ * pushblock callback to record
+ * @return milliseconds; -1 if the block wasn't a whole reply to a request */
+int pwp_conn_get_last_block_latency(const pwp_conn_t* pco);
+
+/**
+ * Smoothed latency from our block requests to the peer's PIECE replies,
+ * queueing at the peer included
+ * @return milliseconds; 0 if not yet known */
+int pwp_conn_get_srtt(const pwp_conn_t* pco);
+
+/**
+ * @return variation of the latency around the smoothed estimate, in ms */
+int pwp_conn_get_rttvar(const pwp_conn_t* pco);
+
+/**
+ * How long a request may wait before it is given back.
+ * This follows the latency estimate when there is a get_time_ms callback;
+ * otherwise requests are given back after 10 ticks
+ * @return milliseconds */
+int pwp_conn_get_request_timeout(const pwp_conn_t* pco);
+
+/**
+ * @return 1 if a request timed out and the peer hasn't sent a block since */
+int pwp_conn_is_snubbed(const pwp_conn_t* pco);
+
+/**
+ * Keepalives need only go out when nothing else has
+ * @return ms since we last sent the peer anything; UINT_MAX if we haven't */
+unsigned int pwp_conn_get_send_idle_ms(const pwp_conn_t* pco);
+
+/**
+ * Set how many block requests we keep outstanding with the peer */
+void pwp_conn_set_max_pending_requests(pwp_conn_t* pco, int n);
+
 /**
  * unchoke, choke, interested, uninterested,
  * @return non-zero if unsucessful */
@@ -175,6 +384,11 @@ int pwp_conn_send_statechange(pwp_conn_t* pco, const unsigned char msg_type);
  **/
 void pwp_conn_send_piece(pwp_conn_t* pco, bt_block_t * req);
 
+/**
+ * Send the piece for the oldest request the peer has queued with us
+ * @return number of payload bytes sent; 0 if nothing is queued */
+int pwp_conn_send_pending_piece(pwp_conn_t* pco);
+
 /**
  * Tell peer we have this piece 
  * @return 0 on error, 1 otherwise */
@@ -190,6 +404,18 @@ void pwp_conn_send_cancel(pwp_conn_t* pco, bt_block_t * cancel);
 
 void pwp_conn_set_im_interested(pwp_conn_t* me_);
 
+void pwp_conn_set_im_uninterested(pwp_conn_t* me_);
+
+/**
+ * We've completed this piece
+ * Interest is updated; we say we're uninterested once the peer has
+ * nothing left that we want */
+void pwp_conn_we_have_piece(pwp_conn_t* pco, const int piece_idx);
+
+/**
+ * @return number of pieces the peer has that we don't */
+int pwp_conn_get_npieces_wanted(const pwp_conn_t* pco);
+
 void pwp_conn_set_piece_info(pwp_conn_t* pco, int num_pieces, int piece_len);
 
 void pwp_conn_set_state(pwp_conn_t* pco, const int state);
@@ -205,6 +431,10 @@ int pwp_conn_mark_peer_has_piece(pwp_conn_t* pco, const int piece_idx);
  * @return number of requests we required from the peer */
 int pwp_conn_get_npending_requests(const pwp_conn_t* pco);
 
+/**
+ * @return number of blocks offered to us that are yet to be requested */
+int pwp_conn_get_nqueued_requests(const pwp_conn_t* pco);
+
 /**
  * @return number of requests we will request from the peer */
 int pwp_conn_get_npending_peer_requests(const pwp_conn_t* pco);
@@ -213,8 +443,45 @@ int pwp_conn_get_npending_peer_requests(const pwp_conn_t* pco);
  * pend a block request */
 void pwp_conn_request_block_from_peer(pwp_conn_t* pco, bt_block_t * blk);
 
+/**
+ * Run every due piece of work: tick, one queued piece, service and rate
+ * sampling
+ * Messages sent meanwhile go out together; see pwp_conn_cork */
 void pwp_conn_periodic(pwp_conn_t* pco);
 
+/**
+ * Hold control messages (state changes, have, request, cancel, keepalive)
+ * so that they go out in one send. Corks nest */
+void pwp_conn_cork(pwp_conn_t* pco);
+
+/**
+ * Undo a pwp_conn_cork, sending held messages once the last cork is gone
+ * @return 0 on error, 1 otherwise */
+int pwp_conn_uncork(pwp_conn_t* pco);
+
+/**
+ * Send held messages now
+ * @return 0 on error, 1 otherwise */
+int pwp_conn_flush(pwp_conn_t* pco);
+
+/**
+ * Advance the request clock. Requests older than 10 ticks are given back */
+void pwp_conn_tick(pwp_conn_t* pco);
+
+/**
+ * Fill the request pipeline and update interest
+ * Queued pieces are left to the caller; see pwp_conn_send_pending_piece */
+void pwp_conn_service(pwp_conn_t* pco);
+
+/**
+ * Push the bytes transferred since the last sample into the rate averages */
+void pwp_conn_sample_rates(pwp_conn_t* pco);
+
+/**
+ * Send a zero length message to keep the connection open
+ * @return 0 on error, 1 otherwise */
+int pwp_conn_send_keepalive(pwp_conn_t* pco);
+
 /** 
  *  @return 1 if the peer has this piece; otherwise 0 */
 int pwp_conn_peer_has_piece(pwp_conn_t* pco, const int piece_idx);
@@ -223,6 +490,21 @@ typedef struct {
     /** send data to peer */
     func_send_f send;
 
+    /** optional. Send PIECE messages without copying the block */
+    func_sendv_f sendv;
+
+    /** optional. Used with sendv to find the block's data */
+    func_get_block_data_f get_block_data;
+
+    /** optional. Send PIECE messages with sendfile/splice */
+    func_send_block_from_file_f send_block_from_file;
+
+    /** optional. Warm up storage for requests we've queued */
+    func_prefetch_request_f prefetch_block;
+
+    /** optional. Clock for timing our requests; see pwp_conn_get_rtt */
+    func_get_time_ms_f get_time_ms;
+
     /* drop the connect.
      * Most likely because we detected an error with the peer's processing */
     func_disconnect_f disconnect;
@@ -237,15 +519,30 @@ typedef struct {
      * @return 0 on success; otherwise -1 on failure*/
     func_pollblock_f pollblock;
 
+    /**
+     * As pollblock, but for up to max blocks in one go. The blocks come
+     * back through pwp_conn_offer_blocks. Used instead of pollblock when
+     * given
+     *
+     * @return 0 on success; otherwise -1 on failure*/
+    func_pollblocks_f pollblocks;
+
     /* We've just downloaded the block and want to allocate it. */
     func_pushblock_f pushblock;
 
     /* Let caller know that a peer has announced that they have a piece */
     func_peerpiece_f peer_have_piece;
 
+    /** optional. Let caller know of all the pieces in a BITFIELD at once;
+     * peer_have_piece is called for each piece otherwise */
+    func_peerbitfield_f peer_have_bitfield;
+
     /* Let caller know that it couldn't download this piece from this peer */
     func_peergiveblockback_f peer_giveback_block;
 
+    /** optional. Peers the peer has told us of with peer exchange */
+    func_peer_exchange_f peer_exchange;
+
 #if 0
     /**
      * Create lock */
@@ -273,6 +570,9 @@ typedef struct {
 
     /* logging */
     func_log_f log;
+
+    /* optional. Messages sent and read go here instead of to log */
+    func_trace_f trace;
 } pwp_conn_cbs_t;
 
 typedef struct {
@@ -308,6 +608,26 @@ void pwp_conn_have(pwp_conn_t* pco, msg_have_t* have);
  * Receive a bitfield */
 void pwp_conn_bitfield(pwp_conn_t* pco, msg_bitfield_t* bitfield);
 
+/**
+ * Receive a HAVE_ALL; the peer is a seeder */
+void pwp_conn_have_all(pwp_conn_t* pco);
+
+/**
+ * Receive a HAVE_NONE */
+void pwp_conn_have_none(pwp_conn_t* pco);
+
+/**
+ * Receive a REJECT_REQUEST; the block is given back straight away */
+void pwp_conn_reject(pwp_conn_t* pco, bt_block_t *reject);
+
+/**
+ * Receive an ALLOWED_FAST; we may request this piece while choked */
+void pwp_conn_allowed_fast(pwp_conn_t* pco, msg_have_t* allowed);
+
+/**
+ * Receive a SUGGEST_PIECE */
+void pwp_conn_suggest(pwp_conn_t* pco, msg_have_t* suggest);
+
 /**
  * Respond to a peer's request for a block
  * @return 0 on error, 1 otherwise */
@@ -337,24 +657,132 @@ void pwp_conn_connect_failed(pwp_conn_t* pco);
  * @return 1 if the request is still pending; otherwise 0 */
 int pwp_conn_block_request_is_pending(void* pc, bt_block_t *b);
 
+/**
+ * Walk our pending requests, oldest first
+ * @param iter Set to 0 before the first call
+ * @param b The request is written here
+ * @param age_ms Milliseconds since it was sent; 0 without a clock
+ * @return 1 if there was another request; otherwise 0 */
+int pwp_conn_get_pending_request(const pwp_conn_t* pco, unsigned int* iter,
+                                 bt_block_t* b, unsigned int* age_ms);
+
+/**
+ * Withdraw our request for this block, eg. another peer sent it first
+ * @return 1 if the request was pending; otherwise 0 */
+int pwp_conn_cancel_request(pwp_conn_t* pco, const bt_block_t *b);
+
+/**
+ * The pieces the peer has; piece i is bit i%64 of word i/64
+ * This is read only, and stays put until the connection is released or
+ * pwp_conn_set_piece_info grows it */
+const uint64_t* pwp_conn_get_peer_pieces(const pwp_conn_t* pco);
+
+/**
+ * @return number of pieces the peer has */
+int pwp_conn_get_npeer_pieces(const pwp_conn_t* pco);
+
+/**
+ * Both ends set the Fast extension bit in their handshakes */
+void pwp_conn_enable_fast_extension(pwp_conn_t* pco);
+
+/**
+ * Both ends set the extension protocol bit in their handshakes */
+void pwp_conn_enable_extension_protocol(pwp_conn_t* pco);
+
+/**
+ * Send our extension handshake, which offers ut_pex
+ * @param listen_port Port we accept connections on; 0 if we don't
+ * @return 0 if the peer doesn't do the extension protocol, or on error */
+int pwp_conn_send_extended_handshake(pwp_conn_t* pco, int listen_port);
+
+/**
+ * Receive an extended message
+ * @param payload The extended message id, and what follows it */
+void pwp_conn_extended(pwp_conn_t* pco, const char* payload,
+                       unsigned int len);
+
+/**
+ * @return 1 if the peer's extension handshake offered ut_pex */
+int pwp_conn_peer_supports_pex(const pwp_conn_t* pco);
+
+/**
+ * @return the port the peer's extension handshake says it listens on; 0
+ *  if it hasn't said */
+int pwp_conn_get_peer_listen_port(const pwp_conn_t* pco);
+
+/**
+ * Send a peer exchange message. Only the first PWP_PEX_MAX of each list
+ * are sent
+ * @param added, dropped PWP_PEX_ADDR_LEN bytes each
+ * @return 0 if the peer doesn't do peer exchange, or on error */
+int pwp_conn_send_pex(pwp_conn_t* pco,
+                      const unsigned char* added, int nadded,
+                      const unsigned char* dropped, int ndropped);
+
+/**
+ * Tell the peer we won't be sending this block */
+void pwp_conn_send_reject(pwp_conn_t* pco, const bt_block_t * reject);
+
+/**
+ * @param n Set to the number of pieces
+ * @return pieces the peer lets us request while choked */
+const int* pwp_conn_get_allowed_fast(const pwp_conn_t* pco, int* n);
+
+/**
+ * @param n Set to the number of pieces
+ * @return pieces the peer has suggested, oldest first */
+const int* pwp_conn_get_suggested(const pwp_conn_t* pco, int* n);
+
+/**
+ * We have every piece. The download side is dropped: requests pending
+ * and queued are given up and their memory freed, and periodic work is
+ * only for uploading. Blocks offered from now on are ignored */
+void pwp_conn_set_seed_mode(pwp_conn_t* me_);
+
 /**
  * Provide a block for us to request from the peer */
 void pwp_conn_offer_block(pwp_conn_t* me_, bt_block_t *b);
 
+/**
+ * Provide several blocks for us to request from the peer, in order
+ * @param n Number of blocks in b */
+void pwp_conn_offer_blocks(pwp_conn_t* me_, const bt_block_t *b, int n);
+
 // TODO: this could be renamed or documented better
 /**
  * Set the progress counter for pieces we've downloaded */
 void pwp_conn_set_progress(pwp_conn_t* me_, void* counter);
 
+/**
+ * A BITFIELD message that is kept up to date as pieces complete, so that
+ * it's ready to send: the header, then a bit for each piece in wire order */
+typedef struct
+{
+    char* msg;
+    int npieces;
+} pwp_bitfield_msg_t;
+
+/**
+ * Make the message for npieces, none of which are marked */
+void pwp_bitfield_msg_init(pwp_bitfield_msg_t* bf, int npieces);
+
+void pwp_bitfield_msg_release(pwp_bitfield_msg_t* bf);
+
+/**
+ * Mark that we have the piece */
+void pwp_bitfield_msg_mark(pwp_bitfield_msg_t* bf, int piece_idx);
+
+/**
+ * @return size of the message in bytes */
+int pwp_bitfield_msg_len(const pwp_bitfield_msg_t* bf);
+
 /**
  * Send a bitfield to peer, telling them what we have
- * @param npieces Number of pieces
- * @param pieces_completed Sparse counter containing pieces we've completed 
+ * @param bf The message, as kept by pwp_bitfield_msg_mark
  * @param send_cb Callback for sending data
  * @return 1 if successful, 0 otherwise */
 int pwp_send_bitfield(
-        int npieces,
-        void* pieces_completed,
+        const pwp_bitfield_msg_t* bf,
         func_send_f send_cb,
         void* cb_ctx,
         void* peer_udata);
@@ -19,13 +19,73 @@ typedef struct
 
 } peer_connection_state_t;
 
+/* control messages held while corked; enough for a tick's worth */
+#define PWP_CONN_OUT_BYTES 512
+
+/* request timeout before we've timed any replies, and the bounds of the
+ * timeout derived from the round trip estimate */
+#define PWP_CONN_REQ_TIMEOUT_MS 10000
+#define PWP_CONN_REQ_TIMEOUT_MIN_MS 2000
+#define PWP_CONN_REQ_TIMEOUT_MAX_MS 60000
+
+/* per connection arena the request tables, queued requests and piece
+ * words are carved from until they outgrow it; see __arena_alloc */
+#define PWP_CONN_ARENA_BYTES 8192
+
+/* samples in the download/upload rate averages used without a clock */
+#define PWP_CONN_RATE_SAMPLES 10
+
+/* time constant of the transfer rate averages */
+#define PWP_CONN_RATE_WINDOW_MS 10000
+
+/* exponentially weighted transfer rate, timed with the get_time_ms
+ * callback so that it doesn't depend on how often we're sampled */
 typedef struct
 {
-    /* the tick which this request was made */
+    /* bytes per second */
+    double rate;
+    /* bytes since the last sample */
+    unsigned int bytes;
+    unsigned int last_ms;
+    int started;
+} rate_meter_t;
+
+typedef struct
+{
+    /* the tick which this request was made.
+     * For the peer's requests, the order in which it was queued */
     int tick;
     bt_block_t blk;
+    /* 1 if this is what is left of a partially received request */
+    int split;
+    /* when the request was sent, for measuring round trips */
+    unsigned int ms;
 } request_t;
 
+/* initial number of slots in the request table; a power of two */
+#define PWP_CONN_REQS_SIZE 32
+
+/* open addressing table of the requests we've made.
+ * Slots with a zero length block are empty */
+typedef struct
+{
+    request_t *slots;
+    unsigned int size;
+    unsigned int count;
+    /* number of split requests */
+    unsigned int nsplit;
+} request_table_t;
+
+/* ring of the requests we've made in the order we made them, so that the
+ * oldest is always at the head */
+typedef struct
+{
+    request_t *items;
+    unsigned int size;
+    unsigned int head;
+    unsigned int count;
+} request_fifo_t;
+
 /*  peer connection */
 typedef struct
 {
@@ -34,19 +94,64 @@ typedef struct
     unsigned int bytes_downloaded_this_period,
                  bytes_uploaded_this_period;
 
+    /* Download/upload rate measurement, for when there's no clock */
+    meanqueue_t bytes_drate, bytes_urate;
+    int bytes_drate_vals[PWP_CONN_RATE_SAMPLES],
+        bytes_urate_vals[PWP_CONN_RATE_SAMPLES];
+
     /* Download/upload rate measurement */
-    void *bytes_drate,
-        *bytes_urate;
+    rate_meter_t drate, urate;
+    unsigned int rate_window_ms;
 
     /* Pending requests that we are waiting to get
      * We could receive pieces that are a subset of the original request */
-    hashmap_t *recv_reqs;
+    request_table_t recv_reqs;
 
-    /* Pending requests we are fufilling for the peer */
-    linked_list_queue_t *peer_reqs;
+    /* the same requests by age, for timing them out */
+    request_fifo_t recv_reqs_order;
+
+    /* Pending requests we are fufilling for the peer, in the order they
+     * arrived. Cancelled requests stay in the ring until they're reached */
+    request_table_t peer_reqs;
+    request_fifo_t peer_reqs_order;
+    int peer_reqs_seq;
     
-    /* list of requests to make */
-    linked_list_queue_t *reqs;
+    /* how many requests we keep with the peer */
+    int max_pending_requests;
+
+    /* round trip time in ms, and the quickest seen this sample period.
+     * UINT_MAX means there's been no reply this period */
+    unsigned int rtt_ms;
+    unsigned int rtt_min_ms;
+
+    /* smoothed request to PIECE latency and its variation, as for TCP.
+     * srtt_ms is 0 until the first reply is timed */
+    unsigned int srtt_ms;
+    unsigned int rttvar_ms;
+
+    /* latency of the last PIECE; -1 if it wasn't a whole reply */
+    int last_block_ms;
+
+    /* a request timed out and the peer has sent nothing since */
+    int snubbed;
+
+    /* get_time_ms when we last sent the peer anything; 0 if we haven't */
+    unsigned int sent_ms;
+
+    /* Fast extension: pieces we may request while choked, and pieces the
+     * peer suggested we download */
+    int allowed_fast[PWP_CONN_FAST_SET_MAX];
+    int nallowed_fast;
+    int suggested[PWP_CONN_FAST_SET_MAX];
+    int nsuggested;
+
+    /* extension protocol: the id the peer gave ut_pex, 0 if it doesn't do
+     * peer exchange, and the port it says it listens on */
+    int peer_ut_pex;
+    int peer_listen_port;
+
+    /* blocks to request, oldest first */
+    request_fifo_t reqs;
     void *req_lock;
 
     // TODO: need to remove this
@@ -66,8 +171,28 @@ typedef struct
     /* we obtain this read only counter from our caller (ie. cb_ctx) */
     const chunkybar_t *pieces_completed;
 
-    /* pieces that the piece has */
-    chunkybar_t *pieces_peerhas;
+    /* pieces that the peer has; piece i is bit i%64 of word i/64 */
+    uint64_t *pieces_peerhas;
+    int pieces_peerhas_nwords;
+    int pieces_peerhas_count;
+
+    /* pieces we have, as far as this connection knows, and how many the
+     * peer has that we don't. We're interested while that's non-zero */
+    uint64_t *pieces_wehave;
+    int npieces_wanted;
+
+    /* while corked, control messages wait here to go out in one send */
+    int corked;
+    unsigned int out_len;
+    char out[PWP_CONN_OUT_BYTES];
+
+    /* 1 if pwp_conn_new allocated us, rather than the caller */
+    int owns_mem;
+
+    /* bytes of the arena handed out. Nothing is given back until the
+     * connection is released */
+    unsigned int arena_used;
+    uint64_t arena[PWP_CONN_ARENA_BYTES / sizeof(uint64_t)];
 
 } pwp_conn_private_t;
 
@@ -22,10 +22,16 @@
 #include "pwp_local.h"
 #include "bitstream.h"
 
+/* longest protocol name, then reserved bytes, infohash and peer id */
+#define HANDSHAKE_MAX_LEN (255 + 8 + 20 + 20)
+
 typedef struct {
     pwp_handshake_t hs;
     unsigned int bytes_read;
 
+    /* the handshake's fields point in here */
+    char data[HANDSHAKE_MAX_LEN];
+
     char* cur;
     char* curr_value;
 
@@ -35,6 +41,9 @@ typedef struct {
     /* my peer id */
     char* my_pi;
 
+    /* why the handshake failed; NULL if it hasn't */
+    const char* error;
+
     /* 1 is handshake is done; 0 otherwise */
 //    int status;
 } pwp_handshaker_t;
@@ -65,13 +74,17 @@ int pwp_send_handshake(
 
     /* reserved characters */
     for (ii=0;ii<8;ii++)
-        bitstream_write_byte((char**)&ptr, 0);
+        bitstream_write_byte((char**)&ptr,
+                ii == PWP_HANDSHAKE_RESERVED_FAST_BYTE ?
+                    PWP_HANDSHAKE_RESERVED_FAST :
+                ii == PWP_HANDSHAKE_RESERVED_EXTENDED_BYTE ?
+                    PWP_HANDSHAKE_RESERVED_EXTENDED : 0);
 
-    /* infohash */
-    bitstream_write_string((char**)&ptr, expected_ih, 20);
+    /* infohash; binary, so it can hold NULs */
+    bitstream_write_bytes((char**)&ptr, expected_ih, 20);
 
     /* peerid */
-    bitstream_write_string((char**)&ptr, my_pi, 20);
+    bitstream_write_bytes((char**)&ptr, my_pi, 20);
 
     /* calculate total handshake size */
     size = 1 + strlen(protocol_name) + 8 + 20 + 20;
@@ -114,6 +127,93 @@ pwp_handshake_t* pwp_handshaker_get_handshake(void* me_)
     return &me->hs;
 }
 
+const char* pwp_handshaker_get_reserved(void* me_)
+{
+    pwp_handshaker_t* me = me_;
+
+    return me->hs.reserved;
+}
+
+const char* pwp_handshaker_get_error(void* me_)
+{
+    pwp_handshaker_t* me = me_;
+
+    return me->error;
+}
+
+/**
+ * @return -1, so the handshake fails */
+static int __fail(pwp_handshaker_t* me, const char* reason)
+{
+    me->error = reason;
+    return -1;
+}
+
+/**
+ * Check the fields that have been read in full
+ * The byte reader calls this as each field is finished, so that we drop
+ * the connection as soon as we know.
+ * @param end Just past the last byte read into the handshake's fields
+ * @return 0 if these fields are fine; -1 on failed handshake */
+static int __validate(pwp_handshaker_t* me, const char* end)
+{
+    pwp_handshake_t* hs = &me->hs;
+
+    if (hs->reserved <= end &&
+        0 != memcmp(hs->pn, PROTOCOL_NAME,
+                    (unsigned int)hs->pn_len < strlen(PROTOCOL_NAME) ?
+                        (unsigned int)hs->pn_len : strlen(PROTOCOL_NAME)))
+        return __fail(me, "handshake: incorrect protocol name");
+
+    /* the infohash is binary, so it isn't compared as a string */
+    if (hs->peerid <= end && 0 != memcmp(hs->infohash, me->expected_ih, 20))
+        return __fail(me, "handshake: invalid infohash");
+
+    return 0;
+}
+
+/**
+ * Point the handshake's fields into our buffer */
+static void __layout(pwp_handshaker_t* me, unsigned int pn_len)
+{
+    pwp_handshake_t* hs = &me->hs;
+
+    hs->pn_len = pn_len;
+    hs->pn = me->data;
+    hs->reserved = hs->pn + pn_len;
+    hs->infohash = hs->reserved + 8;
+    hs->peerid = hs->infohash + 20;
+}
+
+/**
+ * Read a handshake that is wholly in the buffer in one go
+ * @return 1 on succesful handshake; 0 if the handshake has to be read a
+ *  byte at a time; -1 on failed handshake */
+static int __dispatch_whole(pwp_handshaker_t* me, const char** buf,
+        unsigned int* len)
+{
+    pwp_handshake_t* hs = &me->hs;
+    unsigned int pn_len = (unsigned char)**buf, size;
+
+    size = 1 + pn_len + 8 + 20 + 20;
+    if (0 == pn_len || *len < size)
+        return 0;
+
+    __layout(me, pn_len);
+    memcpy(me->data, *buf + 1, size - 1);
+
+    if (-1 == __validate(me, hs->peerid + 20))
+        return -1;
+
+    /* leave the byte reader finished too */
+    me->curr_value = hs->peerid;
+    me->cur = hs->peerid + 20;
+    me->bytes_read += size;
+    *buf += size;
+    *len -= size;
+    return 1;
+}
+
 char __readbyte(unsigned int* bytes_read, const char **buf, unsigned int* len)
 {
     char val;
@@ -130,6 +230,14 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
     pwp_handshaker_t* me = me_;
     pwp_handshake_t* hs = &me->hs;
 
+    if (me->curr_value == NULL && 0 < *len)
+    {
+        int ret = __dispatch_whole(me, buf, len);
+
+        if (0 != ret)
+            return ret;
+    }
+
     while (0 < *len)
     {
 
@@ -141,14 +249,14 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
      * first byte, then the connection MUST be dropped. */
         if (me->curr_value == NULL)
         {
-            hs->pn_len = __readbyte(&me->bytes_read, buf, len);
-            if (0 == hs->pn_len)
-            {
-                printf("ERROR: invalid length\n");
-                return -1;
-            }
+            unsigned int pn_len =
+                (unsigned char)__readbyte(&me->bytes_read, buf, len);
+
+            if (0 == pn_len)
+                return __fail(me, "handshake: invalid length");
 
-            me->cur = me->curr_value = hs->pn = malloc(hs->pn_len);
+            __layout(me, pn_len);
+            me->cur = me->curr_value = hs->pn;
         }
     /* protocol name
     This is a character string which MUST contain the exact name of the 
@@ -165,15 +273,10 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
             /* validate */
             if (me->cur - me->curr_value == hs->pn_len)
             {
-                if (0 != strncmp((char*)hs->pn, PROTOCOL_NAME,
-                    hs->pn_len < strlen(PROTOCOL_NAME) ?
-                        hs->pn_len : strlen(PROTOCOL_NAME)))
-                {
-                    printf("ERROR: incorrect protocol name\n");
+                if (-1 == __validate(me, me->cur))
                     return -1;
-                }
 
-                me->cur = me->curr_value = hs->reserved = malloc(8);
+                me->cur = me->curr_value = hs->reserved;
             }
         }
     /* Reserved The next 8 bytes in the string are reserved for future
@@ -203,7 +306,7 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
 
             if (me->cur - me->curr_value == 8)
             {
-                me->cur = me->curr_value = hs->infohash = malloc(20);
+                me->cur = me->curr_value = hs->infohash;
             }
         }
     /* Info Hash:
@@ -223,17 +326,10 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
             /* validate */
             if (me->cur - me->curr_value == 20)
             {
-                /* check info hash matches expected */
-                if (0 != strncmp(
-                            (char*)hs->infohash,
-                            (char*)me->expected_ih, 20))
-                {
-                    printf("ERROR invalid infohash: '%s' vs '%s'\n",
-                            hs->infohash, me->expected_ih);
+                if (-1 == __validate(me, me->cur))
                     return -1;
-                }
 
-                me->cur = me->curr_value = hs->peerid = malloc(20);
+                me->cur = me->curr_value = hs->peerid;
             }
         }
     /* Peer ID:
@@ -263,10 +359,7 @@ int pwp_handshaker_dispatch_from_buffer(void* me_, const char** buf, unsigned in
             }
         }
         else
-        {
-            printf("ERROR: invalid handshake\n");
-            return -1;
-        }
+            return __fail(me, "handshake: invalid handshake");
     }
 
     return 0;//me->bytes_read;
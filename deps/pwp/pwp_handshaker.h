@@ -10,6 +10,14 @@ typedef struct {
     char* peerid;
 } pwp_handshake_t;
 
+/* Fast extension (BEP 6) bit of the reserved bytes; we always set it */
+#define PWP_HANDSHAKE_RESERVED_FAST_BYTE 7
+#define PWP_HANDSHAKE_RESERVED_FAST 0x04
+
+/* extension protocol (BEP 10) bit; we always set it too */
+#define PWP_HANDSHAKE_RESERVED_EXTENDED_BYTE 5
+#define PWP_HANDSHAKE_RESERVED_EXTENDED 0x10
+
 /**
  * Create a new handshaker
  * @return newly initialised handshaker */
@@ -39,4 +47,12 @@ int pwp_send_handshake(
  * @return null if handshake was successful */
 pwp_handshake_t* pwp_handshaker_get_handshake(void* me_);
 
+/**
+ * @return the 8 reserved bytes the other end sent */
+const char* pwp_handshaker_get_reserved(void* me_);
+
+/**
+ * @return why the handshake failed; NULL if it hasn't */
+const char* pwp_handshaker_get_error(void* me_);
+
 #endif /* PWP_HANDSHAKER_H */
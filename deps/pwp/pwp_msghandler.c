@@ -40,6 +40,16 @@ static uint32_t fe(uint32_t i)
     return o;
 }
 
+/**
+ * @return big endian 32bit int at p */
+static uint32_t __be32(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) |
+           ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
 int mh_uint32(
         uint32_t* in,
         msg_t *msg,
@@ -88,9 +98,39 @@ int mh_byte(
     return 1;
 }
 
+/**
+ * Account for payload bytes that are now in the frame */
+static void __frame_advance(pwp_msghandler_private_t *me, unsigned int size)
+{
+    msg_t* m = &me->msg;
+
+    me->frame_recvd += size;
+    m->len -= size;
+
+    if (me->frame_recvd < me->frame_blk.len)
+        return;
+
+    m->pce.blk = me->frame_blk;
+    m->pce.data = me->frame;
+    me->frame = NULL;
+    pwp_conn_piece(me->pc, &m->pce);
+    mh_endmsg(me);
+}
+
 int __pwp_piece_data(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int* len)
 {
+    if (me->frame)
+    {
+        unsigned int size = min(*len, me->frame_blk.len - me->frame_recvd);
+
+        memcpy(me->frame + me->frame_recvd, *buf, size);
+        *buf += size;
+        *len -= size;
+        __frame_advance(me, size);
+        return 1;
+    }
+
     /* check it isn't bigger than what the message tells
      * us we should be expecting */
     int size = min(*len, m->len - 1 - 4 - 4);
@@ -119,7 +159,19 @@ int __pwp_piece_offset(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int *len)
 {
     if (1 == mh_uint32(&m->pce.blk.offset, m, buf, len))
+    {
         me->process_item = __pwp_piece_data;
+
+        /* we know where the payload is going; see if it has a home */
+        if (me->ifr.get_frame && 9 < m->len)
+        {
+            me->frame_blk = m->pce.blk;
+            me->frame_blk.len = m->len - 1 - 4 - 4;
+            me->frame_recvd = 0;
+            me->frame = me->ifr.get_frame(me->frame_udata, me->pc,
+                                          &me->frame_blk);
+        }
+    }
     return 1;
 }
 
@@ -185,6 +237,101 @@ int __pwp_cancel_pieceidx(pwp_msghandler_private_t *me, msg_t* m, void* udata,
     return 1;
 }
 
+int __pwp_reject_len(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int* len)
+{
+    if (1 == mh_uint32(&m->blk.len, m, buf, len))
+    {
+        pwp_conn_reject(me->pc, &m->blk);
+        mh_endmsg(me);
+    }
+    return 1;
+}
+
+int __pwp_reject_offset(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    if (1 == mh_uint32(&m->blk.offset, m, buf, len))
+        me->process_item = __pwp_reject_len;
+    return 1;
+}
+
+int __pwp_reject_pieceidx(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    if (1 == mh_uint32(&m->blk.piece_idx, m, buf, len))
+        me->process_item = __pwp_reject_offset;
+    return 1;
+}
+
+int __pwp_suggest(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    if (1 == mh_uint32(&m->hve.piece_idx, m, buf, len))
+    {
+        pwp_conn_suggest(me->pc, &m->hve);
+        mh_endmsg(me);
+    }
+    return 1;
+}
+
+int __pwp_allowed_fast(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    if (1 == mh_uint32(&m->hve.piece_idx, m, buf, len))
+    {
+        pwp_conn_allowed_fast(me->pc, &m->hve);
+        mh_endmsg(me);
+    }
+    return 1;
+}
+
+/**
+ * Collect an extended message, which is handed over whole */
+int __pwp_extended(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    unsigned int size;
+
+    if (!me->ext)
+    {
+        if (PWP_EXTENDED_MAX_BYTES < m->len - 1)
+            return 0;
+        me->ext = malloc(m->len - 1);
+    }
+
+    size = min(*len, 4 + m->len - m->bytes_read);
+    memcpy(me->ext + m->bytes_read - 5, *buf, size);
+    m->bytes_read += size;
+    *buf += size;
+    *len -= size;
+
+    if (4 + m->len == m->bytes_read)
+    {
+        pwp_conn_extended(me->pc, me->ext, m->len - 1);
+        free(me->ext);
+        me->ext = NULL;
+        mh_endmsg(me);
+    }
+    return 1;
+}
+
+/**
+ * Read past the payload of a message type we don't handle */
+int __pwp_skip(pwp_msghandler_private_t *me, msg_t* m, void* udata,
+        const char** buf, unsigned int *len)
+{
+    unsigned int size = min(*len, 4 + m->len - m->bytes_read);
+
+    m->bytes_read += size;
+    *buf += size;
+    *len -= size;
+
+    if (4 + m->len == m->bytes_read)
+        mh_endmsg(me);
+    return 1;
+}
+
 int __pwp_have(pwp_msghandler_private_t *me, msg_t* m, void* udata,
         const char** buf, unsigned int *len)
 {
@@ -239,6 +386,43 @@ int __pwp_bitfield_start(pwp_msghandler_private_t *me,
     return 1;
 }
 
+/**
+ * Both the whole message reader and the byte at a time state machine check
+ * lengths here, so that they agree on what's malformed
+ * @param id Message type
+ * @param mlen Length of the message, including its type
+ * @return 1 if the length fits the type; otherwise 0 */
+static int __valid_len(char id, uint32_t mlen)
+{
+    switch (id)
+    {
+    case PWP_MSGTYPE_CHOKE:
+    case PWP_MSGTYPE_UNCHOKE:
+    case PWP_MSGTYPE_INTERESTED:
+    case PWP_MSGTYPE_UNINTERESTED:
+    case PWP_MSGTYPE_HAVE_ALL:
+    case PWP_MSGTYPE_HAVE_NONE:
+        return 1 == mlen;
+    case PWP_MSGTYPE_HAVE:
+    case PWP_MSGTYPE_SUGGEST:
+    case PWP_MSGTYPE_ALLOWED_FAST:
+        return 1 + 4 == mlen;
+    case PWP_MSGTYPE_REQUEST:
+    case PWP_MSGTYPE_CANCEL:
+    case PWP_MSGTYPE_REJECT:
+        return 1 + 4 + 4 + 4 == mlen;
+    case PWP_MSGTYPE_PIECE:
+        return 1 + 4 + 4 <= mlen;
+    case PWP_MSGTYPE_BITFIELD:
+        return 2 <= mlen;
+    case PWP_MSGTYPE_EXTENDED:
+        return 2 <= mlen && mlen - 1 <= PWP_EXTENDED_MAX_BYTES;
+    default:
+        /* custom and unhandled messages */
+        return 1;
+    }
+}
+
 int __pwp_type(pwp_msghandler_private_t *me,
         msg_t* m,
         void* udata __attribute__((unused)),
@@ -249,6 +433,12 @@ int __pwp_type(pwp_msghandler_private_t *me,
 
     mh_byte(&m->id, &m->bytes_read, buf, len);
 
+    if (!__valid_len(m->id, m->len))
+    {
+        mh_endmsg(me);
+        return 0;
+    }
+
     /* payloadless messages */
     if (m->len == 1)
     {
@@ -266,13 +456,19 @@ int __pwp_type(pwp_msghandler_private_t *me,
         case PWP_MSGTYPE_UNINTERESTED:
             pwp_conn_uninterested(me->pc);
             break;
-        default: assert(0); break;
+        case PWP_MSGTYPE_HAVE_ALL:
+            pwp_conn_have_all(me->pc);
+            break;
+        case PWP_MSGTYPE_HAVE_NONE:
+            pwp_conn_have_none(me->pc);
+            break;
+        default: break;
         }
         mh_endmsg(me);
     }
     else
     {
-        if (me->nhandlers < m->id) 
+        if (me->nhandlers <= m->id) 
         {
             printf("ERROR: bad pwp msg type: '%d'\n", m->id);
             mh_endmsg(me);
@@ -281,8 +477,8 @@ int __pwp_type(pwp_msghandler_private_t *me,
         /* the next handler can be selected according to the message type */
         assert(0 < m->id);
         assert(m->id < me->nhandlers);
-        assert(me->handlers[(int)m->id].func);
-        me->process_item = me->handlers[(int)m->id].func;
+        me->process_item = me->handlers[(int)m->id].func ?
+            me->handlers[(int)m->id].func : __pwp_skip;
         me->udata = me->handlers[(int)m->id].udata;
     }
 
@@ -313,6 +509,116 @@ int __pwp_length(pwp_msghandler_private_t *me,
     return 1;
 }
 
+/**
+ * Dispatch a message that is wholly in the buffer, without going through
+ * the byte at a time state machine
+ * A PIECE's payload is handed over from the buffer, and not put in a frame.
+ * @return bytes consumed; 0 if the message has to be read incrementally */
+static unsigned int __dispatch_whole_msg(pwp_msghandler_private_t* me,
+        const char* buf,
+        unsigned int len)
+{
+    const char* p = buf + 5;
+    uint32_t mlen;
+
+    if (len < 4)
+        return 0;
+
+    if (0 == (mlen = __be32(buf)))
+    {
+        pwp_conn_keepalive(me->pc);
+        return 4;
+    }
+
+    if (len - 4 < mlen || !__valid_len(buf[4], mlen))
+        return 0;
+
+    switch (buf[4])
+    {
+    case PWP_MSGTYPE_CHOKE:
+    case PWP_MSGTYPE_UNCHOKE:
+    case PWP_MSGTYPE_INTERESTED:
+    case PWP_MSGTYPE_UNINTERESTED:
+    case PWP_MSGTYPE_HAVE_ALL:
+    case PWP_MSGTYPE_HAVE_NONE:
+        switch (buf[4])
+        {
+        case PWP_MSGTYPE_CHOKE: pwp_conn_choke(me->pc); break;
+        case PWP_MSGTYPE_UNCHOKE: pwp_conn_unchoke(me->pc); break;
+        case PWP_MSGTYPE_INTERESTED: pwp_conn_interested(me->pc); break;
+        case PWP_MSGTYPE_HAVE_ALL: pwp_conn_have_all(me->pc); break;
+        case PWP_MSGTYPE_HAVE_NONE: pwp_conn_have_none(me->pc); break;
+        default: pwp_conn_uninterested(me->pc); break;
+        }
+        break;
+    case PWP_MSGTYPE_HAVE:
+    case PWP_MSGTYPE_SUGGEST:
+    case PWP_MSGTYPE_ALLOWED_FAST:
+    {
+        msg_have_t hve;
+
+        hve.piece_idx = __be32(p);
+        switch (buf[4])
+        {
+        case PWP_MSGTYPE_HAVE: pwp_conn_have(me->pc, &hve); break;
+        case PWP_MSGTYPE_SUGGEST: pwp_conn_suggest(me->pc, &hve); break;
+        default: pwp_conn_allowed_fast(me->pc, &hve); break;
+        }
+    }
+    break;
+    case PWP_MSGTYPE_REQUEST:
+    case PWP_MSGTYPE_CANCEL:
+    case PWP_MSGTYPE_REJECT:
+    {
+        bt_block_t blk;
+
+        blk.piece_idx = __be32(p);
+        blk.offset = __be32(p + 4);
+        blk.len = __be32(p + 8);
+        switch (buf[4])
+        {
+        case PWP_MSGTYPE_REQUEST: pwp_conn_request(me->pc, &blk); break;
+        case PWP_MSGTYPE_CANCEL: pwp_conn_cancel(me->pc, &blk); break;
+        default: pwp_conn_reject(me->pc, &blk); break;
+        }
+    }
+    break;
+    case PWP_MSGTYPE_PIECE:
+    {
+        msg_piece_t pce;
+
+        pce.blk.piece_idx = __be32(p);
+        pce.blk.offset = __be32(p + 4);
+        pce.blk.len = mlen - 1 - 4 - 4;
+        pce.data = p + 8;
+        pwp_conn_piece(me->pc, &pce);
+    }
+    break;
+    case PWP_MSGTYPE_BITFIELD:
+    {
+        msg_bitfield_t bf;
+        unsigned int i, j;
+
+        bf.bf = bitfield_new((mlen - 1) * 8);
+        for (i = 0; i < mlen - 1; i++)
+            for (j = 0; j < 8; j++)
+                if ((unsigned char)p[i] & (1 << (7 - j)))
+                    bitfield_mark(bf.bf, i * 8 + j);
+        pwp_conn_bitfield(me->pc, &bf);
+        bitfield_free(bf.bf);
+    }
+    break;
+    case PWP_MSGTYPE_EXTENDED:
+        pwp_conn_extended(me->pc, p, mlen - 1);
+        break;
+    default:
+        /* custom and bad messages */
+        return 0;
+    }
+
+    return 4 + mlen;
+}
+
 int pwp_msghandler_dispatch_from_buffer(void *mh,
         const char* buf,
         unsigned int len)
@@ -323,6 +629,18 @@ int pwp_msghandler_dispatch_from_buffer(void *mh,
     /* while we have a stream left to read... */
     while (0 < len)
     {
+        unsigned int n;
+
+        /* the state machine is only needed for messages split across
+         * buffers */
+        if (me->process_item == __pwp_length && 0 == m->bytes_read &&
+            0 < (n = __dispatch_whole_msg(me, buf, len)))
+        {
+            buf += n;
+            len -= n;
+            continue;
+        }
+
         assert(me->process_item);
         switch(me->process_item(me,m,me->udata,&buf,&len))
         {
@@ -336,6 +654,52 @@ int pwp_msghandler_dispatch_from_buffer(void *mh,
     return 1;
 }
 
+int pwp_msghandler_dispatch_whole_msgs(void *mh,
+        const char* buf,
+        unsigned int len,
+        unsigned int max_hold,
+        unsigned int *held)
+{
+    pwp_msghandler_private_t* me = mh;
+    msg_t* m = &me->msg;
+
+    *held = 0;
+    while (0 < len)
+    {
+        unsigned long long mlen;
+        unsigned int n;
+
+        /* a message too big to hold is being read incrementally */
+        if (me->process_item != __pwp_length || 0 < m->bytes_read)
+            return pwp_msghandler_dispatch_from_buffer(me, buf, len);
+
+        if (len < 4)
+            break;
+
+        mlen = __be32(buf);
+        if (len - 4 < mlen)
+        {
+            if (max_hold < 4 + mlen)
+                return pwp_msghandler_dispatch_from_buffer(me, buf, len);
+            break;
+        }
+
+        /* custom messages go through their handlers */
+        if (0 == (n = __dispatch_whole_msg(me, buf, len)))
+        {
+            n = 4 + mlen;
+            if (0 == pwp_msghandler_dispatch_from_buffer(me, buf, n))
+                return 0;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    *held = len;
+    return 1;
+}
+
 void mh_endmsg(pwp_msghandler_private_t* me)
 {
     me->process_item = __pwp_length;
@@ -358,6 +722,10 @@ void* pwp_msghandler_new2(
     int size = PWP_MSGTYPE_CANCEL + 1;
     if (handlers)
         size += nhandlers;
+
+    /* room for the Fast extension's and extension protocol's messages */
+    if (size < PWP_MSGTYPE_EXTENDED + 1)
+        size = PWP_MSGTYPE_EXTENDED + 1;
     me->nhandlers = size;
     me->handlers = calloc(1, sizeof(pwp_msghandler_item_t) * size);
 
@@ -367,10 +735,14 @@ void* pwp_msghandler_new2(
     me->handlers[PWP_MSGTYPE_REQUEST].func = __pwp_request_pieceidx;
     me->handlers[PWP_MSGTYPE_PIECE].func = __pwp_piece_pieceidx;
     me->handlers[PWP_MSGTYPE_CANCEL].func = __pwp_cancel_pieceidx;
+    me->handlers[PWP_MSGTYPE_SUGGEST].func = __pwp_suggest;
+    me->handlers[PWP_MSGTYPE_REJECT].func = __pwp_reject_pieceidx;
+    me->handlers[PWP_MSGTYPE_ALLOWED_FAST].func = __pwp_allowed_fast;
+    me->handlers[PWP_MSGTYPE_EXTENDED].func = __pwp_extended;
 
     /* add custom user provided handlers */
     int i, s;
-    for (i=PWP_MSGTYPE_CANCEL + 1, s=0; handlers && i<size; i++, s++)
+    for (i=PWP_MSGTYPE_CANCEL + 1, s=0; handlers && s<nhandlers; i++, s++)
     {
         me->handlers[i].func = (void*)handlers[s].func;
         me->handlers[i].udata = handlers[s].udata;
@@ -383,8 +755,58 @@ void* pwp_msghandler_new(void *pc)
     return pwp_msghandler_new2(pc,NULL,0,0);
 }
 
+void pwp_msghandler_set_frame_provider(void *mh,
+        const pwp_msghandler_frame_i* ifr,
+        void* udata)
+{
+    pwp_msghandler_private_t* me = mh;
+
+    pwp_msghandler_drop_frame(me);
+    memcpy(&me->ifr, ifr, sizeof(pwp_msghandler_frame_i));
+    me->frame_udata = udata;
+}
+
+void* pwp_msghandler_get_frame(void *mh, unsigned int *len)
+{
+    pwp_msghandler_private_t* me = mh;
+
+    if (!me->frame)
+        return NULL;
+
+    *len = me->frame_blk.len - me->frame_recvd;
+    return me->frame + me->frame_recvd;
+}
+
+int pwp_msghandler_frame_received(void *mh, unsigned int len)
+{
+    pwp_msghandler_private_t* me = mh;
+
+    if (!me->frame || me->frame_blk.len - me->frame_recvd < len)
+        return 0;
+
+    __frame_advance(me, len);
+    return 1;
+}
+
+void pwp_msghandler_drop_frame(void *mh)
+{
+    pwp_msghandler_private_t* me = mh;
+
+    if (!me->frame)
+        return;
+
+    if (me->ifr.drop_frame)
+        me->ifr.drop_frame(me->frame_udata, me->pc, &me->frame_blk,
+                           me->frame);
+    me->frame = NULL;
+}
+
 void pwp_msghandler_release(void *pc)
 {
+    pwp_msghandler_private_t* me = pc;
+
+    pwp_msghandler_drop_frame(pc);
+    free(me->ext);
     free(pc);
 }
 
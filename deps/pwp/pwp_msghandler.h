@@ -11,6 +11,20 @@ typedef struct {
     void* udata;
 } pwp_msghandler_item_t; 
 
+typedef struct {
+    /**
+     * A PIECE header has been read. Ask for memory to receive its payload
+     * into, eg. the storage's buffer for the block
+     * @param pc The peer connection the piece came in on
+     * @return frame of blk->len bytes, or NULL to receive as usual */
+    void* (*get_frame)(void* udata, void* pc, const bt_block_t* blk);
+
+    /**
+     * The payload won't arrive, the message handler is being released */
+    void (*drop_frame)(void* udata, void* pc, const bt_block_t* blk,
+                       void* frame);
+} pwp_msghandler_frame_i;
+
 /**
  * @return new msg handler */
 void* pwp_msghandler_new2(
@@ -38,4 +52,43 @@ int pwp_msghandler_dispatch_from_buffer(void *mh,
         const char* buf,
         unsigned int len);
 
+/**
+ * Dispatch the messages wholly within buf
+ * A message cut off at the end isn't read; the caller holds on to it and
+ * passes it again with the rest, so that a PIECE payload is handed to
+ * pwp_conn_piece in one go from the caller's buffer. Messages longer than
+ * max_hold are read incrementally, as pwp_msghandler_dispatch_from_buffer
+ * would.
+ * @param held Set to the number of bytes at the end of buf left unread
+ * @return 1 if successful, 0 if the peer needs to be disconnected */
+int pwp_msghandler_dispatch_whole_msgs(void *mh,
+        const char* buf,
+        unsigned int len,
+        unsigned int max_hold,
+        unsigned int *held);
+
+/**
+ * Receive PIECE payloads into frames from this provider
+ * The payload is passed to pwp_conn_piece in one go once it's all in */
+void pwp_msghandler_set_frame_provider(void *mh,
+        const pwp_msghandler_frame_i* ifr,
+        void* udata);
+
+/**
+ * Where the rest of the current PIECE payload goes
+ * The network layer can read straight into this instead of its own buffer,
+ * and then call pwp_msghandler_frame_received.
+ * @param len Set to the number of bytes still expected
+ * @return NULL if we aren't receiving into a frame */
+void* pwp_msghandler_get_frame(void *mh, unsigned int *len);
+
+/**
+ * This much was read into the frame from pwp_msghandler_get_frame
+ * @return 1 if successful, 0 if the peer needs to be disconnected */
+int pwp_msghandler_frame_received(void *mh, unsigned int len);
+
+/**
+ * Give back the frame we're receiving into, if any */
+void pwp_msghandler_drop_frame(void *mh);
+
 #endif /* PWP_MSGHANDLER_H */
@@ -39,6 +39,18 @@ struct pwp_msghandler_private_s {
     int nhandlers;
 
     msghandler_item_t* handlers;
+
+    /* PIECE payloads are received into frames from here */
+    pwp_msghandler_frame_i ifr;
+    void* frame_udata;
+
+    /* the payload being received, and how much of it is in */
+    char* frame;
+    bt_block_t frame_blk;
+    unsigned int frame_recvd;
+
+    /* an extended message split across buffers */
+    char* ext;
 };
 
 struct msghandler_item_s {
@@ -12,6 +12,8 @@
 #ifndef BT_H_
 #define BT_H_
 
+#include <stdint.h>
+
 #ifndef HAVE_BT_BLOCK_T
 #define HAVE_BT_BLOCK_T
 typedef struct
@@ -34,6 +36,17 @@ typedef void (
     );
 #endif
 
+#ifndef HAVE_BT_IOVEC_T
+#define HAVE_BT_IOVEC_T
+/**
+ * One buffer of a vectored send */
+typedef struct
+{
+    const void* base;
+    unsigned int len;
+} bt_iovec_t;
+#endif
+
 typedef int (
 *func_flush_block_f
 )   (
@@ -70,6 +83,47 @@ typedef struct
 typedef void* bt_dm_t;
 typedef void* bt_piece_t;
 
+/* each power of two is split into this many buckets; see bt_histogram.h */
+#define BT_HISTOGRAM_SUB_BUCKETS 4
+#define BT_HISTOGRAM_BUCKETS 128
+
+typedef struct
+{
+    unsigned int buckets[BT_HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+} bt_histogram_t;
+
+/**
+ * Read cache counters, since the cache was made */
+typedef struct
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} bt_cache_stats_t;
+
+
+/**
+ * Bytes a torrent holds, by what holds them */
+typedef struct
+{
+    /* blocks the disk keeps in memory; 0 if it keeps none */
+    unsigned long long cache;
+
+    /* peers, and their connections' requests and piece words */
+    unsigned long long connections;
+
+    /* piece progress and blocks waiting to be hashed */
+    unsigned long long pieces;
+    unsigned long long selector;
+
+    unsigned long long total;
+
+    /* max_memory, or the session's share if that's less; 0 for no cap */
+    unsigned long long limit;
+} bt_memory_stats_t;
 
 /**
  * Peer statistics */
@@ -81,6 +135,22 @@ typedef struct
     int choking;
     int connected;
     int failed_connection;
+    /* smoothed request latency and its variation, in ms; 0 if unknown */
+    int srtt;
+    int rttvar;
+    /* ms before a request to this peer is given back */
+    int request_timeout;
+    /* the peer let a request time out and has sent nothing since */
+    int snubbed;
+    /* our requests the peer hasn't answered, and theirs we haven't */
+    int npending_requests;
+    int npending_peer_requests;
+    /* bytes the rate limits held back last tick; see bt_dm_stats_t */
+    int upload_deferred;
+    int download_deferred;
+    /* payload bytes sent each way */
+    unsigned long long downloaded;
+    unsigned long long uploaded;
 } bt_dm_peer_stats_t;
 
 typedef struct
@@ -93,15 +163,259 @@ typedef struct
 
     /* size of array */
     int npeers_size;
+
+    /* most jobs that have been outstanding at once */
+    int jobs_hwm;
+
+    /* 1 if we have every piece, and the seeding choker is in charge */
+    int seeding;
+
+    /* choker rounds run so far, and how many peers the last one left
+     * unchoked */
+    int choke_rounds;
+    int nunchoked;
+
+    /* connects that haven't completed, and peers waiting to connect */
+    int nhalf_open;
+    int ncandidates;
+
+    /* peers the last bt_dm_periodic serviced */
+    int nserviced;
+
+    /* jobs waiting, and pieces being hashed in the background. job_depth
+     * samples njobs once a bt_dm_periodic */
+    int njobs;
+    int nhashing;
+    bt_histogram_t job_depth;
+
+    /* microseconds from a downloaded piece's last block arriving to it
+     * validating. The startup check isn't counted */
+    bt_histogram_t validate_us;
+
+    /* ms from our request to the block arriving */
+    bt_histogram_t block_ms;
+
+    /* the disk's read cache; 0s if it hasn't one */
+    bt_cache_stats_t cache;
+
+    /* what the last memory check counted */
+    bt_memory_stats_t memory;
+
+    /* bytes of blocks we already had, and of downloaded pieces that failed
+     * their hash check */
+    unsigned long long duplicate_bytes;
+    unsigned long long hash_failure_bytes;
+    int hash_failures;
+
+    /* blocks also asked of another peer, because the peer we'd asked
+     * would have taken steal_ratio times longer */
+    int stolen_blocks;
+
+    /* bytes the session's, torrent's and peers' rate limits held over to
+     * the next tick: PIECEs peers have asked for, and requests the
+     * pipelines had room for */
+    unsigned long long upload_deferred_bytes;
+    unsigned long long download_deferred_bytes;
+
+    /* piece bytes the web seeds sent */
+    unsigned long long webseed_bytes;
 } bt_dm_stats_t;
 
+/**
+ * Find where the block lives on disk
+ * @param fd File descriptor holding the block
+ * @param offset File offset of the block's first byte
+ * @return 1 if the block's bytes are all in the file; otherwise 0 */
+typedef int (
+*func_block_file_span_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blk,
+    int *fd,
+    unsigned long long *offset
+    );
+
+/**
+ * Hint that the block will be read soon
+ * @return 1 if the block will be ready to read; otherwise 0 */
+typedef int (
+*func_prefetch_block_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    );
+
+/**
+ * Write several blocks with as few writes as possible
+ * @param blks Blocks in file order. Adjacent blocks are written together
+ * @param data Each block's data
+ * @return 1 if every block was written; otherwise 0 */
+typedef int (
+*func_write_blocks_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blks,
+    const void **data,
+    int n
+    );
+
+/**
+ * A queued write has reached the disk, or failed to
+ * @param ok 1 if the block was written; otherwise 0 */
+typedef void (
+*func_block_written_f
+)   (
+    void *udata,
+    const bt_block_t * blk,
+    int ok
+    );
+
+/**
+ * Submit queued writes to the disk and report those that have finished
+ * @return number of writes still outstanding */
+typedef int (
+*func_submit_f
+)   (
+    void *udata,
+    void *caller,
+    func_block_written_f cb,
+    void *cb_udata
+    );
+
+/**
+ * Lend out the memory a block is about to be written to, so it can be
+ * received into directly
+ * Giving the frame back to write_block as the block's data saves the copy.
+ * The frame stays valid until then, or until drop_write_frame
+ * @return frame of blk->len bytes, or NULL if the block has to be copied */
+typedef void *(
+*func_get_write_frame_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    );
+
+/**
+ * Report the read cache's counters */
+typedef void (
+*func_get_cache_stats_f
+)   (
+    void *udata,
+    bt_cache_stats_t * stats
+    );
+
+/**
+ * @return bytes of block data the storage holds in memory */
+typedef unsigned long long (
+*func_get_memory_f
+)   (
+    void *udata
+    );
+
+/**
+ * Hold no more than this many bytes of block data in memory
+ * @param bytes 0 to lift the limit */
+typedef void (
+*func_set_memory_limit_f
+)   (
+    void *udata,
+    unsigned long long bytes
+    );
+
+/**
+ * The frame lent out for this block won't be written, eg. the peer left */
+typedef void (
+*func_drop_write_frame_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blk,
+    void *frame
+    );
+
 typedef struct
 {
     func_write_block_f write_block;
     func_read_block_f read_block;
     func_flush_block_f flush_block;
+
+    /* optional. Only file backed storage can provide this */
+    func_block_file_span_f block_file_span;
+
+    /* optional */
+    func_prefetch_block_f prefetch_block;
+
+    /* optional. Asynchronous storage queues writes until this is called */
+    func_submit_f submit;
+
+    /* optional */
+    func_write_blocks_f write_blocks;
+
+    /* optional. Storage that keeps blocks in memory can lend frames */
+    func_get_write_frame_f get_write_frame;
+    func_drop_write_frame_f drop_write_frame;
+
+    /* optional. Only caches have these */
+    func_get_cache_stats_f get_cache_stats;
+
+    /* optional. Storage that keeps blocks in memory reports them here */
+    func_get_memory_f get_memory;
+
+    /* optional. Only caches can give memory back */
+    func_set_memory_limit_f set_memory_limit;
 } bt_blockrw_i;
 
+/**
+ * A buffer given to a hasher has been hashed. May be called on any thread
+ * @param caller The caller given to submit
+ * @param job_udata The udata given to submit
+ * @param hash 20 byte SHA1 of the buffer; NULL if it couldn't be hashed */
+typedef void (
+*func_hash_done_f
+)   (
+    void *caller,
+    void *job_udata,
+    const char *hash
+    );
+
+/**
+ * Queue a buffer to be SHA1 hashed. Done is called once it has been
+ * @param data The hasher takes ownership and frees it
+ * @return 1 on success; otherwise 0, and data is still the caller's */
+typedef int (
+*func_hash_submit_f
+)   (
+    void *udata,
+    void *caller,
+    func_hash_done_f done,
+    char *data,
+    int len,
+    void *job_udata
+    );
+
+/**
+ * @return number of buffers the hasher should be given at once */
+typedef int (
+*func_hash_get_depth_f
+)   (
+    void *udata
+    );
+
+/**
+ * Somewhere pieces are hashed away from the thread that services peers:
+ * the built in hashpool, or an offload engine */
+typedef struct
+{
+    func_hash_submit_f submit;
+
+    /* optional. Hashers without it are given 2 buffers at once */
+    func_hash_get_depth_f get_depth;
+} bt_hasher_i;
+
 /**
  * Piece info
  * This is how this torrent has */
@@ -111,6 +425,10 @@ typedef struct
      * sha1 hash = 20 bytes */
     char *pieces_hash;
 
+    /* v2: the 32 byte merkle root of every piece, concatenated. NULL for a
+     * v1 torrent; pieces_hash may be NULL for a v2 only one */
+    char *pieces_root;
+
     /* the length of a piece (from protocol) */
     int piece_len;
 
@@ -124,6 +442,23 @@ typedef struct
     void* (*get_sparsecounter)(void *db);
 } bt_piecedb_i;
 
+/* how widely the peers we know of hold a torrent's pieces */
+typedef struct
+{
+    int npieces;
+
+    /* fewest peers that have any one piece */
+    int min;
+
+    /* copies of the torrent the peers hold between them, in thousandths:
+     * min, and the share of pieces that more than min peers have */
+    int distributed_copies;
+
+    /* pieces no peer has, and pieces only one peer has */
+    int nunavailable;
+    int nrare;
+} bt_availability_t;
+
 typedef struct
 {
     void* (*new)(int npieces);
@@ -144,12 +479,27 @@ typedef struct
      * Register this piece as being available from the peer */
     void (*peer_have_piece)(void *r, void* peer, int piece_idx);
 
+    /**
+     * optional. Register all of the peer's pieces at once
+     * @param words Piece i is bit i%64 of words[i/64] */
+    void (*peer_have_bitfield)(void *r, void* peer, const uint64_t* words,
+                               int npieces);
+
+    /**
+     * optional. Read the peer's pieces from the caller's words instead of
+     * keeping a copy. The words stay valid until remove_peer, and
+     * peer_have_piece and peer_have_bitfield then only announce news */
+    void (*peer_share_pieces)(void *r, void* peer, const uint64_t* words,
+                              int npieces);
+
     /*
      * Give this piece back to the selector */
     void (*peer_giveback_piece)(void *r, void* peer, int piece_idx);
 
     /**
      * Poll best piece from peer
+     * A piece that is fully requested already means endgame; its missing
+     * blocks are requested from this peer too
      * @param r random object
      * @param peer Best piece in context of this peer
      * @return idx of piece which is best; otherwise -1 */
@@ -163,11 +513,23 @@ typedef struct
      * Get number of pieces */
     int (*get_npieces)(void* r);
 
+    /**
+     * optional. Get bytes held by the selector */
+    unsigned long (*get_memory)(void* r);
+
+    /**
+     * optional. How widely the peers hold the torrent's pieces */
+    void (*get_availability)(void* r, bt_availability_t* a);
+
 } bt_pieceselector_i;
 
 #define BT_PEER_ID_LEN 20
+/* IPv6 address and port; see bt_addr_pack */
+#define BT_PEER_ADDR_LEN 18
 #define BT_VERSION_NUM 1000
-#define BT_BLOCK_SIZE 1 << 14 // 16kb
+/* 16kb; blocks are split and indexed with the shift */
+#define BT_BLOCK_SHIFT 14
+#define BT_BLOCK_SIZE (1 << BT_BLOCK_SHIFT)
         #define BT_HANDSHAKER_DISPATCH_SUCCESS 1
         #define BT_HANDSHAKER_DISPATCH_REMAINING 0
         #define BT_HANDSHAKER_DISPATCH_ERROR -1
@@ -182,11 +544,72 @@ typedef struct
     char *ip;
     unsigned int port;
 
+    /* ip and port packed by bt_addr_pack. Peers are keyed by this */
+    unsigned char addr[BT_PEER_ADDR_LEN];
+
+    /* 1 if ip is a host name rather than an address; it's keyed by ip */
+    int addr_is_name;
+
     /* peer connection */
     void* pc;
 
     /* message handler */
     void* mh;
+
+    /* receive buffer lent from the dm's pool while it holds data; see
+     * bt_dm_get_recv_buffer */
+    void* recvbuf;
+
+    /* bytes we may upload to, and download from, the peer; topped up
+     * each bt_dm_periodic */
+    int upload_tokens;
+    int download_tokens;
+
+    /* bytes the rate limits held back from the peer last tick */
+    int upload_deferred;
+    int download_deferred;
+
+    /* slot in the peer manager's array of peers */
+    int pm_idx;
+
+    /* 1 while waiting in the candidate queue for a connect */
+    int candidate;
+
+    /* 1 while we've started a connect and haven't heard back */
+    int half_open;
+
+    /* ms when the connection was made, and when the peer last sent us
+     * anything; see bt_dm_periodic's clock */
+    unsigned long long connected_ms;
+    unsigned long long heard_ms;
+
+    /* payload bytes sent each way over this connection */
+    unsigned long long downloaded;
+    unsigned long long uploaded;
+
+    /* 1 if the peer only knows of the pieces we've revealed to it while
+     * super-seeding; super_piece is the last of them, -1 if none */
+    int super_seeded;
+    int super_piece;
+
+    /* pieces that failed validation with blocks from this peer */
+    int suspicions;
+
+    /* 1 while the connection is draining from send_high_watermark */
+    int send_blocked;
+
+    /* 1 while queued to be serviced by the next bt_dm_periodic */
+    int ready;
+
+    /* 1 if the peer is on our LAN; see bt_dm_set_peer_local */
+    int local;
+
+    /* 1 if the peer connected to us, so port isn't the one it listens on */
+    int incoming;
+
+    /* 1 once the peer has been sent all the peers we know of; later
+     * peer exchange messages only say what has changed */
+    int pex_sent;
 } bt_peer_t;
 
 typedef struct
@@ -244,13 +667,14 @@ typedef struct
                         void (*func_connection_failed)(void *, void* conn_ctx));
 
     /**
-     * Send data to peer
+     * Send data to peer. Data the network can't take yet is queued by the
+     * callee; see peer_get_queued_bytes
      *
      * @param me
      * @param conn_ctx The peer's network ID
      * @param send_data Data to be sent
      * @param len Length of data to be sent
-     * @return 0 if added to buffer due to write failure, -2 if disconnect
+     * @return 1 if sent or queued; 0 if the connection has gone
      */
     int (*peer_send)(void* me,
                      void **udata,
@@ -291,6 +715,17 @@ typedef struct
                                            const char** buf,
                                            unsigned int* len);
 
+    /**
+     * Optional. The reserved bytes of the handshake received, so that we
+     * can use the extensions both ends support
+     * @return the 8 reserved bytes */
+    const char* (*handshaker_get_reserved)(void* hs);
+
+    /**
+     * Optional. Why the handshake failed, for the log
+     * @return reason; NULL if it's not known */
+    const char* (*handshaker_get_error)(void* hs);
+
     /**
      * Send the handshake
      * @return 0 on failure; 1 otherwise */
@@ -311,6 +746,58 @@ typedef struct
                               void* pnethandle);
 
     void* (*msghandler_new)(void* callee, void* pc);
+
+    /**
+     * Called each time bt_dm_check_pieces finishes checking a piece
+     * @param npieces_checked Number of pieces checked so far
+     * @param npieces Number of pieces being checked */
+    void (*check_progress)(void* cb_ctx, int npieces_checked, int npieces);
+
+    /**
+     * Optional vectored send, eg. for writev or uv_write
+     * PIECE messages are sent as a 13 byte header and a pointer to the
+     * block's data, with no intermediate buffer.
+     * The header memory is only valid for the duration of the call. The
+     * block data belongs to a complete piece, which is never rewritten, so
+     * it stays valid for as long as the disk backend keeps it.
+     * @return same as peer_send */
+    int (*peer_sendv)(void* me,
+                      void **udata,
+                      void* conn_ctx,
+                      const bt_iovec_t *iov,
+                      const int iovcnt);
+
+    /**
+     * Optional. Send hdr, then len bytes of fd from offset, eg. with a
+     * write followed by sendfile or splice. Used for PIECE messages when
+     * the disk backend implements block_file_span.
+     * @return same as peer_send */
+    int (*peer_sendfile)(void* me,
+                         void **udata,
+                         void* conn_ctx,
+                         const void *hdr,
+                         const int hdr_len,
+                         int fd,
+                         unsigned long long offset,
+                         const unsigned int len);
+
+    /**
+     * Optional. Backpressure for uploads; see the send_high_watermark and
+     * send_low_watermark config
+     * @return bytes sent to the peer that the network hasn't taken yet */
+    unsigned int (*peer_get_queued_bytes)(void* me,
+                                          void **udata,
+                                          void* conn_ctx);
+
+    /**
+     * Optional clock, eg. a simulation's virtual time. Timers, rates and
+     * request timeouts all read it; it's CLOCK_MONOTONIC otherwise.
+     * Called from the shards' threads too when peer_threads is set.
+     * Set it before peers are added; the timers start again on the new
+     * clock
+     * @return microseconds since an arbitrary start. Never goes backwards,
+     *         and isn't 0 */
+    unsigned long long (*get_time_us)(void* cb_ctx);
 } bt_dm_cbs_t;
 
 /**
@@ -335,6 +822,15 @@ int bt_dm_release(bt_dm_t* me_);
  * @return 0 on error */
 int bt_dm_peer_connect(void *bto, void* conn_ctx, char *ip, const int port);
 
+/**
+ * The peer's handshake has been read elsewhere, eg. by bt_session to find
+ * which torrent the connection is for. Its data from now on is PWP
+ * messages
+ * @param reserved The handshake's 8 reserved bytes
+ * @return 0 on error */
+int bt_dm_peer_handshaked(bt_dm_t* me_, void* conn_ctx,
+                          const char* reserved);
+
 /**
  * Called when a connection has failed.  */
 void bt_dm_peer_connect_fail(void *bto, void* conn_ctx);
@@ -348,12 +844,35 @@ int bt_dm_dispatch_from_buffer(
     const char* buf,
     unsigned int len);
 
+/**
+ * Space to read the peer's data into, instead of a buffer of the adapter's
+ * own. Buffers are lent out of a pool that the dm keeps, and hold a
+ * message that's cut off until the rest is read in after it
+ * @param len Set to the number of bytes that can be read in
+ * @return NULL if the peer isn't known */
+char* bt_dm_get_recv_buffer(bt_dm_t* me_, void* peer_conn_ctx,
+                            unsigned int* len);
+
+/**
+ * len bytes were read into the space from bt_dm_get_recv_buffer
+ * The messages that are wholly in the buffer are processed; PIECE payloads
+ * are passed on from the buffer in one go, rather than in fragments. The
+ * buffer goes back to the pool once nothing is held in it
+ * @return 1 on sucess; 0 otherwise */
+int bt_dm_recv_buffer_filled(bt_dm_t* me_, void* peer_conn_ctx,
+                             unsigned int len);
+
 /**
  * Add a peer. Initiate connection with the peer if conn_ctx is NULL
  *
  * Don't add peer twice
  * Don't add myself as peer
  *
+ * Connects wait in a candidate queue while max_half_open connects are
+ * outstanding or max_connects_per_sec has been used up. Peers that would
+ * take us over max_peer_connections are refused if they connected to us,
+ * and queued if we'd connect to them
+ *
  * @param conn_mem Memory that is used for the peer connection. If NULL the
  *                 connection will allocate it's own memory
  * @return the newly initialised peer; NULL on errors */
@@ -364,6 +883,26 @@ void *bt_dm_add_peer(bt_dm_t* me_,
                      void* conn_ctx,
                      void* conn_mem);
 
+/**
+ * Mark the peer as being on our LAN, eg. because local service discovery
+ * found it. Local peers are connected to ahead of other candidates, aren't
+ * replaced to make room for others, and are limited only by
+ * max_local_upload_rate and max_local_download_rate, not by the session's,
+ * the torrent's or the per peer limits
+ * @param peer From bt_dm_add_peer */
+void bt_dm_set_peer_local(bt_dm_t* me_, void* peer);
+
+/**
+ * Add an HTTP server that has the torrent (BEP 19). It's given pieces by
+ * the selector like a peer that has all of them, and what it sends is
+ * validated like any peer's. It's connected to with peer_connect, and
+ * again after webseed_retry_ms if that fails. The pieces have to be
+ * added, and the piece selector set, beforehand
+ * @param url See bt_webseed_new
+ * @return the web seed, for bt_webseed_add_file; NULL if the URL isn't
+ *         usable or there's no selector */
+void* bt_dm_add_webseed(bt_dm_t* me_, const char* url);
+
 /**
  * Remove the peer
  * Disconnect the peer if needed
@@ -376,6 +915,16 @@ int bt_dm_remove_peer(bt_dm_t* me_, void* peer);
  * @param stats Collect download/upload statistics. */
 void bt_dm_periodic(bt_dm_t* me_, bt_dm_stats_t *stats);
 
+/**
+ * Take the stats bt_dm_periodic last published; it publishes them every
+ * stats_interval ms. Safe to call from any thread, and never blocks
+ * bt_dm_periodic. Publishing waits while the snapshot is held, so hand it
+ * back soon with bt_dm_release_stats
+ * @return snapshot; NULL if none has been published */
+const bt_dm_stats_t* bt_dm_acquire_stats(bt_dm_t* me_);
+
+void bt_dm_release_stats(bt_dm_t* me_, const bt_dm_stats_t* stats);
+
 /**
  * Set callback functions
  *
@@ -402,7 +951,25 @@ void *bt_dm_get_piecedb(bt_dm_t* me_);
 void bt_dm_set_piece_db(bt_dm_t* me_, bt_piecedb_i* ipdb, void* piece_db);
 
 /**
- * Scan over downloaded pieces. Assess whether the pieces are complete. */
+ * Let bt_dm_periodic drive the disk's queued writes
+ * Only needed when the disk implements submit. Failed writes drop the
+ * piece's download progress so that it is downloaded again.
+ * @param irw The disk blockrw the piece database writes to
+ * @param udata The disk */
+void bt_dm_set_disk_blockrw(bt_dm_t* me_, bt_blockrw_i* irw, void* udata);
+
+/**
+ * Hash pieces with this instead of the hashpool that validation_threads
+ * sets up. v2 pieces, and pieces the hasher fails on, are still validated
+ * on the calling thread
+ * @param ih NULL to go back to the built in hashing
+ * @param udata Passed to the hasher's functions */
+void bt_dm_set_hasher(bt_dm_t* me_, bt_hasher_i* ih, void* udata);
+
+/**
+ * Scan over downloaded pieces. Assess whether the pieces are complete.
+ * Pieces that need hashing are validated by a single job on the next
+ * bt_dm_periodic, or fed to the hasher as it has room */
 void bt_dm_check_pieces(bt_dm_t* me_);
 
 /**
@@ -418,12 +985,42 @@ void* bt_dm_get_config(bt_dm_t* me_);
 void bt_dm_set_piece_selector(bt_dm_t* me_, bt_pieceselector_i* ips,
                               void* piece_selector);
 
+/**
+ * Count the bytes we hold now
+ * Storage is counted if it was given to bt_dm_set_disk_blockrw */
+void bt_dm_get_memory(bt_dm_t* me_, bt_memory_stats_t* stats);
+
+/**
+ * How widely the swarm holds the torrent, as the piece selector counts it
+ * from the peers' haves
+ * @return 1 on success; 0 if the selector doesn't count availability */
+int bt_dm_get_availability(bt_dm_t* me_, bt_availability_t* a);
+
+/**
+ * Hold no more than this many bytes, as well as max_memory
+ * Over the cap we shrink the cache, then lower pipeline depths, and then
+ * drop the slowest peers
+ * @param bytes 0 for no share */
+void bt_dm_set_memory_share(bt_dm_t* me_, unsigned long long bytes);
+
+/**
+ * Draw on the session's connection, upload and download budgets as well
+ * as our own. See bt_session_add_torrent
+ * @param session NULL to leave the session */
+void bt_dm_set_session(bt_dm_t* me_, void* session);
+
 void *bt_peer_get_conn_ctx(void* pr);
 
 /**
  * @return random Peer ID */
 char *bt_generate_peer_id();
 
+/**
+ * Files backing the download are registered with the resume record via
+ * bt_resume_add_file(). The record is kept when "resume_path" is configured.
+ * @return fast resume record */
+void* bt_dm_get_resume(bt_dm_t* me_);
+
 /**
  * @return number of jobs outstanding */
 int bt_dm_get_jobs(bt_dm_t* me_);
@@ -432,4 +1029,21 @@ int bt_dm_get_jobs(bt_dm_t* me_);
  * @return 1 if piece is complete; 0 otherwise */
 int bt_dm_piece_is_complete(bt_dm_t* me_, unsigned int piece_idx);
 
+/* piece priorities, see bt_dm_set_piece_priority */
+#define BT_PIECE_PRIORITY_SKIP 0
+#define BT_PIECE_PRIORITY_LOW 1
+#define BT_PIECE_PRIORITY_NORMAL 2
+
+/**
+ * Set the priority of pieces [first, last). Pieces are NORMAL by default.
+ * SKIP pieces are never requested. LOW pieces are only requested when
+ * the peer has nothing of NORMAL priority for us.
+ * The selector is told we have SKIP pieces, so it never polls them */
+void bt_dm_set_piece_priority(bt_dm_t* me_, int first, int last,
+                              int priority);
+
+/**
+ * @return priority of the piece */
+int bt_dm_get_piece_priority(bt_dm_t* me_, int piece_idx);
+
 #endif /* BT_H_ */
@@ -2,6 +2,9 @@
 #ifndef BT_BLACKLIST_H_
 #define BT_BLACKLIST_H_
 
+/* bans are by host, so only the address part of bt_addr_pack is used */
+#define BT_BLACKLIST_ADDR_LEN 16
+
 /**
  * @return newly initialised blacklist */
 void *bt_blacklist_new();
@@ -21,6 +24,9 @@ void bt_blacklist_add_peer_as_potentially_blacklisted(
     void* peer);
 
 /**
+ * This is on the request path, so it's cheap: a hashmap lookup for peers
+ * that have never been blacklisted, and a binary search for those that
+ * have
  * @return 1 if peer has been blacklisted */
 int bt_blacklist_peer_is_blacklisted(
     void* blacklist,
@@ -38,4 +44,26 @@ int bt_blacklist_peer_is_potentially_blacklisted(
  * @return number pieces within blacklist */
 int bt_blacklist_get_npieces(void* blacklist);
 
+/**
+ * @return number of pieces the peer has been blacklisted for */
+int bt_blacklist_get_npieces_for_peer(void* blacklist, void* peer);
+
+/**
+ * Forget the peer's blacklisting, eg. because it has gone and its memory
+ * may be reused by another peer. Potential blacklisting is kept */
+void bt_blacklist_remove_peer(void* blacklist, void* peer);
+
+/**
+ * Refuse the host outright, whatever port it comes from
+ * @param addr BT_BLACKLIST_ADDR_LEN bytes, as packed by bt_addr_pack */
+void bt_blacklist_ban_addr(void* blacklist, const unsigned char* addr);
+
+/**
+ * @return 1 if the host has been banned */
+int bt_blacklist_addr_is_banned(void* blacklist, const unsigned char* addr);
+
+/**
+ * @return number of hosts banned */
+int bt_blacklist_get_nbanned(void* blacklist);
+
 #endif /* BT_BLACKLIST_H_ */
@@ -0,0 +1,61 @@
+#ifndef BT_CACHE_POLICY_H_
+#define BT_CACHE_POLICY_H_
+
+/**
+ * Embedded in each cached item. Only the policy touches it.
+ * Items stay known to the policy after eviction when it keeps history, so
+ * they must be removed from the policy before they are freed. */
+typedef struct bt_cache_entry_s bt_cache_entry_t;
+
+struct bt_cache_entry_s
+{
+    bt_cache_entry_t *next, *prev;
+    int list;
+};
+
+/**
+ * Replacement policy
+ * Every operation is O(1). */
+typedef struct
+{
+    /**
+     * @param capacity Number of items the cache is expected to hold. Used by
+     *  policies that adapt to the workload
+     * @return newly initialised policy */
+    void* (*new)(unsigned int capacity);
+
+    void (*free)(void* p);
+
+    void (*set_capacity)(void* p, unsigned int capacity);
+
+    /**
+     * The item has been used. Items not in the cache are added */
+    void (*touch)(void* p, bt_cache_entry_t* e);
+
+    /**
+     * Forget the item, including any history of it */
+    void (*remove)(void* p, bt_cache_entry_t* e);
+
+    /**
+     * Choose an item to evict and stop tracking it as cached
+     * @return the item; NULL if no items are cached */
+    bt_cache_entry_t* (*evict)(void* p);
+
+    /**
+     * @return number of items cached */
+    int (*count)(void* p);
+} bt_cache_policy_i;
+
+/**
+ * Least recently used */
+const bt_cache_policy_i* bt_cache_policy_lru();
+
+/**
+ * Adaptive replacement cache
+ * Splits the cache between items used once and items used more than once,
+ * and keeps a history of evicted items to tune the split. A single pass
+ * over many items, eg. a peer downloading the whole torrent, only
+ * displaces items that have been used once. */
+const bt_cache_policy_i* bt_cache_policy_arc();
+
+#endif /* BT_CACHE_POLICY_H_ */
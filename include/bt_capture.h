@@ -0,0 +1,62 @@
+#ifndef BT_CAPTURE_H_
+#define BT_CAPTURE_H_
+
+/**
+ * Wire capture
+ * Records each connection's inbound bytes, with when they arrived, so that
+ * real traffic can be replayed into a download manager offline.
+ *
+ * Records are a type byte, the connection's id and the microseconds since
+ * the previous record, as varints. Data records carry their length and
+ * bytes; connection records the peer's IP and port.
+ *
+ * @param path File to write the capture to
+ * @return newly initialised recorder; NULL if the file can't be opened */
+void* bt_capture_open(const char* path);
+
+/**
+ * Flush and close the file */
+void bt_capture_close(void* c);
+
+/**
+ * A connection has been made, either way
+ * @param nethandle The network adapter's handle for the connection */
+void bt_capture_connection(void* c, void* nethandle, const char* ip,
+                           int port);
+
+/**
+ * Bytes have been read from the connection */
+void bt_capture_data(void* c, void* nethandle, const void* buf,
+                     unsigned int len);
+
+/**
+ * The connection has closed. Its handle may be reused afterwards */
+void bt_capture_disconnection(void* c, void* nethandle);
+
+/**
+ * Receives a capture as it's replayed
+ * Each connection's nethandle is its id in the capture */
+typedef struct
+{
+    /* @return 0 to drop the connection */
+    int (*process_data) (void *caller, void* nethandle,
+                         const char* buf, unsigned int len);
+
+    /* @return 0 to drop the connection */
+    int (*process_connection) (void *caller, void* nethandle,
+                               char *ip, int port);
+
+    /* the connection closed, or process_* dropped it */
+    void (*connection_failed) (void *caller, void* nethandle);
+
+    /* optional; microseconds into the capture of the next record */
+    void (*record_time) (void *caller, unsigned long long us);
+} bt_capture_replay_i;
+
+/**
+ * Feed a capture through the callbacks as fast as they take it
+ * @return number of records replayed; -1 if the file isn't a capture */
+int bt_capture_replay(const char* path, bt_capture_replay_i* irep,
+                      void* caller);
+
+#endif /* BT_CAPTURE_H_ */
@@ -1,13 +1,23 @@
-
 #ifndef BT_CHOKER_SEEDER_PEER_H_
 #define BT_CHOKER_SEEDER_PEER_H_
 
+/* bytes per second each upload slot beyond the first must add */
+#define BT_SEEDING_CHOKER_SLOT_STEP 2048
+
+/**
+ * Each round the fastest peers we upload to keep their slots, for as many
+ * slots as our upload keeps growing with, and one more slot goes to the
+ * interested peer that has waited longest.
+ * @param size The most peers that can be unchoked at once */
 void *bt_seeding_choker_new(const int size);
 
 void bt_seeding_choker_add_peer(void *ckr, void *peer);
 
 void bt_seeding_choker_remove_peer(void *ckr, void *peer);
 
+/**
+ * Choose who is unchoked until the next round.
+ * This is meant to be called on a timer */
 void bt_seeding_choker_decide_best_npeers(void *ckr);
 
 void bt_seeding_choker_unchoke_peer(void *ckr, void *peer);
@@ -18,6 +28,20 @@ void bt_seeding_choker_set_choker_peer_iface(void *ckr,
 
 int bt_seeding_choker_get_npeers(void *ckr);
 
+/**
+ * Stop opening slots once the peers that keep them take 90% of this.
+ * @param bytes_per_sec Upload capacity; 0 means unknown */
+void bt_seeding_choker_set_upload_capacity(void *ckr, int bytes_per_sec);
+
+/**
+ * Set how much faster each extra slot's peer must be than the step before.
+ * Defaults to BT_SEEDING_CHOKER_SLOT_STEP */
+void bt_seeding_choker_set_slot_step(void *ckr, int bytes_per_sec);
+
+/**
+ * @return number of peers unchoked by the last round */
+int bt_seeding_choker_get_nslots(void *ckr);
+
 void bt_seeding_choker_get_iface(bt_choker_i * iface);
 
 #endif /* BT_CHOKER_SEEDER_PEER_H_ */
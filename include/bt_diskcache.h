@@ -2,14 +2,51 @@
 #ifndef BT_DISKCACHE_H_
 #define BT_DISKCACHE_H_
 
+#include "bt_cache_policy.h"
+
 void bt_diskcache_set_func_log(
     void * dco,
     func_log_f log,
     void *udata
 );
 
+/**
+ * Cache between pieces and the disk
+ * Written pieces are held until the write budget's high watermark is
+ * passed, then the least recently used are flushed until the cache is
+ * under the low watermark. Pieces read from disk are held against a
+ * separate read budget. Budgets are set through the config:
+ *  diskcache_write_bytes, diskcache_read_bytes,
+ *  diskcache_high_watermark and diskcache_low_watermark (percentages).
+ * Setting diskcache_write_behind to 1 moves the flushing onto a background
+ * thread; writes then only block once the pieces being flushed take the
+ * cache over its write budget. The disk's write_block is then called from
+ * that thread, alongside read_block calls for other pieces.
+ * Read misses load diskcache_frame_bytes of the piece. The whole piece is
+ * loaded for reads spanning frames (eg. hashing) and sequential reads.
+ * Pieces longer than diskcache_split_piece_bytes are written into frames
+ * too, so that a huge piece that's partly downloaded only holds what's been
+ * written; its dirty frames are written out one by one.
+ * Buffers come from slabs sized to the budgets and are recycled on
+ * eviction; diskcache_hugepages backs the slabs with huge pages.
+ * Clean pieces are evicted according to diskcache_policy, "arc" (the
+ * default) or "lru".
+ * @return newly initialised disk cache */
 void *bt_diskcache_new() ;
 
+/**
+ * Pieces queued for write-behind are written out first */
+void bt_diskcache_free(void *dco);
+
+/**
+ * @return current configuration */
+void* bt_diskcache_get_config(void *dco);
+
+/**
+ * Evict clean pieces with this policy instead of the one named by
+ * diskcache_policy. Must be called before the cache is used */
+void bt_diskcache_set_policy(void *dco, const bt_cache_policy_i *ipol);
+
 void bt_diskcache_set_size(
     void *dco,
     const int piece_bytes_size
@@ -31,4 +68,12 @@ void bt_diskcache_disk_dump( void *dco);
 
 void bt_diskcache_set_piece_length(void* dco, int piece_length);
 
+/**
+ * @return bytes held that haven't been written to disk */
+unsigned long long bt_diskcache_get_dirty_bytes(void *dco);
+
+/**
+ * @return bytes held that match what is on disk */
+unsigned long long bt_diskcache_get_clean_bytes(void *dco);
+
 #endif /* BT_DISKCACHE_H_ */
@@ -2,12 +2,29 @@
 #ifndef BT_DISKMEM_H_
 #define BT_DISKMEM_H_
 
+/**
+ * A disk layer that keeps each piece in its own page of RAM
+ * Pages are only allocated once their piece is touched.
+ * @return newly initialised memory disk */
 void *bt_diskmem_new();
 
 void bt_diskmem_free( void *dco);
 
+/**
+ * Set the piece length. Room for 10 pieces is made; more is made as later
+ * pieces are written */
 void bt_diskmem_set_size(void *dco, const int piece_bytes_size);
 
+/**
+ * Size the page table for the whole torrent up front
+ * Call after bt_diskmem_set_size */
+void bt_diskmem_set_total_size(void *dco,
+                               const unsigned long long total_bytes);
+
+/**
+ * @return bytes of pages allocated */
+unsigned long long bt_diskmem_get_committed_bytes(void *dco);
+
 bt_blockrw_i *bt_diskmem_get_blockrw( void *dco);
 
 int bt_diskmem_write_block(
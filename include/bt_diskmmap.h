@@ -0,0 +1,37 @@
+#ifndef BT_DISKMMAP_H_
+#define BT_DISKMMAP_H_
+
+/* access patterns, matching the piece selector in use */
+enum {
+    BT_DISKMMAP_RANDOM,
+    BT_DISKMMAP_SEQUENTIAL
+};
+
+/**
+ * A disk layer that maps the payload file into memory
+ * Blocks are read straight out of the mapping, so the page cache is the
+ * only copy of the data; there's no need to put a bt_diskcache in front.
+ * @return newly initialised mmap disk */
+void *bt_diskmmap_new();
+
+/**
+ * Unmap and close the file. Unflushed writes are left to the kernel */
+void bt_diskmmap_free(void *dco);
+
+/**
+ * Open (creating it if needed) the file at path, size it to size bytes and
+ * map it
+ * @return 1 on success; otherwise 0 */
+int bt_diskmmap_open(void *dco, const char *path, unsigned long long size);
+
+void bt_diskmmap_set_size(void *dco, const int piece_bytes_size);
+
+/**
+ * Hint how pieces will be accessed
+ * Use BT_DISKMMAP_SEQUENTIAL with the sequential selector, so the kernel
+ * reads ahead aggressively; otherwise BT_DISKMMAP_RANDOM (the default) */
+void bt_diskmmap_set_access(void *dco, int access);
+
+bt_blockrw_i *bt_diskmmap_get_blockrw(void *dco);
+
+#endif /* BT_DISKMMAP_H_ */
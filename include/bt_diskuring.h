@@ -0,0 +1,31 @@
+#ifndef BT_DISKURING_H_
+#define BT_DISKURING_H_
+
+/**
+ * A disk layer that writes through io_uring
+ * Writes are copied into registered buffers and queued; they only go to
+ * the kernel when submit is called, so each bt_dm_periodic sends one batch
+ * (see bt_dm_set_disk_blockrw). Writes block only when every buffer is in
+ * use. Reads, flushes and file spans wait for outstanding writes first.
+ * If the kernel lacks io_uring, writes are made synchronously.
+ * @return newly initialised io_uring disk */
+void *bt_diskuring_new();
+
+/**
+ * Outstanding writes are finished first */
+void bt_diskuring_free(void *dco);
+
+/**
+ * Open (creating it if needed) the file at path and size it to size bytes
+ * @return 1 on success; otherwise 0 */
+int bt_diskuring_open(void *dco, const char *path, unsigned long long size);
+
+void bt_diskuring_set_size(void *dco, const int piece_bytes_size);
+
+/**
+ * @return 1 if writes go through io_uring; 0 if they are synchronous */
+int bt_diskuring_is_async(void *dco);
+
+bt_blockrw_i *bt_diskuring_get_blockrw(void *dco);
+
+#endif /* BT_DISKURING_H_ */
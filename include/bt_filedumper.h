@@ -1,4 +1,3 @@
-
 #ifndef BT_FILEDUMPER_H_
 #define BT_FILEDUMPER_H_
 
@@ -9,27 +8,39 @@ int bt_filedumper_write_block(
     const void *data);
 
 
+/**
+ * The data is valid until the calling thread's next read */
 void *bt_filedumper_read_block(
     void *flo,
     void *caller __attribute__((__unused__)),
     const bt_block_t * blk
 );
 
+/**
+ * A disk layer that lays the torrent's bytes out over its files
+ * Each block's file span is found by binary search over the files'
+ * offsets. Files are opened as blocks touch them, and only the most
+ * recently used are kept open (see bt_filedumper_set_max_fds).
+ * @return newly initialised file dumper */
 void *bt_filedumper_new();
 
+/**
+ * Close every file */
+void bt_filedumper_free(void* fl);
+
 /**
  * Add this file to the bittorrent client
  * This is used for adding new files.
+ * Files must be added in the order they appear in the torrent.
  *
  * @param fname file name
  * @param fname_len length of fname
- * @param flen length in bytes of the file
- * @return 1 on sucess; otherwise 0 */
+ * @param flen length in bytes of the file */
 void bt_filedumper_add_file(
     void* fl,
     const char *fname,
     int fname_len,
-    const int size);
+    const unsigned long long size);
 
 int bt_filedumper_get_nfiles( void * fl);
 
@@ -38,16 +49,53 @@ const char *bt_filedumper_file_get_path(
     const int idx
 );
 
+/**
+ * Find the pieces holding the file's bytes, eg. for
+ * bt_dm_set_piece_priority. An empty file has first == last
+ * @param first First piece of the file
+ * @param last One past the file's last piece
+ * @return 1 on success; otherwise 0 */
+int bt_filedumper_file_get_pieces(
+    void * fl,
+    const int idx,
+    int *first,
+    int *last
+);
+
 bt_blockrw_i *bt_filedumper_get_blockrw( void * fl);
 
 /**
  * Piece_length is required for figuring out where we are writing blocks */
 void bt_filedumper_set_piece_length( void * fl, const int piece_size);
 
+/**
+ * Files are created relative to this directory */
 void bt_filedumper_set_cwd( void * fl, const char *path);
 
+/**
+ * Allocate each file's disk space when it is first opened, so it isn't
+ * fragmented by out of order writes. On by default. Where fallocate isn't
+ * supported files are left sparse */
+void bt_filedumper_set_preallocate( void * fl, const int preallocate);
+
+/**
+ * Write through O_DIRECT, bypassing the page cache, so that pieces written
+ * once aren't cached twice. Only writes whose buffers, lengths and file
+ * offsets are multiples of 4096 bytes can go this way, eg. whole pieces
+ * flushed from bt_diskcache's slabs; the rest use the page cache. Off by
+ * default. Files where O_DIRECT isn't supported are written as usual */
+void bt_filedumper_set_direct_io( void * fl, const int direct);
+
+/**
+ * Keep at most this many files open. The default is 64 */
+void bt_filedumper_set_max_fds( void * fl, const int max_fds);
+
+/**
+ * @return number of files currently open */
+int bt_filedumper_get_nopen( void * fl);
+
 /**
  * @return total file size in bytes */
-unsigned int bt_filedumper_get_total_size(void * fl);
+unsigned long long bt_filedumper_get_total_size(void * fl);
 
 #endif /* BT_FILEDUMPER_H_ */
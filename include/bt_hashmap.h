@@ -0,0 +1,96 @@
+#ifndef BT_HASHMAP_H_
+#define BT_HASHMAP_H_
+
+/**
+ * Open addressing hashmaps with Robin Hood probing
+ * Entries live in one power of two sized array, so a lookup is usually a
+ * cache line or two. Entries may not be added or removed while iterating.
+ *
+ * bt_hashmap is a drop-in for linked_list_hashmap: keys are pointers to
+ * whatever the hash and compare functions understand. Each slot keeps its
+ * key's hash, so compare is only called on keys that are likely to match.
+ *
+ * bt_intmap is keyed by integers held in the slots, eg. a piece index or a
+ * pointer, and calls no functions while probing.
+ *
+ * As with linked_list_hashmap, NULL keys (for bt_hashmap) and NULL values
+ * aren't stored. */
+
+#include <stdint.h>
+
+typedef struct
+{
+    unsigned int cur;
+} bt_hashmap_iterator_t;
+
+/**
+ * @param initial_capacity Entries to make room for before growing
+ * @return newly initialised map */
+void* bt_hashmap_new(unsigned long (*hash)(const void *),
+                     long (*compare)(const void *, const void *),
+                     unsigned int initial_capacity);
+
+void bt_hashmap_free(void* h);
+
+/**
+ * @return number of entries */
+int bt_hashmap_count(const void* h);
+
+/**
+ * @return bytes used by the map, not counting what the entries point at */
+unsigned long bt_hashmap_get_memory(const void* h);
+
+/**
+ * @return key's value; otherwise NULL */
+void* bt_hashmap_get(const void* h, const void* key);
+
+/**
+ * Associate key with val. If an equal key is in the map its value is
+ * replaced, and the key already in the map is kept
+ * @return previous value; otherwise NULL */
+void* bt_hashmap_put(void* h, void* key, void* val);
+
+/**
+ * @return value of the key that was removed; otherwise NULL */
+void* bt_hashmap_remove(void* h, const void* key);
+
+void bt_hashmap_iterator(const void* h, bt_hashmap_iterator_t* iter);
+
+/**
+ * @return next key from iterator; NULL when there are no more */
+void* bt_hashmap_iterator_next(const void* h, bt_hashmap_iterator_t* iter);
+
+/**
+ * @return next value from iterator; NULL when there are no more */
+void* bt_hashmap_iterator_next_value(const void* h,
+                                     bt_hashmap_iterator_t* iter);
+
+/**
+ * @param initial_capacity Entries to make room for before growing
+ * @return newly initialised map */
+void* bt_intmap_new(unsigned int initial_capacity);
+
+void bt_intmap_free(void* h);
+
+int bt_intmap_count(const void* h);
+
+unsigned long bt_intmap_get_memory(const void* h);
+
+void* bt_intmap_get(const void* h, uint64_t key);
+
+/**
+ * @return previous value; otherwise NULL */
+void* bt_intmap_put(void* h, uint64_t key, void* val);
+
+/**
+ * @return value of the key that was removed; otherwise NULL */
+void* bt_intmap_remove(void* h, uint64_t key);
+
+void bt_intmap_iterator(const void* h, bt_hashmap_iterator_t* iter);
+
+/**
+ * @return next value from iterator; NULL when there are no more */
+void* bt_intmap_iterator_next_value(const void* h,
+                                    bt_hashmap_iterator_t* iter);
+
+#endif /* BT_HASHMAP_H_ */
@@ -0,0 +1,39 @@
+#ifndef BT_HASHPOOL_H_
+#define BT_HASHPOOL_H_
+
+/**
+ * Called from a worker thread once the data has been hashed
+ * @param udata The pool's udata
+ * @param job_udata The udata that was submitted with the data
+ * @param hash 20 byte sha1 of the data; NULL if the pool was freed first */
+typedef void (*func_hashpool_done_f)(void* udata, void* job_udata,
+                                     const char* hash);
+
+/**
+ * Pool of threads that sha1 hash buffers in the background
+ * @param nthreads Number of worker threads
+ * @param done Callback for completed hashes. Called on a worker thread
+ * @return newly initialised hashpool; NULL on error */
+void *bt_hashpool_new(int nthreads, void* udata, func_hashpool_done_f done);
+
+/**
+ * Stop the workers and release the pool
+ * Buffers still queued are freed without being hashed. Their done
+ * callbacks are called on this thread with a NULL hash */
+void bt_hashpool_free(void* hp);
+
+/**
+ * Queue the buffer for hashing
+ * @param data Buffer to hash. The pool takes ownership and frees it
+ * @param len Length of buffer
+ * @param job_udata Passed back to the done callback
+ * @return 1 on success; otherwise 0 */
+int bt_hashpool_submit(void* hp, char* data, int len, void* job_udata);
+
+/**
+ * The pool as a bt_hasher_i. Buffers submitted through it go to the done
+ * callback they were submitted with, rather than the pool's
+ * @return hasher interface for the pool */
+bt_hasher_i *bt_hashpool_get_hasher(void* hp);
+
+#endif /* BT_HASHPOOL_H_ */
@@ -0,0 +1,27 @@
+#ifndef BT_HISTOGRAM_H_
+#define BT_HISTOGRAM_H_
+
+/**
+ * Log-linear histogram of bt_histogram_t, as HdrHistogram does it
+ * Each power of two is split into BT_HISTOGRAM_SUB_BUCKETS buckets, so a
+ * value is known to within a quarter of itself. Values under
+ * BT_HISTOGRAM_SUB_BUCKETS get a bucket each. Values too big for the last
+ * bucket are counted in it.
+ * A zeroed bt_histogram_t is empty. Not thread safe */
+
+/**
+ * Count the value */
+void bt_histogram_add(bt_histogram_t* h, unsigned long long v);
+
+/**
+ * @param pct Percent of the values, from 0 to 100
+ * @return highest value in the bucket holding the pct'th value; 0 if
+ *  empty. Never more than the largest value added */
+unsigned long long bt_histogram_percentile(const bt_histogram_t* h,
+                                           double pct);
+
+/**
+ * @return average of the values; 0 if empty */
+unsigned long long bt_histogram_mean(const bt_histogram_t* h);
+
+#endif /* BT_HISTOGRAM_H_ */
@@ -0,0 +1,46 @@
+#ifndef BT_IOSCHED_H_
+#define BT_IOSCHED_H_
+
+/**
+ * Disk I/O scheduler
+ * Sits between the pieces (or a bt_diskcache) and the disk. Writes are
+ * copied and queued; peers' requests, seen through prefetch_block, queue
+ * reads. Each submit (ie. each bt_dm_periodic, see bt_dm_set_disk_blockrw)
+ * serves queued reads first, then writes, each in elevator order by disk
+ * offset and within a per tick byte budget. Budgets are set through the
+ * config:
+ *  iosched_read_bytes, iosched_write_bytes: bytes moved per submit
+ *  iosched_queue_bytes: queued writes held before write_block starts
+ *  writing them out itself
+ * Reads of blocks that weren't queued go straight to the disk, unless the
+ * block is waiting to be written, and so never wait behind bulk writes.
+ * Data returned from a queued read is valid until the next submit.
+ * @return newly initialised scheduler */
+void *bt_iosched_new();
+
+/**
+ * Queued writes are written out first */
+void bt_iosched_free(void *ios);
+
+/**
+ * @return current configuration */
+void* bt_iosched_get_config(void *ios);
+
+void bt_iosched_set_piece_length(void *ios, int piece_length);
+
+/**
+ * Set the blockrw that we want to use to write to disk */
+void bt_iosched_set_disk_blockrw(void *ios, bt_blockrw_i * irw,
+                                 void *irw_data);
+
+bt_blockrw_i *bt_iosched_get_blockrw(void *ios);
+
+/**
+ * @return bytes waiting to be written */
+unsigned long long bt_iosched_get_queued_write_bytes(void *ios);
+
+/**
+ * @return bytes waiting to be read */
+unsigned long long bt_iosched_get_queued_read_bytes(void *ios);
+
+#endif /* BT_IOSCHED_H_ */
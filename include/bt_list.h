@@ -0,0 +1,45 @@
+#ifndef BT_LIST_H_
+#define BT_LIST_H_
+
+#include <stddef.h>
+
+/**
+ * Intrusive doubly linked list
+ * The links live inside the items, so joining and leaving a list is O(1)
+ * and never allocates. A list is a bt_list_t head that links to itself
+ * when empty. An item that isn't on a list has NULL links. */
+typedef struct bt_list_s bt_list_t;
+
+struct bt_list_s
+{
+    bt_list_t *prev, *next;
+};
+
+/**
+ * @return the item that link is the member of */
+#define bt_list_item(link, type, member) \
+    ((type*)((char*)(link) - offsetof(type, member)))
+
+void bt_list_init(bt_list_t* head);
+
+/**
+ * @return 1 if the list has no items */
+int bt_list_empty(const bt_list_t* head);
+
+/**
+ * @return 1 if the item is on a list */
+int bt_list_linked(const bt_list_t* link);
+
+/**
+ * Add an item to the back of the list. The item mustn't be on a list */
+void bt_list_push_tail(bt_list_t* head, bt_list_t* link);
+
+/**
+ * Take the item off whichever list it's on; does nothing if it's on none */
+void bt_list_remove(bt_list_t* link);
+
+/**
+ * @return link of the item taken off the front; NULL if the list is empty */
+bt_list_t* bt_list_pop_head(bt_list_t* head);
+
+#endif /* BT_LIST_H_ */
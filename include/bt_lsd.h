@@ -0,0 +1,63 @@
+#ifndef BT_LSD_H_
+#define BT_LSD_H_
+
+/* the multicast group announces are sent to */
+#define BT_LSD_GROUP "239.192.152.143"
+#define BT_LSD_PORT 6771
+
+/* ms between a torrent's announces, and the least between datagrams */
+#define BT_LSD_INTERVAL_MS 300000
+#define BT_LSD_GAP_MS 1000
+
+/**
+ * Local service discovery (BEP 14)
+ * Announces our torrents to the LAN's multicast group, and hears the
+ * announces of peers on the LAN. The multicast socket is the caller's:
+ * what arrives on it goes to bt_lsd_dispatch_from_buffer. Peers found are
+ * best added with bt_dm_add_peer and then bt_dm_set_peer_local. */
+typedef struct
+{
+    /* send an announce to BT_LSD_GROUP:BT_LSD_PORT
+     * @return 0 if it wasn't sent */
+    int (*send)(void* udata, const char* buf, unsigned int len);
+
+    /* a peer on the LAN has one of our torrents
+     * @param infohash 20 bytes */
+    void (*found_peer)(void* udata, const char* infohash, const char* ip,
+                       int port);
+} bt_lsd_cbs_t;
+
+/**
+ * @param port Our peer wire listen port, which is what's announced
+ * @return newly initialised announcer */
+void* bt_lsd_new(int port);
+
+void bt_lsd_free(void* lsd);
+
+void bt_lsd_set_cbs(void* lsd, bt_lsd_cbs_t* cb, void* udata);
+
+/**
+ * Start announcing a torrent; it's announced by the next bt_lsd_periodic
+ * @param infohash 20 bytes
+ * @return 1 on success; 0 if it's been added already */
+int bt_lsd_add_torrent(void* lsd, const char* infohash);
+
+/**
+ * @return 1 on success; 0 if it wasn't added */
+int bt_lsd_remove_torrent(void* lsd, const char* infohash);
+
+/**
+ * Announce the torrents that are due. Each is announced every
+ * BT_LSD_INTERVAL_MS, several to a datagram, and datagrams go out at most
+ * every BT_LSD_GAP_MS so that a LAN of clients doesn't flood itself
+ * @return number of datagrams sent */
+int bt_lsd_periodic(void* lsd, unsigned long long now_ms);
+
+/**
+ * Read an announce. Our own, which multicast loops back, are ignored
+ * @param ip Address the datagram came from
+ * @return number of peers found; -1 if it isn't an announce */
+int bt_lsd_dispatch_from_buffer(void* lsd, const char* buf, unsigned int len,
+                                const char* ip);
+
+#endif /* BT_LSD_H_ */
@@ -0,0 +1,90 @@
+#ifndef BT_PEERHISTORY_H_
+#define BT_PEERHISTORY_H_
+
+/* ms we wait before redialling a peer; doubled with each failure */
+#define BT_PEERHISTORY_BACKOFF_MS 5000
+#define BT_PEERHISTORY_MAX_BACKOFF_MS (30 * 60 * 1000)
+
+/**
+ * What we remember about a peer after it's gone */
+typedef struct
+{
+    /* connects that failed, or were useless, since the last good one */
+    int failures;
+
+    /* times it was the only peer behind a piece that failed validation */
+    int blacklisted;
+
+    /* payload bytes over all of its connections */
+    unsigned long long downloaded;
+    unsigned long long uploaded;
+
+    /* fastest it has sent to us, in bytes per second */
+    int drate;
+
+    /* ms we last heard from it */
+    unsigned long long last_seen_ms;
+
+    /* ms before which we won't dial it */
+    unsigned long long retry_ms;
+} bt_peerhistory_entry_t;
+
+/**
+ * Peers are keyed by address and port. The least recently used are
+ * forgotten once there are more than max_peers
+ * @return newly initialised history */
+void *bt_peerhistory_new(unsigned int max_peers);
+
+void bt_peerhistory_free(void* h);
+
+/**
+ * @return the peer's history; NULL if we don't remember it */
+bt_peerhistory_entry_t* bt_peerhistory_get(void* h,
+                                           const char *ip, int ip_len,
+                                           int port);
+
+/**
+ * Our connect failed. The peer isn't dialled again until after a backoff
+ * that doubles with each failure */
+void bt_peerhistory_connect_failed(void* h, const char *ip, int ip_len,
+                                   int port, unsigned long long now_ms);
+
+/**
+ * We're connected. This doesn't forgive failures until the connection has
+ * been worth something; see bt_peerhistory_disconnected */
+void bt_peerhistory_connected(void* h, const char *ip, int ip_len, int port,
+                              unsigned long long now_ms);
+
+/**
+ * The connection has gone. Connections that moved no payload count as a
+ * failure
+ * @param drate The connection's download rate when it went */
+void bt_peerhistory_disconnected(void* h, const char *ip, int ip_len,
+                                 int port,
+                                 unsigned long long downloaded,
+                                 unsigned long long uploaded,
+                                 int drate,
+                                 unsigned long long now_ms);
+
+/**
+ * The peer sent us a piece that failed validation */
+void bt_peerhistory_blacklisted(void* h, const char *ip, int ip_len,
+                                int port);
+
+/**
+ * @return 1 if the peer isn't backing off; otherwise 0 */
+int bt_peerhistory_may_connect(void* h, const char *ip, int ip_len, int port,
+                               unsigned long long now_ms);
+
+/**
+ * Peers that have been fast for us score highest
+ * @return score; 1 for peers we don't know, 0 for peers that have sent us
+ *  bad pieces */
+unsigned int bt_peerhistory_score(void* h, const char *ip, int ip_len,
+                                  int port);
+
+/**
+ * @return number of peers remembered */
+int bt_peerhistory_count(void* h);
+
+#endif /* BT_PEERHISTORY_H_ */
@@ -3,6 +3,11 @@
 
 int bt_peermanager_contains(void *pm, const char *ip, const int port);
 
+/**
+ * @param addr Packed by bt_addr_pack
+ * @return 1 if a peer with the address is within the manager */
+int bt_peermanager_contains_addr(void *pm, const unsigned char *addr);
+
 void *bt_peermanager_conn_ctx_to_peer(void * pm, void* conn_ctx);
 
 bt_peer_t *bt_peermanager_add_peer(void *pm,
@@ -18,12 +23,37 @@ void bt_peermanager_forall(
         void* udata,
         void (*run)(void* caller, void* peer, void* udata));
 
+/**
+ * Run over the shard's share of the peers. Together the nshards shards
+ * cover every peer once. Peers mustn't be added or removed meanwhile */
+void bt_peermanager_forall_shard(
+        void* pm,
+        void* caller,
+        void* udata,
+        int shard,
+        int nshards,
+        void (*run)(void* caller, void* peer, void* udata));
+
 void* bt_peermanager_new(void* caller);
 
 void bt_peermanager_set_config(void* pm, void* cfg);
 
 int bt_peermanager_count(void* pm);
 
+/**
+ * Peers outlive the pieces they sent us blocks of, so check before touching
+ * one. This is a linear search
+ * @return 1 if the peer hasn't been removed */
+int bt_peermanager_has_peer(void* pm, const bt_peer_t* peer);
+
 void* bt_peermanager_get_peer_from_pc(void* pm, const void* pc);
 
+/**
+ * Set the peer's network context, keeping the conn_ctx index up to date */
+void bt_peermanager_set_conn_ctx(void* pm, bt_peer_t* peer, void* conn_ctx);
+
+/**
+ * Set the peer's connection, keeping the pc index up to date */
+void bt_peermanager_set_pc(void* pm, bt_peer_t* peer, void* pc);
+
 #endif /* BT_PEERMANAGER_H */
@@ -10,12 +10,55 @@ bt_piece_t *bt_piece_new(
 
 void bt_piece_free(bt_piece_t * me);
 
+/**
+ * Allocate npieces pieces at once, eg. a torrent's whole piece set
+ * Pieces made this way are freed together with bt_piece_free_many, never
+ * with bt_piece_free
+ * @return the first piece; see bt_piece_nth for the rest */
+bt_piece_t *bt_piece_new_many(const int npieces);
+
+/**
+ * @return the nth piece of those from bt_piece_new_many */
+bt_piece_t *bt_piece_nth(bt_piece_t * first, const int n);
+
+void bt_piece_free_many(bt_piece_t * first, const int npieces);
+
 /**
  * @param sha1sum The 20 byte hash that describes the content of this piece */
 void bt_piece_set_hash(bt_piece_t * me, const char *sha1sum);
 
+/**
+ * Use this hash without copying it, eg. straight out of
+ * bt_piece_info_t.pieces_hash
+ * @param sha1sum The 20 byte hash. Must outlive the piece */
+void bt_piece_set_hash_ref(bt_piece_t * me, const char *sha1sum);
+
 void bt_piece_set_size(bt_piece_t * me, const unsigned int piece_bytes_size);
 
+/**
+ * Make this a v2 piece (BEP 52). It's validated against its merkle root
+ * rather than a SHA1, and each block is hashed with SHA256 as it arrives,
+ * so validation doesn't read the piece back.
+ * @param root The 32 byte root of the piece's subtree, eg. from the piece
+ *  layers. Must outlive the piece
+ * @param width Leaves the subtree spans: piece_length / BT_BLOCK_SIZE, or
+ *  for a file smaller than a piece the next power of two of its blocks */
+void bt_piece_set_root_ref(bt_piece_t * me, const char *root,
+                           unsigned int width);
+
+/**
+ * @return the v2 merkle root; NULL for a v1 piece */
+const char *bt_piece_get_root(bt_piece_t * me);
+
+/**
+ * Give a v2 piece the SHA256 of each of its blocks, eg. from a peer's
+ * hashes message. Once they're known a block that doesn't match is refused
+ * by bt_piece_write_block, and blocks we already had that don't match are
+ * forgotten.
+ * @param leaves 32 byte hash of each block, concatenated
+ * @return 1 if the leaves make the piece's root; otherwise 0 */
+int bt_piece_set_block_hashes(bt_piece_t * me, const char *leaves);
+
 /**
  * @param hash is expected to be 20 chars long
  * @return 0 on error */
@@ -55,16 +98,71 @@ int bt_piece_is_valid(bt_piece_t * me);
 
 void bt_piece_drop_download_progress(bt_piece_t *me);
 
+/**
+ * The piece failed validation. Keep each block's hash and sender, and
+ * forget only the blocks that suspects sent us, so that only those are
+ * downloaded again. Once the piece validates, peers whose blocks have
+ * changed since are handed out by bt_piece_pop_culprit.
+ * If blocks were kept and the piece failed again, every block is
+ * forgotten; so is every block if there are no suspects.
+ * I/O performed.
+ * @param is_suspect Returns 1 if the peer may have sent us bad data
+ * @return number of blocks forgotten; 0 if we don't know who sent which
+ *  block, and bt_piece_drop_download_progress should be used instead */
+int bt_piece_drop_blocks(bt_piece_t *me,
+                         int (*is_suspect)(void* udata, void* peer),
+                         void* udata);
+
+/**
+ * @return a peer that sent us a bad block; NULL if there are no more */
+void* bt_piece_pop_culprit(bt_piece_t *me);
+
 /**
  * Build the following request block for the peer, from this piece.
  * Assume that we want to complete the piece by going through the piece in 
- * sequential blocks. */
+ * sequential blocks.
+ * Once the piece is in flight, ie. a block has been polled, the block is
+ * claimed atomically; threads polling the same piece get different blocks.
+ * This holds until a range that isn't block aligned is written or given
+ * back, after which the piece needs the caller's lock again */
 void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request);
 
+/**
+ * The block is free to be polled again. Atomic, as above */
 void bt_piece_giveback_block(bt_piece_t * me, bt_block_t * b);
 
+/**
+ * Find a block we've requested but haven't received, at or after offset.
+ * In endgame these are requested again from other peers
+ * @return 1 if there is one; otherwise 0 */
+int bt_piece_get_missing_block(bt_piece_t * me, unsigned int offset,
+                               bt_block_t * b);
+
+/**
+ * @return 1 if we've received the whole block; otherwise 0 */
+int bt_piece_have_block(bt_piece_t * me, const bt_block_t * b);
+
+/**
+ * Mark the piece complete without validating it, eg. from resume data
+ * A complete piece's download state is released, as bt_piece_validate
+ * does */
 void bt_piece_set_complete(bt_piece_t * me, int yes);
 
+/**
+ * How many of a set of pieces are complete and downloaded */
+typedef struct
+{
+    int ncompleted;
+    int ndownloaded;
+} bt_piece_counts_t;
+
+/**
+ * Count the piece in counts from now on, and no longer in those it was
+ * counted in before. The counts follow the piece as it completes, so they
+ * can be read without looking at every piece
+ * @param counts May be NULL */
+void bt_piece_set_counts(bt_piece_t * me, bt_piece_counts_t * counts);
+
 void bt_piece_set_idx(bt_piece_t * me, const int idx);
 
 int bt_piece_get_idx(bt_piece_t * me);
@@ -86,6 +184,20 @@ void *bt_piece_get_data(bt_piece_t * me);
  * @return 1 if valid, -1 if invalid, otherwise 0 */
 int bt_piece_validate(bt_piece_t* me);
 
+/**
+ * Blocks are hashed as they arrive in order; a v2 piece's blocks are hashed
+ * as they arrive in any order. When this is true validation doesn't need to
+ * read the piece back.
+ * @return 1 if the running hash or the leaves cover the whole piece;
+ *  otherwise 0 */
+int bt_piece_is_hashed(bt_piece_t * me);
+
+/**
+ * Validate the piece against a hash that was calculated elsewhere
+ * @param hash 20 byte sha1 of the piece's data
+ * @return 1 if valid, -1 if invalid */
+int bt_piece_validate_hash(bt_piece_t* me, const char* hash);
+
 /**
  * I/O performed.
  * @return size of piece */
@@ -95,20 +207,62 @@ int bt_piece_get_size(bt_piece_t * me);
  * @return mtime */
 unsigned int bt_piece_get_mtime(bt_piece_t * me);
 
+/**
+ * @return bytes held by the piece, including blocks waiting to be hashed */
+unsigned long bt_piece_get_memory(bt_piece_t * me);
+
 void bt_piece_set_mtime(bt_piece_t * me, unsigned int mtime);
 
+/**
+ * @return number of blocks the piece's progress is kept in */
+unsigned int bt_piece_get_nblocks(bt_piece_t * me);
+
+/**
+ * Which blocks of an in flight piece have been downloaded
+ * @param bits NULL, or bt_piece_get_nblocks / 8 + 1 bytes; block b is bit
+ *  b % 8 of bits[b / 8]
+ * @return number of blocks downloaded; 0 if the piece isn't in flight; -1
+ *  if progress isn't kept in whole blocks */
+int bt_piece_get_block_progress(bt_piece_t * me, unsigned char *bits);
+
+/**
+ * Take blocks as downloaded without them being written, eg. blocks that
+ * reached the disk before a restart. The blocks weren't hashed as they
+ * arrived, so validation reads the piece back
+ * @param bits As for bt_piece_get_block_progress
+ * @return 1 on success; 0 if nblocks doesn't match or it's complete */
+int bt_piece_set_block_progress(bt_piece_t * me, const unsigned char *bits,
+                                unsigned int nblocks);
+
+/**
+ * Ask the disk to write back whatever it holds for the piece
+ * @return 1 on success, or if the disk can't flush; otherwise 0 */
+int bt_piece_flush(bt_piece_t * me);
+
 /**
  * I/O performed.
  * @return data that the block represents */
 void *bt_piece_read_block(bt_piece_t *pceo, void *caller, const bt_block_t * b);
 
+/**
+ * Find the file region holding this downloaded block
+ * @return 1 if fd and offset are set; 0 if the disk can't provide one */
+int bt_piece_get_block_file(bt_piece_t *me, const bt_block_t * b,
+                            int *fd, unsigned long long *offset);
+
+/**
+ * Tell the disk this downloaded block will be read soon */
+void bt_piece_prefetch_block(bt_piece_t *me, const bt_block_t * b);
+
 #define BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED 2
 #define BT_PIECE_WRITE_BLOCK_SUCCESS 1
+#define BT_PIECE_WRITE_BLOCK_INVALID -1
 
 /**
  * Add this data to the piece
  * I/O performed.
- * @return 1 on success, 2 if now completely downloaded, otherwise 0 */
+ * @return 1 on success, 2 if now completely downloaded, -1 if the block
+ *  doesn't match its v2 leaf and was refused, otherwise 0 */
 int bt_piece_write_block(
     bt_piece_t *me,
     void *caller,
@@ -116,6 +270,16 @@ int bt_piece_write_block(
     const void *b_data,
     void* peer);
 
+/**
+ * Borrow the memory the disk will keep this block in, so it can be received
+ * straight into it. Write the block from the frame with
+ * bt_piece_write_block, or give it back with bt_piece_drop_write_frame
+ * @return frame; NULL if the block has to be copied */
+void *bt_piece_get_write_frame(bt_piece_t *me, const bt_block_t * b);
+
+void bt_piece_drop_write_frame(bt_piece_t *me, const bt_block_t * b,
+                               void *frame);
+
 /**
  * Write the block to the byte stream
  * I/O performed.
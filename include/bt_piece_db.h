@@ -38,10 +38,10 @@ void bt_piecedb_remove(bt_piecedb_t * db, int idx);
 
 /**
  * @return number of pieces downloaded */
-int bt_piecedb_get_num_completed(bt_piecedb_t * db);
+int bt_piecedb_get_num_downloaded(bt_piecedb_t * db);
 
 /**
- * @return number of pieces downloaded */
+ * @return number of pieces complete */
 int bt_piecedb_get_num_completed(bt_piecedb_t * db);
 
 /**
@@ -54,7 +54,17 @@ void bt_piecedb_print_pieces_downloaded(bt_piecedb_t * db);
 
 /**
  * Increase total file size by this file's size */
-void bt_piecedb_increase_piece_space(bt_piecedb_t* db, const int size);
+void bt_piecedb_increase_piece_space(bt_piecedb_t* db,
+                                     const unsigned long long size);
+
+/**
+ * Set the size of all the files together; the last piece is sized to fit */
+void bt_piecedb_set_tot_file_size(bt_piecedb_t * db,
+                                  const unsigned long long size);
+
+/**
+ * @return the size of all the files together, in bytes */
+unsigned long long bt_piecedb_get_tot_file_size(bt_piecedb_t * db);
 
 /**
  * @return 1 if all complete, 0 otherwise */
@@ -71,4 +81,16 @@ int bt_piecedb_add_with_hash_and_size(bt_piecedb_t * db,
 
 int bt_piecedb_add_at_idx(bt_piecedb_t * db, unsigned int npieces, int idx);
 
+/**
+ * Add every piece described by info
+ * The pieces are made with one allocation (see bt_piece_new_many).
+ * Pieces reference info->pieces_hash rather than copying it, so the buffer
+ * (which may be mmap'd from the .torrent) must outlive the database.
+ * The last piece is sized to fit the total file size, when one is set.
+ * v2 roots are referenced too, each spanning a whole piece's leaves; a
+ * file's last piece only lines up with the torrent's for a single file, so
+ * other layouts set their pieces' roots with bt_piece_set_root_ref.
+ * @return idx of the first piece, otherwise -1 on error */
+int bt_piecedb_add_from_info(bt_piecedb_t * db, const bt_piece_info_t* info);
+
 #endif /* BT_PIECE_DB_H */
@@ -0,0 +1,41 @@
+#ifndef BT_RESUME_H_
+#define BT_RESUME_H_
+
+/**
+ * Fast resume record
+ * Remembers which pieces were complete so that a restart doesn't have to
+ * rehash the whole payload, and which blocks of pieces in flight had been
+ * received so that they aren't downloaded again. Pieces are only trusted
+ * if the files backing them are unchanged since the record was written.
+ * @return newly initialised resume record */
+void *bt_resume_new();
+
+void bt_resume_free(void* r);
+
+/**
+ * Add a file that backs the torrent's data
+ * Files must be added in torrent order, so that byte ranges can be mapped to
+ * pieces.
+ * @param path Location of file on disk
+ * @param size Length in bytes of the file within the torrent */
+void bt_resume_add_file(void* r, const char* path, const unsigned long size);
+
+/**
+ * Write the record to disk
+ * Complete pieces and pieces in flight are flushed first; pieces that
+ * can't be flushed aren't kept. The file is written to a temporary path and
+ * renamed into place.
+ * @return 1 on success; otherwise 0 */
+int bt_resume_save(void* r, const char* path, const char* infohash,
+                   bt_piecedb_i* ipdb, void* pdb,
+                   int npieces, int piece_len);
+
+/**
+ * Read the record from disk and mark pieces that can be trusted as complete
+ * Nothing is restored if the record belongs to a different torrent.
+ * @return number of pieces restored; -1 on error */
+int bt_resume_load(void* r, const char* path, const char* infohash,
+                   bt_piecedb_i* ipdb, void* pdb,
+                   int npieces, int piece_len);
+
+#endif /* BT_RESUME_H_ */
@@ -0,0 +1,37 @@
+#ifndef BT_RING_H_
+#define BT_RING_H_
+
+/**
+ * Bounded multi-producer/single-consumer ring
+ * Items are copied into and out of the ring by value. Any number of threads
+ * may offer concurrently; only one thread may poll or drain.
+ * @param size Number of slots. Rounded up to the next power of two
+ * @param item_size Size in bytes of each item
+ * @return newly initialised ring */
+void *bt_ring_new(unsigned int size, unsigned int item_size);
+
+void bt_ring_free(void* r);
+
+/**
+ * Copy item into the ring. Safe to call from any thread
+ * @return 1 on success; 0 if the ring is full */
+int bt_ring_offer(void* r, const void* item);
+
+/**
+ * Copy the oldest item out of the ring. Consumer thread only
+ * @return 1 if an item was polled; otherwise 0 */
+int bt_ring_poll(void* r, void* item);
+
+/**
+ * Consume every item that was published before this call. Consumer thread only
+ * The producer position is read once, so items offered while draining are
+ * left for the next drain.
+ * @param cb Called for each item, in order
+ * @return number of items consumed */
+int bt_ring_drain(void* r, void* udata, void (*cb)(void* udata, void* item));
+
+/**
+ * @return approximate number of items in the ring */
+int bt_ring_count(void* r);
+
+#endif /* BT_RING_H_ */
@@ -0,0 +1,73 @@
+#ifndef BT_SELECTOR_AUTO_H
+#define BT_SELECTOR_AUTO_H
+
+#include <stdint.h>
+
+/* pieces picked at random before switching to rarest first */
+#define BT_AUTO_SELECTOR_RANDOM_FIRST 4
+
+/**
+ * Random first for the first few pieces, then rarest first, then endgame
+ * once every piece has been polled.
+ * In endgame pieces are polled again, so blocks can be requested from more
+ * than one peer. Endgame needs npieces; if it's 0 it is taken from the
+ * first bitfield we're told about */
+void *bt_auto_selector_new(int npieces);
+
+void bt_auto_selector_free(void *r);
+
+/**
+ * Add this piece back to the selector */
+void bt_auto_selector_giveback_piece(void *r, void* peer, int piece_idx);
+
+/**
+ * Notify selector that we have this piece */
+void bt_auto_selector_have_piece(void *r, int piece_idx);
+
+void bt_auto_selector_remove_peer(void *r, void *peer);
+
+void bt_auto_selector_add_peer(void *r, void *peer);
+
+/**
+ * Let us know that there is a peer who has this piece */
+void bt_auto_selector_peer_have_piece(void *r, void *peer, int piece_idx);
+
+/**
+ * Let us know about a peer's whole bitfield */
+void bt_auto_selector_peer_have_bitfield(void *r, void *peer,
+                                         const uint64_t* words, int npieces);
+
+/**
+ * From now on read the peer's pieces from these words */
+void bt_auto_selector_peer_share_pieces(void *r, void *peer,
+                                        const uint64_t* words, int npieces);
+
+int bt_auto_selector_get_npeers(void *r);
+
+int bt_auto_selector_get_npieces(void *r);
+
+/**
+ * @return bytes held by the selector */
+unsigned long bt_auto_selector_get_memory(void *r);
+
+/**
+ * How widely the peers hold the torrent's pieces */
+void bt_auto_selector_get_availability_stats(void *r, bt_availability_t* a);
+
+/**
+ * Set how many pieces we need before random first gives way to rarest first */
+void bt_auto_selector_set_random_first(void *r, int npieces);
+
+/**
+ * @return 1 if every piece we don't have has been polled; otherwise 0 */
+int bt_auto_selector_is_endgame(void *r);
+
+/**
+ * Poll best piece from peer
+ * In endgame this is a piece that has been polled already
+ * @param r Auto selector object
+ * @param peer Best piece in context of this peer
+ * @return idx of piece which is best; otherwise -1 */
+int bt_auto_selector_poll_best_piece(void *r, const void *peer);
+
+#endif /* BT_SELECTOR_AUTO_H */
@@ -1,8 +1,16 @@
 #ifndef BT_SELECTOR_RANDOM_H
 #define BT_SELECTOR_RANDOM_H
 
+#include <stdint.h>
+
+/**
+ * Candidates are the pieces a peer has that aren't polled yet. Polling
+ * scans the peer's pieces against the polled pieces a word at a time,
+ * starting from a random piece */
 void *bt_random_selector_new(int npieces);
 
+void bt_random_selector_free(void *r);
+
 /**
  * Add this piece back to the selector.
  * This is usually when we want to make the piece a candidate again
@@ -28,10 +36,20 @@ void bt_random_selector_add_peer(void *r, void *peer);
  */
 void bt_random_selector_peer_have_piece(void *r, void *peer, int piece_idx);
 
+/**
+ * Let us know about a peer's whole bitfield */
+void bt_random_selector_peer_have_bitfield(void *r, void *peer,
+                                           const uint64_t* words,
+                                           int npieces);
+
 int bt_random_selector_get_npeers(void *r);
 
 int bt_random_selector_get_npieces(void *r);
 
+/**
+ * @return bytes held by the selector */
+unsigned long bt_random_selector_get_memory(void *r);
+
 /**
  * Poll best piece from peer
  * @param r random object
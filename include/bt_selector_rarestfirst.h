@@ -1,8 +1,12 @@
 #ifndef BT_SELECTOR_RARESTFIRST_H
 #define BT_SELECTOR_RARESTFIRST_H
 
+#include <stdint.h>
+
 void *bt_rarestfirst_selector_new(int npieces);
 
+void bt_rarestfirst_selector_free(void *r);
+
 /**
  * Add this piece back to the selector */
 void bt_rarestfirst_selector_giveback_piece(void *r, void* peer, int piece_idx);
@@ -19,11 +23,43 @@ void bt_rarestfirst_selector_add_peer(void *r, void *peer);
 void bt_rarestfirst_selector_peer_have_piece(void *r, void *peer,
                                                       int piece_idx);
 
+/**
+ * Let us know of all the pieces a peer has at once
+ * @param words Piece i is bit i%64 of words[i/64] */
+void bt_rarestfirst_selector_peer_have_bitfield(void *r, void *peer,
+                                                const uint64_t* words,
+                                                int npieces);
+
+/**
+ * Read the peer's pieces from these words rather than keeping a copy
+ * @param words Piece i is bit i%64 of words[i/64]; valid until remove_peer */
+void bt_rarestfirst_selector_peer_share_pieces(void *r, void *peer,
+                                               const uint64_t* words,
+                                               int npieces);
+
 int bt_rarestfirst_selector_get_npeers(void *r);
 
 
 int bt_rarestfirst_selector_get_npieces(void *r);
 
+/**
+ * @return bytes held by the selector */
+unsigned long bt_rarestfirst_selector_get_memory(void *r);
+
+/**
+ * @return number of peers we know have this piece */
+int bt_rarestfirst_selector_get_availability(void *r, int piece_idx);
+
+/**
+ * How widely the peers hold the torrent's pieces */
+void bt_rarestfirst_selector_get_availability_stats(void *r,
+                                                   bt_availability_t* a);
+
+/**
+ * @return 1 if we've been told the peer has this piece; otherwise 0 */
+int bt_rarestfirst_selector_peer_has_piece(void *r, const void *peer,
+                                           int piece_idx);
+
 /**
  * Poll best piece from peer,
  * @param r Rarestfirst object
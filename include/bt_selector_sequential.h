@@ -25,6 +25,10 @@ int bt_sequential_selector_get_npeers(void *r);
 
 int bt_sequential_selector_get_npieces(void *r);
 
+/**
+ * @return bytes held by the selector */
+unsigned long bt_sequential_selector_get_memory(void *r);
+
 /**
  * Poll best piece from peer
  * @param r sequential object
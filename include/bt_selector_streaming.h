@@ -0,0 +1,83 @@
+#ifndef BT_SELECTOR_STREAMING_H
+#define BT_SELECTOR_STREAMING_H
+
+#include <stdint.h>
+
+/**
+ * Pieces in a window after the read cursor go first, to the fastest peers.
+ * Everything else is polled rarest first */
+void *bt_streaming_selector_new(int npieces);
+
+void bt_streaming_selector_free(void *r);
+
+/**
+ * Add this piece back to the selector */
+void bt_streaming_selector_giveback_piece(void *r, void* peer, int piece_idx);
+
+/**
+ * Notify selector that we have this piece */
+void bt_streaming_selector_have_piece(void *r, int piece_idx);
+
+void bt_streaming_selector_remove_peer(void *r, void *peer);
+
+void bt_streaming_selector_add_peer(void *r, void *peer);
+
+/**
+ * Let us know that there is a peer who has this piece */
+void bt_streaming_selector_peer_have_piece(void *r, void *peer, int piece_idx);
+
+/**
+ * Let us know about a peer's whole bitfield */
+void bt_streaming_selector_peer_have_bitfield(void *r, void *peer,
+                                              const uint64_t* words,
+                                              int npieces);
+
+/**
+ * From now on read the peer's pieces from these words */
+void bt_streaming_selector_peer_share_pieces(void *r, void *peer,
+                                             const uint64_t* words,
+                                             int npieces);
+
+int bt_streaming_selector_get_npeers(void *r);
+
+int bt_streaming_selector_get_npieces(void *r);
+
+/**
+ * @return bytes held by the selector */
+unsigned long bt_streaming_selector_get_memory(void *r);
+
+/**
+ * How widely the peers hold the torrent's pieces */
+void bt_streaming_selector_get_availability_stats(void *r, bt_availability_t* a);
+
+/**
+ * Move the read cursor; the window starts at this piece */
+void bt_streaming_selector_set_cursor(void *r, int piece_idx);
+
+/**
+ * Set how many pieces from the cursor are in the window */
+void bt_streaming_selector_set_window(void *r, int npieces);
+
+/**
+ * Size the window to what will be read within the deadline
+ * @param ms Time to the deadline
+ * @param bytes_per_sec Rate the payload is read at
+ * @param piece_len Size of a piece */
+void bt_streaming_selector_set_deadline(void *r, unsigned int ms,
+                                        unsigned int bytes_per_sec,
+                                        unsigned int piece_len);
+
+/**
+ * Tell us how fast the peer is sending to us, eg. its download rate.
+ * The fastest peers are given the pieces in the window */
+void bt_streaming_selector_set_peer_rate(void *r, void *peer,
+                                         unsigned int rate);
+
+/**
+ * Poll best piece from peer
+ * @param r Streaming selector object
+ * @param peer Best piece in context of this peer
+ * @return idx of piece which is best; otherwise -1 */
+int bt_streaming_selector_poll_best_piece(void *r, const void *peer);
+
+#endif /* BT_SELECTOR_STREAMING_H */
@@ -0,0 +1,115 @@
+#ifndef BT_SESSION_H_
+#define BT_SESSION_H_
+
+/**
+ * Many torrents run on one loop, sharing the limits set through the
+ * session's config:
+ *  max_connections, max_upload_rate and max_download_rate (bytes per
+ *  second) cover every torrent; 0 means unlimited.
+ *  diskcache_write_bytes and diskcache_read_bytes are split evenly between
+ *  the disk caches added to the session.
+ *  max_memory (bytes) is split evenly between the torrents; 0 means
+ *  unlimited. See bt_dm_set_memory_share.
+ * Each torrent's own limits still apply within the session's.
+ * @return newly initialised session */
+void *bt_session_new();
+
+/**
+ * The torrents and disk caches aren't released */
+void bt_session_free(void* s);
+
+/**
+ * @return current configuration */
+void* bt_session_get_config(void* s);
+
+/**
+ * Run the torrent from bt_session_periodic, within the session's limits.
+ * The torrent's "infohash" must be set beforehand
+ * @return 1 on success; 0 if a torrent with the infohash is already added */
+int bt_session_add_torrent(void* s, bt_dm_t* dm);
+
+/**
+ * Connections handed to the torrent are no longer routed to it
+ * @return 1 on success; 0 if the torrent wasn't added */
+int bt_session_remove_torrent(void* s, bt_dm_t* dm);
+
+/**
+ * @param infohash 20 byte infohash
+ * @return torrent with this infohash; NULL if there isn't one */
+bt_dm_t* bt_session_get_torrent(void* s, const char* infohash);
+
+/**
+ * @return number of torrents */
+int bt_session_get_ntorrents(void* s);
+
+/**
+ * Budget the cache out of the session's diskcache_write_bytes and
+ * diskcache_read_bytes. The cache's budgets are overwritten */
+void bt_session_add_diskcache(void* s, void* dc);
+
+void bt_session_remove_diskcache(void* s, void* dc);
+
+/**
+ * Read the time for the rate limits from this clock instead of
+ * CLOCK_MONOTONIC. The torrents have their own; see bt_dm_cbs_t.get_time_us
+ * @param get_time_us NULL for CLOCK_MONOTONIC */
+void bt_session_set_clock(void* s,
+                          unsigned long long (*get_time_us)(void* udata),
+                          void* udata);
+
+/**
+ * Top up the rate limits and run bt_dm_periodic on every torrent.
+ * A different torrent goes first each time, so that none of them always
+ * gets the pick of the rate limits */
+void bt_session_periodic(void* s);
+
+/**
+ * The session's listening socket accepted this connection. Its data is
+ * held until the whole handshake is in. The infohash is then looked up,
+ * and the connection handed to that torrent with the handshake already
+ * read; see bt_dm_peer_handshaked
+ * Same signature as bt_dm_peer_connect
+ * @return 0 if the session is at max_connections; 1 otherwise */
+int bt_session_peer_connect(void* s, void* conn_ctx, char *ip,
+                            const int port);
+
+/**
+ * Pass data from a connection the session accepted to its torrent.
+ * Same signature as bt_dm_dispatch_from_buffer
+ * @return 0 if the connection should be dropped, eg. because no torrent
+ *  has the infohash; otherwise 1 */
+int bt_session_dispatch_from_buffer(void* s, void* conn_ctx,
+                                    const char* buf, unsigned int len);
+
+/**
+ * The connection has gone. The torrent is told separately */
+void bt_session_peer_disconnect(void* s, void* conn_ctx);
+
+/**
+ * @return connections held by torrents and connections waiting on a
+ *  handshake */
+int bt_session_get_nconnections(void* s);
+
+/* the budgets torrents draw on; see bt_dm_set_session */
+
+/**
+ * A torrent has opened, or with a negative n, closed connections */
+void bt_session_add_connections(void* s, int n);
+
+/**
+ * @return 1 if another connection fits under max_connections */
+int bt_session_may_open_connection(void* s);
+
+/**
+ * @return 1 if there is upload budget left this tick */
+int bt_session_may_upload(void* s);
+
+void bt_session_spend_upload(void* s, int bytes);
+
+/**
+ * @return 1 if there is download budget left this tick */
+int bt_session_may_download(void* s);
+
+void bt_session_spend_download(void* s, int bytes);
+
+#endif /* BT_SESSION_H_ */
@@ -0,0 +1,42 @@
+#ifndef BT_SHA1_H_
+#define BT_SHA1_H_
+
+typedef struct
+{
+    uint32_t state[5];
+
+    /* number of bytes absorbed */
+    uint64_t count;
+
+    unsigned char buffer[64];
+} bt_sha1_ctx_t;
+
+void bt_sha1_init(bt_sha1_ctx_t* ctx);
+
+void bt_sha1_update(bt_sha1_ctx_t* ctx, const void* data, unsigned int len);
+
+/**
+ * @param hash 20 byte digest is written here */
+void bt_sha1_final(bt_sha1_ctx_t* ctx, char* hash);
+
+/**
+ * SHA1 hash the buffer
+ * @param hash 20 byte digest is written here */
+void bt_sha1(char* hash, const void* data, unsigned int len);
+
+/**
+ * SHA1 hash a batch of independent buffers.
+ * Without the SHA extensions, each 4 buffers are hashed together in SSE2
+ * lanes for as long as the shortest of them
+ * @param n Number of buffers
+ * @param hashes Each buffer's 20 byte digest is written to hashes[i] */
+void bt_sha1_multi(int n, char** hashes, const void** data,
+                   const unsigned int* lens);
+
+/**
+ * Choose whether the CPU's SHA instructions may be used.
+ * Hardware support is detected at runtime; the default is enabled.
+ * @return 1 if the accelerated kernel is now in use; otherwise 0 */
+int bt_sha1_set_acceleration(int enabled);
+
+#endif /* BT_SHA1_H_ */
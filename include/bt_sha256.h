@@ -0,0 +1,44 @@
+#ifndef BT_SHA256_H_
+#define BT_SHA256_H_
+
+typedef struct
+{
+    uint32_t state[8];
+
+    /* number of bytes absorbed */
+    uint64_t count;
+
+    unsigned char buffer[64];
+} bt_sha256_ctx_t;
+
+void bt_sha256_init(bt_sha256_ctx_t* ctx);
+
+void bt_sha256_update(bt_sha256_ctx_t* ctx, const void* data,
+                      unsigned int len);
+
+/**
+ * @param hash 32 byte digest is written here */
+void bt_sha256_final(bt_sha256_ctx_t* ctx, char* hash);
+
+/**
+ * SHA256 hash the buffer
+ * @param hash 32 byte digest is written here */
+void bt_sha256(char* hash, const void* data, unsigned int len);
+
+/**
+ * Root of a BitTorrent v2 merkle tree (BEP 52)
+ * Leaves past nleaves, up to width, are 32 zero bytes.
+ * @param leaves nleaves 32 byte hashes, concatenated
+ * @param width Leaves in the tree; a power of two, at least nleaves
+ * @param root 32 byte root is written here
+ * @return 1 on success; 0 if width isn't usable */
+int bt_sha256_merkle_root(char* root, const char* leaves,
+                          unsigned int nleaves, unsigned int width);
+
+/**
+ * Choose whether the CPU's SHA instructions may be used.
+ * Hardware support is detected at runtime; the default is enabled.
+ * @return 1 if the accelerated kernel is now in use; otherwise 0 */
+int bt_sha256_set_acceleration(int enabled);
+
+#endif /* BT_SHA256_H_ */
@@ -0,0 +1,29 @@
+#ifndef BT_SHARDS_H_
+#define BT_SHARDS_H_
+
+/**
+ * Work on one shard
+ * @param shard Which shard, from 0 to nshards - 1 */
+typedef void (*func_shard_f)(void* udata, int shard, int nshards);
+
+/**
+ * Threads that each run part of a job, and are waited on as a group.
+ * nshards - 1 threads are started; the thread calling bt_shards_run works
+ * on shard 0
+ * @return newly initialised shards; NULL on error */
+void *bt_shards_new(int nshards);
+
+/**
+ * Stop the threads and release the shards */
+void bt_shards_free(void* s);
+
+/**
+ * @return number of shards */
+int bt_shards_count(void* s);
+
+/**
+ * Call run on every shard at once. Returns once every shard has finished.
+ * Only one thread may run the shards at a time */
+void bt_shards_run(void* s, void* udata, func_shard_f run);
+
+#endif /* BT_SHARDS_H_ */
@@ -0,0 +1,52 @@
+#ifndef BT_SLAB_H_
+#define BT_SLAB_H_
+
+/**
+ * Pool of equally sized buffers carved out of large slabs
+ * Buffers are recycled instead of going back to the heap. Slabs are mapped
+ * as they are needed, until max_bytes worth have been mapped.
+ * @param buf_len Size in bytes of each buffer
+ * @param max_bytes Most bytes held in slabs. Allocations beyond this come
+ *  from the heap
+ * @param hugepages Back slabs with huge pages where the system allows it
+ * @return newly initialised slab */
+void *bt_slab_new(unsigned int buf_len, unsigned long long max_bytes,
+                  int hugepages);
+
+/**
+ * Unmap every slab. Outstanding buffers become invalid */
+void bt_slab_free(void* s);
+
+/**
+ * The buffer's contents are not zeroed
+ * @return buffer of buf_len bytes; NULL on error */
+void *bt_slab_alloc(void* s);
+
+/**
+ * Give back a buffer returned by bt_slab_alloc */
+void bt_slab_release(void* s, void* buf);
+
+/**
+ * @return bytes held in slabs */
+unsigned long long bt_slab_get_mapped_bytes(void* s);
+
+/**
+ * Map slabs up to the budget now, rather than as buffers are needed.
+ * Useful when the slabs have to be registered with the kernel up front
+ * @return 1 if the whole budget is mapped; otherwise 0 */
+int bt_slab_reserve(void* s);
+
+/**
+ * @return number of slabs mapped */
+int bt_slab_get_nslabs(void* s);
+
+/**
+ * @param len Set to the slab's length in bytes
+ * @return start of the idx'th slab */
+void *bt_slab_get_slab(void* s, int idx, unsigned long long *len);
+
+/**
+ * @return index of the slab holding buf; -1 if buf is from the heap */
+int bt_slab_find(void* s, void* buf);
+
+#endif /* BT_SLAB_H_ */
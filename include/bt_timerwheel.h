@@ -0,0 +1,37 @@
+#ifndef BT_TIMERWHEEL_H_
+#define BT_TIMERWHEEL_H_
+
+/**
+ * Hierarchical timing wheel with millisecond resolution
+ * Time is supplied by the caller, so the wheel never reads a clock itself.
+ * @param now_ms Current time in milliseconds
+ * @return newly initialised timing wheel */
+void *bt_timerwheel_new(unsigned long long now_ms);
+
+void bt_timerwheel_free(void* w);
+
+/**
+ * Schedule a callback. Delays beyond the wheel's range (about 4.6 hours) are
+ * clamped to the longest delay the wheel can hold.
+ * @param delay_ms Milliseconds from the wheel's current time. 0 means 1
+ * @param cb Called once from bt_timerwheel_step when the timer expires
+ * @return timer handle, valid until the timer fires or is cancelled */
+void *bt_timerwheel_add(void* w, unsigned int delay_ms, void* udata,
+                        void (*cb)(void* udata));
+
+/**
+ * Stop a timer from firing
+ * @param t Handle returned by bt_timerwheel_add */
+void bt_timerwheel_cancel(void* w, void* t);
+
+/**
+ * Advance the wheel to now_ms, firing every timer that has expired
+ * Callbacks may add or cancel timers.
+ * @return number of timers fired */
+int bt_timerwheel_step(void* w, unsigned long long now_ms);
+
+/**
+ * @return number of timers scheduled */
+int bt_timerwheel_count(void* w);
+
+#endif /* BT_TIMERWHEEL_H_ */
@@ -0,0 +1,108 @@
+#ifndef BT_TRACE_H_
+#define BT_TRACE_H_
+
+#include <stdio.h>
+
+/**
+ * Tracepoints
+ * Events are fixed size binary records written to a ring buffer owned by
+ * the thread that emits them. Nothing is formatted until the rings are
+ * read back with bt_trace_snapshot or bt_trace_dump, so tracing costs a
+ * clock read and a copy. Each ring keeps the newest bt_trace_set_ring_size
+ * events. A category is traced once it's in the mask set with
+ * bt_trace_set_mask, which can be changed at any time.
+ * Building with BT_NO_TRACE compiles the tracepoints out. */
+
+/* categories for bt_trace_set_mask */
+#define BT_TRACE_WIRE 0x1  /* peer wire messages sent and read */
+#define BT_TRACE_PIECE 0x2 /* pieces completing and failing, duplicates */
+#define BT_TRACE_PEER 0x4  /* peers coming and going */
+#define BT_TRACE_ALL 0xffffffff
+
+enum
+{
+    /* BT_TRACE_WIRE. The message's PWP_MSGTYPE_* is added to these */
+    BT_TRACE_SEND = 0,
+    BT_TRACE_READ = 32,
+
+    /* BT_TRACE_PIECE */
+    BT_TRACE_PIECE_COMPLETED = 64,
+    BT_TRACE_PIECE_FAILED,
+    BT_TRACE_BLOCK_DUPLICATE,
+
+    /* BT_TRACE_PEER */
+    BT_TRACE_PEER_ADDED,
+    BT_TRACE_PEER_REMOVED
+};
+
+typedef struct
+{
+    /* ns since an arbitrary start; CLOCK_MONOTONIC */
+    unsigned long long ns;
+
+    /* bt_peer_t the event is about; NULL if none */
+    const void* peer;
+
+    int event;
+    unsigned int piece_idx;
+    unsigned int offset;
+    unsigned int len;
+} bt_trace_event_t;
+
+/* read on every tracepoint; set through bt_trace_set_mask */
+extern unsigned int bt_trace_mask;
+
+#ifdef BT_NO_TRACE
+#define bt_trace_on(category) 0
+#else
+#define bt_trace_on(category) \
+    (__atomic_load_n(&bt_trace_mask, __ATOMIC_RELAXED) & (category))
+#endif
+
+/**
+ * Record the event if its category is being traced */
+#define BT_TRACE(category, event, peer, piece_idx, offset, len) \
+    do { \
+        if (bt_trace_on(category)) \
+            bt_trace_emit((event), (peer), (piece_idx), (offset), (len)); \
+    } while (0)
+
+/**
+ * Trace these BT_TRACE_* categories; 0 turns tracing off */
+void bt_trace_set_mask(unsigned int mask);
+
+/**
+ * Events held by each thread's ring. Rounded up to a power of two. Only
+ * rings made afterwards, ie. for threads that haven't traced yet, get the
+ * new size */
+void bt_trace_set_ring_size(unsigned int nevents);
+
+/**
+ * Write the event into this thread's ring. Use BT_TRACE instead, so the
+ * mask is checked first */
+void bt_trace_emit(int event, const void* peer, unsigned int piece_idx,
+                   unsigned int offset, unsigned int len);
+
+/**
+ * Copy out the newest events of every thread, oldest first. Safe to call
+ * while other threads trace; events overwritten while being copied are
+ * left out
+ * @return number of events copied */
+int bt_trace_snapshot(bt_trace_event_t* events, int nevents);
+
+/**
+ * Text for the event, eg. "read,PIECE,piece_idx=3 offset=0 len=16384"
+ * @return out */
+char* bt_trace_format(const bt_trace_event_t* e, char* out, int len);
+
+/**
+ * Write the newest events of every thread as text, one per line with their
+ * time and peer
+ * @return number of events written */
+int bt_trace_dump(FILE* f, int nevents);
+
+/**
+ * Forget every event traced so far */
+void bt_trace_clear();
+
+#endif /* BT_TRACE_H_ */
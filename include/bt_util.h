@@ -5,6 +5,32 @@ char *url2host(const char *url);
 
 char *bt_generate_peer_id();
 
+/**
+ * Pack a numeric IPv4 or IPv6 address and a port into BT_PEER_ADDR_LEN bytes:
+ * the IPv6 address, with IPv4 mapped into ::ffff:0:0/96, then the port.
+ * All of it is in network byte order
+ * @param ip Address text, which needn't be NUL terminated
+ * @return 1 on success; 0 if ip isn't a numeric address */
+int bt_addr_pack(unsigned char* addr, const char* ip, int ip_len, int port);
+
+/**
+ * Write the address part of a packed address as text, which bt_addr_pack
+ * reads back. IPv4 mapped addresses are written as IPv4
+ * @param len Size of ip; INET6_ADDRSTRLEN is always enough
+ * @return the port */
+int bt_addr_unpack(const unsigned char* addr, char* ip, int len);
+
+/**
+ * Write a packed address as text, eg. for logging.
+ * IPv4 mapped addresses are written as IPv4
+ * @return out */
+char *bt_addr_format(const unsigned char* addr, char* out, int len);
+
+/**
+ * Sizes that are powers of two can be divided by with a shift
+ * @return log2 of n if n is a power of two; otherwise -1 */
+int bt_pow2_shift(unsigned int n);
+
 #if WIN32
 char* strndup(const char* str, const unsigned int len);
 #endif
@@ -0,0 +1,74 @@
+#ifndef BT_WEBSEED_H_
+#define BT_WEBSEED_H_
+
+/**
+ * Web seed (BEP 19)
+ * Fetches blocks from an HTTP server with range requests on one keep-alive
+ * connection. Blocks are asked for with bt_webseed_request; contiguous
+ * ones are sent as a single GET by bt_webseed_flush, and GETs are
+ * pipelined. The connection itself is the caller's. */
+typedef struct
+{
+    /* send bytes on the connection
+     * @return 0 if the connection has gone */
+    int (*send)(void* udata, const char* buf, unsigned int len);
+
+    /* a requested block has arrived */
+    void (*pushblock)(void* udata, bt_block_t* b, const void* data);
+} bt_webseed_cbs_t;
+
+/**
+ * @param url http://host[:port]/path. For a torrent with files path is
+ *        their directory; see bt_webseed_add_file. https isn't supported
+ * @return newly initialised web seed; NULL if the URL isn't usable */
+void* bt_webseed_new(const char* url);
+
+void bt_webseed_free(void* ws);
+
+void bt_webseed_set_cbs(void* ws, bt_webseed_cbs_t* cb, void* udata);
+
+const char* bt_webseed_get_host(void* ws);
+
+int bt_webseed_get_port(void* ws);
+
+/**
+ * Blocks are placed in the torrent by piece_idx * piece_len + offset */
+void bt_webseed_set_piece_length(void* ws, int piece_len);
+
+/**
+ * Add the torrent's next file. Files are laid end to end in the order
+ * they're added; a range across files is fetched a file at a time
+ * @param path File's path under the URL's, '/' separated */
+void bt_webseed_add_file(void* ws, const char* path, unsigned long long size);
+
+/**
+ * Queue a block to be fetched by the next bt_webseed_flush */
+void bt_webseed_request(void* ws, const bt_block_t* b);
+
+/**
+ * Send GETs for the queued blocks
+ * @return 0 if the connection has gone */
+int bt_webseed_flush(void* ws);
+
+/**
+ * @return blocks requested that haven't arrived */
+int bt_webseed_get_npending(void* ws);
+
+/**
+ * Read the server's responses
+ * @return 0 if the server refused us or broke the protocol; the
+ *         connection should be dropped */
+int bt_webseed_dispatch_from_buffer(void* ws, const char* buf,
+                                    unsigned int len);
+
+/**
+ * Forget the blocks that haven't arrived, calling giveback for each, and
+ * get ready for a new connection */
+void bt_webseed_giveback(void* ws, void* udata,
+                         void (*giveback)(void* udata, bt_block_t* b));
+
+/**
+ * @return seconds the server's last 503 asked us to wait; 0 if none */
+int bt_webseed_get_retry_secs(void* ws);
+
+#endif /* BT_WEBSEED_H_ */
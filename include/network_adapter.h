@@ -23,8 +23,15 @@ int peer_send(void* caller, void **udata,
                   void* nethandle,
                   const char *send_data, const int len);
 
+int peer_sendv(void* caller, void **udata,
+               void* nethandle,
+               const bt_iovec_t *iov, const int iovcnt);
+
 int peer_disconnect(void* caller, void **udata, void* nethandle);
 
+unsigned int peer_get_queued_bytes(void* caller, void **udata,
+                                   void* nethandle);
+
 int peer_listen(void* caller,
         void **nethandle,
         int port,
@@ -0,0 +1,65 @@
+#ifndef NETWORK_ADAPTER_LIBUV_H
+#define NETWORK_ADAPTER_LIBUV_H
+
+/**
+ * libuv implementation of network_adapter.h
+ *
+ * Pass the adapter as the cb_ctx of bt_dm_set_cbs, with peer_connect,
+ * peer_send, peer_sendv, peer_disconnect and peer_get_queued_bytes as the
+ * callbacks.
+ *
+ * Configured through network_adapter_libuv_get_config:
+ *  tcp_nodelay: 1 to turn off Nagle's algorithm
+ *  socket_send_buffer, socket_recv_buffer: SO_SNDBUF and SO_RCVBUF in
+ *   bytes; 0 keeps the system's
+ *  read_buffer_bytes: size of the pooled buffers data is read into
+ *  read_buffers_max_bytes: most memory held in read buffer slabs
+ *
+ * Sends are queued, and each connection's queue goes out in one uv_write
+ * after the loop has polled. peer_get_queued_bytes reports what's still
+ * queued, so the torrent's send watermarks hold PIECE messages back.
+ *
+ * @param loop uv_loop_t the connections run on
+ * @return newly initialised adapter */
+void* network_adapter_libuv_new(void* loop);
+
+/**
+ * Close every connection and the listening socket.
+ * Run the loop once more afterwards so that the handles finish closing */
+void network_adapter_libuv_free(void* a);
+
+/**
+ * @return current configuration */
+void* network_adapter_libuv_get_config(void* a);
+
+/**
+ * Accept connections on this port. Each connection is announced with
+ * func_process_connection, eg. bt_session_peer_connect; if it returns 0
+ * the connection is closed
+ * @return 1 on success; otherwise 0 */
+int network_adapter_libuv_listen(
+    void* a,
+    void* caller,
+    int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *caller,
+                                    void* nethandle,
+                                    char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *caller, void* nethandle));
+
+/**
+ * @return number of open connections */
+int network_adapter_libuv_get_nconnections(void* a);
+
+/**
+ * Record every connection's inbound bytes from now on
+ * The recorder isn't owned by the adapter; close it after freeing the
+ * adapter. NULL stops recording
+ * @param capture Recorder from bt_capture_open */
+void network_adapter_libuv_set_capture(void* a, void* capture);
+
+#endif /* NETWORK_ADAPTER_LIBUV_H */
@@ -29,6 +29,11 @@ typedef struct {
     /* there is a connection for each peer */
     void* connections;
 
+    /* the connections again, in the order they were made, so that every
+     * run polls them in the same order */
+    client_connection_t** conns;
+    int nconns;
+
     /* the bitorrent client that represents this client */
     void* bt;
 
@@ -39,6 +44,34 @@ typedef struct {
 
 extern void *__clients;
 
+/* added to every connection's queued bytes, to stand in for a network that
+ * can't keep up */
+extern unsigned int networkfuncs_mock_backlog;
+
+/* network_poll ticks that sends spend on the wire before they can be read;
+ * 0 delivers them on the next network_poll */
+extern unsigned int networkfuncs_mock_latency;
+
+/* most bytes a connection delivers each network_poll; 0 for no limit */
+extern unsigned int networkfuncs_mock_bandwidth;
+
+/* ticks so far; see networkfuncs_mock_tick */
+extern unsigned int networkfuncs_mock_ticks;
+
+/* ms of virtual time each tick stands for */
+extern unsigned int networkfuncs_mock_tick_ms;
+
+/**
+ * Move the network's clock on one tick, ie. once every client has been
+ * polled. Without ticks a latency can't pass */
+void networkfuncs_mock_tick();
+
+/**
+ * Virtual time, for bt_dm_cbs_t.get_time_us. It only moves with
+ * networkfuncs_mock_tick, so runs don't depend on how fast the machine is
+ * @return microseconds */
+unsigned long long networkfuncs_mock_get_time_us(void* udata);
+
 client_t* networkfuncs_mock_get_client_from_id(void* nethandle);
 
 void* networkfuns_mock_client_new(void* nethandle);
@@ -0,0 +1,125 @@
+#ifndef NETWORK_ADAPTER_UTP_H
+#define NETWORK_ADAPTER_UTP_H
+
+/**
+ * uTP (BEP 29) implementation of the bt_dm_cbs_t network callbacks
+ *
+ * Pass the adapter as the cb_ctx of bt_dm_set_cbs, with
+ * network_adapter_utp_connect, network_adapter_utp_send,
+ * network_adapter_utp_sendv, network_adapter_utp_disconnect and
+ * network_adapter_utp_get_queued_bytes as the callbacks.
+ *
+ * Every connection shares one UDP socket. Sends are queued, and go out when
+ * network_adapter_utp_poll is next called; datagrams are sent and received
+ * a batch at a time with sendmmsg and recvmmsg. Each connection's window
+ * is run by LEDBAT, which backs off once the one way delay grows past the
+ * target, so uploads can fill the uplink without queueing in front of
+ * other traffic.
+ *
+ * Configured through network_adapter_utp_get_config:
+ *  utp_packet_bytes: largest datagram we send, header included
+ *  utp_target_delay_ms: queueing delay LEDBAT aims for
+ *  utp_max_window_bytes: most bytes a connection has in flight
+ *  utp_recv_window_bytes: receive window we advertise
+ *  utp_batch: datagrams per sendmmsg and recvmmsg
+ *  utp_initial_rto_ms: retransmit timeout before there's an RTT sample
+ *  utp_max_timeouts: timeouts in a row before the connection fails
+ *
+ * Peers are IPv4 addresses; host names aren't resolved.
+ *
+ * @return newly initialised adapter */
+void* network_adapter_utp_new();
+
+/**
+ * Close every connection and the socket */
+void network_adapter_utp_free(void* a);
+
+/**
+ * @return current configuration */
+void* network_adapter_utp_get_config(void* a);
+
+/**
+ * Accept connections on this UDP port. Each connection is announced with
+ * func_process_connection, eg. bt_session_peer_connect; if it returns 0
+ * the connection is reset.
+ * Call before connecting out, so that the connections share the port
+ * @return 1 on success; otherwise 0 */
+int network_adapter_utp_listen(
+    void* a,
+    void* caller,
+    int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *caller,
+                                    void* nethandle,
+                                    char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *caller, void* nethandle));
+
+/**
+ * Read what's arrived, retransmit what has timed out, and send what's
+ * queued. Call when the socket is readable, and every few milliseconds
+ * @return number of datagrams received */
+int network_adapter_utp_poll(void* a);
+
+/**
+ * @return the UDP socket, for the caller's poll loop; -1 if there's none
+ *         yet */
+int network_adapter_utp_get_fd(void* a);
+
+/**
+ * @return number of open connections */
+int network_adapter_utp_get_nconnections(void* a);
+
+typedef struct
+{
+    /* LEDBAT's window, and bytes sent but not yet acknowledged */
+    unsigned int window;
+    unsigned int inflight;
+
+    /* smoothed round trip, and the one way delay over the base delay, as
+     * last measured */
+    unsigned int rtt_us;
+    unsigned int queueing_us;
+
+    /* datagrams sent again */
+    unsigned int retransmits;
+} network_adapter_utp_stats_t;
+
+/**
+ * @return 1 if the connection is open; otherwise 0 */
+int network_adapter_utp_get_stats(void* a, void* nethandle,
+                                  network_adapter_utp_stats_t* stats);
+
+/* bt_dm_cbs_t callbacks; udata points at the adapter */
+
+int network_adapter_utp_connect(
+    void* caller,
+    void **udata,
+    void **nethandle,
+    const char *host, const int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *, void* nethandle, char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *, void* nethandle));
+
+int network_adapter_utp_send(void* caller, void **udata, void* nethandle,
+                             const char *send_data, const int len);
+
+int network_adapter_utp_sendv(void* caller, void **udata, void* nethandle,
+                              const bt_iovec_t *iov, const int iovcnt);
+
+int network_adapter_utp_disconnect(void* caller, void **udata,
+                                   void* nethandle);
+
+/**
+ * @return bytes queued or in flight, not yet acknowledged */
+unsigned int network_adapter_utp_get_queued_bytes(void* caller, void **udata,
+                                                  void* nethandle);
+
+#endif /* NETWORK_ADAPTER_UTP_H */
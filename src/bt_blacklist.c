@@ -18,12 +18,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "bt.h"
 #include "bt_blacklist.h"
 
 #include "linked_list_queue.h"
-#include "linked_list_hashmap.h"
+#include "bt_hashmap.h"
 #include "bag.h"
 #include "heap.h"
 #include "avl_tree.h"
@@ -44,9 +45,25 @@ typedef struct
     /* peers that were involved in providing blocks to this piece */
 } piece_t;
 
+/* the pieces a peer is blacklisted for, sorted by address. Peers are
+ * rarely blacklisted for more than a few, so a binary search over an array
+ * beats walking the per piece trees */
+typedef struct
+{
+    void** pieces;
+    int npieces;
+    int size;
+} peer_t;
+
 typedef struct
 {
     avltree_t* pieces;
+
+    /* peer_t of each peer that's blacklisted for a piece */
+    void* by_peer;
+
+    /* banned hosts; keys are BT_BLACKLIST_ADDR_LEN bytes */
+    void* banned;
 } blacklist_t;
 
 static long __cmp_piece(
@@ -65,15 +82,77 @@ static long __cmp_address(
     return (unsigned long)e2 - (unsigned long)e1;
 }
 
+static unsigned long __addr_hash(const void *obj)
+{
+    uint64_t hi, lo, h;
+
+    memcpy(&hi, obj, sizeof(hi));
+    memcpy(&lo, (const char*)obj + 8, sizeof(lo));
+    h = hi ^ (lo * 0x9e3779b97f4a7c15ULL);
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
+}
+
+static long __addr_compare(const void *obj, const void *other)
+{
+    return memcmp(obj, other, BT_BLACKLIST_ADDR_LEN);
+}
+
 void *bt_blacklist_new()
 {
     blacklist_t* me;
 
     me = calloc(1, sizeof(blacklist_t));
     me->pieces = avltree_new(__cmp_piece);
+    me->by_peer = bt_intmap_new(11);
+    me->banned = bt_hashmap_new(__addr_hash, __addr_compare, 11);
     return me;
 }
 
+/**
+ * @return the slot the piece is in, or would go in, of the peer's array */
+static int __find(const peer_t* pr, const void* piece)
+{
+    int lo = 0, hi = pr->npieces;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if ((unsigned long)pr->pieces[mid] < (unsigned long)piece)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void __index_add(blacklist_t* me, void* piece, void* peer)
+{
+    peer_t* pr;
+    int i;
+
+    if (!(pr = bt_intmap_get(me->by_peer, (uintptr_t)peer)))
+    {
+        pr = calloc(1, sizeof(peer_t));
+        bt_intmap_put(me->by_peer, (uintptr_t)peer, pr);
+    }
+
+    i = __find(pr, piece);
+    if (i < pr->npieces && pr->pieces[i] == piece)
+        return;
+
+    if (pr->size <= pr->npieces)
+    {
+        pr->size = pr->size * 2 + 4;
+        pr->pieces = realloc(pr->pieces, pr->size * sizeof(void*));
+    }
+    memmove(&pr->pieces[i + 1], &pr->pieces[i],
+            (pr->npieces - i) * sizeof(void*));
+    pr->pieces[i] = piece;
+    pr->npieces++;
+}
+
 static piece_t* __init_piece()
 {
     piece_t* p;
@@ -104,6 +183,7 @@ void bt_blacklist_add_peer(
         avltree_insert(me->pieces,piece,p);
     }
     avltree_insert(p->peers_blacklisted,peer,peer);
+    __index_add(me, piece, peer);
 }
 
 void bt_blacklist_add_peer_as_potentially_blacklisted(
@@ -128,17 +208,70 @@ int bt_blacklist_peer_is_blacklisted(
     void* peer)
 {
     blacklist_t* me = blacklist;
-    piece_t* p;
+    peer_t* pr;
+    int i;
 
-    if (!peer)
+    /* most peers have never been blacklisted, and stop at the hashmap */
+    if (!peer || !(pr = bt_intmap_get(me->by_peer, (uintptr_t)peer)))
         return 0;
 
-    if (!(p = avltree_get(me->pieces,piece)))
+    i = __find(pr, piece);
+    return i < pr->npieces && pr->pieces[i] == piece;
+}
+
+int bt_blacklist_get_npieces_for_peer(void* blacklist, void* peer)
+{
+    blacklist_t* me = blacklist;
+    peer_t* pr;
+
+    return (pr = bt_intmap_get(me->by_peer, (uintptr_t)peer)) ? pr->npieces : 0;
+}
+
+void bt_blacklist_remove_peer(void* blacklist, void* peer)
+{
+    blacklist_t* me = blacklist;
+    peer_t* pr;
+    int i;
+
+    if (!(pr = bt_intmap_remove(me->by_peer, (uintptr_t)peer)))
+        return;
+
+    for (i = 0; i < pr->npieces; i++)
     {
-        return 0;
+        piece_t* p = avltree_get(me->pieces, pr->pieces[i]);
+
+        if (p)
+            avltree_remove(p->peers_blacklisted, peer);
     }
+    free(pr->pieces);
+    free(pr);
+}
+
+void bt_blacklist_ban_addr(void* blacklist, const unsigned char* addr)
+{
+    blacklist_t* me = blacklist;
+    unsigned char* key;
+
+    if (bt_hashmap_get(me->banned, addr))
+        return;
+    key = malloc(BT_BLACKLIST_ADDR_LEN);
+    memcpy(key, addr, BT_BLACKLIST_ADDR_LEN);
+    bt_hashmap_put(me->banned, key, key);
+}
+
+int bt_blacklist_addr_is_banned(void* blacklist, const unsigned char* addr)
+{
+    blacklist_t* me = blacklist;
+
+    return 0 < bt_hashmap_count(me->banned) &&
+           NULL != bt_hashmap_get(me->banned, addr);
+}
+
+int bt_blacklist_get_nbanned(void* blacklist)
+{
+    blacklist_t* me = blacklist;
 
-    return NULL != avltree_get(p->peers_blacklisted,peer);
+    return bt_hashmap_count(me->banned);
 }
 
 int bt_blacklist_peer_is_potentially_blacklisted(
@@ -20,16 +20,105 @@
 /* for uint32_t */
 #include <stdint.h>
 
+/* for write-behind */
+#include <pthread.h>
+
 #include "bt.h"
+#include "bt_diskcache.h"
+#include "bt_slab.h"
+#include "bt_util.h"
+
+#include "config.h"
+#include "linked_list_queue.h"
 
-/* for LRU cache */
-#include "pseudolru.h"
+/* for eviction */
+#include "bt_cache_policy.h"
 
+typedef struct mpiece_s mpiece_t;
+
+/**
+ * Part of a piece, used when we don't hold the whole piece. Frames are read
+ * from disk, or written to when the piece is too big to hold whole */
+typedef struct
+{
+    /* first, so that an entry is also its frame. A frame is in the dirty
+     * frames lru or the clean one, never both */
+    bt_cache_entry_t ce;
+    mpiece_t *mpce;
+    int idx;
+    unsigned char *data;
+
+    /* the io thread is reading into data */
+    int fetching;
+
+    /* data has been written that isn't on disk yet */
+    int dirty;
+} frame_t;
+
+typedef enum
+{
+    IO_FLUSH,
+    IO_FETCH
+} io_type_e;
+
+/**
+ * Work for the io thread */
 typedef struct
 {
+    io_type_e type;
+    mpiece_t *mpce;
+
+    /* fetching into a frame; NULL when fetching the whole piece */
+    frame_t *frame;
+    unsigned char *buf;
+    bt_block_t blk;
+
+    int ok;
+} io_job_t;
+
+struct mpiece_s
+{
+    /* first, so that an entry is also its piece. A piece is in the dirty
+     * lru or the clean policy, never both */
+    bt_cache_entry_t ce;
     unsigned char *data;
     int idx;
-} mpiece_t;
+
+    /* frames we've read or written while the piece isn't in memory */
+    frame_t **frames;
+    int ndirty_frames;
+
+    /* frame that follows the last frame read; spots sequential reads */
+    int next_frame;
+
+    /* data has been written that isn't on disk yet */
+    int dirty;
+
+    /* the piece has been written out at least once */
+    int on_disk;
+
+    /* the io thread owns the piece until it has been reaped */
+    int flushing;
+    int fetching;
+
+    /* frames lent out by get_write_frame; the piece stays in memory */
+    int writers;
+};
+
+typedef struct
+{
+    unsigned int version;
+    unsigned long long write_bytes;
+    unsigned long long read_bytes;
+    int high_watermark;
+    int low_watermark;
+    int write_behind;
+    int read_ahead;
+    int frame_bytes;
+    int split_bytes;
+    int hugepages;
+    char *policy;
+} diskcache_settings_t;
 
 typedef struct
 {
@@ -43,8 +132,54 @@ typedef struct
     bt_blockrw_i *disk;
     void *disk_udata;
 
-    /*  least recently used piece */
-    pseudolru_t *lru_piece;
+    /* pieces holding data that hasn't been written out */
+    void *lru_dirty;
+
+    /* pieces that match what is on disk; made on first use */
+    const bt_cache_policy_i *ipol;
+    void *clean;
+
+    /* frames of pieces that aren't in memory. Frames are freed on
+     * eviction, so they can't have a policy that keeps history */
+    void *lru_frames;
+    void *lru_dirty_frames;
+
+    /* size of frames; fixed once the first frame is read. frame_shift
+     * is its log2, or -1 if it isn't a power of two */
+    int frame_len;
+    int frame_shift;
+
+    /* buffers for pieces and frames; made once their size is known */
+    void *piece_slab;
+    void *frame_slab;
+
+    /* bytes held by each lru. Dirty includes pieces being flushed.
+     * Clean includes frames */
+    unsigned long long dirty_bytes;
+    unsigned long long clean_bytes;
+
+    /* the budgets are scaled down to fit in this; 0 for no limit */
+    unsigned long long memory_limit;
+
+    /* reads served from memory and from the disk, and clean pieces and
+     * frames evicted */
+    bt_cache_stats_t stats;
+
+    /* write-behind */
+    pthread_t io_thread;
+    int io_running;
+    int shutdown;
+    pthread_mutex_t lock;
+    /* work for the io thread */
+    pthread_cond_t cond;
+    /* work completed by the io thread */
+    pthread_cond_t done_cond;
+    linked_list_queue_t *io_queue;
+    linked_list_queue_t *io_done;
+    unsigned long long inflight_bytes;
+
+    config_t* cfg;
+    diskcache_settings_t settings;
 
     /* logger */
     func_log_f func_log;
@@ -54,14 +189,6 @@ typedef struct
 
 #define priv(x) ((diskcache_private_t*)(x))
 
-static int __lru_piece_compare(
-    const void *e1,
-    const void *e2
-)
-{
-    return e1 - e2;
-}
-
 static void __log(
     bt_diskcache_t * me,
     const char *format,
@@ -80,6 +207,108 @@ static void __log(
     priv(me)->func_log(priv(me)->logger_data, me, buf);
 }
 
+/**
+ * @return settings, re-read from the config only if it has changed */
+static diskcache_settings_t* __cfg(bt_diskcache_t* me)
+{
+    config_t* cfg = priv(me)->cfg;
+    diskcache_settings_t* s = &priv(me)->settings;
+
+    if (s->version == cfg->version)
+        return s;
+
+    s->version = cfg->version;
+    s->write_bytes = config_get_ull(cfg, "diskcache_write_bytes");
+    s->read_bytes = config_get_ull(cfg, "diskcache_read_bytes");
+    s->high_watermark = config_get_int(cfg, "diskcache_high_watermark");
+    s->low_watermark = config_get_int(cfg, "diskcache_low_watermark");
+    s->write_behind = config_get_int(cfg, "diskcache_write_behind");
+    s->read_ahead = config_get_int(cfg, "diskcache_read_ahead");
+    s->frame_bytes = config_get_int(cfg, "diskcache_frame_bytes");
+    s->split_bytes = config_get_int(cfg, "diskcache_split_piece_bytes");
+    s->hugepages = config_get_int(cfg, "diskcache_hugepages");
+    s->policy = config_get(cfg, "diskcache_policy");
+    if (s->high_watermark < s->low_watermark)
+        s->low_watermark = s->high_watermark;
+
+    if (priv(me)->memory_limit &&
+        priv(me)->memory_limit < s->write_bytes + s->read_bytes)
+    {
+        double scale = (double)priv(me)->memory_limit /
+            (s->write_bytes + s->read_bytes);
+
+        s->write_bytes = s->write_bytes * scale;
+        s->read_bytes = s->read_bytes * scale;
+    }
+    return s;
+}
+
+/**
+ * @return percent of budget in bytes */
+static unsigned long long __mark(unsigned long long budget, int percent)
+{
+    return budget / 100 * percent + budget % 100 * percent / 100;
+}
+
+#define LRU bt_cache_policy_lru()
+
+/**
+ * @return policy for clean pieces */
+static void *__clean(bt_diskcache_t * me)
+{
+    diskcache_settings_t* s = __cfg(me);
+
+    if (priv(me)->clean)
+        return priv(me)->clean;
+
+    if (!priv(me)->ipol)
+        priv(me)->ipol = s->policy && !strcmp(s->policy, "lru") ?
+            bt_cache_policy_lru() : bt_cache_policy_arc();
+    priv(me)->clean = priv(me)->ipol->new(
+        s->read_bytes / (0 < priv(me)->piece_length ?
+                         priv(me)->piece_length : 1));
+    return priv(me)->clean;
+}
+
+static void __touch_clean(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    void *clean = __clean(me);
+
+    priv(me)->ipol->touch(clean, &mpce->ce);
+}
+
+static void __remove_clean(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    void *clean = __clean(me);
+
+    priv(me)->ipol->remove(clean, &mpce->ce);
+}
+
+/**
+ * @return uninitialised piece sized buffer */
+static void *__piece_buf(bt_diskcache_t * me)
+{
+    diskcache_settings_t* s = __cfg(me);
+
+    if (!priv(me)->piece_slab)
+        priv(me)->piece_slab = bt_slab_new(priv(me)->piece_length,
+                                           s->write_bytes + s->read_bytes,
+                                           s->hugepages);
+    return bt_slab_alloc(priv(me)->piece_slab);
+}
+
+/**
+ * @return uninitialised frame sized buffer */
+static void *__frame_buf(bt_diskcache_t * me)
+{
+    diskcache_settings_t* s = __cfg(me);
+
+    if (!priv(me)->frame_slab)
+        priv(me)->frame_slab = bt_slab_new(priv(me)->frame_len,
+                                           s->read_bytes, s->hugepages);
+    return bt_slab_alloc(priv(me)->frame_slab);
+}
+
 /**
  * Get piece as per this piece_idx
  * 
@@ -117,34 +346,662 @@ static mpiece_t *__get_piece(
 }
 
 void bt_diskcache_set_func_log(
-    bt_diskcache_t * me,
+    void * dco,
     func_log_f log,
     void *udata
 )
 {
+    bt_diskcache_t *me = dco;
+
     priv(me)->func_log = log;
     priv(me)->logger_data = udata;
 }
 
+static int __nframes(bt_diskcache_t * me)
+{
+    return (priv(me)->piece_length + priv(me)->frame_len - 1) /
+        priv(me)->frame_len;
+}
+
 /**
- * Dump this piece_idx to the disk */
-static void __diskdump_piece(bt_diskcache_t * me, const int piece_idx)
+ * @return index of the frame holding the byte at offset */
+static int __frame_of(bt_diskcache_t * me, unsigned int offset)
+{
+    if (0 <= priv(me)->frame_shift)
+        return offset >> priv(me)->frame_shift;
+    return offset / priv(me)->frame_len;
+}
+
+static int __frame_len(bt_diskcache_t * me, int frame_idx)
+{
+    int off = frame_idx * priv(me)->frame_len;
+
+    if (priv(me)->piece_length - off < priv(me)->frame_len)
+        return priv(me)->piece_length - off;
+    return priv(me)->frame_len;
+}
+
+static void __drop_frame(bt_diskcache_t * me, frame_t *f)
+{
+    if (f->dirty)
+    {
+        priv(me)->dirty_bytes -= __frame_len(me, f->idx);
+        f->mpce->ndirty_frames--;
+    }
+    else
+        priv(me)->clean_bytes -= __frame_len(me, f->idx);
+    f->mpce->frames[f->idx] = NULL;
+    bt_slab_release(priv(me)->frame_slab, f->data);
+    free(f);
+}
+
+/**
+ * @return lru the frame is in */
+static void *__frame_lru(bt_diskcache_t * me, frame_t *f)
+{
+    return f->dirty ? priv(me)->lru_dirty_frames : priv(me)->lru_frames;
+}
+
+/**
+ * Write the frame out; it moves to the clean frames */
+static void __diskdump_frame(bt_diskcache_t * me, frame_t *f)
 {
     bt_block_t blk;
-    mpiece_t *mpce;
 
-    mpce = __get_piece(me, piece_idx);
-    blk.piece_idx = piece_idx;
+    blk.piece_idx = f->mpce->idx;
+    blk.offset = f->idx * priv(me)->frame_len;
+    blk.len = __frame_len(me, f->idx);
+    if (0 == priv(me)->disk->write_block(priv(me)->disk_udata, me, &blk,
+                                         f->data))
+        __log(me, "ERROR,unable to write piece %d to disk", blk.piece_idx);
+
+    LRU->remove(priv(me)->lru_dirty_frames, &f->ce);
+    f->dirty = 0;
+    f->mpce->ndirty_frames--;
+    f->mpce->on_disk = 1;
+    priv(me)->dirty_bytes -= blk.len;
+    priv(me)->clean_bytes += blk.len;
+    LRU->touch(priv(me)->lru_frames, &f->ce);
+}
+
+static void __diskdump_frames(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    int i;
+
+    for (i = 0; 0 < mpce->ndirty_frames && i < __nframes(me); i++)
+        if (mpce->frames[i] && mpce->frames[i]->dirty)
+            __diskdump_frame(me, mpce->frames[i]);
+}
+
+static void __wait_for_io(bt_diskcache_t * me);
+
+/**
+ * The whole piece is coming into memory; its frames would go stale
+ * @param write_out 1 if dirty frames are written out first */
+static void __drop_frames(bt_diskcache_t * me, mpiece_t *mpce, int write_out)
+{
+    int i, nframes;
+
+    if (!mpce->frames)
+        return;
+
+    if (write_out)
+        __diskdump_frames(me, mpce);
+
+    nframes = __nframes(me);
+    for (i = 0; i < nframes; i++)
+    {
+        while (mpce->frames[i] && mpce->frames[i]->fetching)
+            __wait_for_io(me);
+
+        if (mpce->frames[i])
+        {
+            LRU->remove(__frame_lru(me, mpce->frames[i]),
+                        &mpce->frames[i]->ce);
+            __drop_frame(me, mpce->frames[i]);
+        }
+    }
+    free(mpce->frames);
+    mpce->frames = NULL;
+}
+
+/**
+ * Keep clean pieces within the read budget
+ * Frames are evicted before whole pieces
+ * @param keep Piece or frame that must stay in memory; the caller is using
+ *  it */
+static void __trim_clean(bt_diskcache_t * me, const void *keep)
+{
+    diskcache_settings_t* s = __cfg(me);
+    void *clean = __clean(me);
+    int tries;
+
+    if (priv(me)->clean_bytes <= __mark(s->read_bytes, s->high_watermark))
+        return;
+
+    for (tries = LRU->count(priv(me)->lru_frames);
+         0 < tries &&
+         __mark(s->read_bytes, s->low_watermark) < priv(me)->clean_bytes;
+         tries--)
+    {
+        frame_t *f = (frame_t*)LRU->evict(priv(me)->lru_frames);
+
+        if (f == keep)
+        {
+            LRU->touch(priv(me)->lru_frames, &f->ce);
+            continue;
+        }
+
+        __drop_frame(me, f);
+        priv(me)->stats.evictions++;
+    }
+
+    priv(me)->ipol->set_capacity(clean, s->read_bytes /
+                                 priv(me)->piece_length);
+    for (tries = priv(me)->ipol->count(clean);
+         0 < tries &&
+         __mark(s->read_bytes, s->low_watermark) < priv(me)->clean_bytes;
+         tries--)
+    {
+        mpiece_t *mpce = (mpiece_t*)priv(me)->ipol->evict(clean);
+
+        if (mpce == keep || 0 < mpce->writers)
+        {
+            __touch_clean(me, mpce);
+            continue;
+        }
+
+        priv(me)->clean_bytes -= priv(me)->piece_length;
+        bt_slab_release(priv(me)->piece_slab, mpce->data);
+        mpce->data = NULL;
+        priv(me)->stats.evictions++;
+    }
+}
+
+/**
+ * The piece is on disk; move it from the write cache to the read cache */
+static void __mark_clean(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    mpce->on_disk = 1;
+    if (!mpce->dirty)
+        return;
+    priv(me)->dirty_bytes -= priv(me)->piece_length;
+    mpce->dirty = 0;
+    __touch_clean(me, mpce);
+    priv(me)->clean_bytes += priv(me)->piece_length;
+}
+
+static int __write_piece(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    bt_block_t blk;
+
+    blk.piece_idx = mpce->idx;
     blk.offset = 0;
     blk.len = priv(me)->piece_length;
-    if (0 == priv(me)->disk->write_block(priv(me)->disk_udata, me, &blk, mpce->data))
+    return priv(me)->disk->write_block(priv(me)->disk_udata, me, &blk,
+                                       mpce->data);
+}
+
+/**
+ * Dump this piece_idx to the disk
+ * The piece stays in memory as part of the read cache */
+static void __diskdump_piece(bt_diskcache_t * me, const int piece_idx)
+{
+    mpiece_t *mpce;
+
+    mpce = __get_piece(me, piece_idx);
+    if (0 == __write_piece(me, mpce))
+    {
+        __log(me, "ERROR,unable to write piece %d to disk", piece_idx);
+    }
+
+    LRU->remove(priv(me)->lru_dirty, &mpce->ce);
+    __mark_clean(me, mpce);
+}
+
+static int __cmp_piece_idx(const void *a, const void *b)
+{
+    return (*(mpiece_t* const*)a)->idx - (*(mpiece_t* const*)b)->idx;
+}
+
+/**
+ * Dump these pieces to the disk in piece order
+ * If the disk can take several blocks at once, this lets it merge
+ * neighbouring pieces into single writes */
+static void __diskdump_pieces(bt_diskcache_t * me, mpiece_t **pieces, int n)
+{
+    int i;
+
+    if (0 == n)
+        return;
+
+    qsort(pieces, n, sizeof(mpiece_t*), __cmp_piece_idx);
+
+    if (!priv(me)->disk->write_blocks || 1 == n)
+    {
+        for (i = 0; i < n; i++)
+            __diskdump_piece(me, pieces[i]->idx);
+        return;
+    }
+
+    {
+        bt_block_t *blks = malloc(sizeof(bt_block_t) * n);
+        const void **data = malloc(sizeof(void*) * n);
+
+        for (i = 0; i < n; i++)
+        {
+            blks[i].piece_idx = pieces[i]->idx;
+            blks[i].offset = 0;
+            blks[i].len = priv(me)->piece_length;
+            data[i] = pieces[i]->data;
+        }
+
+        if (0 == priv(me)->disk->write_blocks(priv(me)->disk_udata, me,
+                                              blks, data, n))
+            __log(me, "ERROR,unable to write pieces %d to %d to disk",
+                  pieces[0]->idx, pieces[n - 1]->idx);
+
+        free(blks);
+        free(data);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        LRU->remove(priv(me)->lru_dirty, &pieces[i]->ce);
+        __mark_clean(me, pieces[i]);
+    }
+}
+
+static void* __io_worker(void* me_)
+{
+    bt_diskcache_t *me = me_;
+
+    while (1)
+    {
+        io_job_t *j;
+
+        pthread_mutex_lock(&priv(me)->lock);
+        while (!priv(me)->shutdown &&
+               0 == llqueue_count(priv(me)->io_queue))
+            pthread_cond_wait(&priv(me)->cond, &priv(me)->lock);
+        /* on shutdown we still do what's queued */
+        if (!(j = llqueue_poll(priv(me)->io_queue)))
+        {
+            pthread_mutex_unlock(&priv(me)->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&priv(me)->lock);
+
+        /* nobody touches the buffer while we have it */
+        if (IO_FLUSH == j->type)
+            j->ok = __write_piece(me, j->mpce);
+        else
+        {
+            void *data;
+
+            data = priv(me)->disk->read_block(priv(me)->disk_udata, me,
+                                              &j->blk);
+            if ((j->ok = NULL != data))
+                memcpy(j->buf, data, j->blk.len);
+            else
+                memset(j->buf, 0, j->blk.len);
+        }
+
+        pthread_mutex_lock(&priv(me)->lock);
+        llqueue_offer(priv(me)->io_done, j);
+        pthread_cond_broadcast(&priv(me)->done_cond);
+        pthread_mutex_unlock(&priv(me)->lock);
+    }
+}
+
+/**
+ * Put what the io thread has finished with back into the cache */
+static void __reap(bt_diskcache_t * me)
+{
+    io_job_t *j;
+    int fetched = 0;
+
+    if (!priv(me)->io_running)
+        return;
+
+    pthread_mutex_lock(&priv(me)->lock);
+    while ((j = llqueue_poll(priv(me)->io_done)))
+    {
+        mpiece_t *mpce = j->mpce;
+
+        if (IO_FLUSH == j->type)
+        {
+            if (!j->ok)
+                __log(me, "ERROR,unable to write piece %d to disk", mpce->idx);
+            mpce->flushing = 0;
+            priv(me)->inflight_bytes -= priv(me)->piece_length;
+            __mark_clean(me, mpce);
+        }
+        else if (j->frame)
+        {
+            j->frame->fetching = 0;
+            priv(me)->clean_bytes += j->blk.len;
+            LRU->touch(priv(me)->lru_frames, &j->frame->ce);
+            fetched = 1;
+        }
+        else
+        {
+            mpce->fetching = 0;
+            mpce->data = j->buf;
+            __touch_clean(me, mpce);
+            priv(me)->clean_bytes += priv(me)->piece_length;
+            fetched = 1;
+        }
+        free(j);
+    }
+    pthread_mutex_unlock(&priv(me)->lock);
+
+    if (fetched)
+        __trim_clean(me, NULL);
+}
+
+/**
+ * Block until the io thread has finished at least one job */
+static void __wait_for_io(bt_diskcache_t * me)
+{
+    pthread_mutex_lock(&priv(me)->lock);
+    while (0 == llqueue_count(priv(me)->io_done))
+        pthread_cond_wait(&priv(me)->done_cond, &priv(me)->lock);
+    pthread_mutex_unlock(&priv(me)->lock);
+    __reap(me);
+}
+
+/**
+ * Wait for the io thread to hand the piece back */
+static void __wait_for_piece(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    while (mpce->flushing || mpce->fetching)
+        __wait_for_io(me);
+}
+
+static int __start_io(bt_diskcache_t * me)
+{
+    if (priv(me)->io_running)
+        return 1;
+
+    if (0 != pthread_create(&priv(me)->io_thread, NULL, __io_worker, me))
+    {
+        __log(me, "ERROR,couldn't create io thread");
+        return 0;
+    }
+
+    priv(me)->io_running = 1;
+    return 1;
+}
+
+static void __queue_io(bt_diskcache_t * me, io_job_t *j)
+{
+    pthread_mutex_lock(&priv(me)->lock);
+    llqueue_offer(priv(me)->io_queue, j);
+    pthread_cond_signal(&priv(me)->cond);
+    pthread_mutex_unlock(&priv(me)->lock);
+}
+
+/**
+ * Hand the piece to the io thread
+ * @return 0 if the piece needs to be written synchronously */
+static int __queue_flush(bt_diskcache_t * me, mpiece_t *mpce)
+{
+    io_job_t *j;
+
+    if (!__start_io(me))
+        return 0;
+
+    j = calloc(1, sizeof(io_job_t));
+    j->type = IO_FLUSH;
+    j->mpce = mpce;
+    mpce->flushing = 1;
+    priv(me)->inflight_bytes += priv(me)->piece_length;
+    __queue_io(me, j);
+    return 1;
+}
+
+/**
+ * Flush the least recently used dirty pieces once we go over the high
+ * watermark, until we're under the low watermark
+ * With write-behind the writes happen on the flusher, and we only block
+ * once pieces in flight take us over the write budget */
+static void __trim_dirty(bt_diskcache_t * me)
+{
+    diskcache_settings_t* s = __cfg(me);
+
+    if (priv(me)->dirty_bytes <= __mark(s->write_bytes, s->high_watermark))
+        return;
+
+    /* frames of split pieces go first; they're written where they sit */
+    while (0 < LRU->count(priv(me)->lru_dirty_frames) &&
+           __mark(s->write_bytes, s->low_watermark) <
+           priv(me)->dirty_bytes - priv(me)->inflight_bytes)
+        __diskdump_frame(me,
+                         (frame_t*)LRU->evict(priv(me)->lru_dirty_frames));
+
+    {
+        /* pieces written here are gathered up and written in one go */
+        mpiece_t **victims = NULL;
+        unsigned long long victim_bytes = 0;
+        int n = 0;
+
+        while (0 < LRU->count(priv(me)->lru_dirty) &&
+               __mark(s->write_bytes, s->low_watermark) <
+               priv(me)->dirty_bytes - priv(me)->inflight_bytes -
+               victim_bytes)
+        {
+            mpiece_t *mpce = (mpiece_t*)LRU->evict(priv(me)->lru_dirty);
+
+            if (s->write_behind && __queue_flush(me, mpce))
+                continue;
+
+            victims = realloc(victims, sizeof(mpiece_t*) * (n + 1));
+            victims[n++] = mpce;
+            victim_bytes += priv(me)->piece_length;
+        }
+
+        __diskdump_pieces(me, victims, n);
+        free(victims);
+    }
+
+    while (s->write_bytes < priv(me)->dirty_bytes &&
+           0 < priv(me)->inflight_bytes)
+        __wait_for_io(me);
+}
+
+/**
+ * Bring the piece into memory, reading it from disk if it's there
+ * @return 1 if the piece's data came from the disk */
+static int __load_piece(bt_diskcache_t * me, mpiece_t *mpce, int from_disk)
+{
+    void *data = NULL;
+
+    /* dirty frames are about to be written out */
+    if (0 < mpce->ndirty_frames)
+        from_disk = 1;
+    __drop_frames(me, mpce, 1);
+
+    if (from_disk)
+    {
+        bt_block_t blk;
+
+        blk.piece_idx = mpce->idx;
+        blk.offset = 0;
+        blk.len = priv(me)->piece_length;
+        data = priv(me)->disk->read_block(priv(me)->disk_udata, me, &blk);
+    }
+
+    /* the disk owns what it returns; keep our own copy */
+    mpce->data = __piece_buf(me);
+    if (data)
+        memcpy(mpce->data, data, priv(me)->piece_length);
+    /* blocks that are about to be written don't need zeroing */
+    else if (from_disk)
+        memset(mpce->data, 0, priv(me)->piece_length);
+
+    __touch_clean(me, mpce);
+    priv(me)->clean_bytes += priv(me)->piece_length;
+    return NULL != data;
+}
+
+/**
+ * @return 1 if the piece is too big to hold whole while it's written */
+static int __split(bt_diskcache_t * me)
+{
+    diskcache_settings_t* s = __cfg(me);
+
+    return 0 < s->split_bytes && s->split_bytes < priv(me)->piece_length;
+}
+
+/**
+ * @return 1 if the block lies within one frame */
+static int __in_one_frame(bt_diskcache_t * me, const bt_block_t * blk)
+{
+    diskcache_settings_t* s = __cfg(me);
+
+    if (0 == s->frame_bytes || priv(me)->piece_length <= s->frame_bytes)
+        return 0;
+
+    if (0 == priv(me)->frame_len)
+    {
+        priv(me)->frame_len = s->frame_bytes;
+        priv(me)->frame_shift = bt_pow2_shift(s->frame_bytes);
+    }
+
+    return __frame_of(me, blk->offset) ==
+        __frame_of(me, blk->offset + blk->len - 1);
+}
+
+static int __use_frame(bt_diskcache_t * me, mpiece_t *mpce,
+                       const bt_block_t * blk)
+{
+    int first, seq;
+
+    if (mpce->data || !__in_one_frame(me, blk))
+        return 0;
+
+    first = __frame_of(me, blk->offset);
+
+    /* a peer reading through the piece will want all of it */
+    seq = 0 < first && mpce->next_frame == first;
+    mpce->next_frame = first + 1;
+
+    /* hashing reads the whole piece. Split pieces are never read whole
+     * for a peer */
+    return !seq || __split(me);
+}
+
+/**
+ * Make an empty frame
+ * @param fblk Set to the part of the piece the frame holds */
+static frame_t *__new_frame(bt_diskcache_t * me, mpiece_t *mpce, int idx,
+                            bt_block_t * fblk)
+{
+    frame_t *f;
+
+    if (!mpce->frames)
+        mpce->frames = calloc(__nframes(me), sizeof(frame_t*));
+
+    fblk->piece_idx = mpce->idx;
+    fblk->offset = idx * priv(me)->frame_len;
+    fblk->len = __frame_len(me, idx);
+
+    f = mpce->frames[idx] = calloc(1, sizeof(frame_t));
+    f->mpce = mpce;
+    f->idx = idx;
+    f->data = __frame_buf(me);
+    return f;
+}
+
+/**
+ * @return frame holding the block */
+static frame_t *__get_frame(bt_diskcache_t * me, mpiece_t *mpce,
+                            const bt_block_t * blk)
+{
+    int idx = __frame_of(me, blk->offset);
+    frame_t *f;
+
+    /* read-ahead got here first */
+    while (mpce->frames && mpce->frames[idx] && mpce->frames[idx]->fetching)
+        __wait_for_io(me);
+
+    if (!mpce->frames || !(f = mpce->frames[idx]))
+    {
+        bt_block_t fblk;
+        void *data;
+
+        f = __new_frame(me, mpce, idx, &fblk);
+        if ((data = priv(me)->disk->read_block(priv(me)->disk_udata, me,
+                                               &fblk)))
+            memcpy(f->data, data, fblk.len);
+        else
+            memset(f->data, 0, fblk.len);
+        priv(me)->clean_bytes += fblk.len;
+        priv(me)->stats.misses++;
+    }
+    else
+        priv(me)->stats.hits++;
+
+    LRU->touch(__frame_lru(me, f), &f->ce);
+    return f;
+}
+
+/**
+ * @return frame the block is written to; NULL if it goes to the whole
+ *  piece */
+static frame_t *__write_frame_for(bt_diskcache_t * me, mpiece_t *mpce,
+                                  const bt_block_t * blk)
+{
+    int idx;
+    frame_t *f;
+    bt_block_t fblk;
+
+    if (mpce->data || !__split(me) || !__in_one_frame(me, blk))
+        return NULL;
+
+    idx = __frame_of(me, blk->offset);
+    while (mpce->frames && mpce->frames[idx] && mpce->frames[idx]->fetching)
+        __wait_for_io(me);
+
+    if (mpce->frames && mpce->frames[idx])
+        return mpce->frames[idx];
+
+    f = __new_frame(me, mpce, idx, &fblk);
+
+    /* a block covering the frame needn't have it filled in */
+    if (blk->len < fblk.len)
     {
+        void *data = NULL;
 
+        if (mpce->on_disk)
+            data = priv(me)->disk->read_block(priv(me)->disk_udata, me,
+                                              &fblk);
+        if (data)
+            memcpy(f->data, data, fblk.len);
+        else
+            memset(f->data, 0, fblk.len);
     }
+    priv(me)->clean_bytes += fblk.len;
+    LRU->touch(priv(me)->lru_frames, &f->ce);
+    return f;
+}
 
-    pseudolru_remove(priv(me)->lru_piece, (void *) mpce);
-    free(mpce->data);
-    mpce->data = NULL;
+/**
+ * Move the frame from the read cache to the write cache */
+static void __frame_written(bt_diskcache_t * me, frame_t *f)
+{
+    if (!f->dirty)
+    {
+        int len = __frame_len(me, f->idx);
+
+        LRU->remove(priv(me)->lru_frames, &f->ce);
+        f->dirty = 1;
+        f->mpce->ndirty_frames++;
+        priv(me)->clean_bytes -= len;
+        priv(me)->dirty_bytes += len;
+    }
+    LRU->touch(priv(me)->lru_dirty_frames, &f->ce);
 }
 
 /**
@@ -158,78 +1015,125 @@ static int __write_block(
 {
     bt_diskcache_t *me = udata;
     mpiece_t *mpce;
+    frame_t *f;
 
+    assert(0 < priv(me)->piece_length);
+
+    __reap(me);
     mpce = __get_piece(me, blk->piece_idx);
+    __wait_for_piece(me, mpce);
 
-    if (!mpce->data)
+    /* only hold the part of a huge piece that's been written */
+    if ((f = __write_frame_for(me, mpce, blk)))
     {
-        mpce->data = calloc(1, priv(me)->piece_length);
-        assert(mpce->idx == blk->piece_idx);
+        memcpy(f->data + blk->offset - f->idx * priv(me)->frame_len,
+               blkdata, blk->len);
+        __frame_written(me, f);
+        __trim_dirty(me);
+        __trim_clean(me, NULL);
+        return 1;
     }
 
+    /* don't lose what we've already written out */
+    if (!mpce->data)
+        __load_piece(me, mpce, mpce->on_disk);
+
 #if 0 /* debugging */
     printf("me-writeblock: %d %d %d %d\n",
            blk->piece_idx, blk->offset, blk->len,
-           pseudolru_count(priv(me)->lru_piece));
+           LRU->count(priv(me)->lru_dirty));
 #endif
 
-    assert(0 < priv(me)->piece_length);
     assert(mpce->data);
 
-    /* TODO: remove memcpy for zero-copy */
-    memcpy(mpce->data + blk->offset, blkdata, blk->len);
-
-    /*  touch piece to show how recent it is */
-    pseudolru_put(priv(me)->lru_piece, (void *) mpce, (void *) mpce);
+    /* received straight into the piece; see __get_write_frame */
+    if (blkdata == mpce->data + blk->offset && 0 < mpce->writers)
+        mpce->writers--;
+    else
+        memcpy(mpce->data + blk->offset, blkdata, blk->len);
 
-#if 1
-    /* check if we have enough pieces to write out to disk */
-    if (20 < pseudolru_count(priv(me)->lru_piece))
+    /* move from the read cache to the write cache */
+    if (!mpce->dirty)
     {
-        int ii;
-
-        /*  write out ten to disk */
-
-        for (ii=0; ii < 1; ii++)
-        {
-            mpce = pseudolru_pop_lru(priv(me)->lru_piece);
-            __diskdump_piece(me, mpce->idx);
-        }
+        __remove_clean(me, mpce);
+        priv(me)->clean_bytes -= priv(me)->piece_length;
+        priv(me)->dirty_bytes += priv(me)->piece_length;
+        mpce->dirty = 1;
     }
-#endif
 
+    /*  touch piece to show how recent it is */
+    LRU->touch(priv(me)->lru_dirty, &mpce->ce);
+
+    __trim_dirty(me);
+    __trim_clean(me, NULL);
     return 1;
 }
 
-static int __flush_block(void *udata, void *caller, const bt_block_t * blk)
+/**
+ * Lend out the part of the piece the block goes to
+ * The piece can't be evicted until the frame comes back through write_block
+ * or __drop_write_frame */
+static void *__get_write_frame(void *udata, void *caller,
+                               const bt_block_t * blk)
 {
     bt_diskcache_t *me = udata;
     mpiece_t *mpce;
 
+    assert(0 < priv(me)->piece_length);
+
+    __reap(me);
     mpce = __get_piece(me, blk->piece_idx);
+    __wait_for_piece(me, mpce);
+
+    /* split pieces are copied into their frames by write_block */
+    if (!mpce->data && __split(me) && __in_one_frame(me, blk))
+        return NULL;
 
     if (!mpce->data)
     {
-        return 0;
+        __load_piece(me, mpce, mpce->on_disk);
+        __trim_clean(me, mpce);
     }
 
-    __diskdump_piece(me,blk->piece_idx);
-    //__write_block(udata,caller,blk,blkdata);
+    mpce->writers++;
+    return mpce->data + blk->offset;
+}
 
-    return 1;
+static void __drop_write_frame(void *udata, void *caller,
+                               const bt_block_t * blk, void *frame)
+{
+    bt_diskcache_t *me = udata;
+    mpiece_t *mpce;
+
+    mpce = __get_piece(me, blk->piece_idx);
+    assert(0 < mpce->writers);
+    mpce->writers--;
 }
 
-static void *__get_piece_data_from_disk(
-    bt_diskcache_t * me,
-    const int piece_idx
-)
+static int __flush_block(void *udata, void *caller, const bt_block_t * blk)
 {
-    bt_block_t blk;
+    bt_diskcache_t *me = udata;
+    mpiece_t *mpce;
 
-    blk.piece_idx = piece_idx;
-    blk.offset = 0;
-    blk.len = priv(me)->piece_length;
-    return priv(me)->disk->read_block(priv(me)->disk_udata, me, &blk);
+    __reap(me);
+    mpce = __get_piece(me, blk->piece_idx);
+    __wait_for_piece(me, mpce);
+
+    if (mpce->data && mpce->dirty)
+    {
+        __diskdump_piece(me,blk->piece_idx);
+        __trim_clean(me, NULL);
+    }
+    else if (0 < mpce->ndirty_frames)
+    {
+        __diskdump_frames(me, mpce);
+        __trim_clean(me, NULL);
+    }
+
+    /* the disk below may be holding the writes too */
+    if (priv(me)->disk && priv(me)->disk->flush_block)
+        return priv(me)->disk->flush_block(priv(me)->disk_udata, me, blk);
+    return 1;
 }
 
 /**
@@ -250,31 +1154,164 @@ static void *__read_block(void *udata, void *caller, const bt_block_t * blk)
             blk->piece_idx, blk->offset, blk->len);
 #endif
 
+    __reap(me);
     mpce = __get_piece(me, blk->piece_idx);
+    while (mpce->fetching)
+        __wait_for_io(me);
+
+    /* only read what we need */
+    if (__use_frame(me, mpce, blk))
+    {
+        frame_t *f = __get_frame(me, mpce, blk);
+
+        __trim_clean(me, f);
+        return f->data + blk->offset - f->idx * priv(me)->frame_len;
+    }
 
     /* do we have the data in memory? */
     if (!mpce->data)
     {
-        if (!(mpce->data = __get_piece_data_from_disk(me, blk->piece_idx)))
-        {
-            mpce->data = malloc(priv(me)->piece_length);
-            mpce->idx = blk->piece_idx;
-            memset(mpce->data, 0, priv(me)->piece_length);
-        }
-        else
-        {
-            return NULL;
-        }
+        __load_piece(me, mpce, 1);
+        priv(me)->stats.misses++;
     }
+    else
+        priv(me)->stats.hits++;
 
     assert(mpce->data);
 
-    /*  touch piece to show how recent it is */
-    pseudolru_put(priv(me)->lru_piece, (void *) mpce, (void *) mpce);
+    /*  touch piece to show how recent it is.
+     *  Pieces being flushed are read from while the flusher has them */
+    if (mpce->flushing)
+        ;
+    else if (mpce->dirty)
+        LRU->touch(priv(me)->lru_dirty, &mpce->ce);
+    else
+    {
+        __touch_clean(me, mpce);
+        __trim_clean(me, mpce);
+    }
 
     return mpce->data + blk->offset;
 }
 
+/**
+ * Start reading the block into the cache on the io thread.
+ * Only requested blocks are read ahead; a peer reading through a piece
+ * already gets the whole piece promoted, see __use_frame
+ * @return 1 if the block is cached or on its way */
+static int __prefetch_block(void *udata, void *caller, const bt_block_t * blk)
+{
+    bt_diskcache_t *me = udata;
+    diskcache_settings_t* s = __cfg(me);
+    mpiece_t *mpce;
+    io_job_t *j;
+
+    if (!s->read_ahead || 0 == s->read_bytes)
+        return 0;
+
+    __reap(me);
+    mpce = __get_piece(me, blk->piece_idx);
+
+    if (mpce->data || mpce->fetching)
+        return 1;
+
+    if (__in_one_frame(me, blk) && mpce->frames &&
+        mpce->frames[__frame_of(me, blk->offset)])
+        return 1;
+
+    if (!__start_io(me))
+        return 0;
+
+    j = calloc(1, sizeof(io_job_t));
+    j->type = IO_FETCH;
+    j->mpce = mpce;
+
+    if (__in_one_frame(me, blk))
+    {
+        j->frame = __new_frame(me, mpce, __frame_of(me, blk->offset),
+                               &j->blk);
+        j->frame->fetching = 1;
+        j->buf = j->frame->data;
+    }
+    else
+    {
+        __drop_frames(me, mpce, 1);
+        j->blk.piece_idx = mpce->idx;
+        j->blk.offset = 0;
+        j->blk.len = priv(me)->piece_length;
+        j->buf = __piece_buf(me);
+        mpce->fetching = 1;
+    }
+
+    __queue_io(me, j);
+    return 1;
+}
+
+/**
+ * The file only holds the block once we've dumped the piece, or its
+ * frames
+ * @return 1 if the disk can provide the block's file region */
+static int __block_file_span(void *udata, void *caller,
+                             const bt_block_t * blk,
+                             int *fd, unsigned long long *offset)
+{
+    bt_diskcache_t *me = udata;
+
+    if (!priv(me)->disk->block_file_span)
+        return 0;
+
+    if (blk->piece_idx < priv(me)->npieces &&
+        priv(me)->pieces[blk->piece_idx] &&
+        (priv(me)->pieces[blk->piece_idx]->dirty ||
+         0 < priv(me)->pieces[blk->piece_idx]->ndirty_frames))
+        return 0;
+
+    return priv(me)->disk->block_file_span(priv(me)->disk_udata, me, blk,
+                                           fd, offset);
+}
+
+static void __get_cache_stats(void *udata, bt_cache_stats_t * stats)
+{
+    *stats = priv(udata)->stats;
+}
+
+static unsigned long long __get_memory(void *udata)
+{
+    return priv(udata)->dirty_bytes + priv(udata)->clean_bytes;
+}
+
+/**
+ * Shrink the budgets now, rather than on the next write */
+static void __set_memory_limit(void *udata, unsigned long long bytes)
+{
+    bt_diskcache_t *me = udata;
+
+    if (priv(me)->memory_limit == bytes)
+        return;
+
+    priv(me)->memory_limit = bytes;
+    priv(me)->settings.version = ~0u;
+
+    /* nothing is held until the piece length is known */
+    if (0 == priv(me)->piece_length)
+        return;
+    __trim_dirty(me);
+    __trim_clean(me, NULL);
+}
+
+/**
+ * Pass submission through to the disk, if it queues its writes */
+static int __submit(void *udata, void *caller, func_block_written_f cb,
+                    void *cb_udata)
+{
+    bt_diskcache_t *me = udata;
+
+    if (!priv(me)->disk || !priv(me)->disk->submit)
+        return 0;
+
+    return priv(me)->disk->submit(priv(me)->disk_udata, me, cb, cb_udata);
+}
+
 void *bt_diskcache_new()
 {
     bt_diskcache_t *me;
@@ -283,11 +1320,114 @@ void *bt_diskcache_new()
     priv(me)->irw.write_block = __write_block;
     priv(me)->irw.read_block = __read_block;
     priv(me)->irw.flush_block = __flush_block;
+    priv(me)->irw.block_file_span = __block_file_span;
+    priv(me)->irw.prefetch_block = __prefetch_block;
+    priv(me)->irw.submit = __submit;
+    priv(me)->irw.get_write_frame = __get_write_frame;
+    priv(me)->irw.drop_write_frame = __drop_write_frame;
+    priv(me)->irw.get_cache_stats = __get_cache_stats;
+    priv(me)->irw.get_memory = __get_memory;
+    priv(me)->irw.set_memory_limit = __set_memory_limit;
     priv(me)->piece_length = 0;
-    priv(me)->lru_piece = pseudolru_new(__lru_piece_compare);
+    priv(me)->lru_dirty = LRU->new(0);
+    priv(me)->lru_frames = LRU->new(0);
+    priv(me)->lru_dirty_frames = LRU->new(0);
+    priv(me)->io_queue = llqueue_new();
+    priv(me)->io_done = llqueue_new();
+    pthread_mutex_init(&priv(me)->lock, NULL);
+    pthread_cond_init(&priv(me)->cond, NULL);
+    pthread_cond_init(&priv(me)->done_cond, NULL);
+
+    /* default configuration */
+    priv(me)->cfg = config_new();
+    /* force the first read of the settings */
+    priv(me)->settings.version = ~0u;
+    /* bytes of written data held before it is flushed to disk */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_write_bytes", "33554432");
+    /* bytes of data kept in memory for uploading */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_read_bytes", "16777216");
+    /* percent of a budget that starts eviction */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_high_watermark", "90");
+    /* percent of a budget that eviction stops at */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_low_watermark", "70");
+    /* 1 means evicted pieces are written out on a background thread */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_write_behind", "0");
+    /* 1 means blocks peers have asked for are read in on a background
+     * thread */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_read_ahead", "0");
+    /* read misses load this much of a piece; 0 means load whole pieces */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_frame_bytes", "16384");
+    /* pieces longer than this are written into frames, so a piece that's
+     * partly downloaded only holds what's been written; 0 means hold whole
+     * pieces */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_split_piece_bytes",
+                          "4194304");
+    /* 1 means buffers are backed by huge pages where possible */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_hugepages", "0");
+    /* how clean pieces are evicted; "arc" or "lru" */
+    config_set_if_not_set(priv(me)->cfg, "diskcache_policy", "arc");
     return me;
 }
 
+void bt_diskcache_free(void *dco)
+{
+    bt_diskcache_t *me = dco;
+    int ii;
+
+    /* the flusher writes out what's left in its queue before stopping */
+    if (priv(me)->io_running)
+    {
+        pthread_mutex_lock(&priv(me)->lock);
+        priv(me)->shutdown = 1;
+        pthread_cond_broadcast(&priv(me)->cond);
+        pthread_mutex_unlock(&priv(me)->lock);
+        pthread_join(priv(me)->io_thread, NULL);
+        __reap(me);
+    }
+
+    for (ii = 0; ii < priv(me)->npieces; ii++)
+    {
+        if (!priv(me)->pieces[ii])
+            continue;
+        __drop_frames(me, priv(me)->pieces[ii], 0);
+        if (priv(me)->pieces[ii]->data)
+            bt_slab_release(priv(me)->piece_slab, priv(me)->pieces[ii]->data);
+        free(priv(me)->pieces[ii]);
+    }
+    free(priv(me)->pieces);
+    if (priv(me)->piece_slab)
+        bt_slab_free(priv(me)->piece_slab);
+    if (priv(me)->frame_slab)
+        bt_slab_free(priv(me)->frame_slab);
+    LRU->free(priv(me)->lru_dirty);
+    LRU->free(priv(me)->lru_frames);
+    LRU->free(priv(me)->lru_dirty_frames);
+    if (priv(me)->clean)
+        priv(me)->ipol->free(priv(me)->clean);
+    llqueue_free(priv(me)->io_queue);
+    llqueue_free(priv(me)->io_done);
+    pthread_cond_destroy(&priv(me)->done_cond);
+    pthread_cond_destroy(&priv(me)->cond);
+    pthread_mutex_destroy(&priv(me)->lock);
+    config_free(priv(me)->cfg);
+    free(priv(me)->cfg);
+    free(me);
+}
+
+void bt_diskcache_set_policy(void *dco, const bt_cache_policy_i *ipol)
+{
+    bt_diskcache_t *me = dco;
+
+    assert(!priv(me)->clean);
+    priv(me)->ipol = ipol;
+}
+
+void* bt_diskcache_get_config(void *dco)
+{
+    bt_diskcache_t *me = dco;
+    return priv(me)->cfg;
+}
+
 void bt_diskcache_set_size(void *dco, const int piece_bytes_size)
 {
     bt_diskcache_t *me = dco;
@@ -326,13 +1466,41 @@ void bt_diskcache_disk_dump(void *dco)
 
     int ii;
 
-    for (ii = 0; ii < priv(me)->npieces; ii++)
+    __reap(me);
+    while (0 < priv(me)->inflight_bytes)
+        __wait_for_io(me);
+
     {
-        mpiece_t *p = __get_piece(me, ii);
+        mpiece_t **dirty;
+        int n = 0;
 
-        if (p->data)
+        dirty = malloc(sizeof(mpiece_t*) * (priv(me)->npieces + 1));
+
+        for (ii = 0; ii < priv(me)->npieces; ii++)
         {
-            __diskdump_piece(me, ii);
+            mpiece_t *p = __get_piece(me, ii);
+
+            if (p->dirty)
+                dirty[n++] = p;
+            else if (0 < p->ndirty_frames)
+                __diskdump_frames(me, p);
         }
+
+        __diskdump_pieces(me, dirty, n);
+        free(dirty);
     }
+
+    __trim_clean(me, NULL);
+}
+
+unsigned long long bt_diskcache_get_dirty_bytes(void *dco)
+{
+    bt_diskcache_t *me = dco;
+    return priv(me)->dirty_bytes;
+}
+
+unsigned long long bt_diskcache_get_clean_bytes(void *dco)
+{
+    bt_diskcache_t *me = dco;
+    return priv(me)->clean_bytes;
 }
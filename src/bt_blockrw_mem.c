@@ -28,15 +28,44 @@
 #include <string.h>
 
 #include "bt.h"
+#include "bt_diskmem.h"
 
 typedef struct
 {
     bt_blockrw_i irw;
     int piece_size;
-    int data_size;
-    unsigned char *data;
+
+    /* one page per piece, allocated when the piece is first touched */
+    unsigned char **pages;
+    unsigned int npages;
 } diskmem_t;
 
+/**
+ * Make room in the page table for this many pieces */
+static void __grow(diskmem_t * me, unsigned int npages)
+{
+    unsigned int n;
+
+    if (npages <= me->npages)
+        return;
+
+    /* double, so pieces arriving in order don't each cost a realloc */
+    for (n = me->npages ? me->npages : 1; n < npages; n *= 2)
+        ;
+
+    me->pages = realloc(me->pages, sizeof(unsigned char*) * n);
+    memset(me->pages + me->npages, 0,
+           sizeof(unsigned char*) * (n - me->npages));
+    me->npages = n;
+}
+
+static unsigned char *__page(diskmem_t * me, unsigned int piece_idx)
+{
+    if (!me->pages[piece_idx])
+        me->pages[piece_idx] = calloc(1, me->piece_size);
+    return me->pages[piece_idx];
+}
+
 int bt_diskmem_write_block(
     void *udata,
     void *caller __attribute__((__unused__)),
@@ -45,51 +74,40 @@ int bt_diskmem_write_block(
 )
 {
     diskmem_t *me = udata;
-    unsigned int offset;
+    unsigned char *dst;
 
-#if 0 /* debugging */
-    int ii;
+    assert(0 < me->piece_size);
+    assert(blk->offset + blk->len <= (unsigned int)me->piece_size);
 
-    printf("diskmem %d:", blk->offset);
-    for (ii = 0; ii < blk->len; ii++)
-        printf("%02x,", ((const unsigned char*)blkdata)[ii]);
-    printf("\n");
-//    for (ii = 0; ii < blk->len; ii++)
-//        printf("%c,", ((const unsigned char*)blkdata)[ii]);
-//    printf("\n");
-#endif
+    __grow(me, blk->piece_idx + 1);
+    dst = __page(me, blk->piece_idx) + blk->offset;
 
-    assert(me->data);
-
-    offset = blk->piece_idx * me->piece_size + blk->offset;
-
-    /* if required, enlarge capacity */
-    if (me->data_size < offset + blk->len)
-    {
-        me->data_size = offset + blk->len;
-        me->data = realloc(me->data, me->data_size);
-    }
-
-    memcpy(me->data + offset, blkdata, blk->len);
+    /* received straight into the page; see __get_write_frame */
+    if (dst != blkdata)
+        memcpy(dst, blkdata, blk->len);
+    return 1;
+}
 
-#if 0 /* debugging */
-    {
-    int ii;
+/**
+ * Pages don't move, so they can be written into directly */
+static void *__get_write_frame(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmem_t *me = udata;
 
-    printf("diskmem %d:", blk->offset);
-    for (ii = 0; ii < blk->len; ii++)
-        printf("%02x,", ((const unsigned char*)me->data)[ii]);
-    printf("\n");
-    }
-#endif
+    if ((unsigned int)me->piece_size < blk->offset + blk->len)
+        return NULL;
 
-    return 1;
+    __grow(me, blk->piece_idx + 1);
+    return __page(me, blk->piece_idx) + blk->offset;
 }
 
 /**
  * read data.
- * Check if we have the data in the cache;
- * Otherwise retrieve the memory from the disk */
+ * Pieces within the size that haven't been written read as zeroes */
 static void *__read_block(
     void *udata,
     void *caller __attribute__((__unused__)),
@@ -97,26 +115,23 @@ static void *__read_block(
 )
 {
     diskmem_t *me = udata;
-    unsigned int offset;
 
-    offset = blk->piece_idx * me->piece_size + blk->offset;
-
-    if (me->data_size < offset + blk->len)
-    {
-//        printf("too big %d %d\n", me->data_size, offset + blk->len);
+    if (me->npages <= blk->piece_idx ||
+        (unsigned int)me->piece_size < blk->offset + blk->len)
         return NULL;
-    }
 
-    return me->data + offset;
+    return __page(me, blk->piece_idx) + blk->offset;
 }
 
+/**
+ * Nothing is ever waiting to be written back */
 static int __flush_block(
     void *udata,
     void *caller __attribute__((__unused__)),
     const bt_block_t * blk
 )
 {
-    return 0;
+    return 1;
 }
 
 void *bt_diskmem_new(
@@ -128,7 +143,8 @@ void *bt_diskmem_new(
     me->irw.write_block = bt_diskmem_write_block;
     me->irw.read_block = __read_block;
     me->irw.flush_block = __flush_block;
-    me->data = NULL;
+    me->irw.get_write_frame = __get_write_frame;
+    me->irw.get_memory = bt_diskmem_get_committed_bytes;
 //    me->irw.giveup_block = NULL;
 
     return me;
@@ -139,9 +155,13 @@ void bt_diskmem_free(
 )
 {
     diskmem_t *me = meo;
+    unsigned int i;
 
-    if (me->data)
-        free(me->data);
+    for (i = 0; i < me->npages; i++)
+        if (me->pages[i])
+            free(me->pages[i]);
+    if (me->pages)
+        free(me->pages);
     free(me);
 }
 
@@ -151,11 +171,43 @@ void bt_diskmem_set_size(
 )
 {
     diskmem_t *me = meo;
+    unsigned int i;
+
+    /* pages are sized to the piece, so a new piece size drops them */
+    for (i = 0; i < me->npages; i++)
+        if (me->pages[i])
+        {
+            free(me->pages[i]);
+            me->pages[i] = NULL;
+        }
 
     me->piece_size = piece_bytes_size;
-    me->data_size = piece_bytes_size * 10;
-    me->data = realloc(me->data, me->data_size);
-    memset(me->data, 0, me->data_size);
+    __grow(me, 10);
+}
+
+void bt_diskmem_set_total_size(
+    void *meo,
+    const unsigned long long total_bytes
+)
+{
+    diskmem_t *me = meo;
+
+    assert(0 < me->piece_size);
+    __grow(me, (total_bytes + me->piece_size - 1) / me->piece_size);
+}
+
+unsigned long long bt_diskmem_get_committed_bytes(
+    void *meo
+)
+{
+    diskmem_t *me = meo;
+    unsigned long long bytes = 0;
+    unsigned int i;
+
+    for (i = 0; i < me->npages; i++)
+        if (me->pages[i])
+            bytes += me->piece_size;
+    return bytes;
 }
 
 bt_blockrw_i *bt_diskmem_get_blockrw(
@@ -0,0 +1,295 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief A disk layer which maps the payload file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * A backend block read/writer that hands out pointers into a shared mapping
+ * of the file. Flushing a piece msyncs it and tells the kernel we are done
+ * with its pages, so seeding large read-mostly torrents doesn't pin them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmmap.h"
+
+typedef struct
+{
+    bt_blockrw_i irw;
+    int piece_size;
+    int fd;
+    unsigned long long size;
+    unsigned char *map;
+    int access;
+} diskmmap_t;
+
+/**
+ * Find where the block lives in the mapping
+ * @return 1 if the block is inside the file; otherwise 0 */
+static int __block_offset(
+    diskmmap_t *me,
+    const bt_block_t * blk,
+    unsigned long long *offset
+)
+{
+    if (!me->map)
+        return 0;
+
+    *offset = (unsigned long long)blk->piece_idx * me->piece_size +
+        blk->offset;
+
+    return *offset + blk->len <= me->size;
+}
+
+/**
+ * Widen the range out to page boundaries, as madvise and msync need */
+static void __page_range(
+    diskmmap_t *me,
+    unsigned long long offset,
+    unsigned long long len,
+    void **addr,
+    size_t *addr_len
+)
+{
+    unsigned long long page = sysconf(_SC_PAGESIZE);
+    unsigned long long start = offset & ~(page - 1);
+
+    if (me->size < offset + len)
+        len = me->size - offset;
+    *addr = me->map + start;
+    *addr_len = offset + len - start;
+}
+
+static int __write_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *blkdata
+)
+{
+    diskmmap_t *me = udata;
+    unsigned long long offset;
+
+    if (!__block_offset(me, blk, &offset))
+        return 0;
+
+    memcpy(me->map + offset, blkdata, blk->len);
+    return 1;
+}
+
+static void *__read_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmmap_t *me = udata;
+    unsigned long long offset;
+
+    if (!__block_offset(me, blk, &offset))
+        return NULL;
+
+    return me->map + offset;
+}
+
+/**
+ * Write the whole piece back and drop its pages from our mapping.
+ * The pages stay in the page cache, so re-reading them is cheap */
+static int __flush_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmmap_t *me = udata;
+    unsigned long long offset;
+    void *addr;
+    size_t len;
+
+    if (!me->map)
+        return 0;
+
+    offset = (unsigned long long)blk->piece_idx * me->piece_size;
+    if (me->size <= offset)
+        return 0;
+
+    __page_range(me, offset, me->piece_size, &addr, &len);
+
+    if (-1 == msync(addr, len, MS_SYNC))
+    {
+        perror("msync");
+        return 0;
+    }
+
+    madvise(addr, len, MADV_DONTNEED);
+    return 1;
+}
+
+static int __block_file_span(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    int *fd,
+    unsigned long long *offset
+)
+{
+    diskmmap_t *me = udata;
+
+    if (!__block_offset(me, blk, offset))
+        return 0;
+
+    *fd = me->fd;
+    return 1;
+}
+
+static int __prefetch_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmmap_t *me = udata;
+    unsigned long long offset;
+    void *addr;
+    size_t len;
+
+    if (!__block_offset(me, blk, &offset))
+        return 0;
+
+    __page_range(me, offset, blk->len, &addr, &len);
+    madvise(addr, len, MADV_WILLNEED);
+    return 1;
+}
+
+static void __advise(diskmmap_t *me)
+{
+    if (!me->map)
+        return;
+
+    madvise(me->map, me->size, BT_DISKMMAP_SEQUENTIAL == me->access ?
+            MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+void *bt_diskmmap_new(
+)
+{
+    diskmmap_t *me;
+
+    me = calloc(1, sizeof(diskmmap_t));
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.block_file_span = __block_file_span;
+    me->irw.prefetch_block = __prefetch_block;
+    me->fd = -1;
+    me->access = BT_DISKMMAP_RANDOM;
+    return me;
+}
+
+static void __close(diskmmap_t *me)
+{
+    if (me->map)
+        munmap(me->map, me->size);
+    if (-1 != me->fd)
+        close(me->fd);
+    me->map = NULL;
+    me->fd = -1;
+    me->size = 0;
+}
+
+void bt_diskmmap_free(
+    void *meo
+)
+{
+    diskmmap_t *me = meo;
+
+    __close(me);
+    free(me);
+}
+
+int bt_diskmmap_open(
+    void *meo,
+    const char *path,
+    unsigned long long size
+)
+{
+    diskmmap_t *me = meo;
+    void *map;
+    int fd;
+
+    __close(me);
+
+    if (0 == size)
+        return 0;
+
+    if (-1 == (fd = open(path, O_RDWR | O_CREAT, 0644)))
+    {
+        perror("open");
+        return 0;
+    }
+
+    if (-1 == ftruncate(fd, size))
+    {
+        perror("ftruncate");
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map)
+    {
+        perror("mmap");
+        close(fd);
+        return 0;
+    }
+
+    me->fd = fd;
+    me->map = map;
+    me->size = size;
+    __advise(me);
+    return 1;
+}
+
+void bt_diskmmap_set_size(
+    void *meo,
+    const int piece_bytes_size
+)
+{
+    diskmmap_t *me = meo;
+
+    me->piece_size = piece_bytes_size;
+}
+
+void bt_diskmmap_set_access(
+    void *meo,
+    int access
+)
+{
+    diskmmap_t *me = meo;
+
+    me->access = access;
+    __advise(me);
+}
+
+bt_blockrw_i *bt_diskmmap_get_blockrw(
+    void *meo
+)
+{
+    diskmmap_t *me = meo;
+
+    return &me->irw;
+}
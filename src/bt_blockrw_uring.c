@@ -0,0 +1,713 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief A disk layer which writes through io_uring
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * Blocks are split into BT_BLOCK_SIZE chunks, each copied into a slab
+ * buffer and put on the submission queue. The slabs are registered with
+ * the ring, so the kernel doesn't have to map the buffers on every write.
+ * Nothing reaches the kernel until submit, which also reaps completions
+ * and reports each finished write_block call.
+ * The ring is driven with the raw syscalls, so there's no liburing
+ * dependency.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskuring.h"
+#include "bt_slab.h"
+#include "linked_list_queue.h"
+
+/* number of chunks that can be queued or in flight at once */
+#define URING_DEPTH 256
+
+#define URING_BUF_LEN (BT_BLOCK_SIZE)
+
+/**
+ * A write_block call. Finished once all its chunks are */
+typedef struct
+{
+    bt_block_t blk;
+    int pending;
+    int ok;
+} uring_write_t;
+
+/**
+ * A chunk of a write_block call, in the ring */
+typedef struct
+{
+    uring_write_t *w;
+    char *buf;
+    unsigned int len;
+    unsigned long long offset;
+} uring_op_t;
+
+typedef struct
+{
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+} uring_t;
+
+typedef struct
+{
+    bt_blockrw_i irw;
+    int piece_size;
+    int fd;
+    unsigned long long size;
+
+    /* ring.fd is -1 if we are writing synchronously */
+    uring_t ring;
+
+    /* buffers have been registered with the ring */
+    int fixed;
+    void *slab;
+
+    uring_op_t ops[URING_DEPTH];
+    uring_op_t *free_ops[URING_DEPTH];
+    int nfree_ops;
+
+    /* chunks put on the submission queue, but not submitted */
+    unsigned int queued;
+
+    /* chunks submitted, but not completed */
+    unsigned int inflight;
+
+    /* finished writes that haven't been reported */
+    linked_list_queue_t *done;
+
+    /* read buffer for each thread */
+    pthread_key_t rbuf;
+
+    pthread_mutex_t lock;
+} diskuring_t;
+
+typedef struct
+{
+    char *data;
+    unsigned int len;
+} uring_rbuf_t;
+
+static int __uring_setup(uring_t *r, unsigned int depth)
+{
+    struct io_uring_params p;
+    char *sq;
+
+    memset(&p, 0, sizeof(struct io_uring_params));
+    if (-1 == (r->fd = syscall(__NR_io_uring_setup, depth, &p)))
+        return 0;
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->sq_map_len < r->cq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = 0;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == r->sq_map)
+        goto fail_sq;
+
+    if (0 == r->cq_map_len)
+        r->cq_map = r->sq_map;
+    else
+    {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == r->cq_map)
+            goto fail_cq;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == r->sqes)
+        goto fail_sqes;
+
+    sq = r->sq_map;
+    r->sq_head = (void*)(sq + p.sq_off.head);
+    r->sq_tail = (void*)(sq + p.sq_off.tail);
+    r->sq_mask = (void*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (void*)(sq + p.sq_off.array);
+    r->cq_head = (void*)((char*)r->cq_map + p.cq_off.head);
+    r->cq_tail = (void*)((char*)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (void*)((char*)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (void*)((char*)r->cq_map + p.cq_off.cqes);
+    return 1;
+
+fail_sqes:
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+fail_cq:
+    munmap(r->sq_map, r->sq_map_len);
+fail_sq:
+    close(r->fd);
+    r->fd = -1;
+    return 0;
+}
+
+static void __uring_teardown(uring_t *r)
+{
+    if (-1 == r->fd)
+        return;
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/**
+ * Register each slab as a fixed buffer
+ * @return 1 if the kernel took them */
+static int __register_slabs(diskuring_t *me)
+{
+    int i, n = bt_slab_get_nslabs(me->slab), ok;
+    struct iovec *iov;
+
+    if (0 == n)
+        return 0;
+
+    iov = calloc(n, sizeof(struct iovec));
+    for (i = 0; i < n; i++)
+    {
+        unsigned long long len;
+
+        iov[i].iov_base = bt_slab_get_slab(me->slab, i, &len);
+        iov[i].iov_len = len;
+    }
+    ok = 0 == syscall(__NR_io_uring_register, me->ring.fd,
+                      IORING_REGISTER_BUFFERS, iov, n);
+    free(iov);
+    return ok;
+}
+
+/**
+ * Find where the block lives in the file
+ * @return 1 if the block is inside the file; otherwise 0 */
+static int __block_offset(
+    diskuring_t *me,
+    const bt_block_t * blk,
+    unsigned long long *offset
+)
+{
+    if (-1 == me->fd)
+        return 0;
+
+    *offset = (unsigned long long)blk->piece_idx * me->piece_size +
+        blk->offset;
+
+    return *offset + blk->len <= me->size;
+}
+
+/**
+ * Send queued chunks to the kernel
+ * @param wait Number of completions to wait for */
+static int __enter(diskuring_t *me, unsigned int wait)
+{
+    int n;
+
+    do
+        n = syscall(__NR_io_uring_enter, me->ring.fd, me->queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (-1 == n && EINTR == errno);
+
+    if (-1 == n)
+    {
+        perror("io_uring_enter");
+        return 0;
+    }
+
+    me->queued -= n;
+    me->inflight += n;
+    return 1;
+}
+
+static void __queue_op(diskuring_t *me, uring_op_t *op)
+{
+    uring_t *r = &me->ring;
+    unsigned int tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    int buf_idx;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (me->fixed && -1 != (buf_idx = bt_slab_find(me->slab, op->buf)))
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = buf_idx;
+    }
+    else
+        sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = me->fd;
+    sqe->off = op->offset;
+    sqe->addr = (unsigned long)op->buf;
+    sqe->len = op->len;
+    sqe->user_data = (unsigned long)op;
+    r->sq_array[idx] = idx;
+
+    /* the kernel mustn't see the tail move before the entry is written */
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    me->queued++;
+}
+
+static void __write_done(diskuring_t *me, uring_write_t *w)
+{
+    if (0 == --w->pending)
+        llqueue_offer(me->done, w);
+}
+
+static void __complete_op(diskuring_t *me, uring_op_t *op, int res)
+{
+    /* short write; queue the rest */
+    if (0 < res && (unsigned int)res < op->len)
+    {
+        memmove(op->buf, op->buf + res, op->len - res);
+        op->len -= res;
+        op->offset += res;
+        __queue_op(me, op);
+        return;
+    }
+
+    if (res < 0 || 0 == res)
+        op->w->ok = 0;
+
+    __write_done(me, op->w);
+    bt_slab_release(me->slab, op->buf);
+    me->free_ops[me->nfree_ops++] = op;
+}
+
+static void __reap(diskuring_t *me)
+{
+    uring_t *r = &me->ring;
+    unsigned int head = *r->cq_head;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+        me->inflight--;
+        __complete_op(me, (void*)(unsigned long)cqe->user_data, cqe->res);
+        head++;
+    }
+
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until every queued chunk has made it to disk */
+static void __drain(diskuring_t *me)
+{
+    if (-1 == me->ring.fd)
+        return;
+
+    while (0 < me->queued || 0 < me->inflight)
+    {
+        if (!__enter(me, 1))
+            break;
+        __reap(me);
+    }
+}
+
+static uring_op_t *__take_op(diskuring_t *me)
+{
+    while (0 == me->nfree_ops)
+    {
+        if (!__enter(me, 1))
+            return NULL;
+        __reap(me);
+    }
+
+    return me->free_ops[--me->nfree_ops];
+}
+
+static int __pwrite(diskuring_t *me, const char *data, unsigned int len,
+                    unsigned long long offset)
+{
+    while (0 < len)
+    {
+        ssize_t n = pwrite(me->fd, data, len, offset);
+
+        if (-1 == n && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return 0;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 1;
+}
+
+static int __write_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *blkdata
+)
+{
+    diskuring_t *me = udata;
+    unsigned long long offset;
+    unsigned int done;
+    uring_write_t *w;
+    int ok = 1;
+
+    pthread_mutex_lock(&me->lock);
+
+    if (!__block_offset(me, blk, &offset))
+    {
+        pthread_mutex_unlock(&me->lock);
+        return 0;
+    }
+
+    if (-1 == me->ring.fd)
+    {
+        ok = __pwrite(me, blkdata, blk->len, offset);
+        pthread_mutex_unlock(&me->lock);
+        return ok;
+    }
+
+    w = malloc(sizeof(uring_write_t));
+    w->blk = *blk;
+    w->ok = 1;
+    /* held until every chunk is queued */
+    w->pending = 1;
+
+    for (done = 0; done < blk->len; )
+    {
+        unsigned int len = blk->len - done;
+        uring_op_t *op;
+
+        if (URING_BUF_LEN < len)
+            len = URING_BUF_LEN;
+
+        if (!(op = __take_op(me)))
+        {
+            w->ok = ok = 0;
+            break;
+        }
+
+        op->w = w;
+        op->buf = bt_slab_alloc(me->slab);
+        op->len = len;
+        op->offset = offset + done;
+        memcpy(op->buf, (const char*)blkdata + done, len);
+        w->pending++;
+        __queue_op(me, op);
+        done += len;
+    }
+
+    __write_done(me, w);
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+static uring_rbuf_t *__rbuf(diskuring_t *me, unsigned int len)
+{
+    uring_rbuf_t *b;
+
+    if (!(b = pthread_getspecific(me->rbuf)))
+    {
+        b = calloc(1, sizeof(uring_rbuf_t));
+        pthread_setspecific(me->rbuf, b);
+    }
+
+    if (b->len < len)
+    {
+        b->data = realloc(b->data, len);
+        b->len = len;
+    }
+
+    return b;
+}
+
+static void __free_rbuf(void *b_)
+{
+    uring_rbuf_t *b = b_;
+
+    free(b->data);
+    free(b);
+}
+
+/**
+ * The data is valid until this thread's next read */
+static void *__read_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskuring_t *me = udata;
+    unsigned long long offset;
+    uring_rbuf_t *b;
+    unsigned int done;
+
+    pthread_mutex_lock(&me->lock);
+    if (!__block_offset(me, blk, &offset))
+    {
+        pthread_mutex_unlock(&me->lock);
+        return NULL;
+    }
+    __drain(me);
+    pthread_mutex_unlock(&me->lock);
+
+    b = __rbuf(me, blk->len);
+    for (done = 0; done < blk->len; )
+    {
+        ssize_t n = pread(me->fd, b->data + done, blk->len - done,
+                          offset + done);
+
+        if (-1 == n && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return NULL;
+        done += n;
+    }
+
+    return b->data;
+}
+
+static int __flush_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk __attribute__((__unused__))
+)
+{
+    diskuring_t *me = udata;
+    int ok;
+
+    pthread_mutex_lock(&me->lock);
+    __drain(me);
+    ok = -1 != me->fd && 0 == fdatasync(me->fd);
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+static int __block_file_span(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    int *fd,
+    unsigned long long *offset
+)
+{
+    diskuring_t *me = udata;
+    int ok;
+
+    pthread_mutex_lock(&me->lock);
+    if ((ok = __block_offset(me, blk, offset)))
+    {
+        /* the file has to have the block before it can be sent from it */
+        __drain(me);
+        *fd = me->fd;
+    }
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+static int __prefetch_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskuring_t *me = udata;
+    unsigned long long offset;
+
+    if (!__block_offset(me, blk, &offset))
+        return 0;
+
+    posix_fadvise(me->fd, offset, blk->len, POSIX_FADV_WILLNEED);
+    return 1;
+}
+
+static int __submit(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    func_block_written_f cb,
+    void *cb_udata
+)
+{
+    diskuring_t *me = udata;
+    linked_list_queue_t *done;
+    uring_write_t *w;
+    int outstanding;
+
+    pthread_mutex_lock(&me->lock);
+    if (-1 != me->ring.fd)
+    {
+        if (0 < me->queued)
+            __enter(me, 0);
+        __reap(me);
+    }
+    outstanding = me->queued + me->inflight;
+
+    /* report without the lock, so the callback can use the disk */
+    done = me->done;
+    me->done = llqueue_new();
+    pthread_mutex_unlock(&me->lock);
+
+    while ((w = llqueue_poll(done)))
+    {
+        if (cb)
+            cb(cb_udata, &w->blk, w->ok);
+        free(w);
+    }
+    llqueue_free(done);
+
+    return outstanding;
+}
+
+void *bt_diskuring_new(
+)
+{
+    diskuring_t *me;
+    int i;
+
+    me = calloc(1, sizeof(diskuring_t));
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.block_file_span = __block_file_span;
+    me->irw.prefetch_block = __prefetch_block;
+    me->irw.submit = __submit;
+    me->fd = -1;
+    me->ring.fd = -1;
+    me->slab = bt_slab_new(URING_BUF_LEN,
+                           (unsigned long long)URING_DEPTH * URING_BUF_LEN, 0);
+    for (i = 0; i < URING_DEPTH; i++)
+        me->free_ops[i] = &me->ops[i];
+    me->nfree_ops = URING_DEPTH;
+    me->done = llqueue_new();
+    pthread_key_create(&me->rbuf, __free_rbuf);
+    pthread_mutex_init(&me->lock, NULL);
+    return me;
+}
+
+static void __close(diskuring_t *me)
+{
+    uring_write_t *w;
+
+    __drain(me);
+    while ((w = llqueue_poll(me->done)))
+        free(w);
+    __uring_teardown(&me->ring);
+    me->fixed = 0;
+    if (-1 != me->fd)
+        close(me->fd);
+    me->fd = -1;
+    me->size = 0;
+}
+
+void bt_diskuring_free(
+    void *meo
+)
+{
+    diskuring_t *me = meo;
+    uring_rbuf_t *b;
+
+    __close(me);
+    llqueue_free(me->done);
+    bt_slab_free(me->slab);
+    /* other threads' buffers are freed as those threads exit */
+    if ((b = pthread_getspecific(me->rbuf)))
+        __free_rbuf(b);
+    pthread_key_delete(me->rbuf);
+    pthread_mutex_destroy(&me->lock);
+    free(me);
+}
+
+int bt_diskuring_open(
+    void *meo,
+    const char *path,
+    unsigned long long size
+)
+{
+    diskuring_t *me = meo;
+    int fd;
+
+    pthread_mutex_lock(&me->lock);
+    __close(me);
+
+    if (-1 == (fd = open(path, O_RDWR | O_CREAT, 0644)))
+    {
+        perror("open");
+        pthread_mutex_unlock(&me->lock);
+        return 0;
+    }
+
+    if (-1 == ftruncate(fd, size))
+    {
+        perror("ftruncate");
+        close(fd);
+        pthread_mutex_unlock(&me->lock);
+        return 0;
+    }
+
+    me->fd = fd;
+    me->size = size;
+
+    /* without a ring, we fall back to writing synchronously */
+    if (__uring_setup(&me->ring, URING_DEPTH))
+        me->fixed = bt_slab_reserve(me->slab) && __register_slabs(me);
+
+    pthread_mutex_unlock(&me->lock);
+    return 1;
+}
+
+void bt_diskuring_set_size(
+    void *meo,
+    const int piece_bytes_size
+)
+{
+    diskuring_t *me = meo;
+
+    me->piece_size = piece_bytes_size;
+}
+
+int bt_diskuring_is_async(
+    void *meo
+)
+{
+    diskuring_t *me = meo;
+
+    return -1 != me->ring.fd;
+}
+
+bt_blockrw_i *bt_diskuring_get_blockrw(
+    void *meo
+)
+{
+    diskuring_t *me = meo;
+
+    return &me->irw;
+}
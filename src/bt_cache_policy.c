@@ -0,0 +1,233 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Cache replacement policies
+ * @desc Items embed a bt_cache_entry_t, so that moving an item between lists
+ *       doesn't need a lookup or an allocation.
+ *       ARC follows Megiddo and Modha, "ARC: A Self-Tuning, Low Overhead
+ *       Replacement Cache" (FAST 2003).
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bt_cache_policy.h"
+
+enum {
+    LIST_NONE,
+    /* recently used once */
+    LIST_T1,
+    /* used more than once */
+    LIST_T2,
+    /* evicted from T1 */
+    LIST_B1,
+    /* evicted from T2 */
+    LIST_B2,
+    LIST_COUNT
+};
+
+typedef struct
+{
+    /* circular lists; each head is a sentinel. Least recent is head.next */
+    bt_cache_entry_t lists[LIST_COUNT];
+    unsigned int len[LIST_COUNT];
+    unsigned int capacity;
+
+    /* target size for T1 */
+    unsigned int p;
+} policy_t;
+
+static void __link(policy_t* me, bt_cache_entry_t* e, int list)
+{
+    bt_cache_entry_t* l = &me->lists[list];
+
+    e->prev = l->prev;
+    e->next = l;
+    l->prev->next = e;
+    l->prev = e;
+    e->list = list;
+    me->len[list]++;
+}
+
+static void __unlink(policy_t* me, bt_cache_entry_t* e)
+{
+    if (LIST_NONE == e->list)
+        return;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->next = e->prev = NULL;
+    me->len[e->list]--;
+    e->list = LIST_NONE;
+}
+
+static bt_cache_entry_t* __lru_of(policy_t* me, int list)
+{
+    bt_cache_entry_t* l = &me->lists[list];
+
+    return l->next == l ? NULL : l->next;
+}
+
+static void* __new(unsigned int capacity)
+{
+    policy_t* me;
+    int i;
+
+    me = calloc(1, sizeof(policy_t));
+    for (i = 0; i < LIST_COUNT; i++)
+        me->lists[i].next = me->lists[i].prev = &me->lists[i];
+    me->capacity = capacity;
+    return me;
+}
+
+static void __free(void* p)
+{
+    free(p);
+}
+
+static void __set_capacity(void* p, unsigned int capacity)
+{
+    policy_t* me = p;
+
+    me->capacity = capacity;
+    if (me->capacity < me->p)
+        me->p = me->capacity;
+}
+
+static void __remove(void* p, bt_cache_entry_t* e)
+{
+    __unlink(p, e);
+}
+
+static int __count(void* p)
+{
+    policy_t* me = p;
+
+    return me->len[LIST_T1] + me->len[LIST_T2];
+}
+
+static void __lru_touch(void* p, bt_cache_entry_t* e)
+{
+    __unlink(p, e);
+    __link(p, e, LIST_T1);
+}
+
+static bt_cache_entry_t* __lru_evict(void* p)
+{
+    bt_cache_entry_t* e;
+
+    if ((e = __lru_of(p, LIST_T1)))
+        __unlink(p, e);
+    return e;
+}
+
+static unsigned int __max(unsigned int a, unsigned int b)
+{
+    return a < b ? b : a;
+}
+
+/**
+ * Keep history within the bounds ARC sets out */
+static void __arc_trim_history(policy_t* me)
+{
+    bt_cache_entry_t* e;
+
+    if (me->capacity <= me->len[LIST_T1] + me->len[LIST_B1])
+    {
+        if ((e = __lru_of(me, LIST_B1)))
+            __unlink(me, e);
+    }
+    else if (2 * me->capacity <= me->len[LIST_T1] + me->len[LIST_T2] +
+             me->len[LIST_B1] + me->len[LIST_B2])
+    {
+        if ((e = __lru_of(me, LIST_B2)))
+            __unlink(me, e);
+    }
+}
+
+static void __arc_touch(void* p, bt_cache_entry_t* e)
+{
+    policy_t* me = p;
+    unsigned int delta;
+
+    switch (e->list)
+    {
+    case LIST_T1:
+    case LIST_T2:
+        break;
+    /* we evicted it too early from T1, so T1 should be bigger */
+    case LIST_B1:
+        delta = __max(me->len[LIST_B2] / me->len[LIST_B1], 1);
+        me->p = me->capacity - me->p < delta ? me->capacity : me->p + delta;
+        break;
+    /* we evicted it too early from T2, so T1 should be smaller */
+    case LIST_B2:
+        delta = __max(me->len[LIST_B1] / me->len[LIST_B2], 1);
+        me->p = me->p < delta ? 0 : me->p - delta;
+        break;
+    default:
+        __arc_trim_history(me);
+        __link(me, e, LIST_T1);
+        return;
+    }
+
+    __unlink(me, e);
+    __link(me, e, LIST_T2);
+}
+
+static bt_cache_entry_t* __arc_evict(void* p)
+{
+    policy_t* me = p;
+    bt_cache_entry_t* e;
+
+    if (me->len[LIST_T1] &&
+        (me->p < me->len[LIST_T1] || 0 == me->len[LIST_T2]))
+    {
+        e = __lru_of(me, LIST_T1);
+        __unlink(me, e);
+        __link(me, e, LIST_B1);
+    }
+    else if ((e = __lru_of(me, LIST_T2)))
+    {
+        __unlink(me, e);
+        __link(me, e, LIST_B2);
+    }
+
+    return e;
+}
+
+static const bt_cache_policy_i __lru = {
+    .new = __new,
+    .free = __free,
+    .set_capacity = __set_capacity,
+    .touch = __lru_touch,
+    .remove = __remove,
+    .evict = __lru_evict,
+    .count = __count
+};
+
+static const bt_cache_policy_i __arc = {
+    .new = __new,
+    .free = __free,
+    .set_capacity = __set_capacity,
+    .touch = __arc_touch,
+    .remove = __remove,
+    .evict = __arc_evict,
+    .count = __count
+};
+
+const bt_cache_policy_i* bt_cache_policy_lru()
+{
+    return &__lru;
+}
+
+const bt_cache_policy_i* bt_cache_policy_arc()
+{
+    return &__arc;
+}
@@ -0,0 +1,284 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Wire capture and replay
+ * @desc Layout, varints are LEB128:
+ *       magic[8]
+ *       records * { type:u8 id:varint delta_us:varint ... }
+ *       'C' connection: iplen:u8 ip[iplen] port:u16be
+ *       'D' data: len:varint bytes[len]
+ *       'X' disconnection
+ *       A truncated last record is ignored, so the capture of a process
+ *       that died can still be replayed.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bt_capture.h"
+
+#include "linked_list_hashmap.h"
+
+#define MAGIC "YABTCAP1"
+
+enum {
+    REC_CONNECTION = 'C',
+    REC_DATA = 'D',
+    REC_DISCONNECTION = 'X',
+};
+
+typedef struct
+{
+    FILE* fp;
+
+    /* id by nethandle */
+    hashmap_t* ids;
+    unsigned long next_id;
+
+    /* time of the last record */
+    uint64_t last_us;
+} capture_t;
+
+static unsigned long __nethandle_hash(const void *obj)
+{
+    return (unsigned long)obj;
+}
+
+static long __nethandle_compare(const void *obj, const void *other)
+{
+    return (unsigned long)obj - (unsigned long)other;
+}
+
+static uint64_t __now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void __write_varint(FILE* fp, uint64_t v)
+{
+    for (; 0x80 <= v; v >>= 7)
+        fputc((int)(v & 0x7f) | 0x80, fp);
+    fputc((int)v, fp);
+}
+
+static int __read_varint(FILE* fp, uint64_t* v)
+{
+    int shift, c;
+
+    for (*v = 0, shift = 0; shift < 64; shift += 7)
+    {
+        if (EOF == (c = fgetc(fp)))
+            return 0;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Start a record
+ * @return connection's id; 0 if we've not seen the connection */
+static unsigned long __header(capture_t* me, int type, void* nethandle)
+{
+    unsigned long id;
+    uint64_t now;
+
+    if (!(id = (unsigned long)hashmap_get(me->ids, nethandle)))
+    {
+        if (REC_CONNECTION != type)
+            return 0;
+        /* ids aren't reused, and 0 is never one */
+        id = ++me->next_id;
+        hashmap_put(me->ids, nethandle, (void*)id);
+    }
+
+    now = __now_us();
+    if (0 == me->last_us)
+        me->last_us = now;
+
+    fputc(type, me->fp);
+    __write_varint(me->fp, id);
+    __write_varint(me->fp, now - me->last_us);
+    me->last_us = now;
+    return id;
+}
+
+void* bt_capture_open(const char* path)
+{
+    capture_t* me;
+    FILE* fp;
+
+    if (!(fp = fopen(path, "wb")))
+        return NULL;
+
+    if (1 != fwrite(MAGIC, 8, 1, fp))
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    me = calloc(1, sizeof(capture_t));
+    me->fp = fp;
+    me->ids = hashmap_new(__nethandle_hash, __nethandle_compare, 11);
+    return me;
+}
+
+void bt_capture_close(void* me_)
+{
+    capture_t* me = me_;
+
+    fclose(me->fp);
+    hashmap_free(me->ids);
+    free(me);
+}
+
+void bt_capture_connection(void* me_, void* nethandle, const char* ip,
+                           int port)
+{
+    capture_t* me = me_;
+    size_t len = ip ? strlen(ip) : 0;
+
+    /* a handle we still know has been reused */
+    if (hashmap_get(me->ids, nethandle))
+        bt_capture_disconnection(me, nethandle);
+
+    if (255 < len)
+        len = 255;
+
+    __header(me, REC_CONNECTION, nethandle);
+    fputc((int)len, me->fp);
+    fwrite(ip, 1, len, me->fp);
+    fputc((port >> 8) & 0xff, me->fp);
+    fputc(port & 0xff, me->fp);
+}
+
+void bt_capture_data(void* me_, void* nethandle, const void* buf,
+                     unsigned int len)
+{
+    capture_t* me = me_;
+
+    if (0 == len || !__header(me, REC_DATA, nethandle))
+        return;
+    __write_varint(me->fp, len);
+    fwrite(buf, 1, len, me->fp);
+}
+
+void bt_capture_disconnection(void* me_, void* nethandle)
+{
+    capture_t* me = me_;
+
+    if (!__header(me, REC_DISCONNECTION, nethandle))
+        return;
+    hashmap_remove(me->ids, nethandle);
+}
+
+/**
+ * Drop the connection, and tell the caller */
+static void __drop(hashmap_t* live, bt_capture_replay_i* irep, void* caller,
+                   void* nethandle)
+{
+    hashmap_remove(live, nethandle);
+    irep->connection_failed(caller, nethandle);
+}
+
+int bt_capture_replay(const char* path, bt_capture_replay_i* irep,
+                      void* caller)
+{
+    char magic[8], ip[256], *buf = NULL;
+    uint64_t id, delta, len, us = 0, buf_size = 0;
+    hashmap_t* live;
+    FILE* fp;
+    int type, nrecords = 0;
+
+    if (!(fp = fopen(path, "rb")))
+        return -1;
+
+    if (1 != fread(magic, 8, 1, fp) || 0 != memcmp(magic, MAGIC, 8))
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    live = hashmap_new(__nethandle_hash, __nethandle_compare, 11);
+
+    while (EOF != (type = fgetc(fp)) &&
+           __read_varint(fp, &id) && __read_varint(fp, &delta))
+    {
+        void* nethandle = (void*)(uintptr_t)id;
+
+        us += delta;
+
+        if (REC_CONNECTION == type)
+        {
+            int iplen, hi, lo;
+
+            if (EOF == (iplen = fgetc(fp)) ||
+                (iplen && 1 != fread(ip, iplen, 1, fp)) ||
+                EOF == (hi = fgetc(fp)) || EOF == (lo = fgetc(fp)))
+                break;
+            ip[iplen] = '\0';
+
+            if (irep->record_time)
+                irep->record_time(caller, us);
+
+            /* refused connections were never the caller's */
+            if (irep->process_connection(caller, nethandle, ip,
+                                         (hi << 8) | lo))
+                hashmap_put(live, nethandle, nethandle);
+        }
+        else if (REC_DATA == type)
+        {
+            if (!__read_varint(fp, &len))
+                break;
+
+            if (buf_size < len)
+            {
+                char* b;
+
+                if (!(b = realloc(buf, len)))
+                    break;
+                buf = b;
+                buf_size = len;
+            }
+
+            if (1 != fread(buf, len, 1, fp))
+                break;
+
+            if (irep->record_time)
+                irep->record_time(caller, us);
+
+            if (hashmap_get(live, nethandle) &&
+                0 == irep->process_data(caller, nethandle, buf, len))
+                __drop(live, irep, caller, nethandle);
+        }
+        else if (REC_DISCONNECTION == type)
+        {
+            if (irep->record_time)
+                irep->record_time(caller, us);
+
+            if (hashmap_get(live, nethandle))
+                __drop(live, irep, caller, nethandle);
+        }
+        else
+            break;
+
+        nrecords++;
+    }
+
+    free(buf);
+    hashmap_free(live);
+    fclose(fp);
+    return nrecords;
+}
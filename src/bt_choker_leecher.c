@@ -23,9 +23,25 @@
 #include "bt_choker_peer.h"
 #include "bt_choker.h"
 
-#include "linked_list_queue.h"
-#include "linked_list_hashmap.h"
-#include "heap.h"
+#include "bt_hashmap.h"
+#include "bt_list.h"
+
+/* what the choker knows of a peer */
+typedef struct
+{
+    void *peer;
+    int unchoked;
+
+    /* place in the optimistic unchoke queue, while choked */
+    bt_list_t link;
+} cpeer_t;
+
+/* a peer and its upload rate, for ranking */
+typedef struct
+{
+    void *peer;
+    int urate;
+} rank_t;
 
 typedef struct
 {
@@ -33,14 +49,17 @@ typedef struct
     int max_unchoked_peers;
     /*  last time we checked who was choked */
     int time_last_choke_check;
-    hashmap_t *peers;
-    
-    /*  the head node is the node that will be choked */
-    /*  nodes that are choked are removed from the queue */
-    linked_list_queue_t *peers_unchoked;
-    linked_list_queue_t *peers_choked;
-    linked_list_queue_t *peers_waiting_for_optimistic_unchoke;
-    
+
+    /* cpeer_t of each peer */
+    void *peers;
+
+    /*  choked peers in the order they'll be optimistically unchoked */
+    bt_list_t peers_waiting_for_optimistic_unchoke;
+
+    /* scratch space for ranking peers, grown to the number of peers */
+    rank_t *ranks;
+    int ranks_size;
+
     /* choker peer interface, for callbacks on the peer */
     bt_choker_peer_i *iface;
     
@@ -49,58 +68,56 @@ typedef struct
 
 void bt_leeching_choker_unchoke_peer(void *ckr, void *peer);
 
-static unsigned long __peer_hash(const void *obj)
-{
-    return (unsigned long) obj;
-}
-
-static long __peer_compare(const void *obj, const void *other)
-{
-    return obj - other;
-}
-
 void *bt_leeching_choker_new(const int size)
 {
     choker_t *ch;
 
     ch = calloc(1, sizeof(choker_t));
     ch->max_unchoked_peers = size;
-    ch->peers = hashmap_new(__peer_hash, __peer_compare, 11);
-    ch->peers_unchoked = llqueue_new();
-    ch->peers_choked = llqueue_new();
-    ch->peers_waiting_for_optimistic_unchoke = llqueue_new();
+    ch->peers = bt_intmap_new(11);
+    bt_list_init(&ch->peers_waiting_for_optimistic_unchoke);
     return ch;
 }
 
 void bt_leeching_choker_add_peer(void *ckr, void *peer)
 {
     choker_t *ch = ckr;
+    cpeer_t *cp;
 
     /* Don't add the same peer again */
-    if (hashmap_contains_key(ch->peers, peer))
+    if (bt_intmap_get(ch->peers, (uintptr_t)peer))
     {
       return;
     }
 
-    hashmap_put(ch->peers, peer, peer);
-
-    llqueue_offer(ch->peers_choked, peer);
-    llqueue_offer(ch->peers_waiting_for_optimistic_unchoke, peer);
+    cp = calloc(1, sizeof(cpeer_t));
+    cp->peer = peer;
+    bt_intmap_put(ch->peers, (uintptr_t)peer, cp);
+    bt_list_push_tail(&ch->peers_waiting_for_optimistic_unchoke, &cp->link);
 }
 
 void bt_leeching_choker_remove_peer(void *ckr, void *peer)
 {
     choker_t *ch = ckr;
+    cpeer_t *cp;
 
-    hashmap_remove(ch->peers, peer);
+    if (!(cp = bt_intmap_remove(ch->peers, (uintptr_t)peer)))
+        return;
+    bt_list_remove(&cp->link);
+    free(cp);
 }
 
 static void __choke_peer(choker_t * ch, void *peer)
 {
-    llqueue_remove_item(ch->peers_unchoked, peer);
+    cpeer_t *cp = bt_intmap_get(ch->peers, (uintptr_t)peer);
+
     /*  we're back in the queue for being allowed back */
-    llqueue_offer(ch->peers_choked, peer);
-    llqueue_offer(ch->peers_waiting_for_optimistic_unchoke, peer);
+    if (cp->unchoked)
+    {
+        cp->unchoked = 0;
+        bt_list_push_tail(&ch->peers_waiting_for_optimistic_unchoke,
+                          &cp->link);
+    }
     ch->iface->choke_peer(ch->udata, peer);
 }
 
@@ -109,164 +126,151 @@ void bt_leeching_choker_announce_interested_peer(void *cho, void *peer)
  // @TODO
 }
 
-/** 
- * function used in heap for priority 
- * */
-static int __cmp_peer_priority_datarate(const void *i1,
-                                        const void *i2, const void *ckr)
+/**
+ * Copy the peers and their upload rates into the scratch space
+ * @param unchoked_only Leave out choked peers
+ * @return number of peers copied */
+static int __rank_peers(choker_t * ch, int unchoked_only)
 {
-    const choker_t *ch = ckr;
-
-#if 0
-    const peer_t *p1 = i1;
-    const peer_t *p2 = i2;
-
-    return ch->iface->get_urate(ch->udata,
-                                p1->udata_peer) -
-        ch->iface->get_urate(ch->udata, p2->udata_peer);
-#else
-    const void *p1 = i1;
-    const void *p2 = i2;
+    bt_hashmap_iterator_t iter;
+    cpeer_t *cp;
+    int n = 0;
 
     assert(ch->iface);
     assert(ch->iface->get_urate);
 
-    return ch->iface->get_urate(ch->udata, p1) -
-        ch->iface->get_urate(ch->udata, p2);
-#endif
-}
-
-static int __cmp_peer_priority_datarate_inverse(const void *i1,
-                                                const void *i2, const void *ckr)
-{
-    return -__cmp_peer_priority_datarate(i1, i2, ckr);
-}
-
-void bt_leeching_choker_decide_best_npeers(void *ckr)
-{
-    choker_t *ch = ckr;
-
-    heap_t *hp;
-
-    int ii;
-
-    hp = heap_new(__cmp_peer_priority_datarate, ckr);
-
-    /*  poll all peers and offer to priority queue */
-
-    while (0 < llqueue_count(ch->peers_unchoked))
+    if (ch->ranks_size < bt_intmap_count(ch->peers))
     {
-        heap_offer(hp, llqueue_poll(ch->peers_unchoked));
+        ch->ranks_size = bt_intmap_count(ch->peers) * 2;
+        ch->ranks = realloc(ch->ranks, ch->ranks_size * sizeof(rank_t));
     }
 
-    while (0 < llqueue_count(ch->peers_choked))
+    for (bt_intmap_iterator(ch->peers, &iter);
+         (cp = bt_intmap_iterator_next_value(ch->peers, &iter));)
     {
-        heap_offer(hp, llqueue_poll(ch->peers_choked));
+        if (unchoked_only && !cp->unchoked)
+            continue;
+        ch->ranks[n].peer = cp->peer;
+        ch->ranks[n].urate = ch->iface->get_urate(ch->udata, cp->peer);
+        n++;
     }
 
-    /*  poll best four from priority queue */
-
-    for (ii = 0; ii < ch->max_unchoked_peers; ii++)
-    {
-        void *peer;
+    return n;
+}
 
-        peer = heap_poll(hp);
+static void __swap(rank_t* a, rank_t* b)
+{
+    rank_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
 
-        bt_leeching_choker_unchoke_peer(ckr, peer);
-    }
+/**
+ * Partially order r so that the first k have the highest upload rates.
+ * Neither side of the split is sorted */
+static void __select_best(rank_t* r, int n, int k)
+{
+    int lo = 0, hi = n - 1;
 
-    /*  empty residual peers into choked bucket */
+    if (n <= k)
+        return;
 
-    while (0 < heap_count(hp))
+    while (lo < hi)
     {
-        __choke_peer(ch, heap_poll(hp));
+        int i, j = lo, pivot;
+
+        /* Lomuto partition around the middle element */
+        __swap(&r[(lo + hi) / 2], &r[hi]);
+        pivot = r[hi].urate;
+        for (i = lo; i < hi; i++)
+            if (pivot < r[i].urate)
+                __swap(&r[i], &r[j++]);
+        __swap(&r[j], &r[hi]);
+
+        if (j == k || j == k - 1)
+            return;
+        else if (j < k)
+            lo = j + 1;
+        else
+            hi = j - 1;
     }
-
-    heap_free(hp);
 }
 
-static void __choke_worst_downloader(choker_t * ch)
+void bt_leeching_choker_decide_best_npeers(void *ckr)
 {
-    heap_t *hp;
-
-    int ii;
-
-    hp = heap_new(__cmp_peer_priority_datarate_inverse, ch);
+    choker_t *ch = ckr;
+    int ii, n;
 
-    /*  poll downloading peers and offer to priority queue */
+    n = __rank_peers(ch, 0);
+    __select_best(ch->ranks, n, ch->max_unchoked_peers);
 
-    while (0 < llqueue_count(ch->peers_unchoked))
+    for (ii = 0; ii < n; ii++)
     {
-        heap_offer(hp, llqueue_poll(ch->peers_unchoked));
+        if (ii < ch->max_unchoked_peers)
+            bt_leeching_choker_unchoke_peer(ckr, ch->ranks[ii].peer);
+        else
+            __choke_peer(ch, ch->ranks[ii].peer);
     }
+}
 
-    /*  poll best four from priority queue */
-
-    for (ii = 0; ii < 1; ii++)
-    {
-        void *peer;
-
-        peer = heap_poll(hp);
-        __choke_peer(ch, peer);
-    }
+static void __choke_worst_downloader(choker_t * ch)
+{
+    int ii, n, worst = 0;
 
-    /*  empty residual peers into choked bucket */
+    n = __rank_peers(ch, 1);
+    if (0 == n)
+        return;
 
-    while (0 < heap_count(hp))
-    {
-        llqueue_offer(ch->peers_unchoked, heap_poll(hp));
-    }
+    for (ii = 1; ii < n; ii++)
+        if (ch->ranks[ii].urate < ch->ranks[worst].urate)
+            worst = ii;
 
-    heap_free(hp);
+    __choke_peer(ch, ch->ranks[worst].peer);
 }
 
 void bt_leeching_choker_optimistically_unchoke(void *ckr)
 {
     choker_t *ch = ckr;
-    int ii, end;
-    void *peer;
+    bt_list_t *q = &ch->peers_waiting_for_optimistic_unchoke,
+              *last = q->prev, *l;
 
     /* go through peers waiting to be optimistically unchoked... */
-    for (ii = 0, end = llqueue_count(ch->peers_waiting_for_optimistic_unchoke);
-         ii < end; ii++)
+    while ((l = bt_list_pop_head(q)))
     {
-        peer = llqueue_poll(ch->peers_waiting_for_optimistic_unchoke);
+        cpeer_t *cp = bt_list_item(l, cpeer_t, link);
 
         /* ...if the peer is interested... */
-        if (1 == ch->iface->get_is_interested(ch->udata, peer))
+        if (1 == ch->iface->get_is_interested(ch->udata, cp->peer))
         {
             __choke_worst_downloader(ch);
-            bt_leeching_choker_unchoke_peer(ch, peer);
+            bt_leeching_choker_unchoke_peer(ch, cp->peer);
             break;
         }
 
         /* ...otherwise, better luck next time */
-        llqueue_offer(ch->peers_waiting_for_optimistic_unchoke, peer);
+        bt_list_push_tail(q, l);
+        if (l == last)
+            break;
     }
 }
 
 void bt_leeching_choker_unchoke_peer(void *ckr, void *peer)
 {
     choker_t *ch = ckr;
+    cpeer_t *cp = bt_intmap_get(ch->peers, (uintptr_t)peer);
 
-    void *pr;
-
-    assert(hashmap_contains_key(ch->peers, peer));
+    assert(cp);
     
     ch->iface->unchoke_peer(ch->udata, peer);
-    pr = hashmap_get(ch->peers, peer);
-    /*  ensure that this peer is on the tail of the queue */
-    llqueue_remove_item(ch->peers_choked, peer);
-    llqueue_remove_item(ch->peers_unchoked, peer);
-    llqueue_remove_item(ch->peers_waiting_for_optimistic_unchoke, peer);
-    llqueue_offer(ch->peers_unchoked, peer);
+    cp->unchoked = 1;
+    bt_list_remove(&cp->link);
 }
 
 int bt_leeching_choker_get_npeers(void *ckr)
 {
     choker_t *ch = ckr;
 
-    return hashmap_count(ch->peers);
+    return bt_intmap_count(ch->peers);
 }
 
 void bt_leeching_choker_set_choker_peer_iface(void *ckr,
@@ -20,16 +20,27 @@
 #include "bt.h"
 #include "bt_choker_peer.h"
 #include "bt_choker.h"
+#include "bt_choker_seeder.h"
 
-#include "linked_list_queue.h"
-#include "linked_list_hashmap.h"
+#include "bt_hashmap.h"
+#include "bt_list.h"
 
+/* what the choker knows of a peer */
 typedef struct
 {
-    void *udata_peer;
-    /*  this is id of the unchoke operation */
-//    int unchoke_id;
-} peer_t;
+    void *peer;
+    int unchoked;
+
+    /* place in peers_choked, while choked */
+    bt_list_t link;
+} cpeer_t;
+
+/* a peer and the rate we're uploading to it, for ranking */
+typedef struct
+{
+    void *peer;
+    int urate;
+} rank_t;
 
 typedef struct
 {
@@ -37,26 +48,29 @@ typedef struct
     int max_unchoked_peers;
     /*  last time we checked who was choked */
     int time_last_choke_check;
-    hashmap_t *peers;
+
+    /* cpeer_t of each peer */
+    void *peers;
     bt_choker_peer_i *iface;
-    /*  the head node is the node that will be choked */
-    /*  nodes that are choked are removed from the queue */
-    linked_list_queue_t *peers_unchoked;
-    linked_list_queue_t *peers_choked;
-    /*  the current position we are at on the unchoke id - sequential */
-//    int unchoke_id_current;
-    void *udata;
-} choker_t;
 
-static unsigned long __peer_hash(const void *obj)
-{
-    return (unsigned long) obj;
-}
+    /*  choked peers, the one that has waited longest at the head */
+    bt_list_t peers_choked;
 
-static long __peer_compare(const void *obj, const void *other)
-{
-    return obj - other;
-}
+    /* upload slots opened by the last round */
+    int nslots;
+
+    /* each slot beyond the first needs this many more bytes per second */
+    int slot_step;
+
+    /* bytes per second we can upload; 0 if unknown */
+    int capacity;
+
+    /* scratch space for ranking peers, grown to the number of peers */
+    rank_t *ranks;
+    int ranks_size;
+
+    void *udata;
+} choker_t;
 
 void bt_seeding_choker_unchoke_peer(void *ckr, void *peer);
 
@@ -66,33 +80,48 @@ void *bt_seeding_choker_new(const int size)
 
     ch = calloc(1, sizeof(choker_t));
     ch->max_unchoked_peers = size;
-    ch->peers = hashmap_new(__peer_hash, __peer_compare, 11);
-    ch->peers_unchoked = llqueue_new();
-    ch->peers_choked = llqueue_new();
+    ch->slot_step = BT_SEEDING_CHOKER_SLOT_STEP;
+    ch->peers = bt_intmap_new(11);
+    bt_list_init(&ch->peers_choked);
     return ch;
 }
 
 void bt_seeding_choker_add_peer(void *ckr, void *peer)
 {
     choker_t *ch = ckr;
+    cpeer_t *cp;
+
+    /* Don't add the same peer again */
+    if (bt_intmap_get(ch->peers, (uintptr_t)peer))
+        return;
 
-    hashmap_put(ch->peers, peer, peer);
-    llqueue_offer(ch->peers_choked, peer);
+    cp = calloc(1, sizeof(cpeer_t));
+    cp->peer = peer;
+    bt_intmap_put(ch->peers, (uintptr_t)peer, cp);
+    bt_list_push_tail(&ch->peers_choked, &cp->link);
 }
 
 void bt_seeding_choker_remove_peer(void *ckr, void *peer)
 {
     choker_t *ch = ckr;
+    cpeer_t *cp;
 
-    hashmap_remove(ch->peers, peer);
-    /* FIXME: shouldn't this peer also be removed from the queues? */
+    if (!(cp = bt_intmap_remove(ch->peers, (uintptr_t)peer)))
+        return;
+    bt_list_remove(&cp->link);
+    free(cp);
 }
 
 static void __choke_peer(choker_t * ch, void *peer)
 {
-    llqueue_remove_item(ch->peers_unchoked, peer);
+    cpeer_t *cp = bt_intmap_get(ch->peers, (uintptr_t)peer);
+
     /*  we're back in the queue for being allowed back */
-    llqueue_offer(ch->peers_choked, peer);
+    if (cp->unchoked)
+    {
+        cp->unchoked = 0;
+        bt_list_push_tail(&ch->peers_choked, &cp->link);
+    }
     ch->iface->choke_peer(ch->udata, peer);
 }
 
@@ -100,63 +129,145 @@ int bt_seeding_choker_get_npeers(void *ckr)
 {
     choker_t *ch = ckr;
 
-    return hashmap_count(ch->peers);
+    return bt_intmap_count(ch->peers);
 }
 
-void bt_seeding_choker_decide_best_npeers(void *ckr)
+void bt_seeding_choker_set_upload_capacity(void *ckr, int bytes_per_sec)
 {
     choker_t *ch = ckr;
 
-    void *peer;
+    ch->capacity = bytes_per_sec;
+}
+
+void bt_seeding_choker_set_slot_step(void *ckr, int bytes_per_sec)
+{
+    choker_t *ch = ckr;
+
+    ch->slot_step = bytes_per_sec;
+}
+
+int bt_seeding_choker_get_nslots(void *ckr)
+{
+    choker_t *ch = ckr;
+
+    return ch->nslots;
+}
 
-    /*  if we've already unchoked the number of npeers, no more work to do */
-    if (ch->max_unchoked_peers == bt_seeding_choker_get_npeers(ch))
+/**
+ * Copy the unchoked peers and their upload rates into the scratch space
+ * @return number of peers copied */
+static int __rank_unchoked(choker_t * ch)
+{
+    bt_hashmap_iterator_t iter;
+    cpeer_t *cp;
+    int n = 0;
+
+    if (ch->ranks_size < bt_intmap_count(ch->peers))
     {
-//        return;
+        ch->ranks_size = bt_intmap_count(ch->peers) * 2;
+        ch->ranks = realloc(ch->ranks, ch->ranks_size * sizeof(rank_t));
     }
 
-    /*  only choke if we are maxed out on unchoked peers */
-    if (llqueue_count(ch->peers_unchoked) >= ch->max_unchoked_peers)
+    for (bt_intmap_iterator(ch->peers, &iter);
+         (cp = bt_intmap_iterator_next_value(ch->peers, &iter));)
     {
-        /*  choke most recent */
-        peer = llqueue_poll(ch->peers_unchoked);
-        __choke_peer(ch, peer);
+        if (!cp->unchoked)
+            continue;
+        ch->ranks[n].peer = cp->peer;
+        ch->ranks[n].urate = ch->iface->get_urate(ch->udata, cp->peer);
+        n++;
     }
 
-    /* unchoke peer who has been waiting the longest  */
-    peer = llqueue_poll(ch->peers_choked);
-    bt_seeding_choker_unchoke_peer(ch, peer);
+    return n;
 }
 
-#if 0
-void bt_seeding_choker_set_peer(void *cho)
+static int __cmp_rank_urate(const void *a, const void *b)
 {
-// Every 10 seconds...
-// It does reciprocation and number of uploads capping by unchoking the four peers which it has the best download rates from and are interested. Peers which have a better upload rate but aren't interested get unchoked and if they become interested the worst uploader gets choked. If a downloader has a complete file, it uses its upload rate rather than its download rate to decide who to unchoke.
-// Every 30 seconds...
-// optimistically unchoke
+    const rank_t *r1 = a, *r2 = b;
 
+    return r2->urate - r1->urate;
 }
-#endif
 
-void bt_seeding_choker_unchoke_peer(void *ckr, void *peer)
+/**
+ * The fastest unchoked peers keep their slots for as long as each one of
+ * them is worth a slot: the n-th fastest needs n slot steps of upload
+ * rate. If we stop there, adding slots was only splitting our upload
+ * between more peers. Slots also stop once we're close to our capacity.
+ * The fastest peer always keeps its slot, as peers choked now can't take
+ * the rotating slot until the next round
+ * @return number of unchoked peers that keep their slot */
+static int __keep_fastest(choker_t * ch, int n)
+{
+    long long total = 0;
+    int i;
+
+    qsort(ch->ranks, n, sizeof(rank_t), __cmp_rank_urate);
+
+    for (i = 0; i < n && i < ch->max_unchoked_peers - 1; i++)
+    {
+        if (0 < i &&
+            ch->ranks[i].urate < (long long)ch->slot_step * (i + 1))
+            break;
+
+        /* the uplink is saturated */
+        if (0 < ch->capacity && ch->capacity * 9LL / 10 <= total)
+            break;
+
+        total += ch->ranks[i].urate;
+    }
+
+    return i;
+}
+
+void bt_seeding_choker_decide_best_npeers(void *ckr)
 {
     choker_t *ch = ckr;
+    bt_list_t *last, *l;
+    int i, n, keep;
 
-    peer_t *pr;
+    assert(ch->iface);
+    assert(ch->iface->get_urate);
 
-    assert(hashmap_contains_key(ch->peers, peer));
-    ch->iface->unchoke_peer(ch->udata, peer);
+    n = __rank_unchoked(ch);
+    keep = __keep_fastest(ch, n);
+
+    /* peers choked now are queued after this one, and wait for a later
+     * round. Otherwise a slot we just closed would open again */
+    last = bt_list_empty(&ch->peers_choked) ? NULL : ch->peers_choked.prev;
+
+    for (i = keep; i < n; i++)
+        __choke_peer(ch, ch->ranks[i].peer);
+
+    ch->nslots = keep;
 
-    pr = hashmap_get(ch->peers, peer);
+    /* rotate: the interested peer that has waited longest gets a go */
+    while (last && (l = bt_list_pop_head(&ch->peers_choked)))
+    {
+        cpeer_t *cp = bt_list_item(l, cpeer_t, link);
+
+        if (1 == ch->iface->get_is_interested(ch->udata, cp->peer))
+        {
+            bt_seeding_choker_unchoke_peer(ch, cp->peer);
+            ch->nslots += 1;
+            break;
+        }
+
+        bt_list_push_tail(&ch->peers_choked, l);
+        if (l == last)
+            break;
+    }
+}
+
+void bt_seeding_choker_unchoke_peer(void *ckr, void *peer)
+{
+    choker_t *ch = ckr;
+    cpeer_t *cp = bt_intmap_get(ch->peers, (uintptr_t)peer);
 
-//    /*  find top N-1  */
+    assert(cp);
+    ch->iface->unchoke_peer(ch->udata, peer);
 
-    /*  ensure that this peer is on the tail of the queue */
-    llqueue_remove_item(ch->peers_choked, peer);
-    llqueue_remove_item(ch->peers_unchoked, peer);
-    llqueue_offer(ch->peers_unchoked, peer);
-//    pr->unchoke_id = pr
+    cp->unchoked = 1;
+    bt_list_remove(&cp->link);
 }
 
 void bt_seeding_choker_set_choker_peer_iface(void *ckr,
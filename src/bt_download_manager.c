@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 /* for uint32_t */
@@ -20,22 +21,35 @@
 
 /* for varags */
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "bitfield.h"
-#include "event_timer.h"
+#include "bipbuffer.h"
 #include "config.h"
-#include "linked_list_queue.h"
 #include "chunkybar.h"
 
 #include "pwp_connection.h"
 #include "pwp_msghandler.h"
+#include "pwp_handshaker.h"
 
 #include "bt.h"
 #include "bt_peermanager.h"
 #include "bt_string.h"
+#include "bt_util.h"
 #include "bt_piece_db.h"
 #include "bt_piece.h"
 #include "bt_blacklist.h"
+#include "bt_peerhistory.h"
+#include "bt_ring.h"
+#include "bt_hashmap.h"
+#include "bt_hashpool.h"
+#include "bt_histogram.h"
+#include "bt_resume.h"
+#include "bt_timerwheel.h"
+#include "bt_trace.h"
+#include "bt_session.h"
+#include "bt_shards.h"
+#include "bt_webseed.h"
 #include "bt_choker_peer.h"
 #include "bt_choker.h"
 #include "bt_choker_leecher.h"
@@ -46,24 +60,189 @@
 
 #include <time.h>
 
+/* number of slots in the lock free job ring */
+#define BT_JOB_RING_SIZE 1024
+
+/* number of jobs allocated at once when the job pool runs dry */
+#define BT_JOB_SLAB_SIZE 64
+
+/* most receive buffers kept in the pool while no peer is using them */
+#define BT_RECVBUF_SPARE 64
+
+/* timer periods in milliseconds */
+#define BT_RECIPROCATION_MS 10000
+#define BT_OPTIMISTIC_UNCHOKE_MS 30000
+#define BT_PEER_TICK_MS 1000
+#define BT_RATE_SAMPLE_MS 1000
+/* peers drop connections that are silent for two minutes. Connections
+ * are checked for keepalives and idleness every BT_IDLE_MS */
+#define BT_KEEPALIVE_MS 90000
+#define BT_IDLE_MS 5000
+/* failed peers are reaped, and the worst connected peer is swapped for a
+ * candidate */
+#define BT_REAP_MS 1000
+#define BT_REPLACE_MS 60000
+/* memory is counted, and held to max_memory */
+#define BT_MEMORY_MS 1000
+/* BEP 11 has peer exchange messages at most once a minute */
+#define BT_PEX_MS 60000
+
+typedef struct bt_job_s bt_job_t;
+typedef struct bt_job_slab_s bt_job_slab_t;
+
+typedef struct
+{
+    /* freelist of jobs */
+    void *free;
+
+    /* slabs that back the jobs */
+    bt_job_slab_t *slabs;
+
+    /* number of jobs currently taken from the pool */
+    int nused;
+
+    /* most jobs that have been outstanding at once */
+    int hwm;
+} bt_job_pool_t;
+
+/* typed copy of the configuration, for settings used on hot paths */
+typedef struct
+{
+    /* config version these settings were read from */
+    unsigned int version;
+
+    int npieces;
+    int piece_length;
+    int pwp_listen_port;
+    int min_pending_requests;
+    int max_pending_requests;
+    int validation_threads;
+    int peer_threads;
+    int shutdown_when_complete;
+    int resume_interval;
+    int stats_interval;
+    int max_upload_rate;
+    int max_peer_upload_rate;
+    int max_download_rate;
+    int max_peer_download_rate;
+    int max_local_upload_rate;
+    int max_local_download_rate;
+    unsigned int send_high_watermark;
+    unsigned int send_low_watermark;
+    int rate_window;
+    int slow_piece_secs;
+    int steal_ratio;
+    int max_peer_connections;
+    int super_seeding;
+    int webseed_pending_blocks;
+    int webseed_retry_ms;
+    int max_half_open;
+    int max_connects_per_sec;
+    int max_bad_pieces;
+    int peer_exchange;
+    int recv_buffer_bytes;
+    int peer_idle_timeout_ms;
+    unsigned long long max_memory;
+
+    /* my_ip and pwp_listen_port packed by bt_addr_pack, if my_ip is an
+     * address */
+    unsigned char my_addr[BT_PEER_ADDR_LEN];
+    int my_addr_ok;
+
+    /* owned by the config. NULL if not set */
+    char* my_ip;
+    char* my_peerid;
+    char* infohash;
+    char* resume_path;
+} bt_dm_settings_t;
+
+typedef struct
+{
+    bt_dm_stats_t stats;
+
+    /* threads reading stats */
+    int readers;
+} __snapshot_t;
+
+/**
+ * A web seed, and the pseudo peer the selector knows it as */
+typedef struct
+{
+    void* dm;
+    bt_peer_t* peer;
+    void* ws;
+    void* conn_ctx;
+    int connecting;
+    int connected;
+
+    /* blocks that arrived since the connection was made */
+    int nreceived;
+
+    /* ms before which we don't connect again */
+    unsigned long long retry_ms;
+} __webseed_t;
+
 typedef struct
 {
     /* database for writing pieces */
     bt_piecedb_i ipdb;
     bt_piecedb_t* pdb;
 
+    /* disk whose queued writes we submit, if it queues them */
+    bt_blockrw_i* disk;
+    void* disk_udata;
+
     /* callbacks */
     bt_dm_cbs_t cb;
 
     /* callback context */
     void *cb_ctx;
 
-    /* job management */
+    /* job management
+     * Jobs go onto the lock free ring. The locked queue takes the overflow
+     * when the ring is full; it's linked through the jobs themselves */
+    void *jobring;
     void *job_lock;
-    linked_list_queue_t *jobs;
+    bt_job_t *jobs, *jobs_tail;
+    int njobs;
+
+    /* pool of free jobs, so that job traffic doesn't hit the heap */
+    bt_job_pool_t job_pool;
+
+    /* background piece hashing. No submit when validating inline */
+    bt_hasher_i hasher;
+    void *hasher_udata;
+
+    /* the hasher made for validation_threads; NULL if there's none */
+    void *hashpool;
+
+    /* threads that service a share of the peers each; NULL if the peers
+     * are serviced within bt_dm_periodic's thread */
+    void *shards;
+
+    /* 1 while the shards are running. Peers can't be removed then */
+    int in_shards;
+
+    /* stands in for call_exclusively when it isn't set. Hashpool workers,
+     * shards and the disk's threads queue jobs when the ring is full */
+    pthread_mutex_t exclusive_lock;
+
+    /* receive buffers that aren't lent to a peer */
+    bipbuf_t** recvbufs;
+    int nrecvbufs;
+    pthread_mutex_t recvbuf_lock;
+
+    /* number of pieces being hashed in the background */
+    int nhashing;
+
+    /* startup check. Pieces [check_next, check_end) are yet to be read */
+    int check_next;
+    int check_end;
+    int check_done;
 
     /* configuration */
     void* cfg;
+    bt_dm_settings_t settings;
 
     /* peer manager */
     void* pm;
@@ -71,55 +250,291 @@ typedef struct
     /* peer and piece blacklisting */
     void* blacklist;
 
+    /* peers we've dealt with, for reconnect backoff and admission */
+    void* history;
+
     /*  leeching choker */
     void *lchoke;
 
-    /* timer */
-    void *ticker;
+    /*  seeding choker, used once we have every piece */
+    void *schoke;
+
+    /* timing wheel for choker rounds, request expiry, rate sampling and
+     * keepalives */
+    void *wheel;
 
     /* for selecting pieces */
     bt_pieceselector_i ips;
     void* pselector;
 
-    /* are we seeding? */
+    /* blocks requested from more than one peer, keyed by block */
+    void* endgame_blocks;
+
+    /* BT_PIECE_PRIORITY_* of each piece; NULL while all are NORMAL */
+    unsigned char* priorities;
+    int npriorities;
+
+    /* pieces slow peers are each sending us a few blocks of */
+    int* shared;
+    int nshared;
+    int shared_size;
+
+    /* peers waiting to be connected to, oldest first */
+    bt_peer_t** candidates;
+    int ncandidates;
+    int candidates_size;
+
+    /* peers that have work for the next bt_dm_periodic. A removed peer
+     * leaves a NULL behind */
+    bt_peer_t** ready;
+    int nready;
+    int ready_size;
+
+    /* connections of removed peers. A peer is often removed from within
+     * its connection's callbacks, so they're released by the next
+     * bt_dm_periodic */
+    void** released;
+    int nreleased;
+    int released_size;
+
+    /* the session's share of its max_memory; 0 for none */
+    unsigned long long memory_share;
+
+    /* what the last memory check counted */
+    bt_memory_stats_t memory;
+
+    /* most requests a peer may have pending while we're over the memory
+     * cap; 0 when we aren't */
+    int memory_max_pending;
+
+    /* 1 once pieces have gone back to the selector; any peer may want them */
+    int ready_all;
+
+    /* peers the last bt_dm_periodic serviced */
+    int nserviced;
+
+    /* what bt_dm_stats_t reports; see there */
+    bt_histogram_t job_depth;
+    bt_histogram_t validate_us;
+    bt_histogram_t block_ms;
+    unsigned long long duplicate_bytes;
+    unsigned long long hash_failure_bytes;
+    int hash_failures;
+    int stolen_blocks;
+
+    /* HTTP sources; they're fed by the selector like peers, but aren't in
+     * the peer manager */
+    __webseed_t** webseeds;
+    int nwebseeds;
+
+    /* peers with each piece, counted afresh for each super-seeding
+     * reveal. NULL until super-seeding starts */
+    int* super_avail;
+    int nsuper_avail;
+
+    /* stats published for other threads; see bt_dm_acquire_stats. The one
+     * that isn't published is refilled once its readers have gone */
+    __snapshot_t snapshots[2];
+    __snapshot_t* published;
+    unsigned long long snapshot_ms;
+
+    /* connects we haven't heard back about */
+    int nhalf_open;
+
+    /* session we share budgets with, and the connections we've told it
+     * we hold */
+    void* session;
+    int session_nconnections;
+
+    /* thousandths of a connect we may start, and when it was topped up */
+    long long connect_credit;
+    unsigned long long connect_ms;
+
+    /* are we seeding? Set once every piece is complete */
     int am_seeding;
 
+    /* choker rounds run, and the peers left unchoked by the last one */
+    int choke_rounds;
+    int nunchoked;
+
     chunkybar_t* pieces_completed;
 
+    /* pieces_completed as a BITFIELD message; see __have_msg */
+    pwp_bitfield_msg_t have_msg;
+
+    /* pieces completed this tick; peers are told in one go at its end */
+    int* haves;
+    int nhaves;
+    int haves_size;
+
+    /* peers we're uploading to this tick, served round robin */
+    bt_peer_t** uploaders;
+    int nuploaders;
+    int uploaders_size;
+    unsigned int upload_rr;
+
+    /* bytes we may upload to, and download from, all peers, and when
+     * they were last topped up */
+    int upload_tokens;
+    int download_tokens;
+    unsigned long long refill_ms;
+
+    /* the same for local peers, which the limits above don't cover */
+    int local_upload_tokens;
+    int local_download_tokens;
+
+    /* addresses of the connected peers as of the last peer exchange,
+     * sorted; see __peer_exchange */
+    unsigned char* pex;
+    int npex;
+
+    /* fast resume record */
+    void* resume;
+
+    /* ms when the resume record was last written */
+    unsigned long long resume_saved;
+
+    /* has the resume record been loaded? */
+    int resume_loaded;
+
 } bt_dm_private_t;
 
 typedef struct
 {
     bt_peer_t* peer;
-    bt_block_t blk;
+    /* blocks the connection has room for */
+    int max;
 } bt_job_pollblock_t;
 
 typedef struct
 {
     bt_peer_t* peer;
     int piece_idx;
+    /* when validation was asked for; see __now_us */
+    unsigned long long queued_us;
 } bt_job_validate_piece_t;
 
+typedef struct
+{
+    /* pieces from first up to end, that the startup check left to be
+     * validated */
+    int first;
+    int end;
+} bt_job_check_range_t;
+
+typedef struct
+{
+    bt_peer_t* peer;
+    int piece_idx;
+    unsigned long long queued_us;
+    char hash[20];
+
+    /* 0 if the hasher couldn't hash the piece */
+    int hashed;
+} bt_job_piece_hashed_t;
+
+typedef struct
+{
+    bt_block_t blk;
+    int ok;
+} bt_job_block_written_t;
+
 enum
 {
     BT_JOB_NONE,
     BT_JOB_POLLBLOCK,
-    BT_JOB_VALIDATE_PIECE
+    BT_JOB_VALIDATE_PIECE,
+    /* validate the pieces bt_dm_check_pieces couldn't settle */
+    BT_JOB_CHECK_RANGE,
+    /* the hasher has finished hashing a piece */
+    BT_JOB_PIECE_HASHED,
+    /* the disk has finished a queued write */
+    BT_JOB_BLOCK_WRITTEN
 };
 
-typedef struct
+struct bt_job_s
 {
     int type;
     union
     {
         bt_job_pollblock_t pollblock;
         bt_job_validate_piece_t validate_piece;
+        bt_job_check_range_t check_range;
+        bt_job_piece_hashed_t piece_hashed;
+        bt_job_block_written_t block_written;
     };
-} bt_job_t;
+
+    /* next free job while within the pool, and next queued job while in
+     * the overflow queue */
+    bt_job_t *next;
+};
+
+struct bt_job_slab_s
+{
+    bt_job_slab_t *next;
+    bt_job_t jobs[BT_JOB_SLAB_SIZE];
+};
 
 
 void *bt_dm_get_piecedb(bt_dm_t* me_);
 
+/**
+ * @return settings, re-read from the config only if it has changed */
+static bt_dm_settings_t* __cfg(bt_dm_private_t* me)
+{
+    config_t* cfg = me->cfg;
+    bt_dm_settings_t* s = &me->settings;
+    char* path, *val;
+
+    if (s->version == cfg->version)
+        return s;
+
+    s->version = cfg->version;
+    s->npieces = config_get_int(cfg, "npieces");
+    s->piece_length = config_get_int(cfg, "piece_length");
+    s->pwp_listen_port = config_get_int(cfg, "pwp_listen_port");
+    s->min_pending_requests = config_get_int(cfg, "min_pending_requests");
+    s->max_pending_requests = config_get_int(cfg, "max_pending_requests");
+    s->validation_threads = config_get_int(cfg, "validation_threads");
+    s->peer_threads = config_get_int(cfg, "peer_threads");
+    s->shutdown_when_complete = config_get_int(cfg, "shutdown_when_complete");
+    s->resume_interval = config_get_int(cfg, "resume_interval");
+    s->stats_interval = config_get_int(cfg, "stats_interval");
+    s->max_upload_rate = config_get_int(cfg, "max_upload_rate");
+    s->max_peer_upload_rate = config_get_int(cfg, "max_peer_upload_rate");
+    s->max_download_rate = config_get_int(cfg, "max_download_rate");
+    s->max_peer_download_rate = config_get_int(cfg, "max_peer_download_rate");
+    s->max_local_upload_rate = config_get_int(cfg, "max_local_upload_rate");
+    s->max_local_download_rate =
+        config_get_int(cfg, "max_local_download_rate");
+    s->send_high_watermark = config_get_int(cfg, "send_high_watermark");
+    s->send_low_watermark = config_get_int(cfg, "send_low_watermark");
+    s->rate_window = config_get_int(cfg, "rate_window");
+    s->slow_piece_secs = config_get_int(cfg, "slow_piece_secs");
+    s->steal_ratio = config_get_int(cfg, "steal_ratio");
+    s->max_peer_connections = config_get_int(cfg, "max_peer_connections");
+    s->super_seeding = config_get_int(cfg, "super_seeding");
+    s->webseed_pending_blocks = config_get_int(cfg, "webseed_pending_blocks");
+    s->webseed_retry_ms = config_get_int(cfg, "webseed_retry_ms");
+    s->max_half_open = config_get_int(cfg, "max_half_open");
+    s->max_connects_per_sec = config_get_int(cfg, "max_connects_per_sec");
+    s->max_bad_pieces = config_get_int(cfg, "max_bad_pieces");
+    s->peer_exchange = config_get_int(cfg, "peer_exchange");
+    s->recv_buffer_bytes = config_get_int(cfg, "recv_buffer_bytes");
+    s->peer_idle_timeout_ms = config_get_int(cfg, "peer_idle_timeout_ms");
+    val = config_get(cfg, "max_memory");
+    s->max_memory = val ? strtoull(val, NULL, 10) : 0;
+    s->my_ip = config_get(cfg, "my_ip");
+    s->my_addr_ok = s->my_ip &&
+        bt_addr_pack(s->my_addr, s->my_ip, strlen(s->my_ip),
+                     s->pwp_listen_port);
+    s->my_peerid = config_get(cfg, "my_peerid");
+    s->infohash = config_get(cfg, "infohash");
+    path = config_get(cfg, "resume_path");
+    s->resume_path = path && *path ? path : NULL;
+    return s;
+}
+
 static void __log(void *me_, void *src, const char *fmt, ...)
 {
     bt_dm_private_t *me = me_;
@@ -130,9 +545,9 @@ static void __log(void *me_, void *src, const char *fmt, ...)
         return;
 
     p = buf;
-    if (config_get(me->cfg, "my_peerid"))
+    if (__cfg(me)->my_peerid)
     {
-        sprintf(p, "%s,", config_get(me->cfg, "my_peerid"));
+        sprintf(p, "%s,", __cfg(me)->my_peerid);
         p += strlen(buf);
     }
 
@@ -146,17 +561,306 @@ static int __FUNC_peerconn_send_to_peer(void *me_,
                                         const void *data,
                                         const int len);
 
+/**
+ * Wire messages are traced instead of logged; they're too frequent to be
+ * formatted as they happen */
+static void __FUNC_peerconn_trace(void *me_, void *peer, int sent,
+                                  int msg_type, unsigned int piece_idx,
+                                  unsigned int offset, unsigned int len)
+{
+    BT_TRACE(BT_TRACE_WIRE, (sent ? BT_TRACE_SEND : BT_TRACE_READ) + msg_type,
+             peer, piece_idx, offset, len);
+}
+
 int __FUNC_peerconn_disconnect(void *me_, void* pr, char *reason);
+static unsigned long long __now_ms(bt_dm_private_t* me);
+
+static int __peer_is_active(bt_peer_t* p)
+{
+    if (pwp_conn_flag_is_set(p->pc, PC_FAILED_CONNECTION))
+        return 0;
+    if (!pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED))
+        return 0;
+    return 1;
+}
+
+/**
+ * Tell the peer about pieces we've completed, unless it has them already */
+static void __FUNC_peer_send_haves(void* cb_ctx, void* peer, void* udata)
+{
+    bt_dm_private_t* me = cb_ctx;
+    bt_peer_t* p = peer;
+    int i;
+
+    /* interest is kept current even before the handshake */
+    for (i = 0; i < me->nhaves; i++)
+        pwp_conn_we_have_piece(p->pc, me->haves[i]);
+
+    if (!pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED))
+        return;
+
+    pwp_conn_cork(p->pc);
+    for (i = 0; i < me->nhaves; i++)
+        if (!pwp_conn_peer_has_piece(p->pc, me->haves[i]))
+            pwp_conn_send_have(p->pc, me->haves[i]);
+    pwp_conn_uncork(p->pc);
+}
+
+/**
+ * The session's, the torrent's and the peer's download limits; or for a
+ * local peer, the local limit only
+ * @return 1 if more may be requested from the peer this tick */
+static int __may_download(bt_dm_private_t* me, bt_peer_t* p)
+{
+    if (p->local)
+        return 0 == __cfg(me)->max_local_download_rate ||
+            0 < __atomic_load_n(&me->local_download_tokens, __ATOMIC_SEQ_CST);
+    if (me->session && !bt_session_may_download(me->session))
+        return 0;
+    if (__cfg(me)->max_download_rate &&
+        __atomic_load_n(&me->download_tokens, __ATOMIC_SEQ_CST) <= 0)
+        return 0;
+    return 0 == __cfg(me)->max_peer_download_rate || 0 < p->download_tokens;
+}
+
+/**
+ * @return how many more blocks the limits let us request from the peer
+ * this tick; INT_MAX if there are no limits */
+static int __download_room(bt_dm_private_t* me, bt_peer_t* p)
+{
+    long long tokens = LLONG_MAX, t;
+
+    if (!__may_download(me, p))
+        return 0;
+
+    if (p->local)
+    {
+        if (__cfg(me)->max_local_download_rate)
+            tokens = __atomic_load_n(&me->local_download_tokens,
+                                     __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        if (__cfg(me)->max_download_rate)
+            tokens = __atomic_load_n(&me->download_tokens, __ATOMIC_SEQ_CST);
+        if (__cfg(me)->max_peer_download_rate &&
+            (t = p->download_tokens) < tokens)
+            tokens = t;
+    }
+
+    if (LLONG_MAX == tokens)
+        return INT_MAX;
+    return (tokens + (BT_BLOCK_SIZE) - 1) / (BT_BLOCK_SIZE);
+}
+
+/**
+ * Pay for requests as they go out; waiting for the blocks would let a
+ * whole pipeline through before the buckets noticed. The torrent's bucket
+ * is shared between the shards */
+static void __spend_download(bt_dm_private_t* me, bt_peer_t* p, int bytes)
+{
+    if (bytes <= 0)
+        return;
+    if (p->local)
+    {
+        if (__cfg(me)->max_local_download_rate)
+            __atomic_sub_fetch(&me->local_download_tokens, bytes,
+                               __ATOMIC_SEQ_CST);
+        return;
+    }
+    if (__cfg(me)->max_peer_download_rate)
+        p->download_tokens -= bytes;
+    if (__cfg(me)->max_download_rate)
+        __atomic_sub_fetch(&me->download_tokens, bytes, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Keep two round trips' worth of blocks requested, so that the download
+ * rate has room to grow past what the pipeline delivers now */
+static int __pipeline_depth(bt_dm_private_t* me, bt_peer_t* p)
+{
+    long long n;
+
+    /* a peer that's sitting on our requests gets one at a time until it
+     * delivers again */
+    if (pwp_conn_is_snubbed(p->pc))
+        return 1;
+
+    n = 2LL * pwp_conn_get_download_rate(p->pc) *
+        pwp_conn_get_rtt(p->pc) / 1000 / (BT_BLOCK_SIZE);
+
+    if (n < __cfg(me)->min_pending_requests)
+        n = __cfg(me)->min_pending_requests;
+    if (__cfg(me)->max_pending_requests < n)
+        n = __cfg(me)->max_pending_requests;
+
+    /* requests pending are memory held on both ends */
+    if (me->memory_max_pending && me->memory_max_pending < n)
+        n = me->memory_max_pending;
+    return n;
+}
+
+/**
+ * @return the BITFIELD message of our completed pieces. It's only made
+ *  afresh from pieces_completed when the number of pieces changes */
+static pwp_bitfield_msg_t* __have_msg(bt_dm_private_t* me)
+{
+    int i, npieces = __cfg(me)->npieces;
+
+    if (me->have_msg.msg && me->have_msg.npieces == npieces)
+        return &me->have_msg;
+
+    pwp_bitfield_msg_release(&me->have_msg);
+    pwp_bitfield_msg_init(&me->have_msg, npieces);
+    for (i = 0; i < npieces; i++)
+        if (chunky_have(me->pieces_completed, i, 1))
+            pwp_bitfield_msg_mark(&me->have_msg, i);
+    return &me->have_msg;
+}
+
+static void __mark_completed(bt_dm_private_t* me, int piece_idx)
+{
+    chunky_mark_complete(me->pieces_completed, piece_idx, 1);
+    if (me->have_msg.msg && piece_idx < me->have_msg.npieces)
+        pwp_bitfield_msg_mark(&me->have_msg, piece_idx);
+}
+
+/**
+ * Have bt_dm_periodic service the peer. Only called from bt_dm_periodic's
+ * thread */
+static void __mark_ready(bt_dm_private_t* me, bt_peer_t* p)
+{
+    if (p->ready)
+        return;
+
+    if (me->ready_size <= me->nready)
+    {
+        me->ready_size = me->ready_size * 2 + 8;
+        me->ready = realloc(me->ready, me->ready_size * sizeof(bt_peer_t*));
+    }
+    me->ready[me->nready++] = p;
+    p->ready = 1;
+}
+
+static void __unmark_ready(bt_dm_private_t* me, bt_peer_t* p)
+{
+    int i;
+
+    if (!p->ready)
+        return;
+
+    for (i = 0; i < me->nready; i++)
+        if (me->ready[i] == p)
+            me->ready[i] = NULL;
+    p->ready = 0;
+}
+
+static void __FUNC_peer_mark_ready(void* cb_ctx, void* peer, void* udata)
+{
+    __mark_ready(cb_ctx, peer);
+}
+
+/**
+ * Pieces have gone back to the selector. Every peer gets a chance to ask
+ * for them on the next bt_dm_periodic */
+static void __giveback_piece(bt_dm_private_t* me, void* peer, int idx)
+{
+    me->ips.peer_giveback_piece(me->pselector, peer, idx);
+    me->ready_all = 1;
+}
 
 void __FUNC_peer_periodic(void* cb_ctx, void* peer, void* udata)
 {
+    bt_dm_private_t* me = cb_ctx;
     bt_peer_t* p = peer;
+    int depth, npending, room;
 
-    if (pwp_conn_flag_is_set(p->pc, PC_FAILED_CONNECTION))
+    if (!__peer_is_active(p))
+    {
+        p->ready = 0;
         return;
-    if (!pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED))
+    }
+
+    depth = __pipeline_depth(me, p);
+    npending = pwp_conn_get_npending_requests(p->pc);
+
+    /* the pipeline only grows as far as the buckets allow; the rest waits
+     * for them to refill */
+    p->download_deferred = 0;
+    room = __download_room(me, p);
+    if (npending < depth && pwp_conn_im_interested(p->pc) &&
+        room < depth - npending)
+    {
+        p->download_deferred = (depth - npending - room) * (BT_BLOCK_SIZE);
+        depth = npending + room;
+    }
+
+    pwp_conn_set_max_pending_requests(p->pc, depth);
+
+    /* the tick's messages go out in one send */
+    pwp_conn_cork(p->pc);
+    pwp_conn_service(p->pc);
+    pwp_conn_uncork(p->pc);
+    __spend_download(me, p, (pwp_conn_get_npending_requests(p->pc) -
+                             npending) * (BT_BLOCK_SIZE));
+
+    /* a service fills the pipeline, so requests are left queued only if
+     * it's full. A full pipeline waits for a PIECE, or for the tick to
+     * expire requests */
+    p->ready = pwp_conn_im_interested(p->pc) && !pwp_conn_im_choked(p->pc) &&
+        (0 < p->download_deferred ||
+         (0 < pwp_conn_get_nqueued_requests(p->pc) &&
+          pwp_conn_get_npending_requests(p->pc) < depth));
+}
+
+static void __FUNC_peer_tick(void* cb_ctx, void* peer, void* udata)
+{
+    bt_peer_t* p = peer;
+
+    if (!__peer_is_active(p))
+        return;
+
+    /* expired requests free up pipeline slots */
+    pwp_conn_tick(p->pc);
+    __mark_ready(cb_ctx, p);
+}
+
+static void __FUNC_peer_sample_rates(void* cb_ctx, void* peer, void* udata)
+{
+    bt_dm_private_t* me = cb_ctx;
+    bt_peer_t* p = peer;
+
+    if (!__peer_is_active(p))
         return;
-    pwp_conn_periodic(p->pc);
+
+    pwp_conn_set_rate_window(p->pc, __cfg(me)->rate_window);
+    pwp_conn_sample_rates(p->pc);
+}
+
+/**
+ * Drop a connection the peer has gone quiet on, and keep ours open if
+ * we've had nothing else to say */
+static void __FUNC_peer_keepalive(void* cb_ctx, void* peer, void* udata)
+{
+    bt_dm_private_t* me = cb_ctx;
+    bt_peer_t* p = peer;
+    unsigned long long now = __now_ms(me);
+    int timeout = __cfg(me)->peer_idle_timeout_ms;
+
+    if (!p->connected_ms ||
+        pwp_conn_flag_is_set(p->pc, PC_FAILED_CONNECTION))
+        return;
+
+    if (0 < timeout && p->heard_ms + timeout <= now)
+    {
+        __FUNC_peerconn_disconnect(me, p, "idle");
+        return;
+    }
+
+    if (__peer_is_active(p) &&
+        BT_KEEPALIVE_MS <= pwp_conn_get_send_idle_ms(p->pc) &&
+        p->connected_ms + BT_KEEPALIVE_MS <= now)
+        pwp_conn_send_keepalive(p->pc);
 }
 
 void __FUNC_peer_stats_visitor(void* cb_ctx, void* peer, void* udata)
@@ -172,16 +876,143 @@ void __FUNC_peer_stats_visitor(void* cb_ctx, void* peer, void* udata)
     ps->failed_connection = pwp_conn_flag_is_set(p->pc, PC_FAILED_CONNECTION);
     ps->drate = pwp_conn_get_download_rate(p->pc);
     ps->urate = pwp_conn_get_upload_rate(p->pc);
+    ps->srtt = pwp_conn_get_srtt(p->pc);
+    ps->rttvar = pwp_conn_get_rttvar(p->pc);
+    ps->request_timeout = pwp_conn_get_request_timeout(p->pc);
+    ps->snubbed = pwp_conn_is_snubbed(p->pc);
+    ps->npending_requests = pwp_conn_get_npending_requests(p->pc);
+    ps->npending_peer_requests = pwp_conn_get_npending_peer_requests(p->pc);
+    ps->upload_deferred = p->upload_deferred;
+    ps->download_deferred = p->download_deferred;
+    ps->downloaded = p->downloaded;
+    ps->uploaded = p->uploaded;
+    s->upload_deferred_bytes += p->upload_deferred;
+    s->download_deferred_bytes += p->download_deferred;
+}
+
+/**
+ * Every timer, rate and timeout reads the time from here
+ * @return microseconds from the get_time_us callback, or CLOCK_MONOTONIC */
+static unsigned long long __now_us(bt_dm_private_t* me)
+{
+    struct timespec ts;
+
+    if (me->cb.get_time_us)
+        return me->cb.get_time_us(me->cb_ctx);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long __now_ms(bt_dm_private_t* me)
+{
+    return __now_us(me) / 1000;
+}
+
+/**
+ * @return number of peers that hold, or are opening, a connection */
+static int __nconnections(bt_dm_private_t* me)
+{
+    return bt_peermanager_count(me->pm) - me->ncandidates;
+}
+
+/**
+ * Tell the session about connections we've opened or closed */
+static void __session_sync(bt_dm_private_t* me)
+{
+    int n = __nconnections(me);
+
+    if (me->session && n != me->session_nconnections)
+        bt_session_add_connections(me->session, n - me->session_nconnections);
+    me->session_nconnections = n;
+}
+
+/**
+ * @return 1 if another connection fits under our cap and the session's */
+static int __may_open_connection(bt_dm_private_t* me)
+{
+    return __nconnections(me) < __cfg(me)->max_peer_connections &&
+        (!me->session || bt_session_may_open_connection(me->session));
+}
+
+static void __clear_half_open(bt_dm_private_t* me, bt_peer_t* p)
+{
+    if (!p->half_open)
+        return;
+    p->half_open = 0;
+    me->nhalf_open--;
+}
+
+/**
+ * Blocks we asked for are received straight into the storage's memory
+ * where it can lend it out */
+static void* __FUNC_msghandler_get_frame(void* me_, void* pc,
+                                         const bt_block_t* blk)
+{
+    bt_dm_private_t *me = me_;
+    bt_block_t b = *blk;
+    void* p;
+
+    if (!pwp_conn_block_request_is_pending(pc, &b))
+        return NULL;
+
+    if (!(p = me->ipdb.get_piece(me->pdb, b.piece_idx)))
+        return NULL;
+
+    return bt_piece_get_write_frame(p, &b);
+}
+
+static void __FUNC_msghandler_drop_frame(void* me_, void* pc,
+                                         const bt_block_t* blk, void* frame)
+{
+    bt_dm_private_t *me = me_;
+    void* p;
+
+    if ((p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+        bt_piece_drop_write_frame(p, blk, frame);
 }
 
-static int __handle_handshake_success(bt_dm_private_t *me, bt_peer_t* p)
+static const pwp_msghandler_frame_i __msghandler_frame_i = {
+    .get_frame = __FUNC_msghandler_get_frame,
+    .drop_frame = __FUNC_msghandler_drop_frame
+};
+
+static void* __default_msghandler_new(void* callee, void* pc);
+
+/**
+ * @return 1 if the peer's message handler is one of ours */
+static int __peer_has_pwp_msghandler(bt_dm_private_t *me, bt_peer_t* p)
+{
+    return p->mh && me->cb.msghandler_new == __default_msghandler_new &&
+        pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED);
+}
+
+/**
+ * @param reserved The handshake's reserved bytes; NULL if unknown */
+static int __handle_handshake_success(bt_dm_private_t *me, bt_peer_t* p,
+                                      const char* reserved)
 {
     __log(me, NULL, "handshake,successful, 0x%lx", (unsigned long)p->pc);
-    me->cb.handshaker_release(p->mh);
-    p->mh = me->cb.msghandler_new(me->cb_ctx, p->pc);
     pwp_conn_set_state(p->pc, PC_HANDSHAKE_RECEIVED);
+    if (reserved && (reserved[PWP_HANDSHAKE_RESERVED_FAST_BYTE] &
+                     PWP_HANDSHAKE_RESERVED_FAST))
+        pwp_conn_enable_fast_extension(p->pc);
+    if (reserved && __cfg(me)->peer_exchange &&
+        (reserved[PWP_HANDSHAKE_RESERVED_EXTENDED_BYTE] &
+         PWP_HANDSHAKE_RESERVED_EXTENDED))
+        pwp_conn_enable_extension_protocol(p->pc);
+    if (p->mh && me->cb.handshaker_release)
+        me->cb.handshaker_release(p->mh);
+    p->mh = me->cb.msghandler_new(me->cb_ctx, p->pc);
+    if (me->cb.msghandler_new == __default_msghandler_new)
+        pwp_msghandler_set_frame_provider(p->mh, &__msghandler_frame_i, me);
     if (me->cb.handshake_success)
         me->cb.handshake_success((void*)me, me->cb_ctx, p->pc, p->conn_ctx);
+
+    /* after the bitfield, which has to be the first message */
+    if (pwp_conn_flag_is_set(p->pc, PC_EXTENDED))
+        pwp_conn_send_extended_handshake(p->pc, __cfg(me)->pwp_listen_port);
+    __mark_ready(me, p);
     return 1;
 }
 
@@ -206,15 +1037,23 @@ static int __handle_handshake(
     switch (me->cb.handshaker_dispatch_from_buffer(p->mh, buf, len))
     {
     case BT_HANDSHAKER_DISPATCH_SUCCESS:
-        return __handle_handshake_success(me, p);
+        return __handle_handshake_success(me, p,
+                                          me->cb.handshaker_get_reserved ?
+                                          me->cb.handshaker_get_reserved(p->mh)
+                                          : NULL);
     default:
     case BT_HANDSHAKER_DISPATCH_REMAINING:
         return 0;
     case BT_HANDSHAKER_DISPATCH_ERROR:
-        assert(0);
-        __log(me, NULL, "handshake,failed");
+    {
+        const char* reason = me->cb.handshaker_get_error ?
+            me->cb.handshaker_get_error(p->mh) : NULL;
+
+        __FUNC_peerconn_disconnect(me, p,
+                                   (char*)(reason ? reason : "bad handshake"));
         return 0;
     }
+    }
 }
 
 /* TODO: needs test cases */
@@ -230,6 +1069,8 @@ int bt_dm_dispatch_from_buffer(
     if (!(p = bt_peermanager_conn_ctx_to_peer(me->pm, peer_conn_ctx)))
         return 0;
 
+    p->heard_ms = __now_ms(me);
+
     if (!pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED))
     {
         switch (__handle_handshake(me, p, &buf, &len))
@@ -242,6 +1083,8 @@ int bt_dm_dispatch_from_buffer(
     switch (pwp_msghandler_dispatch_from_buffer(p->mh, buf, len))
     {
     case 1: /* successful */
+        /* unchokes, requests, pieces and haves all give the peer work */
+        __mark_ready(me, p);
         break;
     case 0: /* error, we need to disconnect */
         __FUNC_peerconn_disconnect(me_, p, "bad msg detected by PWP handler");
@@ -251,15 +1094,128 @@ int bt_dm_dispatch_from_buffer(
     return 1;
 }
 
-void bt_dm_peer_connect_fail(void *me_, void* conn_ctx)
+static bipbuf_t* __recvbuf_lend(bt_dm_private_t* me)
 {
-    bt_dm_private_t *me = me_;
-    bt_peer_t *peer;
+    bipbuf_t* b = NULL;
 
-    if (!(peer = bt_peermanager_conn_ctx_to_peer(me->pm, conn_ctx)))
-        return;
+    pthread_mutex_lock(&me->recvbuf_lock);
+    if (0 < me->nrecvbufs)
+        b = me->recvbufs[--me->nrecvbufs];
+    pthread_mutex_unlock(&me->recvbuf_lock);
 
-    pwp_conn_set_state(peer->pc, PC_FAILED_CONNECTION);
+    /* buffers of an older size are let go */
+    if (b && bipbuf_get_size(b) != __cfg(me)->recv_buffer_bytes)
+    {
+        bipbuf_free(b);
+        b = NULL;
+    }
+
+    return b ? b : bipbuf_new(__cfg(me)->recv_buffer_bytes);
+}
+
+static void __recvbuf_return(bt_dm_private_t* me, bt_peer_t* p)
+{
+    bipbuf_t* b = p->recvbuf;
+
+    if (!b)
+        return;
+    p->recvbuf = NULL;
+    bipbuf_poll(b, bipbuf_get_spaceused(b));
+
+    pthread_mutex_lock(&me->recvbuf_lock);
+    if (me->nrecvbufs < BT_RECVBUF_SPARE)
+    {
+        if (!me->recvbufs)
+            me->recvbufs = malloc(sizeof(bipbuf_t*) * BT_RECVBUF_SPARE);
+        me->recvbufs[me->nrecvbufs++] = b;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&me->recvbuf_lock);
+
+    if (b)
+        bipbuf_free(b);
+}
+
+char* bt_dm_get_recv_buffer(bt_dm_t* me_, void* peer_conn_ctx,
+                            unsigned int* len)
+{
+    bt_dm_private_t *me = (void*)me_;
+    bt_peer_t* p;
+
+    if (!(p = bt_peermanager_conn_ctx_to_peer(me->pm, peer_conn_ctx)))
+        return NULL;
+
+    if (!p->recvbuf)
+        p->recvbuf = __recvbuf_lend(me);
+
+    /* the space follows what's held, so that a message stays in one run */
+    bipbuf_compact(p->recvbuf);
+    return (char*)bipbuf_reserve(p->recvbuf, len);
+}
+
+int bt_dm_recv_buffer_filled(bt_dm_t* me_, void* peer_conn_ctx,
+                             unsigned int len)
+{
+    bt_dm_private_t *me = (void*)me_;
+    bt_peer_t* p;
+    bipbuf_t* b;
+    unsigned int used, held = 0;
+    const char* data;
+
+    if (!(p = bt_peermanager_conn_ctx_to_peer(me->pm, peer_conn_ctx)) ||
+        !(b = p->recvbuf))
+        return 0;
+
+    bipbuf_commit(b, len);
+    p->heard_ms = __now_ms(me);
+    used = bipbuf_get_spaceused(b);
+    data = (const char*)bipbuf_peek(b, used);
+
+    /* the handshake, and message handlers of the caller's, read the data
+     * as it comes */
+    if (!__peer_has_pwp_msghandler(me, p))
+    {
+        bt_dm_dispatch_from_buffer(me_, peer_conn_ctx, data, used);
+    }
+    else
+    {
+        switch (pwp_msghandler_dispatch_whole_msgs(p->mh, data, used,
+                                                   bipbuf_get_size(b),
+                                                   &held))
+        {
+        case 1:
+            __mark_ready(me, p);
+            break;
+        case 0:
+            __FUNC_peerconn_disconnect(me_, p,
+                                       "bad msg detected by PWP handler");
+            break;
+        }
+    }
+
+    /* the peer was removed, and its buffer with it */
+    if (!(p = bt_peermanager_conn_ctx_to_peer(me->pm, peer_conn_ctx)))
+        return 1;
+
+    bipbuf_poll(b, used - held);
+    if (bipbuf_is_empty(b))
+        __recvbuf_return(me, p);
+    return 1;
+}
+
+void bt_dm_peer_connect_fail(void *me_, void* conn_ctx)
+{
+    bt_dm_private_t *me = me_;
+    bt_peer_t *peer;
+
+    if (!(peer = bt_peermanager_conn_ctx_to_peer(me->pm, conn_ctx)))
+        return;
+
+    /* reaped on the next BT_REAP_MS */
+    __clear_half_open(me, peer);
+    pwp_conn_set_state(peer->pc, PC_FAILED_CONNECTION);
+    bt_peerhistory_connect_failed(me->history, peer->ip, strlen(peer->ip),
+                                  peer->port, __now_ms(me));
 }
 
 int bt_dm_peer_connect(void *me_, void* conn_ctx, char *ip, const int port)
@@ -271,14 +1227,32 @@ int bt_dm_peer_connect(void *me_, void* conn_ctx, char *ip, const int port)
     if (!(peer = bt_peermanager_conn_ctx_to_peer(me->pm, conn_ctx)))
         return 0;
 
+    __clear_half_open(me, peer);
+    peer->connected_ms = peer->heard_ms = __now_ms(me);
+    bt_peerhistory_connected(me->history, peer->ip, strlen(peer->ip),
+                             peer->port, peer->connected_ms);
+
     if (me->cb.send_handshake)
         me->cb.send_handshake(me_, peer,
                               __FUNC_peerconn_send_to_peer,
-                              config_get(me->cfg, "infohash"),
-                              config_get(me->cfg, "my_peerid"));
+                              __cfg(me)->infohash,
+                              __cfg(me)->my_peerid);
     return 1;
 }
 
+int bt_dm_peer_handshaked(bt_dm_t* me_, void* conn_ctx,
+                          const char* reserved)
+{
+    bt_dm_private_t *me = (void*)me_;
+    bt_peer_t *peer;
+
+    if (!(peer = bt_peermanager_conn_ctx_to_peer(me->pm, conn_ctx)) ||
+        pwp_conn_flag_is_set(peer->pc, PC_HANDSHAKE_RECEIVED))
+        return 0;
+
+    return __handle_handshake_success(me, peer, reserved);
+}
+
 static int __get_drate(const void *me_, const void *pc)
 {
     return pwp_conn_get_download_rate(pc);
@@ -312,416 +1286,3057 @@ static bt_choker_peer_i iface_choker_peer = {
     .unchoke_peer      = __unchoke_peer
 };
 
-static void __leecher_peer_reciprocation(void *me_)
+/**
+ * @return 1 if we have every piece */
+static int __have_all_pieces(bt_dm_private_t* me)
 {
-    bt_dm_private_t *me = me_;
+    return 0 < __cfg(me)->npieces &&
+        chunky_have(me->pieces_completed, 0, __cfg(me)->npieces);
+}
 
-    bt_leeching_choker_decide_best_npeers(me->lchoke);
-    eventtimer_push_event(me->ticker, 10, me, __leecher_peer_reciprocation);
+/**
+ * @return 1 if new peers are to be super-seeded */
+static int __super_seeding(bt_dm_private_t* me)
+{
+    return __cfg(me)->super_seeding && __have_all_pieces(me);
 }
 
-static void __leecher_peer_optimistic_unchoke(void *me_)
+static void __FUNC_peer_count_super(void* cb_ctx, void* peer, void* udata)
 {
-    bt_dm_private_t *me = me_;
+    bt_dm_private_t* me = cb_ctx;
+    bt_peer_t* p = peer;
+    int i;
+
+    if (!p->pc || !__peer_is_active(p))
+        return;
+
+    for (i = 0; i < __cfg(me)->npieces; i++)
+        if (pwp_conn_peer_has_piece(p->pc, i))
+            me->super_avail[i]++;
 
-    bt_leeching_choker_optimistically_unchoke(me->lchoke);
-    eventtimer_push_event(me->ticker, 30, me,
-                          __leecher_peer_optimistic_unchoke);
+    /* a piece being revealed is as good as had */
+    if (p->super_seeded && 0 <= p->super_piece &&
+        !pwp_conn_peer_has_piece(p->pc, p->super_piece))
+        me->super_avail[p->super_piece]++;
 }
 
 /**
- * Peer connections are given this as a callback whenever they want to send
- * information */
-static int __FUNC_peerconn_send_to_peer(void *me_,
-                                        const void* pc_peer,
-                                        const void *data,
-                                        const int len)
+ * Tell the peer of the rarest piece it hasn't got, counting the pieces
+ * revealed to other peers as had, so each is sent a different one */
+static void __super_reveal(bt_dm_private_t* me, bt_peer_t* p)
 {
-    const bt_peer_t * peer = pc_peer;
-    bt_dm_private_t *me = me_;
+    int i, best = -1;
 
-    assert(peer);
-    assert(me->cb.peer_send);
-    return me->cb.peer_send(me, &me->cb_ctx, peer->conn_ctx, data, len);
+    if (me->nsuper_avail < __cfg(me)->npieces)
+    {
+        me->nsuper_avail = __cfg(me)->npieces;
+        me->super_avail = realloc(me->super_avail,
+                                  me->nsuper_avail * sizeof(int));
+    }
+    memset(me->super_avail, 0, __cfg(me)->npieces * sizeof(int));
+    p->super_piece = -1;
+    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_count_super);
+
+    for (i = 0; i < __cfg(me)->npieces; i++)
+        if (!pwp_conn_peer_has_piece(p->pc, i) &&
+            (-1 == best || me->super_avail[i] < me->super_avail[best]))
+            best = i;
+
+    if (-1 == best)
+        return;
+    p->super_piece = best;
+    pwp_conn_send_have(p->pc, best);
 }
 
-static void __FUNC_peerconn_send_have(void* cb_ctx, void* peer, void* udata)
+typedef struct
+{
+    bt_peer_t* peer;
+    int idx;
+    int lacking;
+} __super_have_t;
+
+static void __FUNC_peer_lacks_piece(void* cb_ctx, void* peer, void* udata)
 {
+    __super_have_t* h = udata;
     bt_peer_t* p = peer;
 
-    if (!pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED))
+    if (p != h->peer && p->pc && __peer_is_active(p) &&
+        !pwp_conn_peer_has_piece(p->pc, h->idx))
+        h->lacking++;
+}
+
+/**
+ * The peer has its revealed piece; another is revealed once the piece has
+ * spread, or once there's no one for it to spread to */
+static void __super_check_spread(bt_dm_private_t* me, bt_peer_t* p,
+                                 bt_peer_t* from)
+{
+    __super_have_t h = { p, p->super_piece, 0 };
+
+    if (!p->super_seeded || -1 == p->super_piece || !p->pc ||
+        !__peer_is_active(p))
         return;
-    pwp_conn_send_have(p->pc, bt_piece_get_idx(udata));
+
+    if (from == p)
+    {
+        if (!pwp_conn_peer_has_piece(p->pc, p->super_piece))
+            return;
+        bt_peermanager_forall(me->pm, me, &h, __FUNC_peer_lacks_piece);
+        if (0 < h.lacking)
+            return;
+    }
+
+    __super_reveal(me, p);
 }
 
-static void* __offer_job(void *me_, void* j_)
+static void __FUNC_peer_super_have(void* cb_ctx, void* peer, void* udata)
 {
-    bt_dm_private_t* me = me_;
+    __super_have_t* h = udata;
+    bt_peer_t* p = peer;
 
-    llqueue_offer(me->jobs, j_);
+    if (p->super_seeded && p->super_piece == h->idx)
+        __super_check_spread(cb_ctx, p, h->peer);
+}
 
-    /* unused */
-    return NULL;
+/**
+ * A peer says it has a piece. Peers whose revealed piece it is may get
+ * the next */
+static void __super_have(bt_dm_private_t* me, bt_peer_t* from, int idx)
+{
+    __super_have_t h = { from, idx, 0 };
+
+    bt_peermanager_forall(me->pm, me, &h, __FUNC_peer_super_have);
 }
 
-static void* __poll_job(void *me_, void* __attribute__ ((unused)) unused)
+static void __FUNC_peer_super_sweep(void* cb_ctx, void* peer, void* udata)
 {
-    bt_dm_private_t* me = me_;
+    __super_check_spread(cb_ctx, peer, peer);
+}
+
+static void __FUNC_peer_hand_to_seeding_choker(void* cb_ctx, void* peer,
+                                               void* udata)
+{
+    bt_dm_private_t *me = cb_ctx;
+    bt_peer_t* p = peer;
 
-    return llqueue_poll(me->jobs);
+    if (!p->pc)
+        return;
+    pwp_conn_set_seed_mode(p->pc);
+    if (!pwp_conn_im_choking(p->pc))
+        bt_seeding_choker_unchoke_peer(me->schoke, p->pc);
 }
 
-static void __job_dispatch_poll_piece(bt_dm_private_t* me, bt_job_t* j)
+static void __FUNC_peer_count_unchoked(void* cb_ctx, void* peer, void* udata)
 {
-    assert(me->ips.poll_piece);
+    bt_peer_t* p = peer;
 
-    while (1)
-    {
-        int p_idx = me->ips.poll_piece(me->pselector, j->pollblock.peer);
+    if (p->pc && !pwp_conn_im_choking(p->pc))
+        *(int*)udata += 1;
+}
 
-        if (-1 == p_idx)
-            break;
+/**
+ * Seed once we have every piece. The seeding choker starts with the peers
+ * that the leeching choker left unchoked, and connections give up their
+ * download side */
+static void __check_seeding(bt_dm_private_t* me)
+{
+    if (me->am_seeding || !__have_all_pieces(me))
+        return;
 
-        bt_piece_t* pce = me->ipdb.get_piece(me->pdb, p_idx);
+    me->am_seeding = 1;
+    __log(me, NULL, "client,seeding");
+    bt_peermanager_forall(me->pm, me, NULL,
+                          __FUNC_peer_hand_to_seeding_choker);
+}
 
-        if (pce && bt_piece_is_complete(pce))
-        {
-            me->ips.have_piece(me->pselector, p_idx);
-            continue;
-        }
+static void __leecher_peer_reciprocation(void *me_)
+{
+    bt_dm_private_t *me = me_;
 
-        while (!bt_piece_is_fully_requested(pce))
-        {
-            bt_block_t blk;
-            bt_piece_poll_block_request(pce, &blk);
-            pwp_conn_offer_block(j->pollblock.peer->pc, &blk);
-        }
+    __check_seeding(me);
 
-        break;
+    /* the peers a revealed piece could have spread to may have gone */
+    if (me->super_avail)
+        bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_super_sweep);
+
+    if (me->am_seeding)
+    {
+        bt_seeding_choker_set_upload_capacity(me->schoke,
+                                              __cfg(me)->max_upload_rate);
+        bt_seeding_choker_decide_best_npeers(me->schoke);
     }
+    else
+        bt_leeching_choker_decide_best_npeers(me->lchoke);
+
+    me->choke_rounds += 1;
+    me->nunchoked = 0;
+    bt_peermanager_forall(me->pm, me, &me->nunchoked,
+                          __FUNC_peer_count_unchoked);
+
+    bt_timerwheel_add(me->wheel, BT_RECIPROCATION_MS, me,
+                      __leecher_peer_reciprocation);
 }
 
-static void __job_dispatch_validate_piece(bt_dm_private_t* me, bt_job_t* j)
+static void __leecher_peer_optimistic_unchoke(void *me_)
 {
-    bt_piece_t *p = me->ipdb.get_piece(me->pdb, j->validate_piece.piece_idx);
-    int piece_idx = bt_piece_get_idx(p);
+    bt_dm_private_t *me = me_;
 
-    switch (bt_piece_validate(p))
-    {
-    case BT_PIECE_VALIDATE_COMPLETE_PIECE:
+    /* the seeding choker rotates peers in each round */
+    if (!me->am_seeding)
+        bt_leeching_choker_optimistically_unchoke(me->lchoke);
+    bt_timerwheel_add(me->wheel, BT_OPTIMISTIC_UNCHOKE_MS, me,
+                      __leecher_peer_optimistic_unchoke);
+}
+
+/**
+ * Ages pending requests so that stale ones are given back */
+static void __peer_tick(void *me_)
+{
+    bt_dm_private_t *me = me_;
+
+    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_tick);
+    bt_timerwheel_add(me->wheel, BT_PEER_TICK_MS, me, __peer_tick);
+}
+
+static void __peer_sample_rates(void *me_)
+{
+    bt_dm_private_t *me = me_;
+
+    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_sample_rates);
+    bt_timerwheel_add(me->wheel, BT_RATE_SAMPLE_MS, me, __peer_sample_rates);
+}
+
+static void __peer_keepalive(void *me_)
+{
+    bt_dm_private_t *me = me_;
+
+    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_keepalive);
+    bt_timerwheel_add(me->wheel, BT_IDLE_MS, me, __peer_keepalive);
+}
+
+typedef struct
+{
+    unsigned char* addrs;
+    int n;
+    int size;
+} __addrs_t;
+
+/**
+ * @return 1 if others can connect to the peer at addr */
+static int __pex_addr(bt_peer_t* p, unsigned char* addr)
+{
+    int port;
+
+    if (!__peer_is_active(p) || p->addr_is_name)
+        return 0;
+
+    memcpy(addr, p->addr, BT_PEER_ADDR_LEN);
+    if (!p->incoming)
+        return 1;
+
+    /* the port of a connection to us is no use to anyone; the extension
+     * handshake may say what the peer listens on */
+    if (0 == (port = pwp_conn_get_peer_listen_port(p->pc)))
+        return 0;
+    addr[16] = (port >> 8) & 0xff;
+    addr[17] = port & 0xff;
+    return 1;
+}
+
+static void __FUNC_peer_pex_addr(void* cb_ctx, void* peer, void* udata)
+{
+    __addrs_t* a = udata;
+
+    if (a->size <= a->n)
     {
-        __log(me, NULL, "client,piece completed,pieceidx=%d", piece_idx);
-        assert(me->ips.have_piece);
-        me->ips.have_piece(me->pselector, piece_idx);
-        chunky_mark_complete(me->pieces_completed, piece_idx, 1);
-        bt_peermanager_forall(me->pm, me, p, __FUNC_peerconn_send_have);
+        a->size = a->size * 2 + 16;
+        a->addrs = realloc(a->addrs, a->size * BT_PEER_ADDR_LEN);
     }
-    break;
+    if (__pex_addr(peer, a->addrs + a->n * BT_PEER_ADDR_LEN))
+        a->n++;
+}
 
-    case BT_PIECE_VALIDATE_ERROR: /* error */
-        printf("error validating piece: %d\n", piece_idx);
-        break;
+static int __addr_cmp(const void* a, const void* b)
+{
+    return memcmp(a, b, BT_PEER_ADDR_LEN);
+}
 
-    case BT_PIECE_VALIDATE_INVALID_PIECE: /* invalid piece */
-    {
-        /* only peer involved in piece download, therefore treat as
-         * untrusted and blacklist */
-        if (1 == bt_piece_num_peers(p))
-        {
-            int i = 0;
-            void* peer = bt_piece_get_peers(p, &i);
-            bt_blacklist_add_peer(me->blacklist, p, peer);
-        }
-        else
-        {
-            int i = 0;
-            void* p2;
+/**
+ * Put the addresses in a that aren't in b into out, sorted arrays all
+ * @return number put in out */
+static int __addrs_minus(const unsigned char* a, int na,
+                         const unsigned char* b, int nb, unsigned char* out)
+{
+    int i, j = 0, n = 0, c = 1;
 
-            for (p2 = bt_piece_get_peers(p, &i); p2;
-                 p2 = bt_piece_get_peers(p, &i))
-                bt_blacklist_add_peer_as_potentially_blacklisted(
-                    me->blacklist, p, p2);
+    for (i = 0; i < na; i++)
+    {
+        const unsigned char* x = a + i * BT_PEER_ADDR_LEN;
 
-            bt_piece_drop_download_progress(p);
-            me->ips.peer_giveback_piece(me->pselector, NULL,
-                                        bt_piece_get_idx(p));
-        }
+        while (j < nb && (c = __addr_cmp(b + j * BT_PEER_ADDR_LEN, x)) < 0)
+            j++;
+        if (j < nb && 0 == c)
+            continue;
+        memcpy(out + n++ * BT_PEER_ADDR_LEN, x, BT_PEER_ADDR_LEN);
     }
-    break;
+    return n;
+}
+
+/**
+ * Copy up to PWP_PEX_MAX addresses that aren't the peer's own
+ * @return number copied */
+static int __pex_list(const unsigned char* addrs, int n,
+                      const unsigned char* self, unsigned char* out)
+{
+    int i, nout = 0;
+
+    for (i = 0; i < n && nout < PWP_PEX_MAX; i++)
+    {
+        const unsigned char* x = addrs + i * BT_PEER_ADDR_LEN;
+
+        if (self && 0 == __addr_cmp(x, self))
+            continue;
+        memcpy(out + nout++ * BT_PEER_ADDR_LEN, x, BT_PEER_ADDR_LEN);
     }
+    return nout;
 }
 
-static void __dispatch_job(bt_dm_private_t* me, bt_job_t* j)
+typedef struct
 {
-    assert(j);
+    /* every connected peer, and what's changed since the last round */
+    __addrs_t all;
+    unsigned char* added;
+    int nadded;
+    unsigned char* dropped;
+    int ndropped;
+} __pex_round_t;
+
+static void __FUNC_peer_send_pex(void* cb_ctx, void* peer, void* udata)
+{
+    __pex_round_t* r = udata;
+    bt_peer_t* p = peer;
+    unsigned char self[BT_PEER_ADDR_LEN], *s,
+                  added[PWP_PEX_MAX * BT_PEER_ADDR_LEN],
+                  dropped[PWP_PEX_MAX * BT_PEER_ADDR_LEN];
+    int nadded, ndropped = 0;
 
-    switch (j->type)
+    if (!__peer_is_active(p) || !pwp_conn_peer_supports_pex(p->pc))
+        return;
+
+    s = __pex_addr(p, self) ? self : NULL;
+    if (!p->pex_sent)
+        nadded = __pex_list(r->all.addrs, r->all.n, s, added);
+    else
     {
-    case BT_JOB_POLLBLOCK: __job_dispatch_poll_piece(me, j); break;
-    case BT_JOB_VALIDATE_PIECE: __job_dispatch_validate_piece(me, j); break;
-    default: assert(0); break;
+        nadded = __pex_list(r->added, r->nadded, s, added);
+        ndropped = __pex_list(r->dropped, r->ndropped, s, dropped);
     }
 
-    /* TODO: replace with mempool */
-    free(j);
+    if (0 == nadded && 0 == ndropped)
+        return;
+    if (pwp_conn_send_pex(p->pc, added, nadded, dropped, ndropped))
+        p->pex_sent = 1;
 }
 
-static void* __call_exclusively(void* me_, void** lock, void *j,
-                                void* (*func)(void *me_, void* j_))
+/**
+ * Tell peers that support ut_pex about the peers we're connected to.
+ * A peer's first message has all of them; the rest have the peers that
+ * have come and gone since the last round */
+static void __peer_exchange(void *me_)
 {
     bt_dm_private_t *me = me_;
+    __pex_round_t r;
+
+    bt_timerwheel_add(me->wheel, BT_PEX_MS, me, __peer_exchange);
+    if (!__cfg(me)->peer_exchange)
+        return;
+
+    memset(&r, 0, sizeof(r));
+    bt_peermanager_forall(me->pm, me, &r.all, __FUNC_peer_pex_addr);
+    qsort(r.all.addrs, r.all.n, BT_PEER_ADDR_LEN, __addr_cmp);
+
+    r.added = malloc((r.all.n + 1) * BT_PEER_ADDR_LEN);
+    r.dropped = malloc((me->npex + 1) * BT_PEER_ADDR_LEN);
+    r.nadded = __addrs_minus(r.all.addrs, r.all.n, me->pex, me->npex,
+                             r.added);
+    r.ndropped = __addrs_minus(me->pex, me->npex, r.all.addrs, r.all.n,
+                               r.dropped);
+    bt_peermanager_forall(me->pm, me, &r, __FUNC_peer_send_pex);
+
+    free(r.added);
+    free(r.dropped);
+    free(me->pex);
+    me->pex = r.all.addrs;
+    me->npex = r.all.n;
+}
+
+/**
+ * Peer connections are given this as a callback whenever they want to send
+ * information */
+static int __FUNC_peerconn_send_to_peer(void *me_,
+                                        const void* pc_peer,
+                                        const void *data,
+                                        const int len)
+{
+    const bt_peer_t * peer = pc_peer;
+    bt_dm_private_t *me = me_;
+
+    assert(peer);
+    assert(me->cb.peer_send);
+    return me->cb.peer_send(me, &me->cb_ctx, peer->conn_ctx, data, len);
+}
+
+/**
+ * Queue a HAVE for every peer's next tick */
+static void __queue_have(bt_dm_private_t* me, int piece_idx)
+{
+    if (me->haves_size <= me->nhaves)
+    {
+        me->haves_size = me->haves_size ? me->haves_size * 2 : 16;
+        me->haves = realloc(me->haves, sizeof(int) * me->haves_size);
+    }
+    me->haves[me->nhaves++] = piece_idx;
+}
+
+/**
+ * Take a job from the pool. Grow the pool by a slab if it's empty */
+static bt_job_t* __job_pool_take(bt_job_pool_t* pool)
+{
+    bt_job_t* j;
+
+    if (!pool->free)
+    {
+        bt_job_slab_t* s;
+        int i;
+
+        if (!(s = malloc(sizeof(bt_job_slab_t))))
+        {
+            perror("out of memory");
+            exit(0);
+        }
+        s->next = pool->slabs;
+        pool->slabs = s;
+
+        for (i = 0; i < BT_JOB_SLAB_SIZE; i++)
+        {
+            s->jobs[i].next = pool->free;
+            pool->free = &s->jobs[i];
+        }
+    }
+
+    j = pool->free;
+    pool->free = j->next;
+    pool->nused += 1;
+    if (pool->hwm < pool->nused)
+        pool->hwm = pool->nused;
+    return j;
+}
+
+static void __job_pool_giveback(bt_job_pool_t* pool, bt_job_t* j)
+{
+    j->next = pool->free;
+    pool->free = j;
+    pool->nused -= 1;
+}
+
+static void __job_pool_release(bt_job_pool_t* pool)
+{
+    while (pool->slabs)
+    {
+        bt_job_slab_t* s = pool->slabs;
+        pool->slabs = s->next;
+        free(s);
+    }
+    pool->free = NULL;
+}
+
+/**
+ * Copy the job into a pooled job and queue it.
+ * The queue is linked through the jobs' next, so the only allocation is
+ * the pool growing by a slab
+ * @param j_ Job to be copied */
+static void* __offer_job(void *me_, void* j_)
+{
+    bt_dm_private_t* me = me_;
+    bt_job_t* j = __job_pool_take(&me->job_pool);
+
+    memcpy(j, j_, sizeof(bt_job_t));
+    j->next = NULL;
+    if (me->jobs_tail)
+        me->jobs_tail->next = j;
+    else
+        me->jobs = j;
+    me->jobs_tail = j;
+    __atomic_add_fetch(&me->njobs, 1, __ATOMIC_RELEASE);
+
+    /* unused */
+    return NULL;
+}
+
+/**
+ * Copy the next job out of the queue and give it back to the pool
+ * @param j_ Job to be copied into
+ * @return j_ if a job was polled; otherwise NULL */
+static void* __poll_job(void *me_, void* j_)
+{
+    bt_dm_private_t* me = me_;
+    bt_job_t* j;
+
+    if (!(j = me->jobs))
+        return NULL;
+    if (!(me->jobs = j->next))
+        me->jobs_tail = NULL;
+    __atomic_sub_fetch(&me->njobs, 1, __ATOMIC_RELEASE);
+
+    memcpy(j_, j, sizeof(bt_job_t));
+    __job_pool_giveback(&me->job_pool, j);
+    return j_;
+}
+
+static int __piece_priority(bt_dm_private_t* me, int piece_idx)
+{
+    if (!me->priorities || piece_idx < 0 || me->npriorities <= piece_idx)
+        return BT_PIECE_PRIORITY_NORMAL;
+    return me->priorities[piece_idx];
+}
+
+/* blocks gathered for a peer before they're offered to its connection */
+#define BT_DM_BATCH 32
+
+/* blocks that are offered to the peer's connection together */
+typedef struct
+{
+    bt_peer_t* peer;
+    bt_block_t blks[BT_DM_BATCH];
+    int n;
+    /* blocks offered by this poll, including those already flushed */
+    int total;
+} __batch_t;
+
+static void __batch_flush(__batch_t* b)
+{
+    pwp_conn_offer_blocks(b->peer->pc, b->blks, b->n);
+    b->n = 0;
+}
+
+static void __batch_offer(__batch_t* b, const bt_block_t* blk)
+{
+    b->blks[b->n++] = *blk;
+    b->total++;
+    if (BT_DM_BATCH == b->n)
+        __batch_flush(b);
+}
+
+/**
+ * Request a piece the peer has pointed us at, if it's still needed
+ * @return 1 if blocks were offered */
+static int __poll_hinted_piece(bt_dm_private_t* me, __batch_t* b,
+                               const int* pieces, int n)
+{
+    bt_peer_t* peer = b->peer;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        bt_piece_t* pce = me->ipdb.get_piece(me->pdb, pieces[i]);
+
+        if (!pce || bt_piece_is_complete(pce) ||
+            bt_piece_is_fully_requested(pce) ||
+            BT_PIECE_PRIORITY_SKIP == __piece_priority(me, pieces[i]) ||
+            !pwp_conn_peer_has_piece(peer->pc, pieces[i]) ||
+            bt_blacklist_peer_is_blacklisted(me->blacklist, pce, peer))
+            continue;
+
+        while (!bt_piece_is_fully_requested(pce))
+        {
+            bt_block_t blk;
+            bt_piece_poll_block_request(pce, &blk);
+            __batch_offer(b, &blk);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/* the peers we've asked for a block in endgame */
+typedef struct
+{
+    bt_block_t blk;
+    bt_peer_t** peers;
+    int npeers;
+} __endgame_block_t;
+
+static unsigned long __endgame_block_hash(const void *obj)
+{
+    const bt_block_t* b = obj;
+
+    return (unsigned long)b->piece_idx * 2654435761u ^ b->offset;
+}
+
+static long __endgame_block_cmp(const void *obj, const void *other)
+{
+    const bt_block_t* a = obj, *b = other;
+
+    if (a->piece_idx != b->piece_idx)
+        return (long)a->piece_idx - (long)b->piece_idx;
+    return (long)a->offset - (long)b->offset;
+}
+
+static void __endgame_block_add_peer(__endgame_block_t* e, bt_peer_t* peer)
+{
+    int i;
+
+    for (i = 0; i < e->npeers; i++)
+        if (e->peers[i] == peer)
+            return;
+    e->peers = realloc(e->peers, (e->npeers + 1) * sizeof(bt_peer_t*));
+    e->peers[e->npeers++] = peer;
+}
+
+static void __FUNC_peer_holds_block(void* cb_ctx, void* peer, void* udata)
+{
+    __endgame_block_t* e = udata;
+    bt_peer_t* p = peer;
+
+    if (p->pc && pwp_conn_block_request_is_pending(p->pc, &e->blk))
+        __endgame_block_add_peer(e, p);
+}
+
+/**
+ * Remember that we're asking this peer for the block too.
+ * The first time round we look for whoever we asked before endgame */
+static void __endgame_track(bt_dm_private_t* me, bt_peer_t* peer,
+                            const bt_block_t* blk)
+{
+    __endgame_block_t* e;
+
+    if (!me->endgame_blocks)
+        me->endgame_blocks = bt_hashmap_new(__endgame_block_hash,
+                                            __endgame_block_cmp, 11);
+
+    if (!(e = bt_hashmap_get(me->endgame_blocks, blk)))
+    {
+        e = calloc(1, sizeof(__endgame_block_t));
+        e->blk = *blk;
+        bt_hashmap_put(me->endgame_blocks, &e->blk, e);
+    }
+
+    /* everyone we knew of has left; someone may have been asked since */
+    if (0 == e->npeers)
+        bt_peermanager_forall(me->pm, me, e, __FUNC_peer_holds_block);
+
+    __endgame_block_add_peer(e, peer);
+}
+
+/**
+ * The block has arrived; the other peers needn't send it */
+static void __endgame_cancel(bt_dm_private_t* me, bt_peer_t* from,
+                             const bt_block_t* blk)
+{
+    __endgame_block_t* e;
+    int i;
+
+    if (!me->endgame_blocks ||
+        !(e = bt_hashmap_remove(me->endgame_blocks, blk)))
+        return;
+
+    for (i = 0; i < e->npeers; i++)
+        if (e->peers[i] != from && e->peers[i]->pc)
+            pwp_conn_cancel_request(e->peers[i]->pc, blk);
+    free(e->peers);
+    free(e);
+}
+
+/**
+ * The peer gave the block back; it's no longer one of the holders */
+static void __endgame_forget_block(bt_dm_private_t* me, bt_peer_t* peer,
+                                   const bt_block_t* blk)
+{
+    __endgame_block_t* e;
+    int i;
+
+    if (!me->endgame_blocks || !(e = bt_hashmap_get(me->endgame_blocks, blk)))
+        return;
+
+    for (i = 0; i < e->npeers; i++)
+        if (e->peers[i] == peer)
+            e->peers[i--] = e->peers[--e->npeers];
+
+    if (0 < e->npeers)
+        return;
+    bt_hashmap_remove(me->endgame_blocks, blk);
+    free(e->peers);
+    free(e);
+}
+
+/**
+ * The peer is going away; don't leave it behind in the table */
+static void __endgame_forget_peer(bt_dm_private_t* me, bt_peer_t* peer)
+{
+    bt_hashmap_iterator_t iter;
+    __endgame_block_t* e;
+
+    if (!me->endgame_blocks)
+        return;
+
+    for (bt_hashmap_iterator(me->endgame_blocks, &iter);
+         (e = bt_hashmap_iterator_next_value(me->endgame_blocks, &iter));)
+    {
+        int i;
+
+        for (i = 0; i < e->npeers; i++)
+            if (e->peers[i] == peer)
+                e->peers[i--] = e->peers[--e->npeers];
+    }
+}
+
+static void __endgame_release(bt_dm_private_t* me)
+{
+    bt_hashmap_iterator_t iter;
+    __endgame_block_t* e;
+
+    if (!me->endgame_blocks)
+        return;
+
+    for (bt_hashmap_iterator(me->endgame_blocks, &iter);
+         (e = bt_hashmap_iterator_next_value(me->endgame_blocks, &iter));)
+    {
+        free(e->peers);
+        free(e);
+    }
+    bt_hashmap_free(me->endgame_blocks);
+}
+
+/**
+ * Ask this peer for blocks that other peers are still sending us.
+ * Whoever delivers first gets the other requests cancelled */
+static void __request_endgame_blocks(bt_dm_private_t* me, __batch_t* b,
+                                     bt_piece_t* pce)
+{
+    bt_peer_t* peer = b->peer;
+    bt_block_t blk;
+    unsigned int offset = 0;
+
+    while (bt_piece_get_missing_block(pce, offset, &blk))
+    {
+        offset = blk.offset + blk.len;
+        if (pwp_conn_block_request_is_pending(peer->pc, &blk))
+            continue;
+        __endgame_track(me, peer, &blk);
+        __batch_offer(b, &blk);
+    }
+}
+
+/* a peer with room in its pipeline that blocks can be moved to */
+typedef struct
+{
+    bt_peer_t* peer;
+
+    /* bytes it's to send before a block moved to it, and how many more
+     * blocks it may take this tick */
+    unsigned int bytes;
+    int room;
+} __thief_t;
+
+typedef struct
+{
+    bt_dm_private_t* me;
+    __thief_t* thieves;
+    int nthieves;
+} __steal_t;
+
+static void __FUNC_peer_find_thief(void* cb_ctx, void* peer, void* udata)
+{
+    __steal_t* s = udata;
+    bt_peer_t* p = peer;
+    int npending;
+
+    if (!__peer_is_active(p) || !pwp_conn_im_interested(p->pc) ||
+        pwp_conn_im_choked(p->pc) || pwp_conn_is_snubbed(p->pc) ||
+        0 == pwp_conn_get_download_rate(p->pc) ||
+        !__may_download(s->me, p))
+        return;
+
+    /* it has room in its pipeline, and the requests there go first */
+    npending = pwp_conn_get_npending_requests(p->pc);
+    if (__pipeline_depth(s->me, p) <= npending)
+        return;
+
+    s->thieves = realloc(s->thieves, (s->nthieves + 1) * sizeof(__thief_t));
+    s->thieves[s->nthieves].peer = p;
+    s->thieves[s->nthieves].bytes = npending * (BT_BLOCK_SIZE);
+    s->thieves[s->nthieves].room = __pipeline_depth(s->me, p) - npending;
+    s->nthieves++;
+}
+
+/**
+ * Ask a thief for the block too if it would beat the peer
+ * @param eta_ms When the peer holding the request should get to it */
+static void __steal_block(__steal_t* s, bt_peer_t* holder,
+                          const bt_block_t* blk, unsigned long long eta_ms)
+{
+    bt_dm_private_t* me = s->me;
+    __endgame_block_t* e;
+    int i;
+
+    /* the request can outlive the block arriving from someone else */
+    if (bt_piece_have_block(me->ipdb.get_piece(me->pdb, blk->piece_idx),
+                            blk))
+        return;
+
+    /* it's already been asked of someone else */
+    if (me->endgame_blocks && (e = bt_hashmap_get(me->endgame_blocks, blk)) &&
+        1 < e->npeers)
+        return;
+
+    for (i = 0; i < s->nthieves; i++)
+    {
+        __thief_t* t = &s->thieves[i];
+        unsigned long long ms;
+
+        if (0 == t->room || t->peer == holder ||
+            !pwp_conn_peer_has_piece(t->peer->pc, blk->piece_idx))
+            continue;
+
+        ms = pwp_conn_get_srtt(t->peer->pc) +
+            (t->bytes + blk->len) * 1000ull /
+            pwp_conn_get_download_rate(t->peer->pc);
+        if (eta_ms <= ms * __cfg(me)->steal_ratio)
+            continue;
+
+        /* it skips the queue; whoever loses the race has its request
+         * cancelled */
+        __endgame_track(me, t->peer, blk);
+        pwp_conn_request_block_from_peer(t->peer->pc, (bt_block_t*)blk);
+        __spend_download(me, t->peer, blk->len);
+        t->bytes += blk->len;
+        t->room--;
+        me->stolen_blocks++;
+        return;
+    }
+}
+
+static void __FUNC_peer_steal_from(void* cb_ctx, void* peer, void* udata)
+{
+    __steal_t* s = udata;
+    bt_peer_t* p = peer;
+    unsigned long long ahead = 0;
+    unsigned int iter = 0, age_ms;
+    int rate;
+    bt_block_t blk;
+
+    if (!__peer_is_active(p))
+        return;
+
+    /* the peer sends them in the order we asked */
+    rate = pwp_conn_get_download_rate(p->pc);
+    while (pwp_conn_get_pending_request(p->pc, &iter, &blk, &age_ms))
+    {
+        ahead += blk.len;
+        __steal_block(s, p, &blk,
+                      0 < rate ? ahead * 1000 / rate : ULLONG_MAX);
+    }
+}
+
+/**
+ * Move blocks from slow peers to fast ones with room to spare, so that a
+ * piece isn't left waiting on its last block for the request to time out */
+static void __steal_blocks(bt_dm_private_t* me)
+{
+    __steal_t s = { me, NULL, 0 };
+
+    if (__cfg(me)->steal_ratio <= 0 || __have_all_pieces(me))
+        return;
+
+    bt_peermanager_forall(me->pm, me, &s, __FUNC_peer_find_thief);
+    if (0 < s.nthieves)
+        bt_peermanager_forall(me->pm, me, &s, __FUNC_peer_steal_from);
+    free(s.thieves);
+}
+
+/**
+ * @return 1 if the peer would take too long to send us a whole piece, or
+ * it's sitting on our requests */
+static int __peer_is_slow(bt_dm_private_t* me, bt_peer_t* peer)
+{
+    if (pwp_conn_is_snubbed(peer->pc))
+        return 1;
+
+    return 0 < __cfg(me)->slow_piece_secs &&
+        (long long)pwp_conn_get_download_rate(peer->pc) *
+        __cfg(me)->slow_piece_secs < __cfg(me)->piece_length;
+}
+
+/**
+ * Request blocks of the piece from the peer.
+ * A slow peer gets one block and the rest of the piece is left for others */
+static void __request_blocks(__batch_t* b, bt_piece_t* pce, int slow)
+{
+    while (!bt_piece_is_fully_requested(pce))
+    {
+        bt_block_t blk;
+        bt_piece_poll_block_request(pce, &blk);
+        __batch_offer(b, &blk);
+
+        if (slow)
+            break;
+    }
+}
+
+/**
+ * Let other slow peers help out with this piece */
+static void __share_piece(bt_dm_private_t* me, bt_piece_t* pce)
+{
+    int i;
+
+    if (bt_piece_is_fully_requested(pce))
+        return;
+
+    for (i = 0; i < me->nshared; i++)
+        if (me->shared[i] == bt_piece_get_idx(pce))
+            return;
+
+    if (me->shared_size <= me->nshared)
+    {
+        me->shared_size = me->shared_size ? me->shared_size * 2 : 16;
+        me->shared = realloc(me->shared, sizeof(int) * me->shared_size);
+    }
+    me->shared[me->nshared++] = bt_piece_get_idx(pce);
+}
+
+/**
+ * Carry on with a piece that slow peers are sharing, so that we don't have
+ * more pieces in flight than we need. Pieces that no longer need requests
+ * are dropped from the list
+ * @return 1 if blocks were offered */
+static int __request_shared_blocks(bt_dm_private_t* me, __batch_t* b,
+                                   int slow)
+{
+    bt_peer_t* peer = b->peer;
+    int i;
+
+    for (i = 0; i < me->nshared; i++)
+    {
+        int idx = me->shared[i];
+        bt_piece_t* pce = me->ipdb.get_piece(me->pdb, idx);
+
+        if (!pce || bt_piece_is_complete(pce) ||
+            bt_piece_is_fully_requested(pce) ||
+            BT_PIECE_PRIORITY_SKIP == __piece_priority(me, idx))
+        {
+            me->shared[i--] = me->shared[--me->nshared];
+            continue;
+        }
+
+        if (!pwp_conn_peer_has_piece(peer->pc, idx) ||
+            bt_blacklist_peer_is_blacklisted(me->blacklist, pce, peer))
+            continue;
+
+        /* a fast peer takes the piece over */
+        if (!slow)
+            me->shared[i] = me->shared[--me->nshared];
+
+        __request_blocks(b, pce, slow);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* low priority pieces we'll pass over looking for a normal one */
+#define BT_DM_LOW_LOOKAHEAD 8
+
+/**
+ * Offer the peer the blocks of one piece, or one block if it's slow
+ * @return 1 if blocks were offered */
+static int __poll_piece(bt_dm_private_t* me, __batch_t* b)
+{
+    bt_peer_t* peer = b->peer;
+    const int* hints;
+    int n, i, slow, p_idx = -1, low[BT_DM_LOW_LOOKAHEAD], nlow = 0,
+        skipped[BT_DM_LOW_LOOKAHEAD], nskipped = 0;
+    bt_piece_t* pce;
+
+    /* while choked only the peer's allowed fast pieces can be requested */
+    if (pwp_conn_im_choked(peer->pc))
+    {
+        hints = pwp_conn_get_allowed_fast(peer->pc, &n);
+        return __poll_hinted_piece(me, b, hints, n);
+    }
+
+    hints = pwp_conn_get_suggested(peer->pc, &n);
+    if (__poll_hinted_piece(me, b, hints, n))
+        return 1;
+
+    slow = __peer_is_slow(me, peer);
+    if (__request_shared_blocks(me, b, slow))
+        return 1;
+
+    while (1)
+    {
+        p_idx = me->ips.poll_piece(me->pselector, peer);
+
+        if (-1 == p_idx)
+            break;
+
+        pce = me->ipdb.get_piece(me->pdb, p_idx);
+
+        if (pce && bt_piece_is_complete(pce))
+        {
+            me->ips.have_piece(me->pselector, p_idx);
+            continue;
+        }
+
+        /* the peer sent us a bad copy of this piece before */
+        if (bt_blacklist_peer_is_blacklisted(me->blacklist, pce,
+                                             peer))
+        {
+            if (nskipped < BT_DM_LOW_LOOKAHEAD)
+            {
+                skipped[nskipped++] = p_idx;
+                continue;
+            }
+            me->ips.peer_giveback_piece(me->pselector, peer,
+                                        p_idx);
+            p_idx = -1;
+            break;
+        }
+
+        /* look for something better first */
+        if (BT_PIECE_PRIORITY_LOW == __piece_priority(me, p_idx) &&
+            !bt_piece_is_fully_requested(pce) && nlow < BT_DM_LOW_LOOKAHEAD)
+        {
+            low[nlow++] = p_idx;
+            continue;
+        }
+
+        break;
+    }
+
+    /* settle for a low priority piece; the others go back */
+    for (i = 0; i < nlow; i++)
+        if (-1 == p_idx)
+            p_idx = low[i];
+        else
+            me->ips.peer_giveback_piece(me->pselector, peer,
+                                        low[i]);
+
+    for (i = 0; i < nskipped; i++)
+        me->ips.peer_giveback_piece(me->pselector, peer,
+                                    skipped[i]);
+
+    if (-1 == p_idx)
+        return 0;
+
+    pce = me->ipdb.get_piece(me->pdb, p_idx);
+
+    /* the selector is in endgame */
+    if (bt_piece_is_fully_requested(pce))
+    {
+        n = b->total;
+        __request_endgame_blocks(me, b, pce);
+        return n < b->total;
+    }
+
+    /* fast peers own whole pieces; slow peers start a piece for sharing */
+    __request_blocks(b, pce, slow);
+    if (slow)
+        __share_piece(me, pce);
+    return 1;
+}
+
+/**
+ * Fill the peer's pipeline. Fast peers get whole pieces, so one piece
+ * usually covers it */
+static void __job_dispatch_poll_piece(bt_dm_private_t* me, bt_job_t* j)
+{
+    __batch_t b;
+
+    assert(me->ips.poll_piece);
+
+    /* the peer has been removed since the job was queued */
+    if (!j->pollblock.peer->pc)
+        return;
+
+    /* the rate limits are spent for this tick; try again next */
+    if (!__may_download(me, j->pollblock.peer))
+    {
+        __mark_ready(me, j->pollblock.peer);
+        return;
+    }
+
+    b.peer = j->pollblock.peer;
+    b.n = b.total = 0;
+    while (b.total < j->pollblock.max && __poll_piece(me, &b))
+        ;
+    __batch_flush(&b);
+}
+
+static void __queue_job(bt_dm_private_t* me, bt_job_t* j);
+
+typedef struct
+{
+    bt_dm_private_t* me;
+    int suspicions;
+} __suspects_t;
+
+/**
+ * Peers that have turned up in the most failed pieces are suspects. Peers
+ * that have gone don't get a say */
+static int __FUNC_peer_is_suspect(void* udata, void* peer)
+{
+    __suspects_t* s = udata;
+
+    return !bt_peermanager_has_peer(s->me->pm, peer) ||
+           s->suspicions <= ((bt_peer_t*)peer)->suspicions;
+}
+
+/**
+ * Stop the peer from sending us the piece again. Once it has sent us
+ * max_bad_pieces bad pieces its host is banned and it's dropped.
+ * Peers that have gone are left alone; their memory may be reused */
+static void __blacklist_peer(bt_dm_private_t* me, bt_piece_t* p,
+                             bt_peer_t* peer)
+{
+    if (!bt_peermanager_has_peer(me->pm, peer))
+        return;
+
+    bt_blacklist_add_peer(me->blacklist, p, peer);
+    bt_peerhistory_blacklisted(me->history, peer->ip, strlen(peer->ip),
+                               peer->port);
+
+    if (0 >= __cfg(me)->max_bad_pieces ||
+        bt_blacklist_get_npieces_for_peer(me->blacklist, peer) <
+        __cfg(me)->max_bad_pieces)
+        return;
+
+    if (!peer->addr_is_name)
+        bt_blacklist_ban_addr(me->blacklist, peer->addr);
+    __log(me, NULL, "client,banned peer,%s:%d", peer->ip, peer->port);
+
+    /* reaped on the next BT_REAP_MS; we might be inside its handler */
+    if (peer->pc)
+    {
+        if (me->cb.peer_disconnect)
+            me->cb.peer_disconnect(me, &me->cb_ctx, peer->conn_ctx);
+        pwp_conn_set_state(peer->pc, PC_FAILED_CONNECTION);
+    }
+}
+
+/**
+ * Ban the peers whose blocks were different when the piece validated */
+static void __ban_culprits(bt_dm_private_t* me, bt_piece_t* p)
+{
+    bt_peer_t* peer;
+
+    while ((peer = bt_piece_pop_culprit(p)))
+    {
+        if (!bt_peermanager_has_peer(me->pm, peer))
+            continue;
+        __log(me, NULL, "client,sent bad block,pieceidx=%d,%s:%d",
+              bt_piece_get_idx(p), peer->ip, peer->port);
+        __blacklist_peer(me, p, peer);
+    }
+}
+
+static void __handle_validation(bt_dm_private_t* me, bt_piece_t* p, int result)
+{
+    int piece_idx = bt_piece_get_idx(p);
+
+    switch (result)
+    {
+    case BT_PIECE_VALIDATE_COMPLETE_PIECE:
+    {
+        __log(me, NULL, "client,piece completed,pieceidx=%d", piece_idx);
+        BT_TRACE(BT_TRACE_PIECE, BT_TRACE_PIECE_COMPLETED, NULL, piece_idx,
+                 0, bt_piece_get_size(p));
+        __ban_culprits(me, p);
+        assert(me->ips.have_piece);
+        me->ips.have_piece(me->pselector, piece_idx);
+        __mark_completed(me, piece_idx);
+        __queue_have(me, piece_idx);
+    }
+    break;
+
+    case BT_PIECE_VALIDATE_ERROR: /* error */
+        printf("error validating piece: %d\n", piece_idx);
+        break;
+
+    case BT_PIECE_VALIDATE_INVALID_PIECE: /* invalid piece */
+    {
+        /* the startup check finds pieces we don't have yet */
+        if (0 < bt_piece_num_peers(p))
+        {
+            me->hash_failures++;
+            me->hash_failure_bytes += bt_piece_get_size(p);
+            BT_TRACE(BT_TRACE_PIECE, BT_TRACE_PIECE_FAILED, NULL, piece_idx,
+                     0, bt_piece_get_size(p));
+        }
+
+        /* only peer involved in piece download, therefore treat as
+         * untrusted and blacklist */
+        if (1 == bt_piece_num_peers(p))
+        {
+            int i = 0;
+            bt_peer_t* peer = bt_piece_get_peers(p, &i);
+            __blacklist_peer(me, p, peer);
+        }
+        else
+        {
+            __suspects_t s = { me, 0 };
+            int i = 0;
+            bt_peer_t* p2;
+
+            for (p2 = bt_piece_get_peers(p, &i); p2;
+                 p2 = bt_piece_get_peers(p, &i))
+            {
+                bt_blacklist_add_peer_as_potentially_blacklisted(
+                    me->blacklist, p, p2);
+                if (!bt_peermanager_has_peer(me->pm, p2))
+                    continue;
+                p2->suspicions++;
+                if (s.suspicions < p2->suspicions)
+                    s.suspicions = p2->suspicions;
+            }
+
+            /* only download again what the suspects sent us */
+            if (0 == bt_piece_drop_blocks(p, __FUNC_peer_is_suspect, &s))
+                bt_piece_drop_download_progress(p);
+            __giveback_piece(me, NULL, bt_piece_get_idx(p));
+        }
+    }
+    break;
+    }
+}
+
+/**
+ * Called on the hasher's thread */
+static void __FUNC_piece_hashed(void* me_, void* job_udata, const char* hash)
+{
+    bt_job_validate_piece_t* v = job_udata;
+    bt_job_t j;
+
+    j.type = BT_JOB_PIECE_HASHED;
+    j.piece_hashed.peer = v->peer;
+    j.piece_hashed.piece_idx = v->piece_idx;
+    j.piece_hashed.queued_us = v->queued_us;
+    if ((j.piece_hashed.hashed = NULL != hash))
+        memcpy(j.piece_hashed.hash, hash, 20);
+    free(v);
+    __queue_job(me_, &j);
+}
+
+/**
+ * Hand the piece's data over to the hasher
+ * The disk layer isn't thread safe, so the data is read and copied here.
+ * @return 1 on success; otherwise 0 */
+static int __submit_to_hasher(bt_dm_private_t* me, bt_piece_t* p, bt_job_t* j)
+{
+    bt_job_validate_piece_t* v;
+    char *data, *copy;
+    int len = bt_piece_get_size(p);
+
+    if (!(data = bt_piece_get_data(p)))
+        return 0;
+
+    copy = malloc(len);
+    memcpy(copy, data, len);
+    v = malloc(sizeof(bt_job_validate_piece_t));
+    memcpy(v, &j->validate_piece, sizeof(bt_job_validate_piece_t));
+
+    if (0 == me->hasher.submit(me->hasher_udata, me, __FUNC_piece_hashed,
+                               copy, len, v))
+    {
+        free(copy);
+        free(v);
+        return 0;
+    }
+
+    me->nhashing += 1;
+    return 1;
+}
+
+/**
+ * @return 1 if pieces are hashed off this thread; 0 if validating inline */
+static int __have_hasher(bt_dm_private_t* me)
+{
+    if (!me->hasher.submit && !me->hashpool &&
+        0 < __cfg(me)->validation_threads &&
+        (me->hashpool = bt_hashpool_new(__cfg(me)->validation_threads, me,
+                                        __FUNC_piece_hashed)))
+    {
+        memcpy(&me->hasher, bt_hashpool_get_hasher(me->hashpool),
+               sizeof(bt_hasher_i));
+        me->hasher_udata = me->hashpool;
+    }
+    return NULL != me->hasher.submit;
+}
+
+/**
+ * @return number of pieces the startup check keeps with the hasher */
+static int __hasher_depth(bt_dm_private_t* me)
+{
+    if (me->hasher.get_depth)
+        return me->hasher.get_depth(me->hasher_udata);
+    return 2;
+}
+
+void bt_dm_set_hasher(bt_dm_t* me_, bt_hasher_i* ih, void* udata)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    if (ih)
+        memcpy(&me->hasher, ih, sizeof(bt_hasher_i));
+    else if (me->hashpool)
+        memcpy(&me->hasher, bt_hashpool_get_hasher(me->hashpool),
+               sizeof(bt_hasher_i));
+    else
+        memset(&me->hasher, 0, sizeof(bt_hasher_i));
+    me->hasher_udata = ih ? udata : me->hashpool;
+}
+
+/**
+ * A piece has been checked as part of bt_dm_check_pieces */
+static void __check_progress(bt_dm_private_t* me)
+{
+    me->check_done += 1;
+    if (me->cb.check_progress)
+        me->cb.check_progress(me->cb_ctx, me->check_done, me->check_end);
+}
+
+static void __job_dispatch_validate_piece(bt_dm_private_t* me, bt_job_t* j)
+{
+    bt_piece_t *p = me->ipdb.get_piece(me->pdb, j->validate_piece.piece_idx);
+
+    /* validating a piece with a running hash is cheap. Hashers only do
+     * SHA1, so v2 pieces are validated here */
+    if (__have_hasher(me) && !bt_piece_is_hashed(p) &&
+        !bt_piece_get_root(p) && __submit_to_hasher(me, p, j))
+        return;
+
+    __handle_validation(me, p, bt_piece_validate(p));
+
+    /* only the startup check validates without a peer */
+    if (!j->validate_piece.peer)
+        __check_progress(me);
+    else
+        bt_histogram_add(&me->validate_us,
+                         __now_us(me) - j->validate_piece.queued_us);
+}
+
+/**
+ * A piece that the resume record gave some blocks of can't be complete, and
+ * failing validation would throw the blocks away
+ * @return 1 if the piece is partly downloaded */
+static int __is_partial(bt_piece_t* p)
+{
+    return 0 < bt_piece_get_block_progress(p, NULL) &&
+           !bt_piece_is_downloaded(p);
+}
+
+/**
+ * Read the next pieces to be checked and hand them to the hasher
+ * Pieces are read in order so the disk sees sequential reads. The number of
+ * pieces in flight is capped, which bounds memory and lets the next read
+ * overlap with hashing of the previous pieces. */
+static void __check_step(bt_dm_private_t* me)
+{
+    int window = __hasher_depth(me);
+
+    while (me->check_next < me->check_end && me->nhashing < window)
+    {
+        bt_piece_t* p = me->ipdb.get_piece(me->pdb, me->check_next);
+        bt_job_t j;
+
+        j.type = BT_JOB_VALIDATE_PIECE;
+        j.validate_piece.peer = NULL;
+        j.validate_piece.piece_idx = me->check_next;
+        j.validate_piece.queued_us = __now_us(me);
+        me->check_next += 1;
+
+        if (!p || __is_partial(p))
+            __check_progress(me);
+        else if (bt_piece_is_complete(p))
+        {
+            __mark_completed(me, bt_piece_get_idx(p));
+            __check_progress(me);
+        }
+        else
+            __job_dispatch_validate_piece(me, &j);
+    }
+}
+
+/**
+ * Pieces the check has already counted, as partial or complete, are passed
+ * over */
+static void __job_dispatch_check_range(bt_dm_private_t* me, bt_job_t* j)
+{
+    int i;
+
+    for (i = j->check_range.first; i < j->check_range.end; i++)
+    {
+        bt_piece_t* p = me->ipdb.get_piece(me->pdb, i);
+        bt_job_t v;
+
+        if (!p || __is_partial(p) || bt_piece_is_complete(p))
+            continue;
+
+        v.type = BT_JOB_VALIDATE_PIECE;
+        v.validate_piece.peer = NULL;
+        v.validate_piece.piece_idx = i;
+        v.validate_piece.queued_us = __now_us(me);
+        __job_dispatch_validate_piece(me, &v);
+    }
+}
+
+static void __job_dispatch_piece_hashed(bt_dm_private_t* me, bt_job_t* j)
+{
+    bt_piece_t *p = me->ipdb.get_piece(me->pdb, j->piece_hashed.piece_idx);
+
+    me->nhashing -= 1;
+
+    /* the hasher gave up; the piece can still be hashed here */
+    if (!j->piece_hashed.hashed)
+        __handle_validation(me, p, bt_piece_validate(p));
+    else
+        __handle_validation(me, p,
+                            bt_piece_validate_hash(p, j->piece_hashed.hash));
+
+    if (!j->piece_hashed.peer)
+    {
+        __check_progress(me);
+        __check_step(me);
+    }
+    else
+        bt_histogram_add(&me->validate_us,
+                         __now_us(me) - j->piece_hashed.queued_us);
+}
+
+static void __job_dispatch_block_written(bt_dm_private_t* me, bt_job_t* j)
+{
+    bt_block_t* b = &j->block_written.blk;
+    bt_piece_t *p;
+
+    if (j->block_written.ok)
+        return;
+
+    __log(me, NULL, "disk,write failed,pieceidx=%d offset=%d len=%d",
+          b->piece_idx, b->offset, b->len);
+
+    if (!(p = me->ipdb.get_piece(me->pdb, b->piece_idx)))
+        return;
+
+    /* peers have been told we have it; there's no taking that back */
+    if (bt_piece_is_complete(p))
+        return;
+
+    bt_piece_drop_download_progress(p);
+    __giveback_piece(me, NULL, b->piece_idx);
+}
+
+static void __dispatch_job(bt_dm_private_t* me, bt_job_t* j)
+{
+    assert(j);
+
+    switch (j->type)
+    {
+    case BT_JOB_POLLBLOCK:
+        __job_dispatch_poll_piece(me, j);
+        /* the blocks it got are requested on the next service */
+        if (j->pollblock.peer->pc &&
+            0 < pwp_conn_get_nqueued_requests(j->pollblock.peer->pc))
+            __mark_ready(me, j->pollblock.peer);
+        break;
+    case BT_JOB_VALIDATE_PIECE: __job_dispatch_validate_piece(me, j); break;
+    case BT_JOB_CHECK_RANGE: __job_dispatch_check_range(me, j); break;
+    case BT_JOB_PIECE_HASHED: __job_dispatch_piece_hashed(me, j); break;
+    case BT_JOB_BLOCK_WRITTEN: __job_dispatch_block_written(me, j); break;
+    default: assert(0); break;
+    }
+}
+
+static void* __call_exclusively(void* me_, void** lock, void *j,
+                                void* (*func)(void *me_, void* j_))
+{
+    bt_dm_private_t *me = me_;
+
+    assert(func);
+
+    if (me->cb.call_exclusively)
+        return me->cb.call_exclusively(me_, me->cb_ctx, lock, j, func);
+    else
+    {
+        void* r;
+
+        pthread_mutex_lock(&me->exclusive_lock);
+        r = func(me_, j);
+        pthread_mutex_unlock(&me->exclusive_lock);
+        return r;
+    }
+}
+
+static void __dispatch_ring_job(void* me, void* j)
+{
+    __dispatch_job(me, j);
+}
+
+/**
+ * Queue job without taking the job lock, unless the ring is full */
+static void __queue_job(bt_dm_private_t* me, bt_job_t* j)
+{
+    if (!bt_ring_offer(me->jobring, j))
+        __call_exclusively(me, &me->job_lock, j, __offer_job);
+}
+
+/**
+ * Called from within the disk's submit */
+static void __FUNC_block_written(void* me_, const bt_block_t* blk, int ok)
+{
+    bt_job_t j;
+
+    j.type = BT_JOB_BLOCK_WRITTEN;
+    j.block_written.blk = *blk;
+    j.block_written.ok = ok;
+    __queue_job(me_, &j);
+}
+
+static int __FUNC_peerconn_pollblocks(void *me_, void* peer, int max)
+{
+    bt_dm_private_t *me = me_;
+    bt_job_t j;
+
+    j.type = BT_JOB_POLLBLOCK;
+    j.pollblock.peer = peer;
+    j.pollblock.max = max;
+    __queue_job(me, &j);
+    return 0;
+}
+
+/**
+ * Received a block from a peer
+ * @param peer Peer received from
+ * @param data Data to be pushed */
+int __FUNC_peerconn_pushblock(
+    void *me_,
+    void* pr,
+    bt_block_t *b,
+    const void *data)
+{
+    bt_peer_t *peer = pr;
+    bt_dm_private_t *me = me_;
+    int ms;
+
+    assert(me->ipdb.get_piece);
+
+    peer->downloaded += b->len;
+    if (me->session && !peer->local)
+        bt_session_spend_download(me->session, b->len);
+
+    if (peer->pc && 0 <= (ms = pwp_conn_get_last_block_latency(peer->pc)))
+        bt_histogram_add(&me->block_ms, ms);
+
+    bt_piece_t *p = me->ipdb.get_piece(me->pdb, b->piece_idx);
+
+    /* another peer beat this one to it */
+    if (bt_piece_have_block(p, b))
+    {
+        me->duplicate_bytes += b->len;
+        BT_TRACE(BT_TRACE_PIECE, BT_TRACE_BLOCK_DUPLICATE, peer,
+                 b->piece_idx, b->offset, b->len);
+        return 1;
+    }
+
+    __endgame_cancel(me, peer, b);
+
+    switch (bt_piece_write_block(p, NULL, b, data, peer))
+    {
+    case BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED:
+    {
+        bt_job_t j;
+        j.type = BT_JOB_VALIDATE_PIECE;
+        j.validate_piece.peer = peer;
+        j.validate_piece.piece_idx = b->piece_idx;
+        j.validate_piece.queued_us = __now_us(me);
+        __queue_job(me, &j);
+    }
+    break;
+    case BT_PIECE_WRITE_BLOCK_SUCCESS: break;
+    case BT_PIECE_WRITE_BLOCK_INVALID:
+        /* the v2 leaf says it's bad; nobody else is to blame */
+        me->hash_failure_bytes += b->len;
+        __log(me, NULL, "client,sent bad block,pieceidx=%d,%s:%d",
+              b->piece_idx, peer->ip, peer->port);
+        bt_piece_giveback_block(p, b);
+        __giveback_piece(me, peer, b->piece_idx);
+        __blacklist_peer(me, p, peer);
+        break;
+    case 0:
+        printf("error writing block\n");
+        break;
+    }
+
+    return 1;
+}
+
+void __FUNC_peerconn_log(void *me_, void *src_peer, const char *buf, ...)
+{
+    bt_peer_t *peer = src_peer;
+    char buffer[1000];
+
+    sprintf(buffer, "pwp,%s,%s", peer->peer_id, buf);
+    __log(me_, NULL, buffer);
+}
+
+int __FUNC_peerconn_disconnect(void *me_, void* pr, char *reason)
+{
+    bt_dm_private_t *me = me_;
+    bt_peer_t * peer = pr;
+
+    __log(me_, NULL, "disconnecting,%s", reason);
+
+    /* other shards are walking the peers; reaped on the next BT_REAP_MS */
+    if (me->in_shards)
+    {
+        pwp_conn_set_state(peer->pc, PC_FAILED_CONNECTION);
+        return 1;
+    }
+
+    bt_dm_remove_peer(me_, peer);
+    return 1;
+}
+
+static void __FUNC_peerconn_peer_have_piece(void* bt, void* peer, int idx)
+{
+    bt_dm_private_t *me = bt;
+
+    me->ips.peer_have_piece(me->pselector, peer, idx);
+    if (me->super_avail)
+        __super_have(me, peer, idx);
+}
+
+static void __FUNC_peerconn_peer_have_bitfield(void* bt, void* peer,
+                                               const uint64_t* words,
+                                               int npieces)
+{
+    bt_dm_private_t *me = bt;
+    bt_peer_t* p = peer;
+    int i;
+
+    /* the peer had what we revealed before it told us */
+    if (p->super_seeded && 0 <= p->super_piece &&
+        pwp_conn_peer_has_piece(p->pc, p->super_piece))
+        __super_reveal(me, p);
+
+    if (me->ips.peer_have_bitfield)
+    {
+        me->ips.peer_have_bitfield(me->pselector, peer, words, npieces);
+        return;
+    }
+
+    for (i = 0; i < (npieces + 63) / 64; i++)
+    {
+        uint64_t w;
+
+        for (w = words[i]; w; w &= w - 1)
+            me->ips.peer_have_piece(me->pselector, peer,
+                                    i * 64 + __builtin_ctzll(w));
+    }
+}
+
+/**
+ * A peer told us about other peers; those we don't know become
+ * candidates. Dropped peers are left be, since they may only have dropped
+ * the peer that told us */
+static void __FUNC_peerconn_peer_exchange(void* bt, void* peer,
+                                          const unsigned char* added,
+                                          int nadded,
+                                          const unsigned char* dropped,
+                                          int ndropped)
+{
+    bt_dm_private_t *me = bt;
+    /* room for any IPv6 address as text */
+    char ip[64];
+    int i, port;
+
+    if (!__cfg(me)->peer_exchange)
+        return;
+
+    for (i = 0; i < nadded; i++)
+    {
+        const unsigned char* a = added + i * PWP_PEX_ADDR_LEN;
+
+        /* the binary key is checked before any text is made */
+        if (bt_peermanager_contains_addr(me->pm, a))
+            continue;
+        if (0 == (port = bt_addr_unpack(a, ip, sizeof(ip))))
+            continue;
+        bt_dm_add_peer((bt_dm_t*)me, NULL, 0, ip, strlen(ip), port, NULL,
+                       NULL);
+    }
+}
+
+static void __FUNC_peerconn_giveback_block(void* bt, void* peer, bt_block_t* b)
+{
+    bt_dm_private_t *me = bt;
+
+    void* pce = me->ipdb.get_piece(me->pdb, b->piece_idx);
+
+    __endgame_forget_block(me, peer, b);
+    bt_piece_giveback_block(pce, b);
+    __giveback_piece(me, peer, b->piece_idx);
+}
+
+static int __FUNC_peerconn_sendv(void *me_,
+                                 const void* pc_peer,
+                                 const bt_iovec_t *iov,
+                                 const int iovcnt)
+{
+    const bt_peer_t * peer = pc_peer;
+    bt_dm_private_t *me = me_;
+
+    assert(peer);
+    assert(me->cb.peer_sendv);
+    return me->cb.peer_sendv(me, &me->cb_ctx, peer->conn_ctx, iov, iovcnt);
+}
+
+static const void* __FUNC_peerconn_get_block_data(void* cb_ctx,
+                                                  const bt_block_t * blk)
+{
+    bt_dm_private_t *me = cb_ctx;
+    void* p;
+
+    /* without sendv the block is copied into the message */
+    if (!me->cb.peer_sendv)
+        return NULL;
+
+    if (!(p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+        return NULL;
+
+    return bt_piece_read_block(p, me, blk);
+}
+
+static int __FUNC_peerconn_send_block_from_file(void* cb_ctx,
+                                                const void* pc_peer,
+                                                const void* hdr,
+                                                const int hdr_len,
+                                                const bt_block_t * blk)
+{
+    bt_dm_private_t *me = cb_ctx;
+    const bt_peer_t * peer = pc_peer;
+    unsigned long long offset;
+    void* p;
+    int fd;
+
+    if (!me->cb.peer_sendfile)
+        return 0;
+
+    if (!(p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+        return 0;
+
+    if (0 == bt_piece_get_block_file(p, blk, &fd, &offset))
+        return 0;
+
+    if (0 == me->cb.peer_sendfile(me, &me->cb_ctx, peer->conn_ctx,
+                                  hdr, hdr_len, fd, offset, blk->len))
+        return -1;
+
+    return 1;
+}
+
+static void __FUNC_peerconn_prefetch_block(void* cb_ctx,
+                                           const bt_block_t * blk)
+{
+    bt_dm_private_t *me = cb_ctx;
+    void* p;
+
+    if ((p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+        bt_piece_prefetch_block(p, blk);
+}
+
+static unsigned int __FUNC_peerconn_get_time_ms(void* cb_ctx)
+{
+    return (unsigned int)__now_ms(cb_ctx);
+}
+
+static void __FUNC_peerconn_write_block_to_stream(void* cb_ctx,
+                                                  bt_block_t * blk,
+                                                  char **msg)
+{
+    bt_dm_private_t *me = cb_ctx;
+    void* p;
+
+    if (!(p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+    {
+        __log(me, NULL, "ERROR,unable to obtain piece");
+        return;
+    }
+
+    if (0 == bt_piece_write_block_to_stream(p, blk, msg))
+        __log(me, NULL, "ERROR,unable to write block to stream");
+}
+
+/**
+ * @return 1 if this is the address we listen on */
+static int __is_my_addr(bt_dm_private_t* me, const char *ip, const int ip_len,
+                        const int port)
+{
+    bt_dm_settings_t* s = __cfg(me);
+    unsigned char addr[BT_PEER_ADDR_LEN];
+
+    if (port != s->pwp_listen_port)
+        return 0;
+
+    if (s->my_addr_ok && bt_addr_pack(addr, ip, ip_len, port))
+        return !memcmp(addr, s->my_addr, BT_PEER_ADDR_LEN);
+
+    return s->my_ip && ip_len == (int)strlen(s->my_ip) &&
+        !strncmp(ip, s->my_ip, ip_len);
+}
+
+/**
+ * @return 1 if the peer's host has been banned */
+static int __addr_is_banned(bt_dm_private_t* me, const char *ip,
+                            const int ip_len, const int port)
+{
+    unsigned char addr[BT_PEER_ADDR_LEN];
+
+    if (0 == bt_blacklist_get_nbanned(me->blacklist))
+        return 0;
+
+    return bt_addr_pack(addr, ip, ip_len, port) &&
+        bt_blacklist_addr_is_banned(me->blacklist, addr);
+}
+
+/**
+ * Start connecting to the peer
+ * @return 1 if the network layer took the connect; otherwise 0 */
+static int __connect_peer(bt_dm_private_t* me, bt_peer_t* p)
+{
+    if (0 == me->cb.peer_connect(me,
+                                 &me->cb_ctx,
+                                 &p->conn_ctx,
+                                 p->ip,
+                                 p->port,
+                                 bt_dm_dispatch_from_buffer,
+                                 bt_dm_peer_connect,
+                                 bt_dm_peer_connect_fail))
+    {
+        __log(me, NULL, "failed connection to peer");
+        bt_peerhistory_connect_failed(me->history, p->ip, strlen(p->ip),
+                                      p->port, __now_ms(me));
+        return 0;
+    }
+
+    /* the network layer has given us the peer's conn_ctx */
+    bt_peermanager_set_conn_ctx(me->pm, p, p->conn_ctx);
+    p->half_open = 1;
+    me->nhalf_open++;
+    return 1;
+}
+
+static void __remove_candidate(bt_dm_private_t* me, bt_peer_t* p)
+{
+    int i;
+
+    if (!p->candidate)
+        return;
+
+    for (i = 0; i < me->ncandidates; i++)
+        if (me->candidates[i] == p)
+            break;
+    if (i == me->ncandidates)
+        return;
+    memmove(&me->candidates[i], &me->candidates[i + 1],
+            (me->ncandidates - i - 1) * sizeof(bt_peer_t*));
+    me->ncandidates--;
+    p->candidate = 0;
+}
+
+static void __queue_candidate(bt_dm_private_t* me, bt_peer_t* p)
+{
+    if (me->candidates_size <= me->ncandidates)
+    {
+        me->candidates_size = me->candidates_size * 2 + 8;
+        me->candidates = realloc(me->candidates,
+                                 me->candidates_size * sizeof(bt_peer_t*));
+    }
+    me->candidates[me->ncandidates++] = p;
+    p->candidate = 1;
+}
+
+/**
+ * @return the local candidate, or failing that the candidate, that has
+ *  been best to us before; the oldest wins ties */
+static bt_peer_t* __best_candidate(bt_dm_private_t* me)
+{
+    unsigned int best = 0, score;
+    bt_peer_t* p = NULL;
+    int i;
+
+    for (i = 0; i < me->ncandidates; i++)
+    {
+        bt_peer_t* c = me->candidates[i];
+
+        score = bt_peerhistory_score(me->history, c->ip, strlen(c->ip),
+                                     c->port);
+        if (!p || (c->local && !p->local) ||
+            (c->local == p->local && best < score))
+        {
+            p = c;
+            best = score;
+        }
+    }
+    return p;
+}
+
+/**
+ * Connect to the best candidates, for as long as the half open, rate and
+ * connection limits let us */
+static void __admit_peers(bt_dm_private_t* me)
+{
+    bt_dm_settings_t* s = __cfg(me);
+    unsigned long long now = __now_ms(me);
+
+    /* at most a second's worth of connects is banked */
+    me->connect_credit += (long long)s->max_connects_per_sec *
+        (now - me->connect_ms);
+    if ((long long)s->max_connects_per_sec * 1000 < me->connect_credit)
+        me->connect_credit = (long long)s->max_connects_per_sec * 1000;
+    me->connect_ms = now;
+
+    while (0 < me->ncandidates &&
+           me->nhalf_open < s->max_half_open &&
+           1000 <= me->connect_credit &&
+           __may_open_connection(me))
+    {
+        bt_peer_t* p = __best_candidate(me);
+
+        __remove_candidate(me, p);
+        __session_sync(me);
+        me->connect_credit -= 1000;
+
+        /* reaped on the next BT_REAP_MS */
+        if (0 == __connect_peer(me, p))
+            pwp_conn_set_state(p->pc, PC_FAILED_CONNECTION);
+    }
+}
+
+static void __FUNC_peer_reap_failed(void* cb_ctx, void* peer, void* udata)
+{
+    bt_peer_t* p = peer;
+
+    if (p->pc && pwp_conn_flag_is_set(p->pc, PC_FAILED_CONNECTION))
+        bt_dm_remove_peer(cb_ctx, p);
+}
+
+/**
+ * Failed connects make room for candidates */
+static void __reap_peers(void *me_)
+{
+    bt_dm_private_t *me = me_;
+
+    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_reap_failed);
+    bt_timerwheel_add(me->wheel, BT_REAP_MS, me, __reap_peers);
+}
+
+typedef struct
+{
+    bt_peer_t* worst;
+    int rate;
+    unsigned long long before;
+} __worst_peer_t;
+
+static void __FUNC_peer_find_worst(void* cb_ctx, void* peer, void* udata)
+{
+    bt_dm_private_t *me = cb_ctx;
+    __worst_peer_t* w = udata;
+    bt_peer_t* p = peer;
+    int rate;
+
+    /* newcomers get a full round to show what they can do, and local
+     * peers are worth keeping whatever they send */
+    if (!__peer_is_active(p) || w->before < p->connected_ms || p->local)
+        return;
+
+    rate = me->am_seeding ? pwp_conn_get_upload_rate(p->pc) :
+        pwp_conn_get_download_rate(p->pc);
+    if (!w->worst || rate < w->rate)
+    {
+        w->worst = p;
+        w->rate = rate;
+    }
+}
+
+/**
+ * When candidates are held back by max_peer_connections, drop the peer
+ * that's sending (or while seeding, taking) the least to make room */
+static void __replace_worst_peer(void *me_)
+{
+    bt_dm_private_t *me = me_;
+    unsigned long long now = __now_ms(me);
+    __worst_peer_t w = { NULL, 0,
+                         BT_REPLACE_MS < now ? now - BT_REPLACE_MS : 0 };
+
+    if (0 < me->ncandidates &&
+        __cfg(me)->max_peer_connections <= __nconnections(me))
+    {
+        bt_peermanager_forall(me->pm, me, &w, __FUNC_peer_find_worst);
+        if (w.worst)
+        {
+            __log(me, NULL, "client,replacing peer,%s:%d,rate=%d",
+                  w.worst->ip, w.worst->port, w.rate);
+            if (me->cb.peer_disconnect)
+                me->cb.peer_disconnect(me, &me->cb_ctx, w.worst->conn_ctx);
+            bt_dm_remove_peer((void*)me, w.worst);
+            __admit_peers(me);
+        }
+    }
+
+    bt_timerwheel_add(me->wheel, BT_REPLACE_MS, me, __replace_worst_peer);
+}
+
+static void __FUNC_peer_memory(void* cb_ctx, void* peer, void* udata)
+{
+    bt_peer_t* p = peer;
+
+    *(unsigned long long*)udata += sizeof(bt_peer_t) +
+        (p->pc ? pwp_conn_get_memory(p->pc) : 0);
+}
+
+/**
+ * @return max_memory, or the session's share if that's less; 0 for none */
+static unsigned long long __memory_limit(bt_dm_private_t* me)
+{
+    unsigned long long max = __cfg(me)->max_memory;
+
+    if (!max || (me->memory_share && me->memory_share < max))
+        return me->memory_share;
+    return max;
+}
+
+int bt_dm_get_availability(bt_dm_t* me_, bt_availability_t* a)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    if (!me->pselector || !me->ips.get_availability)
+        return 0;
+    me->ips.get_availability(me->pselector, a);
+    return 1;
+}
+
+void bt_dm_get_memory(bt_dm_t* me_, bt_memory_stats_t* stats)
+{
+    bt_dm_private_t* me = (void*)me_;
+    int i;
+
+    memset(stats, 0, sizeof(bt_memory_stats_t));
+
+    if (me->disk && me->disk->get_memory)
+        stats->cache = me->disk->get_memory(me->disk_udata);
+
+    bt_peermanager_forall(me->pm, me, &stats->connections,
+                          __FUNC_peer_memory);
+
+    stats->pieces = me->shared_size * sizeof(int);
+    if (me->endgame_blocks)
+        stats->pieces += bt_hashmap_get_memory(me->endgame_blocks);
+    if (me->pdb && me->ipdb.get_piece)
+        for (i = 0; i < __cfg(me)->npieces; i++)
+        {
+            bt_piece_t* pce = me->ipdb.get_piece(me->pdb, i);
+
+            if (pce)
+                stats->pieces += bt_piece_get_memory(pce);
+        }
+
+    if (me->pselector && me->ips.get_memory)
+        stats->selector = me->ips.get_memory(me->pselector);
+
+    stats->total = stats->cache + stats->connections + stats->pieces +
+        stats->selector;
+    stats->limit = __memory_limit(me);
+}
+
+/**
+ * Over the cap, give the cache what the rest leaves. If that isn't enough
+ * halve the pipeline depth, and once that's down to one request drop the
+ * slowest peer. Depths are given back once we're well under */
+static void __check_memory(void *me_)
+{
+    bt_dm_private_t *me = me_;
+    bt_memory_stats_t* m = &me->memory;
+    unsigned long long was_limit = m->limit, rest;
+
+    bt_dm_get_memory((void*)me, m);
+
+    if (0 == m->limit)
+    {
+        /* the cap has been lifted */
+        if (was_limit && me->disk && me->disk->set_memory_limit)
+            me->disk->set_memory_limit(me->disk_udata, 0);
+        me->memory_max_pending = 0;
+        bt_timerwheel_add(me->wheel, BT_MEMORY_MS, me, __check_memory);
+        return;
+    }
+
+    if (me->disk && me->disk->set_memory_limit)
+    {
+        rest = m->total - m->cache;
+
+        /* 0 would lift the cache's limit */
+        me->disk->set_memory_limit(me->disk_udata,
+                                   rest < m->limit ? m->limit - rest : 1);
+        if (me->disk->get_memory)
+            m->cache = me->disk->get_memory(me->disk_udata);
+        m->total = rest + m->cache;
+    }
+
+    if (m->limit < m->total)
+    {
+        if (me->memory_max_pending != 1)
+        {
+            int n = me->memory_max_pending ? me->memory_max_pending :
+                __cfg(me)->max_pending_requests;
+
+            me->memory_max_pending = 1 < n / 2 ? n / 2 : 1;
+            __log(me, NULL, "client,memory,%llu over %llu,max pending=%d",
+                  m->total, m->limit, me->memory_max_pending);
+        }
+        else
+        {
+            __worst_peer_t w = { NULL, 0, ~0ULL };
+
+            bt_peermanager_forall(me->pm, me, &w, __FUNC_peer_find_worst);
+            if (w.worst)
+            {
+                __log(me, NULL, "client,memory,%llu over %llu,dropping %s:%d",
+                      m->total, m->limit, w.worst->ip, w.worst->port);
+                if (me->cb.peer_disconnect)
+                    me->cb.peer_disconnect(me, &me->cb_ctx,
+                                           w.worst->conn_ctx);
+                bt_dm_remove_peer((void*)me, w.worst);
+            }
+        }
+    }
+    else if (me->memory_max_pending && m->total < m->limit / 10 * 9)
+    {
+        me->memory_max_pending *= 2;
+        if (__cfg(me)->max_pending_requests <= me->memory_max_pending)
+            me->memory_max_pending = 0;
+    }
+
+    bt_timerwheel_add(me->wheel, BT_MEMORY_MS, me, __check_memory);
+}
+
+void bt_dm_set_memory_share(bt_dm_t* me_, unsigned long long bytes)
+{
+    ((bt_dm_private_t*)me_)->memory_share = bytes;
+}
+
+void *bt_dm_add_peer(bt_dm_t* me_,
+                     const char *peer_id,
+                     const int peer_id_len,
+                     const char *ip, const int ip_len, const int port,
+                     void* conn_ctx,
+                     void* conn_mem)
+{
+    bt_dm_private_t *me = (void*)me_;
+    bt_peer_t* p;
+
+    /*  ensure we aren't adding ourselves as a peer */
+    if (__is_my_addr(me, ip, ip_len, port))
+        return NULL;
+
+    /* it has sent us too many bad pieces */
+    if (__addr_is_banned(me, ip, ip_len, port))
+    {
+        __log(me, NULL, "client,refused banned peer,%.*s:%d",
+              ip_len, ip, port);
+        return NULL;
+    }
+
+    /* we'd rather not run out of file descriptors */
+    if (conn_ctx && !__may_open_connection(me))
+        return NULL;
+
+    /* don't redial peers that have just failed us */
+    if (!conn_ctx && me->cb.peer_connect &&
+        !bt_peerhistory_may_connect(me->history, ip, ip_len, port,
+                                    __now_ms(me)))
+    {
+        __log(me, NULL, "client,backing off,%.*s:%d", ip_len, ip, port);
+        return NULL;
+    }
+
+    /* remember the peer */
+    if (!(p = bt_peermanager_add_peer(me->pm, peer_id, peer_id_len,
+                                      ip, ip_len, port)))
+    {
+#if 0   /* debug */
+        fprintf(stderr, "cant add %s:%d, it's been added already\n", ip, port);
+#endif
+        return NULL;
+    }
+
+    if (me->pselector)
+        me->ips.add_peer(me->pselector, p);
+
+    if (conn_ctx)
+    {
+        bt_peermanager_set_conn_ctx(me->pm, p, conn_ctx);
+        p->incoming = 1;
+    }
+
+    void* pc = pwp_conn_new(conn_mem);
+    bt_peermanager_set_pc(me->pm, p, pc);
+    pwp_conn_set_cbs(pc,
+                     &((pwp_conn_cbs_t) {
+                           .log = __FUNC_peerconn_log,
+                           .trace = __FUNC_peerconn_trace,
+                           .send = __FUNC_peerconn_send_to_peer,
+                           .sendv = __FUNC_peerconn_sendv,
+                           .get_block_data = __FUNC_peerconn_get_block_data,
+                           .send_block_from_file =
+                               __FUNC_peerconn_send_block_from_file,
+                           .prefetch_block = __FUNC_peerconn_prefetch_block,
+                           .get_time_ms = __FUNC_peerconn_get_time_ms,
+                           .pushblock = __FUNC_peerconn_pushblock,
+                           .pollblocks = __FUNC_peerconn_pollblocks,
+                           .disconnect = __FUNC_peerconn_disconnect,
+                           .peer_have_piece =
+                               __FUNC_peerconn_peer_have_piece,
+                           .peer_have_bitfield =
+                               __FUNC_peerconn_peer_have_bitfield,
+                           .peer_giveback_block =
+                               __FUNC_peerconn_giveback_block,
+                           .write_block_to_stream =
+                               __FUNC_peerconn_write_block_to_stream,
+                           .peer_exchange = __FUNC_peerconn_peer_exchange,
+                           .call_exclusively = me->cb.call_exclusively
+                       }), me);
+    pwp_conn_set_progress(pc, me->pieces_completed);
+    pwp_conn_set_piece_info(pc,
+                            __cfg(me)->npieces,
+                            __cfg(me)->piece_length);
+    if (me->pselector && me->ips.peer_share_pieces)
+        me->ips.peer_share_pieces(me->pselector, p,
+                                  pwp_conn_get_peer_pieces(pc),
+                                  __cfg(me)->npieces);
+    pwp_conn_set_peer(pc, p);
+    if (me->am_seeding)
+        pwp_conn_set_seed_mode(pc);
+
+    __log(me, NULL, "added peer %.*s:%d 0x%lx",
+          ip_len, ip, port, (unsigned long)pc);
+    BT_TRACE(BT_TRACE_PEER, BT_TRACE_PEER_ADDED, p, 0, 0, 0);
+
+    if (me->cb.handshaker_new)
+        p->mh = me->cb.handshaker_new(
+            __cfg(me)->infohash,
+            __cfg(me)->my_peerid);
+
+    bt_leeching_choker_add_peer(me->lchoke, p->pc);
+    bt_seeding_choker_add_peer(me->schoke, p->pc);
+
+    if (conn_ctx)
+    {
+        p->connected_ms = p->heard_ms = __now_ms(me);
+        bt_peerhistory_connected(me->history, p->ip, strlen(p->ip), p->port,
+                                 p->connected_ms);
+    }
+    else if (me->cb.peer_connect)
+    {
+        __queue_candidate(me, p);
+        __admit_peers(me);
+
+        if (pwp_conn_flag_is_set(p->pc, PC_FAILED_CONNECTION))
+            return NULL;
+    }
+
+    __session_sync(me);
+    return p;
+}
+
+void bt_dm_set_peer_local(bt_dm_t* me_, void* peer)
+{
+    bt_dm_private_t *me = (void*)me_;
+    bt_peer_t* p = peer;
+
+    if (p->local)
+        return;
+    p->local = 1;
+    __log(me, NULL, "client,local peer,%s:%d", p->ip, p->port);
+}
+
+/**
+ * Release the connection once it's no longer on the stack */
+static void __release_later(bt_dm_private_t* me, void* pc)
+{
+    if (me->nreleased == me->released_size)
+    {
+        me->released_size = me->released_size ? me->released_size * 2 : 8;
+        me->released = realloc(me->released,
+                               me->released_size * sizeof(void*));
+    }
+    me->released[me->nreleased++] = pc;
+}
+
+static void __release_conns(bt_dm_private_t* me)
+{
+    while (0 < me->nreleased)
+        pwp_conn_release(me->released[--me->nreleased]);
+}
+
+int bt_dm_remove_peer(bt_dm_t* me_, void* pr)
+{
+    bt_dm_private_t* me = (void*)me_;
+    bt_peer_t* peer = pr;
+    void* pc = peer->pc;
+
+    BT_TRACE(BT_TRACE_PEER, BT_TRACE_PEER_REMOVED, peer, 0, 0, 0);
+    __remove_candidate(me, peer);
+    __unmark_ready(me, peer);
+    __clear_half_open(me, peer);
+    bt_blacklist_remove_peer(me->blacklist, peer);
+
+    if (peer->connected_ms)
+        bt_peerhistory_disconnected(me->history, peer->ip, strlen(peer->ip),
+                                    peer->port,
+                                    peer->downloaded, peer->uploaded,
+                                    peer->pc ?
+                                    pwp_conn_get_download_rate(peer->pc) : 0,
+                                    __now_ms(me));
+
+    /* a block half way in won't be finished */
+    if (__peer_has_pwp_msghandler(me, peer))
+        pwp_msghandler_drop_frame(peer->mh);
+    __recvbuf_return(me, peer);
+
+    /* the selector may be reading the connection's pieces */
+    me->ips.remove_peer(me->pselector, peer);
+    __endgame_forget_peer(me, peer);
+
+    /* the chokers would otherwise ask a released connection for its rates */
+    if (peer->pc)
+    {
+        bt_leeching_choker_remove_peer(me->lchoke, peer->pc);
+        bt_seeding_choker_remove_peer(me->schoke, peer->pc);
+    }
+
+    if (0 == bt_peermanager_remove_peer(me->pm, peer))
+    {
+        __log(me_, NULL, "ERROR,couldn't remove peer");
+        return 0;
+    }
+
+    if (pc)
+        __release_later(me, pc);
+    __session_sync(me);
+    return 1;
+}
+
+/**
+ * @return path of the resume record; NULL if resuming is disabled */
+static char* __resume_path(bt_dm_private_t* me)
+{
+    return __cfg(me)->resume_path;
+}
+
+static void __resume_save(bt_dm_private_t* me)
+{
+    /* don't clobber a record we haven't read yet */
+    if (!me->ipdb.get_piece || !me->resume_loaded)
+        return;
+
+    if (0 == bt_resume_save(me->resume, __resume_path(me),
+                            __cfg(me)->infohash,
+                            &me->ipdb, me->pdb,
+                            __cfg(me)->npieces,
+                            __cfg(me)->piece_length))
+        __log(me, NULL, "client,resume record not saved,path=%s",
+              __resume_path(me));
+
+    me->resume_saved = __now_ms(me);
+}
+
+void* bt_dm_get_resume(bt_dm_t* me_)
+{
+    bt_dm_private_t *me = (void*)me_;
+
+    return me->resume;
+}
+
+int bt_dm_get_jobs(bt_dm_t* me_)
+{
+    bt_dm_private_t *me = (void*)me_;
+
+    return bt_ring_count(me->jobring) +
+           __atomic_load_n(&me->njobs, __ATOMIC_ACQUIRE) +
+           me->nhashing + me->check_end - me->check_next;
+}
+
+/**
+ * Top up a token bucket. At most a second's worth of bytes is banked */
+static int __refill(int tokens, int rate, unsigned long long ms)
+{
+    long long t = tokens + (long long)rate * ms / 1000;
+    int burst = rate < (BT_BLOCK_SIZE) ? (BT_BLOCK_SIZE) : rate;
+
+    return burst < t ? burst : (int)t;
+}
+
+static void __FUNC_peer_refill(void* cb_ctx, void* peer, void* udata)
+{
+    bt_dm_private_t* me = cb_ctx;
+    bt_peer_t* p = peer;
+    unsigned long long* ms = udata;
+
+    if (__cfg(me)->max_peer_upload_rate)
+        p->upload_tokens = __refill(p->upload_tokens,
+                                    __cfg(me)->max_peer_upload_rate, *ms);
+    if (__cfg(me)->max_peer_download_rate)
+        p->download_tokens = __refill(p->download_tokens,
+                                      __cfg(me)->max_peer_download_rate, *ms);
+}
+
+/**
+ * Top up the torrent's token buckets, and the peers' if they're limited */
+static void __refill_tokens(bt_dm_private_t* me)
+{
+    unsigned long long now = __now_ms(me), ms;
+
+    ms = now - me->refill_ms;
+    if (1000 < ms)
+        ms = 1000;
+    me->refill_ms = now;
+
+    if (__cfg(me)->max_upload_rate)
+        me->upload_tokens = __refill(me->upload_tokens,
+                                     __cfg(me)->max_upload_rate, ms);
+    if (__cfg(me)->max_download_rate)
+        me->download_tokens = __refill(me->download_tokens,
+                                       __cfg(me)->max_download_rate, ms);
+    if (__cfg(me)->max_local_upload_rate)
+        me->local_upload_tokens = __refill(me->local_upload_tokens,
+                                           __cfg(me)->max_local_upload_rate,
+                                           ms);
+    if (__cfg(me)->max_local_download_rate)
+        me->local_download_tokens =
+            __refill(me->local_download_tokens,
+                     __cfg(me)->max_local_download_rate, ms);
+    if (__cfg(me)->max_peer_upload_rate || __cfg(me)->max_peer_download_rate)
+    {
+        int i;
+
+        bt_peermanager_forall(me->pm, me, &ms, __FUNC_peer_refill);
+        for (i = 0; i < me->nwebseeds; i++)
+            __FUNC_peer_refill(me, me->webseeds[i]->peer, &ms);
+    }
+}
+
+static void __FUNC_peer_add_uploader(void* cb_ctx, void* peer, void* udata)
+{
+    bt_dm_private_t* me = cb_ctx;
+    bt_peer_t* p = peer;
+
+    p->upload_deferred = 0;
+
+    if (!__peer_is_active(p))
+        return;
+
+    if (0 == pwp_conn_get_npending_peer_requests(p->pc))
+        return;
+
+    if (me->uploaders_size <= me->nuploaders)
+    {
+        me->uploaders_size = me->uploaders_size * 2 + 8;
+        me->uploaders = realloc(me->uploaders,
+                                me->uploaders_size * sizeof(bt_peer_t*));
+    }
+    me->uploaders[me->nuploaders++] = p;
+}
+
+/**
+ * Backpressure from the network. A peer above send_high_watermark gets no
+ * more PIECE messages until its queue drains to send_low_watermark
+ * @return 1 if a PIECE message may be queued for the peer */
+static int __peer_may_send(bt_dm_private_t* me, bt_peer_t* p)
+{
+    unsigned int queued;
+
+    if (!me->cb.peer_get_queued_bytes)
+        return 1;
+
+    queued = me->cb.peer_get_queued_bytes(me, &me->cb_ctx, p->conn_ctx);
+    if (p->send_blocked && __cfg(me)->send_low_watermark < queued)
+        return 0;
+    p->send_blocked = __cfg(me)->send_high_watermark <= queued;
+    return !p->send_blocked;
+}
+
+/**
+ * The session's, the torrent's and the peer's upload limits; or for a
+ * local peer, the local limit only
+ * @return 1 if more may be uploaded to the peer this tick */
+static int __may_upload(bt_dm_private_t* me, bt_peer_t* p)
+{
+    if (p->local)
+        return 0 == __cfg(me)->max_local_upload_rate ||
+            0 < me->local_upload_tokens;
+    if (me->session && !bt_session_may_upload(me->session))
+        return 0;
+    if (__cfg(me)->max_peer_upload_rate && p->upload_tokens <= 0)
+        return 0;
+    return 0 == __cfg(me)->max_upload_rate || 0 < me->upload_tokens;
+}
+
+static void __spend_upload(bt_dm_private_t* me, bt_peer_t* p, int bytes)
+{
+    if (p->local)
+    {
+        if (__cfg(me)->max_local_upload_rate)
+            me->local_upload_tokens -= bytes;
+        return;
+    }
+    if (__cfg(me)->max_peer_upload_rate)
+        p->upload_tokens -= bytes;
+    if (__cfg(me)->max_upload_rate)
+        me->upload_tokens -= bytes;
+    if (me->session)
+        bt_session_spend_upload(me->session, bytes);
+}
+
+/**
+ * Send the pieces peers have requested, a block per peer at a time, until
+ * the queues are empty or the upload budgets are spent */
+static void __upload(bt_dm_private_t* me)
+{
+    int sent, i;
+
+    me->nuploaders = 0;
+    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_add_uploader);
+    if (0 == me->nuploaders)
+        return;
+
+    /* a different peer goes first each tick */
+    me->upload_rr++;
+    do
+    {
+        sent = 0;
+        for (i = 0; i < me->nuploaders; i++)
+        {
+            bt_peer_t* p =
+                me->uploaders[(me->upload_rr + i) % me->nuploaders];
+            int n;
+
+            /* may have been disconnected by an earlier send */
+            if (!p->pc || !__peer_is_active(p))
+                continue;
+
+            /* local peers aren't held back by the others' limits */
+            if (!__may_upload(me, p))
+                continue;
+
+            if (!__peer_may_send(me, p))
+                continue;
+
+            if (0 == (n = pwp_conn_send_pending_piece(p->pc)))
+                continue;
+
+            p->uploaded += n;
+            __spend_upload(me, p, n);
+            sent++;
+        }
+    }
+    while (0 < sent);
+
+    /* what the limits held over to the next tick */
+    for (i = 0; i < me->nuploaders; i++)
+    {
+        bt_peer_t* p = me->uploaders[i];
+
+        if (!p->pc || !__peer_is_active(p))
+            continue;
+
+        if (__may_upload(me, p))
+            continue;
+
+        p->upload_deferred =
+            pwp_conn_get_npending_peer_requests(p->pc) * (BT_BLOCK_SIZE);
+    }
+}
+
+typedef struct
+{
+    bt_dm_private_t* me;
+    void* udata;
+    void (*run)(void* caller, void* peer, void* udata);
+
+    /* run over these instead of every peer, if set */
+    bt_peer_t** peers;
+    int npeers;
+} __shard_job_t;
+
+static void __FUNC_shard_run(void* udata, int shard, int nshards)
+{
+    __shard_job_t* j = udata;
+    int i, end;
+
+    if (!j->peers)
+    {
+        bt_peermanager_forall_shard(j->me->pm, j->me, j->udata, shard,
+                                    nshards, j->run);
+        return;
+    }
+
+    end = (long long)j->npeers * (shard + 1) / nshards;
+    for (i = (long long)j->npeers * shard / nshards; i < end; i++)
+        if (j->peers[i])
+            j->run(j->me, j->peers[i], j->udata);
+}
+
+/**
+ * @return 1 if the peer_threads shards are running */
+static int __shards_start(bt_dm_private_t* me)
+{
+    if (!me->shards && 1 < __cfg(me)->peer_threads)
+        me->shards = bt_shards_new(__cfg(me)->peer_threads);
+    return NULL != me->shards;
+}
+
+/**
+ * Run over every peer, split across the peer_threads shards if there are
+ * any. run may only touch its own peer, and reach the rest of the
+ * download manager through the job ring */
+static void __forall_sharded(bt_dm_private_t* me, void* udata,
+                             void (*run)(void* caller, void* peer,
+                                         void* udata))
+{
+    __shard_job_t j = { me, udata, run, NULL, 0 };
+
+    if (!__shards_start(me))
+    {
+        bt_peermanager_forall(me->pm, me, udata, run);
+        return;
+    }
+
+    /* the shards only read the settings */
+    __cfg(me);
+    me->in_shards = 1;
+    bt_shards_run(me->shards, &j, __FUNC_shard_run);
+    me->in_shards = 0;
+}
+
+/**
+ * Service the peers that are ready: those that have had a message, have
+ * blocks waiting to be requested, or whose tick is due. Idle peers cost
+ * nothing here */
+static void __service_ready_peers(bt_dm_private_t* me)
+{
+    __shard_job_t j = { me, NULL, __FUNC_peer_periodic, NULL, 0 };
+    int i, n;
+
+    if (me->ready_all)
+    {
+        bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_mark_ready);
+        me->ready_all = 0;
+    }
+
+    me->nserviced = me->nready;
+
+    if (!__shards_start(me))
+    {
+        /* peers marked while we're at it are serviced too */
+        for (i = 0; i < me->nready; i++)
+            if (me->ready[i])
+                __FUNC_peer_periodic(me, me->ready[i], NULL);
+    }
+    else
+    {
+        /* the shards only read the settings */
+        __cfg(me);
+        j.peers = me->ready;
+        j.npeers = me->nready;
+        me->in_shards = 1;
+        bt_shards_run(me->shards, &j, __FUNC_shard_run);
+        me->in_shards = 0;
+    }
 
-    assert(func);
+    /* keep the peers with work left. A peer marked again while being
+     * serviced is in twice */
+    for (i = 0, n = 0; i < me->nready; i++)
+    {
+        bt_peer_t* p = me->ready[i];
 
-    if (me->cb.call_exclusively)
-        return me->cb.call_exclusively(me_, me->cb_ctx, lock, j, func);
-    else
-        return func(me_, j);
+        if (!p || 1 != p->ready)
+            continue;
+        p->ready = 2;
+        me->ready[n++] = p;
+    }
+    for (i = 0; i < n; i++)
+        me->ready[i]->ready = 1;
+    me->nready = n;
 }
 
-static int __FUNC_peerconn_pollblock(void *me_, void* peer)
+static void __fill_stats(bt_dm_private_t *me, bt_dm_stats_t *stats)
 {
-    bt_dm_private_t *me = me_;
+    int i;
 
-    /* TODO: replace malloc() with memory pool/arena */
-    bt_job_t* j = malloc(sizeof(bt_job_t));
-
-    j->type = BT_JOB_POLLBLOCK;
-    j->pollblock.peer = peer;
-    __call_exclusively(me, &me->job_lock, j, __offer_job);
-    return 0;
+    /* enlarge stats array */
+    if (stats->npeers_size < bt_peermanager_count(me->pm))
+    {
+        stats->npeers_size = bt_peermanager_count(me->pm);
+        stats->peers = realloc(stats->peers,
+                               stats->npeers_size *
+                               sizeof(bt_dm_peer_stats_t));
+    }
+    stats->npeers = 0;
+    stats->upload_deferred_bytes = 0;
+    stats->download_deferred_bytes = 0;
+    bt_peermanager_forall(me->pm, me, stats, __FUNC_peer_stats_visitor);
+    stats->jobs_hwm = me->job_pool.hwm;
+    stats->seeding = me->am_seeding;
+    stats->choke_rounds = me->choke_rounds;
+    stats->nunchoked = me->nunchoked;
+    stats->nhalf_open = me->nhalf_open;
+    stats->ncandidates = me->ncandidates;
+    stats->nserviced = me->nserviced;
+    stats->njobs = bt_dm_get_jobs((bt_dm_t*)me);
+    stats->nhashing = me->nhashing;
+    stats->job_depth = me->job_depth;
+    stats->validate_us = me->validate_us;
+    stats->block_ms = me->block_ms;
+    memset(&stats->cache, 0, sizeof(bt_cache_stats_t));
+    if (me->disk && me->disk->get_cache_stats)
+        me->disk->get_cache_stats(me->disk_udata, &stats->cache);
+    stats->memory = me->memory;
+    stats->duplicate_bytes = me->duplicate_bytes;
+    stats->hash_failure_bytes = me->hash_failure_bytes;
+    stats->hash_failures = me->hash_failures;
+    stats->stolen_blocks = me->stolen_blocks;
+    stats->webseed_bytes = 0;
+    for (i = 0; i < me->nwebseeds; i++)
+        stats->webseed_bytes += me->webseeds[i]->peer->downloaded;
 }
 
 /**
- * Received a block from a peer
- * @param peer Peer received from
- * @param data Data to be pushed */
-int __FUNC_peerconn_pushblock(
-    void *me_,
-    void* pr,
-    bt_block_t *b,
-    const void *data)
+ * Every stats_interval, fill the snapshot that isn't published and publish
+ * it. If a reader still has it we try again next time */
+static void __publish_stats(bt_dm_private_t *me)
 {
-    bt_peer_t *peer = pr;
-    bt_dm_private_t *me = me_;
+    __snapshot_t* next;
+    unsigned long long now;
 
-    assert(me->ipdb.get_piece);
+    if (0 == __cfg(me)->stats_interval)
+        return;
 
-    bt_piece_t *p = me->ipdb.get_piece(me->pdb, b->piece_idx);
+    now = __now_ms(me);
+    if (me->published && now < me->snapshot_ms + __cfg(me)->stats_interval)
+        return;
 
-    switch (bt_piece_write_block(p, NULL, b, data, peer))
-    {
-    case BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED:
-    {
-        /* TODO: replace malloc() with memory pool/arena */
-        bt_job_t * j = malloc(sizeof(bt_job_t));
-        j->type = BT_JOB_VALIDATE_PIECE;
-        j->validate_piece.peer = peer;
-        j->validate_piece.piece_idx = b->piece_idx;
-        __call_exclusively(me, &me->job_lock, j, __offer_job);
-    }
-    break;
-    case BT_PIECE_WRITE_BLOCK_SUCCESS: break;
-    case 0:
-        printf("error writing block\n");
-        break;
-    }
+    next = me->published == &me->snapshots[0] ?
+        &me->snapshots[1] : &me->snapshots[0];
+    if (0 < __atomic_load_n(&next->readers, __ATOMIC_SEQ_CST))
+        return;
 
-    return 1;
+    __fill_stats(me, &next->stats);
+    __atomic_store_n(&me->published, next, __ATOMIC_SEQ_CST);
+    me->snapshot_ms = now;
 }
 
-void __FUNC_peerconn_log(void *me_, void *src_peer, const char *buf, ...)
+static int __FUNC_webseed_send(void* udata, const char* buf,
+                               unsigned int len)
 {
-    bt_peer_t *peer = src_peer;
-    char buffer[1000];
+    __webseed_t* w = udata;
+    bt_dm_private_t* me = w->dm;
 
-    sprintf(buffer, "pwp,%s,%s", peer->peer_id, buf);
-    __log(me_, NULL, buffer);
+    return me->cb.peer_send(me, &me->cb_ctx, w->conn_ctx, buf, len);
 }
 
-int __FUNC_peerconn_disconnect(void *me_, void* pr, char *reason)
+static void __FUNC_webseed_pushblock(void* udata, bt_block_t* b,
+                                     const void* data)
 {
-    bt_peer_t * peer = pr;
+    __webseed_t* w = udata;
 
-    __log(me_, NULL, "disconnecting,%s", reason);
-    bt_dm_remove_peer(me_, peer);
-    return 1;
+    w->nreceived++;
+    __FUNC_peerconn_pushblock(w->dm, w->peer, b, data);
 }
 
-static void __FUNC_peerconn_peer_have_piece(void* bt, void* peer, int idx)
+static void __FUNC_webseed_giveback(void* udata, bt_block_t* b)
 {
-    bt_dm_private_t *me = bt;
+    __webseed_t* w = udata;
 
-    me->ips.peer_have_piece(me->pselector, peer, idx);
+    __FUNC_peerconn_giveback_block(w->dm, w->peer, b);
 }
 
-static void __FUNC_peerconn_giveback_block(void* bt, void* peer, bt_block_t* b)
+static __webseed_t* __webseed_from_conn_ctx(bt_dm_private_t* me,
+                                            void* conn_ctx)
 {
-    bt_dm_private_t *me = bt;
+    int i;
 
-    void* pce = me->ipdb.get_piece(me->pdb, b->piece_idx);
+    for (i = 0; i < me->nwebseeds; i++)
+        if (me->webseeds[i]->conn_ctx == conn_ctx &&
+            (me->webseeds[i]->connecting || me->webseeds[i]->connected))
+            return me->webseeds[i];
+    return NULL;
+}
 
-    bt_piece_giveback_block(pce, b);
-    me->ips.peer_giveback_piece(me->pselector, peer, b->piece_idx);
+/**
+ * The connection has gone or is no good. Its blocks go back to the
+ * selector. A server that was sending us blocks is asked again straight
+ * away, as it may only have closed a keep-alive connection */
+static void __webseed_drop(bt_dm_private_t* me, __webseed_t* w,
+                           int disconnect, const char* reason)
+{
+    int secs = bt_webseed_get_retry_secs(w->ws);
+
+    __log(me, NULL, "webseed,dropped,%s:%d,%s", w->peer->ip, w->peer->port,
+          reason);
+    bt_webseed_giveback(w->ws, w, __FUNC_webseed_giveback);
+    if (disconnect && me->cb.peer_disconnect)
+        me->cb.peer_disconnect(me, &me->cb_ctx, w->conn_ctx);
+
+    w->retry_ms = __now_ms(me);
+    if (secs)
+        w->retry_ms += (unsigned long long)secs * 1000;
+    else if (0 == w->nreceived)
+        w->retry_ms += __cfg(me)->webseed_retry_ms;
+    w->connecting = 0;
+    w->connected = 0;
 }
 
-static void __FUNC_peerconn_write_block_to_stream(void* cb_ctx,
-                                                  bt_block_t * blk,
-                                                  char **msg)
+static int __FUNC_webseed_dispatch(void* me_, void* conn_ctx,
+                                   const char* buf, unsigned int len)
 {
-    bt_dm_private_t *me = cb_ctx;
-    void* p;
+    bt_dm_private_t* me = me_;
+    __webseed_t* w;
 
-    if (!(p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+    if (!(w = __webseed_from_conn_ctx(me, conn_ctx)))
+        return 0;
+
+    if (0 == bt_webseed_dispatch_from_buffer(w->ws, buf, len))
     {
-        __log(me, NULL, "ERROR,unable to obtain piece");
-        return;
+        __webseed_drop(me, w, 1, "bad response");
+        return 0;
     }
-
-    if (0 == bt_piece_write_block_to_stream(p, blk, msg))
-        __log(me, NULL, "ERROR,unable to write block to stream");
+    return 1;
 }
 
-void *bt_dm_add_peer(bt_dm_t* me_,
-                     const char *peer_id,
-                     const int peer_id_len,
-                     const char *ip, const int ip_len, const int port,
-                     void* conn_ctx,
-                     void* conn_mem)
+static int __FUNC_webseed_connected(void* me_, void* conn_ctx, char* ip,
+                                    int port)
 {
-    bt_dm_private_t *me = (void*)me_;
-    bt_peer_t* p;
+    __webseed_t* w;
 
-    /*  ensure we aren't adding ourselves as a peer */
-    if (!strncmp(ip, config_get(me->cfg, "my_ip"), ip_len) &&
-        port == atoi(config_get(me->cfg, "pwp_listen_port")))
-        return NULL;
+    if (!(w = __webseed_from_conn_ctx(me_, conn_ctx)))
+        return 0;
+    w->connecting = 0;
+    w->connected = 1;
+    w->nreceived = 0;
+    return 1;
+}
 
-    /* remember the peer */
-    if (!(p = bt_peermanager_add_peer(me->pm, peer_id, peer_id_len,
-                                      ip, ip_len, port)))
-    {
-#if 0   /* debug */
-        fprintf(stderr, "cant add %s:%d, it's been added already\n", ip, port);
-#endif
-        return NULL;
-    }
+static void __FUNC_webseed_failed(void* me_, void* conn_ctx)
+{
+    __webseed_t* w;
 
-    if (me->pselector)
-        me->ips.add_peer(me->pselector, p);
+    if ((w = __webseed_from_conn_ctx(me_, conn_ctx)))
+        __webseed_drop(me_, w, 0, "connection closed");
+}
 
-    if (conn_ctx)
-        p->conn_ctx = conn_ctx;
+/**
+ * Ask the web seed for whole pieces, while it has room and the rate limits
+ * allow. It doesn't join the endgame; the peers finish those pieces */
+static void __webseed_fill(bt_dm_private_t* me, __webseed_t* w)
+{
+    while (bt_webseed_get_npending(w->ws) <
+           __cfg(me)->webseed_pending_blocks && __may_download(me, w->peer))
+    {
+        int idx = me->ips.poll_piece(me->pselector, w->peer);
+        bt_piece_t* pce;
 
-    void* pc = p->pc = pwp_conn_new(conn_mem);
-    pwp_conn_set_cbs(pc,
-                     &((pwp_conn_cbs_t) {
-                           .log = __FUNC_peerconn_log,
-                           .send = __FUNC_peerconn_send_to_peer,
-                           .pushblock = __FUNC_peerconn_pushblock,
-                           .pollblock = __FUNC_peerconn_pollblock,
-                           .disconnect = __FUNC_peerconn_disconnect,
-                           .peer_have_piece =
-                               __FUNC_peerconn_peer_have_piece,
-                           .peer_giveback_block =
-                               __FUNC_peerconn_giveback_block,
-                           .write_block_to_stream =
-                               __FUNC_peerconn_write_block_to_stream,
-                           .call_exclusively = me->cb.call_exclusively
-                       }), me);
-    pwp_conn_set_progress(pc, me->pieces_completed);
-    pwp_conn_set_piece_info(pc,
-                            config_get_int(me->cfg, "npieces"),
-                            config_get_int(me->cfg, "piece_length"));
-    pwp_conn_set_peer(pc, p);
+        if (-1 == idx || !(pce = me->ipdb.get_piece(me->pdb, idx)))
+            break;
 
-    __log(me, NULL, "added peer %.*s:%d 0x%lx",
-          ip_len, ip, port, (unsigned long)pc);
+        if (bt_piece_is_complete(pce))
+        {
+            me->ips.have_piece(me->pselector, idx);
+            continue;
+        }
 
-    if (!conn_ctx && me->cb.peer_connect)
-    {
-        if (0 == me->cb.peer_connect(me,
-                                     &me->cb_ctx,
-                                     &p->conn_ctx,
-                                     p->ip,
-                                     p->port,
-                                     bt_dm_dispatch_from_buffer,
-                                     bt_dm_peer_connect,
-                                     bt_dm_peer_connect_fail))
+        if (bt_piece_is_fully_requested(pce))
         {
-            __log(me, NULL, "failed connection to peer");
-            return NULL;
+            me->ips.peer_giveback_piece(me->pselector, w->peer, idx);
+            break;
         }
-    }
 
-    if (me->cb.handshaker_new)
-        p->mh = me->cb.handshaker_new(
-            config_get(me->cfg, "infohash"),
-            config_get(me->cfg, "my_peerid"));
+        while (!bt_piece_is_fully_requested(pce))
+        {
+            bt_block_t blk;
 
-    bt_leeching_choker_add_peer(me->lchoke, p->pc);
+            bt_piece_poll_block_request(pce, &blk);
+            bt_webseed_request(w->ws, &blk);
+            __spend_download(me, w->peer, blk.len);
+        }
+    }
 
-    return p;
+    if (0 == bt_webseed_flush(w->ws))
+        __webseed_drop(me, w, 1, "couldn't send");
 }
 
-int bt_dm_remove_peer(bt_dm_t* me_, void* pr)
+static void __webseeds_periodic(bt_dm_private_t* me)
 {
-    bt_dm_private_t* me = (void*)me_;
-    bt_peer_t* peer = pr;
+    int i;
 
-    if (0 == bt_peermanager_remove_peer(me->pm, peer))
+    for (i = 0; i < me->nwebseeds; i++)
     {
-        __log(me_, NULL, "ERROR,couldn't remove peer");
-        return 0;
+        __webseed_t* w = me->webseeds[i];
+
+        if (w->connected)
+        {
+            __webseed_fill(me, w);
+            continue;
+        }
+
+        if (w->connecting || __now_ms(me) < w->retry_ms ||
+            __have_all_pieces(me) || !me->cb.peer_connect)
+            continue;
+
+        /* the network layer may call back before it returns */
+        w->connecting = 1;
+        if (0 == me->cb.peer_connect(me, &me->cb_ctx, &w->conn_ctx,
+                                     w->peer->ip, w->peer->port,
+                                     __FUNC_webseed_dispatch,
+                                     __FUNC_webseed_connected,
+                                     __FUNC_webseed_failed) &&
+            w->connecting)
+            __webseed_drop(me, w, 0, "couldn't connect");
     }
-    me->ips.remove_peer(me->pselector, peer);
-    return 1;
 }
 
-int bt_dm_get_jobs(bt_dm_t* me_)
+void* bt_dm_add_webseed(bt_dm_t* me_, const char* url)
 {
-    bt_dm_private_t *me = (void*)me_;
+    bt_dm_private_t* me = (void*)me_;
+    int npieces = __cfg(me)->npieces, i;
+    __webseed_t* w;
+    void* ws;
+
+    if (!me->pselector || !(ws = bt_webseed_new(url)))
+        return NULL;
 
-    return llqueue_count(me->jobs);
+    w = calloc(1, sizeof(__webseed_t));
+    w->dm = me;
+    w->ws = ws;
+    w->peer = calloc(1, sizeof(bt_peer_t));
+    w->peer->ip = strdup(bt_webseed_get_host(ws));
+    w->peer->port = bt_webseed_get_port(ws);
+    w->retry_ms = __now_ms(me);
+    bt_webseed_set_piece_length(ws, __cfg(me)->piece_length);
+    bt_webseed_set_cbs(ws, &((bt_webseed_cbs_t) {
+                             .send = __FUNC_webseed_send,
+                             .pushblock = __FUNC_webseed_pushblock
+                         }), w);
+
+    me->webseeds = realloc(me->webseeds,
+                           (me->nwebseeds + 1) * sizeof(__webseed_t*));
+    me->webseeds[me->nwebseeds++] = w;
+
+    /* it has every piece */
+    me->ips.add_peer(me->pselector, w->peer);
+    if (me->ips.peer_have_bitfield)
+    {
+        uint64_t* words = malloc(((npieces + 63) / 64) * sizeof(uint64_t));
+
+        memset(words, 0xff, ((npieces + 63) / 64) * sizeof(uint64_t));
+        me->ips.peer_have_bitfield(me->pselector, w->peer, words, npieces);
+        free(words);
+    }
+    else
+        for (i = 0; i < npieces; i++)
+            me->ips.peer_have_piece(me->pselector, w->peer, i);
+    return ws;
 }
 
 void bt_dm_periodic(bt_dm_t* me_, bt_dm_stats_t *stats)
 {
     bt_dm_private_t *me = (void*)me_;
 
-    bt_peermanager_forall(me->pm, me, NULL, __FUNC_peer_periodic);
+    __release_conns(me);
+    __refill_tokens(me);
+    __service_ready_peers(me);
+    __steal_blocks(me);
+    __webseeds_periodic(me);
+    __upload(me);
+    __admit_peers(me);
 
-    /* TODO: pump out keep alive message */
+    bt_timerwheel_step(me->wheel, __now_ms(me));
 
-    while (0 < llqueue_count(me->jobs))
+    /* one batch of writes per tick; finished ones are dispatched below */
+    if (me->disk && me->disk->submit)
+        me->disk->submit(me->disk_udata, me, __FUNC_block_written, me);
+
+    if (me->job_pool.hwm < bt_dm_get_jobs(me_))
+        me->job_pool.hwm = bt_dm_get_jobs(me_);
+    bt_histogram_add(&me->job_depth, bt_dm_get_jobs(me_));
+
+    bt_ring_drain(me->jobring, me, __dispatch_ring_job);
+
+    while (0 < __atomic_load_n(&me->njobs, __ATOMIC_ACQUIRE))
+    {
+        bt_job_t j;
+
+        if (__call_exclusively(me_, &me->job_lock, &j, __poll_job))
+            __dispatch_job(me, &j);
+    }
+
+    if (0 < me->nhaves)
     {
-        void *j = __call_exclusively(me_, &me->job_lock, NULL, __poll_job);
-        __dispatch_job(me, j);
+        __forall_sharded(me, NULL, __FUNC_peer_send_haves);
+        me->nhaves = 0;
     }
 
+    __check_seeding(me);
+
     if (1 == me->am_seeding
-        && 1 == config_get_int(me->cfg, "shutdown_when_complete"))
+        && 1 == __cfg(me)->shutdown_when_complete)
         goto cleanup;
 
-    /* TODO: dispatch eventtimer events */
+    __check_step(me);
+
+    if (__resume_path(me) && (unsigned long long)__cfg(me)->resume_interval *
+        1000 <= __now_ms(me) - me->resume_saved)
+        __resume_save(me);
 
 cleanup:
 
     if (stats)
+        __fill_stats(me, stats);
+
+    __publish_stats(me);
+}
+
+const bt_dm_stats_t* bt_dm_acquire_stats(bt_dm_t* me_)
+{
+    bt_dm_private_t *me = (void*)me_;
+    __snapshot_t* s;
+
+    while ((s = __atomic_load_n(&me->published, __ATOMIC_SEQ_CST)))
     {
-        /* enlarge stats array */
-        if (stats->npeers_size < bt_peermanager_count(me->pm))
-        {
-            stats->npeers_size = bt_peermanager_count(me->pm);
-            stats->peers = realloc(stats->peers,
-                                   stats->npeers_size *
-                                   sizeof(bt_dm_peer_stats_t));
-        }
-        stats->npeers = 0;
-        bt_peermanager_forall(me->pm, me, stats, __FUNC_peer_stats_visitor);
+        __atomic_add_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+
+        /* it's ours unless it was swapped out before we counted */
+        if (s == __atomic_load_n(&me->published, __ATOMIC_SEQ_CST))
+            return &s->stats;
+        __atomic_sub_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
     }
+    return NULL;
+}
 
-    return;
+void bt_dm_release_stats(bt_dm_t* me_, const bt_dm_stats_t* stats)
+{
+    __snapshot_t* s = (__snapshot_t*)stats;
+
+    __atomic_sub_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
 }
 
 static void* __default_msghandler_new(void* callee, void* pc)
@@ -737,16 +4352,65 @@ static void __default_handshake_success(
 {
     bt_dm_private_t *me = (void*)me_;
     bt_peer_t* p = bt_peermanager_conn_ctx_to_peer(me->pm, p_conn_ctx);
+    int npieces = __cfg(me)->npieces;
+
+    /* we look like a peer with nothing, until pieces are revealed */
+    if (p && __super_seeding(me))
+    {
+        if (pwp_conn_flag_is_set(pc, PC_FAST_EXTENSION))
+            pwp_conn_send_statechange(pc, PWP_MSGTYPE_HAVE_NONE);
+        p->super_seeded = 1;
+        __super_reveal(me, p);
+        return;
+    }
+
+    /* the Fast extension can say all or nothing in five bytes */
+    if (pwp_conn_flag_is_set(pc, PC_FAST_EXTENSION))
+    {
+        if (0 < npieces && chunky_have(me->pieces_completed, 0, npieces))
+        {
+            pwp_conn_send_statechange(pc, PWP_MSGTYPE_HAVE_ALL);
+            return;
+        }
+        else if (0 == chunky_get_nbytes_completed(me->pieces_completed))
+        {
+            pwp_conn_send_statechange(pc, PWP_MSGTYPE_HAVE_NONE);
+            return;
+        }
+    }
 
-    if (0 == pwp_send_bitfield(config_get_int(me->cfg, "npieces"),
-                               me->pieces_completed,
-                               __FUNC_peerconn_send_to_peer, me, p))
+    if (0 == pwp_send_bitfield(__have_msg(me), __FUNC_peerconn_send_to_peer,
+                               me, p))
         __FUNC_peerconn_disconnect((void*)me, p, "couldn't send bitfield");
 }
 
+/**
+ * Schedule the periodic timers on a new wheel, from the clock's current
+ * time */
+static void __start_timers(bt_dm_private_t* me)
+{
+    if (me->wheel)
+        bt_timerwheel_free(me->wheel);
+    me->wheel = bt_timerwheel_new(__now_ms(me));
+    me->refill_ms = __now_ms(me);
+    me->connect_ms = 0;
+    bt_timerwheel_add(me->wheel, BT_RECIPROCATION_MS, me,
+                      __leecher_peer_reciprocation);
+    bt_timerwheel_add(me->wheel, BT_OPTIMISTIC_UNCHOKE_MS, me,
+                      __leecher_peer_optimistic_unchoke);
+    bt_timerwheel_add(me->wheel, BT_PEER_TICK_MS, me, __peer_tick);
+    bt_timerwheel_add(me->wheel, BT_RATE_SAMPLE_MS, me, __peer_sample_rates);
+    bt_timerwheel_add(me->wheel, BT_IDLE_MS, me, __peer_keepalive);
+    bt_timerwheel_add(me->wheel, BT_REAP_MS, me, __reap_peers);
+    bt_timerwheel_add(me->wheel, BT_REPLACE_MS, me, __replace_worst_peer);
+    bt_timerwheel_add(me->wheel, BT_MEMORY_MS, me, __check_memory);
+    bt_timerwheel_add(me->wheel, BT_PEX_MS, me, __peer_exchange);
+}
+
 void bt_dm_set_cbs(bt_dm_t* me_, bt_dm_cbs_t * func, void* cb_ctx)
 {
     bt_dm_private_t *me = (void*)me_;
+    int clock_changed = me->cb.get_time_us != func->get_time_us;
 
     me->cb_ctx = cb_ctx;
     memcpy(&me->cb, func, sizeof(bt_dm_cbs_t));
@@ -754,6 +4418,10 @@ void bt_dm_set_cbs(bt_dm_t* me_, bt_dm_cbs_t * func, void* cb_ctx)
         me->cb.msghandler_new = __default_msghandler_new;
     if (!me->cb.handshake_success)
         me->cb.handshake_success = __default_handshake_success;
+
+    /* times from the old clock mean nothing on the new one */
+    if (clock_changed)
+        __start_timers(me);
 }
 
 void* bt_dm_get_config(bt_dm_t* me_)
@@ -783,12 +4451,17 @@ void bt_dm_set_piece_selector(
     void* piece_selector)
 {
     bt_dm_private_t* me = (void*)me_;
+    int i;
 
     memcpy(&me->ips, ips, sizeof(bt_pieceselector_i));
     if (!piece_selector)
-        me->pselector = me->ips.new(0);
+        me->pselector = me->ips.new(__cfg(me)->npieces);
     else
         me->pselector = piece_selector;
+
+    for (i = 0; i < me->npriorities; i++)
+        if (BT_PIECE_PRIORITY_SKIP == me->priorities[i])
+            me->ips.have_piece(me->pselector, i);
     bt_dm_check_pieces(me_);
 }
 
@@ -800,33 +4473,122 @@ void bt_dm_set_piece_db(bt_dm_t* me_, bt_piecedb_i* ipdb, void* piece_db)
     me->pdb = piece_db;
 }
 
+void bt_dm_set_disk_blockrw(bt_dm_t* me_, bt_blockrw_i* irw, void* udata)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    me->disk = irw;
+    me->disk_udata = udata;
+}
+
 void bt_dm_check_pieces(bt_dm_t* me_)
 {
     bt_dm_private_t* me = (void*)me_;
+    bt_job_t j;
     int i, end;
 
-    for (i = 0, end = config_get_int(me->cfg, "npieces"); i < end; i++)
+    /* pieces restored from the resume record don't need rehashing */
+    if (__resume_path(me) && !me->resume_loaded)
+    {
+        int n = bt_resume_load(me->resume, __resume_path(me),
+                               __cfg(me)->infohash,
+                               &me->ipdb, me->pdb,
+                               __cfg(me)->npieces,
+                               __cfg(me)->piece_length);
+
+        if (0 <= n)
+            __log(me, NULL, "client,resumed,pieces=%d", n);
+        me->resume_loaded = 1;
+        me->resume_saved = __now_ms(me);
+    }
+
+    me->check_next = 0;
+    me->check_end = __cfg(me)->npieces;
+    me->check_done = 0;
+
+    /* read pieces progressively while the hasher does the hashing */
+    if (__have_hasher(me))
+    {
+        __check_step(me);
+        return;
+    }
+
+    /* one job validates every piece that needs it */
+    j.type = BT_JOB_CHECK_RANGE;
+    j.check_range.first = -1;
+    j.check_range.end = 0;
+
+    for (i = 0, end = me->check_end; i < end; i++)
     {
         bt_piece_t* p = me->ipdb.get_piece(me->pdb, i);
 
-        if (!p)
-            continue;
-        if (bt_piece_is_complete(p))
-            chunky_mark_complete(me->pieces_completed, i, 1);
+        me->check_next += 1;
+
+        if (!p || __is_partial(p))
+            __check_progress(me);
+        else if (bt_piece_is_complete(p))
+        {
+            __mark_completed(me, i);
+            __check_progress(me);
+        }
         else
         {
-            bt_job_t * j = malloc(sizeof(bt_job_t));
-            j->type = BT_JOB_VALIDATE_PIECE;
-            j->validate_piece.peer = NULL;
-            j->validate_piece.piece_idx = bt_piece_get_idx(p);
-            __call_exclusively(me, &me->job_lock, j, __offer_job);
+            if (-1 == j.check_range.first)
+                j.check_range.first = i;
+            j.check_range.end = i + 1;
         }
     }
+
+    if (-1 != j.check_range.first)
+        __queue_job(me, &j);
 }
 
 int bt_dm_release(bt_dm_t* me_)
 {
+    bt_dm_private_t* me = (void*)me_;
+
     /* TODO add destructors */
+    if (__resume_path(me))
+        __resume_save(me);
+    bt_resume_free(me->resume);
+    if (me->hashpool)
+        bt_hashpool_free(me->hashpool);
+    if (me->shards)
+        bt_shards_free(me->shards);
+    pthread_mutex_destroy(&me->exclusive_lock);
+    while (0 < me->nrecvbufs)
+        bipbuf_free(me->recvbufs[--me->nrecvbufs]);
+    free(me->recvbufs);
+    pthread_mutex_destroy(&me->recvbuf_lock);
+    bt_ring_free(me->jobring);
+    __job_pool_release(&me->job_pool);
+    bt_timerwheel_free(me->wheel);
+    free(me->haves);
+    free(me->uploaders);
+    free(me->super_avail);
+    while (0 < me->nwebseeds)
+    {
+        __webseed_t* w = me->webseeds[--me->nwebseeds];
+
+        bt_webseed_free(w->ws);
+        free(w->peer->ip);
+        free(w->peer);
+        free(w);
+    }
+    free(me->webseeds);
+    free(me->priorities);
+    free(me->shared);
+    free(me->candidates);
+    free(me->ready);
+    free(me->pex);
+    pwp_bitfield_msg_release(&me->have_msg);
+    __release_conns(me);
+    free(me->released);
+    free(me->snapshots[0].stats.peers);
+    free(me->snapshots[1].stats.peers);
+    bt_peerhistory_free(me->history);
+    __endgame_release(me);
+    bt_dm_set_session(me_, NULL);
     return 1;
 }
 
@@ -834,7 +4596,7 @@ void *bt_dm_new()
 {
     bt_dm_private_t *me = calloc(1, sizeof(bt_dm_private_t));
 
-    me->jobs = llqueue_new();
+    me->jobring = bt_ring_new(BT_JOB_RING_SIZE, sizeof(bt_job_t));
     me->job_lock = NULL;
     me->blacklist = bt_blacklist_new();
     me->pm = bt_peermanager_new(me);
@@ -842,17 +4604,85 @@ void *bt_dm_new()
 
     /* default configuration */
     me->cfg = config_new();
+    pthread_mutex_init(&me->exclusive_lock, NULL);
+    pthread_mutex_init(&me->recvbuf_lock, NULL);
+    /* force the first read of the settings */
+    me->settings.version = ~0u;
     config_set(me->cfg, "default", "0");
     config_set_if_not_set(me->cfg, "infohash", "00000000000000000000");
     config_set_if_not_set(me->cfg, "my_ip", "127.0.0.1");
     config_set_if_not_set(me->cfg, "pwp_listen_port", "6881");
     config_set_if_not_set(me->cfg, "max_peer_connections", "32");
     config_set_if_not_set(me->cfg, "max_active_peers", "32");
-    config_set_if_not_set(me->cfg, "max_pending_requests", "10");
+    /* connects that may be outstanding at once, and started per second */
+    config_set_if_not_set(me->cfg, "max_half_open", "8");
+    config_set_if_not_set(me->cfg, "max_connects_per_sec", "10");
+    config_set_if_not_set(me->cfg, "max_bad_pieces", "2");
+    /* bytes the torrent may hold; 0 for no cap. See bt_dm_set_memory_share */
+    config_set_if_not_set(me->cfg, "max_memory", "0");
+    /* peers remembered after they've gone */
+    config_set_if_not_set(me->cfg, "peer_history_size", "1024");
+    /* bounds on the requests kept with each peer. In between, the pipeline
+     * is sized from the peer's bandwidth-delay product */
+    config_set_if_not_set(me->cfg, "min_pending_requests", "10");
+    config_set_if_not_set(me->cfg, "max_pending_requests", "250");
     config_set_if_not_set(me->cfg, "npieces", "0");
     config_set_if_not_set(me->cfg, "piece_length", "0");
     config_set_if_not_set(me->cfg, "download_path", ".");
     config_set_if_not_set(me->cfg, "shutdown_when_complete", "0");
+    /* 0 means pieces are validated within bt_dm_periodic */
+    config_set_if_not_set(me->cfg, "validation_threads", "0");
+    /* 0 means peers are serviced within bt_dm_periodic's thread. Otherwise
+     * peer_send and log are called from that many threads at once, though
+     * never for the same peer */
+    config_set_if_not_set(me->cfg, "peer_threads", "0");
+    /* empty means no resume record is kept */
+    config_set_if_not_set(me->cfg, "resume_path", "");
+    /* seconds between writes of the resume record */
+    config_set_if_not_set(me->cfg, "resume_interval", "300");
+    /* ms between stats snapshots for bt_dm_acquire_stats; 0 means none */
+    config_set_if_not_set(me->cfg, "stats_interval", "1000");
+    /* rate limits in bytes per second; 0 means unlimited. They nest
+     * within the session's, and may be changed while running */
+    config_set_if_not_set(me->cfg, "max_upload_rate", "0");
+    config_set_if_not_set(me->cfg, "max_peer_upload_rate", "0");
+    config_set_if_not_set(me->cfg, "max_download_rate", "0");
+    config_set_if_not_set(me->cfg, "max_peer_download_rate", "0");
+    /* local peers (see bt_dm_set_peer_local) have a class of their own,
+     * outside the limits above and the session's */
+    config_set_if_not_set(me->cfg, "max_local_upload_rate", "0");
+    config_set_if_not_set(me->cfg, "max_local_download_rate", "0");
+    /* PIECE messages stop once a connection has this many bytes queued,
+     * and start again when it drains to send_low_watermark */
+    config_set_if_not_set(me->cfg, "send_high_watermark", "1048576");
+    config_set_if_not_set(me->cfg, "send_low_watermark", "262144");
+    /* ms that transfer rates are averaged over */
+    config_set_if_not_set(me->cfg, "rate_window", "10000");
+    /* peers that would take longer than this many seconds to send a piece
+     * share pieces with other peers; 0 means every peer gets whole pieces */
+    config_set_if_not_set(me->cfg, "slow_piece_secs", "8");
+    /* a pending block is asked of another peer too if the peer we asked
+     * would take this many times longer to send it; 0 means never */
+    config_set_if_not_set(me->cfg, "steal_ratio", "3");
+    /* 1 for an initial seed to reveal its pieces a peer at a time, and
+     * reveal another once the last has reached a second peer. Peers
+     * connected while it's set stay that way */
+    config_set_if_not_set(me->cfg, "super_seeding", "0");
+    /* blocks a web seed may have asked for at once, and ms before a web
+     * seed that failed is tried again, unless it says otherwise */
+    config_set_if_not_set(me->cfg, "webseed_pending_blocks", "64");
+    config_set_if_not_set(me->cfg, "webseed_retry_ms", "30000");
+    /* 1 to swap peer lists with peers that support ut_pex (BEP 11) */
+    config_set_if_not_set(me->cfg, "peer_exchange", "1");
+    /* bytes of each receive buffer from bt_dm_get_recv_buffer. Messages
+     * longer than this, such as a big bitfield, are read as they come */
+    config_set_if_not_set(me->cfg, "recv_buffer_bytes", "65536");
+    /* ms a connection may go without hearing from the peer before it's
+     * dropped; 0 to keep quiet connections */
+    config_set_if_not_set(me->cfg, "peer_idle_timeout_ms", "180000");
+
+    me->history = bt_peerhistory_new(
+        atoi(config_get(me->cfg, "peer_history_size")));
 
     /*  set leeching choker */
     me->lchoke = bt_leeching_choker_new(
@@ -860,17 +4690,31 @@ void *bt_dm_new()
     bt_leeching_choker_set_choker_peer_iface(me->lchoke, me,
                                              &iface_choker_peer);
 
-    /* timing */
-    me->ticker = eventtimer_new();
-    eventtimer_push_event(me->ticker, 10, me, __leecher_peer_reciprocation);
-    eventtimer_push_event(me->ticker, 30, me,
-                          __leecher_peer_optimistic_unchoke);
+    /*  set seeding choker */
+    me->schoke = bt_seeding_choker_new(
+        atoi(config_get(me->cfg, "max_active_peers")));
+    bt_seeding_choker_set_choker_peer_iface(me->schoke, me,
+                                            &iface_choker_peer);
+
+    __start_timers(me);
 
     /* we don't need to specify the amount of pieces we need */
     me->pieces_completed = chunky_new(0);
+    me->resume = bt_resume_new();
     return me;
 }
 
+void bt_dm_set_session(bt_dm_t* me_, void* session)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    if (me->session)
+        bt_session_add_connections(me->session, -me->session_nconnections);
+    me->session = session;
+    me->session_nconnections = 0;
+    __session_sync(me);
+}
+
 void *bt_peer_get_conn_ctx(void* pr)
 {
     bt_peer_t* peer = pr;
@@ -884,3 +4728,44 @@ int bt_dm_piece_is_complete(bt_dm_t* me_, unsigned int piece_idx)
 
     return chunky_have(me->pieces_completed, piece_idx, 1);
 }
+
+void bt_dm_set_piece_priority(bt_dm_t* me_, int first, int last,
+                              int priority)
+{
+    bt_dm_private_t* me = (void*)me_;
+    int i;
+
+    if (first < 0)
+        first = 0;
+    if (last <= first)
+        return;
+
+    if (me->npriorities < last)
+    {
+        me->priorities = realloc(me->priorities, last);
+        memset(me->priorities + me->npriorities, BT_PIECE_PRIORITY_NORMAL,
+               last - me->npriorities);
+        me->npriorities = last;
+    }
+
+    for (i = first; i < last; i++)
+    {
+        int was = me->priorities[i];
+
+        me->priorities[i] = priority;
+        if (!me->pselector || was == priority ||
+            chunky_have(me->pieces_completed, i, 1))
+            continue;
+
+        /* the selector doesn't poll pieces we have */
+        if (BT_PIECE_PRIORITY_SKIP == priority)
+            me->ips.have_piece(me->pselector, i);
+        else if (BT_PIECE_PRIORITY_SKIP == was)
+            __giveback_piece(me, NULL, i);
+    }
+}
+
+int bt_dm_get_piece_priority(bt_dm_t* me_, int piece_idx)
+{
+    return __piece_priority((void*)me_, piece_idx);
+}
@@ -0,0 +1,696 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief A disk layer which writes the torrent's files
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * The torrent is one long run of bytes laid over its files in order. Files
+ * are kept sorted by their offset into the torrent, so the file holding a
+ * byte is a binary search away. A block straddling files is read or
+ * written one file at a time.
+ * Opening files is expensive and descriptors are limited, so only the
+ * most recently used files are kept open.
+ * Files are preallocated when first opened, so that they aren't
+ * fragmented by pieces arriving out of order. Runs of adjacent blocks
+ * from write_blocks go out as one pwritev per file.
+ * With direct io, writes that are aligned go through a second descriptor
+ * opened with O_DIRECT, so that pieces written once don't also fill the
+ * page cache. Unaligned heads and tails of files go through the page cache
+ * as usual.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_filedumper.h"
+#include "bt_cache_policy.h"
+
+#define FILEDUMPER_MAX_FDS 64
+
+/* most buffers handed to a single pwritev */
+#define FILEDUMPER_IOV_MAX 64
+
+/* O_DIRECT buffers, lengths and offsets are multiples of this */
+#define FILEDUMPER_DIRECT_ALIGN 4096
+
+typedef struct
+{
+    /* in the open file lru while fd is open */
+    bt_cache_entry_t ce;
+
+    char *path;
+
+    /* offset of the file's first byte within the torrent */
+    unsigned long long offset;
+    unsigned long long size;
+
+    /* -1 if not open */
+    int fd;
+
+    /* opened with O_DIRECT alongside fd; -1 if direct io is off or the
+     * file system doesn't support it */
+    int dfd;
+} file_t;
+
+typedef struct
+{
+    char *data;
+    unsigned int len;
+} rbuf_t;
+
+typedef struct
+{
+    bt_blockrw_i irw;
+
+    /* sorted by offset */
+    file_t **files;
+    int nfiles;
+    int files_size;
+
+    unsigned long long total_size;
+    int piece_length;
+    char *cwd;
+
+    /* open files */
+    void *open;
+    int max_fds;
+
+    /* allocate the files' blocks when they are first opened */
+    int preallocate;
+
+    /* aligned writes bypass the page cache */
+    int direct;
+
+    /* read buffer for each thread */
+    pthread_key_t rbuf;
+
+    pthread_mutex_t lock;
+} filedumper_t;
+
+#define LRU bt_cache_policy_lru()
+
+/**
+ * @return index of the file holding the byte at offset; -1 if none does */
+static int __find_file(filedumper_t *me, unsigned long long offset)
+{
+    int lo = 0, hi = me->nfiles;
+
+    /* the last file starting at or before offset. Empty files share their
+     * offset with the file after them, so they are passed over */
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (me->files[mid]->offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (0 == lo || me->total_size <= offset)
+        return -1;
+    return lo - 1;
+}
+
+/**
+ * Create the directories leading up to the file */
+static void __mkdirs(char *path)
+{
+    char *p;
+
+    for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+}
+
+static void __close_fds(file_t *f)
+{
+    close(f->fd);
+    f->fd = -1;
+    if (-1 != f->dfd)
+        close(f->dfd);
+    f->dfd = -1;
+}
+
+static void __close_file(filedumper_t *me, file_t *f)
+{
+    LRU->remove(me->open, &f->ce);
+    __close_fds(f);
+}
+
+/**
+ * Open the file if it isn't already, closing the least recently used
+ * @return file descriptor; -1 on error */
+static int __open_file(filedumper_t *me, file_t *f)
+{
+    struct stat st;
+    char *path;
+
+    if (-1 != f->fd)
+    {
+        LRU->touch(me->open, &f->ce);
+        return f->fd;
+    }
+
+    while (me->max_fds <= LRU->count(me->open))
+        __close_fds((file_t*)LRU->evict(me->open));
+
+    path = malloc(strlen(me->cwd) + strlen(f->path) + 2);
+    sprintf(path, "%s/%s", me->cwd, f->path);
+    __mkdirs(path);
+    f->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == f->fd)
+        perror(path);
+#ifdef O_DIRECT
+    /* eg. tmpfs refuses O_DIRECT; every write then goes through fd */
+    else if (me->direct)
+        f->dfd = open(path, O_RDWR | O_DIRECT);
+#endif
+    free(path);
+
+    if (-1 == f->fd)
+        return -1;
+
+    /* unwritten parts of the file read back as zeroes */
+    if (0 == fstat(f->fd, &st) && (unsigned long long)st.st_size < f->size)
+    {
+#ifdef __linux__
+        if (!me->preallocate || -1 == fallocate(f->fd, 0, 0, f->size))
+#endif
+            /* a sparse file will have to do */
+            if (-1 == ftruncate(f->fd, f->size))
+                perror("ftruncate");
+    }
+
+    LRU->touch(me->open, &f->ce);
+    return f->fd;
+}
+
+static unsigned long long __block_offset(
+    filedumper_t *me,
+    const bt_block_t * blk
+)
+{
+    return (unsigned long long)blk->piece_idx * me->piece_length + blk->offset;
+}
+
+/**
+ * @return descriptor to write the buffers at foff with; the O_DIRECT one if
+ *  they are all aligned */
+static int __write_fd(file_t *f, const struct iovec *iov, int niov,
+                      unsigned long long foff)
+{
+    int i;
+
+    if (-1 == f->dfd || 0 != foff % FILEDUMPER_DIRECT_ALIGN)
+        return f->fd;
+
+    for (i = 0; i < niov; i++)
+        if (0 != (uintptr_t)iov[i].iov_base % FILEDUMPER_DIRECT_ALIGN ||
+            0 != iov[i].iov_len % FILEDUMPER_DIRECT_ALIGN)
+            return f->fd;
+    return f->dfd;
+}
+
+/**
+ * The file system took the O_DIRECT open but not the write; stop using it
+ * @return 1 if the write should be retried through the page cache */
+static int __direct_failed(file_t *f, int fd)
+{
+    if (fd != f->dfd || EINVAL != errno)
+        return 0;
+    close(f->dfd);
+    f->dfd = -1;
+    return 1;
+}
+
+/**
+ * Read or write each file the range straddles
+ * @return 1 on success; otherwise 0 */
+static int __io(filedumper_t *me, char *data, unsigned int len,
+                unsigned long long offset, int write)
+{
+    int i;
+
+    if (me->total_size < offset + len || -1 == (i = __find_file(me, offset)))
+        return 0;
+
+    for (; 0 < len; i++)
+    {
+        file_t *f = me->files[i];
+        unsigned long long foff = offset - f->offset;
+        unsigned int seg;
+        int fd;
+
+        if (f->size <= foff)
+            continue;
+
+        seg = f->size - foff < len ? f->size - foff : len;
+
+        if (-1 == (fd = __open_file(me, f)))
+            return 0;
+
+        while (0 < seg)
+        {
+            struct iovec iov = { .iov_base = data, .iov_len = seg };
+            ssize_t n;
+
+            if (write)
+            {
+                fd = __write_fd(f, &iov, 1, foff);
+                n = pwrite(fd, data, seg, foff);
+            }
+            else
+                n = pread(fd, data, seg, foff);
+
+            if (-1 == n && (EINTR == errno || (write &&
+                                               __direct_failed(f, fd))))
+                continue;
+            if (n <= 0)
+                return 0;
+            data += n;
+            foff += n;
+            offset += n;
+            seg -= n;
+            len -= n;
+        }
+    }
+
+    return 1;
+}
+
+int bt_filedumper_write_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *data)
+{
+    filedumper_t *me = flo;
+    int ok;
+
+    pthread_mutex_lock(&me->lock);
+    ok = __io(me, (char*)data, blk->len, __block_offset(me, blk), 1);
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+/**
+ * Move the cursor n bytes through the blocks' data */
+static void __advance(const bt_block_t *blks, int *b, unsigned int *boff,
+                      unsigned long long n)
+{
+    while (0 < n)
+    {
+        unsigned int avail = blks[*b].len - *boff;
+
+        if (n < avail)
+        {
+            *boff += n;
+            return;
+        }
+        n -= avail;
+        (*b)++;
+        *boff = 0;
+    }
+}
+
+/**
+ * Write blocks that follow each other on disk, with one pwritev for each
+ * file they cover
+ * @return 1 on success; otherwise 0 */
+static int __write_run(filedumper_t *me, const bt_block_t *blks,
+                       const void **data, int n)
+{
+    struct iovec iov[FILEDUMPER_IOV_MAX];
+    unsigned long long offset, len = 0;
+    unsigned int boff = 0;
+    int i, b = 0;
+
+    offset = __block_offset(me, &blks[0]);
+    for (i = 0; i < n; i++)
+        len += blks[i].len;
+
+    if (me->total_size < offset + len || -1 == (i = __find_file(me, offset)))
+        return 0;
+
+    for (; 0 < len; i++)
+    {
+        file_t *f = me->files[i];
+        unsigned long long foff = offset - f->offset, seg;
+        int fd;
+
+        if (f->size <= foff)
+            continue;
+
+        seg = f->size - foff < len ? f->size - foff : len;
+
+        if (-1 == (fd = __open_file(me, f)))
+            return 0;
+
+        while (0 < seg)
+        {
+            unsigned long long gathered = 0;
+            unsigned int cboff = boff;
+            int niov = 0, cb = b;
+            ssize_t w;
+
+            while (niov < FILEDUMPER_IOV_MAX && gathered < seg)
+            {
+                unsigned int avail = blks[cb].len - cboff;
+
+                if (seg - gathered < avail)
+                    avail = seg - gathered;
+
+                if (0 < avail)
+                {
+                    iov[niov].iov_base = (char*)data[cb] + cboff;
+                    iov[niov].iov_len = avail;
+                    niov++;
+                }
+
+                gathered += avail;
+                cboff += avail;
+                if (cboff == blks[cb].len)
+                {
+                    cb++;
+                    cboff = 0;
+                }
+            }
+
+            fd = __write_fd(f, iov, niov, foff);
+            w = pwritev(fd, iov, niov, foff);
+            if (-1 == w && (EINTR == errno || __direct_failed(f, fd)))
+                continue;
+            if (w <= 0)
+                return 0;
+
+            __advance(blks, &b, &boff, w);
+            foff += w;
+            offset += w;
+            seg -= w;
+            len -= w;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Split the blocks into runs that are adjacent on disk */
+static int __write_blocks(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blks,
+    const void **data,
+    int n)
+{
+    filedumper_t *me = flo;
+    int i, j, ok = 1;
+
+    pthread_mutex_lock(&me->lock);
+    for (i = 0; i < n; i = j)
+    {
+        for (j = i + 1; j < n &&
+             __block_offset(me, &blks[j - 1]) + blks[j - 1].len ==
+             __block_offset(me, &blks[j]); j++)
+            ;
+
+        if (!__write_run(me, &blks[i], &data[i], j - i))
+            ok = 0;
+    }
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+static void __free_rbuf(void *b_)
+{
+    rbuf_t *b = b_;
+
+    free(b->data);
+    free(b);
+}
+
+void *bt_filedumper_read_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    filedumper_t *me = flo;
+    rbuf_t *b;
+    int ok;
+
+    if (!(b = pthread_getspecific(me->rbuf)))
+    {
+        b = calloc(1, sizeof(rbuf_t));
+        pthread_setspecific(me->rbuf, b);
+    }
+
+    if (b->len < blk->len)
+    {
+        b->data = realloc(b->data, blk->len);
+        b->len = blk->len;
+    }
+
+    pthread_mutex_lock(&me->lock);
+    ok = __io(me, b->data, blk->len, __block_offset(me, blk), 0);
+    pthread_mutex_unlock(&me->lock);
+    return ok ? b->data : NULL;
+}
+
+/**
+ * Sync the files the piece lies in */
+static int __flush_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    filedumper_t *me = flo;
+    unsigned long long offset, end;
+    int i, ok = 1;
+
+    offset = (unsigned long long)blk->piece_idx * me->piece_length;
+    end = offset + me->piece_length;
+
+    pthread_mutex_lock(&me->lock);
+    for (i = __find_file(me, offset);
+         0 <= i && i < me->nfiles && me->files[i]->offset < end; i++)
+        if (-1 != me->files[i]->fd && 0 != fdatasync(me->files[i]->fd))
+            ok = 0;
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+/**
+ * Only blocks lying within a single file can be sent from it. The
+ * descriptor is valid until the next call into the dumper */
+static int __block_file_span(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    int *fd,
+    unsigned long long *offset
+)
+{
+    filedumper_t *me = flo;
+    unsigned long long off = __block_offset(me, blk);
+    file_t *f;
+    int i, ok = 0;
+
+    pthread_mutex_lock(&me->lock);
+    if (-1 != (i = __find_file(me, off)))
+    {
+        f = me->files[i];
+        if (off + blk->len <= f->offset + f->size &&
+            -1 != (*fd = __open_file(me, f)))
+        {
+            *offset = off - f->offset;
+            ok = 1;
+        }
+    }
+    pthread_mutex_unlock(&me->lock);
+    return ok;
+}
+
+void *bt_filedumper_new()
+{
+    filedumper_t *me;
+
+    me = calloc(1, sizeof(filedumper_t));
+    me->irw.write_block = bt_filedumper_write_block;
+    me->irw.read_block = bt_filedumper_read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.block_file_span = __block_file_span;
+    me->irw.write_blocks = __write_blocks;
+    me->cwd = strdup(".");
+    me->max_fds = FILEDUMPER_MAX_FDS;
+    me->preallocate = 1;
+    me->open = LRU->new(0);
+    pthread_key_create(&me->rbuf, __free_rbuf);
+    pthread_mutex_init(&me->lock, NULL);
+    return me;
+}
+
+void bt_filedumper_free(void* fl)
+{
+    filedumper_t *me = fl;
+    rbuf_t *b;
+    int i;
+
+    for (i = 0; i < me->nfiles; i++)
+    {
+        if (-1 != me->files[i]->fd)
+            __close_file(me, me->files[i]);
+        free(me->files[i]->path);
+        free(me->files[i]);
+    }
+    free(me->files);
+    LRU->free(me->open);
+    /* other threads' buffers are freed as those threads exit */
+    if ((b = pthread_getspecific(me->rbuf)))
+        __free_rbuf(b);
+    pthread_key_delete(me->rbuf);
+    pthread_mutex_destroy(&me->lock);
+    free(me->cwd);
+    free(me);
+}
+
+void bt_filedumper_add_file(
+    void* fl,
+    const char *fname,
+    int fname_len,
+    const unsigned long long size)
+{
+    filedumper_t *me = fl;
+    file_t *f;
+
+    if (me->files_size == me->nfiles)
+    {
+        me->files_size = me->files_size ? me->files_size * 2 : 8;
+        me->files = realloc(me->files, sizeof(file_t*) * me->files_size);
+    }
+
+    f = calloc(1, sizeof(file_t));
+    f->path = strndup(fname, fname_len);
+    f->offset = me->total_size;
+    f->size = size;
+    f->fd = -1;
+    f->dfd = -1;
+    me->files[me->nfiles++] = f;
+    me->total_size += size;
+}
+
+int bt_filedumper_get_nfiles( void * fl)
+{
+    return ((filedumper_t*)fl)->nfiles;
+}
+
+const char *bt_filedumper_file_get_path(
+    void * fl,
+    const int idx
+)
+{
+    filedumper_t *me = fl;
+
+    if (idx < 0 || me->nfiles <= idx)
+        return NULL;
+    return me->files[idx]->path;
+}
+
+int bt_filedumper_file_get_pieces(
+    void * fl,
+    const int idx,
+    int *first,
+    int *last
+)
+{
+    filedumper_t *me = fl;
+    file_t *f;
+
+    if (idx < 0 || me->nfiles <= idx || me->piece_length <= 0)
+        return 0;
+
+    f = me->files[idx];
+    *first = f->offset / me->piece_length;
+    *last = 0 == f->size ? *first :
+        (f->offset + f->size - 1) / me->piece_length + 1;
+    return 1;
+}
+
+bt_blockrw_i *bt_filedumper_get_blockrw( void * fl)
+{
+    return &((filedumper_t*)fl)->irw;
+}
+
+void bt_filedumper_set_piece_length( void * fl, const int piece_size)
+{
+    ((filedumper_t*)fl)->piece_length = piece_size;
+}
+
+void bt_filedumper_set_cwd( void * fl, const char *path)
+{
+    filedumper_t *me = fl;
+
+    free(me->cwd);
+    me->cwd = strdup(path);
+}
+
+void bt_filedumper_set_preallocate( void * fl, const int preallocate)
+{
+    ((filedumper_t*)fl)->preallocate = preallocate;
+}
+
+void bt_filedumper_set_max_fds( void * fl, const int max_fds)
+{
+    filedumper_t *me = fl;
+
+    pthread_mutex_lock(&me->lock);
+    me->max_fds = 0 < max_fds ? max_fds : 1;
+    while (me->max_fds < LRU->count(me->open))
+        __close_fds((file_t*)LRU->evict(me->open));
+    pthread_mutex_unlock(&me->lock);
+}
+
+void bt_filedumper_set_direct_io( void * fl, const int direct)
+{
+    filedumper_t *me = fl;
+
+    pthread_mutex_lock(&me->lock);
+    me->direct = direct;
+    /* files are reopened with the new setting */
+    while (0 < LRU->count(me->open))
+        __close_fds((file_t*)LRU->evict(me->open));
+    pthread_mutex_unlock(&me->lock);
+}
+
+int bt_filedumper_get_nopen( void * fl)
+{
+    return LRU->count(((filedumper_t*)fl)->open);
+}
+
+unsigned long long bt_filedumper_get_total_size(void * fl)
+{
+    return ((filedumper_t*)fl)->total_size;
+}
@@ -0,0 +1,423 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Open addressing hashmaps with Robin Hood probing
+ * @desc An entry sits at or after its hash's home slot. Inserting takes the
+ *       slot of any entry that's closer to its own home than the new entry
+ *       is, and carries on with the entry it displaced, so probe lengths
+ *       stay short and even. A lookup can stop as soon as it meets an entry
+ *       closer to home than the key would be. Removal shifts the following
+ *       entries back a slot rather than leaving tombstones.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bt_hashmap.h"
+
+#define MIN_SIZE 8
+
+typedef struct
+{
+    /* hash of the key after mixing; NULL key means the slot's empty */
+    unsigned long hash;
+    void* key;
+    void* val;
+} entry_t;
+
+typedef struct
+{
+    entry_t* e;
+    unsigned int size;
+    unsigned int count;
+    unsigned long (*hash)(const void *);
+    long (*compare)(const void *, const void *);
+} hashmap_t;
+
+typedef struct
+{
+    /* NULL val means the slot's empty */
+    uint64_t key;
+    void* val;
+} intentry_t;
+
+typedef struct
+{
+    intentry_t* e;
+    unsigned int size;
+    unsigned int count;
+} intmap_t;
+
+/**
+ * Callers' hashes tend to be weak in the low bits, which are the ones that
+ * pick a slot; the splitmix64 finaliser spreads them out */
+static uint64_t __mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/**
+ * @return a power of two that holds capacity under 3/4 load */
+static unsigned int __size_for(unsigned int capacity)
+{
+    unsigned int size = MIN_SIZE;
+
+    while (size / 4 * 3 < capacity)
+        size *= 2;
+    return size;
+}
+
+static int __full(unsigned int count, unsigned int size)
+{
+    return size / 4 * 3 < count + 1;
+}
+
+/**
+ * @return how far slot i is from the home slot of hash */
+static unsigned int __dist(unsigned long hash, unsigned int i,
+                           unsigned int size)
+{
+    return (i - (unsigned int)hash) & (size - 1);
+}
+
+void* bt_hashmap_new(unsigned long (*hash)(const void *),
+                     long (*compare)(const void *, const void *),
+                     unsigned int initial_capacity)
+{
+    hashmap_t* me = calloc(1, sizeof(hashmap_t));
+
+    me->size = __size_for(initial_capacity);
+    me->e = calloc(me->size, sizeof(entry_t));
+    me->hash = hash;
+    me->compare = compare;
+    return me;
+}
+
+void bt_hashmap_free(void* me_)
+{
+    hashmap_t* me = me_;
+
+    free(me->e);
+    free(me);
+}
+
+int bt_hashmap_count(const void* me_)
+{
+    const hashmap_t* me = me_;
+
+    return me->count;
+}
+
+unsigned long bt_hashmap_get_memory(const void* me_)
+{
+    const hashmap_t* me = me_;
+
+    return sizeof(hashmap_t) + me->size * sizeof(entry_t);
+}
+
+/**
+ * @return slot holding key; otherwise -1 */
+static int __find(const hashmap_t* me, const void* key, unsigned long hash)
+{
+    unsigned int mask = me->size - 1, i = hash & mask, d;
+
+    for (d = 0; me->e[i].key; d++, i = (i + 1) & mask)
+    {
+        const entry_t* e = &me->e[i];
+
+        if (__dist(e->hash, i, me->size) < d)
+            break;
+        if (e->hash == hash && 0 == me->compare(key, e->key))
+            return i;
+    }
+    return -1;
+}
+
+void* bt_hashmap_get(const void* me_, const void* key)
+{
+    const hashmap_t* me = me_;
+    int i;
+
+    if (!key || 0 == me->count)
+        return NULL;
+    i = __find(me, key, __mix(me->hash(key)));
+    return i < 0 ? NULL : me->e[i].val;
+}
+
+/**
+ * Place an entry known not to be in the map */
+static void __insert(hashmap_t* me, entry_t n)
+{
+    unsigned int mask = me->size - 1, i = n.hash & mask, d;
+
+    for (d = 0; me->e[i].key; d++, i = (i + 1) & mask)
+    {
+        entry_t* e = &me->e[i];
+        unsigned int ed = __dist(e->hash, i, me->size);
+
+        if (ed < d)
+        {
+            entry_t tmp = *e;
+
+            *e = n;
+            n = tmp;
+            d = ed;
+        }
+    }
+    me->e[i] = n;
+    me->count++;
+}
+
+static void __grow(hashmap_t* me)
+{
+    entry_t* old = me->e;
+    unsigned int i, size = me->size;
+
+    me->size *= 2;
+    me->e = calloc(me->size, sizeof(entry_t));
+    me->count = 0;
+    for (i = 0; i < size; i++)
+        if (old[i].key)
+            __insert(me, old[i]);
+    free(old);
+}
+
+void* bt_hashmap_put(void* me_, void* key, void* val)
+{
+    hashmap_t* me = me_;
+    unsigned long hash;
+    int i;
+
+    if (!key || !val)
+        return NULL;
+
+    hash = __mix(me->hash(key));
+    if (0 <= (i = __find(me, key, hash)))
+    {
+        void* prev = me->e[i].val;
+
+        me->e[i].val = val;
+        return prev;
+    }
+
+    if (__full(me->count, me->size))
+        __grow(me);
+    __insert(me, (entry_t) { .hash = hash, .key = key, .val = val });
+    return NULL;
+}
+
+void* bt_hashmap_remove(void* me_, const void* key)
+{
+    hashmap_t* me = me_;
+    unsigned int mask = me->size - 1, j;
+    void* val;
+    int i;
+
+    if (!key || 0 == me->count)
+        return NULL;
+    if ((i = __find(me, key, __mix(me->hash(key)))) < 0)
+        return NULL;
+
+    val = me->e[i].val;
+    for (j = (i + 1) & mask;
+         me->e[j].key && 0 < __dist(me->e[j].hash, j, me->size);
+         i = j, j = (j + 1) & mask)
+        me->e[i] = me->e[j];
+    memset(&me->e[i], 0, sizeof(entry_t));
+    me->count--;
+    return val;
+}
+
+void bt_hashmap_iterator(const void* me_, bt_hashmap_iterator_t* iter)
+{
+    iter->cur = 0;
+}
+
+/**
+ * @return next occupied slot; otherwise NULL */
+static const entry_t* __next(const hashmap_t* me, bt_hashmap_iterator_t* iter)
+{
+    for (; iter->cur < me->size; iter->cur++)
+        if (me->e[iter->cur].key)
+            return &me->e[iter->cur++];
+    return NULL;
+}
+
+void* bt_hashmap_iterator_next(const void* me_, bt_hashmap_iterator_t* iter)
+{
+    const entry_t* e = __next(me_, iter);
+
+    return e ? e->key : NULL;
+}
+
+void* bt_hashmap_iterator_next_value(const void* me_,
+                                     bt_hashmap_iterator_t* iter)
+{
+    const entry_t* e = __next(me_, iter);
+
+    return e ? e->val : NULL;
+}
+
+void* bt_intmap_new(unsigned int initial_capacity)
+{
+    intmap_t* me = calloc(1, sizeof(intmap_t));
+
+    me->size = __size_for(initial_capacity);
+    me->e = calloc(me->size, sizeof(intentry_t));
+    return me;
+}
+
+void bt_intmap_free(void* me_)
+{
+    intmap_t* me = me_;
+
+    free(me->e);
+    free(me);
+}
+
+int bt_intmap_count(const void* me_)
+{
+    const intmap_t* me = me_;
+
+    return me->count;
+}
+
+unsigned long bt_intmap_get_memory(const void* me_)
+{
+    const intmap_t* me = me_;
+
+    return sizeof(intmap_t) + me->size * sizeof(intentry_t);
+}
+
+static int __intfind(const intmap_t* me, uint64_t key)
+{
+    unsigned int mask = me->size - 1, i = __mix(key) & mask, d;
+
+    for (d = 0; me->e[i].val; d++, i = (i + 1) & mask)
+    {
+        const intentry_t* e = &me->e[i];
+
+        if (e->key == key)
+            return i;
+        if (__dist(__mix(e->key), i, me->size) < d)
+            break;
+    }
+    return -1;
+}
+
+void* bt_intmap_get(const void* me_, uint64_t key)
+{
+    const intmap_t* me = me_;
+    int i;
+
+    if (0 == me->count)
+        return NULL;
+    i = __intfind(me, key);
+    return i < 0 ? NULL : me->e[i].val;
+}
+
+static void __intinsert(intmap_t* me, intentry_t n)
+{
+    unsigned int mask = me->size - 1, i = __mix(n.key) & mask, d;
+
+    for (d = 0; me->e[i].val; d++, i = (i + 1) & mask)
+    {
+        intentry_t* e = &me->e[i];
+        unsigned int ed = __dist(__mix(e->key), i, me->size);
+
+        if (ed < d)
+        {
+            intentry_t tmp = *e;
+
+            *e = n;
+            n = tmp;
+            d = ed;
+        }
+    }
+    me->e[i] = n;
+    me->count++;
+}
+
+static void __intgrow(intmap_t* me)
+{
+    intentry_t* old = me->e;
+    unsigned int i, size = me->size;
+
+    me->size *= 2;
+    me->e = calloc(me->size, sizeof(intentry_t));
+    me->count = 0;
+    for (i = 0; i < size; i++)
+        if (old[i].val)
+            __intinsert(me, old[i]);
+    free(old);
+}
+
+void* bt_intmap_put(void* me_, uint64_t key, void* val)
+{
+    intmap_t* me = me_;
+    int i;
+
+    if (!val)
+        return NULL;
+
+    if (0 <= (i = __intfind(me, key)))
+    {
+        void* prev = me->e[i].val;
+
+        me->e[i].val = val;
+        return prev;
+    }
+
+    if (__full(me->count, me->size))
+        __intgrow(me);
+    __intinsert(me, (intentry_t) { .key = key, .val = val });
+    return NULL;
+}
+
+void* bt_intmap_remove(void* me_, uint64_t key)
+{
+    intmap_t* me = me_;
+    unsigned int mask = me->size - 1, j;
+    void* val;
+    int i;
+
+    if (0 == me->count || (i = __intfind(me, key)) < 0)
+        return NULL;
+
+    val = me->e[i].val;
+    for (j = (i + 1) & mask;
+         me->e[j].val && 0 < __dist(__mix(me->e[j].key), j, me->size);
+         i = j, j = (j + 1) & mask)
+        me->e[i] = me->e[j];
+    memset(&me->e[i], 0, sizeof(intentry_t));
+    me->count--;
+    return val;
+}
+
+void bt_intmap_iterator(const void* me_, bt_hashmap_iterator_t* iter)
+{
+    iter->cur = 0;
+}
+
+void* bt_intmap_iterator_next_value(const void* me_,
+                                    bt_hashmap_iterator_t* iter)
+{
+    const intmap_t* me = me_;
+
+    for (; iter->cur < me->size; iter->cur++)
+        if (me->e[iter->cur].val)
+            return me->e[iter->cur++].val;
+    return NULL;
+}
@@ -0,0 +1,215 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Hash piece data on background threads
+ * @desc SHA1 over a whole piece is expensive. Doing it on the thread that
+ *       services peers stalls everything else. Workers only ever see a
+ *       private copy of the data, so they don't touch the disk layer.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "bt.h"
+#include "bt_hashpool.h"
+
+#include "linked_list_queue.h"
+#include "bt_sha1.h"
+
+/* most jobs a worker will hash in one batch */
+#define BATCH_SIZE 4
+
+typedef struct
+{
+    char* data;
+    int len;
+    void* udata;
+
+    /* set if submitted through the hasher interface */
+    func_hash_done_f done;
+    void* caller;
+} hashjob_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* jobs waiting for a worker */
+    linked_list_queue_t* jobs;
+
+    pthread_t* threads;
+    int nthreads;
+
+    int shutdown;
+
+    func_hashpool_done_f done;
+    void* udata;
+
+    bt_hasher_i ih;
+} hashpool_t;
+
+static void* __worker(void* me_)
+{
+    hashpool_t* me = me_;
+
+    while (1)
+    {
+        hashjob_t* j[BATCH_SIZE];
+        char hashes[BATCH_SIZE][20], *hashes_p[BATCH_SIZE];
+        const void* data[BATCH_SIZE];
+        unsigned int lens[BATCH_SIZE];
+        int i, n;
+
+        pthread_mutex_lock(&me->lock);
+        while (!me->shutdown && 0 == llqueue_count(me->jobs))
+            pthread_cond_wait(&me->cond, &me->lock);
+        if (me->shutdown)
+        {
+            pthread_mutex_unlock(&me->lock);
+            return NULL;
+        }
+        for (n = 0; n < BATCH_SIZE && (j[n] = llqueue_poll(me->jobs)); n++)
+        {
+            hashes_p[n] = hashes[n];
+            data[n] = j[n]->data;
+            lens[n] = j[n]->len;
+        }
+        pthread_mutex_unlock(&me->lock);
+
+        bt_sha1_multi(n, hashes_p, data, lens);
+
+        for (i = 0; i < n; i++)
+        {
+            if (j[i]->done)
+                j[i]->done(j[i]->caller, j[i]->udata, hashes[i]);
+            else
+                me->done(me->udata, j[i]->udata, hashes[i]);
+            free(j[i]->data);
+            free(j[i]);
+        }
+    }
+}
+
+void *bt_hashpool_new(int nthreads, void* udata, func_hashpool_done_f done)
+{
+    hashpool_t* me;
+    int i;
+
+    me = calloc(1, sizeof(hashpool_t));
+    pthread_mutex_init(&me->lock, NULL);
+    pthread_cond_init(&me->cond, NULL);
+    me->jobs = llqueue_new();
+    me->threads = calloc(nthreads, sizeof(pthread_t));
+    me->done = done;
+    me->udata = udata;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        if (0 != pthread_create(&me->threads[i], NULL, __worker, me))
+        {
+            perror("couldn't create hashing thread");
+            break;
+        }
+        me->nthreads++;
+    }
+
+    if (0 == me->nthreads)
+    {
+        bt_hashpool_free(me);
+        return NULL;
+    }
+
+    return me;
+}
+
+void bt_hashpool_free(void* me_)
+{
+    hashpool_t* me = me_;
+    hashjob_t* j;
+    int i;
+
+    pthread_mutex_lock(&me->lock);
+    me->shutdown = 1;
+    pthread_cond_broadcast(&me->cond);
+    pthread_mutex_unlock(&me->lock);
+
+    for (i = 0; i < me->nthreads; i++)
+        pthread_join(me->threads[i], NULL);
+
+    /* what's left is never hashed; its owners still get their udata back */
+    while ((j = llqueue_poll(me->jobs)))
+    {
+        if (j->done)
+            j->done(j->caller, j->udata, NULL);
+        else
+            me->done(me->udata, j->udata, NULL);
+        free(j->data);
+        free(j);
+    }
+
+    llqueue_free(me->jobs);
+    pthread_cond_destroy(&me->cond);
+    pthread_mutex_destroy(&me->lock);
+    free(me->threads);
+    free(me);
+}
+
+static int __submit(hashpool_t* me, void* caller, func_hash_done_f done,
+                    char* data, int len, void* job_udata)
+{
+    hashjob_t* j;
+
+    if (!(j = malloc(sizeof(hashjob_t))))
+        return 0;
+
+    j->data = data;
+    j->len = len;
+    j->udata = job_udata;
+    j->done = done;
+    j->caller = caller;
+
+    pthread_mutex_lock(&me->lock);
+    llqueue_offer(me->jobs, j);
+    pthread_cond_signal(&me->cond);
+    pthread_mutex_unlock(&me->lock);
+    return 1;
+}
+
+int bt_hashpool_submit(void* me_, char* data, int len, void* job_udata)
+{
+    return __submit(me_, NULL, NULL, data, len, job_udata);
+}
+
+static int __hasher_submit(void* me_, void* caller, func_hash_done_f done,
+                           char* data, int len, void* job_udata)
+{
+    return __submit(me_, caller, done, data, len, job_udata);
+}
+
+/**
+ * Enough to keep every worker busy while the next piece is read */
+static int __hasher_get_depth(void* me_)
+{
+    hashpool_t* me = me_;
+
+    return 2 * me->nthreads;
+}
+
+bt_hasher_i *bt_hashpool_get_hasher(void* me_)
+{
+    hashpool_t* me = me_;
+
+    me->ih.submit = __hasher_submit;
+    me->ih.get_depth = __hasher_get_depth;
+    return &me->ih;
+}
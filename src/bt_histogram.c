@@ -0,0 +1,85 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Log-linear histogram
+ * @desc A value's bucket is found from its highest set bit and the two bits
+ *       below it. The buckets are fixed, so adding is a few instructions and
+ *       histograms copy by value.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bt.h"
+#include "bt_histogram.h"
+
+/* log2 of BT_HISTOGRAM_SUB_BUCKETS */
+#define SUB_BITS 2
+
+static int __bucket(unsigned long long v)
+{
+    int msb, idx;
+
+    if (v < BT_HISTOGRAM_SUB_BUCKETS)
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+    idx = (msb - SUB_BITS + 1) * BT_HISTOGRAM_SUB_BUCKETS +
+        (int)((v >> (msb - SUB_BITS)) & (BT_HISTOGRAM_SUB_BUCKETS - 1));
+    return idx < BT_HISTOGRAM_BUCKETS ? idx : BT_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * @return lowest value that goes into the bucket */
+static unsigned long long __bucket_low(int idx)
+{
+    int shift;
+
+    if (idx < BT_HISTOGRAM_SUB_BUCKETS)
+        return idx;
+
+    shift = idx / BT_HISTOGRAM_SUB_BUCKETS - 1;
+    return (unsigned long long)(BT_HISTOGRAM_SUB_BUCKETS +
+                                idx % BT_HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+void bt_histogram_add(bt_histogram_t* h, unsigned long long v)
+{
+    h->buckets[__bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (h->max < v)
+        h->max = v;
+}
+
+unsigned long long bt_histogram_percentile(const bt_histogram_t* h,
+                                           double pct)
+{
+    unsigned long long want, seen = 0, high;
+    int i;
+
+    if (0 == h->count)
+        return 0;
+
+    want = (unsigned long long)(h->count * pct / 100.0 + 0.5);
+    if (want < 1)
+        want = 1;
+
+    for (i = 0; i < BT_HISTOGRAM_BUCKETS - 1; i++)
+        if (want <= (seen += h->buckets[i]))
+            break;
+
+    high = i < BT_HISTOGRAM_BUCKETS - 1 ? __bucket_low(i + 1) - 1 : h->max;
+    return high < h->max ? high : h->max;
+}
+
+unsigned long long bt_histogram_mean(const bt_histogram_t* h)
+{
+    return 0 == h->count ? 0 : h->sum / h->count;
+}
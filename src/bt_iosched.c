@@ -0,0 +1,590 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Disk I/O scheduler
+ * @desc Keeps separate read and write queues in front of the disk. Each
+ *       submit drains a budget of each queue, reads first, so that blocks
+ *       peers are waiting on don't queue behind bulk writes. Within a queue
+ *       requests are taken in elevator order: upwards by disk offset from
+ *       where the last batch ended, wrapping around to the lowest.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_iosched.h"
+#include "config.h"
+
+typedef struct
+{
+    bt_block_t blk;
+
+    /* offset of the block's first byte on disk */
+    unsigned long long offset;
+
+    /* NULL for reads that haven't been made */
+    void *data;
+
+    int ok;
+} io_req_t;
+
+typedef struct
+{
+    io_req_t **reqs;
+    int n;
+    int size;
+    unsigned long long bytes;
+} io_queue_t;
+
+typedef struct
+{
+    unsigned int version;
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+    unsigned long long queue_bytes;
+} iosched_settings_t;
+
+typedef struct
+{
+    bt_blockrw_i irw;
+
+    bt_blockrw_i *disk;
+    void *disk_udata;
+
+    int piece_length;
+
+    /* reads peers are waiting on */
+    io_queue_t reads;
+    io_queue_t writes;
+
+    /* reads that have been made, waiting for read_block */
+    io_queue_t ready;
+
+    /* reads handed out by read_block; freed on the next submit */
+    io_queue_t taken;
+
+    /* writes that haven't been reported by submit */
+    io_queue_t written;
+
+    /* where each elevator is up to */
+    unsigned long long read_head;
+    unsigned long long write_head;
+
+    pthread_mutex_t lock;
+
+    config_t* cfg;
+    iosched_settings_t settings;
+} iosched_t;
+
+/**
+ * @return settings, re-read from the config only if it has changed */
+static iosched_settings_t* __cfg(iosched_t* me)
+{
+    iosched_settings_t* s = &me->settings;
+
+    if (s->version == me->cfg->version)
+        return s;
+
+    s->version = me->cfg->version;
+    s->read_bytes = config_get_ull(me->cfg, "iosched_read_bytes");
+    s->write_bytes = config_get_ull(me->cfg, "iosched_write_bytes");
+    s->queue_bytes = config_get_ull(me->cfg, "iosched_queue_bytes");
+    return s;
+}
+
+static void __push(io_queue_t* q, io_req_t* r)
+{
+    if (q->size == q->n)
+    {
+        q->size = q->size ? q->size * 2 : 16;
+        q->reqs = realloc(q->reqs, sizeof(io_req_t*) * q->size);
+    }
+    q->reqs[q->n++] = r;
+    q->bytes += r->blk.len;
+}
+
+static io_req_t* __take(io_queue_t* q, int idx)
+{
+    io_req_t* r = q->reqs[idx];
+
+    memmove(&q->reqs[idx], &q->reqs[idx + 1],
+            sizeof(io_req_t*) * (q->n - idx - 1));
+    q->n--;
+    q->bytes -= r->blk.len;
+    return r;
+}
+
+static void __req_free(io_req_t* r)
+{
+    free(r->data);
+    free(r);
+}
+
+static void __queue_release(io_queue_t* q)
+{
+    while (0 < q->n)
+        __req_free(__take(q, q->n - 1));
+    free(q->reqs);
+}
+
+static int __same_block(const bt_block_t* a, const bt_block_t* b)
+{
+    return a->piece_idx == b->piece_idx && a->offset == b->offset &&
+        a->len == b->len;
+}
+
+/**
+ * @return index of the request for exactly this block; -1 if none */
+static int __find(io_queue_t* q, const bt_block_t* blk)
+{
+    int i;
+
+    for (i = 0; i < q->n; i++)
+        if (__same_block(&q->reqs[i]->blk, blk))
+            return i;
+    return -1;
+}
+
+static int __overlaps(io_queue_t* q, unsigned long long offset,
+                      unsigned int len)
+{
+    int i;
+
+    for (i = 0; i < q->n; i++)
+        if (q->reqs[i]->offset < offset + len &&
+            offset < q->reqs[i]->offset + q->reqs[i]->blk.len)
+            return 1;
+    return 0;
+}
+
+static int __cmp_offset(const void *a, const void *b)
+{
+    const io_req_t *ra = *(io_req_t* const*)a, *rb = *(io_req_t* const*)b;
+
+    return ra->offset < rb->offset ? -1 : rb->offset < ra->offset;
+}
+
+/**
+ * Take up to budget bytes of requests in elevator order. At least one
+ * request is taken, so big blocks still get through
+ * @param out Filled with the requests, in the order the head passes them
+ * @return number of requests taken */
+static int __elevator(io_queue_t* q, unsigned long long *head,
+                      unsigned long long budget, io_req_t** out)
+{
+    unsigned long long bytes = 0;
+    int start, i, n = 0;
+
+    if (0 == q->n)
+        return 0;
+
+    qsort(q->reqs, q->n, sizeof(io_req_t*), __cmp_offset);
+
+    for (start = 0; start < q->n && q->reqs[start]->offset < *head; start++)
+        ;
+
+    for (i = 0; i < q->n && (0 == n || bytes < budget); i++)
+    {
+        io_req_t* r = q->reqs[(start + i) % q->n];
+
+        out[n++] = r;
+        bytes += r->blk.len;
+        *head = r->offset + r->blk.len;
+    }
+
+    /* what was taken is a run of the sorted queue, possibly wrapped */
+    if (start + n <= q->n)
+        memmove(&q->reqs[start], &q->reqs[start + n],
+                sizeof(io_req_t*) * (q->n - start - n));
+    else
+        memmove(&q->reqs[0], &q->reqs[start + n - q->n],
+                sizeof(io_req_t*) * (q->n - n));
+    q->n -= n;
+    q->bytes -= bytes;
+    return n;
+}
+
+static unsigned long long __disk_offset(iosched_t* me, const bt_block_t* blk)
+{
+    return (unsigned long long)blk->piece_idx * me->piece_length + blk->offset;
+}
+
+/**
+ * Write out a budget's worth of queued writes */
+static void __dispatch_writes(iosched_t* me, unsigned long long budget)
+{
+    io_req_t** batch;
+    int i, n;
+
+    batch = malloc(sizeof(io_req_t*) * (me->writes.n + 1));
+    n = __elevator(&me->writes, &me->write_head, budget, batch);
+
+    if (me->disk->write_blocks && 1 < n)
+    {
+        bt_block_t *blks = malloc(sizeof(bt_block_t) * n);
+        const void **data = malloc(sizeof(void*) * n);
+        int ok;
+
+        for (i = 0; i < n; i++)
+        {
+            blks[i] = batch[i]->blk;
+            data[i] = batch[i]->data;
+        }
+        ok = me->disk->write_blocks(me->disk_udata, me, blks, data, n);
+        for (i = 0; i < n; i++)
+            batch[i]->ok = ok;
+        free(blks);
+        free(data);
+    }
+    else
+        for (i = 0; i < n; i++)
+            batch[i]->ok = me->disk->write_block(me->disk_udata, me,
+                                                 &batch[i]->blk,
+                                                 batch[i]->data);
+
+    /* only the block is kept for the report */
+    for (i = 0; i < n; i++)
+    {
+        free(batch[i]->data);
+        batch[i]->data = NULL;
+        __push(&me->written, batch[i]);
+    }
+
+    free(batch);
+}
+
+static void __drain_writes(iosched_t* me)
+{
+    while (0 < me->writes.n)
+        __dispatch_writes(me, me->writes.bytes);
+}
+
+/**
+ * Make a budget's worth of queued reads */
+static void __dispatch_reads(iosched_t* me, unsigned long long budget)
+{
+    io_req_t** batch;
+    int i, n;
+
+    batch = malloc(sizeof(io_req_t*) * (me->reads.n + 1));
+    n = __elevator(&me->reads, &me->read_head, budget, batch);
+
+    for (i = 0; i < n; i++)
+    {
+        io_req_t* r = batch[i];
+        void* data = me->disk->read_block(me->disk_udata, me, &r->blk);
+
+        if (!data)
+        {
+            __req_free(r);
+            continue;
+        }
+
+        r->data = malloc(r->blk.len);
+        memcpy(r->data, data, r->blk.len);
+        __push(&me->ready, r);
+    }
+
+    /* blocks nobody came for make way, oldest first */
+    while (0 < me->ready.n && __cfg(me)->read_bytes < me->ready.bytes)
+        __req_free(__take(&me->ready, 0));
+
+    free(batch);
+}
+
+static int __write_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *blkdata
+)
+{
+    iosched_t* me = udata;
+    io_req_t* r;
+    int idx;
+
+    pthread_mutex_lock(&me->lock);
+
+    /* a rewrite replaces the queued write */
+    if (-1 != (idx = __find(&me->writes, blk)))
+    {
+        memcpy(me->writes.reqs[idx]->data, blkdata, blk->len);
+        pthread_mutex_unlock(&me->lock);
+        return 1;
+    }
+
+    /* the elevator could reorder overlapping writes */
+    if (__overlaps(&me->writes, __disk_offset(me, blk), blk->len))
+        __drain_writes(me);
+
+    /* ready reads of this block are stale */
+    while (-1 != (idx = __find(&me->ready, blk)))
+        __req_free(__take(&me->ready, idx));
+
+    r = calloc(1, sizeof(io_req_t));
+    r->blk = *blk;
+    r->offset = __disk_offset(me, blk);
+    r->data = malloc(blk->len);
+    memcpy(r->data, blkdata, blk->len);
+    __push(&me->writes, r);
+
+    while (__cfg(me)->queue_bytes < me->writes.bytes)
+        __dispatch_writes(me, me->writes.bytes - __cfg(me)->queue_bytes);
+
+    pthread_mutex_unlock(&me->lock);
+    return 1;
+}
+
+static void *__read_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    iosched_t* me = udata;
+    int idx;
+
+    pthread_mutex_lock(&me->lock);
+
+    /* a copy, as the queued write can go out at any time */
+    if (-1 != (idx = __find(&me->writes, blk)))
+    {
+        io_req_t* r = calloc(1, sizeof(io_req_t));
+
+        r->blk = *blk;
+        r->data = malloc(blk->len);
+        memcpy(r->data, me->writes.reqs[idx]->data, blk->len);
+        __push(&me->taken, r);
+        pthread_mutex_unlock(&me->lock);
+        return r->data;
+    }
+
+    if (__overlaps(&me->writes, __disk_offset(me, blk), blk->len))
+        __drain_writes(me);
+
+    if (-1 != (idx = __find(&me->ready, blk)))
+    {
+        io_req_t* r = __take(&me->ready, idx);
+
+        __push(&me->taken, r);
+        pthread_mutex_unlock(&me->lock);
+        return r->data;
+    }
+
+    /* we're reading it now */
+    if (-1 != (idx = __find(&me->reads, blk)))
+        __req_free(__take(&me->reads, idx));
+
+    pthread_mutex_unlock(&me->lock);
+    return me->disk->read_block(me->disk_udata, me, blk);
+}
+
+/**
+ * A peer has asked for the block; queue a read for it */
+static int __prefetch_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    iosched_t* me = udata;
+    io_req_t* r;
+
+    pthread_mutex_lock(&me->lock);
+
+    if (-1 != __find(&me->reads, blk) || -1 != __find(&me->ready, blk) ||
+        -1 != __find(&me->writes, blk))
+    {
+        pthread_mutex_unlock(&me->lock);
+        return 1;
+    }
+
+    if (__cfg(me)->read_bytes < me->reads.bytes + blk->len)
+    {
+        pthread_mutex_unlock(&me->lock);
+        return 0;
+    }
+
+    r = calloc(1, sizeof(io_req_t));
+    r->blk = *blk;
+    r->offset = __disk_offset(me, blk);
+    __push(&me->reads, r);
+    pthread_mutex_unlock(&me->lock);
+    return 1;
+}
+
+static int __flush_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    iosched_t* me = udata;
+
+    pthread_mutex_lock(&me->lock);
+    if (__overlaps(&me->writes,
+                   (unsigned long long)blk->piece_idx * me->piece_length,
+                   me->piece_length))
+        __drain_writes(me);
+    pthread_mutex_unlock(&me->lock);
+
+    if (!me->disk->flush_block)
+        return 1;
+    return me->disk->flush_block(me->disk_udata, me, blk);
+}
+
+static int __block_file_span(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    int *fd,
+    unsigned long long *offset
+)
+{
+    iosched_t* me = udata;
+    int pending;
+
+    if (!me->disk->block_file_span)
+        return 0;
+
+    pthread_mutex_lock(&me->lock);
+    pending = __overlaps(&me->writes, __disk_offset(me, blk), blk->len);
+    pthread_mutex_unlock(&me->lock);
+
+    /* the file doesn't have the block yet */
+    if (pending)
+        return 0;
+
+    return me->disk->block_file_span(me->disk_udata, me, blk, fd, offset);
+}
+
+static int __submit(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    func_block_written_f cb,
+    void *cb_udata
+)
+{
+    iosched_t* me = udata;
+    io_queue_t written;
+    int i, outstanding;
+
+    pthread_mutex_lock(&me->lock);
+
+    while (0 < me->taken.n)
+        __req_free(__take(&me->taken, me->taken.n - 1));
+
+    if (0 < me->reads.n)
+        __dispatch_reads(me, __cfg(me)->read_bytes);
+    if (0 < me->writes.n)
+        __dispatch_writes(me, __cfg(me)->write_bytes);
+
+    outstanding = me->writes.n;
+    written = me->written;
+    memset(&me->written, 0, sizeof(io_queue_t));
+    pthread_mutex_unlock(&me->lock);
+
+    /* report without the lock, so the callback can use the scheduler */
+    for (i = 0; i < written.n; i++)
+    {
+        if (cb)
+            cb(cb_udata, &written.reqs[i]->blk, written.reqs[i]->ok);
+        __req_free(written.reqs[i]);
+    }
+    free(written.reqs);
+
+    if (me->disk->submit)
+        outstanding += me->disk->submit(me->disk_udata, me, cb, cb_udata);
+
+    return outstanding;
+}
+
+void *bt_iosched_new()
+{
+    iosched_t* me;
+
+    me = calloc(1, sizeof(iosched_t));
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.block_file_span = __block_file_span;
+    me->irw.prefetch_block = __prefetch_block;
+    me->irw.submit = __submit;
+    pthread_mutex_init(&me->lock, NULL);
+
+    me->cfg = config_new();
+    /* force the first read of the settings */
+    me->settings.version = ~0u;
+    /* bytes of queued reads made each submit */
+    config_set_if_not_set(me->cfg, "iosched_read_bytes", "4194304");
+    /* bytes of queued writes made each submit */
+    config_set_if_not_set(me->cfg, "iosched_write_bytes", "8388608");
+    /* bytes of writes queued before write_block writes them itself */
+    config_set_if_not_set(me->cfg, "iosched_queue_bytes", "16777216");
+    return me;
+}
+
+void bt_iosched_free(void *ios)
+{
+    iosched_t* me = ios;
+
+    if (me->disk)
+        __drain_writes(me);
+    __queue_release(&me->reads);
+    __queue_release(&me->writes);
+    __queue_release(&me->ready);
+    __queue_release(&me->taken);
+    __queue_release(&me->written);
+    pthread_mutex_destroy(&me->lock);
+    config_free(me->cfg);
+    free(me->cfg);
+    free(me);
+}
+
+void* bt_iosched_get_config(void *ios)
+{
+    return ((iosched_t*)ios)->cfg;
+}
+
+void bt_iosched_set_piece_length(void *ios, int piece_length)
+{
+    ((iosched_t*)ios)->piece_length = piece_length;
+}
+
+void bt_iosched_set_disk_blockrw(void *ios, bt_blockrw_i * irw,
+                                 void *irw_data)
+{
+    iosched_t* me = ios;
+
+    assert(irw->write_block);
+    assert(irw->read_block);
+    me->disk = irw;
+    me->disk_udata = irw_data;
+}
+
+bt_blockrw_i *bt_iosched_get_blockrw(void *ios)
+{
+    return &((iosched_t*)ios)->irw;
+}
+
+unsigned long long bt_iosched_get_queued_write_bytes(void *ios)
+{
+    return ((iosched_t*)ios)->writes.bytes;
+}
+
+unsigned long long bt_iosched_get_queued_read_bytes(void *ios)
+{
+    return ((iosched_t*)ios)->reads.bytes;
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Intrusive doubly linked list
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+
+#include "bt_list.h"
+
+void bt_list_init(bt_list_t* head)
+{
+    head->prev = head->next = head;
+}
+
+int bt_list_empty(const bt_list_t* head)
+{
+    return head->next == head;
+}
+
+int bt_list_linked(const bt_list_t* link)
+{
+    return NULL != link->next;
+}
+
+void bt_list_push_tail(bt_list_t* head, bt_list_t* link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+void bt_list_remove(bt_list_t* link)
+{
+    if (!link->next)
+        return;
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = NULL;
+}
+
+bt_list_t* bt_list_pop_head(bt_list_t* head)
+{
+    bt_list_t* link = head->next;
+
+    if (link == head)
+        return NULL;
+    bt_list_remove(link);
+    return link;
+}
@@ -0,0 +1,249 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Local service discovery (BEP 14)
+ * @desc An announce is an HTTP-like request with an Infohash header for
+ *       each torrent. Torrents that are due share a datagram, up to
+ *       BT_LSD_MAX_DATAGRAM bytes; what doesn't fit waits for the next.
+ *       A cookie picked at random marks our own announces.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "bt.h"
+#include "bt_lsd.h"
+
+/* announces are kept under a typical MTU */
+#define BT_LSD_MAX_DATAGRAM 1400
+
+/* "Infohash: " 40 hex digits CRLF, and "cookie: " 8 hex digits and the
+ * message's end */
+#define BT_LSD_INFOHASH_LINE 52
+#define BT_LSD_TAIL 22
+
+typedef struct
+{
+    char infohash[20];
+
+    /* ms the torrent is next announced at; 0 for straight away */
+    unsigned long long next_ms;
+} __torrent_t;
+
+typedef struct
+{
+    bt_lsd_cbs_t cb;
+    void* udata;
+
+    int port;
+    char cookie[9];
+
+    __torrent_t* torrents;
+    int ntorrents;
+    int torrents_size;
+
+    /* ms the last datagram went out at, and whether one has */
+    unsigned long long sent_ms;
+    int sent;
+} lsd_t;
+
+void* bt_lsd_new(int port)
+{
+    lsd_t* me = calloc(1, sizeof(lsd_t));
+
+    me->port = port;
+    sprintf(me->cookie, "%08x", (unsigned int)rand());
+    return me;
+}
+
+void bt_lsd_free(void* me_)
+{
+    lsd_t* me = me_;
+
+    free(me->torrents);
+    free(me);
+}
+
+void bt_lsd_set_cbs(void* me_, bt_lsd_cbs_t* cb, void* udata)
+{
+    lsd_t* me = me_;
+
+    memcpy(&me->cb, cb, sizeof(bt_lsd_cbs_t));
+    me->udata = udata;
+}
+
+static int __find(lsd_t* me, const char* infohash)
+{
+    int i;
+
+    for (i = 0; i < me->ntorrents; i++)
+        if (0 == memcmp(me->torrents[i].infohash, infohash, 20))
+            return i;
+    return -1;
+}
+
+int bt_lsd_add_torrent(void* me_, const char* infohash)
+{
+    lsd_t* me = me_;
+
+    if (0 <= __find(me, infohash))
+        return 0;
+
+    if (me->torrents_size <= me->ntorrents)
+    {
+        me->torrents_size = me->torrents_size * 2 + 4;
+        me->torrents = realloc(me->torrents,
+                               me->torrents_size * sizeof(__torrent_t));
+    }
+    memcpy(me->torrents[me->ntorrents].infohash, infohash, 20);
+    me->torrents[me->ntorrents].next_ms = 0;
+    me->ntorrents++;
+    return 1;
+}
+
+int bt_lsd_remove_torrent(void* me_, const char* infohash)
+{
+    lsd_t* me = me_;
+    int i = __find(me, infohash);
+
+    if (i < 0)
+        return 0;
+    me->torrents[i] = me->torrents[--me->ntorrents];
+    return 1;
+}
+
+int bt_lsd_periodic(void* me_, unsigned long long now_ms)
+{
+    lsd_t* me = me_;
+    char buf[BT_LSD_MAX_DATAGRAM];
+    int i, j, len, ndue = 0;
+
+    if (!me->cb.send)
+        return 0;
+    if (me->sent && now_ms < me->sent_ms + BT_LSD_GAP_MS)
+        return 0;
+
+    len = sprintf(buf, "BT-SEARCH * HTTP/1.1\r\n"
+                  "Host: %s:%d\r\n"
+                  "Port: %d\r\n",
+                  BT_LSD_GROUP, BT_LSD_PORT, me->port);
+
+    for (i = 0; i < me->ntorrents &&
+         len + BT_LSD_INFOHASH_LINE + BT_LSD_TAIL <= BT_LSD_MAX_DATAGRAM;
+         i++)
+    {
+        __torrent_t* t = &me->torrents[i];
+
+        if (now_ms < t->next_ms)
+            continue;
+
+        len += sprintf(buf + len, "Infohash: ");
+        for (j = 0; j < 20; j++)
+            len += sprintf(buf + len, "%02x", (unsigned char)t->infohash[j]);
+        len += sprintf(buf + len, "\r\n");
+        t->next_ms = now_ms + BT_LSD_INTERVAL_MS;
+        ndue++;
+    }
+
+    if (0 == ndue)
+        return 0;
+
+    len += sprintf(buf + len, "cookie: %s\r\n\r\n\r\n", me->cookie);
+    me->sent = 1;
+    me->sent_ms = now_ms;
+    return me->cb.send(me->udata, buf, len) ? 1 : 0;
+}
+
+/**
+ * @return the header's value if the line is the header; otherwise NULL */
+static const char* __header(const char* line, const char* name)
+{
+    size_t n = strlen(name);
+
+    if (strncasecmp(line, name, n) || ':' != line[n])
+        return NULL;
+    for (line += n + 1; ' ' == *line || '\t' == *line; line++)
+        ;
+    return line;
+}
+
+/**
+ * @return 1 if v starts with 40 hex digits, which are put in infohash */
+static int __parse_infohash(const char* v, char* infohash)
+{
+    int i;
+
+    for (i = 0; i < 40; i++)
+        if (!isxdigit((unsigned char)v[i]))
+            return 0;
+    if (v[40] && '\r' != v[40] && '\n' != v[40])
+        return 0;
+
+    for (i = 0; i < 20; i++)
+    {
+        unsigned int b;
+
+        sscanf(v + i * 2, "%2x", &b);
+        infohash[i] = (char)b;
+    }
+    return 1;
+}
+
+int bt_lsd_dispatch_from_buffer(void* me_, const char* buf, unsigned int len,
+                                const char* ip)
+{
+    lsd_t* me = me_;
+    char msg[BT_LSD_MAX_DATAGRAM + 1],
+         found[BT_LSD_MAX_DATAGRAM / BT_LSD_INFOHASH_LINE][20];
+    const char *line, *v;
+    int port = 0, nfound = 0, i, n = 0;
+
+    if (BT_LSD_MAX_DATAGRAM < len)
+        return -1;
+    memcpy(msg, buf, len);
+    msg[len] = '\0';
+
+    if (strncmp(msg, "BT-SEARCH * HTTP/1.", 19))
+        return -1;
+
+    for (line = strstr(msg, "\r\n"); line && line[2] && '\r' != line[2];
+         line = strstr(line + 2, "\r\n"))
+    {
+        const char* l = line + 2;
+
+        if ((v = __header(l, "Port")))
+            port = atoi(v);
+        else if ((v = __header(l, "Infohash")))
+        {
+            if (nfound < BT_LSD_MAX_DATAGRAM / BT_LSD_INFOHASH_LINE &&
+                __parse_infohash(v, found[nfound]))
+                nfound++;
+        }
+        /* multicast loops our own announces back to us */
+        else if ((v = __header(l, "cookie")) &&
+                 0 == strncmp(v, me->cookie, 8) &&
+                 ('\r' == v[8] || '\0' == v[8]))
+            return 0;
+    }
+
+    if (port <= 0 || 65535 < port)
+        return -1;
+
+    for (i = 0; i < nfound; i++)
+        if (0 <= __find(me, found[i]))
+        {
+            if (me->cb.found_peer)
+                me->cb.found_peer(me->udata, found[i], ip, port);
+            n++;
+        }
+    return n;
+}
@@ -24,9 +24,10 @@
 
 #include "bt.h"
 #include "bt_string.h"
+#include "bt_util.h"
 #include "bt_peermanager.h"
 
-#include "linked_list_hashmap.h"
+#include "bt_hashmap.h"
 #include "asprintf.h"
 
 typedef struct {
@@ -34,22 +35,44 @@ typedef struct {
     void* cfg;
     void* caller;
     void* (*func_peerconn_init)(void* caller);
-    hashmap_t *peers;
+    void *peers;
+
+    /* the same peers packed together, so that sweeps over every peer are a
+     * linear pass. Removal swaps the last peer into the gap */
+    bt_peer_t **array;
+    int narray;
+    int array_size;
+
+    /* secondary indexes, so that network events find their peer quickly */
+    void *by_conn_ctx;
+    void *by_pc;
 } bt_peermanager_t;
 
 /**
- * djb2 by Dan Bernstein. */
+ * Addresses are hashed as integers; only host names go through djb2 */
 static unsigned long __peer_hash(const void *obj)
 {
     const bt_peer_t* peer = obj;
-    const char* str;
-    unsigned long hash = 5381;
-    int c;
-    
-    for (str = peer->ip; (c = *(str++));)
-        hash = ((hash << 5) + hash) + c;
-    hash += peer->port * 59;
-    return hash;
+    uint64_t hi, lo, h;
+
+    if (peer->addr_is_name)
+    {
+        /* djb2 by Dan Bernstein */
+        const char* str;
+        unsigned long hash = 5381;
+        int c;
+
+        for (str = peer->ip; (c = *(str++));)
+            hash = ((hash << 5) + hash) + c;
+        hash += peer->port * 59;
+        return hash;
+    }
+
+    memcpy(&hi, peer->addr, sizeof(hi));
+    memcpy(&lo, peer->addr + 8, sizeof(lo));
+    h = (hi ^ (lo * 0x9e3779b97f4a7c15ULL)) + peer->port;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
 }
 
 static long __peer_compare(const void *obj, const void *other)
@@ -58,6 +81,12 @@ static long __peer_compare(const void *obj, const void *other)
     const bt_peer_t* p2 = other;
     int i;
 
+    if (p1->addr_is_name != p2->addr_is_name)
+        return p1->addr_is_name - p2->addr_is_name;
+
+    if (!p1->addr_is_name)
+        return memcmp(p1->addr, p2->addr, BT_PEER_ADDR_LEN);
+
     i = strcmp(p1->ip,p2->ip);
     if (i != 0)
         return i;
@@ -65,26 +94,36 @@ static long __peer_compare(const void *obj, const void *other)
     return p1->port - p2->port;
 }
 
+/**
+ * Fill in what peers are keyed by */
+static void __peer_key(bt_peer_t* peer, const char *ip, const int ip_len,
+                       const int port)
+{
+    peer->port = port;
+    peer->addr_is_name = !bt_addr_pack(peer->addr, ip, ip_len, port);
+}
+
 /**
  * @return 1 if the peer is within the manager */
 int bt_peermanager_contains(void *pm, const char *ip, const int port)
 {
     bt_peermanager_t *me = pm;
-    hashmap_iterator_t iter;
+    bt_peer_t key;
 
-    /* find peerconn that has this ip and port */
-    for (hashmap_iterator(me->peers,&iter);
-         hashmap_iterator_has_next(me->peers,&iter);)
-    {
-        bt_peer_t* peer;
+    key.ip = (char*)ip;
+    __peer_key(&key, ip, strlen(ip), port);
+    return NULL != bt_hashmap_get(me->peers, &key);
+}
 
-        peer = hashmap_iterator_next(me->peers,&iter);
-        if (!strcmp(peer->ip, ip) && peer->port == port)
-        {
-            return 1;
-        }
-    }
-    return 0;
+int bt_peermanager_contains_addr(void *pm, const unsigned char *addr)
+{
+    bt_peermanager_t *me = pm;
+    bt_peer_t key;
+
+    key.addr_is_name = 0;
+    key.port = (addr[16] << 8) | addr[17];
+    memcpy(key.addr, addr, BT_PEER_ADDR_LEN);
+    return NULL != bt_hashmap_get(me->peers, &key);
 }
 
 /**
@@ -92,22 +131,51 @@ int bt_peermanager_contains(void *pm, const char *ip, const int port)
 void *bt_peermanager_conn_ctx_to_peer(void * pm, void* conn_ctx)
 {
     bt_peermanager_t *me = pm;
-    hashmap_iterator_t iter;
+    bt_peer_t* peer;
+    int i;
 
-    /* find peerconn that has this conn_ctx */
-    for (hashmap_iterator(me->peers,&iter);
-         hashmap_iterator_has_next(me->peers,&iter);)
-    {
-        bt_peer_t* peer;
+    if ((peer = bt_intmap_get(me->by_conn_ctx, (uintptr_t)conn_ctx)))
+        return peer;
 
-        peer = hashmap_iterator_next(me->peers,&iter);
-        if (peer->conn_ctx == conn_ctx)
+    /* conn_ctx can be written by the network layer without us being told.
+     * Find the peer the slow way and index it */
+    for (i = 0; i < me->narray; i++)
+    {
+        peer = me->array[i];
+        if (peer->conn_ctx == conn_ctx && conn_ctx)
+        {
+            bt_intmap_put(me->by_conn_ctx, (uintptr_t)conn_ctx, peer);
             return peer;
+        }
     }
 
     return NULL;
 }
 
+void bt_peermanager_set_conn_ctx(void* pm, bt_peer_t* peer, void* conn_ctx)
+{
+    bt_peermanager_t *me = pm;
+
+    if (peer->conn_ctx &&
+        peer == bt_intmap_get(me->by_conn_ctx, (uintptr_t)peer->conn_ctx))
+        bt_intmap_remove(me->by_conn_ctx, (uintptr_t)peer->conn_ctx);
+    peer->conn_ctx = conn_ctx;
+    if (conn_ctx)
+        bt_intmap_put(me->by_conn_ctx, (uintptr_t)conn_ctx, peer);
+}
+
+void bt_peermanager_set_pc(void* pm, bt_peer_t* peer, void* pc)
+{
+    bt_peermanager_t *me = pm;
+
+    if (peer->pc &&
+        peer == bt_intmap_get(me->by_pc, (uintptr_t)peer->pc))
+        bt_intmap_remove(me->by_pc, (uintptr_t)peer->pc);
+    peer->pc = pc;
+    if (pc)
+        bt_intmap_put(me->by_pc, (uintptr_t)pc, peer);
+}
+
 /**
  * Add the peer.
  * Initiate connection with the peer.
@@ -121,14 +189,18 @@ bt_peer_t *bt_peermanager_add_peer(void *pm,
     bt_peermanager_t *me = pm;
     bt_peer_t *peer;
 
+    peer = calloc(1, sizeof(bt_peer_t));
+    asprintf(&peer->ip, "%.*s", ip_len, ip);
+    __peer_key(peer, peer->ip, strlen(peer->ip), port);
+
     /* prevent dupes.. */
-    if (bt_peermanager_contains(me, ip, port))
+    if (bt_hashmap_get(me->peers, peer))
     {
+        free(peer->ip);
+        free(peer);
         return NULL;
     }
 
-    peer = calloc(1, sizeof(bt_peer_t));
-
     /*  'compact=0'
      *  doesn't use peerids.. */
     if (peer_id)
@@ -139,15 +211,21 @@ bt_peer_t *bt_peermanager_add_peer(void *pm,
     {
         asprintf(&peer->peer_id, "");//, peer_id_len, peer_id);
     }
-    asprintf(&peer->ip, "%.*s", ip_len, ip);
-    peer->port = port;
 
 #if 0 /*  debug */
     printf("adding peer: ip:%.*s port:%d\n", ip_len, ip, port);
     //__log(bto,NULL,"adding peer: ip:%.*s port:%d\n", ip_len, ip, port);
 #endif
 
-    hashmap_put(me->peers,peer,peer);
+    bt_hashmap_put(me->peers, peer, peer);
+
+    if (me->array_size <= me->narray)
+    {
+        me->array_size = me->array_size ? me->array_size * 2 : 16;
+        me->array = realloc(me->array, me->array_size * sizeof(bt_peer_t*));
+    }
+    peer->pm_idx = me->narray;
+    me->array[me->narray++] = peer;
     return peer;
 }
 
@@ -164,7 +242,13 @@ int bt_peermanager_remove_peer(void *pm, bt_peer_t* peer)
     bt_peermanager_t *me = pm;
 
 //    bt_leeching_choker_add_peer(me->lchoke, peer);
-    hashmap_remove(me->peers,peer);
+    bt_peermanager_set_conn_ctx(me, peer, NULL);
+    bt_peermanager_set_pc(me, peer, NULL);
+    if (!bt_hashmap_remove(me->peers, peer))
+        return 1;
+
+    me->array[peer->pm_idx] = me->array[--me->narray];
+    me->array[peer->pm_idx]->pm_idx = peer->pm_idx;
     return 1;
 }
 
@@ -175,23 +259,52 @@ void bt_peermanager_forall(
         void (*run)(void* caller, void* peer, void* udata))
 {
     bt_peermanager_t *me = pm;
-    hashmap_iterator_t iter;
+    int i;
 
-    for (hashmap_iterator(me->peers,&iter);
-         hashmap_iterator_has_next(me->peers,&iter);)
+    /* backwards, so that run can remove the peer it's given */
+    for (i = me->narray - 1; 0 <= i; i--)
     {
-        bt_peer_t* peer;
-
-        peer = hashmap_iterator_next(me->peers,&iter);
-        run(caller,peer,udata);
+        if (me->narray <= i)
+            continue;
+        run(caller,me->array[i],udata);
     }
 }
 
+void bt_peermanager_forall_shard(
+        void* pm,
+        void* caller,
+        void* udata,
+        int shard,
+        int nshards,
+        void (*run)(void* caller, void* peer, void* udata))
+{
+    bt_peermanager_t *me = pm;
+    int i, first, end;
+
+    /* a run of the array each, so that shards don't share cache lines */
+    first = (long long)me->narray * shard / nshards;
+    end = (long long)me->narray * (shard + 1) / nshards;
+
+    for (i = first; i < end; i++)
+        run(caller,me->array[i],udata);
+}
+
 int bt_peermanager_count(void* pm)
 {
     bt_peermanager_t* me = pm;
 
-    return hashmap_count(me->peers);
+    return me->narray;
+}
+
+int bt_peermanager_has_peer(void* pm, const bt_peer_t* peer)
+{
+    bt_peermanager_t* me = pm;
+    int i;
+
+    for (i = 0; i < me->narray; i++)
+        if (me->array[i] == peer)
+            return 1;
+    return 0;
 }
 
 void bt_peermanager_set_config(void* pm, void* cfg)
@@ -204,20 +317,8 @@ void bt_peermanager_set_config(void* pm, void* cfg)
 void* bt_peermanager_get_peer_from_pc(void* pm, const void* pc)
 {
     bt_peermanager_t *me = pm;
-    hashmap_iterator_t iter;
-
-    /* find peerconn that has this ip and port */
-    for (hashmap_iterator(me->peers,&iter);
-         hashmap_iterator_has_next(me->peers,&iter);)
-    {
-        bt_peer_t* p = hashmap_iterator_next(me->peers,&iter);
 
-        if (p->pc == pc)
-        {
-            return p;
-        }
-    }
-    return NULL;
+    return bt_intmap_get(me->by_pc, (uintptr_t)pc);
 }
 
 void* bt_peermanager_new(void* caller)
@@ -227,6 +328,8 @@ void* bt_peermanager_new(void* caller)
     me = calloc(1,sizeof(bt_peermanager_t));
 //    me->caller = caller;
 //    me->func_peerconn_init = func_peerconn_init;
-    me->peers = hashmap_new(__peer_hash, __peer_compare, 11);
+    me->peers = bt_hashmap_new(__peer_hash, __peer_compare, 11);
+    me->by_conn_ctx = bt_intmap_new(11);
+    me->by_pc = bt_intmap_new(11);
     return me;
 }
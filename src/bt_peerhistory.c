@@ -0,0 +1,270 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Bounded history of the peers we've dealt with
+ * @desc Entries are found through a hashmap keyed like the peer manager's,
+ *       and aged through the LRU cache policy.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_util.h"
+#include "bt_cache_policy.h"
+#include "bt_peerhistory.h"
+
+#include "linked_list_hashmap.h"
+
+typedef struct
+{
+    /* see bt_addr_pack */
+    unsigned char addr[BT_PEER_ADDR_LEN];
+
+    /* host names aren't packed, and are keyed by name and port */
+    int addr_is_name;
+    const char* name;
+    int name_len;
+    int port;
+} history_key_t;
+
+typedef struct
+{
+    /* must be first; the policy hands these back to us */
+    bt_cache_entry_t lru;
+    history_key_t key;
+    bt_peerhistory_entry_t h;
+} entry_t;
+
+typedef struct
+{
+    hashmap_t* entries;
+    void* lru;
+    unsigned int max_peers;
+} history_t;
+
+static unsigned long __key_hash(const void *obj)
+{
+    const history_key_t* k = obj;
+    uint64_t hi, lo, h;
+
+    if (k->addr_is_name)
+    {
+        /* djb2 by Dan Bernstein */
+        unsigned long hash = 5381;
+        int i;
+
+        for (i = 0; i < k->name_len; i++)
+            hash = ((hash << 5) + hash) + k->name[i];
+        return hash + k->port * 59;
+    }
+
+    memcpy(&hi, k->addr, sizeof(hi));
+    memcpy(&lo, k->addr + 8, sizeof(lo));
+    h = (hi ^ (lo * 0x9e3779b97f4a7c15ULL)) + k->port;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
+}
+
+static long __key_compare(const void *obj, const void *other)
+{
+    const history_key_t* k1 = obj;
+    const history_key_t* k2 = other;
+
+    if (k1->addr_is_name != k2->addr_is_name)
+        return k1->addr_is_name - k2->addr_is_name;
+
+    if (!k1->addr_is_name)
+        return memcmp(k1->addr, k2->addr, BT_PEER_ADDR_LEN);
+
+    if (k1->name_len != k2->name_len)
+        return k1->name_len - k2->name_len;
+    if (k1->port != k2->port)
+        return k1->port - k2->port;
+    return memcmp(k1->name, k2->name, k1->name_len);
+}
+
+static void __key(history_key_t* k, const char *ip, int ip_len, int port)
+{
+    k->port = port;
+    k->name = ip;
+    k->name_len = ip_len;
+    k->addr_is_name = !bt_addr_pack(k->addr, ip, ip_len, port);
+}
+
+static void __entry_free(entry_t* e)
+{
+    if (e->key.addr_is_name)
+        free((char*)e->key.name);
+    free(e);
+}
+
+void *bt_peerhistory_new(unsigned int max_peers)
+{
+    history_t* me = calloc(1, sizeof(history_t));
+
+    me->max_peers = max_peers ? max_peers : 1;
+    me->entries = hashmap_new(__key_hash, __key_compare, 11);
+    me->lru = bt_cache_policy_lru()->new(me->max_peers);
+    return me;
+}
+
+void bt_peerhistory_free(void* h)
+{
+    history_t* me = h;
+    hashmap_iterator_t iter;
+    entry_t* e;
+
+    for (hashmap_iterator(me->entries, &iter);
+         (e = hashmap_iterator_next_value(me->entries, &iter));)
+        __entry_free(e);
+    hashmap_free(me->entries);
+    bt_cache_policy_lru()->free(me->lru);
+    free(me);
+}
+
+static entry_t* __find(history_t* me, const char *ip, int ip_len, int port)
+{
+    history_key_t k;
+
+    __key(&k, ip, ip_len, port);
+    return hashmap_get(me->entries, &k);
+}
+
+/**
+ * @return the peer's entry, added if it's new, as the most recently used */
+static entry_t* __touch(history_t* me, const char *ip, int ip_len, int port)
+{
+    const bt_cache_policy_i* lru = bt_cache_policy_lru();
+    entry_t* e;
+
+    if (!(e = __find(me, ip, ip_len, port)))
+    {
+        e = calloc(1, sizeof(entry_t));
+        __key(&e->key, ip, ip_len, port);
+
+        /* only names are read from the key once it's packed */
+        if (e->key.addr_is_name)
+        {
+            char* name = malloc(ip_len);
+
+            memcpy(name, ip, ip_len);
+            e->key.name = name;
+        }
+        else
+            e->key.name = NULL;
+        hashmap_put(me->entries, &e->key, e);
+    }
+
+    lru->touch(me->lru, &e->lru);
+
+    while (me->max_peers < (unsigned int)lru->count(me->lru))
+    {
+        entry_t* old = (entry_t*)lru->evict(me->lru);
+
+        hashmap_remove(me->entries, &old->key);
+        __entry_free(old);
+    }
+
+    return e;
+}
+
+bt_peerhistory_entry_t* bt_peerhistory_get(void* h,
+                                           const char *ip, int ip_len,
+                                           int port)
+{
+    entry_t* e = __find(h, ip, ip_len, port);
+
+    return e ? &e->h : NULL;
+}
+
+static void __backoff(bt_peerhistory_entry_t* h, unsigned long long now_ms)
+{
+    unsigned long long ms = BT_PEERHISTORY_MAX_BACKOFF_MS;
+
+    h->failures++;
+    if (h->failures < 20)
+    {
+        ms = (unsigned long long)BT_PEERHISTORY_BACKOFF_MS <<
+            (h->failures - 1);
+        if (BT_PEERHISTORY_MAX_BACKOFF_MS < ms)
+            ms = BT_PEERHISTORY_MAX_BACKOFF_MS;
+    }
+    h->retry_ms = now_ms + ms;
+}
+
+void bt_peerhistory_connect_failed(void* h, const char *ip, int ip_len,
+                                   int port, unsigned long long now_ms)
+{
+    __backoff(&__touch(h, ip, ip_len, port)->h, now_ms);
+}
+
+void bt_peerhistory_connected(void* h, const char *ip, int ip_len, int port,
+                              unsigned long long now_ms)
+{
+    __touch(h, ip, ip_len, port)->h.last_seen_ms = now_ms;
+}
+
+void bt_peerhistory_disconnected(void* h, const char *ip, int ip_len,
+                                 int port,
+                                 unsigned long long downloaded,
+                                 unsigned long long uploaded,
+                                 int drate,
+                                 unsigned long long now_ms)
+{
+    bt_peerhistory_entry_t* e = &__touch(h, ip, ip_len, port)->h;
+
+    e->downloaded += downloaded;
+    e->uploaded += uploaded;
+    if (e->drate < drate)
+        e->drate = drate;
+    e->last_seen_ms = now_ms;
+
+    if (0 == downloaded + uploaded)
+        __backoff(e, now_ms);
+    else
+    {
+        e->failures = 0;
+        e->retry_ms = 0;
+    }
+}
+
+void bt_peerhistory_blacklisted(void* h, const char *ip, int ip_len,
+                                int port)
+{
+    __touch(h, ip, ip_len, port)->h.blacklisted++;
+}
+
+int bt_peerhistory_may_connect(void* h, const char *ip, int ip_len, int port,
+                               unsigned long long now_ms)
+{
+    entry_t* e = __find(h, ip, ip_len, port);
+
+    return !e || e->h.retry_ms <= now_ms;
+}
+
+unsigned int bt_peerhistory_score(void* h, const char *ip, int ip_len,
+                                  int port)
+{
+    entry_t* e = __find(h, ip, ip_len, port);
+
+    if (!e)
+        return 1;
+    if (0 < e->h.blacklisted)
+        return 0;
+    return 1 + e->h.drate;
+}
+
+int bt_peerhistory_count(void* h)
+{
+    history_t* me = h;
+
+    return hashmap_count(me->entries);
+}
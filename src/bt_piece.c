@@ -21,8 +21,10 @@
 
 /* for bt_piece_write_block return codes */
 #include "bt_piece.h"
+#include "bt_util.h"
 
-#include "sha1.h"
+#include "bt_sha1.h"
+#include "bt_sha256.h"
 #include "chunkybar.h"
 #include "avl_tree.h"
 
@@ -38,45 +40,670 @@ enum
     VALIDITY_INVALID
 };
 
-typedef struct
+/* which progress is being tracked */
+enum
 {
-    int idx;
+    PROGRESS_DOWNLOADED,
+    PROGRESS_REQUESTED,
+    PROGRESS_N
+};
 
+/* pieces with up to this many blocks keep their bitmaps inside the piece */
+#define BT_PIECE_INLINE_BLOCKS 256
+
+/**
+ * Download state. Only allocated while the piece is in flight */
+typedef struct
+{
     /* for marking peers as invalid piece givers */
     avltree_t* peers;
 
-    int validity;
+    /* block progress, indexed by PROGRESS_*.
+     * Bit i covers bytes [i * blk_size, (i + 1) * blk_size).
+     * A block is free, requested, or requested and downloaded. The bits and
+     * nset are only changed atomically, so blocks can be claimed, given back
+     * and marked downloaded from several threads */
+    unsigned int blk_size;
+    unsigned int nblocks;
+
+    /* log2 of blk_size, so block indexes are a shift; -1 if blk_size
+     * isn't a power of two */
+    int blk_shift;
+    uint32_t *bits[PROGRESS_N];
+    unsigned int nset[PROGRESS_N];
+    uint32_t inline_bits[PROGRESS_N][BT_PIECE_INLINE_BLOCKS / 32];
+
+    /* byte ranges, used instead of the bitmaps once a range that isn't
+     * block aligned is seen. NULL until then */
+    chunkybar_t *progress[PROGRESS_N];
+
+    /* running hash over the contiguous prefix of blocks we've received.
+     * NULL until the first block at hashed_bytes arrives */
+    bt_sha1_ctx_t *hash_ctx;
+
+    /* number of bytes absorbed into hash_ctx */
+    unsigned int hashed_bytes;
+
+    /* blocks received ahead of hashed_bytes, sorted by offset */
+    struct __pending_block_s *hash_pending;
+
+    /* a block was rewritten after being hashed; hash_ctx can't be trusted */
+    int hash_stale;
+
+    /* v2: SHA256 of each block, hashed as it was written or given by
+     * bt_piece_set_block_hashes. NULL until then */
+    char *leaves;
+
+    /* the leaves came from bt_piece_set_block_hashes and match the root,
+     * so blocks that don't match their leaf are refused */
+    int leaves_verified;
+
+    /* a write wasn't a single block, so the leaves don't cover it */
+    int leaves_stale;
+
+    /* the peer that sent each block. Only tracked while progress is kept
+     * in the bitmaps */
+    void **blk_peer;
+
+    /* the hash (SHA1, or the leaf for v2) and sender of each block of the
+     * first download that failed validation. NULL unless it has failed;
+     * see bt_piece_drop_blocks */
+    char *failed_hash;
+    void **failed_peer;
+} __piece_state_t;
+
+/* A piece that isn't in flight is only this, so it's kept small; a seeded
+ * torrent has one for every piece */
+typedef struct
+{
+    int idx;
 
     int piece_length;
 
-    /* downloaded: we have this block downloaded */
-    chunkybar_t *progress_downloaded;
-
-    /* we have requested this block */
-    chunkybar_t *progress_requested;
-
-    char *sha1;
-
     /* modification time */
     unsigned int mtime;
 
+    /* VALIDITY_* */
+    unsigned char validity;
+
     /* if we calculate that we are completed, cache this result */
-    int is_completed;
+    unsigned char is_completed;
+
+    /* the download state was released after the piece completed, so every
+     * block counts as downloaded and requested */
+    unsigned char all_downloaded;
+
+    /* whether the piece is counted as downloaded in counts */
+    unsigned char is_downloaded;
+
+    /* tallies shared with the other pieces of our piece db; may be NULL */
+    bt_piece_counts_t *counts;
+
+    /* points at sha1_copy, or at a hash owned by our caller */
+    const char *sha1;
+    char sha1_copy[20];
+
+    /* v2: root of the piece's merkle subtree, owned by our caller, and the
+     * number of leaves the subtree spans. NULL for v1 pieces */
+    const char *root;
+    unsigned int root_width;
+
+    /* peers whose blocks didn't match those of the valid piece */
+    int nculprits;
+    void **culprits;
 
     /* functions and data for reading/writing block data */
     bt_blockrw_i *disk;
     void *disk_udata;
+
+    /* NULL unless the piece is in flight */
+    __piece_state_t *st;
 } __piece_private_t;
 
+typedef struct __pending_block_s
+{
+    struct __pending_block_s *next;
+    unsigned int offset;
+    unsigned int len;
+    char data[];
+} __pending_block_t;
+
 #define priv(x) ((__piece_private_t*)(x))
+#define st(x) (priv(x)->st)
+
+/**
+ * Forget the running hash and any blocks waiting to be hashed */
+static void __hash_reset(bt_piece_t * me)
+{
+    while (st(me)->hash_pending)
+    {
+        __pending_block_t* pb = st(me)->hash_pending;
+        st(me)->hash_pending = pb->next;
+        free(pb);
+    }
+
+    free(st(me)->hash_ctx);
+    st(me)->hash_ctx = NULL;
+    st(me)->hashed_bytes = 0;
+    st(me)->hash_stale = FALSE;
+}
+
+/**
+ * Feed the block into the running hash
+ * Blocks that don't extend the hashed prefix are held until the gap fills */
+static void __hash_block(bt_piece_t * me, const bt_block_t * b,
+                         const void *b_data)
+{
+    __pending_block_t* pb;
+
+    if (st(me)->hash_stale)
+        return;
+
+    if (b->offset < st(me)->hashed_bytes)
+    {
+        /* data we've hashed is being overwritten */
+        st(me)->hash_stale = TRUE;
+        return;
+    }
+
+    if (b->offset > st(me)->hashed_bytes)
+    {
+        __pending_block_t** prev = &st(me)->hash_pending;
+
+        while (*prev && (*prev)->offset < b->offset)
+            prev = &(*prev)->next;
+
+        /* duplicate */
+        if (*prev && (*prev)->offset == b->offset)
+        {
+            st(me)->hash_stale = TRUE;
+            return;
+        }
+
+        pb = malloc(sizeof(__pending_block_t) + b->len);
+        pb->offset = b->offset;
+        pb->len = b->len;
+        memcpy(pb->data, b_data, b->len);
+        pb->next = *prev;
+        *prev = pb;
+        return;
+    }
+
+    if (!st(me)->hash_ctx)
+    {
+        st(me)->hash_ctx = malloc(sizeof(bt_sha1_ctx_t));
+        bt_sha1_init(st(me)->hash_ctx);
+    }
+
+    bt_sha1_update(st(me)->hash_ctx, b_data, b->len);
+    st(me)->hashed_bytes += b->len;
+
+    /* absorb blocks that were waiting on this one */
+    while ((pb = st(me)->hash_pending) &&
+           pb->offset == st(me)->hashed_bytes)
+    {
+        bt_sha1_update(st(me)->hash_ctx, pb->data, pb->len);
+        st(me)->hashed_bytes += pb->len;
+        st(me)->hash_pending = pb->next;
+        free(pb);
+    }
+}
+
+static void __leaves_release(bt_piece_t * me)
+{
+    free(st(me)->leaves);
+    st(me)->leaves = NULL;
+    st(me)->leaves_verified = FALSE;
+    st(me)->leaves_stale = FALSE;
+}
+
+static void __blame_release(bt_piece_t * me)
+{
+    free(st(me)->blk_peer);
+    free(st(me)->failed_hash);
+    free(st(me)->failed_peer);
+    st(me)->blk_peer = NULL;
+    st(me)->failed_hash = NULL;
+    st(me)->failed_peer = NULL;
+}
+
+/**
+ * Size the bitmaps for piece_length. All progress is cleared */
+static void __progress_init(bt_piece_t * me)
+{
+    unsigned int plen = priv(me)->piece_length;
+    int i;
+
+    for (i = 0; i < PROGRESS_N; i++)
+        if (st(me)->bits[i] != st(me)->inline_bits[i])
+            free(st(me)->bits[i]);
+    __blame_release(me);
+    __leaves_release(me);
+
+    st(me)->blk_size = plen < BT_BLOCK_SIZE ? plen : (BT_BLOCK_SIZE);
+    st(me)->blk_shift = bt_pow2_shift(st(me)->blk_size);
+    st(me)->nblocks = 0 == plen ? 0 :
+        (plen + st(me)->blk_size - 1) / st(me)->blk_size;
+    st(me)->blk_peer = calloc(st(me)->nblocks + 1, sizeof(void*));
+
+    for (i = 0; i < PROGRESS_N; i++)
+    {
+        if (st(me)->nblocks <= BT_PIECE_INLINE_BLOCKS)
+        {
+            st(me)->bits[i] = st(me)->inline_bits[i];
+            memset(st(me)->bits[i], 0, sizeof(st(me)->inline_bits[i]));
+        }
+        else
+            st(me)->bits[i] = calloc((st(me)->nblocks + 31) / 32,
+                                     sizeof(uint32_t));
+        st(me)->nset[i] = 0;
+    }
+}
+
+static void __progress_release(bt_piece_t * me)
+{
+    int i;
+
+    for (i = 0; i < PROGRESS_N; i++)
+    {
+        if (st(me)->bits[i] != st(me)->inline_bits[i])
+            free(st(me)->bits[i]);
+        st(me)->bits[i] = NULL;
+        if (st(me)->progress[i])
+            chunky_free(st(me)->progress[i]);
+        st(me)->progress[i] = NULL;
+    }
+    __blame_release(me);
+    __leaves_release(me);
+}
+
+static unsigned int __min(unsigned int a, unsigned int b)
+{
+    return a < b ? a : b;
+}
+
+static int __bit_is_set(const uint32_t* bits, unsigned int i)
+{
+    return (__atomic_load_n(&bits[i / 32], __ATOMIC_ACQUIRE) >> (i % 32)) & 1;
+}
+
+/**
+ * Set or clear block b's bit, keeping nset in step
+ * @return 1 if this call changed the bit; 0 if it already was so */
+static int __bit_mark(bt_piece_t * me, int which, unsigned int b,
+                      int complete)
+{
+    uint32_t *w = &st(me)->bits[which][b / 32], mask = 1u << (b % 32), old;
+
+    if (complete)
+        old = __atomic_fetch_or(w, mask, __ATOMIC_ACQ_REL);
+    else
+        old = __atomic_fetch_and(w, ~mask, __ATOMIC_ACQ_REL);
+
+    if (!(old & mask) == !complete)
+        return 0;
+    __atomic_add_fetch(&st(me)->nset[which],
+                       complete ? 1u : (unsigned int)-1, __ATOMIC_ACQ_REL);
+    return 1;
+}
+
+/**
+ * Claim the first block nobody has requested. Claimers racing on the same
+ * piece each get a different block
+ * @return 1 if block *b was claimed; 0 if every block is requested */
+static int __bit_claim(bt_piece_t * me, unsigned int *b)
+{
+    uint32_t *bits = st(me)->bits[PROGRESS_REQUESTED], old;
+    unsigned int w, nwords = (st(me)->nblocks + 31) / 32;
+
+    for (w = 0; w < nwords; w++)
+    {
+        old = __atomic_load_n(&bits[w], __ATOMIC_ACQUIRE);
+        while (~old)
+        {
+            unsigned int i = __builtin_ctz(~old);
+
+            if (st(me)->nblocks <= w * 32 + i)
+                return 0;
+
+            /* a failed exchange reloads old, and we try its next free bit */
+            if (__atomic_compare_exchange_n(&bits[w], &old, old | 1u << i, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+            {
+                __atomic_add_fetch(&st(me)->nset[PROGRESS_REQUESTED], 1,
+                                   __ATOMIC_ACQ_REL);
+                *b = w * 32 + i;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static unsigned int __blk_len(bt_piece_t * me, unsigned int i)
+{
+    unsigned int off = i * st(me)->blk_size;
+
+    return priv(me)->piece_length - off < st(me)->blk_size ?
+           priv(me)->piece_length - off : st(me)->blk_size;
+}
+
+/**
+ * @return index of the block holding the byte at offset */
+static unsigned int __blk_of(bt_piece_t * me, unsigned int offset)
+{
+    if (0 <= st(me)->blk_shift)
+        return offset >> st(me)->blk_shift;
+    return offset / st(me)->blk_size;
+}
+
+/**
+ * @return how far offset is into its block */
+static unsigned int __blk_rem(bt_piece_t * me, unsigned int offset)
+{
+    if (0 <= st(me)->blk_shift)
+        return offset & (st(me)->blk_size - 1);
+    return offset % st(me)->blk_size;
+}
+
+/**
+ * @return number of blocks, and so of v2 leaves, whether or not the piece
+ *  is in flight */
+static unsigned int __nleaves(bt_piece_t * me)
+{
+    unsigned int plen = priv(me)->piece_length;
+
+    return 0 == plen ? 0 : (plen + (BT_BLOCK_SIZE) - 1) / (BT_BLOCK_SIZE);
+}
+
+/**
+ * @param blk Set to the block's index
+ * @return 1 if the range is exactly one block; otherwise 0 */
+static int __is_single_block(bt_piece_t * me, const bt_block_t * b,
+                             unsigned int *blk)
+{
+    if (0 == st(me)->blk_size || 0 != __blk_rem(me, b->offset) ||
+        st(me)->nblocks <= __blk_of(me, b->offset))
+        return 0;
+    *blk = __blk_of(me, b->offset);
+    return b->len == __blk_len(me, *blk);
+}
+
+/**
+ * Hash block b of the piece's data the way failed_hash keeps it
+ * @return bytes in the hash */
+static unsigned int __hash_blk(bt_piece_t * me, const char *data,
+                               unsigned int b, char *hash)
+{
+    if (priv(me)->root)
+    {
+        bt_sha256(hash, data + b * st(me)->blk_size, __blk_len(me, b));
+        return 32;
+    }
+    bt_sha1(hash, data + b * st(me)->blk_size, __blk_len(me, b));
+    return 20;
+}
+
+/**
+ * Switch to byte range tracking, carrying over the blocks we've marked */
+static void __progress_to_chunky(bt_piece_t * me)
+{
+    unsigned int b;
+    int i;
+
+    for (i = 0; i < PROGRESS_N; i++)
+    {
+        st(me)->progress[i] = chunky_new(priv(me)->piece_length);
+        for (b = 0; b < st(me)->nblocks; b++)
+            if (__bit_is_set(st(me)->bits[i], b))
+                chunky_mark_complete(st(me)->progress[i],
+                                     b * st(me)->blk_size,
+                                     __blk_len(me, b));
+    }
+}
+
+/**
+ * @return 1 if the range covers whole blocks; otherwise 0 */
+static int __is_block_aligned(bt_piece_t * me, unsigned int offset,
+                              unsigned int len)
+{
+    if (0 == len || 0 == st(me)->blk_size)
+        return 0;
+    if (priv(me)->piece_length < offset + len)
+        return 0;
+    if (0 != __blk_rem(me, offset))
+        return 0;
+    return 0 == __blk_rem(me, len) ||
+           offset + len == priv(me)->piece_length;
+}
+
+static void __progress_mark(bt_piece_t * me, int which, unsigned int offset,
+                            unsigned int len, int complete)
+{
+    unsigned int b, end;
+
+    if (!st(me)->progress[which] && !__is_block_aligned(me, offset, len))
+        __progress_to_chunky(me);
+
+    if (st(me)->progress[which])
+    {
+        if (complete)
+            chunky_mark_complete(st(me)->progress[which], offset, len);
+        else
+            chunky_mark_incomplete(st(me)->progress[which], offset, len);
+        return;
+    }
+
+    end = __blk_of(me, offset + len - 1);
+    for (b = __blk_of(me, offset); b <= end; b++)
+        __bit_mark(me, which, b, complete);
+}
+
+static int __progress_is_complete(bt_piece_t * me, int which)
+{
+    if (!st(me))
+        return priv(me)->all_downloaded;
+    if (st(me)->progress[which])
+        return chunky_is_complete(st(me)->progress[which]);
+    return 0 < st(me)->nblocks &&
+           __atomic_load_n(&st(me)->nset[which], __ATOMIC_ACQUIRE) ==
+           st(me)->nblocks;
+}
+
+static int __progress_have(bt_piece_t * me, int which, unsigned int offset,
+                           unsigned int len)
+{
+    unsigned int b, end;
+
+    if (!st(me))
+        return priv(me)->all_downloaded &&
+               offset + len <= (unsigned int)priv(me)->piece_length;
+    if (st(me)->progress[which])
+        return chunky_have(st(me)->progress[which], offset, len);
+
+    if (0 == st(me)->blk_size ||
+        priv(me)->piece_length < offset + len)
+        return 0;
+
+    end = __blk_of(me, offset + len - 1);
+    for (b = __blk_of(me, offset); b <= end; b++)
+        if (!__bit_is_set(st(me)->bits[which], b))
+            return 0;
+    return 1;
+}
+
+/**
+ * Find the first run of incomplete bytes, up to max bytes long
+ * Like chunky_get_incomplete, a complete piece gives an empty run at the end */
+static void __progress_get_incomplete(bt_piece_t * me, int which,
+                                      unsigned int *offset, unsigned int *len,
+                                      unsigned int max)
+{
+    const uint32_t* bits;
+    unsigned int w, b, nwords;
+
+    if (!st(me))
+    {
+        *offset = priv(me)->all_downloaded ? priv(me)->piece_length : 0;
+        *len = priv(me)->all_downloaded ? 0 :
+               __min(max, priv(me)->piece_length);
+        return;
+    }
+
+    if (st(me)->progress[which])
+    {
+        chunky_get_incomplete(st(me)->progress[which], offset, len, max);
+        return;
+    }
+
+    bits = st(me)->bits[which];
+    nwords = (st(me)->nblocks + 31) / 32;
+    b = st(me)->nblocks;
+    for (w = 0; w < nwords; w++)
+    {
+        uint32_t word = __atomic_load_n(&bits[w], __ATOMIC_ACQUIRE);
+
+        if (~word)
+        {
+            b = w * 32 + __builtin_ctz(~word);
+            break;
+        }
+    }
+
+    if (st(me)->nblocks <= b)
+    {
+        *offset = priv(me)->piece_length;
+        *len = 0;
+        return;
+    }
+
+    *offset = b * st(me)->blk_size;
+    *len = 0;
+    for (; b < st(me)->nblocks && *len < max &&
+         !__bit_is_set(bits, b); b++)
+        *len += __blk_len(me, b);
+    if (max < *len)
+        *len = max;
+}
+
+static long __cmp_address(const void *e1, const void *e2)
+{
+    return (unsigned long)e2 - (unsigned long)e1;
+}
+
+/**
+ * Allocate the download state, if the piece doesn't have it yet
+ * @return download state */
+static __piece_state_t* __state(bt_piece_t * me)
+{
+    if (st(me))
+        return st(me);
+
+    st(me) = calloc(1, sizeof(__piece_state_t));
+    st(me)->peers = avltree_new(__cmp_address);
+    __progress_init(me);
+
+    /* the released state had every block, but not their leaves */
+    if (priv(me)->all_downloaded && 0 < priv(me)->piece_length)
+    {
+        __progress_mark(me, PROGRESS_REQUESTED, 0, priv(me)->piece_length,
+                        TRUE);
+        __progress_mark(me, PROGRESS_DOWNLOADED, 0, priv(me)->piece_length,
+                        TRUE);
+        st(me)->leaves_stale = TRUE;
+    }
+    priv(me)->all_downloaded = FALSE;
+    return st(me);
+}
+
+/**
+ * Free the download state. The piece goes back to being lightweight */
+static void __state_release(bt_piece_t * me)
+{
+    if (!st(me))
+        return;
+
+    __hash_reset(me);
+    __progress_release(me);
+    free(st(me)->peers->nodes);
+    free(st(me)->peers);
+    free(st(me));
+    st(me) = NULL;
+}
+
+static void __count(int *count, int delta)
+{
+    __atomic_add_fetch(count, delta, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Set is_completed, keeping counts in step */
+static void __set_completed(bt_piece_t * me, int yes)
+{
+    yes = !!yes;
+    if (priv(me)->is_completed == yes)
+        return;
+    priv(me)->is_completed = yes;
+    if (priv(me)->counts)
+        __count(&priv(me)->counts->ncompleted, yes ? 1 : -1);
+}
+
+/**
+ * Bring is_downloaded, and counts, up to date with the download progress.
+ * Blocks of one piece may be written from several threads, so while blocks
+ * are being written the piece only ever becomes downloaded */
+static void __downloaded_changed(bt_piece_t * me)
+{
+    if (__progress_is_complete(me, PROGRESS_DOWNLOADED))
+    {
+        if (0 == __atomic_exchange_n(&priv(me)->is_downloaded, 1,
+                                     __ATOMIC_SEQ_CST) && priv(me)->counts)
+            __count(&priv(me)->counts->ndownloaded, 1);
+    }
+    else if (1 == __atomic_exchange_n(&priv(me)->is_downloaded, 0,
+                                      __ATOMIC_SEQ_CST) && priv(me)->counts)
+        __count(&priv(me)->counts->ndownloaded, -1);
+}
+
+void bt_piece_set_counts(bt_piece_t * me, bt_piece_counts_t * counts)
+{
+    if (priv(me)->counts)
+    {
+        __count(&priv(me)->counts->ncompleted,
+                -(int)priv(me)->is_completed);
+        __count(&priv(me)->counts->ndownloaded,
+                -(int)priv(me)->is_downloaded);
+    }
+    priv(me)->counts = counts;
+    if (counts)
+    {
+        __count(&counts->ncompleted, priv(me)->is_completed);
+        __count(&counts->ndownloaded, priv(me)->is_downloaded);
+    }
+}
+
+int bt_piece_is_hashed(bt_piece_t * me)
+{
+    if (priv(me)->root)
+        return st(me) && st(me)->leaves && !st(me)->leaves_stale &&
+               !st(me)->progress[PROGRESS_DOWNLOADED] &&
+               __progress_is_complete(me, PROGRESS_DOWNLOADED);
+
+    return st(me) && !st(me)->hash_stale && st(me)->hash_ctx &&
+           st(me)->hashed_bytes == (unsigned int)priv(me)->piece_length;
+}
 
 void* bt_piece_get_peers(bt_piece_t *me, int *iter)
 {
-    for (; *iter < avltree_size(priv(me)->peers); (*iter)++)
+    if (!st(me))
+        return NULL;
+
+    for (; *iter < avltree_size(st(me)->peers); (*iter)++)
     {
         void* k;
 
-        if ((k = avltree_get_from_idx(priv(me)->peers, *iter)))
+        if ((k = avltree_get_from_idx(st(me)->peers, *iter)))
         {
             (*iter)++;
             return k;
@@ -88,7 +715,7 @@ void* bt_piece_get_peers(bt_piece_t *me, int *iter)
 
 int bt_piece_num_peers(bt_piece_t *me)
 {
-    return avltree_count(priv(me)->peers);
+    return st(me) ? avltree_count(st(me)->peers) : 0;
 }
 
 int bt_piece_write_block(
@@ -99,6 +726,10 @@ int bt_piece_write_block(
     void* peer
     )
 {
+    unsigned int blk;
+    char leaf[32];
+    int is_leaf = FALSE;
+
     assert(me);
 
 #if 0 /*  debugging */
@@ -108,7 +739,19 @@ int bt_piece_write_block(
     if (!priv(me)->disk)
         return 0;
 
-    avltree_insert(priv(me)->peers, peer, peer);
+    __state(me);
+
+    /* v2 blocks are checked against their leaf before they're kept */
+    if (priv(me)->root && __is_single_block(me, b, &blk))
+    {
+        bt_sha256(leaf, b_data, b->len);
+        is_leaf = TRUE;
+        if (st(me)->leaves_verified &&
+            0 != memcmp(leaf, st(me)->leaves + blk * 32, 32))
+            return BT_PIECE_WRITE_BLOCK_INVALID;
+    }
+
+    avltree_insert(st(me)->peers, peer, peer);
 
     assert(priv(me)->disk->write_block);
     assert(priv(me)->disk_udata);
@@ -118,23 +761,64 @@ int bt_piece_write_block(
     else
         priv(me)->validity = VALIDITY_NOTCHECKED;
 
+    if (!priv(me)->root)
+        __hash_block(me, b, b_data);
+    else if (is_leaf)
+    {
+        if (!st(me)->leaves)
+            st(me)->leaves = malloc(st(me)->nblocks * 32);
+        memcpy(st(me)->leaves + blk * 32, leaf, 32);
+    }
+    else
+        st(me)->leaves_stale = TRUE;
+
     /* mark progress */
-    chunky_mark_complete(priv(me)->progress_requested, b->offset, b->len);
-    chunky_mark_complete(priv(me)->progress_downloaded, b->offset, b->len);
+    __progress_mark(me, PROGRESS_REQUESTED, b->offset, b->len, TRUE);
+    __progress_mark(me, PROGRESS_DOWNLOADED, b->offset, b->len, TRUE);
+
+    /* remember who to blame if the piece turns out bad */
+    if (!st(me)->progress[PROGRESS_DOWNLOADED])
+    {
+        unsigned int i, end = __blk_of(me, b->offset + b->len - 1);
+
+        for (i = __blk_of(me, b->offset); i <= end; i++)
+            st(me)->blk_peer[i] = peer;
+    }
 
 #if 0 /*  debugging */
     printf("%d left to go: %d/%d\n",
            me->idx,
-           chunky_get_nbytes_completed(priv(me)->progress_downloaded),
-           priv(me)->piece_length);
+           st(me)->nset[PROGRESS_DOWNLOADED], st(me)->nblocks);
 #endif
 
-    if (chunky_is_complete(priv(me)->progress_downloaded))
+    if (__progress_is_complete(me, PROGRESS_DOWNLOADED))
+    {
+        __downloaded_changed(me);
         return BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED;
+    }
 
     return BT_PIECE_WRITE_BLOCK_SUCCESS;
 }
 
+void *bt_piece_get_write_frame(bt_piece_t *me, const bt_block_t * b)
+{
+    if (!priv(me)->disk || !priv(me)->disk->get_write_frame)
+        return NULL;
+
+    /* don't let a peer write over what we already have */
+    if (__progress_have(me, PROGRESS_DOWNLOADED, b->offset, b->len))
+        return NULL;
+
+    return priv(me)->disk->get_write_frame(priv(me)->disk_udata, me, b);
+}
+
+void bt_piece_drop_write_frame(bt_piece_t *me, const bt_block_t * b,
+                               void *frame)
+{
+    if (priv(me)->disk->drop_write_frame)
+        priv(me)->disk->drop_write_frame(priv(me)->disk_udata, me, b, frame);
+}
+
 void *bt_piece_read_block(bt_piece_t *me, void *caller, const bt_block_t * b)
 {
     assert(priv(me)->disk->read_block);
@@ -142,15 +826,34 @@ void *bt_piece_read_block(bt_piece_t *me, void *caller, const bt_block_t * b)
     if (!priv(me)->disk->read_block)
         return NULL;
 
-    if (!chunky_have(priv(me)->progress_downloaded, b->offset, b->len))
+    if (!__progress_have(me, PROGRESS_DOWNLOADED, b->offset, b->len))
         return NULL;
 
     return priv(me)->disk->read_block(priv(me)->disk_udata, me, b);
 }
 
-static long __cmp_address(const void *e1, const void *e2)
+int bt_piece_get_block_file(bt_piece_t *me, const bt_block_t * b,
+                            int *fd, unsigned long long *offset)
 {
-    return (unsigned long)e2 - (unsigned long)e1;
+    if (!priv(me)->disk || !priv(me)->disk->block_file_span)
+        return 0;
+
+    if (!__progress_have(me, PROGRESS_DOWNLOADED, b->offset, b->len))
+        return 0;
+
+    return priv(me)->disk->block_file_span(priv(me)->disk_udata, me, b,
+                                           fd, offset);
+}
+
+void bt_piece_prefetch_block(bt_piece_t *me, const bt_block_t * b)
+{
+    if (!priv(me)->disk || !priv(me)->disk->prefetch_block)
+        return;
+
+    if (!__progress_have(me, PROGRESS_DOWNLOADED, b->offset, b->len))
+        return;
+
+    priv(me)->disk->prefetch_block(priv(me)->disk_udata, me, b);
 }
 
 bt_piece_t *bt_piece_new(
@@ -160,11 +863,8 @@ bt_piece_t *bt_piece_new(
     __piece_private_t *me;
 
     me = calloc(1, sizeof(__piece_private_t));
-    priv(me)->progress_downloaded = chunky_new(piece_bytes_size);
-    priv(me)->progress_requested = chunky_new(piece_bytes_size);
     priv(me)->piece_length = piece_bytes_size;
     priv(me)->is_completed = FALSE;
-    priv(me)->peers = avltree_new(__cmp_address);
     if (sha1sum)
         bt_piece_set_hash((bt_piece_t*)me, sha1sum);
     return (bt_piece_t*)me;
@@ -172,12 +872,36 @@ bt_piece_t *bt_piece_new(
 
 void bt_piece_free(bt_piece_t * me)
 {
-    free(priv(me)->sha1);
-    chunky_free(priv(me)->progress_downloaded);
-    chunky_free(priv(me)->progress_requested);
+    __state_release(me);
+    free(priv(me)->culprits);
     free(me);
 }
 
+bt_piece_t *bt_piece_new_many(const int npieces)
+{
+    /* calloc leaves each piece as bt_piece_new(NULL, 0) would */
+    return calloc(npieces, sizeof(__piece_private_t));
+}
+
+bt_piece_t *bt_piece_nth(bt_piece_t * first, const int n)
+{
+    return (bt_piece_t*)((__piece_private_t*)first + n);
+}
+
+void bt_piece_free_many(bt_piece_t * first, const int npieces)
+{
+    int i;
+
+    for (i = 0; i < npieces; i++)
+    {
+        bt_piece_t *p = bt_piece_nth(first, i);
+
+        __state_release(p);
+        free(priv(p)->culprits);
+    }
+    free(first);
+}
+
 /**
  * Get data via block read */
 static void *__get_data(bt_piece_t * me)
@@ -229,7 +953,7 @@ int bt_piece_is_valid(bt_piece_t * me)
 
 int bt_piece_is_downloaded(bt_piece_t * me)
 {
-    return chunky_is_complete(priv(me)->progress_downloaded);
+    return __progress_is_complete(me, PROGRESS_DOWNLOADED);
 }
 
 int bt_piece_is_complete(bt_piece_t * me)
@@ -237,19 +961,21 @@ int bt_piece_is_complete(bt_piece_t * me)
     if (priv(me)->is_completed)
         return TRUE;
 
+    /* cheap enough for the selector loop: only a valid piece needs its
+     * progress looked at */
+    if (1 != bt_piece_is_valid(me))
+        return FALSE;
+
     unsigned int off, ln;
 
-    chunky_get_incomplete(priv(me)->progress_downloaded, &off, &ln,
-                          priv(me)->piece_length);
+    __progress_get_incomplete(me, PROGRESS_DOWNLOADED, &off, &ln,
+                              priv(me)->piece_length);
 
     /*  if we haven't downloaded any of the file */
     if (0 == off && ln == priv(me)->piece_length)
     {
-        if (1 == bt_piece_is_valid(me))
-        {
-            priv(me)->is_completed = TRUE;
-            return TRUE;
-        }
+        __set_completed(me, TRUE);
+        return TRUE;
     }
 
     return FALSE;
@@ -257,23 +983,38 @@ int bt_piece_is_complete(bt_piece_t * me)
 
 int bt_piece_is_fully_requested(bt_piece_t * me)
 {
-    return chunky_is_complete(priv(me)->progress_requested);
+    return __progress_is_complete(me, PROGRESS_REQUESTED);
 }
 
 void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request)
 {
-    unsigned int offset, len, blk_size;
+    unsigned int offset, len;
 
-    /*  very rare that the standard block size is greater than the piece size
-     *  this should relate to testing only */
-    if (priv(me)->piece_length < BT_BLOCK_SIZE)
-        blk_size = priv(me)->piece_length;
-    else
-        blk_size = BT_BLOCK_SIZE;
+    __state(me);
+
+    if (!st(me)->progress[PROGRESS_REQUESTED])
+    {
+        unsigned int b;
+
+        request->piece_idx = priv(me)->idx;
+        if (__bit_claim(me, &b))
+        {
+            request->offset = b * st(me)->blk_size;
+            request->len = __blk_len(me, b);
+        }
+        else
+        {
+            request->offset = priv(me)->piece_length;
+            request->len = 0;
+        }
+        return;
+    }
 
-    /* create the request by getting an incomplete block */
-    chunky_get_incomplete(priv(me)->progress_requested, &offset, &len,
-                          blk_size);
+    /* create the request by getting an incomplete block.
+     * blk_size is only smaller than BT_BLOCK_SIZE for tiny pieces, which
+     * should relate to testing only */
+    __progress_get_incomplete(me, PROGRESS_REQUESTED, &offset, &len,
+                              st(me)->blk_size);
     request->piece_idx = priv(me)->idx;
     request->offset = offset;
     request->len = len;
@@ -284,31 +1025,152 @@ void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request)
 #endif
 
     /* mark requested counter */
-    chunky_mark_complete(priv(me)->progress_requested, offset, len);
+    if (0 < len)
+        __progress_mark(me, PROGRESS_REQUESTED, offset, len, TRUE);
 }
 
 void bt_piece_giveback_block(bt_piece_t * me, bt_block_t * b)
 {
-    chunky_mark_incomplete(priv(me)->progress_requested, b->offset, b->len);
+    /* nothing has been requested */
+    if (!st(me) && !priv(me)->all_downloaded)
+        return;
+
+    __state(me);
+    __progress_mark(me, PROGRESS_REQUESTED, b->offset, b->len, FALSE);
+}
+
+int bt_piece_get_missing_block(bt_piece_t * me, unsigned int offset,
+                               bt_block_t * b)
+{
+    unsigned int plen = priv(me)->piece_length, len;
+
+    /* nothing has been requested */
+    if (!st(me) || 0 == st(me)->blk_size)
+        return 0;
+
+    if (0 != __blk_rem(me, offset))
+        offset += st(me)->blk_size - __blk_rem(me, offset);
+    for (; offset < plen; offset += st(me)->blk_size)
+    {
+        len = __min(st(me)->blk_size, plen - offset);
+        if (__progress_have(me, PROGRESS_DOWNLOADED, offset, len) ||
+            !__progress_have(me, PROGRESS_REQUESTED, offset, len))
+            continue;
+
+        b->piece_idx = priv(me)->idx;
+        b->offset = offset;
+        b->len = len;
+        return 1;
+    }
+
+    return 0;
+}
+
+int bt_piece_have_block(bt_piece_t * me, const bt_block_t * b)
+{
+    return __progress_have(me, PROGRESS_DOWNLOADED, b->offset, b->len);
 }
 
 void bt_piece_set_complete(bt_piece_t * me, int yes)
 {
-    priv(me)->is_completed = yes;
+    __set_completed(me, yes);
+    if (!yes)
+        return;
+
+    /* as if it had validated; nothing more will be downloaded */
+    __state_release(me);
+    priv(me)->all_downloaded = TRUE;
+    priv(me)->validity = VALIDITY_VALID;
+    __downloaded_changed(me);
 }
 
 void bt_piece_set_size(bt_piece_t * me, const unsigned int piece_bytes_size)
 {
-    chunky_set_max(priv(me)->progress_downloaded, piece_bytes_size);
-    chunky_set_max(priv(me)->progress_requested, piece_bytes_size);
+    int i;
+
+    if (!st(me))
+    {
+        priv(me)->piece_length = piece_bytes_size;
+        return;
+    }
+
+    /* the bitmaps can only be resized while they are empty */
+    if (!st(me)->progress[PROGRESS_DOWNLOADED] &&
+        (st(me)->nset[PROGRESS_DOWNLOADED] ||
+         st(me)->nset[PROGRESS_REQUESTED]))
+        __progress_to_chunky(me);
+
     priv(me)->piece_length = piece_bytes_size;
+    if (!st(me)->progress[PROGRESS_DOWNLOADED])
+        __progress_init(me);
+    else
+        for (i = 0; i < PROGRESS_N; i++)
+            chunky_set_max(st(me)->progress[i], piece_bytes_size);
+    __downloaded_changed(me);
 }
 
 void bt_piece_set_hash(bt_piece_t * me, const char *sha1sum)
 {
     assert(!priv(me)->sha1);
-    priv(me)->sha1 = malloc(20);
-    memcpy(priv(me)->sha1, sha1sum, 20);
+    memcpy(priv(me)->sha1_copy, sha1sum, 20);
+    priv(me)->sha1 = priv(me)->sha1_copy;
+}
+
+void bt_piece_set_hash_ref(bt_piece_t * me, const char *sha1sum)
+{
+    assert(!priv(me)->sha1);
+    priv(me)->sha1 = sha1sum;
+}
+
+void bt_piece_set_root_ref(bt_piece_t * me, const char *root,
+                           unsigned int width)
+{
+    priv(me)->root = root;
+    priv(me)->root_width = width;
+}
+
+const char *bt_piece_get_root(bt_piece_t * me)
+{
+    return priv(me)->root;
+}
+
+int bt_piece_set_block_hashes(bt_piece_t * me, const char *leaves)
+{
+    unsigned int n = __nleaves(me), b;
+    char root[32];
+
+    if (!priv(me)->root ||
+        0 == bt_sha256_merkle_root(root, leaves, n, priv(me)->root_width) ||
+        0 != memcmp(root, priv(me)->root, 32))
+        return 0;
+
+    /* nothing more will be written */
+    if (priv(me)->is_completed)
+        return 1;
+
+    __state(me);
+
+    /* blocks we have that don't match are downloaded again */
+    if (st(me)->leaves && !st(me)->leaves_stale &&
+        !st(me)->progress[PROGRESS_DOWNLOADED])
+        for (b = 0; b < n; b++)
+        {
+            if (!__bit_is_set(st(me)->bits[PROGRESS_DOWNLOADED], b) ||
+                0 == memcmp(st(me)->leaves + b * 32, leaves + b * 32, 32))
+                continue;
+            __progress_mark(me, PROGRESS_REQUESTED, b * st(me)->blk_size,
+                            __blk_len(me, b), FALSE);
+            __progress_mark(me, PROGRESS_DOWNLOADED, b * st(me)->blk_size,
+                            __blk_len(me, b), FALSE);
+            st(me)->blk_peer[b] = NULL;
+        }
+
+    if (!st(me)->leaves)
+        st(me)->leaves = malloc(n * 32);
+    memcpy(st(me)->leaves, leaves, n * 32);
+    st(me)->leaves_verified = TRUE;
+    __downloaded_changed(me);
+    return 1;
 }
 
 void bt_piece_set_idx(bt_piece_t * me, const int idx)
@@ -323,7 +1185,7 @@ int bt_piece_get_idx(bt_piece_t * me)
 
 char *bt_piece_get_hash(bt_piece_t * me)
 {
-    return priv(me)->sha1;
+    return (char*)priv(me)->sha1;
 }
 
 int bt_piece_get_size(bt_piece_t * me)
@@ -339,19 +1201,11 @@ int bt_piece_write_block_to_stream(
     )
 {
     char *data;
-    int i;
 
     if (!(data = __get_data(me)))
         return 0;
 
-    data += blk->offset;
-
-    for (i = 0; i < blk->len; i++)
-    {
-        char val = *(data + i);
-        bitstream_write_byte(msg, val);
-    }
-
+    bitstream_write_bytes(msg, data + blk->offset, blk->len);
     return 1;
 }
 
@@ -367,13 +1221,137 @@ int bt_piece_write_block_to_str(bt_piece_t *me, bt_block_t *blk, char *out)
     return 1;
 }
 
+/**
+ * Forget the blocks sent by suspects, or every block if all is set
+ * @return number of blocks forgotten */
+static unsigned int __drop_blocks(bt_piece_t *me,
+                                  int (*is_suspect)(void* udata, void* peer),
+                                  void* udata, int all)
+{
+    unsigned int b, ndropped = 0;
+
+    for (b = 0; b < st(me)->nblocks; b++)
+    {
+        void* peer = st(me)->blk_peer[b];
+
+        if (!all && peer && !is_suspect(udata, peer))
+            continue;
+
+        __progress_mark(me, PROGRESS_REQUESTED, b * st(me)->blk_size,
+                        __blk_len(me, b), FALSE);
+        __progress_mark(me, PROGRESS_DOWNLOADED, b * st(me)->blk_size,
+                        __blk_len(me, b), FALSE);
+        st(me)->blk_peer[b] = NULL;
+        ndropped++;
+    }
+
+    return ndropped;
+}
+
+int bt_piece_drop_blocks(bt_piece_t *me,
+                         int (*is_suspect)(void* udata, void* peer),
+                         void* udata)
+{
+    unsigned int b, ndropped, hlen = priv(me)->root ? 32 : 20;
+    int retry, use_leaves;
+    char *data = NULL;
+
+    /* blocks can only be blamed if we know who sent each one */
+    if (!st(me) || st(me)->progress[PROGRESS_DOWNLOADED] ||
+        0 == st(me)->nblocks)
+        return 0;
+
+    /* we've already kept some blocks, and that didn't work either */
+    retry = NULL != st(me)->failed_hash;
+
+    if (!retry)
+    {
+        /* v2 leaves are the block hashes; the piece needn't be read */
+        use_leaves = priv(me)->root && bt_piece_is_hashed(me);
+        if (!use_leaves && !(data = __get_data(me)))
+            return 0;
+
+        st(me)->failed_hash = malloc(st(me)->nblocks * hlen);
+        st(me)->failed_peer = malloc(st(me)->nblocks * sizeof(void*));
+        for (b = 0; b < st(me)->nblocks; b++)
+        {
+            if (use_leaves)
+                memcpy(st(me)->failed_hash + b * hlen,
+                       st(me)->leaves + b * 32, 32);
+            else
+                __hash_blk(me, data, b, st(me)->failed_hash + b * hlen);
+            st(me)->failed_peer[b] = st(me)->blk_peer[b];
+        }
+    }
+
+    /* if nobody was suspect, everybody is */
+    if (0 == (ndropped = __drop_blocks(me, is_suspect, udata, retry)))
+        ndropped = __drop_blocks(me, is_suspect, udata, TRUE);
+
+    __hash_reset(me);
+    __downloaded_changed(me);
+    __set_completed(me, FALSE);
+    priv(me)->validity = VALIDITY_NOTCHECKED;
+    return ndropped;
+}
+
+/**
+ * The piece is valid. Senders of blocks that changed since the failed
+ * download sent us bad data */
+static void __blame(bt_piece_t * me)
+{
+    unsigned int b, hlen = priv(me)->root ? 32 : 20;
+    char *data = NULL, hash[32];
+    int i, use_leaves;
+
+    if (!st(me) || !st(me)->failed_hash)
+        return;
+
+    use_leaves = priv(me)->root && bt_piece_is_hashed(me);
+    if (!use_leaves && !(data = __get_data(me)))
+        return;
+
+    for (b = 0; b < st(me)->nblocks; b++)
+    {
+        void* peer = st(me)->failed_peer[b];
+
+        if (!peer)
+            continue;
+
+        if (use_leaves)
+            memcpy(hash, st(me)->leaves + b * 32, 32);
+        else
+            __hash_blk(me, data, b, hash);
+        if (0 == memcmp(hash, st(me)->failed_hash + b * hlen, hlen))
+            continue;
+
+        for (i = 0; i < priv(me)->nculprits; i++)
+            if (priv(me)->culprits[i] == peer)
+                break;
+        if (i < priv(me)->nculprits)
+            continue;
+
+        priv(me)->culprits = realloc(priv(me)->culprits,
+                                     (priv(me)->nculprits + 1) *
+                                     sizeof(void*));
+        priv(me)->culprits[priv(me)->nculprits++] = peer;
+    }
+}
+
+void* bt_piece_pop_culprit(bt_piece_t *me)
+{
+    if (0 == priv(me)->nculprits)
+        return NULL;
+    return priv(me)->culprits[--priv(me)->nculprits];
+}
+
 void bt_piece_drop_download_progress(bt_piece_t *me)
 {
-    avltree_empty(priv(me)->peers);
-    priv(me)->is_completed = 0;
+    __state_release(me);
+    priv(me)->all_downloaded = FALSE;
+    __set_completed(me, FALSE);
+    __downloaded_changed(me);
     priv(me)->validity = VALIDITY_NOTCHECKED;
-    chunky_mark_all_incomplete(priv(me)->progress_downloaded);
-    chunky_mark_all_incomplete(priv(me)->progress_requested);
 }
 
 int bt_piece_calculate_hash(bt_piece_t* me, char *hash)
@@ -383,47 +1361,90 @@ int bt_piece_calculate_hash(bt_piece_t* me, char *hash)
     if (!(data = __get_data(me)))
         return 0;
 
-    SHA1(hash, data, priv(me)->piece_length);
+    bt_sha1(hash, data, priv(me)->piece_length);
     return 1;
 }
 
-int bt_piece_validate(bt_piece_t* me)
+/**
+ * Root of the piece's merkle subtree; from the leaves if they cover the
+ * piece, otherwise from its data
+ * @return 0 on error */
+static int __calculate_root(bt_piece_t* me, char *root)
 {
-    char hash[20];
+    unsigned int n = __nleaves(me), plen = priv(me)->piece_length, i;
+    char *data, *leaves;
+    int ok;
 
-    if (0 == bt_piece_calculate_hash(me, hash))
+    if (bt_piece_is_hashed(me))
+        return bt_sha256_merkle_root(root, st(me)->leaves, n,
+                                     priv(me)->root_width);
+
+    if (!(data = __get_data(me)))
         return 0;
 
-    int ret = memcmp(hash, priv(me)->sha1, 20);
-    if (0 == ret)
+    leaves = malloc(n * 32);
+    for (i = 0; i < n; i++)
+        bt_sha256(leaves + i * 32, data + i * (BT_BLOCK_SIZE),
+                  __min(BT_BLOCK_SIZE, plen - i * (BT_BLOCK_SIZE)));
+    ok = bt_sha256_merkle_root(root, leaves, n, priv(me)->root_width);
+    free(leaves);
+    return ok;
+}
+
+/**
+ * Record the outcome of validating the piece
+ * @return BT_PIECE_VALIDATE_COMPLETE_PIECE if valid; otherwise
+ *  BT_PIECE_VALIDATE_INVALID_PIECE */
+static int __validated(bt_piece_t* me, int valid)
+{
+    if (valid)
     {
         priv(me)->validity = VALIDITY_VALID;
-        priv(me)->is_completed = TRUE;
+        __set_completed(me, TRUE);
+        __blame(me);
+        /* nothing more will be downloaded for this piece */
+        __state_release(me);
+        priv(me)->all_downloaded = TRUE;
+        __downloaded_changed(me);
         return BT_PIECE_VALIDATE_COMPLETE_PIECE;
     }
-    else
+
+    priv(me)->validity = VALIDITY_INVALID;
+    __set_completed(me, FALSE);
+    return BT_PIECE_VALIDATE_INVALID_PIECE;
+}
+
+int bt_piece_validate(bt_piece_t* me)
+{
+    char hash[32];
+
+    /* v2 pieces are checked against their merkle root alone */
+    if (priv(me)->root)
     {
-        priv(me)->validity = VALIDITY_INVALID;
-        priv(me)->is_completed = FALSE;
-        return BT_PIECE_VALIDATE_INVALID_PIECE;
+        if (0 == __calculate_root(me, hash))
+            return BT_PIECE_VALIDATE_ERROR;
+        return __validated(me, 0 == memcmp(hash, priv(me)->root, 32));
     }
 
-#if 0 /* debugging */
+    /* the blocks have already been hashed as they arrived */
+    if (bt_piece_is_hashed(me))
     {
-        int ii;
-
-//        printf("(idx:%d) Expected: ", me->idx);
-        for (ii = 0; ii < 20; ii++)
-            printf("%02x ", ((unsigned char*)priv(me)->sha1)[ii]);
-        printf("\n");
+        bt_sha1_ctx_t ctx;
 
-        printf("         File calc: ");
-        for (ii = 0; ii < 20; ii++)
-            printf("%02x ", ((unsigned char*)hash)[ii]);
-        printf("\n");
+        memcpy(&ctx, st(me)->hash_ctx, sizeof(bt_sha1_ctx_t));
+        bt_sha1_final(&ctx, hash);
+        return bt_piece_validate_hash(me, hash);
     }
-#endif
-    return BT_PIECE_VALIDATE_ERROR;
+
+    if (0 == bt_piece_calculate_hash(me, hash))
+        return 0;
+
+    return bt_piece_validate_hash(me, hash);
+}
+
+int bt_piece_validate_hash(bt_piece_t* me, const char* hash)
+{
+    return __validated(me, 0 == memcmp(hash, priv(me)->sha1, 20));
 }
 
 void bt_piece_set_mtime(bt_piece_t * me, unsigned int mtime)
@@ -431,8 +1452,110 @@ void bt_piece_set_mtime(bt_piece_t * me, unsigned int mtime)
     priv(me)->mtime = mtime;
 }
 
+unsigned int bt_piece_get_nblocks(bt_piece_t * me)
+{
+    unsigned int plen = priv(me)->piece_length,
+                 blk = plen < BT_BLOCK_SIZE ? plen : (BT_BLOCK_SIZE);
+
+    return 0 == plen ? 0 : (plen + blk - 1) / blk;
+}
+
+int bt_piece_get_block_progress(bt_piece_t * me, unsigned char *bits)
+{
+    unsigned int b;
+    int n = 0;
+
+    if (bits)
+        memset(bits, 0, bt_piece_get_nblocks(me) / 8 + 1);
+    if (!st(me))
+        return 0;
+    if (st(me)->progress[PROGRESS_DOWNLOADED])
+        return -1;
+
+    for (b = 0; b < st(me)->nblocks; b++)
+        if (__bit_is_set(st(me)->bits[PROGRESS_DOWNLOADED], b))
+        {
+            if (bits)
+                bits[b / 8] |= 1 << (b % 8);
+            n++;
+        }
+    return n;
+}
+
+int bt_piece_set_block_progress(bt_piece_t * me, const unsigned char *bits,
+                                unsigned int nblocks)
+{
+    unsigned int b;
+
+    if (nblocks != bt_piece_get_nblocks(me) || priv(me)->is_completed)
+        return 0;
+
+    __state(me);
+    if (st(me)->progress[PROGRESS_DOWNLOADED])
+        return 0;
+
+    for (b = 0; b < nblocks; b++)
+        if ((bits[b / 8] >> (b % 8)) & 1)
+        {
+            __progress_mark(me, PROGRESS_REQUESTED, b * st(me)->blk_size,
+                            __blk_len(me, b), TRUE);
+            __progress_mark(me, PROGRESS_DOWNLOADED, b * st(me)->blk_size,
+                            __blk_len(me, b), TRUE);
+        }
+
+    st(me)->hash_stale = TRUE;
+    st(me)->leaves_stale = TRUE;
+    priv(me)->validity = VALIDITY_NOTCHECKED;
+    __downloaded_changed(me);
+    return 1;
+}
+
+int bt_piece_flush(bt_piece_t * me)
+{
+    bt_block_t blk;
+
+    if (!priv(me)->disk || !priv(me)->disk->flush_block)
+        return 1;
+
+    blk.piece_idx = priv(me)->idx;
+    blk.offset = 0;
+    blk.len = priv(me)->piece_length;
+    return priv(me)->disk->flush_block(priv(me)->disk_udata, me, &blk);
+}
+
 unsigned int bt_piece_get_mtime(bt_piece_t * me)
 {
     return priv(me)->mtime;
 }
 
+unsigned long bt_piece_get_memory(bt_piece_t * me)
+{
+    unsigned long n = sizeof(__piece_private_t) +
+        priv(me)->nculprits * sizeof(void*);
+    __pending_block_t *pb;
+    int i;
+
+    if (!st(me))
+        return n;
+
+    n += sizeof(__piece_state_t) + (st(me)->nblocks + 1) * sizeof(void*);
+    for (i = 0; i < PROGRESS_N; i++)
+    {
+        if (st(me)->bits[i] && st(me)->bits[i] != st(me)->inline_bits[i])
+            n += (st(me)->nblocks + 31) / 32 * sizeof(uint32_t);
+        /* about what a chunk costs in either chunkybar */
+        if (st(me)->progress[i])
+            n += chunky_get_num_chunks(st(me)->progress[i]) *
+                4 * sizeof(void*);
+    }
+    if (st(me)->hash_ctx)
+        n += sizeof(bt_sha1_ctx_t);
+    for (pb = st(me)->hash_pending; pb; pb = pb->next)
+        n += sizeof(__pending_block_t) + pb->len;
+    if (st(me)->leaves)
+        n += st(me)->nblocks * 32;
+    if (st(me)->failed_hash)
+        n += st(me)->nblocks * ((priv(me)->root ? 32 : 20) + sizeof(void*));
+    return n;
+}
+
@@ -24,39 +24,45 @@
 #include "bt_piece_db.h"
 #include "bt_piece.h"
 
-#include "linked_list_hashmap.h"
-
-/* for finding empty slots */
-#include "chunkybar.h"
-
 typedef struct
 {
-    /* piece map */
-    hashmap_t *pmap;
+    /* pieces indexed by piece idx. Empty slots are NULL */
+    bt_piece_t **pieces;
 
-    chunkybar_t *space;
+    /* size of pieces array */
+    unsigned int size;
 
-    int tot_file_size_bytes;
+    /* number of pieces in the array */
+    int count;
+
+    /* 64 bit, as torrents can be bigger than 4GB */
+    unsigned long long tot_file_size_bytes;
 
     /*  reader and writer of blocks to disk */
     bt_blockrw_i *blockrw;
     void *blockrw_data;
 
+    /* kept up to date by the pieces themselves */
+    bt_piece_counts_t counts;
 } bt_piecedb_private_t;
 
 #define priv(x) ((bt_piecedb_private_t*)(x))
 
-static unsigned long __piece_hash(const void *obj)
+/**
+ * Grow the pieces array so that it holds at least size pieces */
+static void __ensure_size(bt_piecedb_t * db, unsigned int size)
 {
-    const unsigned long p = (unsigned long)obj;
-    return p;
-}
+    unsigned int n;
 
-static long __piece_cmp(const void *obj, const void *other)
-{
-    const unsigned long p1 = (unsigned long)obj;
-    const unsigned long p2 = (unsigned long)other;
-    return p2 - p1;
+    if (size <= priv(db)->size)
+        return;
+
+    for (n = priv(db)->size ? priv(db)->size : 16; n < size; n *= 2)
+        ;
+    priv(db)->pieces = realloc(priv(db)->pieces, n * sizeof(bt_piece_t*));
+    memset(priv(db)->pieces + priv(db)->size, 0,
+           (n - priv(db)->size) * sizeof(bt_piece_t*));
+    priv(db)->size = n;
 }
 
 bt_piecedb_t *bt_piecedb_new()
@@ -65,18 +71,16 @@ bt_piecedb_t *bt_piecedb_new()
 
     db = calloc(1, sizeof(bt_piecedb_private_t));
     priv(db)->tot_file_size_bytes = 0;
-    priv(db)->pmap = hashmap_new(__piece_hash, __piece_cmp, 11);
-    priv(db)->space = chunky_new(1 << 31);
     return db;
 }
 
 void bt_piecedb_set_tot_file_size(bt_piecedb_t * db,
-                                  const int tot_file_size_bytes)
+                                  const unsigned long long tot_file_size_bytes)
 {
     priv(db)->tot_file_size_bytes = tot_file_size_bytes;
 }
 
-int bt_piecedb_get_tot_file_size(bt_piecedb_t * db)
+unsigned long long bt_piecedb_get_tot_file_size(bt_piecedb_t * db)
 {
     return priv(db)->tot_file_size_bytes;
 }
@@ -103,12 +107,14 @@ void *bt_piecedb_get(void* dbo, const unsigned int idx)
 {
     bt_piecedb_t * db = dbo;
 
-    return hashmap_get(priv(db)->pmap, (void*)((unsigned long)idx+1));
+    if (priv(db)->size <= idx)
+        return NULL;
+    return priv(db)->pieces[idx];
 }
 
 int bt_piecedb_count(bt_piecedb_t * db)
 {
-    return hashmap_count(priv(db)->pmap);
+    return priv(db)->count;
 }
 
 int bt_piecedb_add_with_hash_and_size(bt_piecedb_t * db,
@@ -121,91 +127,128 @@ int bt_piecedb_add_with_hash_and_size(bt_piecedb_t * db,
     return i;
 }
 
-int bt_piecedb_add(bt_piecedb_t * db, unsigned int npieces)
+/**
+ * @return idx of the first empty slot */
+static unsigned int __first_free(bt_piecedb_t * db)
 {
-    unsigned int idx, len;
+    unsigned int idx;
 
-    /* get space for this block of pieces */
-    chunky_get_incomplete(priv(db)->space, &idx, &len, npieces);
-    assert(len == npieces);
-    return bt_piecedb_add_at_idx(db, npieces, idx);
+    for (idx = 0; idx < priv(db)->size && priv(db)->pieces[idx]; idx++)
+        ;
+    return idx;
 }
 
-int bt_piecedb_add_at_idx(bt_piecedb_t * db, unsigned int npieces, int idx)
+/**
+ * @param many Pieces from bt_piece_new_many; NULL to allocate each piece on
+ *  its own
+ * @return idx, otherwise -1 if a slot is taken */
+static int __add_at_idx(bt_piecedb_t * db, unsigned int npieces, int idx,
+                        bt_piece_t *many)
 {
-    if (chunky_have(priv(db)->space,idx, npieces))
-        return -1;
+    int i;
+
+    for (i=0; i<npieces; i++)
+        if (bt_piecedb_get(db, idx + i))
+            return -1;
 
-    chunky_mark_complete(priv(db)->space, idx, npieces);
+    __ensure_size(db, idx + npieces);
 
-    int i;
     for (i=0; i<npieces; i++)
     {
-        bt_piece_t *p = bt_piece_new(NULL, 0);
+        bt_piece_t *p = many ? bt_piece_nth(many, i) : bt_piece_new(NULL, 0);
         bt_piece_set_disk_blockrw(p, priv(db)->blockrw, priv(db)->blockrw_data);
         bt_piece_set_idx(p, idx + i);
-        hashmap_put(priv(db)->pmap,
-            (void*)((unsigned long)bt_piece_get_idx(p)+1), p);
+        bt_piece_set_counts(p, &priv(db)->counts);
+        priv(db)->pieces[idx + i] = p;
     }
+    priv(db)->count += npieces;
 
     return idx;
 }
 
-void bt_piecedb_remove(bt_piecedb_t * db, int idx)
+int bt_piecedb_add_from_info(bt_piecedb_t * db, const bt_piece_info_t* info)
 {
-    // TODO memleak here?
-    hashmap_remove(priv(db)->pmap, (void*)((unsigned long)idx+1));
-    chunky_mark_incomplete(priv(db)->space, idx, 1);
-}
+    int i, idx, last_len;
+    long long left;
+    bt_piece_t *many;
 
-int bt_piecedb_get_num_downloaded(bt_piecedb_t * db)
-{
-    int ii, downloaded = 0;
+    if (info->npieces <= 0)
+        return -1;
 
-    for (ii = 0; ii < bt_piecedb_get_length(db); ii++)
+    /* the whole piece set is one allocation */
+    many = bt_piece_new_many(info->npieces);
+    if (-1 == (idx = __add_at_idx(db, info->npieces, __first_free(db), many)))
     {
-        bt_piece_t *p = bt_piecedb_get(db, ii);
-        if (bt_piece_is_downloaded(p))
-            downloaded += 1;
+        bt_piece_free_many(many, info->npieces);
+        return -1;
     }
 
-    return downloaded;
+    /* the last piece holds whatever is left of the files */
+    left = (long long)priv(db)->tot_file_size_bytes -
+           (long long)(info->npieces - 1) * info->piece_len;
+    last_len = left <= 0 || info->piece_len < left ?
+               info->piece_len : (int)left;
+
+    for (i = 0; i < info->npieces; i++)
+    {
+        void *p = bt_piecedb_get(db, idx + i);
+
+        if (info->pieces_hash)
+            bt_piece_set_hash_ref(p, info->pieces_hash + i * 20);
+        if (info->pieces_root)
+            bt_piece_set_root_ref(p, info->pieces_root + i * 32,
+                                  info->piece_len < BT_BLOCK_SIZE ? 1 :
+                                  info->piece_len / (BT_BLOCK_SIZE));
+        bt_piece_set_size(p, i == info->npieces - 1 ?
+                          last_len : info->piece_len);
+    }
+
+    return idx;
 }
 
-int bt_piecedb_get_num_completed(bt_piecedb_t * db)
+int bt_piecedb_add(bt_piecedb_t * db, unsigned int npieces)
 {
-    int ii, cnt = 0;
+    /* get space for this block of pieces */
+    return bt_piecedb_add_at_idx(db, npieces, __first_free(db));
+}
 
-    for (ii = 0; ii < bt_piecedb_get_length(db); ii++)
-    {
-        bt_piece_t *p = bt_piecedb_get(db, ii);
-        if (bt_piece_is_complete(p))
-            cnt += 1;
-    }
+int bt_piecedb_add_at_idx(bt_piecedb_t * db, unsigned int npieces, int idx)
+{
+    return __add_at_idx(db, npieces, idx, NULL);
+}
 
-    return cnt;
+void bt_piecedb_remove(bt_piecedb_t * db, int idx)
+{
+    // TODO memleak here?
+    if (!bt_piecedb_get(db, idx))
+        return;
+    bt_piece_set_counts(priv(db)->pieces[idx], NULL);
+    priv(db)->pieces[idx] = NULL;
+    priv(db)->count--;
 }
 
-int bt_piecedb_get_length(bt_piecedb_t * db)
+int bt_piecedb_get_num_downloaded(bt_piecedb_t * db)
 {
-    return hashmap_count(priv(db)->pmap);
+    return __atomic_load_n(&priv(db)->counts.ndownloaded, __ATOMIC_SEQ_CST);
 }
 
-int bt_piecedb_all_pieces_are_complete(bt_piecedb_t* db)
+int bt_piecedb_get_num_completed(bt_piecedb_t * db)
 {
-    int ii;
+    return __atomic_load_n(&priv(db)->counts.ncompleted, __ATOMIC_SEQ_CST);
+}
 
-    for (ii = 0; ii < bt_piecedb_get_length(db); ii++)
-    {
-        bt_piece_t *pce = bt_piecedb_get(db, ii);
-        if (!bt_piece_is_complete(pce))
-            return 0;
-    }
+int bt_piecedb_get_length(bt_piecedb_t * db)
+{
+    return priv(db)->count;
+}
 
-    return 1;
+int bt_piecedb_all_pieces_are_complete(bt_piecedb_t* db)
+{
+    return bt_piecedb_get_num_completed(db) == bt_piecedb_get_length(db);
 }
 
-void bt_piecedb_increase_piece_space(bt_piecedb_t* db, const int size)
+void bt_piecedb_increase_piece_space(bt_piecedb_t* db,
+                                     const unsigned long long size)
 {
     bt_piecedb_set_tot_file_size(db,
             bt_piecedb_get_tot_file_size(db) + size);
@@ -0,0 +1,361 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Fast resume record
+ * @desc Layout, all integers big endian:
+ *       magic[8] infohash[20] npieces:u32 piece_len:u32 nfiles:u32
+ *       nfiles * { pathlen:u32 path[pathlen] size:u64 mtime:u64 }
+ *       npieces * { complete:u8 mtime:u32 }
+ *       npartial:u32 npartial * { idx:u32 nblocks:u32 bits[nblocks / 8 + 1] }
+ *       Partial pieces are those in flight; bits are the blocks that have
+ *       been written back to the disk. Records from before partial pieces
+ *       were kept have the old magic and end after the pieces.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "bt.h"
+#include "bt_piece.h"
+#include "bt_resume.h"
+
+#include "linked_list_queue.h"
+
+#define MAGIC "YABTRSM2"
+#define MAGIC_V1 "YABTRSM1"
+
+/* most blocks a partial piece can be saved with */
+#define MAX_BLOCKS (1 << 20)
+
+typedef struct
+{
+    char* path;
+    unsigned long size;
+} file_t;
+
+typedef struct
+{
+    /* files in torrent order */
+    linked_list_queue_t* files;
+} resume_t;
+
+void *bt_resume_new()
+{
+    resume_t* me = calloc(1, sizeof(resume_t));
+
+    me->files = llqueue_new();
+    return me;
+}
+
+void bt_resume_free(void* me_)
+{
+    resume_t* me = me_;
+    file_t* f;
+
+    while ((f = llqueue_poll(me->files)))
+    {
+        free(f->path);
+        free(f);
+    }
+    llqueue_free(me->files);
+    free(me);
+}
+
+void bt_resume_add_file(void* me_, const char* path, const unsigned long size)
+{
+    resume_t* me = me_;
+    file_t* f = malloc(sizeof(file_t));
+
+    f->path = strdup(path);
+    f->size = size;
+    llqueue_offer(me->files, f);
+}
+
+static int __write_uint(FILE* fp, uint64_t v, int nbytes)
+{
+    for (; 0 < nbytes; nbytes--)
+        if (EOF == fputc((int)((v >> ((nbytes - 1) * 8)) & 0xff), fp))
+            return 0;
+    return 1;
+}
+
+static int __read_uint(FILE* fp, uint64_t* v, int nbytes)
+{
+    for (*v = 0; 0 < nbytes; nbytes--)
+    {
+        int c;
+
+        if (EOF == (c = fgetc(fp)))
+            return 0;
+        *v = (*v << 8) | (unsigned char)c;
+    }
+    return 1;
+}
+
+/**
+ * @return mtime of file; 0 if the file doesn't exist */
+static uint64_t __file_mtime(const char* path, uint64_t* size)
+{
+    struct stat st;
+
+    if (0 != stat(path, &st))
+    {
+        *size = 0;
+        return 0;
+    }
+
+    *size = st.st_size;
+    return st.st_mtime;
+}
+
+int bt_resume_save(void* me_, const char* path, const char* infohash,
+                   bt_piecedb_i* ipdb, void* pdb,
+                   int npieces, int piece_len)
+{
+    resume_t* me = me_;
+    char* tmp, *flushed;
+    unsigned char* bits = NULL;
+    FILE* fp;
+    int i, ok = 1, npartial = 0;
+
+    if (!(tmp = malloc(strlen(path) + 5)))
+        return 0;
+    sprintf(tmp, "%s.tmp", path);
+
+    /* flush before the files are stat'd, so that their mtimes cover what's
+     * been written back. Pieces that can't be flushed aren't kept */
+    flushed = calloc(npieces + 1, 1);
+    for (i = 0; i < npieces; i++)
+    {
+        void* p = ipdb->get_piece(pdb, i);
+
+        if (!p)
+            continue;
+        if (bt_piece_is_complete(p))
+            flushed[i] = bt_piece_flush(p);
+        else if (0 < bt_piece_get_block_progress(p, NULL) &&
+                 (flushed[i] = bt_piece_flush(p)))
+            npartial++;
+    }
+
+    if (!(fp = fopen(tmp, "wb")))
+    {
+        free(flushed);
+        free(tmp);
+        return 0;
+    }
+
+    ok &= 1 == fwrite(MAGIC, 8, 1, fp);
+    ok &= 1 == fwrite(infohash, 20, 1, fp);
+    ok &= __write_uint(fp, npieces, 4);
+    ok &= __write_uint(fp, piece_len, 4);
+    ok &= __write_uint(fp, llqueue_count(me->files), 4);
+
+    for (i = 0; i < llqueue_count(me->files); i++)
+    {
+        /* rotate the queue so it keeps its order */
+        file_t* f = llqueue_poll(me->files);
+        uint64_t size, mtime;
+
+        mtime = __file_mtime(f->path, &size);
+        ok &= __write_uint(fp, strlen(f->path), 4);
+        ok &= 1 == fwrite(f->path, strlen(f->path), 1, fp);
+        ok &= __write_uint(fp, size, 8);
+        ok &= __write_uint(fp, mtime, 8);
+        llqueue_offer(me->files, f);
+    }
+
+    for (i = 0; i < npieces; i++)
+    {
+        void* p = ipdb->get_piece(pdb, i);
+
+        ok &= __write_uint(fp, p && bt_piece_is_complete(p) && flushed[i], 1);
+        ok &= __write_uint(fp, p ? bt_piece_get_mtime(p) : 0, 4);
+    }
+
+    ok &= __write_uint(fp, npartial, 4);
+    for (i = 0; i < npieces; i++)
+    {
+        void* p;
+        unsigned int nblocks;
+
+        p = ipdb->get_piece(pdb, i);
+        if (!flushed[i] || bt_piece_is_complete(p))
+            continue;
+        nblocks = bt_piece_get_nblocks(p);
+        bits = realloc(bits, nblocks / 8 + 1);
+        bt_piece_get_block_progress(p, bits);
+        ok &= __write_uint(fp, i, 4);
+        ok &= __write_uint(fp, nblocks, 4);
+        ok &= 1 == fwrite(bits, nblocks / 8 + 1, 1, fp);
+    }
+    free(bits);
+    free(flushed);
+
+    if (0 != fclose(fp))
+        ok = 0;
+
+    if (ok && 0 != rename(tmp, path))
+        ok = 0;
+
+    if (!ok)
+        remove(tmp);
+
+    free(tmp);
+    return ok;
+}
+
+/**
+ * Mark pieces covered by [offset, offset + size) as untrustworthy */
+static void __mark_changed(char* changed, uint64_t offset, uint64_t size,
+                           int npieces, int piece_len)
+{
+    uint64_t i;
+
+    if (0 == size)
+        return;
+
+    for (i = offset / piece_len;
+         i <= (offset + size - 1) / piece_len && i < (uint64_t)npieces; i++)
+        changed[i] = 1;
+}
+
+int bt_resume_load(void* me_, const char* path, const char* infohash,
+                   bt_piecedb_i* ipdb, void* pdb,
+                   int npieces, int piece_len)
+{
+    resume_t* me = me_;
+    char magic[8], ih[20], *changed = NULL, *complete = NULL;
+    uint64_t v, nfiles, npartial = 0, offset = 0, *mtimes = NULL;
+    unsigned char* bits = NULL;
+    FILE* fp;
+    int i, nrestored = 0, v1;
+
+    if (!(fp = fopen(path, "rb")))
+        return -1;
+
+    if (1 != fread(magic, 8, 1, fp) ||
+        (0 != memcmp(magic, MAGIC, 8) && 0 != memcmp(magic, MAGIC_V1, 8)) ||
+        1 != fread(ih, 20, 1, fp) || 0 != memcmp(ih, infohash, 20))
+        goto fail;
+    v1 = 0 == memcmp(magic, MAGIC_V1, 8);
+
+    if (!__read_uint(fp, &v, 4) || v != (uint64_t)npieces ||
+        !__read_uint(fp, &v, 4) || v != (uint64_t)piece_len ||
+        !__read_uint(fp, &nfiles, 4))
+        goto fail;
+
+    changed = calloc(npieces + 1, 1);
+
+    for (i = 0; (uint64_t)i < nfiles; i++)
+    {
+        uint64_t len, size, mtime, cur_size, cur_mtime;
+        file_t* f = NULL;
+        char* fpath;
+        int j;
+
+        if (!__read_uint(fp, &len, 4) || 4096 < len)
+            goto fail;
+        fpath = calloc(len + 1, 1);
+        if (len != fread(fpath, 1, len, fp) ||
+            !__read_uint(fp, &size, 8) || !__read_uint(fp, &mtime, 8))
+        {
+            free(fpath);
+            goto fail;
+        }
+
+        cur_mtime = __file_mtime(fpath, &cur_size);
+
+        /* the file's place within the torrent comes from the current layout */
+        for (j = 0; j < llqueue_count(me->files); j++)
+        {
+            file_t* f2 = llqueue_poll(me->files);
+            if (j == i)
+                f = f2;
+            llqueue_offer(me->files, f2);
+        }
+
+        if (!f || 0 != strcmp(f->path, fpath) ||
+            size != cur_size || mtime != cur_mtime)
+            __mark_changed(changed, offset, f ? f->size : size,
+                           npieces, piece_len);
+
+        offset += f ? f->size : size;
+        free(fpath);
+    }
+
+    /* the file layout has changed */
+    if (nfiles != (uint64_t)llqueue_count(me->files))
+        goto fail;
+
+    /* read everything before touching any piece */
+    complete = calloc(npieces + 1, 1);
+    mtimes = calloc(npieces + 1, sizeof(uint64_t));
+    for (i = 0; i < npieces; i++)
+    {
+        if (!__read_uint(fp, &v, 1) || !__read_uint(fp, &mtimes[i], 4))
+            goto fail;
+        complete[i] = (char)v;
+    }
+    if (!v1 &&
+        (!__read_uint(fp, &npartial, 4) || (uint64_t)npieces < npartial))
+        goto fail;
+
+    for (i = 0; i < npieces; i++)
+    {
+        void* p;
+
+        if (!(p = ipdb->get_piece(pdb, i)) || changed[i])
+            continue;
+
+        bt_piece_set_mtime(p, mtimes[i]);
+
+        if (complete[i] && !bt_piece_is_complete(p))
+        {
+            bt_piece_set_complete(p, 1);
+            nrestored++;
+        }
+    }
+
+    /* a partial piece that can't be restored is only downloaded again */
+    for (i = 0; (uint64_t)i < npartial; i++)
+    {
+        uint64_t idx, nblocks;
+        void* p;
+
+        if (!__read_uint(fp, &idx, 4) || !__read_uint(fp, &nblocks, 4) ||
+            MAX_BLOCKS < nblocks)
+            break;
+        bits = realloc(bits, nblocks / 8 + 1);
+        if (1 != fread(bits, nblocks / 8 + 1, 1, fp))
+            break;
+
+        if ((uint64_t)npieces <= idx || changed[idx] ||
+            !(p = ipdb->get_piece(pdb, idx)) || bt_piece_is_complete(p))
+            continue;
+        bt_piece_set_block_progress(p, bits, nblocks);
+    }
+
+    free(bits);
+    free(complete);
+    free(mtimes);
+    free(changed);
+    fclose(fp);
+    return nrestored;
+
+fail:
+    free(complete);
+    free(mtimes);
+    free(changed);
+    fclose(fp);
+    return -1;
+}
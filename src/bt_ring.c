@@ -0,0 +1,166 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Bounded multi-producer/single-consumer ring
+ * @desc Each slot carries a sequence number. A producer claims a slot by
+ *       CAS'ing the head forward, copies in its item, and then publishes the
+ *       slot by bumping the slot's sequence. The consumer only reads slots
+ *       that have been published, so no lock is required on either side.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bt_ring.h"
+
+#define CACHELINE 64
+
+typedef struct
+{
+    unsigned int seq;
+} slot_t;
+
+typedef struct
+{
+    /* next position producers will claim */
+    unsigned int head;
+    char pad1[CACHELINE - sizeof(unsigned int)];
+
+    /* next position the consumer will read */
+    unsigned int tail;
+    char pad2[CACHELINE - sizeof(unsigned int)];
+
+    unsigned int mask;
+    unsigned int item_size;
+
+    /* distance in bytes between slots */
+    unsigned int stride;
+
+    char* slots;
+} ring_t;
+
+static slot_t* __slot(ring_t* me, unsigned int pos)
+{
+    return (slot_t*)(void*)(me->slots + (pos & me->mask) * me->stride);
+}
+
+static void* __slot_item(slot_t* s)
+{
+    return (char*)s + sizeof(void*);
+}
+
+void *bt_ring_new(unsigned int size, unsigned int item_size)
+{
+    ring_t* me;
+    unsigned int i, n;
+
+    for (n = 1; n < size; n <<= 1);
+
+    me = calloc(1, sizeof(ring_t));
+    me->mask = n - 1;
+    me->item_size = item_size;
+    /* keep items pointer aligned */
+    me->stride = sizeof(void*) +
+        (item_size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    me->slots = malloc(me->stride * n);
+
+    for (i = 0; i < n; i++)
+        __slot(me, i)->seq = i;
+
+    return me;
+}
+
+void bt_ring_free(void* me_)
+{
+    ring_t* me = me_;
+
+    free(me->slots);
+    free(me);
+}
+
+int bt_ring_offer(void* me_, const void* item)
+{
+    ring_t* me = me_;
+    unsigned int pos;
+    slot_t* s;
+
+    pos = __atomic_load_n(&me->head, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        int dif;
+
+        s = __slot(me, pos);
+        dif = (int)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (0 == dif)
+        {
+            if (__atomic_compare_exchange_n(&me->head, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        /* slot hasn't been consumed yet */
+        else if (dif < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&me->head, __ATOMIC_RELAXED);
+    }
+
+    memcpy(__slot_item(s), item, me->item_size);
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int bt_ring_poll(void* me_, void* item)
+{
+    ring_t* me = me_;
+    slot_t* s = __slot(me, me->tail);
+
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != me->tail + 1)
+        return 0;
+
+    memcpy(item, __slot_item(s), me->item_size);
+    /* hand slot back to producers for the next lap */
+    __atomic_store_n(&s->seq, me->tail + me->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&me->tail, me->tail + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+int bt_ring_drain(void* me_, void* udata, void (*cb)(void* udata, void* item))
+{
+    ring_t* me = me_;
+    unsigned int head, n = 0;
+
+    head = __atomic_load_n(&me->head, __ATOMIC_ACQUIRE);
+
+    while (me->tail != head)
+    {
+        slot_t* s = __slot(me, me->tail);
+
+        /* claimed but not yet published */
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != me->tail + 1)
+            break;
+
+        cb(udata, __slot_item(s));
+        __atomic_store_n(&s->seq, me->tail + me->mask + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&me->tail, me->tail + 1, __ATOMIC_RELAXED);
+        n++;
+    }
+
+    return n;
+}
+
+int bt_ring_count(void* me_)
+{
+    ring_t* me = me_;
+
+    return __atomic_load_n(&me->head, __ATOMIC_RELAXED) -
+           __atomic_load_n(&me->tail, __ATOMIC_RELAXED);
+}
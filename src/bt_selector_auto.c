@@ -0,0 +1,319 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Select pieces randomly, then by rarity, then for the endgame
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_auto.h"
+#include "bt_selector_random.h"
+#include "bt_selector_rarestfirst.h"
+
+#define WORD_BITS 64
+#define NWORDS(n) (((n) + WORD_BITS - 1) / WORD_BITS)
+
+typedef struct
+{
+    void *random;
+    void *rarest;
+
+    /*  pieces that we've polled or have, one bit per piece */
+    uint64_t *taken;
+    int ntaken;
+
+    /*  pieces that we have */
+    uint64_t *have;
+    int nhave;
+
+    /*  number of pieces the words above cover */
+    int size;
+
+    int npieces;
+
+    /*  random first until we have this many pieces */
+    int random_first;
+
+    /*  where the next endgame poll starts looking */
+    int cursor;
+} auto_t;
+
+static int __bit(const uint64_t* w, int idx)
+{
+    return (w[idx / WORD_BITS] >> (idx % WORD_BITS)) & 1;
+}
+
+/**
+ * Make room for pieces up to npieces */
+static void __grow(auto_t* me, int npieces)
+{
+    int size;
+
+    if (npieces <= me->size)
+        return;
+
+    size = NWORDS(me->size * 2 < npieces ? npieces : me->size * 2) *
+        WORD_BITS;
+    me->taken = realloc(me->taken, NWORDS(size) * sizeof(uint64_t));
+    me->have = realloc(me->have, NWORDS(size) * sizeof(uint64_t));
+    memset(me->taken + NWORDS(me->size), 0,
+           (NWORDS(size) - NWORDS(me->size)) * sizeof(uint64_t));
+    memset(me->have + NWORDS(me->size), 0,
+           (NWORDS(size) - NWORDS(me->size)) * sizeof(uint64_t));
+    me->size = size;
+}
+
+static void __take(auto_t* me, int idx)
+{
+    __grow(me, idx + 1);
+    if (__bit(me->taken, idx))
+        return;
+    me->taken[idx / WORD_BITS] |= (uint64_t)1 << (idx % WORD_BITS);
+    me->ntaken += 1;
+}
+
+/**
+ * A bitfield covers the whole torrent */
+static void __learn_npieces(auto_t* me, int npieces)
+{
+    if (npieces <= me->npieces)
+        return;
+    me->npieces = npieces;
+    __grow(me, npieces);
+}
+
+void *bt_auto_selector_new(
+    const int npieces
+)
+{
+    auto_t *me;
+
+    me = calloc(1, sizeof(auto_t));
+    me->npieces = npieces;
+    me->random_first = BT_AUTO_SELECTOR_RANDOM_FIRST;
+    me->random = bt_random_selector_new(npieces);
+    me->rarest = bt_rarestfirst_selector_new(npieces);
+    __grow(me, npieces);
+    return me;
+}
+
+void bt_auto_selector_free(
+    void *r
+)
+{
+    auto_t *me = r;
+
+    bt_random_selector_free(me->random);
+    bt_rarestfirst_selector_free(me->rarest);
+    free(me->taken);
+    free(me->have);
+    free(me);
+}
+
+void bt_auto_selector_giveback_piece(
+    void *r,
+    void* peer,
+    int piece_idx
+)
+{
+    auto_t *me = r;
+
+    bt_random_selector_giveback_piece(me->random, peer, piece_idx);
+    bt_rarestfirst_selector_giveback_piece(me->rarest, peer, piece_idx);
+
+    if (piece_idx < me->size && __bit(me->taken, piece_idx) &&
+        !__bit(me->have, piece_idx))
+    {
+        me->taken[piece_idx / WORD_BITS] &=
+            ~((uint64_t)1 << (piece_idx % WORD_BITS));
+        me->ntaken -= 1;
+    }
+}
+
+void bt_auto_selector_have_piece(
+    void *r,
+    int piece_idx
+)
+{
+    auto_t *me = r;
+
+    bt_random_selector_have_piece(me->random, piece_idx);
+    bt_rarestfirst_selector_have_piece(me->rarest, piece_idx);
+
+    __take(me, piece_idx);
+    if (__bit(me->have, piece_idx))
+        return;
+    me->have[piece_idx / WORD_BITS] |= (uint64_t)1 << (piece_idx % WORD_BITS);
+    me->nhave += 1;
+}
+
+void bt_auto_selector_remove_peer(
+    void *r,
+    void *peer
+)
+{
+    auto_t *me = r;
+
+    bt_random_selector_remove_peer(me->random, peer);
+    bt_rarestfirst_selector_remove_peer(me->rarest, peer);
+}
+
+void bt_auto_selector_add_peer(
+    void *r,
+    void *peer
+)
+{
+    auto_t *me = r;
+
+    bt_random_selector_add_peer(me->random, peer);
+    bt_rarestfirst_selector_add_peer(me->rarest, peer);
+}
+
+void bt_auto_selector_peer_have_piece(
+    void *r,
+    void *peer,
+    const int piece_idx
+)
+{
+    auto_t *me = r;
+
+    bt_random_selector_peer_have_piece(me->random, peer, piece_idx);
+    bt_rarestfirst_selector_peer_have_piece(me->rarest, peer, piece_idx);
+}
+
+void bt_auto_selector_peer_have_bitfield(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    auto_t *me = r;
+
+    __learn_npieces(me, npieces);
+    bt_rarestfirst_selector_peer_have_bitfield(me->rarest, peer, words,
+                                               npieces);
+    bt_random_selector_peer_have_bitfield(me->random, peer, words, npieces);
+}
+
+void bt_auto_selector_peer_share_pieces(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    auto_t *me = r;
+
+    __learn_npieces(me, npieces);
+    bt_rarestfirst_selector_peer_share_pieces(me->rarest, peer, words,
+                                              npieces);
+}
+
+int bt_auto_selector_get_npeers(void *r)
+{
+    auto_t *me = r;
+
+    return bt_rarestfirst_selector_get_npeers(me->rarest);
+}
+
+int bt_auto_selector_get_npieces(void *r)
+{
+    auto_t *me = r;
+
+    return me->npieces;
+}
+
+unsigned long bt_auto_selector_get_memory(void *r)
+{
+    auto_t *me = r;
+
+    return sizeof(auto_t) + 2 * NWORDS(me->size) * sizeof(uint64_t) +
+        bt_random_selector_get_memory(me->random) +
+        bt_rarestfirst_selector_get_memory(me->rarest);
+}
+
+void bt_auto_selector_get_availability_stats(void *r, bt_availability_t* a)
+{
+    auto_t *me = r;
+
+    bt_rarestfirst_selector_get_availability_stats(me->rarest, a);
+}
+
+void bt_auto_selector_set_random_first(void *r, int npieces)
+{
+    auto_t *me = r;
+
+    me->random_first = npieces;
+}
+
+int bt_auto_selector_is_endgame(void *r)
+{
+    auto_t *me = r;
+
+    return 0 < me->npieces && me->ntaken == me->npieces &&
+        me->nhave < me->npieces;
+}
+
+/**
+ * Take turns over the pieces that are polled but that we don't have yet,
+ * so that each peer spreads its duplicate requests around */
+static int __poll_endgame(auto_t* me, const void *peer)
+{
+    int i, n = me->npieces;
+
+    for (i = 0; i < n; i++)
+    {
+        int idx = (me->cursor + i) % n;
+
+        if (__bit(me->have, idx) ||
+            !bt_rarestfirst_selector_peer_has_piece(me->rarest, peer, idx))
+            continue;
+
+        me->cursor = idx + 1;
+        return idx;
+    }
+
+    return -1;
+}
+
+int bt_auto_selector_poll_best_piece(
+    void *r,
+    const void *peer
+)
+{
+    auto_t *me = r;
+    int idx = -1;
+
+    if (bt_auto_selector_is_endgame(me))
+        return __poll_endgame(me, peer);
+
+    /*  random pieces get us something to trade quickly */
+    if (me->nhave < me->random_first &&
+        -1 != (idx = bt_random_selector_poll_best_piece(me->random, peer)))
+        bt_rarestfirst_selector_have_piece(me->rarest, idx);
+    else if (-1 != (idx =
+                    bt_rarestfirst_selector_poll_best_piece(me->rarest, peer)))
+        bt_random_selector_have_piece(me->random, idx);
+
+    if (-1 != idx)
+    {
+        __take(me, idx);
+        return idx;
+    }
+
+    if (bt_auto_selector_is_endgame(me))
+        return __poll_endgame(me, peer);
+
+    return -1;
+}
@@ -1,4 +1,3 @@
-
 /**
  * Copyright (c) 2011, Willem-Hendrik Thiart
  * Use of this source code is governed by a BSD-style license that can be
@@ -14,23 +13,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "bt.h"
+#include "bt_selector_random.h"
 
-#include "linked_list_queue.h"
 #include "linked_list_hashmap.h"
-#include "bag.h"
+
+#define WORD_BITS 64
+#define NWORDS(n) (((n) + WORD_BITS - 1) / WORD_BITS)
 
 /*  random  */
 typedef struct
 {
     hashmap_t *peers;
 
-    /*  pieces that are candidates for polling  */
-    //hashmap_t *p_candidates;
+    /*  pieces that we've polled or have, one bit per piece.
+     *  A candidate is a piece the peer has that isn't in here */
+    uint64_t *polled;
 
-    /*  pieces that we've polled */
-    hashmap_t *p_polled;
+    /*  number of words in polled */
+    int nwords;
 
     /*  number of pieces to download */
     int npieces;
@@ -39,8 +42,9 @@ typedef struct
 /*  peer */
 typedef struct
 {
-    //hashmap_t *have_pieces;
-    bag_t *p_candidates;
+    /*  pieces the peer has, one bit per piece */
+    uint64_t *have;
+    int nwords;
 } peer_t;
 
 static unsigned long __peer_hash(
@@ -58,13 +62,26 @@ static long __peer_compare(
     return obj - other;
 }
 
-static int __cmp_piece(
-    const void *i1,
-    const void *i2,
-    const void *ckr
-)
+/**
+ * Make room for piece_idx in the words */
+static void __grow(uint64_t** words, int* nwords, int piece_idx)
 {
-    return i2 - i1;
+    int n = *nwords;
+
+    if (piece_idx / WORD_BITS < n)
+        return;
+
+    while (n <= piece_idx / WORD_BITS)
+        n = n ? n * 2 : 1;
+    *words = realloc(*words, n * sizeof(uint64_t));
+    memset(*words + *nwords, 0, (n - *nwords) * sizeof(uint64_t));
+    *nwords = n;
+}
+
+static void __set(uint64_t** words, int* nwords, int piece_idx)
+{
+    __grow(words, nwords, piece_idx);
+    (*words)[piece_idx / WORD_BITS] |= (uint64_t)1 << (piece_idx % WORD_BITS);
 }
 
 void *bt_random_selector_new(
@@ -76,7 +93,8 @@ void *bt_random_selector_new(
     rf = calloc(1, sizeof(random_t));
     rf->npieces = npieces;
     rf->peers = hashmap_new(__peer_hash, __peer_compare, 17);
-    rf->p_polled = hashmap_new(__peer_hash, __peer_compare, 17);
+    if (0 < npieces)
+        __grow(&rf->polled, &rf->nwords, npieces - 1);
     return rf;
 }
 
@@ -84,11 +102,19 @@ void bt_random_selector_free(
     void *r
 )
 {
+    random_t *rf = r;
+    hashmap_iterator_t iter;
+    peer_t *pr;
 
-//    hashmap_free(rf->peers);
-//    bag_free(rf->p_candidates);
-//    hashmap_free(rf->p_polled);
-//    free(rf);
+    for (hashmap_iterator(rf->peers, &iter);
+         (pr = hashmap_iterator_next_value(rf->peers, &iter));)
+    {
+        free(pr->have);
+        free(pr);
+    }
+    hashmap_free(rf->peers);
+    free(rf->polled);
+    free(rf);
 }
 
 void bt_random_selector_remove_peer(
@@ -101,7 +127,7 @@ void bt_random_selector_remove_peer(
 
     if ((pr = hashmap_remove(rf->peers, peer)))
     {
-//        hashmap_free(pr->have_pieces);
+        free(pr->have);
         free(pr);
     }
 }
@@ -119,8 +145,6 @@ void bt_random_selector_add_peer(
         return;
 
     pr = calloc(1,sizeof(peer_t));
-    pr->p_candidates = bag_new();
-//    pr->have_pieces = hashmap_new(__peer_hash, __peer_compare, 11);
     hashmap_put(rf->peers, peer, pr);
 }
 
@@ -133,13 +157,15 @@ void bt_random_selector_giveback_piece(
     random_t *rf = r;
     peer_t *pr;
 
-    hashmap_remove(rf->p_polled, (void *) (long) piece_idx + 1);
+    if (piece_idx / WORD_BITS < rf->nwords)
+        rf->polled[piece_idx / WORD_BITS] &=
+            ~((uint64_t)1 << (piece_idx % WORD_BITS));
 
     if (peer)
     {
         pr = hashmap_get(rf->peers, peer);
         assert(pr);
-        bag_put(pr->p_candidates, (void *) (long) piece_idx + 1);
+        __set(&pr->have, &pr->nwords, piece_idx);
     }
 }
 
@@ -151,8 +177,7 @@ void bt_random_selector_have_piece(
     random_t *rf = r;
 
     assert(rf);
-    assert(rf->p_polled);
-    hashmap_put(rf->p_polled, (void *) (long) piece_idx + 1, (void *) (long) piece_idx + 1);
+    __set(&rf->polled, &rf->nwords, piece_idx);
 }
 
 void bt_random_selector_peer_have_piece(
@@ -163,17 +188,36 @@ void bt_random_selector_peer_have_piece(
 {
     random_t *rf = r;
     peer_t *pr;
-    void* p;
 
     /*  get the peer */
     pr = hashmap_get(rf->peers, peer);
 
     assert(pr);
 
-    if (!(p = hashmap_get(rf->p_polled, (void *) (long) piece_idx + 1)))
-    {
-        bag_put(pr->p_candidates, (void *) (long) piece_idx + 1);
-    }
+    __set(&pr->have, &pr->nwords, piece_idx);
+}
+
+void bt_random_selector_peer_have_bitfield(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    random_t *rf = r;
+    peer_t *pr;
+    int i;
+
+    pr = hashmap_get(rf->peers, peer);
+
+    assert(pr);
+
+    if (npieces <= 0)
+        return;
+
+    __grow(&pr->have, &pr->nwords, npieces - 1);
+    for (i = 0; i < NWORDS(npieces); i++)
+        pr->have[i] |= words[i];
 }
 
 int bt_random_selector_get_npeers(void *r)
@@ -188,6 +232,28 @@ int bt_random_selector_get_npieces(void *r)
     return rf->npieces;
 }
 
+unsigned long bt_random_selector_get_memory(void *r)
+{
+    random_t *rf = r;
+    hashmap_iterator_t iter;
+    unsigned long n;
+    peer_t *pr;
+
+    n = sizeof(random_t) + hashmap_get_memory(rf->peers) +
+        rf->nwords * sizeof(uint64_t);
+    for (hashmap_iterator(rf->peers, &iter);
+         (pr = hashmap_iterator_next_value(rf->peers, &iter));)
+        n += sizeof(peer_t) + pr->nwords * sizeof(uint64_t);
+    return n;
+}
+
+/**
+ * @return candidates in this word of the peer's pieces */
+static uint64_t __candidates(random_t* rf, peer_t* pr, int i)
+{
+    return pr->have[i] & ~(i < rf->nwords ? rf->polled[i] : 0);
+}
+
 int bt_random_selector_poll_best_piece(
     void *r,
     const void *peer
@@ -195,27 +261,28 @@ int bt_random_selector_poll_best_piece(
 {
     random_t *rf = r;
     peer_t *pr;
-    int piece_idx;
+    uint64_t w;
+    int i, start, piece_idx;
 
-    if (!(pr = hashmap_get(rf->peers, peer)))
+    if (!(pr = hashmap_get(rf->peers, peer)) || 0 == pr->nwords)
     {
         return -1;
     }
 
-    /* get a random piece that the client might have */
-    while (0 < bag_count(pr->p_candidates))
-    {
-        piece_idx = ((unsigned long int)bag_take(pr->p_candidates)) - 1;
-
-        /* don't poll if it has been polled already */
-        if (!(hashmap_get(rf->p_polled, (void *) (long) piece_idx + 1)))
-        {
-            void* i = (void *) ((long) piece_idx + 1);
-            hashmap_put(rf->p_polled, i, i);
-            return piece_idx;
-        }
-    }
+    /* scan from a random piece, wrapping round to the bits before it */
+    start = rand() % (pr->nwords * WORD_BITS);
 
-    return -1;
-}
+    w = __candidates(rf, pr, start / WORD_BITS) &
+        (~(uint64_t)0 << (start % WORD_BITS));
+    for (i = 0; !w && i < pr->nwords; i++)
+        w = __candidates(rf, pr, (start / WORD_BITS + 1 + i) % pr->nwords);
 
+    if (!w)
+        return -1;
+
+    /* w is i words on from the start word */
+    piece_idx = ((start / WORD_BITS + i) % pr->nwords) * WORD_BITS +
+        __builtin_ctzll(w);
+    __set(&rf->polled, &rf->nwords, piece_idx);
+    return piece_idx;
+}
@@ -1,4 +1,3 @@
-
 /**
  * Copyright (c) 2011, Willem-Hendrik Thiart
  * Use of this source code is governed by a BSD-style license that can be
@@ -14,65 +13,200 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "bt.h"
 
-#include "linked_list_queue.h"
-#include "linked_list_hashmap.h"
-#include "heap.h"
+#include "bt_hashmap.h"
+
+#define WORD_BITS 64
+#define NWORDS(n) (((n) + WORD_BITS - 1) / WORD_BITS)
 
 /*  rarestfirst  */
 typedef struct
 {
-    hashmap_t *peers;
-    hashmap_t *pieces;
-    /*  pieces that we've polled */
-    hashmap_t *pieces_polled;
+    void *peers;
+
+    /*  Number of peers that have each piece
+     *  This is for determining rarity */
+    int *nhaves;
+
+    /*  pieces that we've polled, one bit per piece */
+    uint64_t *polled;
+
+    /*  Pieces we haven't polled, in a list per number of haves.
+     *  next and prev link pieces; -1 ends a list */
+    int *next, *prev;
+    int *heads;
+    int nbuckets;
+
+    /*  number of pieces with each number of haves, and the fewest haves
+     *  any of them has. The pieces counted are those below ncounted: all
+     *  we've been told of, as npieces may be 0 if it wasn't known yet */
+    int *hist;
+    int nhist;
+    int min;
+    int ncounted;
+
+    /*  number of pieces the arrays above cover */
+    int size;
+
     int npieces;
 } rarestfirst_t;
 
 /*  peer */
 typedef struct
 {
-    /*  the pieces that the peer has */
-    hashmap_t *have_pieces;
+    /*  the pieces that the peer has, one bit per piece.
+     *  These are the caller's words if it shares them, otherwise own */
+    const uint64_t *have;
+    uint64_t *own;
+    int nwords;
 } peer_t;
 
-/*  piece */
-typedef struct
+static uint64_t* __words_grow(uint64_t* w, int nwords, int new_nwords)
 {
-    /*  Number of peers that has this piece
-     *  This is for determining rarity */
-    int nhaves;
-    /*  Piece IDX */
-    int idx;
-} piece_t;
+    w = realloc(w, new_nwords * sizeof(uint64_t));
+    memset(w + nwords, 0, (new_nwords - nwords) * sizeof(uint64_t));
+    return w;
+}
 
-static unsigned long __peer_hash(
-    const void *obj
-)
+static int __is_polled(const rarestfirst_t* rf, int idx)
 {
-    return (unsigned long) obj;
+    return (rf->polled[idx / WORD_BITS] >> (idx % WORD_BITS)) & 1;
 }
 
-static long __peer_compare(
-    const void *obj,
-    const void *other
-)
+/**
+ * Take the piece out of its bucket */
+static void __unlink(rarestfirst_t* rf, int idx)
 {
-    return obj - other;
+    if (-1 == rf->prev[idx])
+        rf->heads[rf->nhaves[idx]] = rf->next[idx];
+    else
+        rf->next[rf->prev[idx]] = rf->next[idx];
+    if (-1 != rf->next[idx])
+        rf->prev[rf->next[idx]] = rf->prev[idx];
 }
 
-static int __cmp_piece(
-    const void *i1,
-    const void *i2,
-    const void *ckr
-)
+/**
+ * Put the piece at the front of the bucket for its number of haves */
+static void __link(rarestfirst_t* rf, int idx)
 {
-    const piece_t *p1 = i1;
-    const piece_t *p2 = i2;
+    int c = rf->nhaves[idx];
 
-    return p2->nhaves - p1->nhaves;
+    if (rf->nbuckets <= c)
+    {
+        int n = rf->nbuckets * 2 <= c ? c + 1 : rf->nbuckets * 2;
+
+        rf->heads = realloc(rf->heads, n * sizeof(int));
+        memset(rf->heads + rf->nbuckets, -1,
+               (n - rf->nbuckets) * sizeof(int));
+        rf->nbuckets = n;
+    }
+
+    rf->prev[idx] = -1;
+    rf->next[idx] = rf->heads[c];
+    if (-1 != rf->heads[c])
+        rf->prev[rf->heads[c]] = idx;
+    rf->heads[c] = idx;
+}
+
+static void __hist_grow(rarestfirst_t* rf, int c)
+{
+    int n;
+
+    if (c < rf->nhist)
+        return;
+
+    n = rf->nhist * 2 <= c ? c + 1 : rf->nhist * 2;
+    rf->hist = realloc(rf->hist, n * sizeof(int));
+    memset(rf->hist + rf->nhist, 0, (n - rf->nhist) * sizeof(int));
+    rf->nhist = n;
+}
+
+/**
+ * Move the piece to the histogram bucket for its new number of haves */
+static void __hist_move(rarestfirst_t* rf, int idx, int from)
+{
+    int to = rf->nhaves[idx];
+
+    if (rf->ncounted <= idx)
+        return;
+
+    __hist_grow(rf, to);
+    rf->hist[from]--;
+    rf->hist[to]++;
+    if (to < rf->min)
+        rf->min = to;
+    else if (from == rf->min && 0 == rf->hist[from])
+        rf->min = to;
+}
+
+/**
+ * Count pieces up to npieces in the histogram */
+static void __hist_count(rarestfirst_t* rf, int npieces)
+{
+    int i;
+
+    for (i = rf->ncounted; i < npieces; i++)
+    {
+        __hist_grow(rf, rf->nhaves[i]);
+        rf->hist[rf->nhaves[i]]++;
+        if (0 == i || rf->nhaves[i] < rf->min)
+            rf->min = rf->nhaves[i];
+    }
+    if (rf->ncounted < npieces)
+        rf->ncounted = npieces;
+}
+
+/**
+ * One more or one less peer has this piece */
+static void __add_have(rarestfirst_t* rf, int idx, int n)
+{
+    if (__is_polled(rf, idx))
+        rf->nhaves[idx] += n;
+    else
+    {
+        __unlink(rf, idx);
+        rf->nhaves[idx] += n;
+        __link(rf, idx);
+    }
+    __hist_move(rf, idx, rf->nhaves[idx] - n);
+}
+
+/**
+ * Make room for pieces up to npieces */
+static void __grow(rarestfirst_t* rf, int npieces)
+{
+    int size, i;
+
+    if (npieces <= rf->size)
+    {
+        __hist_count(rf, npieces);
+        return;
+    }
+
+    size = NWORDS(rf->size * 2 < npieces ? npieces : rf->size * 2) *
+        WORD_BITS;
+    rf->nhaves = realloc(rf->nhaves, size * sizeof(int));
+    memset(rf->nhaves + rf->size, 0, (size - rf->size) * sizeof(int));
+    rf->polled = __words_grow(rf->polled, NWORDS(rf->size), NWORDS(size));
+    rf->next = realloc(rf->next, size * sizeof(int));
+    rf->prev = realloc(rf->prev, size * sizeof(int));
+
+    /*  nobody has the new pieces yet */
+    for (i = size - 1; rf->size <= i; i--)
+        __link(rf, i);
+    rf->size = size;
+    __hist_count(rf, npieces);
+}
+
+static void __peer_grow(rarestfirst_t* rf, peer_t* pr)
+{
+    if (pr->have != pr->own || NWORDS(rf->size) <= pr->nwords)
+        return;
+    pr->have = pr->own = __words_grow(pr->own, pr->nwords, NWORDS(rf->size));
+    pr->nwords = NWORDS(rf->size);
 }
 
 void *bt_rarestfirst_selector_new(
@@ -83,22 +217,15 @@ void *bt_rarestfirst_selector_new(
 
     rf = calloc(1, sizeof(rarestfirst_t));
     rf->npieces = npieces;
-    rf->peers = hashmap_new(__peer_hash, __peer_compare, 11);
-    rf->pieces = hashmap_new(__peer_hash, __peer_compare, 11);
-    rf->pieces_polled = hashmap_new(__peer_hash, __peer_compare, 11);
+    rf->peers = bt_intmap_new(11);
+    __grow(rf, npieces);
     return rf;
 }
 
-static void __peer_release(peer_t* p)
+static void __peer_free(peer_t* pr)
 {
-    hashmap_iterator_t iter;
-    piece_t* pce;
-
-    for (hashmap_iterator(p->have_pieces, &iter);
-        (pce = hashmap_iterator_next(p->have_pieces, &iter));)
-    {
-        hashmap_remove(p->have_pieces, p);
-    }
+    free(pr->own);
+    free(pr);
 }
 
 void bt_rarestfirst_selector_free(
@@ -106,19 +233,20 @@ void bt_rarestfirst_selector_free(
 )
 {
     rarestfirst_t *rf = r;
-    hashmap_iterator_t iter;
-    peer_t* p;
-
-    for (hashmap_iterator(rf->pieces, &iter);
-        (p = hashmap_iterator_next(rf->pieces, &iter));)
-    {
-        hashmap_remove(rf->pieces, p);
-        free(p);
-    }
-
-    hashmap_free(rf->peers);
-    hashmap_free(rf->pieces);
-    hashmap_free(rf->pieces_polled);
+    bt_hashmap_iterator_t iter;
+    peer_t* pr;
+
+    for (bt_intmap_iterator(rf->peers, &iter);
+        (pr = bt_intmap_iterator_next_value(rf->peers, &iter));)
+        __peer_free(pr);
+
+    bt_intmap_free(rf->peers);
+    free(rf->nhaves);
+    free(rf->polled);
+    free(rf->next);
+    free(rf->prev);
+    free(rf->heads);
+    free(rf->hist);
     free(rf);
 }
 
@@ -129,12 +257,21 @@ void bt_rarestfirst_selector_remove_peer(
 {
     rarestfirst_t *rf = r;
     peer_t *pr;
+    int i;
 
-    if ((pr = hashmap_remove(rf->peers, peer)))
+    if (!(pr = bt_intmap_remove(rf->peers, (uintptr_t)peer)))
+        return;
+
+    /*  its pieces are now that much rarer */
+    for (i = 0; i < pr->nwords; i++)
     {
-        hashmap_free(pr->have_pieces);
-        free(pr);
+        uint64_t w;
+
+        for (w = pr->have[i]; w; w &= w - 1)
+            __add_have(rf, i * WORD_BITS + __builtin_ctzll(w), -1);
     }
+
+    __peer_free(pr);
 }
 
 void bt_rarestfirst_selector_add_peer(
@@ -145,11 +282,10 @@ void bt_rarestfirst_selector_add_peer(
     rarestfirst_t *rf = r;
     peer_t *pr;
 
-    if (!(pr = hashmap_get(rf->peers, peer)))
+    if (!(pr = bt_intmap_get(rf->peers, (uintptr_t)peer)))
     {
         pr = calloc(1,sizeof(peer_t));
-        pr->have_pieces = hashmap_new(__peer_hash, __peer_compare, 11);
-        hashmap_put(rf->peers, peer, pr);
+        bt_intmap_put(rf->peers, (uintptr_t)peer, pr);
     }
 }
 
@@ -161,12 +297,12 @@ void bt_rarestfirst_selector_giveback_piece(
 {
     rarestfirst_t *rf = r;
 
-    piece_t *pce;
+    if (rf->size <= piece_idx || !__is_polled(rf, piece_idx))
+        return;
 
-    if ((pce = hashmap_remove(rf->pieces_polled, (void *) (long) piece_idx)))
-    {
-        hashmap_put(rf->pieces, (void *) (long) piece_idx, pce);
-    }
+    rf->polled[piece_idx / WORD_BITS] &=
+        ~((uint64_t)1 << (piece_idx % WORD_BITS));
+    __link(rf, piece_idx);
 }
 
 void bt_rarestfirst_selector_have_piece(
@@ -175,11 +311,14 @@ void bt_rarestfirst_selector_have_piece(
 )
 {
     rarestfirst_t *rf = r;
-    piece_t *pce;
 
-    pce = hashmap_remove(rf->pieces, (void *) (long) piece_idx);
-    pce = hashmap_put(rf->pieces_polled, (void *) (long) piece_idx, pce);
-    /*  possible memory leak here */
+    __grow(rf, piece_idx + 1);
+    if (__is_polled(rf, piece_idx))
+        return;
+
+    __unlink(rf, piece_idx);
+    rf->polled[piece_idx / WORD_BITS] |=
+        (uint64_t)1 << (piece_idx % WORD_BITS);
 }
 
 void bt_rarestfirst_selector_peer_have_piece(
@@ -189,34 +328,86 @@ void bt_rarestfirst_selector_peer_have_piece(
 )
 {
     rarestfirst_t *rf = r;
-    piece_t *piece;
     peer_t *pr;
+    uint64_t bit = (uint64_t)1 << (piece_idx % WORD_BITS);
 
     /*  get the peer */
-    pr = hashmap_get(rf->peers, peer);
+    pr = bt_intmap_get(rf->peers, (uintptr_t)peer);
+
+    assert(pr);
+
+    __grow(rf, piece_idx + 1);
+    __peer_grow(rf, pr);
+
+    /*  shared pieces are already marked, and this is news */
+    if (pr->have == pr->own)
+    {
+        if (pr->own[piece_idx / WORD_BITS] & bit)
+            return;
+        pr->own[piece_idx / WORD_BITS] |= bit;
+    }
+
+    __add_have(rf, piece_idx, 1);
+}
+
+void bt_rarestfirst_selector_peer_have_bitfield(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    rarestfirst_t *rf = r;
+    peer_t *pr;
+    int i;
+
+    pr = bt_intmap_get(rf->peers, (uintptr_t)peer);
 
     assert(pr);
 
-    if (!(piece = hashmap_get(rf->pieces, (void *) (long) piece_idx)))
+    __grow(rf, npieces);
+    __peer_grow(rf, pr);
+
+    for (i = 0; i < NWORDS(npieces); i++)
     {
-        piece = malloc(sizeof(piece_t));
-        piece->nhaves = 1;
-        piece->idx = piece_idx;
-        hashmap_put(rf->pieces, (void *) (long) piece_idx, piece);
+        uint64_t w = words[i];
+
+        if (pr->have == pr->own)
+        {
+            w &= ~pr->own[i];
+            pr->own[i] |= w;
+        }
+
+        for (; w; w &= w - 1)
+            __add_have(rf, i * WORD_BITS + __builtin_ctzll(w), 1);
     }
+}
+
+void bt_rarestfirst_selector_peer_share_pieces(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    rarestfirst_t *rf = r;
+    peer_t *pr;
 
-    /*  increment haves  */
-    piece->nhaves += 1;
+    pr = bt_intmap_get(rf->peers, (uintptr_t)peer);
 
-    /*  add to peer's pieces */
-    hashmap_put(pr->have_pieces, (void *) (long) piece_idx, piece);
+    assert(pr);
+    assert(!pr->own);
+
+    __grow(rf, npieces);
+    pr->have = words;
+    pr->nwords = NWORDS(npieces);
 }
 
 int bt_rarestfirst_selector_get_npeers(void *r)
 {
     rarestfirst_t *rf = r;
 
-    return hashmap_count(rf->peers);
+    return bt_intmap_count(rf->peers);
 }
 
 int bt_rarestfirst_selector_get_npieces(void *r)
@@ -226,56 +417,95 @@ int bt_rarestfirst_selector_get_npieces(void *r)
     return rf->npieces;
 }
 
+unsigned long bt_rarestfirst_selector_get_memory(void *r)
+{
+    rarestfirst_t *rf = r;
+    bt_hashmap_iterator_t iter;
+    unsigned long n;
+    peer_t *pr;
+
+    n = sizeof(rarestfirst_t) + bt_intmap_get_memory(rf->peers) +
+        3 * rf->size * sizeof(int) +
+        (rf->nbuckets + rf->nhist) * sizeof(int) +
+        NWORDS(rf->size) * sizeof(uint64_t);
+    for (bt_intmap_iterator(rf->peers, &iter);
+         (pr = bt_intmap_iterator_next_value(rf->peers, &iter));)
+    {
+        n += sizeof(peer_t);
+        if (pr->own)
+            n += pr->nwords * sizeof(uint64_t);
+    }
+    return n;
+}
+
+int bt_rarestfirst_selector_get_availability(void *r, int piece_idx)
+{
+    rarestfirst_t *rf = r;
+
+    if (piece_idx < 0 || rf->size <= piece_idx)
+        return 0;
+    return rf->nhaves[piece_idx];
+}
+
+void bt_rarestfirst_selector_get_availability_stats(void *r,
+                                                   bt_availability_t* a)
+{
+    rarestfirst_t *rf = r;
+
+    memset(a, 0, sizeof(bt_availability_t));
+    a->npieces = rf->ncounted;
+    if (0 == rf->ncounted)
+        return;
+    a->min = rf->min;
+    a->distributed_copies = rf->min * 1000 +
+        (int)((long long)(rf->ncounted - rf->hist[rf->min]) * 1000 /
+              rf->ncounted);
+    a->nunavailable = rf->hist[0];
+    a->nrare = 1 < rf->nhist ? rf->hist[1] : 0;
+}
+
+int bt_rarestfirst_selector_peer_has_piece(
+    void *r,
+    const void *peer,
+    const int piece_idx
+)
+{
+    rarestfirst_t *rf = r;
+    peer_t *pr;
+
+    if (!(pr = bt_intmap_get(rf->peers, (uintptr_t)peer)) || piece_idx < 0 ||
+        pr->nwords * WORD_BITS <= piece_idx)
+        return 0;
+    return (pr->have[piece_idx / WORD_BITS] >> (piece_idx % WORD_BITS)) & 1;
+}
+
 int bt_rarestfirst_selector_poll_best_piece(
     void *r,
     const void *peer
 )
 {
     rarestfirst_t *rf = r;
-    heap_t *hp;
     peer_t *pr;
-    void *p;
-    int piece_idx;
-    hashmap_iterator_t iter;
-    piece_t *pce;
+    int c, idx;
 
-    if (!(pr = hashmap_get(rf->peers, peer)))
+    if (!(pr = bt_intmap_get(rf->peers, (uintptr_t)peer)))
     {
         return -1;
     }
 
-    /*  if we have no pieces, fail */
-    if (0 == hashmap_count(pr->have_pieces))
-    {
-        return -1;
-    }
-
-    hp = heap_new(__cmp_piece, rf);
-
-    /*  add to priority queue */
-    for (hashmap_iterator(rf->pieces, &iter);
-        (p = hashmap_iterator_next(rf->pieces, &iter));)
-    {
-        /* only add if peer has it */
-        if (hashmap_get(pr->have_pieces, p))
+    /*  walk up from the rarest bucket to the first piece the peer has */
+    for (c = 1; c < rf->nbuckets; c++)
+        for (idx = rf->heads[c]; -1 != idx; idx = rf->next[idx])
         {
-            pce = hashmap_get(rf->pieces, p);
-            heap_offer(hp, pce);
+            if (pr->nwords * WORD_BITS <= idx ||
+                !((pr->have[idx / WORD_BITS] >> (idx % WORD_BITS)) & 1))
+                continue;
+
+            __unlink(rf, idx);
+            rf->polled[idx / WORD_BITS] |=
+                (uint64_t)1 << (idx % WORD_BITS);
+            return idx;
         }
-    }
-
-    /*  queue best from priority queue */
-    if ((pce = heap_poll(hp)))
-    {
-        piece_idx = pce->idx;
-        hashmap_remove(rf->pieces, (void *) (long) pce->idx);
-        hashmap_put(rf->pieces_polled, (void *) (long) pce->idx, pce);
-    }
-    else
-    {
-        piece_idx = -1;
-    }
 
-    heap_free(hp);
-    return piece_idx;
+    return -1;
 }
@@ -193,6 +193,22 @@ int bt_sequential_selector_get_npieces(void *r)
     return me->npieces;
 }
 
+unsigned long bt_sequential_selector_get_memory(void *r)
+{
+    sequential_t *me = r;
+    hashmap_iterator_t iter;
+    unsigned long n;
+    peer_t *pr;
+
+    n = sizeof(sequential_t) + hashmap_get_memory(me->peers) +
+        hashmap_get_memory(me->p_polled);
+    for (hashmap_iterator(me->peers, &iter);
+         (pr = hashmap_iterator_next_value(me->peers, &iter));)
+        n += sizeof(peer_t) + sizeof(heap_t) +
+            heap_size(pr->p_candidates) * sizeof(void*);
+    return n;
+}
+
 int bt_sequential_selector_poll_best_piece(
     void *r,
     const void *peer
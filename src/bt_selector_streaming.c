@@ -0,0 +1,412 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Select pieces that are about to be read, then the rarest
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_streaming.h"
+#include "bt_selector_rarestfirst.h"
+
+#include "linked_list_hashmap.h"
+
+#define WORD_BITS 64
+#define NWORDS(n) (((n) + WORD_BITS - 1) / WORD_BITS)
+
+typedef struct
+{
+    /*  for everything outside the window, and for who has what */
+    void *rarest;
+
+    /*  peer_t of each peer */
+    hashmap_t *peers;
+
+    /*  pieces that we've polled or have, one bit per piece */
+    uint64_t *taken;
+
+    /*  pieces that we have */
+    uint64_t *have;
+
+    /*  number of pieces the words above cover */
+    int size;
+
+    int npieces;
+
+    /*  the window is [cursor, cursor + window) */
+    int cursor;
+    int window;
+
+    /*  in window pieces that rarest first handed to a slow peer */
+    int *skipped;
+} streaming_t;
+
+typedef struct
+{
+    unsigned int rate;
+} peer_t;
+
+static unsigned long __peer_hash(
+    const void *obj
+)
+{
+    return (unsigned long) obj;
+}
+
+static long __peer_compare(
+    const void *obj,
+    const void *other
+)
+{
+    return obj - other;
+}
+
+static int __bit(const uint64_t* w, int idx)
+{
+    return (w[idx / WORD_BITS] >> (idx % WORD_BITS)) & 1;
+}
+
+/**
+ * Make room for pieces up to npieces */
+static void __grow(streaming_t* me, int npieces)
+{
+    int size;
+
+    if (npieces <= me->size)
+        return;
+
+    size = NWORDS(me->size * 2 < npieces ? npieces : me->size * 2) *
+        WORD_BITS;
+    me->taken = realloc(me->taken, NWORDS(size) * sizeof(uint64_t));
+    me->have = realloc(me->have, NWORDS(size) * sizeof(uint64_t));
+    memset(me->taken + NWORDS(me->size), 0,
+           (NWORDS(size) - NWORDS(me->size)) * sizeof(uint64_t));
+    memset(me->have + NWORDS(me->size), 0,
+           (NWORDS(size) - NWORDS(me->size)) * sizeof(uint64_t));
+    me->size = size;
+}
+
+static void __take(streaming_t* me, int idx)
+{
+    __grow(me, idx + 1);
+    me->taken[idx / WORD_BITS] |= (uint64_t)1 << (idx % WORD_BITS);
+}
+
+static int __in_window(const streaming_t* me, int idx)
+{
+    return me->cursor <= idx && idx < me->cursor + me->window;
+}
+
+void *bt_streaming_selector_new(
+    const int npieces
+)
+{
+    streaming_t *me;
+
+    me = calloc(1, sizeof(streaming_t));
+    me->npieces = npieces;
+    me->rarest = bt_rarestfirst_selector_new(npieces);
+    me->peers = hashmap_new(__peer_hash, __peer_compare, 17);
+    __grow(me, npieces);
+    bt_streaming_selector_set_window(me, 1);
+    return me;
+}
+
+void bt_streaming_selector_free(
+    void *r
+)
+{
+    streaming_t *me = r;
+    hashmap_iterator_t iter;
+    peer_t* pr;
+
+    for (hashmap_iterator(me->peers, &iter);
+        (pr = hashmap_iterator_next_value(me->peers, &iter));)
+        free(pr);
+
+    hashmap_free(me->peers);
+    bt_rarestfirst_selector_free(me->rarest);
+    free(me->taken);
+    free(me->have);
+    free(me->skipped);
+    free(me);
+}
+
+void bt_streaming_selector_giveback_piece(
+    void *r,
+    void* peer,
+    int piece_idx
+)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_giveback_piece(me->rarest, peer, piece_idx);
+
+    if (piece_idx < me->size && !__bit(me->have, piece_idx))
+        me->taken[piece_idx / WORD_BITS] &=
+            ~((uint64_t)1 << (piece_idx % WORD_BITS));
+}
+
+void bt_streaming_selector_have_piece(
+    void *r,
+    int piece_idx
+)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_have_piece(me->rarest, piece_idx);
+    __take(me, piece_idx);
+    me->have[piece_idx / WORD_BITS] |= (uint64_t)1 << (piece_idx % WORD_BITS);
+}
+
+void bt_streaming_selector_remove_peer(
+    void *r,
+    void *peer
+)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_remove_peer(me->rarest, peer);
+    free(hashmap_remove(me->peers, peer));
+}
+
+void bt_streaming_selector_add_peer(
+    void *r,
+    void *peer
+)
+{
+    streaming_t *me = r;
+
+    /* make sure not to add duplicates */
+    if (hashmap_get(me->peers, peer))
+        return;
+
+    bt_rarestfirst_selector_add_peer(me->rarest, peer);
+    hashmap_put(me->peers, peer, calloc(1, sizeof(peer_t)));
+}
+
+void bt_streaming_selector_peer_have_piece(
+    void *r,
+    void *peer,
+    const int piece_idx
+)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_peer_have_piece(me->rarest, peer, piece_idx);
+}
+
+void bt_streaming_selector_peer_have_bitfield(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_peer_have_bitfield(me->rarest, peer, words,
+                                               npieces);
+}
+
+void bt_streaming_selector_peer_share_pieces(
+    void *r,
+    void *peer,
+    const uint64_t* words,
+    const int npieces
+)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_peer_share_pieces(me->rarest, peer, words,
+                                              npieces);
+}
+
+int bt_streaming_selector_get_npeers(void *r)
+{
+    streaming_t *me = r;
+
+    return hashmap_count(me->peers);
+}
+
+int bt_streaming_selector_get_npieces(void *r)
+{
+    streaming_t *me = r;
+
+    return me->npieces;
+}
+
+unsigned long bt_streaming_selector_get_memory(void *r)
+{
+    streaming_t *me = r;
+
+    return sizeof(streaming_t) + 2 * NWORDS(me->size) * sizeof(uint64_t) +
+        me->window * sizeof(int) +
+        hashmap_get_memory(me->peers) +
+        hashmap_count(me->peers) * sizeof(peer_t) +
+        bt_rarestfirst_selector_get_memory(me->rarest);
+}
+
+void bt_streaming_selector_get_availability_stats(void *r, bt_availability_t* a)
+{
+    streaming_t *me = r;
+
+    bt_rarestfirst_selector_get_availability_stats(me->rarest, a);
+}
+
+void bt_streaming_selector_set_cursor(void *r, int piece_idx)
+{
+    streaming_t *me = r;
+
+    me->cursor = piece_idx;
+}
+
+void bt_streaming_selector_set_window(void *r, int npieces)
+{
+    streaming_t *me = r;
+
+    if (npieces < 1)
+        npieces = 1;
+    me->window = npieces;
+    me->skipped = realloc(me->skipped, npieces * sizeof(int));
+}
+
+void bt_streaming_selector_set_deadline(void *r, unsigned int ms,
+                                        unsigned int bytes_per_sec,
+                                        unsigned int piece_len)
+{
+    unsigned long long bytes;
+
+    if (0 == piece_len)
+        return;
+
+    bytes = (unsigned long long)ms * bytes_per_sec / 1000;
+    bt_streaming_selector_set_window(r, (bytes + piece_len - 1) / piece_len);
+}
+
+void bt_streaming_selector_set_peer_rate(void *r, void *peer,
+                                         unsigned int rate)
+{
+    streaming_t *me = r;
+    peer_t* pr;
+
+    if ((pr = hashmap_get(me->peers, peer)))
+        pr->rate = rate;
+}
+
+/**
+ * @return number of peers that are faster than this one */
+static int __nfaster(streaming_t* me, const peer_t* pr)
+{
+    hashmap_iterator_t iter;
+    peer_t* other;
+    int n = 0;
+
+    for (hashmap_iterator(me->peers, &iter);
+        (other = hashmap_iterator_next_value(me->peers, &iter));)
+        if (pr->rate < other->rate)
+            n++;
+    return n;
+}
+
+/**
+ * @return 1 if a peer that's faster than this one has the piece */
+static int __faster_peer_has(streaming_t* me, const peer_t* pr, int idx)
+{
+    hashmap_iterator_t iter;
+    void* peer;
+
+    for (hashmap_iterator(me->peers, &iter);
+        (peer = hashmap_iterator_next(me->peers, &iter));)
+    {
+        peer_t* other = hashmap_get(me->peers, peer);
+
+        if (pr->rate < other->rate &&
+            bt_rarestfirst_selector_peer_has_piece(me->rarest, peer, idx))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * The earliest piece in the window the peer has. One peer per piece we
+ * still need goes to the fastest peers; the others only get pieces that
+ * nobody faster can send us
+ * @return idx of the piece; otherwise -1 */
+static int __poll_window(streaming_t* me, const void *peer, const peer_t* pr)
+{
+    int idx, end, nwanted = 0, nfaster;
+
+    end = me->cursor + me->window;
+    if (0 < me->npieces && me->npieces < end)
+        end = me->npieces;
+    __grow(me, end);
+
+    for (idx = me->cursor; idx < end; idx++)
+        if (!__bit(me->taken, idx))
+            nwanted++;
+
+    if (0 == nwanted)
+        return -1;
+
+    nfaster = __nfaster(me, pr);
+    for (idx = me->cursor; idx < end; idx++)
+    {
+        if (__bit(me->taken, idx) ||
+            !bt_rarestfirst_selector_peer_has_piece(me->rarest, peer, idx))
+            continue;
+
+        if (nfaster < nwanted || !__faster_peer_has(me, pr, idx))
+            return idx;
+    }
+
+    return -1;
+}
+
+int bt_streaming_selector_poll_best_piece(
+    void *r,
+    const void *peer
+)
+{
+    streaming_t *me = r;
+    peer_t *pr;
+    int idx, i, nskipped = 0;
+
+    if (!(pr = hashmap_get(me->peers, peer)))
+        return -1;
+
+    if (-1 != (idx = __poll_window(me, peer, pr)))
+    {
+        bt_rarestfirst_selector_have_piece(me->rarest, idx);
+        __take(me, idx);
+        return idx;
+    }
+
+    /*  fill up with the rarest, leaving the window to faster peers */
+    while (-1 != (idx = bt_rarestfirst_selector_poll_best_piece(me->rarest,
+                                                                peer)))
+    {
+        if (!__in_window(me, idx))
+            break;
+        me->skipped[nskipped++] = idx;
+    }
+
+    for (i = 0; i < nskipped; i++)
+        bt_rarestfirst_selector_giveback_piece(me->rarest, NULL,
+                                               me->skipped[i]);
+
+    if (-1 != idx)
+        __take(me, idx);
+
+    return idx;
+}
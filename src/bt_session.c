@@ -0,0 +1,546 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Many torrents on one loop, under shared limits
+ * @desc Torrents are found by infohash, so that one listening socket can
+ *       serve all of them. Connections, rates and disk cache memory are
+ *       budgeted across the torrents.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bt.h"
+#include "bt_diskcache.h"
+#include "bt_session.h"
+
+#include "config.h"
+#include "bt_hashmap.h"
+
+#define INFOHASH_LEN 20
+#define PROTOCOL_NAME "BitTorrent protocol"
+#define PROTOCOL_NAME_LEN 19
+
+/* pstrlen, pstr, reserved[8], infohash[20], peer_id[20] */
+#define HANDSHAKE_RESERVED (1 + PROTOCOL_NAME_LEN)
+#define HANDSHAKE_INFOHASH (HANDSHAKE_RESERVED + 8)
+#define HANDSHAKE_PEER_ID (HANDSHAKE_INFOHASH + INFOHASH_LEN)
+#define HANDSHAKE_LEN (HANDSHAKE_PEER_ID + BT_PEER_ID_LEN)
+
+typedef struct
+{
+    unsigned int version;
+    int max_connections;
+    int max_upload_rate;
+    int max_download_rate;
+    unsigned long long diskcache_write_bytes;
+    unsigned long long diskcache_read_bytes;
+    unsigned long long max_memory;
+} session_settings_t;
+
+typedef struct
+{
+    char infohash[INFOHASH_LEN];
+    bt_dm_t* dm;
+} torrent_t;
+
+/* a connection the session accepted */
+typedef struct
+{
+    void* conn_ctx;
+    char* ip;
+    int port;
+
+    /* the torrent it's been handed to; NULL while waiting for the
+     * handshake's infohash */
+    bt_dm_t* dm;
+
+    /* 1 if its torrent has been removed */
+    int orphaned;
+
+    /* the handshake so far */
+    char buf[HANDSHAKE_LEN];
+    unsigned int len;
+} conn_t;
+
+typedef struct
+{
+    config_t* cfg;
+    session_settings_t settings;
+
+    /* torrents in the order they're run, and keyed by infohash */
+    torrent_t** torrents;
+    int ntorrents;
+    int torrents_size;
+    void* by_infohash;
+
+    /* first torrent to run next bt_session_periodic */
+    unsigned int rr;
+
+    /* disk caches, and the config version they were last budgeted against;
+     * ~0 when the budgets need splitting again */
+    void** caches;
+    int ncaches;
+    int caches_size;
+    unsigned int caches_version;
+
+    /* accepted connections, keyed by conn_ctx */
+    void* conns;
+
+    /* held by torrents, or waiting on a handshake */
+    int nconnections;
+
+    /* bytes we may send and receive, and when they were last topped up */
+    int upload_tokens;
+    int download_tokens;
+    unsigned long long refill_ms;
+
+    /* NULL for CLOCK_MONOTONIC */
+    unsigned long long (*get_time_us)(void* udata);
+    void* clock_udata;
+} session_t;
+
+static unsigned long __infohash_hash(const void *obj)
+{
+    unsigned long h;
+
+    /* infohashes are already uniformly distributed */
+    memcpy(&h, obj, sizeof(h));
+    return h;
+}
+
+static long __infohash_compare(const void *obj, const void *other)
+{
+    return memcmp(obj, other, INFOHASH_LEN);
+}
+
+static unsigned long long __now_ms(session_t* me)
+{
+    struct timespec ts;
+
+    if (me->get_time_us)
+        return me->get_time_us(me->clock_udata) / 1000;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static session_settings_t* __cfg(session_t* me)
+{
+    config_t* cfg = me->cfg;
+    session_settings_t* s = &me->settings;
+
+    if (s->version == cfg->version)
+        return s;
+
+    s->version = cfg->version;
+    s->max_connections = config_get_int(cfg, "max_connections");
+    s->max_upload_rate = config_get_int(cfg, "max_upload_rate");
+    s->max_download_rate = config_get_int(cfg, "max_download_rate");
+    s->diskcache_write_bytes = config_get_ull(cfg, "diskcache_write_bytes");
+    s->diskcache_read_bytes = config_get_ull(cfg, "diskcache_read_bytes");
+    s->max_memory = config_get_ull(cfg, "max_memory");
+    return s;
+}
+
+void *bt_session_new()
+{
+    session_t* me = calloc(1, sizeof(session_t));
+
+    me->cfg = config_new();
+    me->settings.version = ~0u;
+    me->caches_version = ~0u;
+    config_set_if_not_set(me->cfg, "max_connections", "0");
+    config_set_if_not_set(me->cfg, "max_upload_rate", "0");
+    config_set_if_not_set(me->cfg, "max_download_rate", "0");
+    config_set_if_not_set(me->cfg, "diskcache_write_bytes", "33554432");
+    config_set_if_not_set(me->cfg, "diskcache_read_bytes", "16777216");
+    config_set_if_not_set(me->cfg, "max_memory", "0");
+    me->by_infohash = bt_hashmap_new(__infohash_hash, __infohash_compare, 11);
+    me->conns = bt_intmap_new(11);
+    me->refill_ms = __now_ms(me);
+    return me;
+}
+
+void bt_session_set_clock(void* s,
+                          unsigned long long (*get_time_us)(void* udata),
+                          void* udata)
+{
+    session_t* me = s;
+
+    me->get_time_us = get_time_us;
+    me->clock_udata = udata;
+    me->refill_ms = __now_ms(me);
+}
+
+static void __conn_free(conn_t* c)
+{
+    free(c->ip);
+    free(c);
+}
+
+void bt_session_free(void* s)
+{
+    session_t* me = s;
+    bt_hashmap_iterator_t iter;
+    conn_t* c;
+    int i;
+
+    for (i = 0; i < me->ntorrents; i++)
+    {
+        bt_dm_set_session(me->torrents[i]->dm, NULL);
+        free(me->torrents[i]);
+    }
+    free(me->torrents);
+    bt_hashmap_free(me->by_infohash);
+
+    for (bt_intmap_iterator(me->conns, &iter);
+         (c = bt_intmap_iterator_next_value(me->conns, &iter));)
+        __conn_free(c);
+    bt_intmap_free(me->conns);
+
+    free(me->caches);
+    config_free(me->cfg);
+    free(me);
+}
+
+void* bt_session_get_config(void* s)
+{
+    return ((session_t*)s)->cfg;
+}
+
+int bt_session_add_torrent(void* s, bt_dm_t* dm)
+{
+    session_t* me = s;
+    char* ih = config_get(bt_dm_get_config(dm), "infohash");
+    torrent_t* t;
+
+    if (!ih || bt_hashmap_get(me->by_infohash, ih))
+        return 0;
+
+    t = calloc(1, sizeof(torrent_t));
+    memcpy(t->infohash, ih, INFOHASH_LEN);
+    t->dm = dm;
+    bt_hashmap_put(me->by_infohash, t->infohash, t);
+
+    if (me->torrents_size <= me->ntorrents)
+    {
+        me->torrents_size = me->torrents_size * 2 + 8;
+        me->torrents = realloc(me->torrents,
+                               me->torrents_size * sizeof(torrent_t*));
+    }
+    me->torrents[me->ntorrents++] = t;
+
+    bt_dm_set_session(dm, me);
+    return 1;
+}
+
+int bt_session_remove_torrent(void* s, bt_dm_t* dm)
+{
+    session_t* me = s;
+    bt_hashmap_iterator_t iter;
+    conn_t* c;
+    int i;
+
+    for (i = 0; i < me->ntorrents; i++)
+        if (me->torrents[i]->dm == dm)
+            break;
+
+    if (i == me->ntorrents)
+        return 0;
+
+    bt_hashmap_remove(me->by_infohash, me->torrents[i]->infohash);
+    free(me->torrents[i]);
+    me->torrents[i] = me->torrents[--me->ntorrents];
+
+    for (bt_intmap_iterator(me->conns, &iter);
+         (c = bt_intmap_iterator_next_value(me->conns, &iter));)
+        if (c->dm == dm)
+        {
+            c->dm = NULL;
+            c->orphaned = 1;
+        }
+
+    bt_dm_set_memory_share(dm, 0);
+    bt_dm_set_session(dm, NULL);
+    return 1;
+}
+
+bt_dm_t* bt_session_get_torrent(void* s, const char* infohash)
+{
+    session_t* me = s;
+    torrent_t* t = bt_hashmap_get(me->by_infohash, infohash);
+
+    return t ? t->dm : NULL;
+}
+
+int bt_session_get_ntorrents(void* s)
+{
+    return ((session_t*)s)->ntorrents;
+}
+
+void bt_session_add_diskcache(void* s, void* dc)
+{
+    session_t* me = s;
+
+    if (me->caches_size <= me->ncaches)
+    {
+        me->caches_size = me->caches_size * 2 + 8;
+        me->caches = realloc(me->caches, me->caches_size * sizeof(void*));
+    }
+    me->caches[me->ncaches++] = dc;
+    me->caches_version = ~0u;
+}
+
+void bt_session_remove_diskcache(void* s, void* dc)
+{
+    session_t* me = s;
+    int i;
+
+    for (i = 0; i < me->ncaches; i++)
+        if (me->caches[i] == dc)
+        {
+            me->caches[i] = me->caches[--me->ncaches];
+            me->caches_version = ~0u;
+            return;
+        }
+}
+
+/**
+ * Give each cache an even share of the session's budgets. The caches read
+ * their config as they go, so a shrunken budget is flushed down to */
+static void __split_caches(session_t* me)
+{
+    session_settings_t* s = __cfg(me);
+    int i;
+
+    if (me->caches_version == s->version || 0 == me->ncaches)
+        return;
+
+    me->caches_version = s->version;
+    for (i = 0; i < me->ncaches; i++)
+    {
+        config_t* cfg = bt_diskcache_get_config(me->caches[i]);
+
+        config_set_va(cfg, "diskcache_write_bytes", "%llu",
+                      s->diskcache_write_bytes / me->ncaches);
+        config_set_va(cfg, "diskcache_read_bytes", "%llu",
+                      s->diskcache_read_bytes / me->ncaches);
+    }
+}
+
+/**
+ * Top up a token bucket. At most a second's worth of bytes is banked */
+static int __refill(int tokens, int rate, unsigned long long ms)
+{
+    long long t = tokens + (long long)rate * ms / 1000;
+    int burst = rate < (BT_BLOCK_SIZE) ? (BT_BLOCK_SIZE) : rate;
+
+    return burst < t ? burst : (int)t;
+}
+
+void bt_session_periodic(void* s)
+{
+    session_t* me = s;
+    session_settings_t* cfg = __cfg(me);
+    unsigned long long now = __now_ms(me), ms;
+    int i;
+
+    ms = now - me->refill_ms;
+    if (1000 < ms)
+        ms = 1000;
+    me->refill_ms = now;
+    if (cfg->max_upload_rate)
+        me->upload_tokens = __refill(me->upload_tokens,
+                                     cfg->max_upload_rate, ms);
+    if (cfg->max_download_rate)
+        me->download_tokens = __refill(me->download_tokens,
+                                       cfg->max_download_rate, ms);
+
+    __split_caches(me);
+
+    for (i = 0; i < me->ntorrents; i++)
+        bt_dm_set_memory_share(me->torrents[i]->dm,
+                               cfg->max_memory / me->ntorrents);
+
+    for (i = 0; i < me->ntorrents; i++)
+        bt_dm_periodic(me->torrents[(me->rr + i) % me->ntorrents]->dm, NULL);
+    me->rr++;
+}
+
+int bt_session_peer_connect(void* s, void* conn_ctx, char *ip,
+                            const int port)
+{
+    session_t* me = s;
+    conn_t* c;
+
+    if (!bt_session_may_open_connection(me) ||
+        bt_intmap_get(me->conns, (uintptr_t)conn_ctx))
+        return 0;
+
+    c = calloc(1, sizeof(conn_t));
+    c->conn_ctx = conn_ctx;
+    c->ip = strdup(ip);
+    c->port = port;
+    bt_intmap_put(me->conns, (uintptr_t)conn_ctx, c);
+    me->nconnections++;
+    return 1;
+}
+
+/**
+ * Check what we have of the handshake, so that junk is dropped early
+ * @return 1 if it's a BitTorrent handshake so far */
+static int __handshake_is_valid(const conn_t* c)
+{
+    unsigned int n = c->len < HANDSHAKE_RESERVED ? c->len : HANDSHAKE_RESERVED;
+
+    if (0 == n)
+        return 1;
+    return PROTOCOL_NAME_LEN == (unsigned char)c->buf[0] &&
+        0 == memcmp(c->buf + 1, PROTOCOL_NAME, n - 1);
+}
+
+static void __drop_conn(session_t* me, conn_t* c)
+{
+    bt_intmap_remove(me->conns, (uintptr_t)c->conn_ctx);
+    if (!c->dm && !c->orphaned)
+        me->nconnections--;
+    __conn_free(c);
+}
+
+/**
+ * The handshake is in. Hand the connection to the torrent with its
+ * infohash; the torrent doesn't read the handshake again
+ * @return 0 if no torrent takes it */
+static int __hand_over(session_t* me, conn_t* c)
+{
+    bt_dm_t* dm = bt_session_get_torrent(me, c->buf + HANDSHAKE_INFOHASH);
+    char* my_peerid;
+
+    if (!dm)
+        return 0;
+
+    /* we've connected to ourselves */
+    my_peerid = config_get(bt_dm_get_config(dm), "my_peerid");
+    if (my_peerid && 0 == strncmp(c->buf + HANDSHAKE_PEER_ID, my_peerid,
+                                  BT_PEER_ID_LEN))
+        return 0;
+
+    /* the torrent counts it from here */
+    me->nconnections--;
+    c->dm = dm;
+
+    if (!bt_dm_add_peer(dm, c->buf + HANDSHAKE_PEER_ID, BT_PEER_ID_LEN,
+                        c->ip, strlen(c->ip), c->port, c->conn_ctx, NULL))
+    {
+        c->orphaned = 1;
+        return 0;
+    }
+
+    /* our handshake goes out before our first message */
+    bt_dm_peer_connect(dm, c->conn_ctx, c->ip, c->port);
+    return bt_dm_peer_handshaked(dm, c->conn_ctx,
+                                 c->buf + HANDSHAKE_RESERVED);
+}
+
+int bt_session_dispatch_from_buffer(void* s, void* conn_ctx,
+                                    const char* buf, unsigned int len)
+{
+    session_t* me = s;
+    unsigned int n;
+    conn_t* c;
+
+    if (!(c = bt_intmap_get(me->conns, (uintptr_t)conn_ctx)) || c->orphaned)
+        return 0;
+
+    if (c->dm)
+        return bt_dm_dispatch_from_buffer(c->dm, conn_ctx, buf, len);
+
+    n = HANDSHAKE_LEN - c->len < len ? HANDSHAKE_LEN - c->len : len;
+    memcpy(c->buf + c->len, buf, n);
+    c->len += n;
+    buf += n;
+    len -= n;
+
+    if (!__handshake_is_valid(c))
+    {
+        __drop_conn(me, c);
+        return 0;
+    }
+
+    if (c->len < HANDSHAKE_LEN)
+        return 1;
+
+    if (!__hand_over(me, c))
+    {
+        __drop_conn(me, c);
+        return 0;
+    }
+
+    return 0 == len || bt_dm_dispatch_from_buffer(c->dm, conn_ctx, buf, len);
+}
+
+void bt_session_peer_disconnect(void* s, void* conn_ctx)
+{
+    session_t* me = s;
+    conn_t* c;
+
+    if ((c = bt_intmap_get(me->conns, (uintptr_t)conn_ctx)))
+        __drop_conn(me, c);
+}
+
+int bt_session_get_nconnections(void* s)
+{
+    return ((session_t*)s)->nconnections;
+}
+
+void bt_session_add_connections(void* s, int n)
+{
+    ((session_t*)s)->nconnections += n;
+}
+
+int bt_session_may_open_connection(void* s)
+{
+    session_t* me = s;
+
+    return 0 == __cfg(me)->max_connections ||
+        me->nconnections < __cfg(me)->max_connections;
+}
+
+int bt_session_may_upload(void* s)
+{
+    session_t* me = s;
+
+    return 0 == __cfg(me)->max_upload_rate || 0 < me->upload_tokens;
+}
+
+void bt_session_spend_upload(void* s, int bytes)
+{
+    session_t* me = s;
+
+    if (__cfg(me)->max_upload_rate)
+        me->upload_tokens -= bytes;
+}
+
+int bt_session_may_download(void* s)
+{
+    session_t* me = s;
+
+    return 0 == __cfg(me)->max_download_rate || 0 < me->download_tokens;
+}
+
+void bt_session_spend_download(void* s, int bytes)
+{
+    session_t* me = s;
+
+    if (__cfg(me)->max_download_rate)
+        me->download_tokens -= bytes;
+}
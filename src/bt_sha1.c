@@ -0,0 +1,366 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief SHA1 with a runtime selected compression kernel
+ * @desc Uses the x86 SHA extensions when the CPU has them, otherwise the
+ *       scalar transform from deps/sha1. Without the SHA extensions,
+ *       batches are hashed 4 buffers at a time in SSE2 lanes.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sha1.h"
+#include "bt_sha1.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BT_SHA1_HAVE_SHANI 1
+#define BT_SHA1_HAVE_SSE2 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*func_sha1_blocks_f)(uint32_t state[5],
+                                   const unsigned char* data,
+                                   unsigned int nblocks);
+
+/* compress nblocks of each of 4 buffers; state[i] is buffer i's */
+typedef void (*func_sha1_blocks4_f)(uint32_t state[4][5],
+                                    const unsigned char* data[4],
+                                    unsigned int nblocks);
+
+static void __blocks_scalar(uint32_t state[5], const unsigned char* data,
+                            unsigned int nblocks)
+{
+    for (; 0 < nblocks; nblocks--, data += 64)
+        SHA1Transform(state, data);
+}
+
+#ifdef BT_SHA1_HAVE_SHANI
+
+/* the message schedule is kept in a ring of 4 message groups */
+#define MSG(g) m[(g) & 3]
+#define SCHEDULE(g) \
+    MSG(g) = _mm_sha1msg2_epu32( \
+        _mm_xor_si128(_mm_sha1msg1_epu32(MSG(g), MSG((g) + 1)), \
+                      MSG((g) + 2)), MSG((g) + 3))
+
+/* 4 rounds, then derive E for the next group */
+#define ROUNDS(g, f) \
+    do { \
+        tmp = abcd; \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, f); \
+        if ((g) < 19) \
+        { \
+            if (3 <= (g)) SCHEDULE((g) + 1); \
+            e = _mm_sha1nexte_epu32(tmp, MSG((g) + 1)); \
+        } \
+    } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void __blocks_shani(uint32_t state[5], const unsigned char* data,
+                           unsigned int nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, e, tmp, m[4];
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    e = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; 0 < nblocks; nblocks--, data += 64)
+    {
+        __m128i abcd_save = abcd, e_save = e;
+        int i;
+
+        for (i = 0; i < 4; i++)
+            m[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*)(data + i * 16)), mask);
+
+        e = _mm_add_epi32(e, m[0]);
+        ROUNDS(0, 0); ROUNDS(1, 0); ROUNDS(2, 0); ROUNDS(3, 0); ROUNDS(4, 0);
+        ROUNDS(5, 1); ROUNDS(6, 1); ROUNDS(7, 1); ROUNDS(8, 1); ROUNDS(9, 1);
+        ROUNDS(10, 2); ROUNDS(11, 2); ROUNDS(12, 2); ROUNDS(13, 2);
+        ROUNDS(14, 2);
+        ROUNDS(15, 3); ROUNDS(16, 3); ROUNDS(17, 3); ROUNDS(18, 3);
+        ROUNDS(19, 3);
+
+        e = _mm_sha1nexte_epu32(tmp, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e, 3);
+}
+
+static int __cpu_has_shani()
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+    /* SSSE3 and SSE4.1 */
+    if (!(c & (1 << 9)) || !(c & (1 << 19)))
+        return 0;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return 0;
+    return 0 != (b & (1 << 29));
+}
+#endif
+
+#ifdef BT_SHA1_HAVE_SSE2
+
+/* lane i of each vector belongs to buffer i */
+#define ROL(x, n) \
+    _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define LANE(i) ((const __m128i*)(data[i] + off + t * 4))
+#define W(t) w[(t) & 15]
+#define EXPAND(t) \
+    (W(t) = ROL(_mm_xor_si128(_mm_xor_si128(W((t) - 3), W((t) - 8)), \
+                              _mm_xor_si128(W((t) - 14), W(t))), 1))
+#define F0(b, c, d) _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)))
+#define F1(b, c, d) _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define F2(b, c, d) \
+    _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)))
+#define ROUND4(f, k, x) \
+    do { \
+        tmp = _mm_add_epi32(_mm_add_epi32(ROL(a, 5), f(b, c, d)), \
+                            _mm_add_epi32(_mm_add_epi32(e, k), x)); \
+        e = d; d = c; c = ROL(b, 30); b = a; a = tmp; \
+    } while (0)
+
+__attribute__((target("sse2")))
+static __m128i __bswap4(__m128i x)
+{
+    const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+
+    x = _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16));
+    return _mm_or_si128(_mm_slli_epi32(_mm_and_si128(x, mask), 8),
+                        _mm_and_si128(_mm_srli_epi32(x, 8), mask));
+}
+
+__attribute__((target("sse2")))
+static void __blocks4_sse2(uint32_t state[4][5], const unsigned char* data[4],
+                           unsigned int nblocks)
+{
+    const __m128i k0 = _mm_set1_epi32(0x5A827999),
+                  k1 = _mm_set1_epi32(0x6ED9EBA1),
+                  k2 = _mm_set1_epi32(0x8F1BBCDC),
+                  k3 = _mm_set1_epi32(0xCA62C1D6);
+    __m128i s[5], w[16], a, b, c, d, e, tmp;
+    uint32_t out[5][4];
+    unsigned int off;
+    int i, t;
+
+    for (i = 0; i < 5; i++)
+        s[i] = _mm_set_epi32(state[3][i], state[2][i], state[1][i],
+                             state[0][i]);
+
+    for (off = 0; off < nblocks * 64; off += 64)
+    {
+        /* transpose each 16 bytes of the 4 buffers into 4 words' lanes */
+        for (t = 0; t < 16; t += 4)
+        {
+            __m128i r0 = _mm_loadu_si128(LANE(0)),
+                    r1 = _mm_loadu_si128(LANE(1)),
+                    r2 = _mm_loadu_si128(LANE(2)),
+                    r3 = _mm_loadu_si128(LANE(3)),
+                    l01 = _mm_unpacklo_epi32(r0, r1),
+                    h01 = _mm_unpackhi_epi32(r0, r1),
+                    l23 = _mm_unpacklo_epi32(r2, r3),
+                    h23 = _mm_unpackhi_epi32(r2, r3);
+
+            w[t] = __bswap4(_mm_unpacklo_epi64(l01, l23));
+            w[t + 1] = __bswap4(_mm_unpackhi_epi64(l01, l23));
+            w[t + 2] = __bswap4(_mm_unpacklo_epi64(h01, h23));
+            w[t + 3] = __bswap4(_mm_unpackhi_epi64(h01, h23));
+        }
+
+        a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];
+        for (t = 0; t < 16; t++)
+            ROUND4(F0, k0, W(t));
+        for (; t < 20; t++)
+            ROUND4(F0, k0, EXPAND(t));
+        for (; t < 40; t++)
+            ROUND4(F1, k1, EXPAND(t));
+        for (; t < 60; t++)
+            ROUND4(F2, k2, EXPAND(t));
+        for (; t < 80; t++)
+            ROUND4(F1, k3, EXPAND(t));
+
+        s[0] = _mm_add_epi32(s[0], a);
+        s[1] = _mm_add_epi32(s[1], b);
+        s[2] = _mm_add_epi32(s[2], c);
+        s[3] = _mm_add_epi32(s[3], d);
+        s[4] = _mm_add_epi32(s[4], e);
+    }
+
+    for (i = 0; i < 5; i++)
+        _mm_storeu_si128((__m128i*)out[i], s[i]);
+    for (i = 0; i < 20; i++)
+        state[i % 4][i / 4] = out[i / 4][i % 4];
+}
+
+static int __cpu_has_sse2()
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+    return 0 != (d & (1 << 26));
+}
+#endif
+
+static func_sha1_blocks_f __blocks = NULL;
+
+/* NULL when batches are run a buffer at a time */
+static func_sha1_blocks4_f __blocks4 = NULL;
+
+static func_sha1_blocks_f __get_blocks()
+{
+    if (!__blocks)
+        bt_sha1_set_acceleration(1);
+    return __blocks;
+}
+
+int bt_sha1_set_acceleration(int enabled)
+{
+#ifdef BT_SHA1_HAVE_SHANI
+    /* the SHA extensions run one buffer faster than SSE2 runs four */
+    if (enabled && __cpu_has_shani())
+    {
+        __blocks = __blocks_shani;
+        __blocks4 = NULL;
+        return 1;
+    }
+#endif
+    __blocks = __blocks_scalar;
+    __blocks4 = NULL;
+#ifdef BT_SHA1_HAVE_SSE2
+    if (__cpu_has_sse2())
+        __blocks4 = __blocks4_sse2;
+#endif
+    return 0;
+}
+
+void bt_sha1_init(bt_sha1_ctx_t* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->count = 0;
+}
+
+void bt_sha1_update(bt_sha1_ctx_t* ctx, const void* data_, unsigned int len)
+{
+    const unsigned char* data = data_;
+    unsigned int have = ctx->count % 64;
+
+    ctx->count += len;
+
+    /* top up partially filled buffer */
+    if (0 < have)
+    {
+        unsigned int n = 64 - have < len ? 64 - have : len;
+
+        memcpy(ctx->buffer + have, data, n);
+        data += n;
+        len -= n;
+        if (have + n < 64)
+            return;
+        __get_blocks()(ctx->state, ctx->buffer, 1);
+    }
+
+    if (64 <= len)
+    {
+        __get_blocks()(ctx->state, data, len / 64);
+        data += len / 64 * 64;
+        len %= 64;
+    }
+
+    memcpy(ctx->buffer, data, len);
+}
+
+void bt_sha1_final(bt_sha1_ctx_t* ctx, char* hash)
+{
+    unsigned char pad[72];
+    uint64_t bits = ctx->count * 8;
+    unsigned int npad, i;
+
+    /* pad to 56 bytes mod 64, leaving room for the length */
+    npad = (ctx->count % 64 < 56 ? 56 : 120) - ctx->count % 64;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[npad + i] = (unsigned char)(bits >> (56 - i * 8));
+    bt_sha1_update(ctx, pad, npad + 8);
+
+    for (i = 0; i < 20; i++)
+        hash[i] = (char)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+void bt_sha1(char* hash, const void* data, unsigned int len)
+{
+    bt_sha1_ctx_t ctx;
+
+    bt_sha1_init(&ctx);
+    bt_sha1_update(&ctx, data, len);
+    bt_sha1_final(&ctx, hash);
+}
+
+/**
+ * Hash 4 buffers together for as many blocks as the shortest has; each
+ * buffer's tail is then finished on its own */
+static void __sha1_4(char** hashes, const void** data_,
+                     const unsigned int* lens)
+{
+    const unsigned char* data[4];
+    bt_sha1_ctx_t ctx[4];
+    uint32_t state[4][5];
+    unsigned int nblocks = lens[0] / 64;
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        bt_sha1_init(&ctx[i]);
+        memcpy(state[i], ctx[i].state, sizeof(state[i]));
+        data[i] = data_[i];
+        if (lens[i] / 64 < nblocks)
+            nblocks = lens[i] / 64;
+    }
+
+    if (0 < nblocks)
+        __blocks4(state, data, nblocks);
+
+    for (i = 0; i < 4; i++)
+    {
+        memcpy(ctx[i].state, state[i], sizeof(state[i]));
+        ctx[i].count = (uint64_t)nblocks * 64;
+        bt_sha1_update(&ctx[i], data[i] + nblocks * 64,
+                       lens[i] - nblocks * 64);
+        bt_sha1_final(&ctx[i], hashes[i]);
+    }
+}
+
+void bt_sha1_multi(int n, char** hashes, const void** data,
+                   const unsigned int* lens)
+{
+    int i = 0;
+
+    __get_blocks();
+    if (__blocks4)
+        for (; i + 4 <= n; i += 4)
+            __sha1_4(hashes + i, data + i, lens + i);
+
+    for (; i < n; i++)
+        bt_sha1(hashes[i], data[i], lens[i]);
+}
@@ -0,0 +1,270 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief SHA256 and v2 merkle roots, with a runtime selected kernel
+ * @desc Uses the x86 SHA extensions when the CPU has them, otherwise a
+ *       scalar transform.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bt_sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BT_SHA256_HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*func_sha256_blocks_f)(uint32_t state[8],
+                                     const unsigned char* data,
+                                     unsigned int nblocks);
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void __blocks_scalar(uint32_t state[8], const unsigned char* data,
+                            unsigned int nblocks)
+{
+    for (; 0 < nblocks; nblocks--, data += 64)
+    {
+        uint32_t w[64], s[8], t1, t2;
+        int i;
+
+        for (i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[i * 4] << 24 |
+                   (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 |
+                   (uint32_t)data[i * 4 + 3];
+        for (; i < 64; i++)
+            w[i] = w[i - 16] +
+                   (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+                   w[i - 7] +
+                   (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+        memcpy(s, state, sizeof(s));
+        for (i = 0; i < 64; i++)
+        {
+            t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+                 ((s[4] & s[5]) ^ (~s[4] & s[6])) + K[i] + w[i];
+            t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+                 ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            memmove(s + 1, s, 7 * sizeof(uint32_t));
+            s[4] += t1;
+            s[0] = t1 + t2;
+        }
+
+        for (i = 0; i < 8; i++)
+            state[i] += s[i];
+    }
+}
+
+#ifdef BT_SHA256_HAVE_SHANI
+
+/* the message schedule is kept in a ring of 4 message groups */
+#define MSG(g) m[(g) & 3]
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void __blocks_shani(uint32_t state[8], const unsigned char* data,
+                           unsigned int nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i abef, cdgh, tmp, msg, m[4];
+
+    /* the rounds want the state as ABEF and CDGH */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xB1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)),
+                             0x1B);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; 0 < nblocks; nblocks--, data += 64)
+    {
+        __m128i abef_save = abef, cdgh_save = cdgh;
+        int g;
+
+        for (g = 0; g < 16; g++)
+        {
+            if (g < 4)
+                MSG(g) = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i*)(data + g * 16)), mask);
+            else
+                MSG(g) = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(MSG(g), MSG(g + 1)),
+                                  _mm_alignr_epi8(MSG(g + 3), MSG(g + 2), 4)),
+                    MSG(g + 3));
+
+            /* 4 rounds, 2 at a time */
+            msg = _mm_add_epi32(MSG(g),
+                                _mm_loadu_si128((const __m128i*)&K[g * 4]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                                         _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static int __cpu_has_shani()
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+    /* SSSE3 and SSE4.1 */
+    if (!(c & (1 << 9)) || !(c & (1 << 19)))
+        return 0;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return 0;
+    return 0 != (b & (1 << 29));
+}
+#endif
+
+static func_sha256_blocks_f __blocks = NULL;
+
+static func_sha256_blocks_f __get_blocks()
+{
+    if (!__blocks)
+        bt_sha256_set_acceleration(1);
+    return __blocks;
+}
+
+int bt_sha256_set_acceleration(int enabled)
+{
+#ifdef BT_SHA256_HAVE_SHANI
+    if (enabled && __cpu_has_shani())
+    {
+        __blocks = __blocks_shani;
+        return 1;
+    }
+#endif
+    __blocks = __blocks_scalar;
+    return 0;
+}
+
+void bt_sha256_init(bt_sha256_ctx_t* ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+void bt_sha256_update(bt_sha256_ctx_t* ctx, const void* data_,
+                      unsigned int len)
+{
+    const unsigned char* data = data_;
+    unsigned int have = ctx->count % 64;
+
+    ctx->count += len;
+
+    /* top up partially filled buffer */
+    if (0 < have)
+    {
+        unsigned int n = 64 - have < len ? 64 - have : len;
+
+        memcpy(ctx->buffer + have, data, n);
+        data += n;
+        len -= n;
+        if (have + n < 64)
+            return;
+        __get_blocks()(ctx->state, ctx->buffer, 1);
+    }
+
+    if (64 <= len)
+    {
+        __get_blocks()(ctx->state, data, len / 64);
+        data += len / 64 * 64;
+        len %= 64;
+    }
+
+    memcpy(ctx->buffer, data, len);
+}
+
+void bt_sha256_final(bt_sha256_ctx_t* ctx, char* hash)
+{
+    unsigned char pad[72];
+    uint64_t bits = ctx->count * 8;
+    unsigned int npad, i;
+
+    /* pad to 56 bytes mod 64, leaving room for the length */
+    npad = (ctx->count % 64 < 56 ? 56 : 120) - ctx->count % 64;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[npad + i] = (unsigned char)(bits >> (56 - i * 8));
+    bt_sha256_update(ctx, pad, npad + 8);
+
+    for (i = 0; i < 32; i++)
+        hash[i] = (char)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+void bt_sha256(char* hash, const void* data, unsigned int len)
+{
+    bt_sha256_ctx_t ctx;
+
+    bt_sha256_init(&ctx);
+    bt_sha256_update(&ctx, data, len);
+    bt_sha256_final(&ctx, hash);
+}
+
+int bt_sha256_merkle_root(char* root, const char* leaves,
+                          unsigned int nleaves, unsigned int width)
+{
+    char *layer;
+
+    if (0 == width || 0 != (width & (width - 1)) || width < nleaves)
+        return 0;
+
+    /* each layer is hashed in place, pairs into the first half */
+    layer = calloc(width, 32);
+    memcpy(layer, leaves, nleaves * 32);
+    for (; 1 < width; width /= 2)
+    {
+        unsigned int i;
+
+        for (i = 0; i < width / 2; i++)
+            bt_sha256(layer + i * 32, layer + i * 64, 64);
+    }
+    memcpy(root, layer, 32);
+    free(layer);
+    return 1;
+}
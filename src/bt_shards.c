@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Split a job over threads and wait for all of them
+ * @desc The threads are kept between runs, so that a run only costs a
+ *       wakeup per thread.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bt_shards.h"
+
+typedef struct shards_s shards_t;
+
+typedef struct
+{
+    shards_t* me;
+    int shard;
+    pthread_t thread;
+} worker_t;
+
+struct shards_s
+{
+    pthread_mutex_t lock;
+
+    /* signalled when a run starts, and when the last shard finishes */
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    worker_t* workers;
+    int nshards;
+
+    /* bumped by each run, so workers can tell a new one has started */
+    unsigned int generation;
+
+    /* shards of the current run still working, not counting shard 0 */
+    int pending;
+
+    int shutdown;
+
+    func_shard_f run;
+    void* udata;
+};
+
+static void* __worker(void* w_)
+{
+    worker_t* w = w_;
+    shards_t* me = w->me;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&me->lock);
+    while (1)
+    {
+        func_shard_f run;
+        void* udata;
+
+        while (!me->shutdown && seen == me->generation)
+            pthread_cond_wait(&me->start, &me->lock);
+        if (me->shutdown)
+            break;
+        seen = me->generation;
+        run = me->run;
+        udata = me->udata;
+        pthread_mutex_unlock(&me->lock);
+
+        run(udata, w->shard, me->nshards);
+
+        pthread_mutex_lock(&me->lock);
+        if (0 == --me->pending)
+            pthread_cond_signal(&me->done);
+    }
+    pthread_mutex_unlock(&me->lock);
+    return NULL;
+}
+
+void *bt_shards_new(int nshards)
+{
+    shards_t* me;
+    int i;
+
+    if (nshards < 1)
+        return NULL;
+
+    me = calloc(1, sizeof(shards_t));
+    me->nshards = nshards;
+    pthread_mutex_init(&me->lock, NULL);
+    pthread_cond_init(&me->start, NULL);
+    pthread_cond_init(&me->done, NULL);
+    me->workers = calloc(nshards, sizeof(worker_t));
+
+    for (i = 1; i < nshards; i++)
+    {
+        me->workers[i].me = me;
+        me->workers[i].shard = i;
+        if (0 != pthread_create(&me->workers[i].thread, NULL, __worker,
+                                &me->workers[i]))
+        {
+            /* carry on with the threads we have */
+            me->nshards = i;
+            break;
+        }
+    }
+
+    return me;
+}
+
+void bt_shards_free(void* s)
+{
+    shards_t* me = s;
+    int i;
+
+    pthread_mutex_lock(&me->lock);
+    me->shutdown = 1;
+    pthread_cond_broadcast(&me->start);
+    pthread_mutex_unlock(&me->lock);
+
+    for (i = 1; i < me->nshards; i++)
+        pthread_join(me->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&me->start);
+    pthread_cond_destroy(&me->done);
+    pthread_mutex_destroy(&me->lock);
+    free(me->workers);
+    free(me);
+}
+
+int bt_shards_count(void* s)
+{
+    return ((shards_t*)s)->nshards;
+}
+
+void bt_shards_run(void* s, void* udata, func_shard_f run)
+{
+    shards_t* me = s;
+
+    if (1 == me->nshards)
+    {
+        run(udata, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&me->lock);
+    me->run = run;
+    me->udata = udata;
+    me->pending = me->nshards - 1;
+    me->generation++;
+    pthread_cond_broadcast(&me->start);
+    pthread_mutex_unlock(&me->lock);
+
+    run(udata, 0, me->nshards);
+
+    pthread_mutex_lock(&me->lock);
+    while (0 < me->pending)
+        pthread_cond_wait(&me->done, &me->lock);
+    pthread_mutex_unlock(&me->lock);
+}
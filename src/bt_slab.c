@@ -0,0 +1,205 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Pool of equally sized buffers
+ * @desc Piece buffers are large and short lived. Carving them out of a few
+ *       big mappings, and keeping released buffers on a freelist, stops them
+ *       churning the heap. Released buffers hold the freelist's next
+ *       pointer in their first bytes.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bt_slab.h"
+
+/* we map at least this much at a time; the size of a huge page on x86 */
+#define SLAB_MIN_BYTES (1 << 21)
+
+typedef struct
+{
+    void* base;
+    size_t len;
+} slab_mapping_t;
+
+typedef struct
+{
+    unsigned int buf_len;
+    unsigned int bufs_per_slab;
+    unsigned long long max_bytes;
+    unsigned long long mapped_bytes;
+    int hugepages;
+
+    slab_mapping_t* slabs;
+    int nslabs;
+
+    void* freelist;
+} slab_t;
+
+void *bt_slab_new(unsigned int buf_len, unsigned long long max_bytes,
+                  int hugepages)
+{
+    slab_t* me;
+
+    me = calloc(1, sizeof(slab_t));
+    /* the freelist lives inside released buffers, so keep them aligned */
+    me->buf_len = (buf_len + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (0 == me->buf_len)
+        me->buf_len = sizeof(void*);
+    me->bufs_per_slab = SLAB_MIN_BYTES / me->buf_len;
+    /* small budgets get a single smaller slab */
+    if (max_bytes < (unsigned long long)me->buf_len * me->bufs_per_slab)
+        me->bufs_per_slab = max_bytes / me->buf_len;
+    if (0 == me->bufs_per_slab)
+        me->bufs_per_slab = 1;
+    me->max_bytes = max_bytes;
+    me->hugepages = hugepages;
+    return me;
+}
+
+void bt_slab_free(void* s)
+{
+    slab_t* me = s;
+    int i;
+
+    for (i = 0; i < me->nslabs; i++)
+        munmap(me->slabs[i].base, me->slabs[i].len);
+    free(me->slabs);
+    free(me);
+}
+
+static void* __map(slab_t* me, size_t len)
+{
+    void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (me->hugepages && 0 == len % SLAB_MIN_BYTES)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (MAP_FAILED == p)
+    {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == p)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        /* transparent huge pages, if no pages were reserved */
+        if (me->hugepages)
+            madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    return p;
+}
+
+/**
+ * Map another slab and put its buffers on the freelist
+ * @return 0 if we're at the budget or mapping failed */
+static int __grow(slab_t* me)
+{
+    size_t len = (size_t)me->buf_len * me->bufs_per_slab;
+    char* p;
+    unsigned int i;
+
+    if (me->max_bytes < me->mapped_bytes + len)
+        return 0;
+
+    if (!(p = __map(me, len)))
+        return 0;
+
+    me->slabs = realloc(me->slabs, sizeof(slab_mapping_t) * (me->nslabs + 1));
+    me->slabs[me->nslabs].base = p;
+    me->slabs[me->nslabs].len = len;
+    me->nslabs++;
+    me->mapped_bytes += len;
+
+    for (i = me->bufs_per_slab; 0 < i; i--)
+    {
+        void* buf = p + (size_t)(i - 1) * me->buf_len;
+
+        *(void**)buf = me->freelist;
+        me->freelist = buf;
+    }
+
+    return 1;
+}
+
+void *bt_slab_alloc(void* s)
+{
+    slab_t* me = s;
+    void* buf;
+
+    if (!me->freelist && !__grow(me))
+        return malloc(me->buf_len);
+
+    buf = me->freelist;
+    me->freelist = *(void**)buf;
+    return buf;
+}
+
+int bt_slab_find(void* s, void* buf)
+{
+    slab_t* me = s;
+    int i;
+
+    for (i = 0; i < me->nslabs; i++)
+        if (me->slabs[i].base <= buf &&
+            (char*)buf < (char*)me->slabs[i].base + me->slabs[i].len)
+            return i;
+    return -1;
+}
+
+void bt_slab_release(void* s, void* buf)
+{
+    slab_t* me = s;
+
+    if (!buf)
+        return;
+
+    if (-1 == bt_slab_find(me, buf))
+    {
+        free(buf);
+        return;
+    }
+
+    *(void**)buf = me->freelist;
+    me->freelist = buf;
+}
+
+unsigned long long bt_slab_get_mapped_bytes(void* s)
+{
+    return ((slab_t*)s)->mapped_bytes;
+}
+
+int bt_slab_reserve(void* s)
+{
+    slab_t* me = s;
+
+    while (__grow(me))
+        ;
+    return me->max_bytes < me->mapped_bytes +
+        (unsigned long long)me->buf_len * me->bufs_per_slab;
+}
+
+int bt_slab_get_nslabs(void* s)
+{
+    return ((slab_t*)s)->nslabs;
+}
+
+void *bt_slab_get_slab(void* s, int idx, unsigned long long *len)
+{
+    slab_t* me = s;
+
+    *len = me->slabs[idx].len;
+    return me->slabs[idx].base;
+}
@@ -0,0 +1,267 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Hierarchical timing wheel
+ * @desc Four levels of 64 slots. Level 0 holds timers due in the next 64ms,
+ *       level 1 the next 4096ms, and so on. Each time a level wraps around,
+ *       the matching slot of the level above is cascaded down. Adding and
+ *       cancelling are O(1) and stepping only touches the slots that expire.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bt_timerwheel.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELAY ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+typedef struct tw_timer_s tw_timer_t;
+
+struct tw_timer_s
+{
+    tw_timer_t *next, *prev;
+    unsigned long long expires;
+    void* udata;
+    void (*cb)(void* udata);
+};
+
+typedef struct
+{
+    /* time the wheel has been stepped up to */
+    unsigned long long now;
+
+    /* circular lists; each slot is a sentinel */
+    tw_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+    /* timers that have expired but have not been called yet */
+    tw_timer_t firing;
+
+    /* recycled timers */
+    tw_timer_t* freelist;
+
+    int count;
+} wheel_t;
+
+static void __list_init(tw_timer_t* l)
+{
+    l->next = l->prev = l;
+}
+
+static void __list_unlink(tw_timer_t* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = t;
+}
+
+static void __list_push(tw_timer_t* l, tw_timer_t* t)
+{
+    t->prev = l->prev;
+    t->next = l;
+    l->prev->next = t;
+    l->prev = t;
+}
+
+/**
+ * Move every timer in src to the end of dst */
+static void __list_splice(tw_timer_t* dst, tw_timer_t* src)
+{
+    if (src->next == src)
+        return;
+    src->next->prev = dst->prev;
+    src->prev->next = dst;
+    dst->prev->next = src->next;
+    dst->prev = src->prev;
+    __list_init(src);
+}
+
+static void __place(wheel_t* me, tw_timer_t* t)
+{
+    unsigned long long diff;
+    int level;
+
+    if (t->expires <= me->now)
+    {
+        __list_push(&me->firing, t);
+        return;
+    }
+
+    diff = t->expires - me->now;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (diff < 1ULL << (WHEEL_BITS * (level + 1)))
+            break;
+
+    __list_push(&me->slots[level][(t->expires >> (WHEEL_BITS * level)) &
+                                  WHEEL_MASK], t);
+}
+
+/**
+ * Re-place the timers in this level's current slot into the levels below
+ * @return 1 if this level also wrapped around */
+static int __cascade(wheel_t* me, int level)
+{
+    tw_timer_t tmp, *t;
+    int idx = (me->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    __list_init(&tmp);
+    __list_splice(&tmp, &me->slots[level][idx]);
+    while (tmp.next != &tmp)
+    {
+        t = tmp.next;
+        __list_unlink(t);
+        __place(me, t);
+    }
+    return idx == 0;
+}
+
+void *bt_timerwheel_new(unsigned long long now_ms)
+{
+    wheel_t* me;
+    int i, j;
+
+    me = calloc(1, sizeof(wheel_t));
+    me->now = now_ms;
+    for (i = 0; i < WHEEL_LEVELS; i++)
+        for (j = 0; j < WHEEL_SLOTS; j++)
+            __list_init(&me->slots[i][j]);
+    __list_init(&me->firing);
+    return me;
+}
+
+static void __free_list(tw_timer_t* l)
+{
+    while (l->next != l)
+    {
+        tw_timer_t* t = l->next;
+
+        __list_unlink(t);
+        free(t);
+    }
+}
+
+void bt_timerwheel_free(void* w)
+{
+    wheel_t* me = w;
+    int i, j;
+
+    for (i = 0; i < WHEEL_LEVELS; i++)
+        for (j = 0; j < WHEEL_SLOTS; j++)
+            __free_list(&me->slots[i][j]);
+    __free_list(&me->firing);
+    while (me->freelist)
+    {
+        tw_timer_t* t = me->freelist;
+
+        me->freelist = t->next;
+        free(t);
+    }
+    free(me);
+}
+
+void *bt_timerwheel_add(void* w, unsigned int delay_ms, void* udata,
+                        void (*cb)(void* udata))
+{
+    wheel_t* me = w;
+    tw_timer_t* t;
+
+    if (me->freelist)
+    {
+        t = me->freelist;
+        me->freelist = t->next;
+    }
+    else
+        t = malloc(sizeof(tw_timer_t));
+
+    if (0 == delay_ms)
+        delay_ms = 1;
+    t->expires = me->now + (delay_ms < WHEEL_MAX_DELAY ?
+                            delay_ms : WHEEL_MAX_DELAY);
+    t->udata = udata;
+    t->cb = cb;
+    __list_init(t);
+    __place(me, t);
+    me->count++;
+    return t;
+}
+
+static void __giveback(wheel_t* me, tw_timer_t* t)
+{
+    t->next = me->freelist;
+    me->freelist = t;
+    me->count--;
+}
+
+void bt_timerwheel_cancel(void* w, void* t_)
+{
+    tw_timer_t* t = t_;
+
+    __list_unlink(t);
+    __giveback(w, t);
+}
+
+static int __fire(wheel_t* me)
+{
+    int n = 0;
+
+    while (me->firing.next != &me->firing)
+    {
+        tw_timer_t* t = me->firing.next;
+        void (*cb)(void*) = t->cb;
+        void* udata = t->udata;
+
+        /* give the timer back first so the callback can re-arm cheaply */
+        __list_unlink(t);
+        __giveback(me, t);
+        cb(udata);
+        n++;
+    }
+
+    return n;
+}
+
+int bt_timerwheel_step(void* w, unsigned long long now_ms)
+{
+    wheel_t* me = w;
+    int n = __fire(me);
+
+    while (me->now < now_ms)
+    {
+        int level;
+
+        /* nothing is scheduled, so there is nothing to walk through */
+        if (0 == me->count)
+        {
+            me->now = now_ms;
+            break;
+        }
+
+        me->now++;
+        for (level = 1;
+             level < WHEEL_LEVELS &&
+             0 == (me->now & ((1ULL << (WHEEL_BITS * level)) - 1));
+             level++)
+            if (!__cascade(me, level))
+                break;
+
+        __list_splice(&me->firing, &me->slots[0][me->now & WHEEL_MASK]);
+        n += __fire(me);
+    }
+
+    return n;
+}
+
+int bt_timerwheel_count(void* w)
+{
+    return ((wheel_t*)w)->count;
+}
@@ -0,0 +1,256 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Tracepoints recorded into per-thread rings
+ * @desc Each thread that traces gets its own ring, so emitting an event
+ *       takes no lock and shares no cache lines. The thread is the ring's
+ *       only writer. It fills in the slot and then publishes it by moving
+ *       the head on; readers copy the slots behind the head, and then
+ *       check the head again to drop anything that was overwritten under
+ *       them. Rings are kept once made, as a thread may trace until exit.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bt_trace.h"
+
+/* PWP_MSGTYPE_*, for formatting */
+static const char* __msgtypes[] = {
+    "CHOKE", "UNCHOKE", "INTERESTED", "UNINTERESTED", "HAVE", "BITFIELD",
+    "REQUEST", "PIECE", "CANCEL", "PORT", NULL, NULL, NULL, "SUGGEST",
+    "HAVE_ALL", "HAVE_NONE", "REJECT", "ALLOWED_FAST", NULL, NULL,
+    "EXTENDED"
+};
+
+typedef struct ring_s ring_t;
+
+struct ring_s
+{
+    ring_t* next;
+
+    /* events ever written; the next goes at head & mask */
+    unsigned long long head;
+
+    /* events before this were cleared */
+    unsigned long long start;
+
+    unsigned int mask;
+    bt_trace_event_t* events;
+};
+
+unsigned int bt_trace_mask = 0;
+
+static unsigned int __ring_size = 4096;
+
+/* every ring made, newest first */
+static ring_t* __rings = NULL;
+static pthread_mutex_t __rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ring_t* __ring = NULL;
+
+static unsigned long long __now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ring_t* __ring_new()
+{
+    ring_t* r = calloc(1, sizeof(ring_t));
+    unsigned int size = 1;
+
+    while (size < __atomic_load_n(&__ring_size, __ATOMIC_RELAXED))
+        size <<= 1;
+    r->mask = size - 1;
+    r->events = calloc(size, sizeof(bt_trace_event_t));
+
+    pthread_mutex_lock(&__rings_lock);
+    r->next = __rings;
+    __atomic_store_n(&__rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&__rings_lock);
+    return r;
+}
+
+void bt_trace_set_mask(unsigned int mask)
+{
+    __atomic_store_n(&bt_trace_mask, mask, __ATOMIC_RELAXED);
+}
+
+void bt_trace_set_ring_size(unsigned int nevents)
+{
+    __atomic_store_n(&__ring_size, nevents, __ATOMIC_RELAXED);
+}
+
+void bt_trace_emit(int event, const void* peer, unsigned int piece_idx,
+                   unsigned int offset, unsigned int len)
+{
+    ring_t* r = __ring;
+    bt_trace_event_t* e;
+    unsigned long long head;
+
+    if (!r)
+        r = __ring = __ring_new();
+
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    e = &r->events[head & r->mask];
+    e->ns = __now_ns();
+    e->peer = peer;
+    e->event = event;
+    e->piece_idx = piece_idx;
+    e->offset = offset;
+    e->len = len;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy the ring's newest events
+ * @return number copied */
+static int __ring_copy(ring_t* r, bt_trace_event_t* out, int n)
+{
+    unsigned long long head, first, i, start;
+    unsigned long long size = (unsigned long long)r->mask + 1;
+    int kept;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    start = __atomic_load_n(&r->start, __ATOMIC_RELAXED);
+    first = head < size ? 0 : head - size;
+    if (first < start)
+        first = start;
+    if ((unsigned long long)n < head - first)
+        first = head - n;
+
+    for (i = first; i < head; i++)
+        out[i - first] = r->events[i & r->mask];
+
+    /* the writer may have lapped us while we copied */
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (first + size < head)
+    {
+        unsigned long long lost = head - size - first;
+
+        if (lost > i - first)
+            return 0;
+        kept = (int)(i - first - lost);
+        memmove(out, out + lost, kept * sizeof(bt_trace_event_t));
+        return kept;
+    }
+    return (int)(i - first);
+}
+
+static int __cmp_ns(const void* a, const void* b)
+{
+    const bt_trace_event_t *x = a, *y = b;
+
+    return x->ns < y->ns ? -1 : x->ns > y->ns ? 1 : 0;
+}
+
+int bt_trace_snapshot(bt_trace_event_t* events, int nevents)
+{
+    ring_t* r;
+    bt_trace_event_t* all;
+    int n = 0, nrings = 0, size = 0;
+
+    for (r = __atomic_load_n(&__rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+        size += r->mask + 1;
+        nrings++;
+    }
+    if (0 == nrings || nevents <= 0)
+        return 0;
+
+    all = malloc(size * sizeof(bt_trace_event_t));
+    for (r = __atomic_load_n(&__rings, __ATOMIC_ACQUIRE);
+         r && 0 < nrings; r = r->next, nrings--)
+        n += __ring_copy(r, all + n, r->mask + 1);
+
+    /* the newest nevents, oldest first */
+    qsort(all, n, sizeof(bt_trace_event_t), __cmp_ns);
+    if (nevents < n)
+    {
+        memcpy(events, all + n - nevents, nevents * sizeof(bt_trace_event_t));
+        n = nevents;
+    }
+    else
+        memcpy(events, all, n * sizeof(bt_trace_event_t));
+    free(all);
+    return n;
+}
+
+char* bt_trace_format(const bt_trace_event_t* e, char* out, int len)
+{
+    int type;
+
+    if (e->event < BT_TRACE_PIECE_COMPLETED)
+    {
+        const char* name;
+
+        type = e->event % BT_TRACE_READ;
+        name = type < (int)(sizeof(__msgtypes) / sizeof(__msgtypes[0])) &&
+            __msgtypes[type] ? __msgtypes[type] : "UNKNOWN";
+        snprintf(out, len, "%s,%s,piece_idx=%u offset=%u len=%u",
+                 e->event < BT_TRACE_READ ? "send" : "read", name,
+                 e->piece_idx, e->offset, e->len);
+        return out;
+    }
+
+    switch (e->event)
+    {
+    case BT_TRACE_PIECE_COMPLETED:
+        snprintf(out, len, "piece,completed,piece_idx=%u", e->piece_idx);
+        break;
+    case BT_TRACE_PIECE_FAILED:
+        snprintf(out, len, "piece,failed,piece_idx=%u len=%u",
+                 e->piece_idx, e->len);
+        break;
+    case BT_TRACE_BLOCK_DUPLICATE:
+        snprintf(out, len, "block,duplicate,piece_idx=%u offset=%u len=%u",
+                 e->piece_idx, e->offset, e->len);
+        break;
+    case BT_TRACE_PEER_ADDED:
+        snprintf(out, len, "peer,added");
+        break;
+    case BT_TRACE_PEER_REMOVED:
+        snprintf(out, len, "peer,removed");
+        break;
+    default:
+        snprintf(out, len, "unknown,%d", e->event);
+        break;
+    }
+    return out;
+}
+
+int bt_trace_dump(FILE* f, int nevents)
+{
+    bt_trace_event_t* events = malloc(nevents * sizeof(bt_trace_event_t));
+    char buf[128];
+    int i, n;
+
+    n = bt_trace_snapshot(events, nevents);
+    for (i = 0; i < n; i++)
+        fprintf(f, "%llu.%09llu %p %s\n",
+                events[i].ns / 1000000000ULL, events[i].ns % 1000000000ULL,
+                events[i].peer, bt_trace_format(&events[i], buf, sizeof(buf)));
+    free(events);
+    return n;
+}
+
+void bt_trace_clear()
+{
+    ring_t* r;
+
+    for (r = __atomic_load_n(&__rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        __atomic_store_n(&r->start, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELAXED);
+}
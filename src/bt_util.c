@@ -16,6 +16,8 @@
 /* for uint32_t */
 #include <stdint.h>
 
+#include <arpa/inet.h>
+
 #include "bt.h"
 #include "bt_string.h"
 #include "bt_util.h"
@@ -34,3 +36,63 @@ char *bt_generate_peer_id()
     return str;
 }
 
+
+int bt_addr_pack(unsigned char* addr, const char* ip, int ip_len, int port)
+{
+    char str[INET6_ADDRSTRLEN];
+
+    /* [::1] is how URLs write IPv6 */
+    if (2 < ip_len && '[' == ip[0] && ']' == ip[ip_len - 1])
+    {
+        ip += 1;
+        ip_len -= 2;
+    }
+
+    if (ip_len <= 0 || (int)sizeof(str) <= ip_len)
+        return 0;
+    memcpy(str, ip, ip_len);
+    str[ip_len] = 0;
+
+    if (1 == inet_pton(AF_INET, str, addr + 12))
+    {
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+    }
+    else if (1 != inet_pton(AF_INET6, str, addr))
+        return 0;
+
+    addr[16] = (port >> 8) & 0xff;
+    addr[17] = port & 0xff;
+    return 1;
+}
+
+int bt_addr_unpack(const unsigned char* addr, char* ip, int len)
+{
+    static const unsigned char v4mapped[12] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    if (!memcmp(addr, v4mapped, sizeof(v4mapped)))
+        inet_ntop(AF_INET, addr + 12, ip, len);
+    else
+        inet_ntop(AF_INET6, addr, ip, len);
+    return (addr[16] << 8) | addr[17];
+}
+
+int bt_pow2_shift(unsigned int n)
+{
+    if (0 == n || (n & (n - 1)))
+        return -1;
+    return __builtin_ctz(n);
+}
+
+char *bt_addr_format(const unsigned char* addr, char* out, int len)
+{
+    char str[INET6_ADDRSTRLEN];
+    int port = bt_addr_unpack(addr, str, sizeof(str));
+
+    if (strchr(str, ':'))
+        snprintf(out, len, "[%s]:%d", str, port);
+    else
+        snprintf(out, len, "%s:%d", str, port);
+    return out;
+}
@@ -0,0 +1,450 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Web seed (BEP 19)
+ * @desc Blocks are queued in the order they'll arrive. Each flush covers
+ *       the queued blocks with as few GETs as it can: a run of contiguous
+ *       blocks is one range, split only at file boundaries and at
+ *       BT_WEBSEED_MAX_RANGE. Responses come back in order, so the bodies
+ *       are one stream that fills the blocks in turn.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "bt.h"
+#include "bt_webseed.h"
+
+/* largest range asked for in one GET */
+#define BT_WEBSEED_MAX_RANGE (1 << 22)
+
+/* a response's headers have to fit in this */
+#define BT_WEBSEED_MAX_HEADER 8192
+
+typedef struct
+{
+    /* escaped, and with the URL's path in front */
+    char* path;
+    unsigned long long size;
+} __file_t;
+
+typedef struct
+{
+    /* byte range asked for, within the file */
+    unsigned long long start;
+    unsigned long long len;
+} __get_t;
+
+typedef struct
+{
+    char* host;
+    int port;
+    char* path;
+
+    /* none means the URL is the file */
+    __file_t* files;
+    int nfiles;
+    int piece_len;
+
+    bt_webseed_cbs_t cb;
+    void* udata;
+
+    /* blocks asked for, in the order their bytes will arrive. The first
+     * nsent are covered by GETs */
+    bt_block_t* blocks;
+    int nblocks;
+    int blocks_size;
+    int nsent;
+
+    /* GETs without a response yet, oldest first */
+    __get_t* gets;
+    int ngets;
+    int gets_size;
+
+    /* the response being read: its headers, then what's left of its body.
+     * The first block is put together in buf */
+    char hdr[BT_WEBSEED_MAX_HEADER];
+    unsigned int nhdr;
+    unsigned long long body_left;
+    int in_body;
+    char* buf;
+    unsigned int nbuf;
+    unsigned int buf_size;
+
+    int retry_secs;
+} webseed_t;
+
+/**
+ * BEP 19 paths are percent encoded, except for their slashes */
+static char* __escape(const char* dir, const char* path)
+{
+    size_t dirlen = strlen(dir);
+    char* e = malloc(dirlen + 1 + strlen(path) * 3 + 1), *o;
+
+    memcpy(e, dir, dirlen);
+    o = e + dirlen;
+    if (0 == dirlen || '/' != dir[dirlen - 1])
+        *o++ = '/';
+
+    for (; *path; path++)
+    {
+        unsigned char c = *path;
+
+        if (isalnum(c) || strchr("-._~/", c))
+            *o++ = c;
+        else
+            o += sprintf(o, "%%%02X", c);
+    }
+    *o = '\0';
+    return e;
+}
+
+void* bt_webseed_new(const char* url)
+{
+    const char *host, *end, *colon;
+    webseed_t* me;
+
+    if (strncmp(url, "http://", 7))
+        return NULL;
+
+    host = url + 7;
+    if (!(end = strchr(host, '/')))
+        end = host + strlen(host);
+    colon = memchr(host, ':', end - host);
+    if (host == (colon ? colon : end))
+        return NULL;
+
+    me = calloc(1, sizeof(webseed_t));
+    me->host = strndup(host, (colon ? colon : end) - host);
+    me->port = colon ? atoi(colon + 1) : 80;
+    me->path = strdup(*end ? end : "/");
+    if (me->port <= 0 || 65535 < me->port)
+    {
+        bt_webseed_free(me);
+        return NULL;
+    }
+    return me;
+}
+
+void bt_webseed_free(void* me_)
+{
+    webseed_t* me = me_;
+    int i;
+
+    for (i = 0; i < me->nfiles; i++)
+        free(me->files[i].path);
+    free(me->files);
+    free(me->blocks);
+    free(me->gets);
+    free(me->buf);
+    free(me->host);
+    free(me->path);
+    free(me);
+}
+
+void bt_webseed_set_cbs(void* me_, bt_webseed_cbs_t* cb, void* udata)
+{
+    webseed_t* me = me_;
+
+    memcpy(&me->cb, cb, sizeof(bt_webseed_cbs_t));
+    me->udata = udata;
+}
+
+const char* bt_webseed_get_host(void* me_)
+{
+    return ((webseed_t*)me_)->host;
+}
+
+int bt_webseed_get_port(void* me_)
+{
+    return ((webseed_t*)me_)->port;
+}
+
+void bt_webseed_set_piece_length(void* me_, int piece_len)
+{
+    ((webseed_t*)me_)->piece_len = piece_len;
+}
+
+void bt_webseed_add_file(void* me_, const char* path, unsigned long long size)
+{
+    webseed_t* me = me_;
+
+    me->files = realloc(me->files, (me->nfiles + 1) * sizeof(__file_t));
+    me->files[me->nfiles].path = __escape(me->path, path);
+    me->files[me->nfiles].size = size;
+    me->nfiles++;
+}
+
+void bt_webseed_request(void* me_, const bt_block_t* b)
+{
+    webseed_t* me = me_;
+
+    if (me->blocks_size <= me->nblocks)
+    {
+        me->blocks_size = me->blocks_size * 2 + 16;
+        me->blocks = realloc(me->blocks,
+                             me->blocks_size * sizeof(bt_block_t));
+    }
+    me->blocks[me->nblocks++] = *b;
+}
+
+static unsigned long long __offset(webseed_t* me, const bt_block_t* b)
+{
+    return (unsigned long long)b->piece_idx * me->piece_len + b->offset;
+}
+
+/**
+ * @return 0 if the connection has gone */
+static int __send_get(webseed_t* me, const char* path,
+                      unsigned long long start, unsigned long long len)
+{
+    char host[300], *req;
+    int n, ok;
+
+    if (80 == me->port)
+        snprintf(host, sizeof(host), "%s", me->host);
+    else
+        snprintf(host, sizeof(host), "%s:%d", me->host, me->port);
+
+    req = malloc(strlen(path) + strlen(host) + 160);
+    n = sprintf(req, "GET %s HTTP/1.1\r\n"
+                "Host: %s\r\n"
+                "Range: bytes=%llu-%llu\r\n"
+                "User-Agent: yabtorrent\r\n"
+                "\r\n", path, host, start, start + len - 1);
+    ok = me->cb.send(me->udata, req, n);
+    free(req);
+
+    if (me->gets_size <= me->ngets)
+    {
+        me->gets_size = me->gets_size * 2 + 8;
+        me->gets = realloc(me->gets, me->gets_size * sizeof(__get_t));
+    }
+    me->gets[me->ngets].start = start;
+    me->gets[me->ngets].len = len;
+    me->ngets++;
+    return ok;
+}
+
+/**
+ * GET a range of the torrent, a file at a time */
+static int __get_range(webseed_t* me, unsigned long long start,
+                       unsigned long long len)
+{
+    unsigned long long file_start = 0;
+    int i;
+
+    if (0 == me->nfiles)
+        return __send_get(me, me->path, start, len);
+
+    for (i = 0; i < me->nfiles && 0 < len; i++)
+    {
+        unsigned long long file_end = file_start + me->files[i].size, n;
+
+        if (start < file_end)
+        {
+            n = file_end - start < len ? file_end - start : len;
+            if (!__send_get(me, me->files[i].path, start - file_start, n))
+                return 0;
+            start += n;
+            len -= n;
+        }
+        file_start = file_end;
+    }
+
+    /* past the last file; the server won't have it */
+    return 0 == len;
+}
+
+int bt_webseed_flush(void* me_)
+{
+    webseed_t* me = me_;
+
+    while (me->nsent < me->nblocks)
+    {
+        unsigned long long start = __offset(me, &me->blocks[me->nsent]),
+                           len = 0;
+
+        do
+        {
+            len += me->blocks[me->nsent++].len;
+        }
+        while (me->nsent < me->nblocks &&
+               __offset(me, &me->blocks[me->nsent]) == start + len &&
+               len + me->blocks[me->nsent].len <= BT_WEBSEED_MAX_RANGE);
+
+        if (!__get_range(me, start, len))
+            return 0;
+    }
+    return 1;
+}
+
+int bt_webseed_get_npending(void* me_)
+{
+    return ((webseed_t*)me_)->nblocks;
+}
+
+int bt_webseed_get_retry_secs(void* me_)
+{
+    return ((webseed_t*)me_)->retry_secs;
+}
+
+/**
+ * @return the header's value if the line is the header; otherwise NULL */
+static const char* __header(const char* line, const char* name)
+{
+    size_t n = strlen(name);
+
+    if (strncasecmp(line, name, n) || ':' != line[n])
+        return NULL;
+    for (line += n + 1; ' ' == *line || '\t' == *line; line++)
+        ;
+    return line;
+}
+
+/**
+ * The headers have all arrived
+ * @return 0 if the response isn't the range we asked for */
+static int __parse_headers(webseed_t* me)
+{
+    long long length = -1, range_start = -1;
+    const char *line, *v;
+    int status = 0;
+
+    me->hdr[me->nhdr] = '\0';
+    me->retry_secs = 0;
+    if (1 != sscanf(me->hdr, "HTTP/%*d.%*d %d", &status))
+        return 0;
+
+    for (line = strstr(me->hdr, "\r\n"); line && line[2];
+         line = strstr(line + 2, "\r\n"))
+    {
+        const char* l = line + 2;
+
+        if ((v = __header(l, "Content-Length")))
+            length = strtoll(v, NULL, 10);
+        else if ((v = __header(l, "Content-Range")))
+            sscanf(v, "bytes %lld-", &range_start);
+        else if ((v = __header(l, "Retry-After")))
+            me->retry_secs = atoi(v);
+        else if ((v = __header(l, "Transfer-Encoding")) &&
+                 strncasecmp(v, "identity", 8))
+            /* a file server has no reason to chunk a range */
+            return 0;
+    }
+
+    if (206 != status)
+        return 0;
+
+    if (length != (long long)me->gets[0].len ||
+        (-1 != range_start &&
+         range_start != (long long)me->gets[0].start))
+        return 0;
+
+    me->body_left = me->gets[0].len;
+    me->in_body = 1;
+    me->nhdr = 0;
+    return 1;
+}
+
+/**
+ * @return bytes of the body used */
+static unsigned int __read_body(webseed_t* me, const char* buf,
+                                unsigned int len)
+{
+    bt_block_t* b = &me->blocks[0];
+    unsigned int n = b->len - me->nbuf;
+
+    if (me->body_left < n)
+        n = me->body_left;
+    if (len < n)
+        n = len;
+
+    /* a whole block at once is handed on from where it is */
+    if (0 != me->nbuf || n != b->len)
+    {
+        if (me->buf_size < b->len)
+        {
+            me->buf_size = b->len;
+            me->buf = realloc(me->buf, me->buf_size);
+        }
+        memcpy(me->buf + me->nbuf, buf, n);
+    }
+    me->nbuf += n;
+    me->body_left -= n;
+
+    if (me->nbuf == b->len)
+    {
+        bt_block_t blk = *b;
+        const void* data = n == b->len ? (const void*)buf : me->buf;
+
+        me->nbuf = 0;
+        me->nblocks--;
+        me->nsent--;
+        memmove(me->blocks, me->blocks + 1, me->nblocks * sizeof(bt_block_t));
+        me->cb.pushblock(me->udata, &blk, data);
+    }
+
+    if (0 == me->body_left)
+    {
+        me->in_body = 0;
+        me->ngets--;
+        memmove(me->gets, me->gets + 1, me->ngets * sizeof(__get_t));
+    }
+    return n;
+}
+
+int bt_webseed_dispatch_from_buffer(void* me_, const char* buf,
+                                    unsigned int len)
+{
+    webseed_t* me = me_;
+
+    while (0 < len)
+    {
+        if (me->in_body)
+        {
+            unsigned int n = __read_body(me, buf, len);
+
+            buf += n;
+            len -= n;
+            continue;
+        }
+
+        /* nothing was asked for */
+        if (0 == me->ngets || sizeof(me->hdr) - 1 <= me->nhdr)
+            return 0;
+
+        me->hdr[me->nhdr++] = *buf++;
+        len--;
+
+        if (4 <= me->nhdr &&
+            0 == memcmp(me->hdr + me->nhdr - 4, "\r\n\r\n", 4) &&
+            !__parse_headers(me))
+            return 0;
+    }
+    return 1;
+}
+
+void bt_webseed_giveback(void* me_, void* udata,
+                         void (*giveback)(void* udata, bt_block_t* b))
+{
+    webseed_t* me = me_;
+    int i;
+
+    for (i = 0; i < me->nblocks; i++)
+        giveback(udata, &me->blocks[i]);
+    me->nblocks = 0;
+    me->nsent = 0;
+    me->ngets = 0;
+    me->nhdr = 0;
+    me->nbuf = 0;
+    me->in_body = 0;
+}
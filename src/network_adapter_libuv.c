@@ -0,0 +1,739 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief libuv network adapter
+ * @desc Data is read into buffers pooled in a slab. Sends are queued per
+ *       connection and written with one uv_write per connection once the
+ *       loop has polled, so a tick's messages go out together.
+ *       Connections are known to the caller by an id rather than a
+ *       pointer, so that a connection that has gone can still be
+ *       disconnected.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "bt.h"
+#include "bt_slab.h"
+#include "bt_capture.h"
+#include "network_adapter.h"
+#include "network_adapter_libuv.h"
+
+#include "config.h"
+#include "linked_list_hashmap.h"
+
+typedef int (*func_process_data_f)(void *caller, void* nethandle,
+                                   const char* buf, unsigned int len);
+
+typedef int (*func_process_connection_f)(void *caller, void* nethandle,
+                                         char *ip, int port);
+
+typedef void (*func_connection_failed_f)(void *caller, void* nethandle);
+
+typedef struct
+{
+    unsigned int version;
+    int tcp_nodelay;
+    int socket_send_buffer;
+    int socket_recv_buffer;
+} adapter_settings_t;
+
+typedef struct conn_s conn_t;
+
+typedef struct
+{
+    uv_loop_t* loop;
+    config_t* cfg;
+    adapter_settings_t settings;
+
+    /* read buffers */
+    void* slab;
+    unsigned int read_buf_len;
+
+    /* conn_t by id */
+    hashmap_t* conns;
+    unsigned long next_id;
+
+    /* connections with sends waiting for the check handle */
+    conn_t* dirty;
+    uv_check_t flusher;
+
+    uv_tcp_t listener;
+    int listening;
+    void* listen_caller;
+    func_process_data_f listen_process_data;
+    func_process_connection_f listen_process_connection;
+    func_connection_failed_f listen_connection_failed;
+
+    /* handles of our own still closing; freed once this reaches 0 */
+    int nclosing;
+
+    /* bt_capture recorder, if inbound traffic is being captured */
+    void* capture;
+} adapter_t;
+
+struct conn_s
+{
+    uv_tcp_t tcp;
+    adapter_t* a;
+    unsigned long id;
+
+    void* caller;
+    func_process_data_f process_data;
+    func_process_connection_f process_connection;
+    func_connection_failed_f connection_failed;
+
+    uv_connect_t connect_req;
+    uv_getaddrinfo_t resolve_req;
+    int port;
+    char ip[INET6_ADDRSTRLEN];
+
+    /* sends not yet handed to uv_write. owned[i] is set when we
+     * copied bufs[i] and have to free it */
+    uv_buf_t* bufs;
+    char* owned;
+    unsigned int nbufs;
+    unsigned int bufs_size;
+
+    /* bytes queued and in flight */
+    unsigned int queued_bytes;
+
+    /* on adapter_t.dirty */
+    conn_t* next_dirty;
+    int is_dirty;
+
+    int closing;
+    int resolving;
+};
+
+typedef struct
+{
+    /* must be first; libuv hands this back to us */
+    uv_write_t req;
+    conn_t* cn;
+    uv_buf_t* bufs;
+    char* owned;
+    unsigned int nbufs;
+    unsigned int bytes;
+} write_t;
+
+static unsigned long __id_hash(const void *obj)
+{
+    return (unsigned long)obj;
+}
+
+static long __id_compare(const void *obj, const void *other)
+{
+    return (unsigned long)obj - (unsigned long)other;
+}
+
+static adapter_settings_t* __cfg(adapter_t* me)
+{
+    config_t* cfg = me->cfg;
+    adapter_settings_t* s = &me->settings;
+
+    if (s->version == cfg->version)
+        return s;
+
+    s->version = cfg->version;
+    s->tcp_nodelay = config_get_int(cfg, "tcp_nodelay");
+    s->socket_send_buffer = config_get_int(cfg, "socket_send_buffer");
+    s->socket_recv_buffer = config_get_int(cfg, "socket_recv_buffer");
+    return s;
+}
+
+static void* __nethandle(conn_t* cn)
+{
+    return (void*)(uintptr_t)cn->id;
+}
+
+static conn_t* __get(adapter_t* me, void* nethandle)
+{
+    return hashmap_get(me->conns, nethandle);
+}
+
+static void __free_bufs(uv_buf_t* bufs, char* owned, unsigned int nbufs)
+{
+    unsigned int i;
+
+    for (i = 0; i < nbufs; i++)
+        if (owned[i])
+            free(bufs[i].base);
+    free(bufs);
+    free(owned);
+}
+
+static void __on_close(uv_handle_t* handle)
+{
+    conn_t* cn = (conn_t*)handle;
+
+    __free_bufs(cn->bufs, cn->owned, cn->nbufs);
+    free(cn);
+}
+
+/**
+ * Close the connection. Later calls with its id are ignored. Writes in
+ * flight are cancelled by libuv before the handle is closed */
+static void __close(adapter_t* me, conn_t* cn)
+{
+    conn_t** d;
+
+    if (cn->closing)
+        return;
+    cn->closing = 1;
+    hashmap_remove(me->conns, __nethandle(cn));
+    if (me->capture)
+        bt_capture_disconnection(me->capture, __nethandle(cn));
+
+    for (d = &me->dirty; *d; d = &(*d)->next_dirty)
+        if (*d == cn)
+        {
+            *d = cn->next_dirty;
+            break;
+        }
+
+    /* the resolver's callback closes the connection */
+    if (cn->resolving)
+    {
+        uv_cancel((uv_req_t*)&cn->resolve_req);
+        return;
+    }
+
+    uv_close((uv_handle_t*)&cn->tcp, __on_close);
+}
+
+/**
+ * The connection failed on its own. The caller is told, and is still
+ * expected to disconnect it */
+static void __fail(adapter_t* me, conn_t* cn)
+{
+    void* nethandle = __nethandle(cn);
+
+    if (cn->closing)
+        return;
+    __close(me, cn);
+    if (cn->connection_failed)
+        cn->connection_failed(cn->caller, nethandle);
+}
+
+static conn_t* __conn_new(adapter_t* me, void* caller,
+                          func_process_data_f process_data,
+                          func_process_connection_f process_connection,
+                          func_connection_failed_f connection_failed)
+{
+    conn_t* cn = calloc(1, sizeof(conn_t));
+
+    cn->a = me;
+    cn->caller = caller;
+    cn->process_data = process_data;
+    cn->process_connection = process_connection;
+    cn->connection_failed = connection_failed;
+
+    /* ids aren't reused, and 0 is never one */
+    cn->id = ++me->next_id;
+    hashmap_put(me->conns, __nethandle(cn), cn);
+    uv_tcp_init(me->loop, &cn->tcp);
+    return cn;
+}
+
+static void __tune(adapter_t* me, conn_t* cn)
+{
+    adapter_settings_t* s = __cfg(me);
+    int v;
+
+    if (s->tcp_nodelay)
+        uv_tcp_nodelay(&cn->tcp, 1);
+
+    /* a zero value would read the size instead */
+    if (0 < (v = s->socket_send_buffer))
+        uv_send_buffer_size((uv_handle_t*)&cn->tcp, &v);
+    if (0 < (v = s->socket_recv_buffer))
+        uv_recv_buffer_size((uv_handle_t*)&cn->tcp, &v);
+}
+
+static void __on_alloc(uv_handle_t* handle, size_t suggested, uv_buf_t* buf)
+{
+    conn_t* cn = (conn_t*)handle;
+
+    /* a zero length buffer makes libuv report UV_ENOBUFS */
+    buf->base = bt_slab_alloc(cn->a->slab);
+    buf->len = buf->base ? cn->a->read_buf_len : 0;
+}
+
+static void __on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    conn_t* cn = (conn_t*)stream;
+    adapter_t* me = cn->a;
+
+    if (0 < nread && !cn->closing && me->capture)
+        bt_capture_data(me->capture, __nethandle(cn), buf->base, nread);
+
+    if (0 < nread && !cn->closing &&
+        0 == cn->process_data(cn->caller, __nethandle(cn), buf->base, nread))
+        __fail(me, cn);
+    else if (nread < 0)
+        __fail(me, cn);
+
+    if (buf->base)
+        bt_slab_release(me->slab, buf->base);
+}
+
+static int __start(adapter_t* me, conn_t* cn)
+{
+    __tune(me, cn);
+    if (0 != uv_read_start((uv_stream_t*)&cn->tcp, __on_alloc, __on_read))
+        return 0;
+    return 1;
+}
+
+static void __on_connect(uv_connect_t* req, int status)
+{
+    conn_t* cn = req->data;
+    adapter_t* me = cn->a;
+
+    /* disconnected while connecting */
+    if (cn->closing)
+        return;
+
+    if (status < 0 || !__start(me, cn))
+    {
+        __fail(me, cn);
+        return;
+    }
+
+    if (me->capture)
+        bt_capture_connection(me->capture, __nethandle(cn), cn->ip, cn->port);
+
+    if (0 == cn->process_connection(cn->caller, __nethandle(cn), cn->ip,
+                                    cn->port))
+        __fail(me, cn);
+}
+
+static int __connect(adapter_t* me, conn_t* cn, const struct sockaddr* addr)
+{
+    cn->connect_req.data = cn;
+    return 0 == uv_tcp_connect(&cn->connect_req, &cn->tcp, addr,
+                               __on_connect);
+}
+
+static void __on_resolve(uv_getaddrinfo_t* req, int status,
+                         struct addrinfo* res)
+{
+    conn_t* cn = req->data;
+    adapter_t* me = cn->a;
+
+    cn->resolving = 0;
+
+    /* __close left the handle to us */
+    if (cn->closing)
+    {
+        uv_close((uv_handle_t*)&cn->tcp, __on_close);
+        uv_freeaddrinfo(res);
+        return;
+    }
+
+    if (status < 0 || !res || !__connect(me, cn, res->ai_addr))
+        __fail(me, cn);
+    uv_freeaddrinfo(res);
+}
+
+void* network_adapter_libuv_new(void* loop)
+{
+    adapter_t* me = calloc(1, sizeof(adapter_t));
+
+    me->loop = loop;
+    me->cfg = config_new();
+    me->settings.version = ~0u;
+    config_set_if_not_set(me->cfg, "tcp_nodelay", "1");
+    config_set_if_not_set(me->cfg, "socket_send_buffer", "0");
+    config_set_if_not_set(me->cfg, "socket_recv_buffer", "0");
+    config_set_if_not_set(me->cfg, "read_buffer_bytes", "65536");
+    config_set_if_not_set(me->cfg, "read_buffers_max_bytes", "16777216");
+    me->conns = hashmap_new(__id_hash, __id_compare, 11);
+    uv_check_init(me->loop, &me->flusher);
+    me->flusher.data = me;
+    return me;
+}
+
+void* network_adapter_libuv_get_config(void* a)
+{
+    adapter_t* me = a;
+
+    return me->cfg;
+}
+
+/**
+ * Read buffers are sized by the config the first time they're needed */
+static void* __slab(adapter_t* me)
+{
+    if (!me->slab)
+    {
+        me->read_buf_len = config_get_int(me->cfg, "read_buffer_bytes");
+        me->slab = bt_slab_new(me->read_buf_len,
+                               config_get_int(me->cfg,
+                                              "read_buffers_max_bytes"), 0);
+    }
+    return me->slab;
+}
+
+static void __on_adapter_close(uv_handle_t* handle)
+{
+    adapter_t* me = handle->data;
+
+    if (0 == --me->nclosing)
+        free(me);
+}
+
+void network_adapter_libuv_free(void* a)
+{
+    adapter_t* me = a;
+    hashmap_iterator_t iter;
+    conn_t* cn;
+
+    /* __close removes the connection, so start over each time */
+    while (0 < hashmap_count(me->conns))
+    {
+        hashmap_iterator(me->conns, &iter);
+        cn = hashmap_iterator_next_value(me->conns, &iter);
+        __close(me, cn);
+    }
+
+    /* reads don't hold on to their buffers, so the slab can go now */
+    hashmap_freeall(me->conns);
+    config_free(me->cfg);
+    if (me->slab)
+        bt_slab_free(me->slab);
+
+    me->nclosing = 1;
+    uv_close((uv_handle_t*)&me->flusher, __on_adapter_close);
+    if (me->listening)
+    {
+        me->nclosing++;
+        uv_close((uv_handle_t*)&me->listener, __on_adapter_close);
+    }
+}
+
+int peer_connect(
+    void* caller,
+    void **udata,
+    void **nethandle,
+    const char *host, int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *, void* nethandle, char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *, void* nethandle))
+{
+    adapter_t* me = *udata;
+    conn_t* cn;
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    char service[8];
+
+    __slab(me);
+    cn = __conn_new(me, caller, func_process_data, func_process_connection,
+                    func_connection_failed);
+    snprintf(cn->ip, sizeof(cn->ip), "%s", host);
+    cn->port = port;
+    *nethandle = __nethandle(cn);
+
+    if (0 == uv_ip4_addr(host, port, &addr4))
+    {
+        if (__connect(me, cn, (struct sockaddr*)&addr4))
+            return 1;
+    }
+    else if (0 == uv_ip6_addr(host, port, &addr6))
+    {
+        if (__connect(me, cn, (struct sockaddr*)&addr6))
+            return 1;
+    }
+    else
+    {
+        /* a host name */
+        snprintf(service, sizeof(service), "%d", port);
+        cn->resolve_req.data = cn;
+        if (0 == uv_getaddrinfo(me->loop, &cn->resolve_req, __on_resolve,
+                                host, service, NULL))
+        {
+            cn->resolving = 1;
+            return 1;
+        }
+    }
+
+    /* the caller doesn't get a connection it has to disconnect */
+    cn->connection_failed = NULL;
+    __close(me, cn);
+    return 0;
+}
+
+static void __flush(adapter_t* me, conn_t* cn);
+
+static void __on_write(uv_write_t* req, int status)
+{
+    write_t* w = (write_t*)req;
+    conn_t* cn = w->cn;
+
+    __free_bufs(w->bufs, w->owned, w->nbufs);
+
+    /* closing cancels writes, but the connection is only freed after its
+     * writes' callbacks. The adapter may have gone by then */
+    if (!cn->closing)
+    {
+        cn->queued_bytes -= w->bytes;
+        if (status < 0)
+            __fail(cn->a, cn);
+    }
+    free(w);
+}
+
+/**
+ * Hand the connection's queue to uv_write */
+static void __flush(adapter_t* me, conn_t* cn)
+{
+    write_t* w;
+    unsigned int i;
+
+    if (0 == cn->nbufs || cn->closing)
+        return;
+
+    w = calloc(1, sizeof(write_t));
+    w->cn = cn;
+    w->bufs = cn->bufs;
+    w->owned = cn->owned;
+    w->nbufs = cn->nbufs;
+    for (i = 0; i < w->nbufs; i++)
+        w->bytes += w->bufs[i].len;
+
+    cn->bufs = NULL;
+    cn->owned = NULL;
+    cn->nbufs = cn->bufs_size = 0;
+
+    if (0 != uv_write(&w->req, (uv_stream_t*)&cn->tcp, w->bufs, w->nbufs,
+                      __on_write))
+    {
+        __free_bufs(w->bufs, w->owned, w->nbufs);
+        cn->queued_bytes -= w->bytes;
+        free(w);
+        __fail(me, cn);
+    }
+}
+
+static void __on_check(uv_check_t* handle)
+{
+    adapter_t* me = handle->data;
+
+    while (me->dirty)
+    {
+        conn_t* cn = me->dirty;
+
+        me->dirty = cn->next_dirty;
+        cn->is_dirty = 0;
+        __flush(me, cn);
+    }
+    uv_check_stop(&me->flusher);
+}
+
+/**
+ * Add a buffer to the connection's queue, which is written once the loop
+ * has polled
+ * @param copy 1 to copy the data; 0 if it outlives the write */
+static void __queue(adapter_t* me, conn_t* cn, const void* data,
+                    unsigned int len, int copy)
+{
+    if (0 == len)
+        return;
+
+    if (cn->bufs_size <= cn->nbufs)
+    {
+        cn->bufs_size = cn->bufs_size ? cn->bufs_size * 2 : 8;
+        cn->bufs = realloc(cn->bufs, sizeof(uv_buf_t) * cn->bufs_size);
+        cn->owned = realloc(cn->owned, cn->bufs_size);
+    }
+
+    if (copy)
+    {
+        void* mem = malloc(len);
+
+        memcpy(mem, data, len);
+        data = mem;
+    }
+    cn->bufs[cn->nbufs] = uv_buf_init((char*)data, len);
+    cn->owned[cn->nbufs] = copy;
+    cn->nbufs++;
+    cn->queued_bytes += len;
+
+    if (!cn->is_dirty)
+    {
+        cn->is_dirty = 1;
+        cn->next_dirty = me->dirty;
+        me->dirty = cn;
+        uv_check_start(&me->flusher, __on_check);
+    }
+}
+
+int peer_send(void* caller, void **udata,
+              void* nethandle,
+              const char *send_data, const int len)
+{
+    adapter_t* me = *udata;
+    conn_t* cn = __get(me, nethandle);
+
+    if (!cn)
+        return 0;
+
+    __queue(me, cn, send_data, len, 1);
+    return 1;
+}
+
+int peer_sendv(void* caller, void **udata,
+               void* nethandle,
+               const bt_iovec_t *iov, const int iovcnt)
+{
+    adapter_t* me = *udata;
+    conn_t* cn = __get(me, nethandle);
+    int i;
+
+    if (!cn)
+        return 0;
+
+    /* only the leading message header is short lived; see
+     * bt_dm_cbs_t.peer_sendv */
+    for (i = 0; i < iovcnt; i++)
+        __queue(me, cn, iov[i].base, iov[i].len, 0 == i);
+    return 1;
+}
+
+unsigned int peer_get_queued_bytes(void* caller, void **udata,
+                                   void* nethandle)
+{
+    conn_t* cn = __get(*udata, nethandle);
+
+    return cn ? cn->queued_bytes : 0;
+}
+
+int peer_disconnect(void* caller, void **udata, void* nethandle)
+{
+    adapter_t* me = *udata;
+    conn_t* cn = __get(me, nethandle);
+
+    if (!cn)
+        return 0;
+
+    __close(me, cn);
+    return 1;
+}
+
+static void __on_connection(uv_stream_t* server, int status)
+{
+    adapter_t* me = server->data;
+    struct sockaddr_storage addr;
+    int port = 0, len = sizeof(addr);
+    conn_t* cn;
+
+    if (status < 0)
+        return;
+
+    cn = __conn_new(me, me->listen_caller, me->listen_process_data, NULL,
+                    me->listen_connection_failed);
+
+    if (0 != uv_accept(server, (uv_stream_t*)&cn->tcp) ||
+        0 != uv_tcp_getpeername(&cn->tcp, (struct sockaddr*)&addr, &len))
+    {
+        cn->connection_failed = NULL;
+        __close(me, cn);
+        return;
+    }
+
+    if (AF_INET6 == addr.ss_family)
+    {
+        struct sockaddr_in6* a6 = (struct sockaddr_in6*)&addr;
+
+        uv_ip6_name(a6, cn->ip, sizeof(cn->ip));
+        port = ntohs(a6->sin6_port);
+    }
+    else
+    {
+        struct sockaddr_in* a4 = (struct sockaddr_in*)&addr;
+
+        uv_ip4_name(a4, cn->ip, sizeof(cn->ip));
+        port = ntohs(a4->sin_port);
+    }
+    cn->port = port;
+
+    if (me->capture)
+        bt_capture_connection(me->capture, __nethandle(cn), cn->ip, port);
+
+    /* refused connections were never the caller's */
+    if (!__start(me, cn) ||
+        0 == me->listen_process_connection(me->listen_caller,
+                                           __nethandle(cn), cn->ip, port))
+    {
+        cn->connection_failed = NULL;
+        __close(me, cn);
+    }
+}
+
+int network_adapter_libuv_listen(
+    void* a,
+    void* caller,
+    int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *caller,
+                                    void* nethandle,
+                                    char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *caller, void* nethandle))
+{
+    adapter_t* me = a;
+    struct sockaddr_in addr;
+
+    if (me->listening)
+        return 0;
+
+    __slab(me);
+    me->listen_caller = caller;
+    me->listen_process_data = func_process_data;
+    me->listen_process_connection = func_process_connection;
+    me->listen_connection_failed = func_connection_failed;
+
+    uv_tcp_init(me->loop, &me->listener);
+    me->listener.data = me;
+    me->listening = 1;
+    if (0 != uv_ip4_addr("0.0.0.0", port, &addr) ||
+        0 != uv_tcp_bind(&me->listener, (struct sockaddr*)&addr, 0) ||
+        0 != uv_listen((uv_stream_t*)&me->listener, 128, __on_connection))
+    {
+        uv_close((uv_handle_t*)&me->listener, NULL);
+        me->listening = 0;
+        return 0;
+    }
+    return 1;
+}
+
+int network_adapter_libuv_get_nconnections(void* a)
+{
+    adapter_t* me = a;
+
+    return hashmap_count(me->conns);
+}
+
+void network_adapter_libuv_set_capture(void* a, void* capture)
+{
+    adapter_t* me = a;
+
+    me->capture = capture;
+}
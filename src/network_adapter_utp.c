@@ -0,0 +1,1301 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief uTP (BEP 29) network adapter
+ * @desc Connections share one UDP socket, and are found by the sender's
+ *       address and the connection id. Datagrams are batched both ways
+ *       with sendmmsg and recvmmsg. Each connection keeps the packets it
+ *       has sent until they're acknowledged; acknowledgements are
+ *       cumulative, and a loss is repaired on three duplicate
+ *       acknowledgements or a timeout. The window follows LEDBAT.
+ *       Connections are known to the caller by an id rather than a
+ *       pointer, so that a connection that has gone can still be
+ *       disconnected.
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bt.h"
+#include "network_adapter_utp.h"
+
+#include "config.h"
+#include "linked_list_hashmap.h"
+
+#define UTP_HEADER_LEN 20
+#define UTP_VERSION 1
+
+enum {
+    ST_DATA = 0,
+    ST_FIN = 1,
+    ST_STATE = 2,
+    ST_RESET = 3,
+    ST_SYN = 4,
+};
+
+enum {
+    UTP_SYN_SENT,
+    UTP_CONNECTED,
+};
+
+/* packets past the next one we expect that are held for reordering */
+#define UTP_REORDER 128
+
+/* LEDBAT grows the window by at most this much a round trip */
+#define UTP_MAX_CWND_INCREASE 3000
+
+#define UTP_MIN_RTO_US 500000
+#define UTP_MAX_RTO_US 8000000
+
+/* the base delay is the least delay seen over the last two minutes */
+#define UTP_BASE_DELAY_PERIOD_US 60000000ull
+
+#define SEQ_LT(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)) < 0)
+
+typedef int (*func_process_data_f)(void *caller, void* nethandle,
+                                   const char* buf, unsigned int len);
+
+typedef int (*func_process_connection_f)(void *caller, void* nethandle,
+                                         char *ip, int port);
+
+typedef void (*func_connection_failed_f)(void *caller, void* nethandle);
+
+typedef struct
+{
+    unsigned int version;
+    unsigned int packet_bytes;
+    unsigned int target_delay_us;
+    unsigned int max_window;
+    unsigned int recv_window;
+    unsigned int batch;
+    unsigned int initial_rto_us;
+    int max_timeouts;
+} adapter_settings_t;
+
+typedef struct
+{
+    unsigned char type;
+    uint16_t connection_id;
+    uint32_t timestamp_us;
+    uint32_t timestamp_difference_us;
+    uint32_t wnd_size;
+    uint16_t seq_nr;
+    uint16_t ack_nr;
+} header_t;
+
+/* a packet we've sent that hasn't been acknowledged, or one received out of
+ * order */
+typedef struct
+{
+    unsigned char type;
+    uint16_t seq_nr;
+    unsigned int len;
+    unsigned long long sent_us;
+    int transmissions;
+    char data[];
+} packet_t;
+
+/* connections are found by where a datagram came from and its id */
+typedef struct
+{
+    uint32_t ip;
+    uint16_t port;
+    uint16_t id;
+} route_t;
+
+typedef struct conn_s conn_t;
+
+typedef struct
+{
+    config_t* cfg;
+    adapter_settings_t settings;
+
+    int fd;
+
+    /* conn_t by id, and by route */
+    hashmap_t* conns;
+    hashmap_t* routes;
+    unsigned long next_id;
+
+    int listening;
+    void* listen_caller;
+    func_process_data_f listen_process_data;
+    func_process_connection_f listen_process_connection;
+    func_connection_failed_f listen_connection_failed;
+
+    /* datagrams waiting for sendmmsg */
+    struct mmsghdr* out_msgs;
+    struct iovec* out_iov;
+    struct sockaddr_in* out_addrs;
+    char* out_bufs;
+    unsigned int nout;
+
+    /* recvmmsg's buffers */
+    struct mmsghdr* in_msgs;
+    struct iovec* in_iov;
+    struct sockaddr_in* in_addrs;
+    char* in_bufs;
+
+    /* the batches are sized by the config the first time they're needed */
+    unsigned int batch;
+    unsigned int packet_bytes;
+
+    /* connections walked by network_adapter_utp_poll */
+    conn_t** walk;
+    unsigned int walk_size;
+
+    /* closed, and freed once the callbacks can't be holding them */
+    conn_t* closed;
+} adapter_t;
+
+struct conn_s
+{
+    adapter_t* a;
+    unsigned long id;
+    route_t route;
+    struct sockaddr_in addr;
+    int port;
+    char ip[INET_ADDRSTRLEN];
+
+    void* caller;
+    func_process_data_f process_data;
+    func_process_connection_f process_connection;
+    func_connection_failed_f connection_failed;
+
+    int state;
+    int closing;
+    conn_t* next_closed;
+    uint16_t send_id;
+
+    /* sent packets from acked_nr + 1 up to seq_nr - 1, oldest first */
+    packet_t** out;
+    unsigned int out_head;
+    unsigned int nout;
+    unsigned int out_size;
+    uint16_t seq_nr;
+    uint16_t acked_nr;
+
+    /* payload bytes sent and not yet acknowledged */
+    unsigned int inflight;
+
+    /* bytes the caller has given us that haven't been packetised */
+    char* unsent;
+    unsigned int unsent_off;
+    unsigned int unsent_len;
+    unsigned int unsent_size;
+
+    /* LEDBAT's window, and the receive window the peer last advertised */
+    unsigned int cwnd;
+    unsigned int peer_wnd;
+
+    /* three duplicate acks repair a loss. Until recover_nr is acknowledged
+     * the window isn't cut again */
+    int dup_acks;
+    int recovering;
+    uint16_t recover_nr;
+
+    /* RFC 6298 */
+    unsigned int srtt_us;
+    unsigned int rttvar_us;
+    unsigned int rto_us;
+    unsigned long long rto_deadline_us;
+    int ntimeouts;
+
+    /* least one way delays, this period and the last */
+    uint32_t base_delay[2];
+    int have_base_delay;
+    unsigned long long base_period_us;
+    unsigned int queueing_us;
+
+    /* last packet delivered in order, and those after it held back */
+    uint16_t ack_nr;
+    packet_t* reorder[UTP_REORDER];
+    unsigned int reorder_bytes;
+    int need_ack;
+
+    /* how long the peer's last packet took, echoed back for its LEDBAT */
+    uint32_t reply_micro;
+
+    unsigned int retransmits;
+};
+
+static unsigned long __id_hash(const void *obj)
+{
+    return (unsigned long)obj;
+}
+
+static long __id_compare(const void *obj, const void *other)
+{
+    return (unsigned long)obj - (unsigned long)other;
+}
+
+static unsigned long __route_hash(const void *obj)
+{
+    const route_t* r = obj;
+
+    return (unsigned long)r->ip * 2654435761u ^
+           (unsigned long)r->port << 16 ^ r->id;
+}
+
+static long __route_compare(const void *obj, const void *other)
+{
+    const route_t* a = obj, *b = other;
+
+    return !(a->ip == b->ip && a->port == b->port && a->id == b->id);
+}
+
+static adapter_settings_t* __cfg(adapter_t* me)
+{
+    config_t* cfg = me->cfg;
+    adapter_settings_t* s = &me->settings;
+
+    if (s->version == cfg->version)
+        return s;
+
+    s->version = cfg->version;
+    s->packet_bytes = config_get_int(cfg, "utp_packet_bytes");
+    s->target_delay_us = config_get_int(cfg, "utp_target_delay_ms") * 1000;
+    s->max_window = config_get_int(cfg, "utp_max_window_bytes");
+    s->recv_window = config_get_int(cfg, "utp_recv_window_bytes");
+    s->batch = config_get_int(cfg, "utp_batch");
+    s->initial_rto_us = config_get_int(cfg, "utp_initial_rto_ms") * 1000;
+    s->max_timeouts = config_get_int(cfg, "utp_max_timeouts");
+    return s;
+}
+
+static unsigned long long __now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void* __nethandle(conn_t* cn)
+{
+    return (void*)(uintptr_t)cn->id;
+}
+
+static conn_t* __get(adapter_t* me, void* nethandle)
+{
+    return hashmap_get(me->conns, nethandle);
+}
+
+/** @return payload bytes a packet can carry */
+static unsigned int __mss(adapter_t* me)
+{
+    return me->packet_bytes - UTP_HEADER_LEN;
+}
+
+static void __put16(unsigned char* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void __put32(unsigned char* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint16_t __get16(const unsigned char* p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t __get32(const unsigned char* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @return 1 if the datagram has a header we understand; otherwise 0 */
+static int __header_read(header_t* h, const unsigned char* p,
+                         unsigned int len)
+{
+    unsigned int ext, off = UTP_HEADER_LEN;
+
+    if (len < UTP_HEADER_LEN || UTP_VERSION != (p[0] & 0xf) ||
+        ST_SYN < p[0] >> 4)
+        return 0;
+
+    h->type = p[0] >> 4;
+    h->connection_id = __get16(p + 2);
+    h->timestamp_us = __get32(p + 4);
+    h->timestamp_difference_us = __get32(p + 8);
+    h->wnd_size = __get32(p + 12);
+    h->seq_nr = __get16(p + 16);
+    h->ack_nr = __get16(p + 18);
+
+    /* extensions are skipped over; we don't do selective acks */
+    for (ext = p[1]; 0 != ext; ext = p[off], off += 2 + p[off + 1])
+        if (len < off + 2 || len < off + 2 + p[off + 1])
+            return 0;
+    return off;
+}
+
+static void __header_write(unsigned char* p, const header_t* h)
+{
+    p[0] = h->type << 4 | UTP_VERSION;
+    p[1] = 0;
+    __put16(p + 2, h->connection_id);
+    __put32(p + 4, h->timestamp_us);
+    __put32(p + 8, h->timestamp_difference_us);
+    __put32(p + 12, h->wnd_size);
+    __put16(p + 16, h->seq_nr);
+    __put16(p + 18, h->ack_nr);
+}
+
+/**
+ * Hand the batch to sendmmsg. Datagrams the socket won't take are lost,
+ * and retransmitted like any other loss */
+static void __flush(adapter_t* me)
+{
+    unsigned int i = 0;
+
+    while (i < me->nout)
+    {
+        int n = sendmmsg(me->fd, me->out_msgs + i, me->nout - i, 0);
+
+        if (n <= 0)
+        {
+            if (n < 0 && EINTR == errno)
+                continue;
+            break;
+        }
+        i += n;
+    }
+    me->nout = 0;
+}
+
+static void __batches_new(adapter_t* me)
+{
+    unsigned int i;
+
+    if (me->out_msgs)
+        return;
+
+    me->batch = __cfg(me)->batch;
+    me->packet_bytes = __cfg(me)->packet_bytes;
+    me->out_msgs = calloc(me->batch, sizeof(struct mmsghdr));
+    me->out_iov = calloc(me->batch, sizeof(struct iovec));
+    me->out_addrs = calloc(me->batch, sizeof(struct sockaddr_in));
+    me->out_bufs = malloc(me->batch * me->packet_bytes);
+    me->in_msgs = calloc(me->batch, sizeof(struct mmsghdr));
+    me->in_iov = calloc(me->batch, sizeof(struct iovec));
+    me->in_addrs = calloc(me->batch, sizeof(struct sockaddr_in));
+    me->in_bufs = malloc(me->batch * me->packet_bytes);
+
+    for (i = 0; i < me->batch; i++)
+    {
+        me->out_iov[i].iov_base = me->out_bufs + i * me->packet_bytes;
+        me->out_msgs[i].msg_hdr.msg_iov = &me->out_iov[i];
+        me->out_msgs[i].msg_hdr.msg_iovlen = 1;
+        me->out_msgs[i].msg_hdr.msg_name = &me->out_addrs[i];
+        me->out_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        me->in_iov[i].iov_base = me->in_bufs + i * me->packet_bytes;
+        me->in_iov[i].iov_len = me->packet_bytes;
+        me->in_msgs[i].msg_hdr.msg_iov = &me->in_iov[i];
+        me->in_msgs[i].msg_hdr.msg_iovlen = 1;
+        me->in_msgs[i].msg_hdr.msg_name = &me->in_addrs[i];
+    }
+}
+
+/**
+ * Open the socket, bound to this port; 0 for any
+ * @return 1 if the socket is open; otherwise 0 */
+static int __socket(adapter_t* me, int port)
+{
+    struct sockaddr_in addr;
+
+    if (0 <= me->fd)
+        return 1;
+
+    __batches_new(me);
+    if ((me->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (0 != bind(me->fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        0 != fcntl(me->fd, F_SETFL, fcntl(me->fd, F_GETFL) | O_NONBLOCK))
+    {
+        close(me->fd);
+        me->fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @return receive window to advertise */
+static uint32_t __recv_window(adapter_t* me, conn_t* cn)
+{
+    unsigned int w = __cfg(me)->recv_window;
+
+    return cn->reorder_bytes < w ? w - cn->reorder_bytes : 0;
+}
+
+/**
+ * Add a datagram to the batch; a full batch goes out now */
+static void __send(adapter_t* me, conn_t* cn, unsigned char type,
+                   uint16_t seq_nr, const char* data, unsigned int len)
+{
+    unsigned char* p;
+    header_t h;
+
+    if (me->nout == me->batch)
+        __flush(me);
+
+    p = (unsigned char*)me->out_bufs + me->nout * me->packet_bytes;
+    h.type = type;
+    h.connection_id = ST_SYN == type ? cn->route.id : cn->send_id;
+    h.timestamp_us = (uint32_t)__now_us();
+    h.timestamp_difference_us = cn->reply_micro;
+    h.wnd_size = __recv_window(me, cn);
+    h.seq_nr = seq_nr;
+    h.ack_nr = cn->ack_nr;
+    __header_write(p, &h);
+    /* SYNs and acks carry no data */
+    if (0 < len)
+        memcpy(p + UTP_HEADER_LEN, data, len);
+
+    me->out_iov[me->nout].iov_len = UTP_HEADER_LEN + len;
+    me->out_addrs[me->nout] = cn->addr;
+    me->nout++;
+
+    /* a data packet carries the ack too */
+    if (ST_STATE != type)
+        cn->need_ack = 0;
+}
+
+static packet_t* __packet_new(unsigned char type, uint16_t seq_nr,
+                              const char* data, unsigned int len)
+{
+    packet_t* pkt = malloc(sizeof(packet_t) + len);
+
+    pkt->type = type;
+    pkt->seq_nr = seq_nr;
+    pkt->len = len;
+    pkt->sent_us = 0;
+    pkt->transmissions = 0;
+    if (0 < len)
+        memcpy(pkt->data, data, len);
+    return pkt;
+}
+
+static void __transmit(adapter_t* me, conn_t* cn, packet_t* pkt)
+{
+    unsigned long long now = __now_us();
+
+    if (0 < pkt->transmissions)
+        cn->retransmits++;
+    pkt->transmissions++;
+    pkt->sent_us = now;
+    __send(me, cn, pkt->type, pkt->seq_nr, pkt->data, pkt->len);
+    if (0 == cn->rto_deadline_us)
+        cn->rto_deadline_us = now + cn->rto_us;
+}
+
+/**
+ * Send a packet that needs acknowledging, and keep it until it is */
+static void __send_reliably(adapter_t* me, conn_t* cn, unsigned char type,
+                            const char* data, unsigned int len)
+{
+    packet_t* pkt = __packet_new(type, cn->seq_nr++, data, len);
+
+    if (cn->nout == cn->out_size)
+    {
+        unsigned int i, size = cn->out_size ? cn->out_size * 2 : 16;
+        packet_t** out = malloc(size * sizeof(packet_t*));
+
+        for (i = 0; i < cn->nout; i++)
+            out[i] = cn->out[(cn->out_head + i) % cn->out_size];
+        free(cn->out);
+        cn->out = out;
+        cn->out_size = size;
+        cn->out_head = 0;
+    }
+    cn->out[(cn->out_head + cn->nout++) % cn->out_size] = pkt;
+    cn->inflight += len;
+    __transmit(me, cn, pkt);
+}
+
+static packet_t* __oldest(conn_t* cn)
+{
+    return 0 == cn->nout ? NULL : cn->out[cn->out_head];
+}
+
+static void __conn_free(conn_t* cn)
+{
+    unsigned int i;
+
+    for (i = 0; i < cn->nout; i++)
+        free(cn->out[(cn->out_head + i) % cn->out_size]);
+    free(cn->out);
+    for (i = 0; i < UTP_REORDER; i++)
+        free(cn->reorder[i]);
+    free(cn->unsent);
+    free(cn);
+}
+
+/**
+ * Close the connection. Later calls with its id are ignored. It's freed
+ * at the end of network_adapter_utp_poll, as the callbacks may still be
+ * using it */
+static void __close(adapter_t* me, conn_t* cn)
+{
+    if (cn->closing)
+        return;
+    cn->closing = 1;
+    hashmap_remove(me->conns, __nethandle(cn));
+    hashmap_remove(me->routes, &cn->route);
+    cn->next_closed = me->closed;
+    me->closed = cn;
+}
+
+/**
+ * The connection failed on its own. The caller is told, and is still
+ * expected to disconnect it */
+static void __fail(adapter_t* me, conn_t* cn)
+{
+    if (cn->closing)
+        return;
+    __close(me, cn);
+    if (cn->connection_failed)
+        cn->connection_failed(cn->caller, __nethandle(cn));
+}
+
+static conn_t* __conn_new(adapter_t* me, void* caller,
+                          func_process_data_f process_data,
+                          func_process_connection_f process_connection,
+                          func_connection_failed_f connection_failed,
+                          const struct sockaddr_in* addr, uint16_t recv_id)
+{
+    conn_t* cn = calloc(1, sizeof(conn_t));
+
+    cn->a = me;
+    cn->caller = caller;
+    cn->process_data = process_data;
+    cn->process_connection = process_connection;
+    cn->connection_failed = connection_failed;
+    cn->addr = *addr;
+    cn->port = ntohs(addr->sin_port);
+    inet_ntop(AF_INET, &addr->sin_addr, cn->ip, sizeof(cn->ip));
+    cn->route.ip = addr->sin_addr.s_addr;
+    cn->route.port = addr->sin_port;
+    cn->route.id = recv_id;
+
+    /* a window of two packets to start with */
+    cn->cwnd = 2 * __mss(me);
+    cn->peer_wnd = __mss(me);
+    cn->rto_us = __cfg(me)->initial_rto_us;
+
+    /* ids aren't reused, and 0 is never one */
+    cn->id = ++me->next_id;
+    hashmap_put(me->conns, __nethandle(cn), cn);
+    hashmap_put(me->routes, &cn->route, cn);
+    return cn;
+}
+
+/**
+ * Fold a round trip into the estimate (RFC 6298) */
+static void __rtt_sample(conn_t* cn, unsigned int rtt)
+{
+    unsigned int err;
+
+    if (0 == cn->srtt_us)
+    {
+        cn->srtt_us = rtt;
+        cn->rttvar_us = rtt / 2;
+    }
+    else
+    {
+        err = cn->srtt_us < rtt ? rtt - cn->srtt_us : cn->srtt_us - rtt;
+        cn->rttvar_us = (3 * cn->rttvar_us + err) / 4;
+        cn->srtt_us = (7 * cn->srtt_us + rtt) / 8;
+    }
+
+    cn->rto_us = cn->srtt_us + 4 * cn->rttvar_us;
+    if (cn->rto_us < UTP_MIN_RTO_US)
+        cn->rto_us = UTP_MIN_RTO_US;
+    if (UTP_MAX_RTO_US < cn->rto_us)
+        cn->rto_us = UTP_MAX_RTO_US;
+}
+
+/**
+ * @return the least one way delay of the last two periods. Clocks aren't
+ *         synchronised, so only differences from it mean anything */
+static uint32_t __base_delay(conn_t* cn, uint32_t delay,
+                             unsigned long long now)
+{
+    if (!cn->have_base_delay)
+    {
+        cn->base_delay[0] = cn->base_delay[1] = delay;
+        cn->base_period_us = now;
+        cn->have_base_delay = 1;
+    }
+
+    if (cn->base_period_us + UTP_BASE_DELAY_PERIOD_US <= now)
+    {
+        cn->base_delay[1] = cn->base_delay[0];
+        cn->base_delay[0] = delay;
+        cn->base_period_us = now;
+    }
+
+    /* the timestamps wrap */
+    if ((int32_t)(delay - cn->base_delay[0]) < 0)
+        cn->base_delay[0] = delay;
+    return (int32_t)(cn->base_delay[1] - cn->base_delay[0]) < 0 ?
+        cn->base_delay[1] : cn->base_delay[0];
+}
+
+/**
+ * LEDBAT: grow the window while the delay our packets see is under the
+ * target, and shrink it in proportion once it's over */
+static void __ledbat(adapter_t* me, conn_t* cn, uint32_t delay,
+                     unsigned int bytes_acked)
+{
+    adapter_settings_t* s = __cfg(me);
+    long long off_target, gain, cwnd;
+
+    cn->queueing_us = delay - __base_delay(cn, delay, __now_us());
+    off_target = (long long)s->target_delay_us - cn->queueing_us;
+    gain = (long long)UTP_MAX_CWND_INCREASE * off_target / s->target_delay_us
+        * bytes_acked / cn->cwnd;
+
+    cwnd = (long long)cn->cwnd + gain;
+    if (cwnd < __mss(me))
+        cwnd = __mss(me);
+    if (s->max_window < cwnd)
+        cwnd = s->max_window;
+    cn->cwnd = cwnd;
+}
+
+/**
+ * The oldest packet is lost. The window halves, once per window */
+static void __fast_retransmit(adapter_t* me, conn_t* cn)
+{
+    if (!cn->recovering)
+    {
+        cn->recovering = 1;
+        cn->recover_nr = cn->seq_nr - 1;
+        cn->cwnd = cn->cwnd / 2 < __mss(me) ? __mss(me) : cn->cwnd / 2;
+    }
+    __transmit(me, cn, __oldest(cn));
+}
+
+static void __acked(adapter_t* me, conn_t* cn, const header_t* h,
+                    unsigned int payload)
+{
+    unsigned long long now = __now_us();
+    unsigned int n = (uint16_t)(h->ack_nr - cn->acked_nr), bytes = 0;
+
+    cn->peer_wnd = h->wnd_size;
+
+    /* it acknowledges something we haven't sent */
+    if (cn->nout < n)
+        return;
+
+    if (0 == n)
+    {
+        /* a bare ack for nothing new, while we wait on our oldest */
+        if (0 < cn->nout && ST_STATE == h->type && 0 == payload &&
+            3 == ++cn->dup_acks)
+            __fast_retransmit(me, cn);
+        return;
+    }
+
+    for (; 0 < n; n--)
+    {
+        packet_t* pkt = __oldest(cn);
+
+        /* Karn: a resent packet's round trip is ambiguous */
+        if (1 == pkt->transmissions)
+            __rtt_sample(cn, now - pkt->sent_us);
+        bytes += pkt->len;
+        cn->inflight -= pkt->len;
+        cn->out_head = (cn->out_head + 1) % cn->out_size;
+        cn->nout--;
+        free(pkt);
+    }
+
+    cn->acked_nr = h->ack_nr;
+    cn->dup_acks = 0;
+    cn->ntimeouts = 0;
+    cn->rto_deadline_us = 0 < cn->nout ? now + cn->rto_us : 0;
+
+    if (0 < bytes && 0 != h->timestamp_difference_us)
+        __ledbat(me, cn, h->timestamp_difference_us, bytes);
+
+    /* a partial ack in recovery means the next packet was lost too */
+    if (cn->recovering)
+    {
+        if (SEQ_LT(cn->acked_nr, cn->recover_nr) && 0 < cn->nout)
+            __transmit(me, cn, __oldest(cn));
+        else
+            cn->recovering = 0;
+    }
+}
+
+/**
+ * Pass packets on for as long as they're in order
+ * @return 0 if the connection closed; otherwise 1 */
+static int __deliver(adapter_t* me, conn_t* cn, const char* data,
+                     unsigned int len)
+{
+    while (1)
+    {
+        packet_t* next;
+
+        cn->ack_nr++;
+        if (0 < len && 0 == cn->process_data(cn->caller, __nethandle(cn),
+                                             data, len))
+        {
+            __fail(me, cn);
+            return 0;
+        }
+
+        if (cn->closing)
+            return 0;
+
+        /* the packets held back move up one */
+        if (cn->reorder[0])
+            free(cn->reorder[0]);
+        memmove(cn->reorder, cn->reorder + 1,
+                (UTP_REORDER - 1) * sizeof(packet_t*));
+        cn->reorder[UTP_REORDER - 1] = NULL;
+
+        if (!(next = cn->reorder[0]))
+            return 1;
+
+        /* freed when it moves out of the slot */
+        cn->reorder_bytes -= next->len;
+        data = next->data;
+        len = next->len;
+    }
+}
+
+static void __received(adapter_t* me, conn_t* cn, const header_t* h,
+                       const char* data, unsigned int len)
+{
+    unsigned int ahead;
+
+    __acked(me, cn, h, len);
+    if (cn->closing)
+        return;
+
+    /* the peer has gone; anything it hadn't got to us won't be resent */
+    if (ST_FIN == h->type)
+    {
+        __fail(me, cn);
+        return;
+    }
+
+    if (ST_DATA != h->type)
+        return;
+
+    cn->need_ack = 1;
+    ahead = (uint16_t)(h->seq_nr - cn->ack_nr - 1);
+
+    if (0 == ahead)
+    {
+        /* the slot's packet, if any, is a copy of this one */
+        if (cn->reorder[0])
+        {
+            cn->reorder_bytes -= cn->reorder[0]->len;
+            free(cn->reorder[0]);
+            cn->reorder[0] = NULL;
+        }
+        __deliver(me, cn, data, len);
+    }
+    else if (ahead < UTP_REORDER && !cn->reorder[ahead])
+    {
+        cn->reorder[ahead] = __packet_new(h->type, h->seq_nr, data, len);
+        cn->reorder_bytes += len;
+    }
+}
+
+static void __connected(adapter_t* me, conn_t* cn, const header_t* h)
+{
+    cn->state = UTP_CONNECTED;
+
+    /* their data starts at the sequence number they replied with */
+    cn->ack_nr = h->seq_nr - 1;
+    __acked(me, cn, h, 0);
+
+    if (0 == cn->process_connection(cn->caller, __nethandle(cn), cn->ip,
+                                    cn->port))
+        __fail(me, cn);
+}
+
+static void __syn(adapter_t* me, const header_t* h,
+                  const struct sockaddr_in* from)
+{
+    route_t r = { from->sin_addr.s_addr, from->sin_port,
+                  (uint16_t)(h->connection_id + 1) };
+    conn_t* cn;
+
+    /* our reply was lost */
+    if ((cn = hashmap_get(me->routes, &r)))
+    {
+        __send(me, cn, ST_STATE, cn->seq_nr, NULL, 0);
+        return;
+    }
+
+    if (!me->listening)
+        return;
+
+    cn = __conn_new(me, me->listen_caller, me->listen_process_data, NULL,
+                    me->listen_connection_failed, from, r.id);
+    cn->send_id = h->connection_id;
+    cn->state = UTP_CONNECTED;
+    cn->seq_nr = rand();
+    cn->acked_nr = cn->seq_nr - 1;
+    cn->ack_nr = h->seq_nr;
+    cn->reply_micro = (uint32_t)__now_us() - h->timestamp_us;
+    cn->peer_wnd = h->wnd_size;
+
+    /* refused connections were never the caller's */
+    if (0 == me->listen_process_connection(me->listen_caller,
+                                           __nethandle(cn), cn->ip, cn->port))
+    {
+        __send(me, cn, ST_RESET, cn->seq_nr, NULL, 0);
+        cn->connection_failed = NULL;
+        __close(me, cn);
+        return;
+    }
+
+    if (!cn->closing)
+        __send(me, cn, ST_STATE, cn->seq_nr, NULL, 0);
+}
+
+static void __datagram(adapter_t* me, const unsigned char* p,
+                       unsigned int len, const struct sockaddr_in* from)
+{
+    route_t r;
+    header_t h;
+    conn_t* cn;
+    int off;
+
+    if (0 == (off = __header_read(&h, p, len)))
+        return;
+
+    if (ST_SYN == h.type)
+    {
+        __syn(me, &h, from);
+        return;
+    }
+
+    r.ip = from->sin_addr.s_addr;
+    r.port = from->sin_port;
+    r.id = h.connection_id;
+    if (!(cn = hashmap_get(me->routes, &r)))
+        return;
+
+    cn->reply_micro = (uint32_t)__now_us() - h.timestamp_us;
+
+    if (ST_RESET == h.type)
+        __fail(me, cn);
+    else if (UTP_SYN_SENT == cn->state)
+    {
+        if (ST_STATE == h.type && h.ack_nr == cn->acked_nr + 1)
+            __connected(me, cn, &h);
+    }
+    else
+        __received(me, cn, &h, (const char*)p + off, len - off);
+}
+
+/**
+ * Resend the oldest packet if it's waited too long
+ * @return 0 if the connection failed; otherwise 1 */
+static int __timeout(adapter_t* me, conn_t* cn, unsigned long long now)
+{
+    if (0 == cn->nout || now < cn->rto_deadline_us)
+        return 1;
+
+    if (__cfg(me)->max_timeouts <= cn->ntimeouts++)
+    {
+        __fail(me, cn);
+        return 0;
+    }
+
+    /* start again from a packet */
+    cn->cwnd = __mss(me);
+    cn->rto_us = cn->rto_us * 2 < UTP_MAX_RTO_US ?
+        cn->rto_us * 2 : UTP_MAX_RTO_US;
+    cn->rto_deadline_us = now + cn->rto_us;
+    cn->recovering = 0;
+    cn->dup_acks = 0;
+    __transmit(me, cn, __oldest(cn));
+    return 1;
+}
+
+/**
+ * Packetise what's queued, for as long as the windows allow */
+static void __pump(adapter_t* me, conn_t* cn)
+{
+    unsigned int window = cn->cwnd < cn->peer_wnd ? cn->cwnd : cn->peer_wnd;
+
+    if (UTP_CONNECTED != cn->state)
+        return;
+
+    while (cn->unsent_off < cn->unsent_len)
+    {
+        unsigned int len = cn->unsent_len - cn->unsent_off;
+
+        if (__mss(me) < len)
+            len = __mss(me);
+
+        /* a closed window still lets a packet through to probe it */
+        if (0 < cn->inflight && window < cn->inflight + len)
+            break;
+
+        __send_reliably(me, cn, ST_DATA, cn->unsent + cn->unsent_off, len);
+        cn->unsent_off += len;
+    }
+
+    if (cn->unsent_off == cn->unsent_len)
+        cn->unsent_off = cn->unsent_len = 0;
+
+    if (cn->need_ack)
+        __send(me, cn, ST_STATE, cn->seq_nr, NULL, 0);
+}
+
+static void __free_closed(adapter_t* me)
+{
+    while (me->closed)
+    {
+        conn_t* cn = me->closed;
+
+        me->closed = cn->next_closed;
+        __conn_free(cn);
+    }
+}
+
+/**
+ * @return the open connections; callbacks can't change the list */
+static unsigned int __snapshot(adapter_t* me)
+{
+    hashmap_iterator_t iter;
+    unsigned int n = 0;
+    conn_t* cn;
+
+    if (me->walk_size < (unsigned int)hashmap_count(me->conns))
+    {
+        me->walk_size = hashmap_count(me->conns) * 2;
+        me->walk = realloc(me->walk, me->walk_size * sizeof(conn_t*));
+    }
+
+    for (hashmap_iterator(me->conns, &iter);
+         (cn = hashmap_iterator_next_value(me->conns, &iter));)
+        me->walk[n++] = cn;
+    return n;
+}
+
+int network_adapter_utp_poll(void* a)
+{
+    adapter_t* me = a;
+    unsigned long long now;
+    unsigned int i, n;
+    int total = 0;
+
+    if (me->fd < 0)
+        return 0;
+
+    while (1)
+    {
+        int got;
+
+        for (i = 0; i < me->batch; i++)
+            me->in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        got = recvmmsg(me->fd, me->in_msgs, me->batch, MSG_DONTWAIT, NULL);
+        if (got <= 0)
+            break;
+
+        for (i = 0; i < (unsigned int)got; i++)
+            __datagram(me, me->in_iov[i].iov_base, me->in_msgs[i].msg_len,
+                       &me->in_addrs[i]);
+        total += got;
+
+        if ((unsigned int)got < me->batch)
+            break;
+    }
+
+    now = __now_us();
+    n = __snapshot(me);
+    for (i = 0; i < n; i++)
+        if (!me->walk[i]->closing && __timeout(me, me->walk[i], now))
+            __pump(me, me->walk[i]);
+
+    __flush(me);
+    __free_closed(me);
+    return total;
+}
+
+void* network_adapter_utp_new()
+{
+    adapter_t* me = calloc(1, sizeof(adapter_t));
+
+    me->fd = -1;
+    me->cfg = config_new();
+    me->settings.version = ~0u;
+    config_set_if_not_set(me->cfg, "utp_packet_bytes", "1400");
+    config_set_if_not_set(me->cfg, "utp_target_delay_ms", "100");
+    config_set_if_not_set(me->cfg, "utp_max_window_bytes", "1048576");
+    config_set_if_not_set(me->cfg, "utp_recv_window_bytes", "1048576");
+    config_set_if_not_set(me->cfg, "utp_batch", "32");
+    config_set_if_not_set(me->cfg, "utp_initial_rto_ms", "1000");
+    config_set_if_not_set(me->cfg, "utp_max_timeouts", "5");
+    me->conns = hashmap_new(__id_hash, __id_compare, 11);
+    me->routes = hashmap_new(__route_hash, __route_compare, 11);
+    return me;
+}
+
+void* network_adapter_utp_get_config(void* a)
+{
+    adapter_t* me = a;
+
+    return me->cfg;
+}
+
+void network_adapter_utp_free(void* a)
+{
+    adapter_t* me = a;
+    hashmap_iterator_t iter;
+    conn_t* cn;
+
+    /* __close removes the connection, so start over each time */
+    while (0 < hashmap_count(me->conns))
+    {
+        hashmap_iterator(me->conns, &iter);
+        cn = hashmap_iterator_next_value(me->conns, &iter);
+        if (UTP_CONNECTED == cn->state)
+            __send(me, cn, ST_FIN, cn->seq_nr, NULL, 0);
+        __close(me, cn);
+    }
+    if (0 <= me->fd)
+    {
+        __flush(me);
+        close(me->fd);
+    }
+    __free_closed(me);
+
+    hashmap_freeall(me->conns);
+    hashmap_freeall(me->routes);
+    config_free(me->cfg);
+    free(me->out_msgs);
+    free(me->out_iov);
+    free(me->out_addrs);
+    free(me->out_bufs);
+    free(me->in_msgs);
+    free(me->in_iov);
+    free(me->in_addrs);
+    free(me->in_bufs);
+    free(me->walk);
+    free(me);
+}
+
+int network_adapter_utp_listen(
+    void* a,
+    void* caller,
+    int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *caller,
+                                    void* nethandle,
+                                    char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *caller, void* nethandle))
+{
+    adapter_t* me = a;
+
+    if (me->listening || 0 <= me->fd || !__socket(me, port))
+        return 0;
+
+    me->listening = 1;
+    me->listen_caller = caller;
+    me->listen_process_data = func_process_data;
+    me->listen_process_connection = func_process_connection;
+    me->listen_connection_failed = func_connection_failed;
+    return 1;
+}
+
+int network_adapter_utp_get_fd(void* a)
+{
+    adapter_t* me = a;
+
+    return me->fd;
+}
+
+int network_adapter_utp_get_nconnections(void* a)
+{
+    adapter_t* me = a;
+
+    return hashmap_count(me->conns);
+}
+
+int network_adapter_utp_get_stats(void* a, void* nethandle,
+                                  network_adapter_utp_stats_t* stats)
+{
+    conn_t* cn = __get(a, nethandle);
+
+    if (!cn)
+        return 0;
+
+    stats->window = cn->cwnd;
+    stats->inflight = cn->inflight;
+    stats->rtt_us = cn->srtt_us;
+    stats->queueing_us = cn->queueing_us;
+    stats->retransmits = cn->retransmits;
+    return 1;
+}
+
+int network_adapter_utp_connect(
+    void* caller,
+    void **udata,
+    void **nethandle,
+    const char *host, const int port,
+    int (*func_process_data) (void *caller,
+                              void* nethandle,
+                              const char* buf,
+                              unsigned int len),
+    int (*func_process_connection) (void *, void* nethandle, char *ip,
+                                    int port),
+    void (*func_connection_failed) (void *, void* nethandle))
+{
+    adapter_t* me = *udata;
+    struct sockaddr_in addr;
+    route_t r;
+    conn_t* cn;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (1 != inet_pton(AF_INET, host, &addr.sin_addr) || !__socket(me, 0))
+        return 0;
+
+    /* an id that's free for this peer */
+    r.ip = addr.sin_addr.s_addr;
+    r.port = addr.sin_port;
+    do
+        r.id = rand();
+    while (hashmap_get(me->routes, &r));
+
+    cn = __conn_new(me, caller, func_process_data, func_process_connection,
+                    func_connection_failed, &addr, r.id);
+    cn->send_id = r.id + 1;
+    cn->state = UTP_SYN_SENT;
+    cn->seq_nr = 1;
+    cn->acked_nr = 0;
+    *nethandle = __nethandle(cn);
+
+    /* the SYN goes now; it's resent like a data packet */
+    __send_reliably(me, cn, ST_SYN, NULL, 0);
+    __flush(me);
+    return 1;
+}
+
+/**
+ * Add bytes to the connection's queue, which is sent once we're polled */
+static void __queue(conn_t* cn, const void* data, unsigned int len)
+{
+    if (0 == len)
+        return;
+
+    /* what has gone out makes room first */
+    if (cn->unsent_size < cn->unsent_len + len && 0 < cn->unsent_off)
+    {
+        memmove(cn->unsent, cn->unsent + cn->unsent_off,
+                cn->unsent_len - cn->unsent_off);
+        cn->unsent_len -= cn->unsent_off;
+        cn->unsent_off = 0;
+    }
+
+    if (cn->unsent_size < cn->unsent_len + len)
+    {
+        cn->unsent_size = (cn->unsent_len + len) * 2;
+        cn->unsent = realloc(cn->unsent, cn->unsent_size);
+    }
+
+    memcpy(cn->unsent + cn->unsent_len, data, len);
+    cn->unsent_len += len;
+}
+
+int network_adapter_utp_send(void* caller, void **udata, void* nethandle,
+                             const char *send_data, const int len)
+{
+    conn_t* cn = __get(*udata, nethandle);
+
+    if (!cn)
+        return 0;
+
+    __queue(cn, send_data, len);
+    return 1;
+}
+
+int network_adapter_utp_sendv(void* caller, void **udata, void* nethandle,
+                              const bt_iovec_t *iov, const int iovcnt)
+{
+    conn_t* cn = __get(*udata, nethandle);
+    int i;
+
+    if (!cn)
+        return 0;
+
+    for (i = 0; i < iovcnt; i++)
+        __queue(cn, iov[i].base, iov[i].len);
+    return 1;
+}
+
+unsigned int network_adapter_utp_get_queued_bytes(void* caller, void **udata,
+                                                  void* nethandle)
+{
+    conn_t* cn = __get(*udata, nethandle);
+
+    return cn ? cn->unsent_len - cn->unsent_off + cn->inflight : 0;
+}
+
+int network_adapter_utp_disconnect(void* caller, void **udata,
+                                   void* nethandle)
+{
+    adapter_t* me = *udata;
+    conn_t* cn = __get(me, nethandle);
+
+    if (!cn)
+        return 0;
+
+    /* what's queued is dropped; the FIN isn't resent */
+    if (UTP_CONNECTED == cn->state)
+    {
+        __send(me, cn, ST_FIN, cn->seq_nr, NULL, 0);
+        __flush(me);
+    }
+    __close(me, cn);
+    return 1;
+}
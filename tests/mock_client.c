@@ -17,7 +17,7 @@
 #include <assert.h>
 
 #include "bt.h"
-#include "bt_selector_random.h"
+#include "bt_selector_auto.h"
 #include "network_adapter.h"
 #include "network_adapter_mock.h"
 #include "mock_torrent.h"
@@ -126,47 +126,67 @@ void client_add_peer(
 
 }
 
-client_t* mock_client_setup(int piecelen)
+static void __set_cbs(client_t* cli,
+                      unsigned long long (*get_time_us)(void* cb_ctx))
 {
-    client_t* cli;
-    config_t* cfg;
-
-    cli = networkfuns_mock_client_new(NULL);
-
-    /* bittorrent client */
-    cli->bt = bt_dm_new();
-    cfg = bt_dm_get_config(cli->bt);
-    config_set(cfg, "my_peerid", bt_generate_peer_id());
     bt_dm_set_cbs(cli->bt,
                   &((bt_dm_cbs_t) {
                         .peer_connect = peer_connect,
                         .peer_send = peer_send,
+                        .peer_sendv = peer_sendv,
                         .peer_disconnect = peer_disconnect,
+                        .peer_get_queued_bytes = peer_get_queued_bytes,
                         .call_exclusively = call_exclusively_pass_through,
                         .log = __log,
                         .handshaker_new = pwp_handshaker_new,
                         .handshaker_release = pwp_handshaker_release,
                         .handshaker_dispatch_from_buffer =
                             pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved,
+                        .handshaker_get_error = pwp_handshaker_get_error,
                         .send_handshake = pwp_send_handshake,
-                        .msghandler_new = NULL
+                        .msghandler_new = NULL,
+                        .get_time_us = get_time_us
                     }), cli);
+}
+
+client_t* mock_client_setup(int piecelen)
+{
+    client_t* cli;
+    config_t* cfg;
+
+    cli = networkfuns_mock_client_new(NULL);
+
+    /* bittorrent client */
+    cli->bt = bt_dm_new();
+    cfg = bt_dm_get_config(cli->bt);
+    config_set(cfg, "my_peerid", bt_generate_peer_id());
+    __set_cbs(cli, NULL);
     bt_dm_set_piece_selector(cli->bt,
                              &((bt_pieceselector_i) {
-                                   .new = bt_random_selector_new,
+                                   .new = bt_auto_selector_new,
                                    .peer_giveback_piece =
-                                       bt_random_selector_giveback_piece,
-                                   .have_piece = bt_random_selector_have_piece,
+                                       bt_auto_selector_giveback_piece,
+                                   .have_piece = bt_auto_selector_have_piece,
                                    .remove_peer =
-                                       bt_random_selector_remove_peer,
-                                   .add_peer = bt_random_selector_add_peer,
+                                       bt_auto_selector_remove_peer,
+                                   .add_peer = bt_auto_selector_add_peer,
                                    .peer_have_piece =
-                                       bt_random_selector_peer_have_piece,
-                                   .get_npeers = bt_random_selector_get_npeers,
+                                       bt_auto_selector_peer_have_piece,
+                                   .peer_have_bitfield =
+                                       bt_auto_selector_peer_have_bitfield,
+                                   .peer_share_pieces =
+                                       bt_auto_selector_peer_share_pieces,
+                                   .get_npeers = bt_auto_selector_get_npeers,
                                    .get_npieces =
-                                       bt_random_selector_get_npieces,
+                                       bt_auto_selector_get_npieces,
+                                   .get_memory =
+                                       bt_auto_selector_get_memory,
+                                   .get_availability =
+                                       bt_auto_selector_get_availability_stats,
                                    .poll_piece =
-                                       bt_random_selector_poll_best_piece
+                                       bt_auto_selector_poll_best_piece
                                }), NULL);
     mock_client_setup_disk_backend(cli->bt, piecelen);
 
@@ -175,6 +195,11 @@ client_t* mock_client_setup(int piecelen)
     return cli;
 }
 
+void mock_client_use_virtual_clock(client_t* cli)
+{
+    __set_cbs(cli, networkfuncs_mock_get_time_us);
+}
+
 void mock_on_connect(void *bt, void* nethandle, char *ip, int port)
 {
     bt_dm_add_peer(bt, "", 0, ip, strlen(ip), port, nethandle, NULL);
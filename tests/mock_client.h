@@ -17,6 +17,11 @@ void client_add_peer(
 
 client_t* mock_client_setup(int piecelen);
 
+/**
+ * Run the client on the mock network's virtual time, so that its timers
+ * only move with networkfuncs_mock_tick */
+void mock_client_use_virtual_clock(client_t* cli);
+
 void mock_on_connect(void *bt, void* nethandle, char *ip, int port);
 
 #endif /* MOCK_CLIENT_H */
@@ -0,0 +1,253 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bt.h"
+#include "network_adapter.h"
+#include "network_adapter_mock.h"
+#include "mock_torrent.h"
+#include "mock_client.h"
+#include "mock_swarm.h"
+
+#include "bt_piece_db.h"
+#include "bt_diskmem.h"
+#include "config.h"
+#include "mt19937ar.h"
+
+static double __seconds(struct timeval* tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double __cpu_seconds()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return __seconds(&ru.ru_utime) + __seconds(&ru.ru_stime);
+}
+
+static double __wall_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static client_t* __client_new(const mock_swarm_params_t* p, void* mt)
+{
+    client_t* cli = mock_client_setup(p->piece_len);
+    void* cfg = bt_dm_get_config(cli->bt);
+    char val[32];
+    int i;
+
+    if (p->tick_ms)
+        mock_client_use_virtual_clock(cli);
+
+    sprintf(val, "%d", p->npieces);
+    config_set(cfg, "npieces", val);
+    sprintf(val, "%d", p->piece_len);
+    config_set(cfg, "piece_length", val);
+    if (p->selector)
+        bt_dm_set_piece_selector(cli->bt, p->selector, NULL);
+    config_set(cfg, "infohash", "00000000000000000000");
+
+    /* connects are limited by ticks instead */
+    config_set(cfg, "max_connects_per_sec", "1000000");
+    sprintf(val, "%d", p->npeers);
+    config_set(cfg, "max_half_open", val);
+    config_set_va(cfg, "max_upload_rate", "%d", p->max_upload_rate);
+    config_set_va(cfg, "max_download_rate", "%d", p->max_download_rate);
+    if (p->steal_ratio)
+        config_set_va(cfg, "steal_ratio", "%d", p->steal_ratio);
+
+    bt_piecedb_increase_piece_space(bt_dm_get_piecedb(cli->bt), p->npieces);
+    for (i = 0; i < p->npieces; i++)
+    {
+        char hash[21];
+
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(cli->bt),
+                mocktorrent_get_piece_sha1(mt, hash, i), p->piece_len);
+    }
+    return cli;
+}
+
+static void __seed(client_t* cli, const mock_swarm_params_t* p, void* mt)
+{
+    void* db = bt_dm_get_piecedb(cli->bt);
+    bt_block_t blk;
+    int i;
+
+    for (i = 0; i < p->npieces; i++)
+    {
+        blk.piece_idx = i;
+        blk.offset = 0;
+        blk.len = p->piece_len;
+        bt_diskmem_write_block(bt_piecedb_get_diskstorage(db), NULL, &blk,
+                               mocktorrent_get_data(mt, i));
+    }
+    bt_dm_check_pieces(cli->bt);
+}
+
+/**
+ * Give client i npeers others to connect to, picked at random */
+static void __add_peers(client_t** clients, int i,
+                        const mock_swarm_params_t* p)
+{
+    int n, tries;
+    void* peer;
+
+    for (n = 0, tries = 0; n < p->npeers && tries < p->npeers * 10; tries++)
+    {
+        int j = genrand_int32() % p->nclients;
+        char addr[32];
+
+        if (j == i)
+            continue;
+        sprintf(addr, "%p", (void*)clients[j]);
+        if ((peer = bt_dm_add_peer(clients[i]->bt, NULL, 0, addr,
+                                   strlen(addr), 0, NULL, NULL)))
+        {
+            if (p->local_peers)
+                bt_dm_set_peer_local(clients[i]->bt, peer);
+            n++;
+        }
+    }
+}
+
+/**
+ * mock_on_connect, with the peer marked local */
+static void __on_connect_local(void *bt, void* nethandle, char *ip, int port)
+{
+    void* peer = bt_dm_add_peer(bt, "", 0, ip, strlen(ip), port, nethandle,
+                                NULL);
+
+    if (peer)
+        bt_dm_set_peer_local(bt, peer);
+    bt_dm_peer_connect(bt, nethandle, ip, port);
+}
+
+int mock_swarm_run(const mock_swarm_params_t* p, mock_swarm_results_t* r)
+{
+    unsigned int latency = networkfuncs_mock_latency,
+                 bandwidth = networkfuncs_mock_bandwidth,
+                 tick_ms = networkfuncs_mock_tick_ms;
+    int nseeds = p->nclients * p->seed_percent / 100;
+    int *completed_tick, i, tick, nleechers;
+    client_t** clients;
+    struct rusage ru;
+    double cpu, wall, mb;
+    void* mt;
+
+    if (nseeds < 1)
+        nseeds = 1;
+    nleechers = p->nclients - nseeds;
+
+    memset(r, 0, sizeof(mock_swarm_results_t));
+    networkfuncs_mock_latency = p->latency;
+    networkfuncs_mock_bandwidth = p->bandwidth;
+    if (p->tick_ms)
+        networkfuncs_mock_tick_ms = p->tick_ms;
+
+    /* the selectors and peer ids draw from rand() */
+    srand(p->seed);
+    clients_setup();
+    mt = mocktorrent_new(p->npieces, p->piece_len);
+    clients = calloc(p->nclients, sizeof(client_t*));
+    completed_tick = calloc(p->nclients, sizeof(int));
+    for (i = 0; i < p->nclients; i++)
+        clients[i] = __client_new(p, mt);
+    for (i = 0; i < nseeds; i++)
+    {
+        config_set_va(bt_dm_get_config(clients[i]->bt), "super_seeding",
+                      "%d", p->super_seeding);
+        __seed(clients[i], p, mt);
+    }
+    if (p->slow_seed_upload_rate)
+        config_set_va(bt_dm_get_config(clients[0]->bt), "max_upload_rate",
+                      "%d", p->slow_seed_upload_rate);
+    r->ncompleted = nseeds;
+
+    cpu = __cpu_seconds();
+    wall = __wall_seconds();
+
+    init_genrand(p->seed);
+    for (i = 0; i < p->nclients; i++)
+        __add_peers(clients, i, p);
+
+    for (tick = 1; tick <= p->max_ticks && r->ncompleted < p->nclients;
+         tick++)
+    {
+        for (i = 0; i < p->nclients; i++)
+            bt_dm_periodic(clients[i]->bt, NULL);
+
+        for (i = 0; i < p->nclients; i++)
+            network_poll(clients[i]->bt, (void*)&clients[i], 0,
+                         bt_dm_dispatch_from_buffer,
+                         p->local_peers ? __on_connect_local :
+                         mock_on_connect);
+        networkfuncs_mock_tick();
+
+        for (i = nseeds; i < p->nclients; i++)
+        {
+            if (completed_tick[i] || !bt_piecedb_all_pieces_are_complete(
+                    bt_dm_get_piecedb(clients[i]->bt)))
+                continue;
+            completed_tick[i] = tick;
+            r->mean_ticks += tick;
+            r->ncompleted++;
+        }
+    }
+
+    r->seconds = __wall_seconds() - wall;
+    r->cpu_seconds = __cpu_seconds() - cpu;
+    r->ticks = r->ncompleted == p->nclients ? tick - 1 : -1;
+    r->sim_seconds = p->tick_ms ? (tick - 1) * p->tick_ms / 1000.0 : 0;
+    if (0 < nleechers)
+        r->mean_ticks /= nleechers;
+
+    for (i = 0; i < p->nclients; i++)
+    {
+        bt_dm_stats_t stats;
+        int j;
+
+        memset(&stats, 0, sizeof(stats));
+        bt_dm_periodic(clients[i]->bt, &stats);
+        for (j = 0; i < nseeds && j < stats.npeers; j++)
+            r->seed_uploaded_bytes += stats.peers[j].uploaded;
+        r->duplicate_bytes += stats.duplicate_bytes;
+        r->stolen_blocks += stats.stolen_blocks;
+        r->upload_deferred_bytes += stats.upload_deferred_bytes;
+        r->download_deferred_bytes += stats.download_deferred_bytes;
+        free(stats.peers);
+    }
+
+    r->downloaded_bytes =
+        (unsigned long long)nleechers * p->npieces * p->piece_len;
+    mb = r->downloaded_bytes / (double)(1 << 20);
+    r->cpu_us_per_mb = 0 < mb ? r->cpu_seconds * 1e6 / mb : 0;
+    getrusage(RUSAGE_SELF, &ru);
+    r->peak_rss_kb = ru.ru_maxrss;
+
+    networkfuncs_mock_latency = latency;
+    networkfuncs_mock_bandwidth = bandwidth;
+    networkfuncs_mock_tick_ms = tick_ms;
+    free(completed_tick);
+    free(clients);
+    return r->ncompleted == p->nclients;
+}
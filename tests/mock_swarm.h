@@ -0,0 +1,97 @@
+#ifndef MOCK_SWARM_H
+#define MOCK_SWARM_H
+
+typedef struct
+{
+    int nclients;
+    int npieces;
+    int piece_len;
+
+    /* percentage of clients that start with every piece; at least one
+     * client does */
+    int seed_percent;
+
+    /* peers each client is given to connect to */
+    int npeers;
+
+    /* see networkfuncs_mock_latency and networkfuncs_mock_bandwidth */
+    unsigned int latency;
+    unsigned int bandwidth;
+
+    /* virtual ms per tick, see networkfuncs_mock_tick_ms; 0 runs the
+     * clients on the wall clock instead */
+    unsigned int tick_ms;
+
+    /* for mt19937ar and rand(). On the virtual clock a seed always gives
+     * the same results */
+    unsigned long seed;
+
+    /* give up after this many ticks */
+    int max_ticks;
+
+    /* each client's max_upload_rate and max_download_rate; 0 for none */
+    int max_upload_rate;
+    int max_download_rate;
+
+    /* 1 for the seeds to super-seed */
+    int super_seeding;
+
+    /* the first seed's max_upload_rate instead, to make it a slow peer */
+    int slow_seed_upload_rate;
+
+    /* each client's steal_ratio; 0 for the default, -1 for none */
+    int steal_ratio;
+
+    /* 1 for every peer to be local; see bt_dm_set_peer_local */
+    int local_peers;
+
+    /* each client's piece selector; NULL for mock_client_setup's */
+    bt_pieceselector_i* selector;
+} mock_swarm_params_t;
+
+typedef struct
+{
+    /* clients with every piece at the end, of nclients */
+    int ncompleted;
+
+    /* tick the last leecher completed on, and the mean over leechers.
+     * -1 if one didn't complete within max_ticks */
+    int ticks;
+    double mean_ticks;
+
+    double seconds;
+    double cpu_seconds;
+
+    /* virtual seconds the ticks stood for; 0 on the wall clock */
+    double sim_seconds;
+
+    /* piece bytes the leechers needed, and bytes they got again */
+    unsigned long long downloaded_bytes;
+    unsigned long long duplicate_bytes;
+
+    /* what the rate limits held back on the last tick, over every client */
+    unsigned long long upload_deferred_bytes;
+    unsigned long long download_deferred_bytes;
+
+    /* piece bytes the seeds sent */
+    unsigned long long seed_uploaded_bytes;
+
+    /* blocks the leechers asked of a second peer; see bt_dm_stats_t */
+    int stolen_blocks;
+
+    /* process CPU time for each MB the leechers downloaded */
+    double cpu_us_per_mb;
+
+    /* resident set's high water mark, of the whole process */
+    long peak_rss_kb;
+} mock_swarm_results_t;
+
+/**
+ * Share a torrent between clients on the mock network until every client
+ * has it, or max_ticks pass. Each tick every client runs
+ * bt_dm_periodic, then every client polls the network.
+ * The clients aren't freed afterwards
+ * @return 1 if every client completed; otherwise 0 */
+int mock_swarm_run(const mock_swarm_params_t* p, mock_swarm_results_t* r);
+
+#endif /* MOCK_SWARM_H */
@@ -30,6 +30,12 @@
 
 //void *__clients = NULL;
 
+unsigned int networkfuncs_mock_backlog = 0;
+unsigned int networkfuncs_mock_latency = 0;
+unsigned int networkfuncs_mock_bandwidth = 0;
+unsigned int networkfuncs_mock_ticks = 0;
+unsigned int networkfuncs_mock_tick_ms = 10;
+
 static unsigned long __vptr_hash(
     const void *e1
 )
@@ -90,6 +96,108 @@ void __print_client_contents()
 }
 #endif
 
+/**
+ * Bytes sent to us over one connection, oldest first.
+ * Each send is a segment that can be read once latency ticks have passed */
+typedef struct
+{
+    char* data;
+
+    /* data[head] is the next byte to be read; len bytes are queued */
+    unsigned int head, len, size;
+
+    /* end offset (from data[0]) and tick of each send not yet readable */
+    unsigned int* seg_end;
+    unsigned int* seg_tick;
+    int nsegs, segs_size;
+
+    /* bytes up to this offset may be read */
+    unsigned int readable;
+} inbox_t;
+
+static inbox_t* __inbox_new()
+{
+    return calloc(1, sizeof(inbox_t));
+}
+
+static unsigned int __inbox_count(inbox_t* me)
+{
+    return me->len;
+}
+
+static void __inbox_offer(inbox_t* me, const void* data, unsigned int len)
+{
+    if (0 == len)
+        return;
+
+    /* slide the unread bytes back to the start */
+    if (me->head && me->size < me->head + me->len + len)
+    {
+        int i;
+
+        memmove(me->data, me->data + me->head, me->len);
+        for (i = 0; i < me->nsegs; i++)
+            me->seg_end[i] -= me->head;
+        me->readable -= me->head;
+        me->head = 0;
+    }
+
+    if (me->size < me->len + len)
+    {
+        while (me->size < me->len + len)
+            me->size = me->size ? me->size * 2 : 1024;
+        me->data = realloc(me->data, me->size);
+    }
+
+    memcpy(me->data + me->head + me->len, data, len);
+    me->len += len;
+
+    if (me->segs_size == me->nsegs)
+    {
+        me->segs_size = me->segs_size ? me->segs_size * 2 : 8;
+        me->seg_end = realloc(me->seg_end,
+                              me->segs_size * sizeof(unsigned int));
+        me->seg_tick = realloc(me->seg_tick,
+                               me->segs_size * sizeof(unsigned int));
+    }
+    me->seg_end[me->nsegs] = me->head + me->len;
+    me->seg_tick[me->nsegs] = networkfuncs_mock_ticks;
+    me->nsegs++;
+}
+
+/**
+ * Take what has arrived, up to max bytes
+ * @return data, or NULL if nothing has arrived yet */
+static char* __inbox_poll(inbox_t* me, unsigned int max, unsigned int* len)
+{
+    char* data;
+    int i;
+
+    /* sends that have spent long enough on the wire */
+    for (i = 0; i < me->nsegs &&
+         me->seg_tick[i] + networkfuncs_mock_latency <= networkfuncs_mock_ticks;
+         i++)
+        me->readable = me->seg_end[i];
+    if (0 < i)
+    {
+        me->nsegs -= i;
+        memmove(me->seg_end, me->seg_end + i, me->nsegs * sizeof(unsigned int));
+        memmove(me->seg_tick, me->seg_tick + i,
+                me->nsegs * sizeof(unsigned int));
+    }
+
+    *len = me->readable - me->head;
+    if (max && max < *len)
+        *len = max;
+    if (0 == *len)
+        return NULL;
+
+    data = me->data + me->head;
+    me->head += *len;
+    me->len -= *len;
+    return data;
+}
+
 /**
  * Create a connection to this peer */
 static void __client_create_connection(client_t* me, void* nethandle)
@@ -104,11 +212,13 @@ static void __client_create_connection(client_t* me, void* nethandle)
 
     /* message inbox */
     cn = calloc(1,sizeof(client_connection_t));
-    cn->inbox = bipbuf_new(1000);
+    cn->inbox = __inbox_new();
     cn->connect_status = 0;
     cn->nethandle = nethandle;
     /* record on hashmap */
     hashmap_put(me->connections,cn->nethandle,cn);
+    me->conns = realloc(me->conns, (me->nconns + 1) * sizeof(cn));
+    me->conns[me->nconns++] = cn;
 }
 
 /**
@@ -121,16 +231,20 @@ static void __offer_inbox(client_t* me, const void* send_data, int len, void* ne
     assert(me->connections);
     cn = hashmap_get(me->connections, nethandle);
     assert(cn);
-    bipbuf_offer(cn->inbox, send_data, len);
-
-#if 0 /*  debuggin */
-    printf("|inbox me:%d rawpeer:%d peer:%d inbox:%d %dB",
-            me->nethandle, nethandle, cn->nethandle, bipbuf_get_spaceused(cn->inbox), len);
-    for (ii=0; ii<len; ii++)
-        printf("%c", ((char*)send_data)[ii]);
-    printf("\n");
-    __print_client_contents();
-#endif
+    __inbox_offer(cn->inbox, send_data, len);
+}
+
+void networkfuncs_mock_tick()
+{
+    networkfuncs_mock_ticks++;
+}
+
+unsigned long long networkfuncs_mock_get_time_us(void* udata)
+{
+    /* an hour in, so that nothing sees a time of 0 */
+    return (3600000ULL +
+            (unsigned long long)networkfuncs_mock_ticks *
+            networkfuncs_mock_tick_ms) * 1000;
 }
 
 void* networkfuns_mock_client_new(void* nethandle)
@@ -193,11 +307,37 @@ int peer_send(void* caller, void **udata,
     return 1;
 }
 
+int peer_sendv(void* caller, void **udata,
+               void* nethandle, const bt_iovec_t *iov, const int iovcnt)
+{
+    client_t* me = *udata;
+    int i;
+
+    /* each buffer lands in the sendee's inbox straight after the last */
+    for (i = 0; i < iovcnt; i++)
+        __offer_inbox(nethandle, iov[i].base, iov[i].len, me->nethandle);
+
+    return 1;
+}
+
 int peer_disconnect(void* caller, void **udata, void* nethandle)
 {
     return 1;
 }
 
+unsigned int peer_get_queued_bytes(void* caller, void **udata,
+                                   void* nethandle)
+{
+    client_t* me = *udata;
+    client_t* you = nethandle;
+    client_connection_t* cn;
+
+    /* what we've sent that the sendee hasn't polled yet */
+    if (!(cn = hashmap_get(you->connections, me->nethandle)))
+        return networkfuncs_mock_backlog;
+    return networkfuncs_mock_backlog + __inbox_count(cn->inbox);
+}
+
 /**
  * poll info peer has information 
  * */
@@ -214,17 +354,12 @@ int network_poll(void* caller, void **udata,
                )
 {
     client_t* me = *udata;
-    hashmap_iterator_t iter;
+    int i;
 
     /* loop throught each connection for this peer */
-    for (
-        hashmap_iterator(me->connections, &iter);
-        hashmap_iterator_has_next(me->connections, &iter);
-        )
+    for (i = 0; i < me->nconns; i++)
     {
-        client_connection_t* cn;
-
-        cn = hashmap_iterator_next_value(me->connections, &iter);
+        client_connection_t* cn = me->conns[i];
 
         /* we need to process a connection request created by the peer */
         if (0 == cn->connect_status)
@@ -241,16 +376,16 @@ int network_poll(void* caller, void **udata,
             func_process_connection(me->bt, cn->nethandle, ip, 4000);
             cn->connect_status = CS_CONNECTED;
         }
-        else if (!bipbuf_is_empty(cn->inbox))
+        else
         {
-            int len = bipbuf_get_spaceused(cn->inbox);
-            if (0 < len)
-                func_process(me->bt,
-                             (char*)cn->nethandle,
-                             (char*)bipbuf_poll(cn->inbox, len), len);
+            unsigned int len;
+            char* data = __inbox_poll(cn->inbox, networkfuncs_mock_bandwidth,
+                                      &len);
+
+            if (data)
+                func_process(me->bt, (char*)cn->nethandle, data, len);
         }
     }
 
     return 1;
 }
-
@@ -0,0 +1,140 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bitfield.h"
+
+/* not a multiple of a word, or of SSE2's sixteen bytes */
+#define NBITS 301
+
+static bitfield_t* __pattern(unsigned int nbits, unsigned int seed)
+{
+    bitfield_t* bf = bitfield_new(nbits);
+    unsigned int i;
+
+    for (i = 0; i < nbits; i++)
+        if ((i * seed + i / 7) % 3 == 0)
+            bitfield_mark(bf, i);
+    return bf;
+}
+
+void TestBitfield_and_andnot_or_match_bit_by_bit(
+    CuTest * tc
+)
+{
+    bitfield_t *a = __pattern(NBITS, 5), *b = __pattern(NBITS, 11),
+               *and = __pattern(NBITS, 5), *andnot = __pattern(NBITS, 5),
+               *or = __pattern(NBITS, 5);
+    unsigned int i;
+
+    bitfield_and(and, b);
+    bitfield_andnot(andnot, b);
+    bitfield_or(or, b);
+    for (i = 0; i < NBITS; i++)
+    {
+        int x = bitfield_is_marked(a, i), y = bitfield_is_marked(b, i);
+
+        CuAssertTrue(tc, (x && y) == bitfield_is_marked(and, i));
+        CuAssertTrue(tc, (x && !y) == bitfield_is_marked(andnot, i));
+        CuAssertTrue(tc, (x || y) == bitfield_is_marked(or, i));
+    }
+    bitfield_free(a);
+    bitfield_free(b);
+    bitfield_free(and);
+    bitfield_free(andnot);
+    bitfield_free(or);
+}
+
+void TestBitfield_only_the_shared_bits_are_changed(
+    CuTest * tc
+)
+{
+    bitfield_t *a = bitfield_new(20), *b = bitfield_new(10);
+    unsigned int i;
+
+    for (i = 0; i < 20; i++)
+        bitfield_mark(a, i);
+    bitfield_and(a, b);
+    for (i = 0; i < 10; i++)
+        CuAssertTrue(tc, 0 == bitfield_is_marked(a, i));
+    for (; i < 20; i++)
+        CuAssertTrue(tc, 1 == bitfield_is_marked(a, i));
+
+    /* nor are bits past the end touched */
+    bitfield_mark(a, 3);
+    bitfield_or(b, a);
+    CuAssertTrue(tc, 1 == bitfield_count(b));
+    bitfield_free(a);
+    bitfield_free(b);
+}
+
+void TestBitfield_count_counts_marked_bits(
+    CuTest * tc
+)
+{
+    bitfield_t *a = __pattern(NBITS, 7);
+    unsigned int i, n = 0;
+
+    for (i = 0; i < NBITS; i++)
+        n += bitfield_is_marked(a, i);
+    CuAssertTrue(tc, n == bitfield_count(a));
+    bitfield_free(a);
+}
+
+void TestBitfield_next_set_finds_each_marked_bit(
+    CuTest * tc
+)
+{
+    bitfield_t *a = bitfield_new(NBITS);
+
+    CuAssertTrue(tc, -1 == bitfield_next_set(a, 0));
+    bitfield_mark(a, 0);
+    bitfield_mark(a, 9);
+    bitfield_mark(a, 200);
+    bitfield_mark(a, NBITS - 1);
+    CuAssertTrue(tc, 0 == bitfield_next_set(a, 0));
+    CuAssertTrue(tc, 9 == bitfield_next_set(a, 1));
+    CuAssertTrue(tc, 9 == bitfield_next_set(a, 9));
+    CuAssertTrue(tc, 200 == bitfield_next_set(a, 10));
+    CuAssertTrue(tc, NBITS - 1 == bitfield_next_set(a, 201));
+    CuAssertTrue(tc, -1 == bitfield_next_set(a, NBITS));
+    bitfield_free(a);
+}
+
+typedef struct
+{
+    unsigned int bits[NBITS];
+    unsigned int n;
+} __seen_t;
+
+static void __see(void* udata, unsigned int bit)
+{
+    __seen_t* s = udata;
+
+    s->bits[s->n++] = bit;
+}
+
+void TestBitfield_forall_set_runs_over_marked_bits_in_order(
+    CuTest * tc
+)
+{
+    bitfield_t *a = __pattern(NBITS, 3);
+    __seen_t s;
+    unsigned int i;
+    int j;
+
+    s.n = 0;
+    bitfield_forall_set(a, &s, __see);
+    CuAssertTrue(tc, bitfield_count(a) == s.n);
+    for (i = 0, j = bitfield_next_set(a, 0); i < s.n;
+         i++, j = bitfield_next_set(a, j + 1))
+        CuAssertTrue(tc, (int)s.bits[i] == j);
+    CuAssertTrue(tc, -1 == j);
+    bitfield_free(a);
+}
@@ -78,3 +78,57 @@ void TestBT_blacklist_after_adding_peer_as_potentially_is_recognised_as_potentia
     CuAssertTrue(tc, 1 == bt_blacklist_peer_is_potentially_blacklisted(b,(void*)1,(void*)2));
 }
 
+
+void TestBT_blacklist_counts_pieces_per_peer(
+    CuTest * tc
+)
+{
+    void *b;
+
+    b = bt_blacklist_new();
+
+    CuAssertTrue(tc, 0 == bt_blacklist_get_npieces_for_peer(b,(void*)2));
+    bt_blacklist_add_peer(b,(void*)9,(void*)2);
+    bt_blacklist_add_peer(b,(void*)1,(void*)2);
+    bt_blacklist_add_peer(b,(void*)5,(void*)2);
+    bt_blacklist_add_peer(b,(void*)1,(void*)2);
+    CuAssertTrue(tc, 3 == bt_blacklist_get_npieces_for_peer(b,(void*)2));
+    CuAssertTrue(tc, 1 == bt_blacklist_peer_is_blacklisted(b,(void*)5,(void*)2));
+    CuAssertTrue(tc, 0 == bt_blacklist_peer_is_blacklisted(b,(void*)4,(void*)2));
+    CuAssertTrue(tc, 0 == bt_blacklist_peer_is_blacklisted(b,(void*)5,(void*)3));
+}
+
+void TestBT_blacklist_removed_peer_is_no_longer_blacklisted(
+    CuTest * tc
+)
+{
+    void *b;
+
+    b = bt_blacklist_new();
+
+    bt_blacklist_add_peer(b,(void*)1,(void*)2);
+    bt_blacklist_add_peer(b,(void*)1,(void*)3);
+    bt_blacklist_remove_peer(b,(void*)2);
+    CuAssertTrue(tc, 0 == bt_blacklist_peer_is_blacklisted(b,(void*)1,(void*)2));
+    CuAssertTrue(tc, 0 == bt_blacklist_get_npieces_for_peer(b,(void*)2));
+    CuAssertTrue(tc, 1 == bt_blacklist_peer_is_blacklisted(b,(void*)1,(void*)3));
+}
+
+void TestBT_blacklist_banned_addr_is_recognised(
+    CuTest * tc
+)
+{
+    void *b;
+    unsigned char a1[BT_BLACKLIST_ADDR_LEN], a2[BT_BLACKLIST_ADDR_LEN];
+
+    b = bt_blacklist_new();
+
+    memset(a1, 1, sizeof(a1));
+    memset(a2, 2, sizeof(a2));
+    CuAssertTrue(tc, 0 == bt_blacklist_addr_is_banned(b, a1));
+    bt_blacklist_ban_addr(b, a1);
+    bt_blacklist_ban_addr(b, a1);
+    CuAssertTrue(tc, 1 == bt_blacklist_get_nbanned(b));
+    CuAssertTrue(tc, 1 == bt_blacklist_addr_is_banned(b, a1));
+    CuAssertTrue(tc, 0 == bt_blacklist_addr_is_banned(b, a2));
+}
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "bt.h"
+#include "bt_util.h"
 
 #include "sha1.h"
 
@@ -37,3 +38,52 @@ void TestBT_GeneratedPeeridIs20BytesLong(
 
     CuAssertTrue(tc, 20 == strlen(peerid));
 }
+
+void TestBT_addr_pack_maps_ipv4_into_ipv6(
+    CuTest * tc
+    )
+{
+    unsigned char addr[BT_PEER_ADDR_LEN];
+    unsigned char expected[BT_PEER_ADDR_LEN] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 10, 0, 0, 1, 0x1a, 0xe1 };
+    char str[64];
+
+    CuAssertTrue(tc, 1 == bt_addr_pack(addr, "10.0.0.1", 8, 6881));
+    CuAssertTrue(tc, 0 == memcmp(addr, expected, BT_PEER_ADDR_LEN));
+    CuAssertStrEquals(tc, "10.0.0.1:6881",
+                      bt_addr_format(addr, str, sizeof(str)));
+}
+
+void TestBT_addr_pack_takes_ipv6(
+    CuTest * tc
+    )
+{
+    unsigned char addr[BT_PEER_ADDR_LEN];
+    char str[64];
+
+    CuAssertTrue(tc, 1 == bt_addr_pack(addr, "[2001:db8::1]", 13, 80));
+    CuAssertStrEquals(tc, "[2001:db8::1]:80",
+                      bt_addr_format(addr, str, sizeof(str)));
+}
+
+void TestBT_addr_pack_rejects_host_names(
+    CuTest * tc
+    )
+{
+    unsigned char addr[BT_PEER_ADDR_LEN];
+
+    CuAssertTrue(tc, 0 == bt_addr_pack(addr, "example.org", 11, 80));
+    /* only the first ip_len bytes are read */
+    CuAssertTrue(tc, 0 == bt_addr_pack(addr, "10.0.0.1", 6, 80));
+}
+
+void TestBT_pow2_shift_only_takes_powers_of_two(
+    CuTest * tc
+    )
+{
+    CuAssertTrue(tc, 0 == bt_pow2_shift(1));
+    CuAssertTrue(tc, BT_BLOCK_SHIFT == bt_pow2_shift(BT_BLOCK_SIZE));
+    CuAssertTrue(tc, 31 == bt_pow2_shift(1u << 31));
+    CuAssertTrue(tc, -1 == bt_pow2_shift(0));
+    CuAssertTrue(tc, -1 == bt_pow2_shift(3 * (BT_BLOCK_SIZE)));
+}
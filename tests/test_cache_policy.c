@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_cache_policy.h"
+
+void TestBT_cache_policy_lru_evicts_least_recently_used(CuTest * tc)
+{
+    const bt_cache_policy_i* ip = bt_cache_policy_lru();
+    bt_cache_entry_t e[3];
+    void *p;
+
+    memset(e, 0, sizeof(e));
+    p = ip->new(3);
+    ip->touch(p, &e[0]);
+    ip->touch(p, &e[1]);
+    ip->touch(p, &e[2]);
+    ip->touch(p, &e[0]);
+    CuAssertTrue(tc, 3 == ip->count(p));
+    CuAssertTrue(tc, &e[1] == ip->evict(p));
+    CuAssertTrue(tc, &e[2] == ip->evict(p));
+    CuAssertTrue(tc, &e[0] == ip->evict(p));
+    CuAssertTrue(tc, NULL == ip->evict(p));
+    ip->free(p);
+}
+
+void TestBT_cache_policy_removed_entry_is_not_evicted(CuTest * tc)
+{
+    const bt_cache_policy_i* ip = bt_cache_policy_arc();
+    bt_cache_entry_t e[2];
+    void *p;
+
+    memset(e, 0, sizeof(e));
+    p = ip->new(2);
+    ip->touch(p, &e[0]);
+    ip->touch(p, &e[1]);
+    ip->remove(p, &e[0]);
+    CuAssertTrue(tc, 1 == ip->count(p));
+    CuAssertTrue(tc, &e[1] == ip->evict(p));
+    CuAssertTrue(tc, NULL == ip->evict(p));
+    ip->free(p);
+}
+
+void TestBT_cache_policy_arc_scan_doesnt_evict_hot_entries(CuTest * tc)
+{
+    const bt_cache_policy_i* ip = bt_cache_policy_arc();
+    bt_cache_entry_t hot[2], scan[20];
+    void *p;
+    int i;
+
+    memset(hot, 0, sizeof(hot));
+    memset(scan, 0, sizeof(scan));
+    p = ip->new(4);
+
+    /* used twice, so they're frequent */
+    for (i = 0; i < 2; i++)
+    {
+        ip->touch(p, &hot[i]);
+        ip->touch(p, &hot[i]);
+    }
+
+    /* one pass over lots of entries, holding the cache at 4 */
+    for (i = 0; i < 20; i++)
+    {
+        ip->touch(p, &scan[i]);
+        if (4 < ip->count(p))
+        {
+            bt_cache_entry_t* e = ip->evict(p);
+            CuAssertTrue(tc, e != &hot[0] && e != &hot[1]);
+        }
+    }
+    ip->free(p);
+}
+
+void TestBT_cache_policy_arc_ghost_hit_makes_entry_frequent(CuTest * tc)
+{
+    const bt_cache_policy_i* ip = bt_cache_policy_arc();
+    bt_cache_entry_t e[3];
+    void *p;
+
+    memset(e, 0, sizeof(e));
+    p = ip->new(2);
+    ip->touch(p, &e[0]);
+    ip->touch(p, &e[1]);
+    CuAssertTrue(tc, &e[0] == ip->evict(p));
+    CuAssertTrue(tc, 1 == ip->count(p));
+
+    /* back from history */
+    ip->touch(p, &e[0]);
+    CuAssertTrue(tc, 2 == ip->count(p));
+    ip->touch(p, &e[2]);
+
+    /* recency entries go first */
+    CuAssertTrue(tc, &e[1] == ip->evict(p));
+    ip->free(p);
+}
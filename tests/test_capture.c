@@ -0,0 +1,277 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "pwp_handshaker.h"
+
+#include "bt.h"
+#include "bt_capture.h"
+#include "bt_session.h"
+
+#define CAPTURE_PATH "test_capture.tmp"
+
+typedef struct
+{
+    /* what the replay saw, one letter and id per callback */
+    char log[256];
+    char data[256];
+    unsigned int ndata;
+    int port;
+    char ip[32];
+
+    /* process_data refuses once this many bytes are in */
+    unsigned int refuse_after;
+
+    unsigned long long last_us;
+    int times_went_backwards;
+} replay_t;
+
+static void __log(replay_t* r, char what, void* nethandle)
+{
+    sprintf(r->log + strlen(r->log), "%c%lu", what,
+            (unsigned long)(uintptr_t)nethandle);
+}
+
+static int __data(void *caller, void* nethandle, const char* buf,
+                  unsigned int len)
+{
+    replay_t* r = caller;
+
+    __log(r, 'D', nethandle);
+    memcpy(r->data + r->ndata, buf, len);
+    r->ndata += len;
+    return !r->refuse_after || r->ndata < r->refuse_after;
+}
+
+static int __connected(void *caller, void* nethandle, char *ip, int port)
+{
+    replay_t* r = caller;
+
+    __log(r, 'C', nethandle);
+    strcpy(r->ip, ip);
+    r->port = port;
+    return 1;
+}
+
+static void __failed(void *caller, void* nethandle)
+{
+    __log(caller, 'X', nethandle);
+}
+
+static void __time(void *caller, unsigned long long us)
+{
+    replay_t* r = caller;
+
+    if (us < r->last_us)
+        r->times_went_backwards = 1;
+    r->last_us = us;
+}
+
+static bt_capture_replay_i __irep = {
+    .process_data = __data,
+    .process_connection = __connected,
+    .connection_failed = __failed,
+    .record_time = __time
+};
+
+void TestBT_capture_replays_connections_in_order(
+    CuTest * tc
+)
+{
+    void *c = bt_capture_open(CAPTURE_PATH);
+    replay_t r;
+
+    CuAssertPtrNotNull(tc, c);
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_data(c, (void*)100, "hello", 5);
+    bt_capture_connection(c, (void*)200, "10.0.0.2", 6882);
+    bt_capture_data(c, (void*)200, "abc", 3);
+    bt_capture_data(c, (void*)100, " world", 6);
+    bt_capture_disconnection(c, (void*)100);
+    bt_capture_close(c);
+
+    memset(&r, 0, sizeof(replay_t));
+    CuAssertTrue(tc, 6 == bt_capture_replay(CAPTURE_PATH, &__irep, &r));
+
+    /* handles are replaced by ids in order of connection */
+    CuAssertStrEquals(tc, "C1D1C2D2D1X1", r.log);
+    CuAssertTrue(tc, 14 == r.ndata);
+    CuAssertTrue(tc, 0 == memcmp(r.data, "helloabc world", 14));
+    CuAssertStrEquals(tc, "10.0.0.2", r.ip);
+    CuAssertTrue(tc, 6882 == r.port);
+    CuAssertTrue(tc, 0 == r.times_went_backwards);
+    remove(CAPTURE_PATH);
+}
+
+void TestBT_capture_ignores_handles_it_wasnt_told_about(
+    CuTest * tc
+)
+{
+    void *c = bt_capture_open(CAPTURE_PATH);
+    replay_t r;
+
+    bt_capture_data(c, (void*)100, "hello", 5);
+    bt_capture_disconnection(c, (void*)100);
+    bt_capture_close(c);
+
+    memset(&r, 0, sizeof(replay_t));
+    CuAssertTrue(tc, 0 == bt_capture_replay(CAPTURE_PATH, &__irep, &r));
+    CuAssertStrEquals(tc, "", r.log);
+    remove(CAPTURE_PATH);
+}
+
+void TestBT_capture_reused_handle_is_a_new_connection(
+    CuTest * tc
+)
+{
+    void *c = bt_capture_open(CAPTURE_PATH);
+    replay_t r;
+
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_disconnection(c, (void*)100);
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_data(c, (void*)100, "x", 1);
+
+    /* we weren't told the first one went */
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_close(c);
+
+    memset(&r, 0, sizeof(replay_t));
+    CuAssertTrue(tc, 6 == bt_capture_replay(CAPTURE_PATH, &__irep, &r));
+    CuAssertStrEquals(tc, "C1X1C2D2X2C3", r.log);
+    remove(CAPTURE_PATH);
+}
+
+void TestBT_capture_dropped_connection_gets_no_more_data(
+    CuTest * tc
+)
+{
+    void *c = bt_capture_open(CAPTURE_PATH);
+    replay_t r;
+
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_data(c, (void*)100, "abc", 3);
+    bt_capture_data(c, (void*)100, "def", 3);
+    bt_capture_data(c, (void*)100, "ghi", 3);
+    bt_capture_disconnection(c, (void*)100);
+    bt_capture_close(c);
+
+    memset(&r, 0, sizeof(replay_t));
+    r.refuse_after = 6;
+    bt_capture_replay(CAPTURE_PATH, &__irep, &r);
+
+    /* the replay drops it, and it isn't dropped twice */
+    CuAssertStrEquals(tc, "C1D1D1X1", r.log);
+    CuAssertTrue(tc, 6 == r.ndata);
+    remove(CAPTURE_PATH);
+}
+
+void TestBT_capture_truncated_record_is_ignored(
+    CuTest * tc
+)
+{
+    void *c = bt_capture_open(CAPTURE_PATH);
+    char buf[256];
+    replay_t r;
+    FILE* fp;
+    size_t len;
+
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_data(c, (void*)100, "hello", 5);
+    bt_capture_close(c);
+
+    /* cut the data record short, as if we had died writing it */
+    fp = fopen(CAPTURE_PATH, "rb");
+    len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    fp = fopen(CAPTURE_PATH, "wb");
+    fwrite(buf, 1, len - 2, fp);
+    fclose(fp);
+
+    memset(&r, 0, sizeof(replay_t));
+    CuAssertTrue(tc, 1 == bt_capture_replay(CAPTURE_PATH, &__irep, &r));
+    CuAssertStrEquals(tc, "C1", r.log);
+    remove(CAPTURE_PATH);
+}
+
+void TestBT_capture_replay_of_other_file_fails(
+    CuTest * tc
+)
+{
+    FILE* fp = fopen(CAPTURE_PATH, "wb");
+    replay_t r;
+
+    fputs("not a capture", fp);
+    fclose(fp);
+    memset(&r, 0, sizeof(replay_t));
+    CuAssertTrue(tc, -1 == bt_capture_replay(CAPTURE_PATH, &__irep, &r));
+    remove(CAPTURE_PATH);
+    CuAssertTrue(tc, -1 == bt_capture_replay(CAPTURE_PATH, &__irep, &r));
+}
+
+static int __mock_send(void* me, void **udata, void* conn_ctx,
+                       const char *send_data, const int len)
+{
+    return 1;
+}
+
+static int __handshake(char* buf, const char* infohash)
+{
+    buf[0] = 19;
+    memcpy(buf + 1, "BitTorrent protocol", 19);
+    memset(buf + 20, 0, 8);
+    memcpy(buf + 28, infohash, 20);
+    memcpy(buf + 48, "-XX0001-000000000000", 20);
+    return 68;
+}
+
+static void __session_failed(void *caller, void* nethandle)
+{
+    bt_session_peer_disconnect(caller, nethandle);
+}
+
+void TestBT_capture_replays_into_session(
+    CuTest * tc
+)
+{
+    void *c = bt_capture_open(CAPTURE_PATH);
+    void *s = bt_session_new(), *dm = bt_dm_new();
+    char hs[68];
+    int len = __handshake(hs, "aaaaaaaaaaaaaaaaaaaa");
+
+    /* the handshake arrives in pieces */
+    bt_capture_connection(c, (void*)100, "10.0.0.1", 6881);
+    bt_capture_data(c, (void*)100, hs, 10);
+    bt_capture_data(c, (void*)100, hs + 10, len - 10);
+    bt_capture_close(c);
+
+    config_set(bt_dm_get_config(dm), "infohash", "aaaaaaaaaaaaaaaaaaaa");
+    bt_dm_set_cbs(dm, &((bt_dm_cbs_t) {
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .peer_send = __mock_send
+                    }), NULL);
+    bt_session_add_torrent(s, dm);
+
+    CuAssertTrue(tc, 3 == bt_capture_replay(CAPTURE_PATH,
+                            &((bt_capture_replay_i) {
+                                .process_data =
+                                    bt_session_dispatch_from_buffer,
+                                .process_connection =
+                                    bt_session_peer_connect,
+                                .connection_failed = __session_failed
+                            }), s));
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(dm));
+    bt_session_free(s);
+    remove(CAPTURE_PATH);
+}
@@ -340,3 +340,73 @@ void TestBTleechingChoke_optimistically_unchoke_different(
     CuAssertTrue(tc, 0 == peers[2].isChoked);
     CuAssertTrue(tc, 1 == peers[3].isChoked);
 }
+
+void TestBTleechingChoke_unchokes_all_peers_when_there_are_few(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    peer_t peers[10];
+
+    __pset(&peers[0], 0, 100, 1);
+    __pset(&peers[1], 0, 50, 1);
+
+    cr = bt_leeching_choker_new(3);
+    bt_leeching_choker_set_choker_peer_iface(cr, NULL, &iface_choker_peer);
+    bt_leeching_choker_add_peer(cr, &peers[0]);
+    bt_leeching_choker_add_peer(cr, &peers[1]);
+    bt_leeching_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 0 == peers[0].isChoked);
+    CuAssertTrue(tc, 0 == peers[1].isChoked);
+}
+
+void TestBTleechingChoke_select_best_of_many_peers(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    peer_t peers[50];
+
+    /* rates are a shuffle of 0..49 */
+    for (i = 0; i < 50; i++)
+        __pset(&peers[i], 0, (i * 17) % 50, 1);
+
+    cr = bt_leeching_choker_new(4);
+    bt_leeching_choker_set_choker_peer_iface(cr, NULL, &iface_choker_peer);
+    for (i = 0; i < 50; i++)
+        bt_leeching_choker_add_peer(cr, &peers[i]);
+    bt_leeching_choker_decide_best_npeers(cr);
+
+    for (i = 0; i < 50; i++)
+        CuAssertTrue(tc, (46 <= peers[i].urate) == !peers[i].isChoked);
+}
+
+void TestBTleechingChoke_removed_peer_isnt_optimistically_unchoked(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    peer_t peers[10];
+
+    __pset(&peers[0], 0, 100, 1);
+    __pset(&peers[1], 0, 50, 1);
+    __pset(&peers[2], 0, 10, 1);
+
+    cr = bt_leeching_choker_new(2);
+    bt_leeching_choker_set_choker_peer_iface(cr, NULL, &iface_choker_peer);
+    bt_leeching_choker_add_peer(cr, &peers[0]);
+    bt_leeching_choker_add_peer(cr, &peers[1]);
+    bt_leeching_choker_add_peer(cr, &peers[2]);
+    bt_leeching_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 1 == peers[2].isChoked);
+
+    bt_leeching_choker_remove_peer(cr, &peers[2]);
+    bt_leeching_choker_optimistically_unchoke(cr);
+    CuAssertTrue(tc, 0 == peers[0].isChoked);
+    CuAssertTrue(tc, 0 == peers[1].isChoked);
+    CuAssertTrue(tc, 1 == peers[2].isChoked);
+}
@@ -136,7 +136,7 @@ void TestBTSeedingChoker_remove_peer(
     CuAssertTrue(tc, 0 == bt_seeding_choker_get_npeers(cr));
 }
 
-void TestBTSeedingChoker_decide_unchokes_interested_choked(
+void TestBTSeedingChoker_decide_keeps_fastest_and_rotates_waiting_peer(
     CuTest * tc
 )
 {
@@ -144,9 +144,9 @@ void TestBTSeedingChoker_decide_unchokes_interested_choked(
 
     peer_t peers[10];
 
-    __pset(&peers[0], 0, 100, 1, 1);
-    __pset(&peers[1], 0, 50, 1, 1);
-    __pset(&peers[2], 0, 200, 1, 1);
+    __pset(&peers[0], 0, 10000, 1, 1);
+    __pset(&peers[1], 0, 6000, 1, 1);
+    __pset(&peers[2], 0, 1000, 1, 1);
     __pset(&peers[3], 0, 10, 1, 1);
 
     cr = bt_seeding_choker_new(3);
@@ -158,23 +158,99 @@ void TestBTSeedingChoker_decide_unchokes_interested_choked(
     bt_seeding_choker_unchoke_peer(cr, &peers[0]);
     bt_seeding_choker_unchoke_peer(cr, &peers[1]);
     bt_seeding_choker_unchoke_peer(cr, &peers[2]);
-    /* the unchoked and interested remote peers are ordered according to the
-     * time they were last unchoked, most recently unchoked peers first.
-     * The 3 first peers are kept unchoked and an additional 4th peer that is
-     * choked and interested is selected at random and unchoked.*/
-    bt_seeding_choker_decide_best_npeers(cr);
 
-//    printf("%d,%d,%d,%d\n", peers[0].isChoked, peers[1].isChoked,
-//           peers[2].isChoked, peers[3].isChoked);
+    /* the two fastest keep their slots; the slowest makes way for the
+     * peer that has been waiting */
+    bt_seeding_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 0 == peers[0].isChoked);
+    CuAssertTrue(tc, 0 == peers[1].isChoked);
+    CuAssertTrue(tc, 1 == peers[2].isChoked);
+    CuAssertTrue(tc, 0 == peers[3].isChoked);
+    CuAssertTrue(tc, 3 == bt_seeding_choker_get_nslots(cr));
 
-    CuAssertTrue(tc, 1 == peers[0].isChoked);
+    bt_seeding_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 0 == peers[0].isChoked);
     CuAssertTrue(tc, 0 == peers[1].isChoked);
     CuAssertTrue(tc, 0 == peers[2].isChoked);
-    CuAssertTrue(tc, 0 == peers[3].isChoked);
+    CuAssertTrue(tc, 1 == peers[3].isChoked);
+}
+
+void TestBTSeedingChoker_trickling_peers_dont_get_more_slots(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    peer_t peers[10];
+
+    cr = bt_seeding_choker_new(10);
+    bt_seeding_choker_set_choker_peer_iface(cr, NULL, &iface_choker_peer);
+    for (i = 0; i < 10; i++)
+    {
+        __pset(&peers[i], 0, 1500, 1, 1);
+        bt_seeding_choker_add_peer(cr, &peers[i]);
+        bt_seeding_choker_unchoke_peer(cr, &peers[i]);
+    }
 
+    bt_seeding_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 1 == bt_seeding_choker_get_nslots(cr));
+}
+
+void TestBTSeedingChoker_fast_peers_open_more_slots(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    peer_t peers[10];
+
+    cr = bt_seeding_choker_new(10);
+    bt_seeding_choker_set_choker_peer_iface(cr, NULL, &iface_choker_peer);
+    for (i = 0; i < 10; i++)
+    {
+        __pset(&peers[i], 0, i < 8 ? 100000 : 0, 1, 1);
+        bt_seeding_choker_add_peer(cr, &peers[i]);
+        if (i < 8)
+            bt_seeding_choker_unchoke_peer(cr, &peers[i]);
+    }
+
+    bt_seeding_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 9 == bt_seeding_choker_get_nslots(cr));
+    for (i = 0; i < 8; i++)
+        CuAssertTrue(tc, 0 == peers[i].isChoked);
+}
+
+void TestBTSeedingChoker_saturated_capacity_stops_slots(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    peer_t peers[10];
+
+    __pset(&peers[0], 0, 9500, 1, 1);
+    __pset(&peers[1], 0, 8000, 1, 1);
+
+    cr = bt_seeding_choker_new(5);
+    bt_seeding_choker_set_choker_peer_iface(cr, NULL, &iface_choker_peer);
+    bt_seeding_choker_set_upload_capacity(cr, 10000);
+    bt_seeding_choker_add_peer(cr, &peers[0]);
+    bt_seeding_choker_add_peer(cr, &peers[1]);
+    bt_seeding_choker_unchoke_peer(cr, &peers[0]);
+    bt_seeding_choker_unchoke_peer(cr, &peers[1]);
+
+    /* peer 0 alone takes over 90% of what we can upload, and the slot
+     * peer 1 had isn't given straight back */
     bt_seeding_choker_decide_best_npeers(cr);
     CuAssertTrue(tc, 0 == peers[0].isChoked);
     CuAssertTrue(tc, 1 == peers[1].isChoked);
-    CuAssertTrue(tc, 0 == peers[2].isChoked);
-    CuAssertTrue(tc, 0 == peers[3].isChoked);
+    CuAssertTrue(tc, 1 == bt_seeding_choker_get_nslots(cr));
+
+    /* peer 1 has waited a round, and rotates back in */
+    bt_seeding_choker_set_upload_capacity(cr, 0);
+    bt_seeding_choker_decide_best_npeers(cr);
+    CuAssertTrue(tc, 0 == peers[0].isChoked);
+    CuAssertTrue(tc, 0 == peers[1].isChoked);
 }
@@ -0,0 +1,92 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "chunkybar.h"
+
+void TestChunky_new_is_empty(
+    CuTest * tc
+)
+{
+    chunkybar_t *c;
+    unsigned int off, len;
+
+    c = chunky_new(100);
+    CuAssertTrue(tc, 0 == chunky_get_num_chunks(c));
+    CuAssertTrue(tc, 0 == chunky_is_complete(c));
+    CuAssertTrue(tc, 0 == chunky_have(c, 0, 1));
+    chunky_get_incomplete(c, &off, &len, 10);
+    CuAssertTrue(tc, 0 == off);
+    CuAssertTrue(tc, 10 == len);
+    chunky_free(c);
+}
+
+void TestChunky_touching_chunks_merge(
+    CuTest * tc
+)
+{
+    chunkybar_t *c;
+
+    c = chunky_new(100);
+    chunky_mark_complete(c, 50, 10);
+    chunky_mark_complete(c, 0, 10);
+    chunky_mark_complete(c, 20, 10);
+    CuAssertTrue(tc, 3 == chunky_get_num_chunks(c));
+    chunky_mark_complete(c, 10, 10);
+    CuAssertTrue(tc, 2 == chunky_get_num_chunks(c));
+    CuAssertTrue(tc, 1 == chunky_have(c, 5, 25));
+    CuAssertTrue(tc, 0 == chunky_have(c, 25, 10));
+    chunky_mark_complete(c, 25, 75);
+    CuAssertTrue(tc, 1 == chunky_get_num_chunks(c));
+    CuAssertTrue(tc, 1 == chunky_is_complete(c));
+    CuAssertTrue(tc, 100 == chunky_get_nbytes_completed(c));
+    chunky_free(c);
+}
+
+void TestChunky_mark_incomplete_splits_chunk(
+    CuTest * tc
+)
+{
+    chunkybar_t *c;
+    unsigned int off, len;
+
+    c = chunky_new(100);
+    chunky_mark_complete(c, 0, 100);
+    chunky_mark_incomplete(c, 40, 20);
+    CuAssertTrue(tc, 2 == chunky_get_num_chunks(c));
+    CuAssertTrue(tc, 1 == chunky_have(c, 0, 40));
+    CuAssertTrue(tc, 0 == chunky_have(c, 40, 1));
+    CuAssertTrue(tc, 1 == chunky_have(c, 60, 40));
+    chunky_get_incomplete(c, &off, &len, 100);
+    CuAssertTrue(tc, 40 == off);
+    CuAssertTrue(tc, 20 == len);
+    chunky_mark_all_incomplete(c);
+    CuAssertTrue(tc, 0 == chunky_get_num_chunks(c));
+    chunky_free(c);
+}
+
+void TestChunky_many_fragments(
+    CuTest * tc
+)
+{
+    chunkybar_t *c;
+    unsigned int i;
+
+    c = chunky_new(200000);
+    for (i = 0; i < 200000; i += 2)
+        chunky_mark_complete(c, i, 1);
+    CuAssertTrue(tc, 100000 == chunky_get_num_chunks(c));
+    for (i = 0; i < 200000; i += 2)
+        CuAssertTrue(tc, 1 == chunky_have(c, i, 1) &&
+                     0 == chunky_have(c, i + 1, 1));
+    for (i = 1; i < 200000; i += 2)
+        chunky_mark_complete(c, i, 1);
+    CuAssertTrue(tc, 1 == chunky_is_complete(c));
+    chunky_free(c);
+}
@@ -0,0 +1,550 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "bt.h"
+#include "bt_diskcache.h"
+
+#define PIECE_LEN 100
+#define NPIECES 10
+
+typedef struct
+{
+    char data[NPIECES * PIECE_LEN];
+    int writes;
+    int reads;
+    /* calls to write_blocks, and whether their blocks were in order */
+    int batches;
+    int unordered;
+} mockdisk_t;
+
+static int __mock_disk_write_block(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk,
+    const void *blkdata
+    )
+{
+    mockdisk_t *md = udata;
+
+    memcpy(md->data + blk->piece_idx * PIECE_LEN + blk->offset,
+           blkdata, blk->len);
+    md->writes++;
+    return 1;
+}
+
+static void *__mock_disk_read_block(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    )
+{
+    mockdisk_t *md = udata;
+
+    md->reads++;
+    return md->data + blk->piece_idx * PIECE_LEN + blk->offset;
+}
+
+static int __mock_disk_write_blocks(
+    void *udata,
+    void *caller,
+    const bt_block_t * blks,
+    const void **data,
+    int n
+    )
+{
+    mockdisk_t *md = udata;
+    int i;
+
+    md->batches++;
+    for (i = 0; i < n; i++)
+    {
+        if (0 < i && blks[i].piece_idx < blks[i - 1].piece_idx)
+            md->unordered = 1;
+        __mock_disk_write_block(udata, caller, &blks[i], data[i]);
+    }
+    return 1;
+}
+
+static bt_blockrw_i __mock_disk_rw = {
+    .read_block = __mock_disk_read_block,
+    .write_block = __mock_disk_write_block
+};
+
+static bt_blockrw_i __mock_disk_batch_rw = {
+    .read_block = __mock_disk_read_block,
+    .write_block = __mock_disk_write_block,
+    .write_blocks = __mock_disk_write_blocks
+};
+
+static void* __cache_new(mockdisk_t* md, const char* write_bytes,
+                         const char* read_bytes)
+{
+    void *dc;
+
+    memset(md, 0, sizeof(mockdisk_t));
+    dc = bt_diskcache_new();
+    bt_diskcache_set_size(dc, PIECE_LEN);
+    bt_diskcache_set_disk_blockrw(dc, &__mock_disk_rw, md);
+    config_set(bt_diskcache_get_config(dc), "diskcache_write_bytes",
+               write_bytes);
+    config_set(bt_diskcache_get_config(dc), "diskcache_read_bytes",
+               read_bytes);
+    config_set(bt_diskcache_get_config(dc), "diskcache_high_watermark", "100");
+    config_set(bt_diskcache_get_config(dc), "diskcache_low_watermark", "50");
+    return dc;
+}
+
+static void __write(void* dc, int piece_idx, const char* msg)
+{
+    bt_block_t b = { .piece_idx = piece_idx, .offset = 0, .len = 10 };
+
+    bt_diskcache_get_blockrw(dc)->write_block(dc, NULL, &b, msg);
+}
+
+void TestBTDiskcache_writes_stay_in_memory_within_budget(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "0");
+
+    __write(dc, 0, "0123456789");
+    __write(dc, 1, "0123456789");
+    __write(dc, 2, "0123456789");
+    __write(dc, 3, "0123456789");
+    CuAssertTrue(tc, 0 == md.writes);
+    CuAssertTrue(tc, 400 == bt_diskcache_get_dirty_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_passing_high_watermark_flushes_to_low_watermark(
+    CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "0");
+
+    __write(dc, 0, "0123456789");
+    __write(dc, 1, "0123456789");
+    __write(dc, 2, "0123456789");
+    __write(dc, 3, "0123456789");
+    __write(dc, 4, "0123456789");
+    CuAssertTrue(tc, 3 == md.writes);
+    CuAssertTrue(tc, 200 == bt_diskcache_get_dirty_bytes(dc));
+    CuAssertTrue(tc, 0 == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_flushed_pieces_are_kept_within_read_budget(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "200");
+
+    __write(dc, 0, "0123456789");
+    __write(dc, 1, "0123456789");
+    __write(dc, 2, "0123456789");
+    __write(dc, 3, "0123456789");
+    __write(dc, 4, "0123456789");
+    CuAssertTrue(tc, 3 == md.writes);
+    CuAssertTrue(tc, bt_diskcache_get_clean_bytes(dc) <= 200);
+    CuAssertTrue(tc, 0 < bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_read_miss_copies_piece_from_disk(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "200");
+    bt_block_t b = { .piece_idx = 2, .offset = 10, .len = 10 };
+    char *data;
+
+    memcpy(md.data + 2 * PIECE_LEN + 10, "abcdefghij", 10);
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, NULL != data);
+    CuAssertTrue(tc, 0 == strncmp(data, "abcdefghij", 10));
+    CuAssertTrue(tc, data != md.data + 2 * PIECE_LEN + 10);
+    CuAssertTrue(tc, 100 == bt_diskcache_get_clean_bytes(dc));
+
+    /* now it's cached */
+    bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 1 == md.reads);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_read_budget_evicts_clean_pieces(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "200");
+    bt_block_t b = { .piece_idx = 0, .offset = 0, .len = 10 };
+    int i;
+
+    for (i = 0; i < 5; i++)
+    {
+        b.piece_idx = i;
+        CuAssertTrue(tc, NULL !=
+                     bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b));
+    }
+    CuAssertTrue(tc, 5 == md.reads);
+    CuAssertTrue(tc, bt_diskcache_get_clean_bytes(dc) <= 200);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_counts_hits_misses_and_evictions(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "200");
+    bt_block_t b = { .piece_idx = 0, .offset = 0, .len = 10 };
+    bt_cache_stats_t s;
+    int i;
+
+    for (i = 0; i < 5; i++)
+    {
+        b.piece_idx = i;
+        bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+        bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    }
+    bt_diskcache_get_blockrw(dc)->get_cache_stats(dc, &s);
+    CuAssertTrue(tc, 5 == s.misses);
+    CuAssertTrue(tc, 5 == s.hits);
+    CuAssertTrue(tc, 0 < s.evictions);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_rewriting_flushed_piece_keeps_earlier_blocks(
+    CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "0");
+    bt_block_t b = { .piece_idx = 0, .offset = 10, .len = 10 };
+
+    __write(dc, 0, "0123456789");
+    bt_diskcache_disk_dump(dc);
+    CuAssertTrue(tc, 0 == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_get_blockrw(dc)->write_block(dc, NULL, &b, "abcdefghij");
+    bt_diskcache_disk_dump(dc);
+    CuAssertTrue(tc, 0 == strncmp(md.data, "0123456789abcdefghij", 20));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_write_behind_writes_evicted_pieces(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "0");
+    int i;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_write_behind", "1");
+    for (i = 0; i < NPIECES; i++)
+        __write(dc, i, "0123456789");
+    CuAssertTrue(tc, bt_diskcache_get_dirty_bytes(dc) <= 400);
+    bt_diskcache_disk_dump(dc);
+    CuAssertTrue(tc, NPIECES == md.writes);
+    CuAssertTrue(tc, 0 == bt_diskcache_get_dirty_bytes(dc));
+    for (i = 0; i < NPIECES; i++)
+        CuAssertTrue(tc, 0 == strncmp(md.data + i * PIECE_LEN,
+                                      "0123456789", 10));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_write_behind_rewrite_waits_for_flush(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 0, .offset = 10, .len = 10 };
+    int i;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_write_behind", "1");
+    for (i = 0; i < 5; i++)
+        __write(dc, i, "0123456789");
+    bt_diskcache_get_blockrw(dc)->write_block(dc, NULL, &b, "abcdefghij");
+    bt_diskcache_disk_dump(dc);
+    CuAssertTrue(tc, 0 == strncmp(md.data, "0123456789abcdefghij", 20));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_read_miss_only_loads_the_frame(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 20, .len = 10 };
+    char *data;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    memcpy(md.data + PIECE_LEN + 20, "abcdefghij", 10);
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 0 == strncmp(data, "abcdefghij", 10));
+    CuAssertTrue(tc, 10 == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 1 == md.reads);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_sequential_reads_load_whole_piece(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 20, .len = 10 };
+    char *data;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    memcpy(md.data + PIECE_LEN + 30, "abcdefghij", 10);
+    bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    b.offset = 30;
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 0 == strncmp(data, "abcdefghij", 10));
+    CuAssertTrue(tc, PIECE_LEN == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_reading_whole_piece_bypasses_frames(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = PIECE_LEN };
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, PIECE_LEN == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_prefetched_frame_is_read_without_disk_io(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 20, .len = 10 };
+    char *data;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    config_set(bt_diskcache_get_config(dc), "diskcache_read_ahead", "1");
+    memcpy(md.data + PIECE_LEN + 20, "abcdefghij", 10);
+    CuAssertTrue(tc, 1 ==
+                 bt_diskcache_get_blockrw(dc)->prefetch_block(dc, NULL, &b));
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 0 == strncmp(data, "abcdefghij", 10));
+    CuAssertTrue(tc, 1 == md.reads);
+    CuAssertTrue(tc, 10 == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_prefetched_piece_is_read_without_disk_io(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 20, .len = 10 };
+    char *data;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "0");
+    config_set(bt_diskcache_get_config(dc), "diskcache_read_ahead", "1");
+    memcpy(md.data + PIECE_LEN + 20, "abcdefghij", 10);
+    CuAssertTrue(tc, 1 ==
+                 bt_diskcache_get_blockrw(dc)->prefetch_block(dc, NULL, &b));
+    CuAssertTrue(tc, 1 ==
+                 bt_diskcache_get_blockrw(dc)->prefetch_block(dc, NULL, &b));
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 0 == strncmp(data, "abcdefghij", 10));
+    CuAssertTrue(tc, 1 == md.reads);
+    CuAssertTrue(tc, PIECE_LEN == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_prefetch_is_off_by_default(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 20, .len = 10 };
+
+    CuAssertTrue(tc, 0 ==
+                 bt_diskcache_get_blockrw(dc)->prefetch_block(dc, NULL, &b));
+    CuAssertTrue(tc, 0 == md.reads);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_disk_dump_writes_pieces_in_one_batch(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "1000", "0");
+
+    bt_diskcache_set_disk_blockrw(dc, &__mock_disk_batch_rw, &md);
+    __write(dc, 3, "3333333333");
+    __write(dc, 1, "1111111111");
+    __write(dc, 2, "2222222222");
+    bt_diskcache_disk_dump(dc);
+    CuAssertTrue(tc, 1 == md.batches);
+    CuAssertTrue(tc, 0 == md.unordered);
+    CuAssertTrue(tc, 3 == md.writes);
+    CuAssertTrue(tc, 0 == strncmp(md.data + 2 * PIECE_LEN, "2222222222", 10));
+    CuAssertTrue(tc, 0 == bt_diskcache_get_dirty_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_trimming_writes_evicted_pieces_in_order(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "0");
+
+    bt_diskcache_set_disk_blockrw(dc, &__mock_disk_batch_rw, &md);
+    __write(dc, 4, "0123456789");
+    __write(dc, 0, "0123456789");
+    __write(dc, 3, "0123456789");
+    __write(dc, 1, "0123456789");
+    __write(dc, 2, "0123456789");
+    CuAssertTrue(tc, 1 == md.batches);
+    CuAssertTrue(tc, 0 == md.unordered);
+    CuAssertTrue(tc, 3 == md.writes);
+    CuAssertTrue(tc, 200 == bt_diskcache_get_dirty_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_write_frame_is_written_without_a_copy(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "200");
+    bt_blockrw_i *irw = bt_diskcache_get_blockrw(dc);
+    bt_block_t b = { .piece_idx = 1, .offset = 10, .len = 10 };
+    char *frame;
+
+    frame = irw->get_write_frame(dc, NULL, &b);
+    CuAssertTrue(tc, NULL != frame);
+    memcpy(frame, "0123456789", 10);
+    CuAssertTrue(tc, 1 == irw->write_block(dc, NULL, &b, frame));
+    CuAssertTrue(tc, 100 == bt_diskcache_get_dirty_bytes(dc));
+    CuAssertTrue(tc, frame == irw->read_block(dc, NULL, &b));
+    CuAssertTrue(tc, 0 == strncmp(frame, "0123456789", 10));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_lent_frame_keeps_piece_in_memory(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "100");
+    bt_blockrw_i *irw = bt_diskcache_get_blockrw(dc);
+    bt_block_t b = { .piece_idx = 0, .offset = 0, .len = 10 };
+    bt_block_t other = { .piece_idx = 0, .offset = 0, .len = PIECE_LEN };
+    char *frame;
+
+    frame = irw->get_write_frame(dc, NULL, &b);
+    other.piece_idx = 1;
+    irw->read_block(dc, NULL, &other);
+    other.piece_idx = 2;
+    irw->read_block(dc, NULL, &other);
+
+    memcpy(frame, "0123456789", 10);
+    irw->write_block(dc, NULL, &b, frame);
+    CuAssertTrue(tc, frame == irw->read_block(dc, NULL, &b));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_dropped_frame_lets_piece_be_evicted(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "100");
+    bt_blockrw_i *irw = bt_diskcache_get_blockrw(dc);
+    bt_block_t b = { .piece_idx = 0, .offset = 0, .len = 10 };
+    bt_block_t other = { .piece_idx = 0, .offset = 0, .len = PIECE_LEN };
+
+    irw->drop_write_frame(dc, NULL, &b, irw->get_write_frame(dc, NULL, &b));
+    other.piece_idx = 1;
+    irw->read_block(dc, NULL, &other);
+    other.piece_idx = 2;
+    irw->read_block(dc, NULL, &other);
+    CuAssertTrue(tc, bt_diskcache_get_clean_bytes(dc) <= 100);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_memory_limit_shrinks_budgets(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "0");
+    bt_blockrw_i *irw = bt_diskcache_get_blockrw(dc);
+    int writes;
+
+    __write(dc, 0, "0123456789");
+    __write(dc, 1, "0123456789");
+    __write(dc, 2, "0123456789");
+    __write(dc, 3, "0123456789");
+    CuAssertTrue(tc, 400 == irw->get_memory(dc));
+
+    /* written out straight away, not on the next write */
+    irw->set_memory_limit(dc, 200);
+    CuAssertTrue(tc, 0 < md.writes);
+    CuAssertTrue(tc, irw->get_memory(dc) <= 200);
+
+    /* the configured budget is back once the limit is lifted */
+    irw->set_memory_limit(dc, 0);
+    writes = md.writes;
+    __write(dc, 4, "0123456789");
+    __write(dc, 5, "0123456789");
+    CuAssertTrue(tc, writes == md.writes);
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_split_piece_only_holds_written_frames(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = 10 };
+    char *data;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    config_set(bt_diskcache_get_config(dc), "diskcache_split_piece_bytes",
+               "50");
+    __write(dc, 1, "0123456789");
+    CuAssertTrue(tc, 10 == bt_diskcache_get_dirty_bytes(dc));
+    CuAssertTrue(tc, 0 == md.writes);
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 0 == strncmp(data, "0123456789", 10));
+    CuAssertTrue(tc, 0 == md.reads);
+
+    bt_diskcache_disk_dump(dc);
+    CuAssertTrue(tc, 1 == md.writes);
+    CuAssertTrue(tc, 0 == strncmp(md.data + PIECE_LEN, "0123456789", 10));
+    CuAssertTrue(tc, 0 == bt_diskcache_get_dirty_bytes(dc));
+    CuAssertTrue(tc, 10 == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_reading_split_piece_whole_sees_its_frames(CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "400", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 20, .len = 10 };
+    char *data;
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    config_set(bt_diskcache_get_config(dc), "diskcache_split_piece_bytes",
+               "50");
+    __write(dc, 1, "0123456789");
+    bt_diskcache_get_blockrw(dc)->write_block(dc, NULL, &b, "abcdefghij");
+    CuAssertTrue(tc, 20 == bt_diskcache_get_dirty_bytes(dc));
+
+    b.offset = 0;
+    b.len = PIECE_LEN;
+    data = bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &b);
+    CuAssertTrue(tc, 2 == md.writes);
+    CuAssertTrue(tc, 0 == strncmp(data, "0123456789", 10));
+    CuAssertTrue(tc, 0 == strncmp(data + 20, "abcdefghij", 10));
+    CuAssertTrue(tc, 0 == bt_diskcache_get_dirty_bytes(dc));
+    CuAssertTrue(tc, PIECE_LEN == bt_diskcache_get_clean_bytes(dc));
+    bt_diskcache_free(dc);
+}
+
+void TestBTDiskcache_split_piece_frames_are_flushed_past_the_budget(
+    CuTest * tc)
+{
+    mockdisk_t md;
+    void *dc = __cache_new(&md, "20", "400");
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    config_set(bt_diskcache_get_config(dc), "diskcache_frame_bytes", "10");
+    config_set(bt_diskcache_get_config(dc), "diskcache_split_piece_bytes",
+               "50");
+    for (b.offset = 0; b.offset < 30; b.offset += 10)
+        bt_diskcache_get_blockrw(dc)->write_block(dc, NULL, &b, "0123456789");
+    CuAssertTrue(tc, 2 == md.writes);
+    CuAssertTrue(tc, 10 == bt_diskcache_get_dirty_bytes(dc));
+    bt_diskcache_free(dc);
+}
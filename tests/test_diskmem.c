@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmem.h"
+
+void TestBT_diskmem_write_then_read(CuTest * tc)
+{
+    void *dc;
+    bt_block_t b = { .piece_idx = 1, .offset = 5, .len = 10 };
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    CuAssertTrue(tc, 1 == bt_diskmem_write_block(dc, NULL, &b, "0123456789"));
+    CuAssertTrue(tc, 0 == strncmp(bt_diskmem_get_blockrw(dc)->read_block(
+                dc, NULL, &b), "0123456789", 10));
+    bt_diskmem_free(dc);
+}
+
+void TestBT_diskmem_only_commits_written_pieces(CuTest * tc)
+{
+    void *dc;
+    bt_block_t b = { .piece_idx = 500, .offset = 0, .len = 10 };
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    bt_diskmem_set_total_size(dc, 40 * 1000);
+    CuAssertTrue(tc, 0 == bt_diskmem_get_committed_bytes(dc));
+    bt_diskmem_write_block(dc, NULL, &b, "0123456789");
+    CuAssertTrue(tc, 40 == bt_diskmem_get_committed_bytes(dc));
+    bt_diskmem_free(dc);
+}
+
+void TestBT_diskmem_write_past_size_grows(CuTest * tc)
+{
+    void *dc;
+    bt_block_t b = { .piece_idx = 30, .offset = 0, .len = 10 };
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    CuAssertTrue(tc, NULL == bt_diskmem_get_blockrw(dc)->read_block(
+                dc, NULL, &b));
+    bt_diskmem_write_block(dc, NULL, &b, "0123456789");
+    CuAssertTrue(tc, 0 == strncmp(bt_diskmem_get_blockrw(dc)->read_block(
+                dc, NULL, &b), "0123456789", 10));
+    bt_diskmem_free(dc);
+}
+
+void TestBT_diskmem_unwritten_piece_reads_as_zeroes(CuTest * tc)
+{
+    void *dc;
+    char zeroes[10] = { 0 };
+    bt_block_t b = { .piece_idx = 3, .offset = 0, .len = 10 };
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    CuAssertTrue(tc, 0 == memcmp(bt_diskmem_get_blockrw(dc)->read_block(
+                dc, NULL, &b), zeroes, 10));
+    bt_diskmem_free(dc);
+}
+
+void TestBT_diskmem_write_frame_is_the_page(CuTest * tc)
+{
+    void *dc;
+    bt_blockrw_i *irw;
+    bt_block_t b = { .piece_idx = 2, .offset = 10, .len = 10 };
+    char *frame;
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    irw = bt_diskmem_get_blockrw(dc);
+    frame = irw->get_write_frame(dc, NULL, &b);
+    memcpy(frame, "0123456789", 10);
+    CuAssertTrue(tc, 1 == irw->write_block(dc, NULL, &b, frame));
+    CuAssertTrue(tc, frame == irw->read_block(dc, NULL, &b));
+    bt_diskmem_free(dc);
+}
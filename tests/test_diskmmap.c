@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "bt.h"
+#include "bt_diskmmap.h"
+
+#define PIECE_LEN 100
+#define NPIECES 10
+
+static void* __mmap_new(CuTest * tc, char *path)
+{
+    void *dm;
+    int fd;
+
+    strcpy(path, "/tmp/test_diskmmap_XXXXXX");
+    fd = mkstemp(path);
+    CuAssertTrue(tc, -1 != fd);
+    close(fd);
+
+    dm = bt_diskmmap_new();
+    bt_diskmmap_set_size(dm, PIECE_LEN);
+    CuAssertTrue(tc, 1 == bt_diskmmap_open(dm, path, PIECE_LEN * NPIECES));
+    return dm;
+}
+
+static void __mmap_free(void *dm, char *path)
+{
+    bt_diskmmap_free(dm);
+    unlink(path);
+}
+
+void TestBT_diskmmap_read_returns_written_data(CuTest * tc)
+{
+    char path[64];
+    void *dm;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 2, .offset = 10, .len = 5 };
+
+    dm = __mmap_new(tc, path);
+    irw = bt_diskmmap_get_blockrw(dm);
+    CuAssertTrue(tc, 1 == irw->write_block(dm, NULL, &blk, "hello"));
+    CuAssertTrue(tc, 0 == strncmp(irw->read_block(dm, NULL, &blk), "hello", 5));
+    __mmap_free(dm, path);
+}
+
+void TestBT_diskmmap_read_points_into_the_mapping(CuTest * tc)
+{
+    char path[64];
+    void *dm;
+    bt_blockrw_i *irw;
+    bt_block_t a = { .piece_idx = 0, .offset = 0, .len = 10 };
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    dm = __mmap_new(tc, path);
+    irw = bt_diskmmap_get_blockrw(dm);
+    CuAssertTrue(tc, (char*)irw->read_block(dm, NULL, &a) + PIECE_LEN ==
+                 (char*)irw->read_block(dm, NULL, &b));
+    __mmap_free(dm, path);
+}
+
+void TestBT_diskmmap_blocks_outside_file_are_refused(CuTest * tc)
+{
+    char path[64];
+    void *dm;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = NPIECES - 1, .offset = 95, .len = 10 };
+
+    dm = __mmap_new(tc, path);
+    irw = bt_diskmmap_get_blockrw(dm);
+    CuAssertTrue(tc, NULL == irw->read_block(dm, NULL, &blk));
+    CuAssertTrue(tc, 0 == irw->write_block(dm, NULL, &blk, "0123456789"));
+    __mmap_free(dm, path);
+}
+
+void TestBT_diskmmap_flush_writes_through_to_file(CuTest * tc)
+{
+    char path[64], buf[5];
+    void *dm;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 3, .offset = 0, .len = 5 };
+    FILE *f;
+
+    dm = __mmap_new(tc, path);
+    irw = bt_diskmmap_get_blockrw(dm);
+    irw->write_block(dm, NULL, &blk, "hello");
+    CuAssertTrue(tc, 1 == irw->flush_block(dm, NULL, &blk));
+
+    f = fopen(path, "rb");
+    fseek(f, 3 * PIECE_LEN, SEEK_SET);
+    CuAssertTrue(tc, 5 == fread(buf, 1, 5, f));
+    fclose(f);
+    CuAssertTrue(tc, 0 == strncmp(buf, "hello", 5));
+
+    /* pages dropped from the mapping are read back from the file */
+    CuAssertTrue(tc, 0 == strncmp(irw->read_block(dm, NULL, &blk), "hello", 5));
+    __mmap_free(dm, path);
+}
+
+void TestBT_diskmmap_reopen_keeps_data(CuTest * tc)
+{
+    char path[64];
+    void *dm;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 4, .offset = 20, .len = 5 };
+
+    dm = __mmap_new(tc, path);
+    irw = bt_diskmmap_get_blockrw(dm);
+    irw->write_block(dm, NULL, &blk, "hello");
+    bt_diskmmap_set_access(dm, BT_DISKMMAP_SEQUENTIAL);
+    CuAssertTrue(tc, 1 == bt_diskmmap_open(dm, path, PIECE_LEN * NPIECES));
+    CuAssertTrue(tc, 0 == strncmp(irw->read_block(dm, NULL, &blk), "hello", 5));
+    __mmap_free(dm, path);
+}
+
+void TestBT_diskmmap_block_file_span_gives_file_offset(CuTest * tc)
+{
+    char path[64];
+    void *dm;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 2, .offset = 10, .len = 5 };
+    unsigned long long offset;
+    int fd;
+
+    dm = __mmap_new(tc, path);
+    irw = bt_diskmmap_get_blockrw(dm);
+    CuAssertTrue(tc, 1 == irw->block_file_span(dm, NULL, &blk, &fd, &offset));
+    CuAssertTrue(tc, -1 != fd);
+    CuAssertTrue(tc, 2 * PIECE_LEN + 10 == offset);
+    CuAssertTrue(tc, 1 == irw->prefetch_block(dm, NULL, &blk));
+    __mmap_free(dm, path);
+}
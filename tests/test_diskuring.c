@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "bt.h"
+#include "bt_diskuring.h"
+
+#define PIECE_LEN (4 * (BT_BLOCK_SIZE))
+#define NPIECES 120
+
+typedef struct
+{
+    int written;
+    int failed;
+} written_t;
+
+static void __written(void *udata, const bt_block_t * blk, int ok)
+{
+    written_t *w = udata;
+
+    if (ok)
+        w->written++;
+    else
+        w->failed++;
+}
+
+static void* __uring_new(CuTest * tc, char *path)
+{
+    void *du;
+    int fd;
+
+    strcpy(path, "/tmp/test_diskuring_XXXXXX");
+    fd = mkstemp(path);
+    CuAssertTrue(tc, -1 != fd);
+    close(fd);
+
+    du = bt_diskuring_new();
+    bt_diskuring_set_size(du, PIECE_LEN);
+    CuAssertTrue(tc, 1 == bt_diskuring_open(du, path, PIECE_LEN * NPIECES));
+    return du;
+}
+
+static void __uring_free(void *du, char *path)
+{
+    bt_diskuring_free(du);
+    unlink(path);
+}
+
+static void __submit_all(void *du, written_t *w)
+{
+    bt_blockrw_i *irw = bt_diskuring_get_blockrw(du);
+
+    while (0 < irw->submit(du, NULL, __written, w))
+        ;
+    irw->submit(du, NULL, __written, w);
+}
+
+static int __file_has(char *path, unsigned long long offset, const char *s,
+                      int len)
+{
+    char buf[64];
+    int fd, ok;
+
+    fd = open(path, O_RDONLY);
+    ok = len == pread(fd, buf, len, offset) && 0 == memcmp(buf, s, len);
+    close(fd);
+    return ok;
+}
+
+void TestBT_diskuring_read_returns_written_data(CuTest * tc)
+{
+    char path[64];
+    void *du;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 2, .offset = 10, .len = 5 };
+
+    du = __uring_new(tc, path);
+    irw = bt_diskuring_get_blockrw(du);
+    CuAssertTrue(tc, 1 == irw->write_block(du, NULL, &blk, "hello"));
+    CuAssertTrue(tc, 0 == strncmp(irw->read_block(du, NULL, &blk), "hello", 5));
+    __uring_free(du, path);
+}
+
+void TestBT_diskuring_write_is_held_until_submit(CuTest * tc)
+{
+    char path[64];
+    void *du;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 1, .offset = 0, .len = 5 };
+    written_t w = { 0, 0 };
+
+    du = __uring_new(tc, path);
+    irw = bt_diskuring_get_blockrw(du);
+    irw->write_block(du, NULL, &blk, "hello");
+    if (bt_diskuring_is_async(du))
+        CuAssertTrue(tc, !__file_has(path, PIECE_LEN, "hello", 5));
+    __submit_all(du, &w);
+    CuAssertTrue(tc, 1 == w.written);
+    CuAssertTrue(tc, 0 == w.failed);
+    CuAssertTrue(tc, __file_has(path, PIECE_LEN, "hello", 5));
+    __uring_free(du, path);
+}
+
+void TestBT_diskuring_large_write_is_reported_once(CuTest * tc)
+{
+    char path[64], *piece;
+    void *du;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 3, .offset = 0, .len = PIECE_LEN };
+    written_t w = { 0, 0 };
+    int i;
+
+    du = __uring_new(tc, path);
+    irw = bt_diskuring_get_blockrw(du);
+    piece = malloc(PIECE_LEN);
+    for (i = 0; i < PIECE_LEN; i++)
+        piece[i] = i % 251;
+    irw->write_block(du, NULL, &blk, piece);
+    __submit_all(du, &w);
+    CuAssertTrue(tc, 1 == w.written);
+    CuAssertTrue(tc, 0 == memcmp(irw->read_block(du, NULL, &blk), piece,
+                                 PIECE_LEN));
+    free(piece);
+    __uring_free(du, path);
+}
+
+void TestBT_diskuring_writes_beyond_queue_depth_all_land(CuTest * tc)
+{
+    char path[64], *piece;
+    void *du;
+    bt_blockrw_i *irw;
+    written_t w = { 0, 0 };
+    int i;
+
+    du = __uring_new(tc, path);
+    irw = bt_diskuring_get_blockrw(du);
+    piece = calloc(1, PIECE_LEN);
+    for (i = 0; i < NPIECES; i++)
+    {
+        bt_block_t blk = { .piece_idx = i, .offset = 0, .len = PIECE_LEN };
+
+        piece[0] = i;
+        CuAssertTrue(tc, 1 == irw->write_block(du, NULL, &blk, piece));
+    }
+    __submit_all(du, &w);
+    CuAssertTrue(tc, NPIECES == w.written);
+    piece[0] = NPIECES - 1;
+    CuAssertTrue(tc, __file_has(path, (NPIECES - 1) * PIECE_LEN, piece, 1));
+    free(piece);
+    __uring_free(du, path);
+}
+
+void TestBT_diskuring_blocks_outside_file_are_refused(CuTest * tc)
+{
+    char path[64];
+    void *du;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = NPIECES - 1, .offset = PIECE_LEN - 5,
+                       .len = 10 };
+
+    du = __uring_new(tc, path);
+    irw = bt_diskuring_get_blockrw(du);
+    CuAssertTrue(tc, NULL == irw->read_block(du, NULL, &blk));
+    CuAssertTrue(tc, 0 == irw->write_block(du, NULL, &blk, "0123456789"));
+    __uring_free(du, path);
+}
+
+void TestBT_diskuring_free_finishes_outstanding_writes(CuTest * tc)
+{
+    char path[64];
+    void *du;
+    bt_blockrw_i *irw;
+    bt_block_t blk = { .piece_idx = 5, .offset = 7, .len = 5 };
+
+    du = __uring_new(tc, path);
+    irw = bt_diskuring_get_blockrw(du);
+    irw->write_block(du, NULL, &blk, "hello");
+    bt_diskuring_free(du);
+    CuAssertTrue(tc, __file_has(path, 5 * PIECE_LEN + 7, "hello", 5));
+    unlink(path);
+}
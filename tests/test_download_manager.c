@@ -7,8 +7,17 @@
 #include "CuTest.h"
 
 #include <stdint.h>
+#include <unistd.h>
 
 #include "bt.h"
+#include "bt_piece.h"
+#include "bt_piece_db.h"
+#include "bt_diskmem.h"
+#include "bt_selector_auto.h"
+#include "config.h"
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_handshaker.h"
 
 #if 0
 /*
@@ -46,6 +55,23 @@ void TestBT_dm_dont_add_myself_as_a_peer(
                 ip, strlen(ip), 4001, peer_ctx, NULL));
 }
 
+void TestBT_dm_myself_isnt_added_as_a_peer(
+    CuTest * tc
+)
+{
+    void *id;
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1", *mapped = "::ffff:127.0.0.1", *prefix = "127.0.0";
+
+    id = bt_dm_new();
+    CuAssertTrue(tc, NULL == bt_dm_add_peer(id, peerid, strlen(peerid),
+                ip, strlen(ip), 6881, malloc(1), NULL));
+    CuAssertTrue(tc, NULL == bt_dm_add_peer(id, peerid, strlen(peerid),
+                mapped, strlen(mapped), 6881, malloc(1), NULL));
+    CuAssertTrue(tc, NULL != bt_dm_add_peer(id, peerid, strlen(peerid),
+                prefix, strlen(prefix), 6881, malloc(1), NULL));
+}
+
 void TestBT_dm_add_peer_adds_peer(
     CuTest * tc
 )
@@ -95,3 +121,896 @@ void TestBT_dm_wont_connect_peer_if_not_added(
                 ip, strlen(ip), 4001, peer_ctx, NULL));
     CuAssertTrue(tc, 1 == bt_dm_peer_connect(id, peer_ctx, ip, 4001));
 }
+
+void TestBT_dm_config_change_is_seen_by_add_peer(
+    CuTest * tc
+)
+{
+    void *id;
+    char *peerid = "0000000000000";
+    char *ip = "192.168.1.1";
+    void* peer_ctx = malloc(1);
+
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "my_ip", ip);
+    config_set(bt_dm_get_config(id), "pwp_listen_port", "4001");
+    CuAssertTrue(tc, NULL == bt_dm_add_peer(id, peerid, strlen(peerid),
+                ip, strlen(ip), 4001, peer_ctx, NULL));
+
+    /* we're now listening elsewhere, so this isn't us */
+    config_set(bt_dm_get_config(id), "pwp_listen_port", "4002");
+    CuAssertTrue(tc, NULL != bt_dm_add_peer(id, peerid, strlen(peerid),
+                ip, strlen(ip), 4001, peer_ctx, NULL));
+}
+
+static int __submits = 0;
+
+static int __mock_submit(void *udata, void *caller, func_block_written_f cb,
+                         void *cb_udata)
+{
+    __submits++;
+    return 0;
+}
+
+void TestBT_dm_periodic_submits_queued_disk_writes(
+    CuTest * tc
+)
+{
+    void *id;
+    bt_blockrw_i irw;
+
+    memset(&irw, 0, sizeof(bt_blockrw_i));
+    irw.submit = __mock_submit;
+
+    id = bt_dm_new();
+    bt_dm_set_disk_blockrw(id, &irw, NULL);
+    __submits = 0;
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, 1 == __submits);
+}
+
+static int __haves[16], __givebacks[16];
+
+static void __mock_have_piece(void *r, int piece_idx)
+{
+    __haves[piece_idx]++;
+}
+
+static void __mock_giveback_piece(void *r, void* peer, int piece_idx)
+{
+    __givebacks[piece_idx]++;
+}
+
+void TestBT_dm_skipped_pieces_are_kept_from_the_selector(
+    CuTest * tc
+)
+{
+    void *id;
+
+    memset(__haves, 0, sizeof(__haves));
+    memset(__givebacks, 0, sizeof(__givebacks));
+
+    id = bt_dm_new();
+    CuAssertTrue(tc, BT_PIECE_PRIORITY_NORMAL ==
+                 bt_dm_get_piece_priority(id, 3));
+
+    /* a selector set afterwards is told too */
+    bt_dm_set_piece_priority(id, 2, 4, BT_PIECE_PRIORITY_SKIP);
+    bt_dm_set_piece_priority(id, 6, 7, BT_PIECE_PRIORITY_LOW);
+    bt_dm_set_piece_selector(id, &((bt_pieceselector_i) {
+                                   .have_piece = __mock_have_piece,
+                                   .peer_giveback_piece =
+                                       __mock_giveback_piece
+                               }), (void*)1);
+    CuAssertTrue(tc, 1 == __haves[2] && 1 == __haves[3]);
+    CuAssertTrue(tc, 0 == __haves[1] && 0 == __haves[4] && 0 == __haves[6]);
+    CuAssertTrue(tc, BT_PIECE_PRIORITY_SKIP == bt_dm_get_piece_priority(id, 3));
+    CuAssertTrue(tc, BT_PIECE_PRIORITY_LOW == bt_dm_get_piece_priority(id, 6));
+
+    /* unskipping hands the piece back */
+    bt_dm_set_piece_priority(id, 3, 4, BT_PIECE_PRIORITY_NORMAL);
+    CuAssertTrue(tc, 1 == __givebacks[3]);
+    CuAssertTrue(tc, 0 == __givebacks[2]);
+    bt_dm_set_piece_priority(id, 0, 1, BT_PIECE_PRIORITY_SKIP);
+    CuAssertTrue(tc, 1 == __haves[0]);
+}
+
+static unsigned long __connects = 0;
+
+/* host of the last connect */
+static char __connected_host[32];
+
+static int __mock_peer_connect(void* me, void **udata, void **conn_ctx,
+                               const char *host, const int port,
+                               int (*func_process_data) (void *,
+                                                         void*,
+                                                         const char*,
+                                                         unsigned int),
+                               int (*func_process_connection) (void *,
+                                                               void*,
+                                                               char *,
+                                                               int),
+                               void (*func_connection_failed) (void *,
+                                                               void*))
+{
+    *conn_ctx = (void*)++__connects;
+    snprintf(__connected_host, sizeof(__connected_host), "%s", host);
+    return 1;
+}
+
+static void __add_outgoing_peers(void* id, int n)
+{
+    char ip[32];
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        sprintf(ip, "192.168.1.%d", i + 1);
+        bt_dm_add_peer(id, "", 0, ip, strlen(ip), 4001, NULL, NULL);
+    }
+}
+
+void TestBT_dm_half_open_connects_are_capped(
+    CuTest * tc
+)
+{
+    void *id;
+    bt_dm_stats_t stats;
+
+    memset(&stats, 0, sizeof(bt_dm_stats_t));
+    __connects = 0;
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "max_half_open", "2");
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+
+    __add_outgoing_peers(id, 4);
+    CuAssertTrue(tc, 4 == bt_dm_get_num_peers(id));
+    CuAssertTrue(tc, 2 == __connects);
+
+    /* a connect completing makes room for a candidate */
+    CuAssertTrue(tc, 1 == bt_dm_peer_connect(id, (void*)1, "", 0));
+    bt_dm_periodic(id, &stats);
+    CuAssertTrue(tc, 3 == __connects);
+    CuAssertTrue(tc, 2 == stats.nhalf_open);
+    CuAssertTrue(tc, 1 == stats.ncandidates);
+}
+
+void TestBT_dm_connects_are_rate_limited(
+    CuTest * tc
+)
+{
+    void *id;
+    bt_dm_stats_t stats;
+
+    memset(&stats, 0, sizeof(bt_dm_stats_t));
+    __connects = 0;
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "max_connects_per_sec", "3");
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+
+    __add_outgoing_peers(id, 5);
+    bt_dm_periodic(id, &stats);
+    CuAssertTrue(tc, 3 == __connects);
+    CuAssertTrue(tc, 2 == stats.ncandidates);
+}
+
+void TestBT_dm_local_candidates_are_connected_first(
+    CuTest * tc
+)
+{
+    void *id, *local;
+    char *ip = "192.168.1.9";
+    bt_dm_stats_t stats;
+
+    memset(&stats, 0, sizeof(bt_dm_stats_t));
+    __connects = 0;
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "max_half_open", "1");
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+
+    __add_outgoing_peers(id, 3);
+    local = bt_dm_add_peer(id, "", 0, ip, strlen(ip), 4001, NULL, NULL);
+    bt_dm_set_peer_local(id, local);
+    CuAssertTrue(tc, 1 == __connects);
+    CuAssertTrue(tc, 0 == ((bt_peer_t*)local)->half_open);
+
+    /* it was queued last, but goes ahead of the others */
+    CuAssertTrue(tc, 1 == bt_dm_peer_connect(id, (void*)1, "", 0));
+    bt_dm_periodic(id, &stats);
+    CuAssertTrue(tc, 2 == __connects);
+    CuAssertTrue(tc, 0 == strcmp(__connected_host, ip));
+    CuAssertTrue(tc, 1 == ((bt_peer_t*)local)->half_open);
+}
+
+void TestBT_dm_incoming_peers_are_refused_at_max_peer_connections(
+    CuTest * tc
+)
+{
+    void *id;
+    char *ip = "192.168.1.1", *other = "192.168.1.2";
+
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "max_peer_connections", "1");
+    CuAssertTrue(tc, NULL != bt_dm_add_peer(id, "", 0, ip, strlen(ip), 4001,
+                                            malloc(1), NULL));
+    CuAssertTrue(tc, NULL == bt_dm_add_peer(id, "", 0, other, strlen(other),
+                                            4001, malloc(1), NULL));
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(id));
+}
+
+static void __mock_peer(void *r, void *peer)
+{
+}
+
+void TestBT_dm_failed_peer_isnt_redialled_straight_away(
+    CuTest * tc
+)
+{
+    void *id, *peer;
+    char *ip = "192.168.1.1";
+
+    __connects = 0;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+    bt_dm_set_piece_selector(id, &((bt_pieceselector_i) {
+                                   .add_peer = __mock_peer,
+                                   .remove_peer = __mock_peer
+                               }), (void*)1);
+
+    peer = bt_dm_add_peer(id, "", 0, ip, strlen(ip), 4001, NULL, NULL);
+    CuAssertTrue(tc, NULL != peer);
+    bt_dm_peer_connect_fail(id, (void*)1);
+    CuAssertTrue(tc, 1 == bt_dm_remove_peer(id, peer));
+
+    /* the tracker hands us the same peer again */
+    CuAssertTrue(tc, NULL == bt_dm_add_peer(id, "", 0, ip, strlen(ip), 4001,
+                                            NULL, NULL));
+    CuAssertTrue(tc, 1 == __connects);
+
+    /* but it may still connect to us */
+    CuAssertTrue(tc, NULL != bt_dm_add_peer(id, "", 0, ip, strlen(ip), 4001,
+                                            malloc(1), NULL));
+}
+
+void TestBT_dm_stats_snapshot_is_published_by_periodic(
+    CuTest * tc
+)
+{
+    void *id;
+    const bt_dm_stats_t *s;
+
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+    CuAssertTrue(tc, NULL == bt_dm_acquire_stats(id));
+
+    __add_outgoing_peers(id, 3);
+    bt_dm_periodic(id, NULL);
+    s = bt_dm_acquire_stats(id);
+    CuAssertTrue(tc, NULL != s);
+    CuAssertTrue(tc, 3 == s->npeers);
+    bt_dm_release_stats(id, s);
+}
+
+void TestBT_dm_held_stats_snapshot_isnt_overwritten(
+    CuTest * tc
+)
+{
+    void *id;
+    const bt_dm_stats_t *s, *s2;
+
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "stats_interval", "1");
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+    bt_dm_periodic(id, NULL);
+    s = bt_dm_acquire_stats(id);
+    CuAssertTrue(tc, 0 == s->npeers);
+
+    /* the other snapshot is published... */
+    __add_outgoing_peers(id, 2);
+    usleep(2000);
+    bt_dm_periodic(id, NULL);
+    s2 = bt_dm_acquire_stats(id);
+    CuAssertTrue(tc, s != s2);
+    CuAssertTrue(tc, 2 == s2->npeers);
+    bt_dm_release_stats(id, s2);
+
+    /* ...but ours is left alone while we have it */
+    usleep(2000);
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, 0 == s->npeers);
+    s2 = bt_dm_acquire_stats(id);
+    CuAssertTrue(tc, s != s2);
+    bt_dm_release_stats(id, s2);
+
+    /* and is refilled once we've let go */
+    bt_dm_release_stats(id, s);
+    bt_dm_periodic(id, NULL);
+    s2 = bt_dm_acquire_stats(id);
+    CuAssertTrue(tc, s == s2);
+    CuAssertTrue(tc, 2 == s2->npeers);
+    bt_dm_release_stats(id, s2);
+}
+
+static unsigned long long __now_us = 0;
+static unsigned long long __cache_bytes = 0;
+static unsigned long long __cache_limit = ~0ULL;
+
+static unsigned long long __mock_get_time_us(void* udata)
+{
+    return __now_us;
+}
+
+static unsigned long long __mock_get_memory(void *udata)
+{
+    return __cache_bytes;
+}
+
+static void __mock_set_memory_limit(void *udata, unsigned long long bytes)
+{
+    __cache_limit = bytes;
+    if (bytes && bytes < __cache_bytes)
+        __cache_bytes = bytes;
+}
+
+static unsigned long __mock_selector_memory(void* r)
+{
+    return 1000;
+}
+
+static bt_blockrw_i __mock_disk = {
+    .get_memory = __mock_get_memory,
+    .set_memory_limit = __mock_set_memory_limit
+};
+
+void TestBT_dm_memory_is_counted_by_component(
+    CuTest * tc
+)
+{
+    void *id;
+    bt_memory_stats_t m;
+
+    __connects = 0;
+    __cache_bytes = 5000;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect }), NULL);
+    bt_dm_set_disk_blockrw(id, &__mock_disk, NULL);
+    bt_dm_set_piece_selector(id, &((bt_pieceselector_i) {
+                                   .add_peer = __mock_peer,
+                                   .remove_peer = __mock_peer,
+                                   .get_memory = __mock_selector_memory
+                               }), (void*)1);
+    __add_outgoing_peers(id, 3);
+
+    bt_dm_get_memory(id, &m);
+    CuAssertTrue(tc, 5000 == m.cache);
+    CuAssertTrue(tc, 1000 == m.selector);
+    CuAssertTrue(tc, 3 * sizeof(bt_peer_t) < m.connections);
+    CuAssertTrue(tc, m.total == m.cache + m.connections + m.pieces +
+                 m.selector);
+    CuAssertTrue(tc, 0 == m.limit);
+
+    /* the smaller of our cap and the session's share */
+    config_set(bt_dm_get_config(id), "max_memory", "100000");
+    bt_dm_get_memory(id, &m);
+    CuAssertTrue(tc, 100000 == m.limit);
+    bt_dm_set_memory_share(id, 50000);
+    bt_dm_get_memory(id, &m);
+    CuAssertTrue(tc, 50000 == m.limit);
+}
+
+void TestBT_dm_memory_cap_shrinks_the_cache(
+    CuTest * tc
+)
+{
+    void *id;
+    bt_memory_stats_t m;
+
+    __now_us = 1000000;
+    __cache_bytes = 50000;
+    __cache_limit = ~0ULL;
+    id = bt_dm_new();
+    config_set(bt_dm_get_config(id), "max_memory", "10000");
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .get_time_us = __mock_get_time_us }), NULL);
+    bt_dm_set_disk_blockrw(id, &__mock_disk, NULL);
+
+    /* the cache is left what the rest doesn't use */
+    __now_us += 1001000;
+    bt_dm_periodic(id, NULL);
+    bt_dm_get_memory(id, &m);
+    CuAssertTrue(tc, 0 < __cache_limit && __cache_limit <= 10000);
+    CuAssertTrue(tc, __cache_limit == m.limit - (m.total - m.cache));
+    CuAssertTrue(tc, m.total <= m.limit);
+
+    /* and gets its own budgets back when the cap is lifted */
+    config_set(bt_dm_get_config(id), "max_memory", "0");
+    __now_us += 1001000;
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, 0 == __cache_limit);
+}
+
+/**
+ * @return where s is within buf; NULL if it isn't */
+static const char* __memfind(const char* buf, int len, const char* s)
+{
+    int i, n = strlen(s);
+
+    for (i = 0; i + n <= len; i++)
+        if (0 == memcmp(buf + i, s, n))
+            return buf + i;
+    return NULL;
+}
+
+/**
+ * @return how many times the n bytes of msg are within buf */
+static int __memcount(const char* buf, int len, const char* msg, int n)
+{
+    int i, count = 0;
+
+    for (i = 0; i + n <= len; i++)
+        if (0 == memcmp(buf + i, msg, n))
+            count++;
+    return count;
+}
+
+/* what was sent to each of three connections, with conn_ctx 1 to 3 */
+static char __sent[3][4096];
+static int __nsent[3];
+
+static int __mock_peer_send(void* me, void **udata, void* conn_ctx,
+                            const char *send_data, const int len)
+{
+    int i = (int)(unsigned long)conn_ctx - 1;
+
+    memcpy(__sent[i] + __nsent[i], send_data, len);
+    __nsent[i] += len;
+    return 1;
+}
+
+/**
+ * A peer connects to us, handshakes with the extension bit set, and says
+ * it listens on port */
+static void* __extended_peer(void* id, const char* ip, int conn, int port)
+{
+    char msg[256], *p = msg;
+    void* peer;
+
+    peer = bt_dm_add_peer(id, "", 0, ip, strlen(ip), 50000,
+                          (void*)(unsigned long)conn, NULL);
+    p += sprintf(p, "%cBitTorrent protocol", 19);
+    memset(p, 0, 8);
+    p[5] = 0x10;
+    p += 8;
+    p += sprintf(p, "00000000000000000000%020d", conn);
+    p += sprintf(p, "0000%c%cd1:md6:ut_pexi1ee1:pi%dee",
+                 PWP_MSGTYPE_EXTENDED, PWP_EXTENDED_HANDSHAKE, port);
+    /* the length goes in last, as the payload's length is known */
+    msg[68 + 3] = p - msg - 68 - 4;
+    msg[68] = msg[68 + 1] = msg[68 + 2] = 0;
+    bt_dm_dispatch_from_buffer(id, (void*)(unsigned long)conn, msg, p - msg);
+    return peer;
+}
+
+void TestBT_dm_peer_with_wrong_infohash_is_dropped(
+    CuTest * tc
+)
+{
+    char msg[68], *p = msg;
+    void *id;
+
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_send = __mock_peer_send,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_error =
+                            pwp_handshaker_get_error }), NULL);
+    bt_dm_set_piece_selector(id, &((bt_pieceselector_i) {
+                                 .add_peer = __mock_peer,
+                                 .remove_peer = __mock_peer }), (void*)1);
+    bt_dm_add_peer(id, "", 0, "192.168.1.1", strlen("192.168.1.1"), 50000,
+                   (void*)1, NULL);
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(id));
+
+    p += sprintf(p, "%cBitTorrent protocol", 19);
+    memset(p, 0, 8);
+    p += 8;
+    memcpy(p, "1111111111111111111100000000000000000001", 40);
+    bt_dm_dispatch_from_buffer(id, (void*)1, msg, sizeof(msg));
+    CuAssertTrue(tc, 0 == bt_dm_get_num_peers(id));
+}
+
+void TestBT_dm_peers_heard_of_through_pex_are_connected_to(
+    CuTest * tc
+)
+{
+    void *id;
+    /* ut_pex with added 10.0.0.5:6881 */
+    const char pex[] = "\0\0\0\x13\x14\x01" "d5:added6:\x0a\0\0\x05\x1a\xe1"
+                       "e";
+
+    /* clear of the conn_ctx of the peers that connect to us */
+    __connects = 100;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect,
+                        .peer_send = __mock_peer_send,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved }), NULL);
+    memset(__nsent, 0, sizeof(__nsent));
+    __extended_peer(id, "192.168.1.1", 1, 7000);
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(id));
+
+    CuAssertTrue(tc, 1 == bt_dm_dispatch_from_buffer(id, (void*)1, pex,
+                                                     sizeof(pex) - 1));
+    CuAssertTrue(tc, 2 == bt_dm_get_num_peers(id));
+    CuAssertTrue(tc, 101 == __connects);
+    CuAssertTrue(tc, 0 == strcmp(__connected_host, "10.0.0.5"));
+
+    /* we know of it now */
+    CuAssertTrue(tc, 1 == bt_dm_dispatch_from_buffer(id, (void*)1, pex,
+                                                     sizeof(pex) - 1));
+    CuAssertTrue(tc, 2 == bt_dm_get_num_peers(id));
+
+    /* unless we'd rather not */
+    config_set(bt_dm_get_config(id), "peer_exchange", "0");
+    __extended_peer(id, "192.168.1.2", 2, 7001);
+    CuAssertTrue(tc, NULL == __memfind(__sent[1], __nsent[1], "ut_pex"));
+}
+
+void TestBT_dm_recv_buffer_holds_a_message_until_its_whole(
+    CuTest * tc
+)
+{
+    void *id;
+    const char pex[] = "\0\0\0\x13\x14\x01" "d5:added6:\x0a\0\0\x05\x1a\xe1"
+                       "e";
+    char *buf, *rest;
+    unsigned int len;
+
+    __connects = 100;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_connect = __mock_peer_connect,
+                        .peer_send = __mock_peer_send,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved }), NULL);
+    memset(__nsent, 0, sizeof(__nsent));
+    __extended_peer(id, "192.168.1.1", 1, 7000);
+    CuAssertTrue(tc, NULL == bt_dm_get_recv_buffer(id, (void*)9, &len));
+
+    /* half a message is held */
+    buf = bt_dm_get_recv_buffer(id, (void*)1, &len);
+    CuAssertTrue(tc, NULL != buf && sizeof(pex) - 1 <= len);
+    memcpy(buf, pex, 10);
+    CuAssertTrue(tc, 1 == bt_dm_recv_buffer_filled(id, (void*)1, 10));
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(id));
+
+    /* and the rest is read in after it */
+    rest = bt_dm_get_recv_buffer(id, (void*)1, &len);
+    CuAssertTrue(tc, buf + 10 == rest);
+    memcpy(rest, pex + 10, sizeof(pex) - 1 - 10);
+    CuAssertTrue(tc, 1 == bt_dm_recv_buffer_filled(id, (void*)1,
+                                                   sizeof(pex) - 1 - 10));
+    CuAssertTrue(tc, 2 == bt_dm_get_num_peers(id));
+    CuAssertTrue(tc, 0 == strcmp(__connected_host, "10.0.0.5"));
+}
+
+void TestBT_dm_pex_tells_peers_about_each_other(
+    CuTest * tc
+)
+{
+    void *id;
+    const char *ext;
+
+    __now_us = 1000000;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_send = __mock_peer_send,
+                        .get_time_us = __mock_get_time_us,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved }), NULL);
+    memset(__nsent, 0, sizeof(__nsent));
+    __extended_peer(id, "192.168.1.1", 1, 7000);
+    __extended_peer(id, "192.168.1.2", 2, 7001);
+
+    /* our extension handshake follows the bitfield */
+    CuAssertTrue(tc, NULL != __memfind(__sent[0], __nsent[0], "6:ut_pex"));
+
+    __nsent[0] = __nsent[1] = 0;
+    __now_us += 61000000;
+    bt_dm_periodic(id, NULL);
+
+    /* each hears of the other at the port its handshake gave, not the
+     * port it dialled us from */
+    ext = __memfind(__sent[0], __nsent[0], "5:added6:");
+    CuAssertTrue(tc, NULL != ext);
+    CuAssertTrue(tc, 0 == memcmp(ext + 9, "\xc0\xa8\x01\x02\x1b\x59", 6));
+    ext = __memfind(__sent[1], __nsent[1], "5:added6:");
+    CuAssertTrue(tc, NULL != ext);
+    CuAssertTrue(tc, 0 == memcmp(ext + 9, "\xc0\xa8\x01\x01\x1b\x58", 6));
+
+    /* nothing has changed, so nothing more is said */
+    __nsent[0] = __nsent[1] = 0;
+    __now_us += 61000000;
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, NULL == __memfind(__sent[0], __nsent[0], "added"));
+}
+
+void TestBT_dm_quiet_peers_are_kept_alive_then_dropped(
+    CuTest * tc
+)
+{
+    void *id;
+
+    __now_us = 1000000;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_send = __mock_peer_send,
+                        .get_time_us = __mock_get_time_us,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved }), NULL);
+    bt_dm_set_piece_selector(id, &((bt_pieceselector_i) {
+                                   .add_peer = __mock_peer,
+                                   .remove_peer = __mock_peer
+                               }), (void*)1);
+    memset(__nsent, 0, sizeof(__nsent));
+    __extended_peer(id, "192.168.1.1", 1, 7000);
+
+    /* we've said nothing for a while, so a keepalive goes out */
+    __nsent[0] = 0;
+    __now_us += 95000000;
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, 4 <= __nsent[0]);
+    CuAssertTrue(tc, 0 == memcmp(__sent[0], "\0\0\0\0", 4));
+
+    /* the peer's keepalive puts off its timeout */
+    CuAssertTrue(tc, 1 == bt_dm_dispatch_from_buffer(id, (void*)1,
+                                                     "\0\0\0\0", 4));
+    __now_us += 170000000;
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(id));
+
+    /* until it's been quiet too long */
+    __now_us += 15000000;
+    bt_dm_periodic(id, NULL);
+    __now_us += 1000000;
+    bt_dm_periodic(id, NULL);
+    CuAssertTrue(tc, 0 == bt_dm_get_num_peers(id));
+}
+
+/* a REQUEST and a CANCEL for the one block of a lone 5 byte piece */
+static const char __request[] = "\0\0\0\x0d\x06\0\0\0\0\0\0\0\0\0\0\0\x05";
+static const char __cancel[] = "\0\0\0\x0d\x08\0\0\0\0\0\0\0\0\0\0\0\x05";
+
+static void* __mock_call_exclusively(void* me, void* cb_ctx, void **lock,
+                                     void* udata,
+                                     void* (*cb)(void* me, void* udata))
+{
+    return cb(me, udata);
+}
+
+/**
+ * A dm leeching pieces of piece_len bytes, with the auto selector */
+static void* __leeching_dm(int npieces, int piece_len)
+{
+    void *id, *dc, *db;
+    char val[32];
+    int i;
+
+    __now_us = 1000000;
+    id = bt_dm_new();
+    bt_dm_set_cbs(id, &((bt_dm_cbs_t) {
+                        .peer_send = __mock_peer_send,
+                        .get_time_us = __mock_get_time_us,
+                        .call_exclusively = __mock_call_exclusively,
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .handshaker_get_reserved =
+                            pwp_handshaker_get_reserved }), NULL);
+    sprintf(val, "%d", npieces);
+    config_set(bt_dm_get_config(id), "npieces", val);
+    sprintf(val, "%d", piece_len);
+    config_set(bt_dm_get_config(id), "piece_length", val);
+    config_set(bt_dm_get_config(id), "infohash", "00000000000000000000");
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, piece_len);
+    db = bt_piecedb_new();
+    bt_piecedb_set_diskstorage(db, bt_diskmem_get_blockrw(dc), dc);
+    bt_piecedb_increase_piece_space(db, (unsigned long long)npieces *
+                                    piece_len);
+    for (i = 0; i < npieces; i++)
+        bt_piecedb_add_with_hash_and_size(db, "00000000000000000000",
+                                          piece_len);
+    bt_dm_set_piece_db(id, &((bt_piecedb_i) {.get_piece = bt_piecedb_get }),
+                       db);
+    bt_dm_set_piece_selector(id, &((bt_pieceselector_i) {
+                                   .new = bt_auto_selector_new,
+                                   .peer_giveback_piece =
+                                       bt_auto_selector_giveback_piece,
+                                   .have_piece = bt_auto_selector_have_piece,
+                                   .remove_peer =
+                                       bt_auto_selector_remove_peer,
+                                   .add_peer = bt_auto_selector_add_peer,
+                                   .peer_have_piece =
+                                       bt_auto_selector_peer_have_piece,
+                                   .peer_have_bitfield =
+                                       bt_auto_selector_peer_have_bitfield,
+                                   .get_npeers = bt_auto_selector_get_npeers,
+                                   .get_npieces =
+                                       bt_auto_selector_get_npieces,
+                                   .poll_piece =
+                                       bt_auto_selector_poll_best_piece
+                               }), NULL);
+    memset(__nsent, 0, sizeof(__nsent));
+    return id;
+}
+
+/**
+ * The peer on conn has all of up to eight pieces, and unchokes us */
+static void __unchoking_seed(void* id, int conn, int npieces)
+{
+    char ip[32], msg[] = "\0\0\0\x02\x05\0" "\0\0\0\x01\x01";
+
+    sprintf(ip, "192.168.1.%d", conn);
+    __extended_peer(id, ip, conn, 7000 + conn);
+    msg[5] = (char)(0xff00 >> npieces);
+    bt_dm_dispatch_from_buffer(id, (void*)(unsigned long)conn, msg, 11);
+}
+
+/**
+ * Peers are polled for blocks in one periodic, and ask for them the next */
+static void __periodic(void* id)
+{
+    __now_us += 1000000;
+    bt_dm_periodic(id, NULL);
+    bt_dm_periodic(id, NULL);
+}
+
+void TestBT_dm_endgame_cancels_only_at_peers_holding_the_block(
+    CuTest * tc
+)
+{
+    const char piece[] = "\0\0\0\x0e\x07\0\0\0\0\0\0\0\0" "abcde";
+    void *id;
+    int i;
+
+    id = __leeching_dm(1, 5);
+    for (i = 1; i <= 3; i++)
+        __unchoking_seed(id, i, 1);
+    __periodic(id);
+    for (i = 0; i < 3; i++)
+        CuAssertTrue(tc, 1 == __memcount(__sent[i], __nsent[i], __request,
+                                         17));
+
+    /* the second peer chokes us, so the block isn't coming from it */
+    bt_dm_dispatch_from_buffer(id, (void*)2, "\0\0\0\x01\x00", 5);
+
+    /* the first delivers; only the third still has the request */
+    bt_dm_dispatch_from_buffer(id, (void*)1, piece, sizeof(piece) - 1);
+    CuAssertTrue(tc, 0 == __memcount(__sent[0], __nsent[0], __cancel, 17));
+    CuAssertTrue(tc, 0 == __memcount(__sent[1], __nsent[1], __cancel, 17));
+    CuAssertTrue(tc, 1 == __memcount(__sent[2], __nsent[2], __cancel, 17));
+}
+
+/**
+ * @return how many of the piece's blocks we've asked for */
+static int __nrequested(void* id, int piece_idx)
+{
+    bt_piece_t* pce = bt_piecedb_get(bt_dm_get_piecedb(id), piece_idx);
+    bt_block_t blk;
+    unsigned int offset = 0;
+    int n = 0;
+
+    for (; bt_piece_get_missing_block(pce, offset, &blk); n++)
+        offset = blk.offset + blk.len;
+    return n;
+}
+
+/**
+ * A dm leeching two pieces of four blocks. Nothing has come from any peer,
+ * so they're all slow. A peer is polled until it has one block coming, so
+ * each poll is the one pick */
+static void* __sharing_dm()
+{
+    void* id = __leeching_dm(2, 4 * BT_BLOCK_SIZE);
+
+    config_set(bt_dm_get_config(id), "slow_piece_secs", "8");
+    config_set(bt_dm_get_config(id), "min_pending_requests", "1");
+    return id;
+}
+
+/**
+ * Poll each peer for blocks once */
+static void __poll(void* id)
+{
+    __now_us += 1000000;
+    bt_dm_periodic(id, NULL);
+}
+
+void TestBT_dm_slow_peer_is_asked_for_one_block(
+    CuTest * tc
+)
+{
+    void *id;
+
+    id = __sharing_dm();
+    __unchoking_seed(id, 1, 2);
+    __poll(id);
+    CuAssertTrue(tc, 1 == __nrequested(id, 0) + __nrequested(id, 1));
+}
+
+void TestBT_dm_second_slow_peer_carries_on_with_the_shared_piece(
+    CuTest * tc
+)
+{
+    void *id;
+
+    /* whichever is polled first starts a piece; the other doesn't start
+     * the other piece */
+    id = __sharing_dm();
+    __unchoking_seed(id, 1, 2);
+    __unchoking_seed(id, 2, 2);
+    __poll(id);
+    CuAssertTrue(tc, 2 == __nrequested(id, 0) || 2 == __nrequested(id, 1));
+    CuAssertTrue(tc, 0 == __nrequested(id, 0) || 0 == __nrequested(id, 1));
+}
+
+void TestBT_dm_fast_peer_takes_the_shared_piece_over(
+    CuTest * tc
+)
+{
+    void *id;
+    int idx;
+
+    id = __sharing_dm();
+    __unchoking_seed(id, 1, 2);
+    __poll(id);
+    idx = 1 == __nrequested(id, 0) ? 0 : 1;
+
+    /* it chokes us, so it's polled no more */
+    bt_dm_dispatch_from_buffer(id, (void*)1, "\0\0\0\x01\x00", 5);
+
+    /* no peer is slow now */
+    config_set(bt_dm_get_config(id), "slow_piece_secs", "0");
+    __unchoking_seed(id, 2, 2);
+    __poll(id);
+    CuAssertTrue(tc, 4 == __nrequested(id, idx));
+    CuAssertTrue(tc, 0 == __nrequested(id, !idx));
+
+    /* the piece isn't shared any more; the next slow peer starts the
+     * other one */
+    bt_dm_dispatch_from_buffer(id, (void*)2, "\0\0\0\x01\x00", 5);
+    config_set(bt_dm_get_config(id), "slow_piece_secs", "8");
+    __unchoking_seed(id, 3, 2);
+    __poll(id);
+    CuAssertTrue(tc, 1 == __nrequested(id, !idx));
+}
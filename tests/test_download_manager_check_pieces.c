@@ -15,6 +15,8 @@
 #include <strings.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "bt.h"
 #include "network_adapter.h"
@@ -24,12 +26,14 @@
 
 #include "bt_piece_db.h"
 #include "bt_diskmem.h"
+#include "bt_sha1.h"
 #include "config.h"
 #include "linked_list_hashmap.h"
 #include "bipbuffer.h"
 
 #include <fcntl.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 /**
  * Does the bt_dm_check_pieces() confirm if a piece is complete? */
@@ -105,3 +109,451 @@ void TestBT_Peer_shares_all_pieces_between_each_other(
     CuAssertTrue(tc, bt_dm_piece_is_complete(b->bt, 0));
 }
 
+
+/**
+ * Are jobs from bt_dm_check_pieces() accounted for in the job pool? */
+void TestBT_dm_check_pieces_records_job_high_water_mark(
+    CuTest * tc
+    )
+{
+    client_t* a;
+    hashmap_iterator_t iter;
+    bt_dm_stats_t stats;
+    void* mt;
+
+    clients_setup();
+    mt = mocktorrent_new(2, 5);
+    a = mock_client_setup(5);
+
+    for (
+        hashmap_iterator(clients_get(), &iter);
+        hashmap_iterator_has_next(clients_get(), &iter);
+        )
+    {
+        char hash[21];
+        void* bt, *cfg;
+        client_t* cli;
+
+        cli = hashmap_iterator_next_value(clients_get(), &iter);
+        bt = cli->bt;
+        cfg = bt_dm_get_config(bt);
+        config_set(cfg, "npieces", "2");
+        config_set(cfg, "piece_length", "5");
+        config_set(cfg, "infohash", "00000000000000000000");
+        bt_piecedb_increase_piece_space(bt_dm_get_piecedb(bt), 12);
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     0), 5);
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     1), 5);
+    }
+
+    /* one job checks both pieces */
+    bt_dm_check_pieces(a->bt);
+    CuAssertTrue(tc, 1 == bt_dm_get_jobs(a->bt));
+
+    memset(&stats, 0, sizeof(bt_dm_stats_t));
+    bt_dm_periodic(a->bt, &stats);
+    CuAssertTrue(tc, 0 == bt_dm_get_jobs(a->bt));
+    CuAssertTrue(tc, 1 == stats.jobs_hwm);
+}
+
+/**
+ * Are pieces validated when hashing is done by background threads? */
+void TestBT_dm_check_pieces_with_validation_threads(
+    CuTest * tc
+    )
+{
+    client_t* a;
+    hashmap_iterator_t iter;
+    void* mt;
+    int i;
+
+    clients_setup();
+    mt = mocktorrent_new(2, 5);
+    a = mock_client_setup(5);
+
+    for (
+        hashmap_iterator(clients_get(), &iter);
+        hashmap_iterator_has_next(clients_get(), &iter);
+        )
+    {
+        char hash[21];
+        void* bt, *cfg;
+        client_t* cli;
+
+        cli = hashmap_iterator_next_value(clients_get(), &iter);
+        bt = cli->bt;
+        cfg = bt_dm_get_config(bt);
+        config_set(cfg, "npieces", "2");
+        config_set(cfg, "piece_length", "5");
+        config_set(cfg, "infohash", "00000000000000000000");
+        config_set(cfg, "validation_threads", "2");
+        bt_piecedb_increase_piece_space(bt_dm_get_piecedb(bt), 12);
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     0), 5);
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     1), 5);
+    }
+
+    /* write blocks to client A */
+    {
+        bt_block_t blk;
+
+        blk.offset = 0;
+        blk.len = 5;
+        for (blk.piece_idx = 0; blk.piece_idx < 2; blk.piece_idx++)
+            bt_diskmem_write_block(
+                bt_piecedb_get_diskstorage(bt_dm_get_piecedb(a->bt)),
+                NULL, &blk, mocktorrent_get_data(mt, blk.piece_idx));
+    }
+
+    bt_dm_check_pieces(a->bt);
+
+    for (i = 0; i < 1000 && 0 < bt_dm_get_jobs(a->bt); i++)
+    {
+        bt_dm_periodic(a->bt, NULL);
+        usleep(1000);
+    }
+
+    CuAssertTrue(tc, 0 == bt_dm_get_jobs(a->bt));
+    CuAssertTrue(tc, bt_dm_piece_is_complete(a->bt, 0));
+    CuAssertTrue(tc, bt_dm_piece_is_complete(a->bt, 1));
+}
+
+static void __check_progress(void* cb_ctx, int npieces_checked, int npieces)
+{
+    int* checked = cb_ctx;
+
+    *checked = npieces_checked;
+}
+
+/**
+ * Does bt_dm_check_pieces() report progress while the hashpool works
+ * through more pieces than it holds at once? */
+void TestBT_dm_check_pieces_reports_progress(
+    CuTest * tc
+    )
+{
+    client_t* a;
+    void* mt, *cfg;
+    int i, checked = 0;
+    char hash[21];
+
+    clients_setup();
+    mt = mocktorrent_new(6, 5);
+    a = mock_client_setup(5);
+    bt_dm_set_cbs(a->bt, &((bt_dm_cbs_t) {
+                        .check_progress = __check_progress }), &checked);
+
+    cfg = bt_dm_get_config(a->bt);
+    config_set(cfg, "npieces", "6");
+    config_set(cfg, "piece_length", "5");
+    config_set(cfg, "validation_threads", "1");
+    bt_piecedb_increase_piece_space(bt_dm_get_piecedb(a->bt), 30);
+    for (i = 0; i < 6; i++)
+    {
+        bt_block_t blk;
+
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(a->bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     i), 5);
+        blk.piece_idx = i;
+        blk.offset = 0;
+        blk.len = 5;
+        bt_diskmem_write_block(
+            bt_piecedb_get_diskstorage(bt_dm_get_piecedb(a->bt)),
+            NULL, &blk, mocktorrent_get_data(mt, i));
+    }
+
+    bt_dm_check_pieces(a->bt);
+
+    /* only a window of pieces is read ahead of the hashpool */
+    CuAssertTrue(tc, 6 > checked);
+
+    for (i = 0; i < 1000 && 0 < bt_dm_get_jobs(a->bt); i++)
+    {
+        bt_dm_periodic(a->bt, NULL);
+        usleep(1000);
+    }
+
+    CuAssertTrue(tc, 6 == checked);
+    for (i = 0; i < 6; i++)
+        CuAssertTrue(tc, bt_dm_piece_is_complete(a->bt, i));
+}
+
+/* a hasher that holds buffers until the test hashes them */
+typedef struct
+{
+    void* caller;
+    func_hash_done_f done;
+    char* data[8];
+    int len[8];
+    void* job[8];
+    int n;
+} __hasher_t;
+
+static int __hasher_submit(void* udata, void* caller, func_hash_done_f done,
+                           char* data, int len, void* job_udata)
+{
+    __hasher_t* h = udata;
+
+    if (8 == h->n)
+        return 0;
+    h->caller = caller;
+    h->done = done;
+    h->data[h->n] = data;
+    h->len[h->n] = len;
+    h->job[h->n] = job_udata;
+    h->n++;
+    return 1;
+}
+
+static int __hasher_get_depth(void* udata)
+{
+    return 3;
+}
+
+/**
+ * Does bt_dm_check_pieces() hand pieces to the hasher we set, and fall back
+ * to hashing the piece itself when the hasher fails? */
+void TestBT_dm_check_pieces_uses_hasher(
+    CuTest * tc
+    )
+{
+    client_t* a;
+    void* mt, *cfg;
+    int i, checked = 0, nfailed = 0;
+    char hash[21];
+    __hasher_t h;
+
+    memset(&h, 0, sizeof(h));
+    clients_setup();
+    mt = mocktorrent_new(6, 5);
+    a = mock_client_setup(5);
+    bt_dm_set_cbs(a->bt, &((bt_dm_cbs_t) {
+                        .check_progress = __check_progress }), &checked);
+    bt_dm_set_hasher(a->bt, &((bt_hasher_i) {
+                        .submit = __hasher_submit,
+                        .get_depth = __hasher_get_depth }), &h);
+
+    cfg = bt_dm_get_config(a->bt);
+    config_set(cfg, "npieces", "6");
+    config_set(cfg, "piece_length", "5");
+    bt_piecedb_increase_piece_space(bt_dm_get_piecedb(a->bt), 30);
+    for (i = 0; i < 6; i++)
+    {
+        bt_block_t blk;
+
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(a->bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     i), 5);
+        blk.piece_idx = i;
+        blk.offset = 0;
+        blk.len = 5;
+        bt_diskmem_write_block(
+            bt_piecedb_get_diskstorage(bt_dm_get_piecedb(a->bt)),
+            NULL, &blk, mocktorrent_get_data(mt, i));
+    }
+
+    bt_dm_check_pieces(a->bt);
+    CuAssertTrue(tc, 3 == h.n);
+    CuAssertTrue(tc, 0 == checked);
+
+    for (i = 0; i < 100 && 0 < h.n; i++)
+    {
+        /* the first piece the hasher can't do */
+        if (0 == nfailed++)
+            h.done(h.caller, h.job[0], NULL);
+        else
+        {
+            bt_sha1(hash, h.data[0], h.len[0]);
+            h.done(h.caller, h.job[0], hash);
+        }
+        free(h.data[0]);
+        h.n--;
+        memmove(h.data, h.data + 1, h.n * sizeof(char*));
+        memmove(h.len, h.len + 1, h.n * sizeof(int));
+        memmove(h.job, h.job + 1, h.n * sizeof(void*));
+        bt_dm_periodic(a->bt, NULL);
+    }
+
+    CuAssertTrue(tc, 6 == checked);
+    for (i = 0; i < 6; i++)
+        CuAssertTrue(tc, bt_dm_piece_is_complete(a->bt, i));
+}
+
+/**
+ * Do we start seeding once the check finds every piece? */
+void TestBT_dm_seeds_once_all_pieces_are_complete(
+    CuTest * tc
+    )
+{
+    client_t* a;
+    bt_dm_stats_t stats;
+    bt_block_t blk;
+    char hash[21];
+    void* mt, *cfg;
+
+    clients_setup();
+    mt = mocktorrent_new(1, 5);
+    a = mock_client_setup(5);
+
+    cfg = bt_dm_get_config(a->bt);
+    config_set(cfg, "npieces", "1");
+    config_set(cfg, "piece_length", "5");
+    config_set(cfg, "infohash", "00000000000000000000");
+    bt_piecedb_increase_piece_space(bt_dm_get_piecedb(a->bt), 5);
+    bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(a->bt),
+                                      mocktorrent_get_piece_sha1(mt, hash, 0),
+                                      5);
+
+    memset(&stats, 0, sizeof(bt_dm_stats_t));
+    bt_dm_periodic(a->bt, &stats);
+    CuAssertTrue(tc, 0 == stats.seeding);
+
+    blk.piece_idx = 0;
+    blk.offset = 0;
+    blk.len = 5;
+    bt_diskmem_write_block(
+        bt_piecedb_get_diskstorage(bt_dm_get_piecedb(a->bt)),
+        NULL, &blk, mocktorrent_get_data(mt, 0));
+
+    bt_dm_check_pieces(a->bt);
+    bt_dm_periodic(a->bt, &stats);
+    bt_dm_periodic(a->bt, &stats);
+    CuAssertTrue(tc, 1 == stats.seeding);
+    CuAssertTrue(tc, 0 == stats.choke_rounds);
+}
+
+#define NRACED 4096
+#define NRACERS 4
+
+/* a hasher whose buffers are hashed on several threads at once */
+typedef struct
+{
+    void* caller;
+    func_hash_done_f done;
+    char* data[NRACED];
+    int len[NRACED];
+    void* job[NRACED];
+    int n;
+} __racing_hasher_t;
+
+typedef struct
+{
+    __racing_hasher_t* h;
+    int first;
+} __racer_t;
+
+static int __racing_hasher_submit(void* udata, void* caller,
+                                  func_hash_done_f done, char* data, int len,
+                                  void* job_udata)
+{
+    __racing_hasher_t* h = udata;
+
+    h->caller = caller;
+    h->done = done;
+    h->data[h->n] = data;
+    h->len[h->n] = len;
+    h->job[h->n] = job_udata;
+    h->n++;
+    return 1;
+}
+
+static int __racing_hasher_get_depth(void* udata)
+{
+    return NRACED;
+}
+
+static void* __racer(void* r_)
+{
+    __racer_t* r = r_;
+    int i;
+
+    for (i = r->first; i < NRACED; i += NRACERS)
+    {
+        char hash[21];
+
+        bt_sha1(hash, r->h->data[i], r->h->len[i]);
+        r->h->done(r->h->caller, r->h->job[i], hash);
+        free(r->h->data[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Are jobs queued by several threads at once all dispatched when they
+ * overflow the job ring, and call_exclusively isn't set? */
+void TestBT_dm_job_ring_overflows_from_many_threads(
+    CuTest * tc
+    )
+{
+    client_t* a;
+    void* mt, *cfg;
+    int i, checked = 0;
+    char hash[21];
+    __racing_hasher_t* h;
+    __racer_t r[NRACERS];
+    pthread_t t[NRACERS];
+
+    h = calloc(1, sizeof(__racing_hasher_t));
+    clients_setup();
+    mt = mocktorrent_new(NRACED, 8);
+    a = mock_client_setup(8);
+    /* replaces the mock client's call_exclusively */
+    bt_dm_set_cbs(a->bt, &((bt_dm_cbs_t) {
+                        .check_progress = __check_progress }), &checked);
+    bt_dm_set_hasher(a->bt, &((bt_hasher_i) {
+                        .submit = __racing_hasher_submit,
+                        .get_depth = __racing_hasher_get_depth }), h);
+
+    cfg = bt_dm_get_config(a->bt);
+    config_set_va(cfg, "npieces", "%d", NRACED);
+    config_set(cfg, "piece_length", "8");
+    bt_piecedb_increase_piece_space(bt_dm_get_piecedb(a->bt), NRACED * 8);
+    for (i = 0; i < NRACED; i++)
+    {
+        bt_block_t blk;
+
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(a->bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     i), 8);
+        blk.piece_idx = i;
+        blk.offset = 0;
+        blk.len = 8;
+        bt_diskmem_write_block(
+            bt_piecedb_get_diskstorage(bt_dm_get_piecedb(a->bt)),
+            NULL, &blk, mocktorrent_get_data(mt, i));
+    }
+
+    bt_dm_check_pieces(a->bt);
+    CuAssertTrue(tc, NRACED == h->n);
+
+    for (i = 0; i < NRACERS; i++)
+    {
+        r[i].h = h;
+        r[i].first = i;
+        pthread_create(&t[i], NULL, __racer, &r[i]);
+    }
+
+    /* the ring is drained while the threads fill it */
+    for (i = 0; i < 10000 && checked < NRACED; i++)
+    {
+        bt_dm_periodic(a->bt, NULL);
+        sched_yield();
+    }
+
+    for (i = 0; i < NRACERS; i++)
+        pthread_join(t[i], NULL);
+    bt_dm_periodic(a->bt, NULL);
+
+    CuAssertTrue(tc, NRACED == checked);
+    CuAssertTrue(tc, 0 == bt_dm_get_jobs(a->bt));
+    for (i = 0; i < NRACED; i++)
+        CuAssertTrue(tc, bt_dm_piece_is_complete(a->bt, i));
+    free(h);
+}
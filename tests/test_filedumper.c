@@ -0,0 +1,312 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_filedumper.h"
+
+static void* __dumper_new(CuTest * tc, char *dir)
+{
+    void *fd;
+
+    strcpy(dir, "/tmp/test_filedumper_XXXXXX");
+    CuAssertTrue(tc, NULL != mkdtemp(dir));
+
+    fd = bt_filedumper_new();
+    bt_filedumper_set_cwd(fd, dir);
+    bt_filedumper_set_piece_length(fd, 10);
+    return fd;
+}
+
+static void __dumper_free(CuTest * tc, void *fd, char *dir)
+{
+    char cmd[128];
+
+    bt_filedumper_free(fd);
+    sprintf(cmd, "rm -rf %s", dir);
+    CuAssertTrue(tc, 0 == system(cmd));
+}
+
+static void __add(void *fd, const char *fname, unsigned long long size)
+{
+    bt_filedumper_add_file(fd, fname, strlen(fname), size);
+}
+
+/**
+ * @return 1 if the file starts with len bytes of s */
+static int __file_has(char *dir, const char *fname, const char *s, int len)
+{
+    char path[128], buf[64];
+    FILE *f;
+    int ok;
+
+    sprintf(path, "%s/%s", dir, fname);
+    if (!(f = fopen(path, "rb")))
+        return 0;
+    ok = len == (int)fread(buf, 1, len, f) && 0 == memcmp(buf, s, len);
+    fclose(f);
+    return ok;
+}
+
+void TestBT_filedumper_add_file_adds_to_total_size(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 5);
+    __add(fd, "b", 7);
+    CuAssertTrue(tc, 2 == bt_filedumper_get_nfiles(fd));
+    CuAssertTrue(tc, 12 == bt_filedumper_get_total_size(fd));
+    CuAssertTrue(tc, 0 == strcmp("b", bt_filedumper_file_get_path(fd, 1)));
+    CuAssertTrue(tc, NULL == bt_filedumper_file_get_path(fd, 2));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_file_get_pieces_covers_the_file(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    int first, last;
+
+    /*  pieces are 10 bytes */
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 5);
+    __add(fd, "b", 0);
+    __add(fd, "c", 20);
+    CuAssertTrue(tc, 1 == bt_filedumper_file_get_pieces(fd, 0, &first, &last));
+    CuAssertTrue(tc, 0 == first && 1 == last);
+    CuAssertTrue(tc, 1 == bt_filedumper_file_get_pieces(fd, 1, &first, &last));
+    CuAssertTrue(tc, first == last);
+    CuAssertTrue(tc, 1 == bt_filedumper_file_get_pieces(fd, 2, &first, &last));
+    CuAssertTrue(tc, 0 == first && 3 == last);
+    CuAssertTrue(tc, 0 == bt_filedumper_file_get_pieces(fd, 3, &first, &last));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_read_returns_written_data(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_block_t blk = { .piece_idx = 1, .offset = 2, .len = 5 };
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 100);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, "hello"));
+    CuAssertTrue(tc, 0 == strncmp(bt_filedumper_read_block(fd, NULL, &blk),
+                                  "hello", 5));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_block_straddling_files_is_split(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_block_t blk = { .piece_idx = 0, .offset = 3, .len = 5 };
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 5);
+    __add(fd, "b", 10);
+    bt_filedumper_write_block(fd, NULL, &blk, "hello");
+    CuAssertTrue(tc, __file_has(dir, "a", "\0\0\0he", 5));
+    CuAssertTrue(tc, __file_has(dir, "b", "llo", 3));
+    CuAssertTrue(tc, 0 == strncmp(bt_filedumper_read_block(fd, NULL, &blk),
+                                  "hello", 5));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_empty_files_are_skipped(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 4 };
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 2);
+    __add(fd, "empty", 0);
+    __add(fd, "b", 2);
+    bt_filedumper_write_block(fd, NULL, &blk, "abcd");
+    CuAssertTrue(tc, __file_has(dir, "a", "ab", 2));
+    CuAssertTrue(tc, __file_has(dir, "b", "cd", 2));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_files_are_created_in_subdirectories(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 5 };
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "sub/dir/a", 10);
+    bt_filedumper_write_block(fd, NULL, &blk, "hello");
+    CuAssertTrue(tc, __file_has(dir, "sub/dir/a", "hello", 5));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_blocks_past_the_end_are_refused(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_block_t blk = { .piece_idx = 0, .offset = 8, .len = 5 };
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 10);
+    CuAssertTrue(tc, 0 == bt_filedumper_write_block(fd, NULL, &blk, "hello"));
+    CuAssertTrue(tc, NULL == bt_filedumper_read_block(fd, NULL, &blk));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_open_files_are_bounded(CuTest * tc)
+{
+    char dir[64], name[32];
+    void *fd;
+    int i;
+
+    fd = __dumper_new(tc, dir);
+    bt_filedumper_set_max_fds(fd, 4);
+    for (i = 0; i < 1000; i++)
+    {
+        sprintf(name, "f%d", i);
+        __add(fd, name, 3);
+    }
+
+    for (i = 0; i < 300; i++)
+    {
+        bt_block_t blk = { .piece_idx = i, .offset = 0, .len = 10 };
+
+        CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk,
+                                                        "0123456789"));
+        CuAssertTrue(tc, bt_filedumper_get_nopen(fd) <= 4);
+    }
+
+    CuAssertTrue(tc, __file_has(dir, "f999", "789", 3));
+    CuAssertTrue(tc, __file_has(dir, "f500", "012", 3));
+    for (i = 0; i < 300; i++)
+    {
+        bt_block_t blk = { .piece_idx = i, .offset = 0, .len = 10 };
+
+        CuAssertTrue(tc, 0 == strncmp(bt_filedumper_read_block(fd, NULL, &blk),
+                                      "0123456789", 10));
+    }
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_block_file_span_needs_a_single_file(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_blockrw_i *irw;
+    bt_block_t inside = { .piece_idx = 0, .offset = 6, .len = 3 };
+    bt_block_t straddles = { .piece_idx = 0, .offset = 3, .len = 5 };
+    unsigned long long offset;
+    int f;
+
+    fd = __dumper_new(tc, dir);
+    irw = bt_filedumper_get_blockrw(fd);
+    __add(fd, "a", 5);
+    __add(fd, "b", 10);
+    CuAssertTrue(tc, 1 == irw->block_file_span(fd, NULL, &inside, &f, &offset));
+    CuAssertTrue(tc, -1 != f);
+    CuAssertTrue(tc, 1 == offset);
+    CuAssertTrue(tc, 0 == irw->block_file_span(fd, NULL, &straddles, &f,
+                                               &offset));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_write_blocks_merges_adjacent_blocks(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_blockrw_i *irw;
+    bt_block_t blks[] = {
+        { .piece_idx = 0, .offset = 0, .len = 3 },
+        { .piece_idx = 0, .offset = 3, .len = 4 },
+        { .piece_idx = 1, .offset = 0, .len = 2 },
+    };
+    const void *data[] = { "abc", "defg", "hi" };
+
+    fd = __dumper_new(tc, dir);
+    irw = bt_filedumper_get_blockrw(fd);
+    __add(fd, "a", 5);
+    __add(fd, "b", 15);
+    CuAssertTrue(tc, 1 == irw->write_blocks(fd, NULL, blks, data, 3));
+    CuAssertTrue(tc, __file_has(dir, "a", "abcde", 5));
+    CuAssertTrue(tc, __file_has(dir, "b", "fg\0\0\0hi", 7));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_write_blocks_refuses_blocks_past_the_end(CuTest * tc)
+{
+    char dir[64];
+    void *fd;
+    bt_blockrw_i *irw;
+    bt_block_t blks[] = {
+        { .piece_idx = 0, .offset = 0, .len = 5 },
+        { .piece_idx = 0, .offset = 5, .len = 10 },
+    };
+    const void *data[] = { "abcde", "0123456789" };
+
+    fd = __dumper_new(tc, dir);
+    irw = bt_filedumper_get_blockrw(fd);
+    __add(fd, "a", 10);
+    CuAssertTrue(tc, 0 == irw->write_blocks(fd, NULL, blks, data, 2));
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_files_are_sized_when_opened(CuTest * tc)
+{
+    char dir[64], path[128];
+    void *fd;
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 1 };
+    FILE *f;
+
+    fd = __dumper_new(tc, dir);
+    __add(fd, "a", 4096);
+    bt_filedumper_write_block(fd, NULL, &blk, "x");
+    sprintf(path, "%s/a", dir);
+    f = fopen(path, "rb");
+    fseek(f, 0, SEEK_END);
+    CuAssertTrue(tc, 4096 == ftell(f));
+    fclose(f);
+    __dumper_free(tc, fd, dir);
+}
+
+void TestBT_filedumper_direct_io_writes_read_back(CuTest * tc)
+{
+    char dir[64];
+    void *fd, *buf;
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 4096 };
+    char *data;
+
+    fd = __dumper_new(tc, dir);
+    bt_filedumper_set_piece_length(fd, 4096);
+    bt_filedumper_set_direct_io(fd, 1);
+    __add(fd, "a", 4096 * 2 + 100);
+    CuAssertTrue(tc, 0 == posix_memalign(&buf, 4096, 4096));
+    memset(buf, 'a', 4096);
+
+    /* aligned, so it can skip the page cache */
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, buf));
+
+    /* the last piece's tail isn't */
+    blk.piece_idx = 2;
+    blk.len = 100;
+    memset(buf, 'b', 100);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, buf));
+
+    data = bt_filedumper_read_block(fd, NULL, &blk);
+    CuAssertTrue(tc, NULL != data && 'b' == data[0] && 'b' == data[99]);
+    blk.piece_idx = 0;
+    blk.len = 4096;
+    data = bt_filedumper_read_block(fd, NULL, &blk);
+    CuAssertTrue(tc, NULL != data && 'a' == data[0] && 'a' == data[4095]);
+    free(buf);
+    __dumper_free(tc, fd, dir);
+}
@@ -0,0 +1,178 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_hashmap.h"
+
+static unsigned long __int_hash(const void *obj)
+{
+    return *(const int*)obj;
+}
+
+static long __int_compare(const void *obj, const void *other)
+{
+    return *(const int*)obj - *(const int*)other;
+}
+
+/* everything collides, so probing is what's being tested */
+static unsigned long __bad_hash(const void *obj)
+{
+    return 7;
+}
+
+void TestBT_hashmap_new_is_empty(
+    CuTest * tc
+)
+{
+    void *h = bt_hashmap_new(__int_hash, __int_compare, 11);
+    int k = 1;
+
+    CuAssertTrue(tc, 0 == bt_hashmap_count(h));
+    CuAssertTrue(tc, NULL == bt_hashmap_get(h, &k));
+    CuAssertTrue(tc, NULL == bt_hashmap_remove(h, &k));
+    bt_hashmap_free(h);
+}
+
+void TestBT_hashmap_put_replaces_and_returns_previous(
+    CuTest * tc
+)
+{
+    void *h = bt_hashmap_new(__int_hash, __int_compare, 11);
+    int k1 = 1, k2 = 1, a, b;
+
+    CuAssertTrue(tc, NULL == bt_hashmap_put(h, &k1, &a));
+    CuAssertTrue(tc, &a == bt_hashmap_put(h, &k2, &b));
+    CuAssertTrue(tc, 1 == bt_hashmap_count(h));
+    CuAssertTrue(tc, &b == bt_hashmap_get(h, &k2));
+    CuAssertTrue(tc, NULL == bt_hashmap_put(h, NULL, &a));
+    CuAssertTrue(tc, NULL == bt_hashmap_put(h, &k1, NULL));
+    CuAssertTrue(tc, 1 == bt_hashmap_count(h));
+    bt_hashmap_free(h);
+}
+
+static void __fill_and_drain(CuTest * tc, void* h, int n)
+{
+    int *keys = malloc(n * sizeof(int)), i;
+
+    for (i = 0; i < n; i++)
+    {
+        keys[i] = i * 3;
+        CuAssertTrue(tc, NULL == bt_hashmap_put(h, &keys[i], &keys[i]));
+    }
+    CuAssertTrue(tc, n == bt_hashmap_count(h));
+
+    /* take out every other key; the rest must still be found */
+    for (i = 0; i < n; i += 2)
+        CuAssertTrue(tc, &keys[i] == bt_hashmap_remove(h, &keys[i]));
+    for (i = 0; i < n; i++)
+    {
+        int k = i * 3;
+
+        if (i % 2)
+            CuAssertTrue(tc, &keys[i] == bt_hashmap_get(h, &k));
+        else
+            CuAssertTrue(tc, NULL == bt_hashmap_get(h, &k));
+    }
+    CuAssertTrue(tc, n / 2 == bt_hashmap_count(h));
+    free(keys);
+}
+
+void TestBT_hashmap_grows_and_removes(
+    CuTest * tc
+)
+{
+    void *h = bt_hashmap_new(__int_hash, __int_compare, 0);
+    unsigned long small = bt_hashmap_get_memory(h);
+
+    __fill_and_drain(tc, h, 10000);
+    CuAssertTrue(tc, small < bt_hashmap_get_memory(h));
+    bt_hashmap_free(h);
+}
+
+void TestBT_hashmap_colliding_keys_survive_removal(
+    CuTest * tc
+)
+{
+    void *h = bt_hashmap_new(__bad_hash, __int_compare, 11);
+
+    __fill_and_drain(tc, h, 200);
+    bt_hashmap_free(h);
+}
+
+void TestBT_hashmap_iterator_visits_each_entry_once(
+    CuTest * tc
+)
+{
+    void *h = bt_hashmap_new(__int_hash, __int_compare, 11);
+    bt_hashmap_iterator_t iter;
+    int keys[100], seen[100] = { 0 }, i, *k;
+
+    for (i = 0; i < 100; i++)
+    {
+        keys[i] = i;
+        bt_hashmap_put(h, &keys[i], &keys[i]);
+    }
+
+    for (bt_hashmap_iterator(h, &iter);
+         (k = bt_hashmap_iterator_next(h, &iter));)
+        seen[*k]++;
+    for (i = 0; i < 100; i++)
+        CuAssertTrue(tc, 1 == seen[i]);
+
+    for (bt_hashmap_iterator(h, &iter);
+         (k = bt_hashmap_iterator_next_value(h, &iter));)
+        seen[*k]++;
+    for (i = 0; i < 100; i++)
+        CuAssertTrue(tc, 2 == seen[i]);
+    bt_hashmap_free(h);
+}
+
+void TestBT_intmap_put_get_remove(
+    CuTest * tc
+)
+{
+    void *h = bt_intmap_new(11);
+    int a, b;
+
+    CuAssertTrue(tc, NULL == bt_intmap_get(h, 0));
+    CuAssertTrue(tc, NULL == bt_intmap_put(h, 0, &a));
+    CuAssertTrue(tc, NULL == bt_intmap_put(h, (uintptr_t)&a, &b));
+    CuAssertTrue(tc, &a == bt_intmap_get(h, 0));
+    CuAssertTrue(tc, &b == bt_intmap_get(h, (uintptr_t)&a));
+    CuAssertTrue(tc, &a == bt_intmap_put(h, 0, &b));
+    CuAssertTrue(tc, 2 == bt_intmap_count(h));
+    CuAssertTrue(tc, &b == bt_intmap_remove(h, 0));
+    CuAssertTrue(tc, NULL == bt_intmap_remove(h, 0));
+    CuAssertTrue(tc, 1 == bt_intmap_count(h));
+    bt_intmap_free(h);
+}
+
+void TestBT_intmap_grows_and_removes(
+    CuTest * tc
+)
+{
+    void *h = bt_intmap_new(0);
+    bt_hashmap_iterator_t iter;
+    int n = 0, x;
+    uint64_t i;
+
+    /* piece index like keys, which all sit in the low bits */
+    for (i = 0; i < 20000; i++)
+        bt_intmap_put(h, i, &x);
+    for (i = 0; i < 20000; i += 2)
+        CuAssertTrue(tc, &x == bt_intmap_remove(h, i));
+    for (i = 0; i < 20000; i++)
+        CuAssertTrue(tc, (i % 2 ? &x : NULL) == bt_intmap_get(h, i));
+
+    for (bt_intmap_iterator(h, &iter); bt_intmap_iterator_next_value(h, &iter);)
+        n++;
+    CuAssertTrue(tc, 10000 == n);
+    CuAssertTrue(tc, 10000 == bt_intmap_count(h));
+    bt_intmap_free(h);
+}
@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_histogram.h"
+
+void TestBT_histogram_empty_has_no_percentiles(CuTest * tc)
+{
+    bt_histogram_t h;
+
+    memset(&h, 0, sizeof(h));
+    CuAssertTrue(tc, 0 == bt_histogram_percentile(&h, 50));
+    CuAssertTrue(tc, 0 == bt_histogram_mean(&h));
+}
+
+void TestBT_histogram_small_values_are_exact(CuTest * tc)
+{
+    bt_histogram_t h;
+
+    memset(&h, 0, sizeof(h));
+    bt_histogram_add(&h, 0);
+    bt_histogram_add(&h, 1);
+    bt_histogram_add(&h, 2);
+    bt_histogram_add(&h, 3);
+    CuAssertTrue(tc, 4 == h.count);
+    CuAssertTrue(tc, 0 == bt_histogram_percentile(&h, 25));
+    CuAssertTrue(tc, 1 == bt_histogram_percentile(&h, 50));
+    CuAssertTrue(tc, 3 == bt_histogram_percentile(&h, 100));
+    CuAssertTrue(tc, 1 == bt_histogram_mean(&h));
+}
+
+void TestBT_histogram_percentile_is_within_a_quarter(CuTest * tc)
+{
+    bt_histogram_t h;
+    unsigned long long v;
+    int i;
+
+    memset(&h, 0, sizeof(h));
+    for (i = 1; i <= 1000; i++)
+        bt_histogram_add(&h, i * 1000);
+
+    v = bt_histogram_percentile(&h, 50);
+    CuAssertTrue(tc, 500000 <= v);
+    CuAssertTrue(tc, v <= 500000 + 500000 / 4);
+
+    v = bt_histogram_percentile(&h, 99);
+    CuAssertTrue(tc, 990000 <= v);
+    CuAssertTrue(tc, v <= 1000000);
+}
+
+void TestBT_histogram_percentile_is_capped_at_max(CuTest * tc)
+{
+    bt_histogram_t h;
+
+    memset(&h, 0, sizeof(h));
+    bt_histogram_add(&h, 1000);
+    CuAssertTrue(tc, 1000 == bt_histogram_percentile(&h, 100));
+    CuAssertTrue(tc, 1000 == h.max);
+}
+
+void TestBT_histogram_huge_values_go_in_last_bucket(CuTest * tc)
+{
+    bt_histogram_t h;
+
+    memset(&h, 0, sizeof(h));
+    bt_histogram_add(&h, 1ULL << 62);
+    CuAssertTrue(tc, 1 == h.buckets[BT_HISTOGRAM_BUCKETS - 1]);
+    CuAssertTrue(tc, 1ULL << 62 == bt_histogram_percentile(&h, 50));
+}
@@ -0,0 +1,245 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "bt.h"
+#include "bt_iosched.h"
+
+#define PIECE_LEN 100
+#define NPIECES 10
+
+typedef struct
+{
+    char data[NPIECES * PIECE_LEN];
+    int writes;
+    int reads;
+    /* pieces in the order they were written */
+    int order[32];
+} mockdisk_t;
+
+static int __mock_disk_write_block(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk,
+    const void *blkdata
+    )
+{
+    mockdisk_t *md = udata;
+
+    memcpy(md->data + blk->piece_idx * PIECE_LEN + blk->offset,
+           blkdata, blk->len);
+    md->order[md->writes++] = blk->piece_idx;
+    return 1;
+}
+
+static void *__mock_disk_read_block(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    )
+{
+    mockdisk_t *md = udata;
+
+    md->reads++;
+    return md->data + blk->piece_idx * PIECE_LEN + blk->offset;
+}
+
+static bt_blockrw_i __mock_disk_rw = {
+    .read_block = __mock_disk_read_block,
+    .write_block = __mock_disk_write_block
+};
+
+static void* __sched_new(mockdisk_t* md, const char* read_bytes,
+                         const char* write_bytes, const char* queue_bytes)
+{
+    void *ios;
+
+    memset(md, 0, sizeof(mockdisk_t));
+    ios = bt_iosched_new();
+    bt_iosched_set_piece_length(ios, PIECE_LEN);
+    bt_iosched_set_disk_blockrw(ios, &__mock_disk_rw, md);
+    config_set(bt_iosched_get_config(ios), "iosched_read_bytes", read_bytes);
+    config_set(bt_iosched_get_config(ios), "iosched_write_bytes", write_bytes);
+    config_set(bt_iosched_get_config(ios), "iosched_queue_bytes", queue_bytes);
+    return ios;
+}
+
+static void __write(void* ios, int piece_idx, const char* msg)
+{
+    bt_block_t b = { .piece_idx = piece_idx, .offset = 0, .len = 10 };
+
+    bt_iosched_get_blockrw(ios)->write_block(ios, NULL, &b, msg);
+}
+
+static int __written = 0;
+
+static void __block_written(void *udata, const bt_block_t * blk, int ok)
+{
+    if (ok)
+        __written++;
+}
+
+static int __submit(void* ios)
+{
+    return bt_iosched_get_blockrw(ios)->submit(ios, NULL, __block_written,
+                                               NULL);
+}
+
+void TestBT_iosched_writes_are_queued_until_submit(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "1000", "1000");
+
+    __write(ios, 1, "0123456789");
+    CuAssertTrue(tc, 0 == md.writes);
+    CuAssertTrue(tc, 10 == bt_iosched_get_queued_write_bytes(ios));
+    __written = 0;
+    CuAssertTrue(tc, 0 == __submit(ios));
+    CuAssertTrue(tc, 1 == md.writes);
+    CuAssertTrue(tc, 1 == __written);
+    CuAssertTrue(tc, 0 == strncmp(md.data + PIECE_LEN, "0123456789", 10));
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_writes_go_out_in_offset_order(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "1000", "1000");
+
+    __write(ios, 5, "0123456789");
+    __write(ios, 2, "0123456789");
+    __write(ios, 7, "0123456789");
+    __write(ios, 0, "0123456789");
+    __submit(ios);
+    CuAssertTrue(tc, 4 == md.writes);
+    CuAssertTrue(tc, 0 == md.order[0]);
+    CuAssertTrue(tc, 2 == md.order[1]);
+    CuAssertTrue(tc, 5 == md.order[2]);
+    CuAssertTrue(tc, 7 == md.order[3]);
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_elevator_continues_from_where_it_stopped(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "20", "1000");
+
+    __write(ios, 4, "0123456789");
+    __write(ios, 6, "0123456789");
+    __submit(ios);
+    CuAssertTrue(tc, 2 == md.writes);
+
+    /* the head is past 6, so 8 goes before 1 */
+    __write(ios, 1, "0123456789");
+    __write(ios, 8, "0123456789");
+    __write(ios, 3, "0123456789");
+    CuAssertTrue(tc, 1 == __submit(ios));
+    CuAssertTrue(tc, 8 == md.order[2]);
+    CuAssertTrue(tc, 1 == md.order[3]);
+    __submit(ios);
+    CuAssertTrue(tc, 3 == md.order[4]);
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_write_budget_is_per_submit(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "20", "1000");
+
+    __write(ios, 0, "0123456789");
+    __write(ios, 1, "0123456789");
+    __write(ios, 2, "0123456789");
+    CuAssertTrue(tc, 1 == __submit(ios));
+    CuAssertTrue(tc, 2 == md.writes);
+    CuAssertTrue(tc, 0 == __submit(ios));
+    CuAssertTrue(tc, 3 == md.writes);
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_full_queue_writes_synchronously(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "1000", "20");
+
+    __write(ios, 0, "0123456789");
+    __write(ios, 1, "0123456789");
+    CuAssertTrue(tc, 0 == md.writes);
+    __write(ios, 2, "0123456789");
+    CuAssertTrue(tc, 1 == md.writes);
+    CuAssertTrue(tc, 20 == bt_iosched_get_queued_write_bytes(ios));
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_read_of_queued_write_sees_new_data(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "1000", "1000");
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = 10 };
+    bt_block_t part = { .piece_idx = 1, .offset = 2, .len = 3 };
+
+    __write(ios, 1, "0123456789");
+    CuAssertTrue(tc, 0 == strncmp(bt_iosched_get_blockrw(ios)->read_block(
+                ios, NULL, &b), "0123456789", 10));
+    CuAssertTrue(tc, 0 == md.writes);
+
+    /* partial overlaps are written out first */
+    CuAssertTrue(tc, 0 == strncmp(bt_iosched_get_blockrw(ios)->read_block(
+                ios, NULL, &part), "234", 3));
+    CuAssertTrue(tc, 1 == md.writes);
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_queued_reads_are_served_before_writes(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "1000", "1000");
+    bt_blockrw_i* irw;
+    bt_block_t b = { .piece_idx = 3, .offset = 0, .len = 10 };
+
+    irw = bt_iosched_get_blockrw(ios);
+    memcpy(md.data + 3 * PIECE_LEN, "abcdefghij", 10);
+    __write(ios, 1, "0123456789");
+    CuAssertTrue(tc, 1 == irw->prefetch_block(ios, NULL, &b));
+    CuAssertTrue(tc, 10 == bt_iosched_get_queued_read_bytes(ios));
+    __submit(ios);
+    CuAssertTrue(tc, 1 == md.reads);
+    CuAssertTrue(tc, 0 == bt_iosched_get_queued_read_bytes(ios));
+
+    /* the read was made during submit */
+    CuAssertTrue(tc, 0 == strncmp(irw->read_block(ios, NULL, &b),
+                                  "abcdefghij", 10));
+    CuAssertTrue(tc, 1 == md.reads);
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_read_queue_is_bounded(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "15", "1000", "1000");
+    bt_blockrw_i* irw;
+    bt_block_t a = { .piece_idx = 3, .offset = 0, .len = 10 };
+    bt_block_t b = { .piece_idx = 4, .offset = 0, .len = 10 };
+
+    irw = bt_iosched_get_blockrw(ios);
+    CuAssertTrue(tc, 1 == irw->prefetch_block(ios, NULL, &a));
+    CuAssertTrue(tc, 1 == irw->prefetch_block(ios, NULL, &a));
+    CuAssertTrue(tc, 0 == irw->prefetch_block(ios, NULL, &b));
+    bt_iosched_free(ios);
+}
+
+void TestBT_iosched_free_writes_out_queue(CuTest * tc)
+{
+    mockdisk_t md;
+    void *ios = __sched_new(&md, "1000", "1000", "1000");
+
+    __write(ios, 1, "0123456789");
+    __write(ios, 2, "0123456789");
+    bt_iosched_free(ios);
+    CuAssertTrue(tc, 2 == md.writes);
+}
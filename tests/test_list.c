@@ -0,0 +1,72 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include "bt_list.h"
+
+typedef struct
+{
+    int id;
+    bt_list_t link;
+} item_t;
+
+void TestBT_list_new_is_empty(
+    CuTest * tc
+)
+{
+    bt_list_t l;
+
+    bt_list_init(&l);
+    CuAssertTrue(tc, 1 == bt_list_empty(&l));
+    CuAssertTrue(tc, NULL == bt_list_pop_head(&l));
+}
+
+void TestBT_list_pops_in_order_pushed(
+    CuTest * tc
+)
+{
+    item_t items[3] = { { .id = 0 }, { .id = 1 }, { .id = 2 } };
+    bt_list_t l;
+    int i;
+
+    bt_list_init(&l);
+    for (i = 0; i < 3; i++)
+        bt_list_push_tail(&l, &items[i].link);
+    CuAssertTrue(tc, 0 == bt_list_empty(&l));
+
+    for (i = 0; i < 3; i++)
+    {
+        bt_list_t* link = bt_list_pop_head(&l);
+
+        CuAssertTrue(tc, i == bt_list_item(link, item_t, link)->id);
+        CuAssertTrue(tc, 0 == bt_list_linked(link));
+    }
+    CuAssertTrue(tc, 1 == bt_list_empty(&l));
+}
+
+void TestBT_list_remove_from_middle(
+    CuTest * tc
+)
+{
+    item_t items[3] = { { .id = 0 }, { .id = 1 }, { .id = 2 } };
+    bt_list_t l;
+    int i;
+
+    bt_list_init(&l);
+    for (i = 0; i < 3; i++)
+        bt_list_push_tail(&l, &items[i].link);
+
+    bt_list_remove(&items[1].link);
+    CuAssertTrue(tc, 0 == bt_list_linked(&items[1].link));
+
+    /* removing again does nothing */
+    bt_list_remove(&items[1].link);
+
+    CuAssertTrue(tc, &items[0].link == bt_list_pop_head(&l));
+    CuAssertTrue(tc, &items[2].link == bt_list_pop_head(&l));
+    CuAssertTrue(tc, NULL == bt_list_pop_head(&l));
+}
@@ -0,0 +1,225 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_lsd.h"
+
+typedef struct
+{
+    /* the last datagram sent */
+    char sent[2048];
+    unsigned int nsent;
+    int nsends;
+
+    char infohash[20];
+    char ip[32];
+    int port;
+    int nfound;
+} __net_t;
+
+static int __send(void* udata, const char* buf, unsigned int len)
+{
+    __net_t* n = udata;
+
+    memcpy(n->sent, buf, len);
+    n->sent[len] = '\0';
+    n->nsent = len;
+    n->nsends++;
+    return 1;
+}
+
+static void __found_peer(void* udata, const char* infohash, const char* ip,
+                         int port)
+{
+    __net_t* n = udata;
+
+    memcpy(n->infohash, infohash, 20);
+    strcpy(n->ip, ip);
+    n->port = port;
+    n->nfound++;
+}
+
+static void* __lsd(__net_t* n, int port)
+{
+    void* lsd = bt_lsd_new(port);
+
+    memset(n, 0, sizeof(__net_t));
+    bt_lsd_set_cbs(lsd, &((bt_lsd_cbs_t) {
+                          .send = __send,
+                          .found_peer = __found_peer }), n);
+    return lsd;
+}
+
+void TestBTLsd_announce_names_the_torrent_and_port(
+    CuTest * tc
+)
+{
+    __net_t n;
+    void* lsd = __lsd(&n, 6881);
+
+    CuAssertTrue(tc, 1 == bt_lsd_add_torrent(lsd, "\x01\x23\x45\x67\x89"
+                                             "\xab\xcd\xef\x00\x11\x22\x33"
+                                             "\x44\x55\x66\x77\x88\x99\xaa"
+                                             "\xbb"));
+    CuAssertTrue(tc, 1 == bt_lsd_periodic(lsd, 0));
+    CuAssertTrue(tc, 0 == strncmp(n.sent, "BT-SEARCH * HTTP/1.1\r\n", 22));
+    CuAssertTrue(tc, NULL != strstr(n.sent,
+                                    "\r\nHost: 239.192.152.143:6771\r\n"));
+    CuAssertTrue(tc, NULL != strstr(n.sent, "\r\nPort: 6881\r\n"));
+    CuAssertTrue(tc, NULL != strstr(n.sent,
+        "\r\nInfohash: 0123456789abcdef00112233445566778899aabb\r\n"));
+    CuAssertTrue(tc, NULL != strstr(n.sent, "\r\ncookie: "));
+    CuAssertTrue(tc, 0 == strcmp(n.sent + n.nsent - 4, "\r\n\r\n"));
+    bt_lsd_free(lsd);
+}
+
+void TestBTLsd_peer_with_same_torrent_is_found(
+    CuTest * tc
+)
+{
+    __net_t a, b;
+    void *la = __lsd(&a, 6881), *lb = __lsd(&b, 7000);
+
+    bt_lsd_add_torrent(la, "aaaaaaaaaaaaaaaaaaaa");
+    bt_lsd_add_torrent(la, "bbbbbbbbbbbbbbbbbbbb");
+    bt_lsd_add_torrent(lb, "bbbbbbbbbbbbbbbbbbbb");
+    CuAssertTrue(tc, 1 == bt_lsd_periodic(la, 0));
+
+    CuAssertTrue(tc, 1 == bt_lsd_dispatch_from_buffer(lb, a.sent, a.nsent,
+                                                      "10.0.0.2"));
+    CuAssertTrue(tc, 1 == b.nfound);
+    CuAssertTrue(tc, 0 == memcmp(b.infohash, "bbbbbbbbbbbbbbbbbbbb", 20));
+    CuAssertTrue(tc, 0 == strcmp(b.ip, "10.0.0.2"));
+    CuAssertTrue(tc, 6881 == b.port);
+    bt_lsd_free(la);
+    bt_lsd_free(lb);
+}
+
+void TestBTLsd_own_announce_is_ignored(
+    CuTest * tc
+)
+{
+    __net_t n;
+    void* lsd = __lsd(&n, 6881);
+
+    bt_lsd_add_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa");
+    bt_lsd_periodic(lsd, 0);
+    CuAssertTrue(tc, 0 == bt_lsd_dispatch_from_buffer(lsd, n.sent, n.nsent,
+                                                      "10.0.0.1"));
+    CuAssertTrue(tc, 0 == n.nfound);
+    bt_lsd_free(lsd);
+}
+
+void TestBTLsd_announces_are_spaced_out(
+    CuTest * tc
+)
+{
+    __net_t n;
+    void* lsd = __lsd(&n, 6881);
+
+    bt_lsd_add_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa");
+    CuAssertTrue(tc, 1 == bt_lsd_periodic(lsd, 10000));
+
+    /* a torrent added now waits out the gap */
+    bt_lsd_add_torrent(lsd, "bbbbbbbbbbbbbbbbbbbb");
+    CuAssertTrue(tc, 0 == bt_lsd_periodic(lsd, 10000 + BT_LSD_GAP_MS - 1));
+    CuAssertTrue(tc, 1 == bt_lsd_periodic(lsd, 10000 + BT_LSD_GAP_MS));
+    CuAssertTrue(tc, NULL == strstr(n.sent, "6161616161"));
+    CuAssertTrue(tc, NULL != strstr(n.sent, "6262626262"));
+
+    /* nothing's due until the interval passes */
+    CuAssertTrue(tc, 0 == bt_lsd_periodic(lsd, 10000 + BT_LSD_GAP_MS * 5));
+    CuAssertTrue(tc, 1 == bt_lsd_periodic(lsd, 10000 + BT_LSD_INTERVAL_MS));
+    CuAssertTrue(tc, NULL != strstr(n.sent, "6161616161"));
+    CuAssertTrue(tc, 3 == n.nsends);
+    bt_lsd_free(lsd);
+}
+
+void TestBTLsd_many_torrents_fill_several_datagrams(
+    CuTest * tc
+)
+{
+    __net_t n;
+    void* lsd = __lsd(&n, 6881);
+    char infohash[20];
+    int i, total = 0;
+    unsigned long long now = 0;
+
+    for (i = 0; i < 60; i++)
+    {
+        memset(infohash, i, sizeof(infohash));
+        bt_lsd_add_torrent(lsd, infohash);
+    }
+
+    while (bt_lsd_periodic(lsd, now))
+    {
+        char* l;
+
+        CuAssertTrue(tc, n.nsent <= 1400);
+        for (l = n.sent; (l = strstr(l, "Infohash: ")); l++)
+            total++;
+        now += BT_LSD_GAP_MS;
+    }
+    CuAssertTrue(tc, 60 == total);
+    CuAssertTrue(tc, 3 == n.nsends);
+    bt_lsd_free(lsd);
+}
+
+void TestBTLsd_malformed_announces_are_rejected(
+    CuTest * tc
+)
+{
+    __net_t n;
+    void* lsd = __lsd(&n, 6881);
+    char* bad[] = {
+        "GET / HTTP/1.1\r\n\r\n",
+        /* no port */
+        "BT-SEARCH * HTTP/1.1\r\n"
+        "Infohash: 6161616161616161616161616161616161616161\r\n\r\n",
+        "BT-SEARCH * HTTP/1.1\r\nPort: 70000\r\n"
+        "Infohash: 6161616161616161616161616161616161616161\r\n\r\n",
+    };
+    char* short_hash = "BT-SEARCH * HTTP/1.1\r\nPort: 6881\r\n"
+        "Infohash: 61616161616161616161616161616161616161\r\n\r\n";
+    int i;
+
+    bt_lsd_add_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa");
+    for (i = 0; i < 3; i++)
+        CuAssertTrue(tc, -1 == bt_lsd_dispatch_from_buffer(lsd, bad[i],
+                                                           strlen(bad[i]),
+                                                           "10.0.0.2"));
+    CuAssertTrue(tc, 0 == bt_lsd_dispatch_from_buffer(lsd, short_hash,
+                                                      strlen(short_hash),
+                                                      "10.0.0.2"));
+    CuAssertTrue(tc, 0 == n.nfound);
+
+    /* header names aren't case sensitive */
+    short_hash = "BT-SEARCH * HTTP/1.1\r\nport: 6881\r\n"
+        "INFOHASH: 6161616161616161616161616161616161616161\r\n\r\n";
+    CuAssertTrue(tc, 1 == bt_lsd_dispatch_from_buffer(lsd, short_hash,
+                                                      strlen(short_hash),
+                                                      "10.0.0.2"));
+    bt_lsd_free(lsd);
+}
+
+void TestBTLsd_removed_torrent_isnt_announced(
+    CuTest * tc
+)
+{
+    __net_t n;
+    void* lsd = __lsd(&n, 6881);
+
+    bt_lsd_add_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa");
+    CuAssertTrue(tc, 0 == bt_lsd_add_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa"));
+    CuAssertTrue(tc, 1 == bt_lsd_remove_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa"));
+    CuAssertTrue(tc, 0 == bt_lsd_remove_torrent(lsd, "aaaaaaaaaaaaaaaaaaaa"));
+    CuAssertTrue(tc, 0 == bt_lsd_periodic(lsd, 0));
+    bt_lsd_free(lsd);
+}
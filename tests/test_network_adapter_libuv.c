@@ -0,0 +1,271 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "bt.h"
+#include "bt_capture.h"
+#include "network_adapter.h"
+#include "network_adapter_libuv.h"
+
+#include "config.h"
+
+#define PORT 31415
+
+typedef struct
+{
+    void* nethandle;
+    char received[256];
+    unsigned int nreceived;
+    int connected;
+    int failed;
+} end_t;
+
+static int __data(void *caller, void* nethandle, const char* buf,
+                  unsigned int len)
+{
+    end_t* e = caller;
+
+    memcpy(e->received + e->nreceived, buf, len);
+    e->nreceived += len;
+    return 1;
+}
+
+static int __connected(void *caller, void* nethandle, char *ip, int port)
+{
+    end_t* e = caller;
+
+    e->nethandle = nethandle;
+    e->connected = 1;
+    return 1;
+}
+
+static int __refuse(void *caller, void* nethandle, char *ip, int port)
+{
+    return 0;
+}
+
+static void __failed(void *caller, void* nethandle)
+{
+    end_t* e = caller;
+
+    e->failed++;
+}
+
+/**
+ * Run the loop until *flag is set, or we give up */
+static void __run_until(uv_loop_t* loop, int* flag)
+{
+    int i;
+
+    for (i = 0; i < 1000 && !*flag; i++)
+        uv_run(loop, UV_RUN_NOWAIT);
+}
+
+static void __run_until_received(uv_loop_t* loop, end_t* e, unsigned int n)
+{
+    int i;
+
+    for (i = 0; i < 1000 && e->nreceived < n; i++)
+        uv_run(loop, UV_RUN_NOWAIT);
+}
+
+static void __connect(CuTest * tc, uv_loop_t* loop, void** s, void** c,
+                      end_t* server, end_t* client)
+{
+    memset(server, 0, sizeof(end_t));
+    memset(client, 0, sizeof(end_t));
+    *s = network_adapter_libuv_new(loop);
+    *c = network_adapter_libuv_new(loop);
+    CuAssertTrue(tc, 1 == network_adapter_libuv_listen(*s, server, PORT,
+                                                       __data, __connected,
+                                                       __failed));
+    CuAssertTrue(tc, 1 == peer_connect(client, c, &client->nethandle,
+                                       "127.0.0.1", PORT, __data,
+                                       __connected, __failed));
+    __run_until(loop, &client->connected);
+    __run_until(loop, &server->connected);
+}
+
+static void __free(uv_loop_t* loop, void* s, void* c)
+{
+    network_adapter_libuv_free(s);
+    network_adapter_libuv_free(c);
+    uv_run(loop, UV_RUN_NOWAIT);
+    uv_loop_close(loop);
+}
+
+void TestNetworkAdapterLibuv_sends_arrive_in_order(
+    CuTest * tc
+)
+{
+    uv_loop_t loop;
+    void *s, *c;
+    end_t server, client;
+    bt_iovec_t iov[2];
+    char hdr[6];
+
+    uv_loop_init(&loop);
+    __connect(tc, &loop, &s, &c, &server, &client);
+    CuAssertTrue(tc, 1 == client.connected);
+    CuAssertTrue(tc, 1 == server.connected);
+
+    strcpy(hdr, "world");
+    CuAssertTrue(tc, 1 == peer_send(&client, &c, client.nethandle,
+                                    "hello ", 6));
+    iov[0].base = hdr;
+    iov[0].len = 5;
+    iov[1].base = "!";
+    iov[1].len = 1;
+    CuAssertTrue(tc, 1 == peer_sendv(&client, &c, client.nethandle, iov, 2));
+
+    /* the header is copied */
+    memset(hdr, 0, sizeof(hdr));
+    CuAssertTrue(tc, 12 == peer_get_queued_bytes(&client, &c,
+                                                 client.nethandle));
+
+    __run_until_received(&loop, &server, 12);
+    CuAssertTrue(tc, 12 == server.nreceived);
+    CuAssertTrue(tc, 0 == memcmp(server.received, "hello world!", 12));
+    CuAssertTrue(tc, 0 == peer_get_queued_bytes(&client, &c,
+                                                client.nethandle));
+    __free(&loop, s, c);
+}
+
+void TestNetworkAdapterLibuv_queue_drains_as_it_is_written(
+    CuTest * tc
+)
+{
+    uv_loop_t loop;
+    void *s, *c;
+    end_t server, client;
+    bt_iovec_t iov[2] = { { "012", 3 }, { "3456789", 7 } };
+
+    uv_loop_init(&loop);
+    __connect(tc, &loop, &s, &c, &server, &client);
+
+    CuAssertTrue(tc, 0 == peer_get_queued_bytes(&client, &c,
+                                                client.nethandle));
+    peer_sendv(&client, &c, client.nethandle, iov, 2);
+    peer_send(&client, &c, client.nethandle, "abc", 3);
+    CuAssertTrue(tc, 13 == peer_get_queued_bytes(&client, &c,
+                                                 client.nethandle));
+
+    __run_until_received(&loop, &server, 13);
+    CuAssertTrue(tc, 0 == memcmp(server.received, "0123456789abc", 13));
+    CuAssertTrue(tc, 0 == peer_get_queued_bytes(&client, &c,
+                                                client.nethandle));
+    __free(&loop, s, c);
+}
+
+void TestNetworkAdapterLibuv_disconnect_is_seen_by_other_end(
+    CuTest * tc
+)
+{
+    uv_loop_t loop;
+    void *s, *c;
+    end_t server, client;
+
+    uv_loop_init(&loop);
+    __connect(tc, &loop, &s, &c, &server, &client);
+
+    CuAssertTrue(tc, 1 == peer_disconnect(&client, &c, client.nethandle));
+    CuAssertTrue(tc, 0 == network_adapter_libuv_get_nconnections(c));
+    __run_until(&loop, &server.failed);
+    CuAssertTrue(tc, 1 == server.failed);
+
+    /* we aren't told about connections we disconnected */
+    CuAssertTrue(tc, 0 == client.failed);
+
+    /* the connection is gone, but its id is still safe to use */
+    CuAssertTrue(tc, 0 == peer_disconnect(&client, &c, client.nethandle));
+    CuAssertTrue(tc, 0 == peer_send(&client, &c, client.nethandle, "x", 1));
+
+    /* the server's end closed itself */
+    CuAssertTrue(tc, 0 == network_adapter_libuv_get_nconnections(s));
+    CuAssertTrue(tc, 0 == peer_disconnect(&server, &s, server.nethandle));
+    __free(&loop, s, c);
+}
+
+void TestNetworkAdapterLibuv_refused_connection_is_closed(
+    CuTest * tc
+)
+{
+    uv_loop_t loop;
+    void *s, *c;
+    end_t server, client;
+
+    uv_loop_init(&loop);
+    memset(&server, 0, sizeof(end_t));
+    memset(&client, 0, sizeof(end_t));
+    s = network_adapter_libuv_new(&loop);
+    c = network_adapter_libuv_new(&loop);
+    network_adapter_libuv_listen(s, &server, PORT, __data, __refuse,
+                                 __failed);
+    peer_connect(&client, &c, &client.nethandle, "127.0.0.1", PORT, __data,
+                 __connected, __failed);
+    __run_until(&loop, &client.failed);
+    CuAssertTrue(tc, 1 == client.failed);
+    CuAssertTrue(tc, 0 == network_adapter_libuv_get_nconnections(s));
+    CuAssertTrue(tc, 0 == server.failed);
+    peer_disconnect(&client, &c, client.nethandle);
+    __free(&loop, s, c);
+}
+
+void TestNetworkAdapterLibuv_capture_records_inbound_bytes(
+    CuTest * tc
+)
+{
+    uv_loop_t loop;
+    void *s, *c, *cap;
+    end_t server, client, replayed;
+
+    uv_loop_init(&loop);
+    __connect(tc, &loop, &s, &c, &server, &client);
+    cap = bt_capture_open("test_network_adapter_libuv.tmp");
+    CuAssertPtrNotNull(tc, cap);
+    network_adapter_libuv_set_capture(s, cap);
+
+    peer_send(&client, &c, client.nethandle, "abc", 3);
+    __run_until_received(&loop, &server, 3);
+    peer_send(&client, &c, client.nethandle, "def", 3);
+    __run_until_received(&loop, &server, 6);
+
+    /* the connection was made before we started; the new one is known */
+    peer_disconnect(&client, &c, client.nethandle);
+    __run_until(&loop, &server.failed);
+    network_adapter_libuv_free(c);
+    c = network_adapter_libuv_new(&loop);
+    memset(&client, 0, sizeof(end_t));
+    memset(&server, 0, sizeof(end_t));
+    peer_connect(&client, &c, &client.nethandle, "127.0.0.1", PORT, __data,
+                 __connected, __failed);
+    __run_until(&loop, &server.connected);
+    peer_send(&client, &c, client.nethandle, "ghi", 3);
+    __run_until_received(&loop, &server, 3);
+    __free(&loop, s, c);
+    bt_capture_close(cap);
+
+    memset(&replayed, 0, sizeof(end_t));
+    CuAssertTrue(tc, 3 == bt_capture_replay("test_network_adapter_libuv.tmp",
+                            &((bt_capture_replay_i) {
+                                .process_data = __data,
+                                .process_connection = __connected,
+                                .connection_failed = __failed
+                            }), &replayed));
+    CuAssertTrue(tc, 1 == replayed.connected);
+    CuAssertTrue(tc, 3 == replayed.nreceived);
+    CuAssertTrue(tc, 0 == memcmp(replayed.received, "ghi", 3));
+
+    /* the adapter closed it on the way out */
+    CuAssertTrue(tc, 1 == replayed.failed);
+    remove("test_network_adapter_libuv.tmp");
+}
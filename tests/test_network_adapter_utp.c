@@ -0,0 +1,320 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "network_adapter_utp.h"
+
+#include "config.h"
+
+#define PORT 31416
+
+typedef struct
+{
+    void* nethandle;
+    char* received;
+    unsigned int nreceived;
+    int connected;
+    int failed;
+} end_t;
+
+static int __data(void *caller, void* nethandle, const char* buf,
+                  unsigned int len)
+{
+    end_t* e = caller;
+
+    e->received = realloc(e->received, e->nreceived + len);
+    memcpy(e->received + e->nreceived, buf, len);
+    e->nreceived += len;
+    return 1;
+}
+
+static int __connected(void *caller, void* nethandle, char *ip, int port)
+{
+    end_t* e = caller;
+
+    e->nethandle = nethandle;
+    e->connected = 1;
+    return 1;
+}
+
+static int __refuse(void *caller, void* nethandle, char *ip, int port)
+{
+    return 0;
+}
+
+static void __failed(void *caller, void* nethandle)
+{
+    end_t* e = caller;
+
+    e->failed++;
+}
+
+static void __poll(void* s, void* c)
+{
+    network_adapter_utp_poll(c);
+    network_adapter_utp_poll(s);
+}
+
+/**
+ * Poll both ends until *flag is set, or we give up */
+static void __run_until(void* s, void* c, int* flag)
+{
+    int i;
+
+    for (i = 0; i < 1000 && !*flag; i++)
+    {
+        __poll(s, c);
+        usleep(100);
+    }
+}
+
+static void __run_until_received(void* s, void* c, end_t* e, unsigned int n)
+{
+    int i;
+
+    for (i = 0; i < 100000 && e->nreceived < n; i++)
+        __poll(s, c);
+}
+
+static void __connect(CuTest * tc, void** s, void** c, end_t* server,
+                      end_t* client)
+{
+    memset(server, 0, sizeof(end_t));
+    memset(client, 0, sizeof(end_t));
+    *s = network_adapter_utp_new();
+    *c = network_adapter_utp_new();
+    CuAssertTrue(tc, 1 == network_adapter_utp_listen(*s, server, PORT,
+                                                     __data, __connected,
+                                                     __failed));
+    CuAssertTrue(tc, 1 == network_adapter_utp_connect(client, c,
+                                                      &client->nethandle,
+                                                      "127.0.0.1", PORT,
+                                                      __data, __connected,
+                                                      __failed));
+    __run_until(*s, *c, &client->connected);
+    CuAssertTrue(tc, 1 == client->connected);
+    CuAssertTrue(tc, 1 == server->connected);
+}
+
+static void __free(void* s, void* c, end_t* server, end_t* client)
+{
+    network_adapter_utp_free(s);
+    network_adapter_utp_free(c);
+    free(server->received);
+    free(client->received);
+}
+
+void TestNetworkAdapterUtp_sends_arrive_in_order(
+    CuTest * tc
+)
+{
+    void *s, *c;
+    end_t server, client;
+    bt_iovec_t iov[2];
+    char hdr[6];
+
+    __connect(tc, &s, &c, &server, &client);
+
+    strcpy(hdr, "world");
+    CuAssertTrue(tc, 1 == network_adapter_utp_send(&client, &c,
+                                                   client.nethandle,
+                                                   "hello ", 6));
+    iov[0].base = hdr;
+    iov[0].len = 5;
+    iov[1].base = "!";
+    iov[1].len = 1;
+    CuAssertTrue(tc, 1 == network_adapter_utp_sendv(&client, &c,
+                                                    client.nethandle,
+                                                    iov, 2));
+
+    /* the data is copied */
+    memset(hdr, 0, sizeof(hdr));
+    CuAssertTrue(tc, 12 == network_adapter_utp_get_queued_bytes(
+                     &client, &c, client.nethandle));
+
+    __run_until_received(s, c, &server, 12);
+    CuAssertTrue(tc, 12 == server.nreceived);
+    CuAssertTrue(tc, 0 == memcmp(server.received, "hello world!", 12));
+
+    /* the ack has to come back before the queue is empty */
+    __poll(s, c);
+    CuAssertTrue(tc, 0 == network_adapter_utp_get_queued_bytes(
+                     &client, &c, client.nethandle));
+
+    /* and the other way */
+    network_adapter_utp_send(&server, &s, server.nethandle, "pong", 4);
+    __run_until_received(s, c, &client, 4);
+    CuAssertTrue(tc, 0 == memcmp(client.received, "pong", 4));
+    __free(s, c, &server, &client);
+}
+
+void TestNetworkAdapterUtp_large_send_arrives_intact_and_window_grows(
+    CuTest * tc
+)
+{
+    void *s, *c;
+    end_t server, client;
+    network_adapter_utp_stats_t stats;
+    unsigned int i, len = 1 << 20;
+    char* data = malloc(len);
+
+    __connect(tc, &s, &c, &server, &client);
+    for (i = 0; i < len; i++)
+        data[i] = (char)(i * 31 + i / 1400);
+
+    network_adapter_utp_send(&client, &c, client.nethandle, data, len);
+    __run_until_received(s, c, &server, len);
+    CuAssertTrue(tc, len == server.nreceived);
+    CuAssertTrue(tc, 0 == memcmp(server.received, data, len));
+
+    /* the loopback has no queue to speak of */
+    CuAssertTrue(tc, 1 == network_adapter_utp_get_stats(c, client.nethandle,
+                                                         &stats));
+    CuAssertTrue(tc, 2 * 1380 < stats.window);
+    CuAssertTrue(tc, 0 < stats.rtt_us);
+    free(data);
+    __free(s, c, &server, &client);
+}
+
+void TestNetworkAdapterUtp_window_shrinks_when_delay_passes_target(
+    CuTest * tc
+)
+{
+    void *s, *c;
+    end_t server, client;
+    network_adapter_utp_stats_t before, after;
+    char data[1380 * 4];
+    unsigned int n;
+    int i;
+
+    __connect(tc, &s, &c, &server, &client);
+    config_set(network_adapter_utp_get_config(c), "utp_target_delay_ms",
+               "20");
+    memset(data, 'x', sizeof(data));
+
+    /* a few quick round trips for the base delay */
+    for (i = 0, n = 0; i < 20; i++)
+    {
+        network_adapter_utp_send(&client, &c, client.nethandle, data,
+                                 sizeof(data));
+        n += sizeof(data);
+        __run_until_received(s, c, &server, n);
+    }
+    __poll(s, c);
+    network_adapter_utp_get_stats(c, client.nethandle, &before);
+
+    /* the server is slow to read, so our packets queue up in front of it */
+    for (i = 0; i < 3; i++)
+    {
+        network_adapter_utp_send(&client, &c, client.nethandle, data,
+                                 sizeof(data));
+        n += sizeof(data);
+        network_adapter_utp_poll(c);
+        usleep(60000);
+        __run_until_received(s, c, &server, n);
+        network_adapter_utp_poll(c);
+    }
+    network_adapter_utp_get_stats(c, client.nethandle, &after);
+    CuAssertTrue(tc, 20000 < after.queueing_us);
+    CuAssertTrue(tc, after.window < before.window);
+    __free(s, c, &server, &client);
+}
+
+void TestNetworkAdapterUtp_disconnect_is_seen_by_other_end(
+    CuTest * tc
+)
+{
+    void *s, *c;
+    end_t server, client;
+
+    __connect(tc, &s, &c, &server, &client);
+
+    CuAssertTrue(tc, 1 == network_adapter_utp_disconnect(&client, &c,
+                                                         client.nethandle));
+    CuAssertTrue(tc, 0 == network_adapter_utp_get_nconnections(c));
+    __run_until(s, c, &server.failed);
+    CuAssertTrue(tc, 1 == server.failed);
+
+    /* we aren't told about connections we disconnected */
+    CuAssertTrue(tc, 0 == client.failed);
+
+    /* the connection is gone, but its id is still safe to use */
+    CuAssertTrue(tc, 0 == network_adapter_utp_disconnect(&client, &c,
+                                                         client.nethandle));
+    CuAssertTrue(tc, 0 == network_adapter_utp_send(&client, &c,
+                                                   client.nethandle, "x", 1));
+
+    /* the server's end closed itself */
+    CuAssertTrue(tc, 0 == network_adapter_utp_get_nconnections(s));
+    CuAssertTrue(tc, 0 == network_adapter_utp_disconnect(&server, &s,
+                                                         server.nethandle));
+    __free(s, c, &server, &client);
+}
+
+void TestNetworkAdapterUtp_refused_connection_is_reset(
+    CuTest * tc
+)
+{
+    void *s, *c;
+    end_t server, client;
+
+    memset(&server, 0, sizeof(end_t));
+    memset(&client, 0, sizeof(end_t));
+    s = network_adapter_utp_new();
+    c = network_adapter_utp_new();
+    network_adapter_utp_listen(s, &server, PORT, __data, __refuse, __failed);
+    network_adapter_utp_connect(&client, &c, &client.nethandle, "127.0.0.1",
+                                PORT, __data, __connected, __failed);
+    __run_until(s, c, &client.failed);
+    CuAssertTrue(tc, 1 == client.failed);
+    CuAssertTrue(tc, 0 == client.connected);
+    CuAssertTrue(tc, 0 == network_adapter_utp_get_nconnections(s));
+    CuAssertTrue(tc, 0 == server.failed);
+    network_adapter_utp_disconnect(&client, &c, client.nethandle);
+    __free(s, c, &server, &client);
+}
+
+void TestNetworkAdapterUtp_unanswered_connect_times_out(
+    CuTest * tc
+)
+{
+    void *c;
+    end_t client;
+    int i;
+
+    memset(&client, 0, sizeof(end_t));
+    c = network_adapter_utp_new();
+    config_set(network_adapter_utp_get_config(c), "utp_initial_rto_ms", "5");
+    config_set(network_adapter_utp_get_config(c), "utp_max_timeouts", "2");
+
+    /* nobody is listening */
+    CuAssertTrue(tc, 1 == network_adapter_utp_connect(&client, &c,
+                                                      &client.nethandle,
+                                                      "127.0.0.1", PORT,
+                                                      __data, __connected,
+                                                      __failed));
+    for (i = 0; i < 1000 && !client.failed; i++)
+    {
+        network_adapter_utp_poll(c);
+        usleep(1000);
+    }
+    CuAssertTrue(tc, 1 == client.failed);
+    CuAssertTrue(tc, 0 == network_adapter_utp_get_nconnections(c));
+
+    /* host names aren't resolved */
+    CuAssertTrue(tc, 0 == network_adapter_utp_connect(&client, &c,
+                                                      &client.nethandle,
+                                                      "localhost", PORT,
+                                                      __data, __connected,
+                                                      __failed));
+    network_adapter_utp_free(c);
+}
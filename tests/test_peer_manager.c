@@ -95,3 +95,200 @@ void T_estPM_emovePeer(
 }
 #endif
 
+
+void TestPM_conn_ctx_finds_peer(
+    CuTest * tc
+)
+{
+    void *pm, *ctx = malloc(1);
+    bt_peer_t* peer;
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1";
+
+    pm = bt_peermanager_new(NULL);
+    peer = bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip),
+                                   4000);
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip), 4001);
+    bt_peermanager_set_conn_ctx(pm, peer, ctx);
+    CuAssertTrue(tc, peer == bt_peermanager_conn_ctx_to_peer(pm, ctx));
+}
+
+void TestPM_conn_ctx_set_outside_manager_finds_peer(
+    CuTest * tc
+)
+{
+    void *pm, *ctx = malloc(1);
+    bt_peer_t* peer;
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1";
+
+    pm = bt_peermanager_new(NULL);
+    peer = bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip),
+                                   4000);
+    peer->conn_ctx = ctx;
+    CuAssertTrue(tc, peer == bt_peermanager_conn_ctx_to_peer(pm, ctx));
+}
+
+void TestPM_pc_finds_peer(
+    CuTest * tc
+)
+{
+    void *pm, *pc = malloc(1);
+    bt_peer_t* peer;
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1";
+
+    pm = bt_peermanager_new(NULL);
+    peer = bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip),
+                                   4000);
+    bt_peermanager_set_pc(pm, peer, pc);
+    CuAssertTrue(tc, peer == bt_peermanager_get_peer_from_pc(pm, pc));
+}
+
+void TestPM_removed_peer_isnt_found(
+    CuTest * tc
+)
+{
+    void *pm, *pc = malloc(1), *ctx = malloc(1);
+    bt_peer_t* peer;
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1";
+
+    pm = bt_peermanager_new(NULL);
+    peer = bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip),
+                                   4000);
+    bt_peermanager_set_pc(pm, peer, pc);
+    bt_peermanager_set_conn_ctx(pm, peer, ctx);
+    bt_peermanager_remove_peer(pm, peer);
+    CuAssertTrue(tc, NULL == bt_peermanager_get_peer_from_pc(pm, pc));
+    CuAssertTrue(tc, NULL == bt_peermanager_conn_ctx_to_peer(pm, ctx));
+    CuAssertTrue(tc, 0 == bt_peermanager_contains(pm, ip, 4000));
+}
+
+void TestPM_ipv6_peer_is_keyed_by_address(
+    CuTest * tc
+)
+{
+    char *peerid = "0000000000000";
+    char *ip = "2001:db8::1", *same = "2001:0db8:0:0::1";
+    void *pm =  bt_peermanager_new(NULL);
+
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip), 4000);
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), same, strlen(same),
+                            4000);
+    CuAssertTrue(tc, 1 == bt_peermanager_count(pm));
+    CuAssertTrue(tc, bt_peermanager_contains(pm, "[2001:db8::1]", 4000));
+    CuAssertTrue(tc, !bt_peermanager_contains(pm, ip, 4001));
+}
+
+void TestPM_ipv4_and_mapped_ipv4_are_the_same_peer(
+    CuTest * tc
+)
+{
+    char *peerid = "0000000000000";
+    char *ip = "10.0.0.1", *mapped = "::ffff:10.0.0.1";
+    void *pm =  bt_peermanager_new(NULL);
+
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip), 4000);
+    CuAssertTrue(tc, NULL == bt_peermanager_add_peer(pm, peerid,
+                                                     strlen(peerid), mapped,
+                                                     strlen(mapped), 4000));
+    CuAssertTrue(tc, 1 == bt_peermanager_count(pm));
+}
+
+void TestPM_host_names_are_keyed_by_name(
+    CuTest * tc
+)
+{
+    char *peerid = "0000000000000";
+    char *host = "peer.example.org";
+    void *pm =  bt_peermanager_new(NULL);
+
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), host, strlen(host),
+                            4000);
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), host, strlen(host),
+                            4000);
+    CuAssertTrue(tc, 1 == bt_peermanager_count(pm));
+    CuAssertTrue(tc, bt_peermanager_contains(pm, host, 4000));
+    CuAssertTrue(tc, !bt_peermanager_contains(pm, "127.0.0.1", 4000));
+}
+
+static void removeone(void* caller, void* peer, void* val)
+{
+    int* vali = val;
+    *vali += 1;
+    bt_peermanager_remove_peer(caller, peer);
+}
+
+void TestPM_forall_can_remove_the_peer_it_visits(
+    CuTest * tc
+)
+{
+    void *pm;
+    int i, mod = 0;
+    char *peerid = "0000000000000";
+    char ip[32];
+
+    pm =  bt_peermanager_new(NULL);
+    for (i = 0; i < 20; i++)
+    {
+        sprintf(ip, "10.0.0.%d", i);
+        bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip),
+                                4000);
+    }
+
+    bt_peermanager_forall(pm, pm, &mod, removeone);
+    CuAssertTrue(tc, 20 == mod);
+    CuAssertTrue(tc, 0 == bt_peermanager_count(pm));
+    CuAssertTrue(tc, !bt_peermanager_contains(pm, "10.0.0.3", 4000));
+}
+
+void TestPM_removal_keeps_other_peers(
+    CuTest * tc
+)
+{
+    void *pm;
+    bt_peer_t* first;
+    int mod = 0;
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1";
+
+    pm =  bt_peermanager_new(NULL);
+    first = bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip,
+                                    strlen(ip), 4000);
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip), 4001);
+    bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip), 4002);
+    bt_peermanager_remove_peer(pm, first);
+    bt_peermanager_remove_peer(pm, first);
+    bt_peermanager_forall(pm, NULL, &mod, addone);
+    CuAssertTrue(tc, 2 == mod);
+    CuAssertTrue(tc, bt_peermanager_contains(pm, ip, 4002));
+}
+
+static void countport(void* caller, void* peer, void* udata)
+{
+    int* seen = udata;
+
+    seen[((bt_peer_t*)peer)->port - 4000]++;
+}
+
+void TestPM_shards_visit_every_peer_once(
+    CuTest * tc
+)
+{
+    void *pm;
+    int i, shard, seen[7];
+    char *peerid = "0000000000000";
+    char *ip = "127.0.0.1";
+
+    pm =  bt_peermanager_new(NULL);
+    for (i = 0; i < 7; i++)
+        bt_peermanager_add_peer(pm, peerid, strlen(peerid), ip, strlen(ip),
+                                4000 + i);
+
+    memset(seen, 0, sizeof(seen));
+    for (shard = 0; shard < 3; shard++)
+        bt_peermanager_forall_shard(pm, NULL, seen, shard, 3, countport);
+    for (i = 0; i < 7; i++)
+        CuAssertTrue(tc, 1 == seen[i]);
+}
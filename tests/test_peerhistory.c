@@ -0,0 +1,137 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_peerhistory.h"
+
+void TestPH_new_history_is_empty(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(10);
+    char *ip = "10.0.0.1";
+
+    CuAssertTrue(tc, 0 == bt_peerhistory_count(h));
+    CuAssertTrue(tc, NULL == bt_peerhistory_get(h, ip, strlen(ip), 4000));
+    CuAssertTrue(tc, 1 == bt_peerhistory_may_connect(h, ip, strlen(ip), 4000,
+                                                     0));
+    bt_peerhistory_free(h);
+}
+
+void TestPH_failed_connects_back_off_exponentially(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(10);
+    char *ip = "10.0.0.1";
+    int len = strlen(ip);
+
+    bt_peerhistory_connect_failed(h, ip, len, 4000, 1000);
+    CuAssertTrue(tc, 0 == bt_peerhistory_may_connect(h, ip, len, 4000,
+                     1000 + BT_PEERHISTORY_BACKOFF_MS - 1));
+    CuAssertTrue(tc, 1 == bt_peerhistory_may_connect(h, ip, len, 4000,
+                     1000 + BT_PEERHISTORY_BACKOFF_MS));
+
+    bt_peerhistory_connect_failed(h, ip, len, 4000, 1000);
+    CuAssertTrue(tc, 0 == bt_peerhistory_may_connect(h, ip, len, 4000,
+                     1000 + 2 * BT_PEERHISTORY_BACKOFF_MS - 1));
+    CuAssertTrue(tc, 2 == bt_peerhistory_get(h, ip, len, 4000)->failures);
+
+    /* the same address on another port is another peer */
+    CuAssertTrue(tc, 1 == bt_peerhistory_may_connect(h, ip, len, 4001, 1000));
+    bt_peerhistory_free(h);
+}
+
+void TestPH_backoff_is_capped(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(10);
+    char *ip = "10.0.0.1";
+    int i, len = strlen(ip);
+
+    for (i = 0; i < 100; i++)
+        bt_peerhistory_connect_failed(h, ip, len, 4000, 0);
+    CuAssertTrue(tc, BT_PEERHISTORY_MAX_BACKOFF_MS ==
+                 bt_peerhistory_get(h, ip, len, 4000)->retry_ms);
+    bt_peerhistory_free(h);
+}
+
+void TestPH_useful_connection_forgives_failures(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(10);
+    char *ip = "10.0.0.1";
+    int len = strlen(ip);
+
+    bt_peerhistory_connect_failed(h, ip, len, 4000, 0);
+    bt_peerhistory_connected(h, ip, len, 4000, 10);
+    bt_peerhistory_disconnected(h, ip, len, 4000, 100, 50, 20, 20);
+    CuAssertTrue(tc, 0 == bt_peerhistory_get(h, ip, len, 4000)->failures);
+    CuAssertTrue(tc, 100 == bt_peerhistory_get(h, ip, len, 4000)->downloaded);
+    CuAssertTrue(tc, 50 == bt_peerhistory_get(h, ip, len, 4000)->uploaded);
+    CuAssertTrue(tc, 20 == bt_peerhistory_get(h, ip, len, 4000)->last_seen_ms);
+    CuAssertTrue(tc, 1 == bt_peerhistory_may_connect(h, ip, len, 4000, 20));
+    bt_peerhistory_free(h);
+}
+
+void TestPH_useless_connection_backs_off(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(10);
+    char *ip = "10.0.0.1";
+    int len = strlen(ip);
+
+    bt_peerhistory_connected(h, ip, len, 4000, 0);
+    bt_peerhistory_disconnected(h, ip, len, 4000, 0, 0, 0, 10);
+    CuAssertTrue(tc, 0 == bt_peerhistory_may_connect(h, ip, len, 4000, 10));
+    bt_peerhistory_free(h);
+}
+
+void TestPH_fast_peers_score_higher_and_bad_peers_lowest(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(10);
+    char *fast = "10.0.0.1", *slow = "10.0.0.2", *bad = "10.0.0.3",
+         *unknown = "10.0.0.4";
+
+    bt_peerhistory_disconnected(h, fast, strlen(fast), 4000, 1, 0, 1000, 0);
+    bt_peerhistory_disconnected(h, slow, strlen(slow), 4000, 1, 0, 10, 0);
+    bt_peerhistory_disconnected(h, bad, strlen(bad), 4000, 1, 0, 5000, 0);
+    bt_peerhistory_blacklisted(h, bad, strlen(bad), 4000);
+    CuAssertTrue(tc, bt_peerhistory_score(h, slow, strlen(slow), 4000) <
+                 bt_peerhistory_score(h, fast, strlen(fast), 4000));
+    CuAssertTrue(tc, 1 == bt_peerhistory_score(h, unknown, strlen(unknown),
+                                               4000));
+    CuAssertTrue(tc, 0 == bt_peerhistory_score(h, bad, strlen(bad), 4000));
+    bt_peerhistory_free(h);
+}
+
+void TestPH_least_recently_used_peer_is_forgotten(
+    CuTest * tc
+)
+{
+    void *h = bt_peerhistory_new(2);
+    char *a = "10.0.0.1", *b = "10.0.0.2", *c = "peer.example.org";
+
+    bt_peerhistory_connected(h, a, strlen(a), 4000, 0);
+    bt_peerhistory_connected(h, b, strlen(b), 4000, 0);
+    bt_peerhistory_connected(h, a, strlen(a), 4000, 1);
+    bt_peerhistory_connected(h, c, strlen(c), 4000, 2);
+    CuAssertTrue(tc, 2 == bt_peerhistory_count(h));
+    CuAssertTrue(tc, NULL != bt_peerhistory_get(h, a, strlen(a), 4000));
+    CuAssertTrue(tc, NULL == bt_peerhistory_get(h, b, strlen(b), 4000));
+    CuAssertTrue(tc, NULL != bt_peerhistory_get(h, c, strlen(c), 4000));
+    bt_peerhistory_free(h);
+}
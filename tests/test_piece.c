@@ -8,6 +8,7 @@
 #include "CuTest.h"
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "bt.h"
 #include "bitfield.h"
@@ -19,6 +20,7 @@
 
 #include "bt_piece_db.h"
 #include "bt_piece.h"
+#include "bt_sha256.h"
 
 #define HASH_EXAMPLE "00000000000000000000"
 
@@ -74,6 +76,82 @@ void TestBTPiece_pollBlockRequest_has_default_blockSize( CuTest * tc)
     CuAssertTrue(tc, req.len == BT_BLOCK_SIZE);
 }
 
+void TestBTPiece_pollBlockRequest_walks_every_block( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t req;
+    int i;
+
+    pce = bt_piece_new("00000000000000000000", 400000);
+    for (i = 0; !bt_piece_is_fully_requested(pce); i++)
+    {
+        bt_piece_poll_block_request(pce, &req);
+        CuAssertTrue(tc, req.offset == (unsigned int)i * (BT_BLOCK_SIZE));
+    }
+    CuAssertTrue(tc, 25 == i);
+    CuAssertTrue(tc, req.len == 400000 - 24 * (BT_BLOCK_SIZE));
+}
+
+void TestBTPiece_givenback_block_is_polled_again( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t req, blk;
+
+    pce = bt_piece_new("00000000000000000000", 400000);
+    bt_piece_poll_block_request(pce, &req);
+    bt_piece_poll_block_request(pce, &blk);
+    bt_piece_poll_block_request(pce, &req);
+    bt_piece_giveback_block(pce, &blk);
+    bt_piece_poll_block_request(pce, &req);
+    CuAssertTrue(tc, req.offset == blk.offset);
+    CuAssertTrue(tc, req.len == blk.len);
+}
+
+void TestBTPiece_missing_blocks_are_the_requested_ones( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t req, blk;
+
+    pce = bt_piece_new("00000000000000000000", 400000);
+    CuAssertTrue(tc, 0 == bt_piece_get_missing_block(pce, 0, &blk));
+
+    bt_piece_poll_block_request(pce, &req);
+    bt_piece_poll_block_request(pce, &req);
+    bt_piece_giveback_block(pce, &req);
+    bt_piece_poll_block_request(pce, &req);
+    bt_piece_poll_block_request(pce, &req);
+
+    CuAssertTrue(tc, 1 == bt_piece_get_missing_block(pce, 0, &blk));
+    CuAssertTrue(tc, 0 == blk.offset);
+    CuAssertTrue(tc, (BT_BLOCK_SIZE) == blk.len);
+    CuAssertTrue(tc, 0 == bt_piece_have_block(pce, &blk));
+    CuAssertTrue(tc, 1 == bt_piece_get_missing_block(pce, 1, &blk));
+    CuAssertTrue(tc, (unsigned int)(BT_BLOCK_SIZE) == blk.offset);
+    CuAssertTrue(tc, 1 == bt_piece_get_missing_block(pce,
+                     blk.offset + blk.len, &blk));
+    CuAssertTrue(tc, (unsigned int)(BT_BLOCK_SIZE) * 2 == blk.offset);
+    CuAssertTrue(tc, 0 == bt_piece_get_missing_block(pce,
+                     blk.offset + blk.len, &blk));
+}
+
+void TestBTPiece_unaligned_giveback_keeps_request_progress( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t req;
+    int i;
+
+    pce = bt_piece_new("00000000000000000000", 400000);
+    for (i = 0; i < 24; i++)
+        bt_piece_poll_block_request(pce, &req);
+    req.offset = 100;
+    req.len = 10;
+    bt_piece_giveback_block(pce, &req);
+    CuAssertTrue(tc, 0 == bt_piece_is_fully_requested(pce));
+    bt_piece_poll_block_request(pce, &req);
+    CuAssertTrue(tc, req.offset == 100);
+    CuAssertTrue(tc, req.len == 10);
+}
+
 void TestBTPiece_pollBlockRequest_sized_under_threshhold( CuTest * tc)
 {
     bt_piece_t *pce;
@@ -166,6 +244,60 @@ void TestBTPiece_write_block_means_block_can_be_read( CuTest * tc)
     CuAssertTrue(tc, 0 == strncmp(bt_piece_read_block(pce, NULL, &b), m, 10));
 }
 
+static int __mock_disk_block_file_span(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk,
+    int *fd,
+    unsigned long long *offset
+    )
+{
+    *fd = 7;
+    *offset = 1000 + blk->offset;
+    return 1;
+}
+
+void TestBTPiece_block_file_is_only_given_for_downloaded_blocks( CuTest * tc)
+{
+    bt_blockrw_i rw = __mock_disk_rw;
+    bt_piece_t *pce;
+    bt_block_t b;
+    unsigned long long off;
+    int fd;
+    char *m = "this great message is 40 bytes in length";
+
+    rw.block_file_span = __mock_disk_block_file_span;
+    pce = bt_piece_new("00000000000000000000", 40);
+    b.piece_idx = 0;
+    b.offset = 10;
+    b.len = 10;
+    bt_piece_set_disk_blockrw(pce, &rw, &__mockdisk);
+    CuAssertTrue(tc, 0 == bt_piece_get_block_file(pce, &b, &fd, &off));
+    bt_piece_write_block(pce, NULL, &b, m, NULL);
+    CuAssertTrue(tc, 1 == bt_piece_get_block_file(pce, &b, &fd, &off));
+    CuAssertTrue(tc, 7 == fd);
+    CuAssertTrue(tc, 1010 == off);
+    bt_piece_free(pce);
+}
+
+void TestBTPiece_block_file_needs_disk_support( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t b;
+    unsigned long long off;
+    int fd;
+    char *m = "this great message is 40 bytes in length";
+
+    pce = bt_piece_new("00000000000000000000", 40);
+    b.piece_idx = 0;
+    b.offset = 0;
+    b.len = 10;
+    bt_piece_set_disk_blockrw(pce, &__mock_disk_rw, &__mockdisk);
+    bt_piece_write_block(pce, NULL, &b, m, NULL);
+    CuAssertTrue(tc, 0 == bt_piece_get_block_file(pce, &b, &fd, &off));
+    bt_piece_free(pce);
+}
+
 void TestBTPiece_doneness_is_valid_only_when_validated( CuTest * tc)
 {
     bt_piece_t *pce;
@@ -291,6 +423,41 @@ void TestBTPiece_write_valid_block_results_in_valid_piece( CuTest * tc)
     CuAssertTrue(tc, 1 == bt_piece_is_valid(pce));
 }
 
+void TestBTPiece_validated_piece_keeps_progress_after_release( CuTest * tc)
+{
+    void* peer;
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char *msg = "this great message is 40 bytes in length";
+    char hash[21];
+
+    peer = malloc(1);
+    SHA1(hash, msg, 40);
+    pce = bt_piece_new(hash, 40);
+    memset(&__mockdisk, 0, sizeof(mockdisk_t));
+    bt_piece_set_disk_blockrw(pce, &__mock_disk_rw, &__mockdisk);
+
+    blk.offset = 0;
+    blk.len = 40;
+    bt_piece_write_block(pce, NULL, &blk, msg, peer);
+    CuAssertTrue(tc, 1 == bt_piece_num_peers(pce));
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_COMPLETE_PIECE == bt_piece_validate(pce));
+
+    /* the download state has been released */
+    CuAssertTrue(tc, 0 == bt_piece_num_peers(pce));
+    CuAssertTrue(tc, 1 == bt_piece_is_downloaded(pce));
+    CuAssertTrue(tc, 1 == bt_piece_is_fully_requested(pce));
+    blk.offset = 10;
+    blk.len = 20;
+    CuAssertTrue(tc, NULL != bt_piece_read_block(pce, NULL, &blk));
+
+    /* giving a block back brings the state back */
+    bt_piece_giveback_block(pce, &blk);
+    CuAssertTrue(tc, 0 == bt_piece_is_fully_requested(pce));
+    CuAssertTrue(tc, 1 == bt_piece_is_downloaded(pce));
+    bt_piece_free(pce);
+}
+
 void TestBTPiece_write_invalid_block_results_in_invalid_piece( CuTest * tc)
 {
     void* peer;
@@ -317,6 +484,90 @@ void TestBTPiece_write_invalid_block_results_in_invalid_piece( CuTest * tc)
     CuAssertTrue(tc, 0 == bt_piece_is_valid(pce));
 }
 
+void TestBTPiece_blocks_written_in_order_are_hashed( CuTest * tc)
+{
+    void *dc, *peer;
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char *msg = "this great message is 40 bytes in length";
+    char hash[21];
+
+    peer = malloc(1);
+    SHA1(hash, msg, 40);
+    pce = bt_piece_new(hash, 40);
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    bt_piece_set_disk_blockrw(pce, bt_diskmem_get_blockrw(dc), dc);
+
+    blk.piece_idx = 0;
+    blk.offset = 0;
+    blk.len = 20;
+    bt_piece_write_block(pce, NULL, &blk, msg, peer);
+    CuAssertTrue(tc, 0 == bt_piece_is_hashed(pce));
+    blk.offset = 20;
+    bt_piece_write_block(pce, NULL, &blk, msg + 20, peer);
+    CuAssertTrue(tc, 1 == bt_piece_is_hashed(pce));
+    CuAssertTrue(tc, 1 == bt_piece_validate(pce));
+    bt_diskmem_free(dc);
+}
+
+void TestBTPiece_blocks_written_out_of_order_are_hashed( CuTest * tc)
+{
+    void *dc, *peer;
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char *msg = "this great message is 40 bytes in length";
+    char hash[21];
+
+    peer = malloc(1);
+    SHA1(hash, msg, 40);
+    pce = bt_piece_new(hash, 40);
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    bt_piece_set_disk_blockrw(pce, bt_diskmem_get_blockrw(dc), dc);
+
+    blk.piece_idx = 0;
+    blk.len = 10;
+    blk.offset = 30;
+    bt_piece_write_block(pce, NULL, &blk, msg + 30, peer);
+    blk.offset = 10;
+    bt_piece_write_block(pce, NULL, &blk, msg + 10, peer);
+    blk.offset = 20;
+    bt_piece_write_block(pce, NULL, &blk, msg + 20, peer);
+    CuAssertTrue(tc, 0 == bt_piece_is_hashed(pce));
+    blk.offset = 0;
+    bt_piece_write_block(pce, NULL, &blk, msg, peer);
+    CuAssertTrue(tc, 1 == bt_piece_is_hashed(pce));
+    CuAssertTrue(tc, 1 == bt_piece_validate(pce));
+    bt_diskmem_free(dc);
+}
+
+void TestBTPiece_rewritten_block_falls_back_to_reading_piece( CuTest * tc)
+{
+    void *dc, *peer;
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char *msg = "this great message is 40 bytes in length";
+    char *bad_msg = "this great xxxxxxx is 40 bytes in length";
+    char hash[21];
+
+    peer = malloc(1);
+    SHA1(hash, msg, 40);
+    pce = bt_piece_new(hash, 40);
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, 40);
+    bt_piece_set_disk_blockrw(pce, bt_diskmem_get_blockrw(dc), dc);
+
+    blk.piece_idx = 0;
+    blk.offset = 0;
+    blk.len = 40;
+    bt_piece_write_block(pce, NULL, &blk, bad_msg, peer);
+    bt_piece_write_block(pce, NULL, &blk, msg, peer);
+    CuAssertTrue(tc, 0 == bt_piece_is_hashed(pce));
+    CuAssertTrue(tc, 1 == bt_piece_validate(pce));
+    bt_diskmem_free(dc);
+}
+
 #if 0
 void TxestBTPiece_solo_peer_recognised_as_definitely_invalidating_piece(
     CuTest * tc
@@ -448,3 +699,438 @@ void TestBTPiece_get_peers_from_write_block( CuTest * tc)
     CuAssertTrue(tc, (p1_ == p1 && p2_ == p2) || (p2_ == p1 && p1_ == p2));
     CuAssertTrue(tc, !bt_piece_get_peers(pce, &i));
 }
+
+static void* __suspect;
+
+static int __is_suspect(void* udata, void* peer)
+{
+    return peer == __suspect;
+}
+
+/**
+ * Write three blocks; p2 sends the middle one */
+static bt_piece_t* __piece_with_bad_middle_block(void* dc, char* data,
+                                                 void* p1, void* p2)
+{
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char hash[21];
+    int i;
+
+    for (i = 0; i < 3 * BT_BLOCK_SIZE; i++)
+        data[i] = i % 251;
+    SHA1(hash, data, 3 * BT_BLOCK_SIZE);
+    pce = bt_piece_new(hash, 3 * BT_BLOCK_SIZE);
+    bt_diskmem_set_size(dc, 3 * BT_BLOCK_SIZE);
+    bt_piece_set_disk_blockrw(pce, bt_diskmem_get_blockrw(dc), dc);
+
+    blk.piece_idx = 0;
+    blk.len = BT_BLOCK_SIZE;
+    blk.offset = 0;
+    bt_piece_write_block(pce, NULL, &blk, data, p1);
+    blk.offset = 2 * BT_BLOCK_SIZE;
+    bt_piece_write_block(pce, NULL, &blk, data + blk.offset, p1);
+    data[BT_BLOCK_SIZE]++;
+    blk.offset = BT_BLOCK_SIZE;
+    bt_piece_write_block(pce, NULL, &blk, data + blk.offset, p2);
+    data[BT_BLOCK_SIZE]--;
+    return pce;
+}
+
+void TestBTPiece_drop_blocks_only_drops_suspects_blocks( CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *p1 = malloc(1), *p2 = malloc(1),
+         *p3 = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE);
+    bt_piece_t *pce;
+    bt_block_t blk;
+
+    pce = __piece_with_bad_middle_block(dc, data, p1, p2);
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_INVALID_PIECE == bt_piece_validate(pce));
+
+    __suspect = p2;
+    CuAssertTrue(tc, 1 == bt_piece_drop_blocks(pce, __is_suspect, NULL));
+    blk.piece_idx = 0;
+    blk.len = BT_BLOCK_SIZE;
+    blk.offset = 0;
+    CuAssertTrue(tc, 1 == bt_piece_have_block(pce, &blk));
+    blk.offset = BT_BLOCK_SIZE;
+    CuAssertTrue(tc, 0 == bt_piece_have_block(pce, &blk));
+    CuAssertTrue(tc, 0 == bt_piece_is_fully_requested(pce));
+
+    /* another peer sends the good block */
+    CuAssertTrue(tc, 2 == bt_piece_write_block(pce, NULL, &blk,
+                                               data + blk.offset, p3));
+    CuAssertTrue(tc, NULL == bt_piece_pop_culprit(pce));
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_COMPLETE_PIECE ==
+                 bt_piece_validate(pce));
+    CuAssertTrue(tc, p2 == bt_piece_pop_culprit(pce));
+    CuAssertTrue(tc, NULL == bt_piece_pop_culprit(pce));
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_drop_blocks_drops_everything_without_suspects( CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *p1 = malloc(1), *p2 = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE);
+    bt_piece_t *pce;
+
+    pce = __piece_with_bad_middle_block(dc, data, p1, p2);
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_INVALID_PIECE == bt_piece_validate(pce));
+    __suspect = NULL;
+    CuAssertTrue(tc, 3 == bt_piece_drop_blocks(pce, __is_suspect, NULL));
+    CuAssertTrue(tc, 0 == bt_piece_is_downloaded(pce));
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_drop_blocks_drops_everything_when_piece_fails_again(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *p1 = malloc(1), *p2 = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE);
+    bt_piece_t *pce;
+    bt_block_t blk;
+
+    pce = __piece_with_bad_middle_block(dc, data, p1, p2);
+    bt_piece_validate(pce);
+    __suspect = p2;
+    CuAssertTrue(tc, 1 == bt_piece_drop_blocks(pce, __is_suspect, NULL));
+
+    /* p1 was the bad one after all */
+    blk.piece_idx = 0;
+    blk.len = BT_BLOCK_SIZE;
+    blk.offset = BT_BLOCK_SIZE;
+    data[0]++;
+    bt_diskmem_write_block(dc, NULL, &((bt_block_t){ 0, 0, 1 }), data);
+    bt_piece_write_block(pce, NULL, &blk, data + blk.offset, p2);
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_INVALID_PIECE == bt_piece_validate(pce));
+    CuAssertTrue(tc, 3 == bt_piece_drop_blocks(pce, __is_suspect, NULL));
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_drop_blocks_needs_block_aligned_writes( CuTest * tc)
+{
+    void *peer = malloc(1);
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char *bad_msg = "this great xxxxxxx is 40 bytes in length";
+
+    pce = bt_piece_new(HASH_EXAMPLE, 40);
+    memset(&__mockdisk, 0, sizeof(mockdisk_t));
+    bt_piece_set_disk_blockrw(pce, &__mock_disk_rw, &__mockdisk);
+    blk.offset = 0;
+    blk.len = 20;
+    bt_piece_write_block(pce, NULL, &blk, bad_msg, peer);
+    blk.offset = 20;
+    bt_piece_write_block(pce, NULL, &blk, bad_msg + 20, peer);
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_INVALID_PIECE == bt_piece_validate(pce));
+    __suspect = peer;
+    CuAssertTrue(tc, 0 == bt_piece_drop_blocks(pce, __is_suspect, NULL));
+    bt_piece_free(pce);
+}
+
+#define CLAIMERS 4
+#define CLAIM_BLOCKS 200
+
+typedef struct
+{
+    bt_piece_t *pce;
+    int claimed[CLAIM_BLOCKS];
+} claimer_t;
+
+static void *__claim_all(void *udata)
+{
+    claimer_t *c = udata;
+    bt_block_t req;
+
+    while (1)
+    {
+        bt_piece_poll_block_request(c->pce, &req);
+        if (0 == req.len)
+            break;
+        c->claimed[req.offset / (BT_BLOCK_SIZE)]++;
+    }
+    return NULL;
+}
+
+void TestBTPiece_concurrent_polls_claim_each_block_once( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t req;
+    pthread_t threads[CLAIMERS];
+    claimer_t c[CLAIMERS];
+    int i, j;
+
+    pce = bt_piece_new(HASH_EXAMPLE, CLAIM_BLOCKS * (BT_BLOCK_SIZE));
+
+    /* put the piece in flight first */
+    bt_piece_poll_block_request(pce, &req);
+    bt_piece_giveback_block(pce, &req);
+
+    for (i = 0; i < CLAIMERS; i++)
+    {
+        memset(&c[i], 0, sizeof(c[i]));
+        c[i].pce = pce;
+        pthread_create(&threads[i], NULL, __claim_all, &c[i]);
+    }
+    for (i = 0; i < CLAIMERS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (j = 0; j < CLAIM_BLOCKS; j++)
+    {
+        int n = 0;
+
+        for (i = 0; i < CLAIMERS; i++)
+            n += c[i].claimed[j];
+        CuAssertTrue(tc, 1 == n);
+    }
+    CuAssertTrue(tc, 1 == bt_piece_is_fully_requested(pce));
+
+    /* a given back block is the next one claimed */
+    req.offset = 7 * (BT_BLOCK_SIZE);
+    req.len = BT_BLOCK_SIZE;
+    bt_piece_giveback_block(pce, &req);
+    CuAssertTrue(tc, 0 == bt_piece_is_fully_requested(pce));
+    bt_piece_poll_block_request(pce, &req);
+    CuAssertTrue(tc, 7 * (BT_BLOCK_SIZE) == req.offset);
+    CuAssertTrue(tc, 1 == bt_piece_is_fully_requested(pce));
+}
+
+void TestBTPiece_download_progress_is_counted_in_memory( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t req;
+    unsigned long idle;
+
+    pce = bt_piece_new("00000000000000000000", 400000);
+    idle = bt_piece_get_memory(pce);
+    CuAssertTrue(tc, 0 < idle);
+
+    bt_piece_poll_block_request(pce, &req);
+    CuAssertTrue(tc, idle < bt_piece_get_memory(pce));
+}
+
+void TestBTPiece_completed_piece_costs_no_more_than_a_new_one( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t blk;
+    char *msg = "this great message is 40 bytes in length";
+    unsigned long idle;
+
+    pce = bt_piece_new("00000000000000000000", 40);
+    memset(&__mockdisk, 0, sizeof(mockdisk_t));
+    bt_piece_set_disk_blockrw(pce, &__mock_disk_rw, &__mockdisk);
+    idle = bt_piece_get_memory(pce);
+
+    blk.piece_idx = 0;
+    blk.offset = 0;
+    blk.len = 20;
+    bt_piece_write_block(pce, NULL, &blk, msg, malloc(1));
+    CuAssertTrue(tc, idle < bt_piece_get_memory(pce));
+
+    /* resume data says we have it */
+    bt_piece_set_complete(pce, 1);
+    CuAssertTrue(tc, idle == bt_piece_get_memory(pce));
+    CuAssertTrue(tc, 0 == bt_piece_num_peers(pce));
+    CuAssertTrue(tc, 1 == bt_piece_is_complete(pce));
+    CuAssertTrue(tc, 1 == bt_piece_is_downloaded(pce));
+
+    /* so it can be uploaded */
+    blk.offset = 20;
+    CuAssertTrue(tc, NULL != bt_piece_read_block(pce, NULL, &blk));
+    bt_piece_free(pce);
+}
+
+static int __nreads;
+static bt_blockrw_i __counted_rw;
+
+static void *__counted_read_block(void *udata, void *caller,
+                                  const bt_block_t * blk)
+{
+    __nreads++;
+    return bt_diskmem_get_blockrw(udata)->read_block(udata, caller, blk);
+}
+
+/**
+ * A v2 piece of three blocks, on a disk that counts its reads
+ * @param leaves Set to the blocks' hashes */
+static bt_piece_t* __v2_piece(void* dc, char* data, char* root, char* leaves)
+{
+    bt_piece_t *pce;
+    int i;
+
+    for (i = 0; i < 3 * (BT_BLOCK_SIZE); i++)
+        data[i] = i % 251;
+    for (i = 0; i < 3; i++)
+        bt_sha256(leaves + i * 32, data + i * (BT_BLOCK_SIZE), BT_BLOCK_SIZE);
+    bt_sha256_merkle_root(root, leaves, 3, 4);
+
+    pce = bt_piece_new(NULL, 3 * BT_BLOCK_SIZE);
+    bt_piece_set_root_ref(pce, root, 4);
+    bt_diskmem_set_size(dc, 3 * BT_BLOCK_SIZE);
+    __counted_rw = *bt_diskmem_get_blockrw(dc);
+    __counted_rw.read_block = __counted_read_block;
+    bt_piece_set_disk_blockrw(pce, &__counted_rw, dc);
+    __nreads = 0;
+    return pce;
+}
+
+static int __write(bt_piece_t *pce, int blk, const char* data, void* peer)
+{
+    bt_block_t b = { .piece_idx = 0, .offset = blk * (BT_BLOCK_SIZE),
+                     .len = (BT_BLOCK_SIZE) };
+
+    return bt_piece_write_block(pce, NULL, &b, data + b.offset, peer);
+}
+
+void TestBTPiece_v2_blocks_in_any_order_validate_without_reading(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *peer = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE), root[32], leaves[96];
+    bt_piece_t *pce = __v2_piece(dc, data, root, leaves);
+
+    CuAssertTrue(tc, root == bt_piece_get_root(pce));
+    __write(pce, 2, data, peer);
+    __write(pce, 0, data, peer);
+    CuAssertTrue(tc, 0 == bt_piece_is_hashed(pce));
+    CuAssertTrue(tc, 2 == __write(pce, 1, data, peer));
+    CuAssertTrue(tc, 1 == bt_piece_is_hashed(pce));
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_COMPLETE_PIECE ==
+                 bt_piece_validate(pce));
+    CuAssertTrue(tc, 0 == __nreads);
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_v2_bad_block_fails_validation(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *peer = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE), root[32], leaves[96];
+    bt_piece_t *pce = __v2_piece(dc, data, root, leaves);
+
+    __write(pce, 0, data, peer);
+    __write(pce, 2, data, peer);
+    data[(BT_BLOCK_SIZE)]++;
+    __write(pce, 1, data, peer);
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_INVALID_PIECE ==
+                 bt_piece_validate(pce));
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_v2_block_that_doesnt_match_its_leaf_is_refused(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *peer = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE), root[32], leaves[96];
+    bt_piece_t *pce = __v2_piece(dc, data, root, leaves);
+    bt_block_t b = { .piece_idx = 0, .offset = (BT_BLOCK_SIZE),
+                     .len = (BT_BLOCK_SIZE) };
+
+    /* leaves that don't make the root aren't taken */
+    leaves[0]++;
+    CuAssertTrue(tc, 0 == bt_piece_set_block_hashes(pce, leaves));
+    leaves[0]--;
+    CuAssertTrue(tc, 1 == bt_piece_set_block_hashes(pce, leaves));
+
+    data[(BT_BLOCK_SIZE)]++;
+    CuAssertTrue(tc, BT_PIECE_WRITE_BLOCK_INVALID ==
+                 __write(pce, 1, data, peer));
+    CuAssertTrue(tc, 0 == bt_piece_have_block(pce, &b));
+    CuAssertTrue(tc, 0 == bt_piece_num_peers(pce));
+    data[(BT_BLOCK_SIZE)]--;
+
+    __write(pce, 0, data, peer);
+    __write(pce, 1, data, peer);
+    CuAssertTrue(tc, 2 == __write(pce, 2, data, peer));
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_COMPLETE_PIECE ==
+                 bt_piece_validate(pce));
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_v2_block_hashes_forget_bad_blocks_we_have(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *peer = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE), root[32], leaves[96];
+    bt_piece_t *pce = __v2_piece(dc, data, root, leaves);
+    bt_block_t b = { .piece_idx = 0, .len = (BT_BLOCK_SIZE) };
+
+    __write(pce, 0, data, peer);
+    data[(BT_BLOCK_SIZE)]++;
+    __write(pce, 1, data, peer);
+    data[(BT_BLOCK_SIZE)]--;
+
+    CuAssertTrue(tc, 1 == bt_piece_set_block_hashes(pce, leaves));
+    b.offset = 0;
+    CuAssertTrue(tc, 1 == bt_piece_have_block(pce, &b));
+    b.offset = (BT_BLOCK_SIZE);
+    CuAssertTrue(tc, 0 == bt_piece_have_block(pce, &b));
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_v2_culprits_are_found_from_the_leaves(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *p1 = malloc(1), *p2 = malloc(1),
+         *p3 = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE), root[32], leaves[96];
+    bt_piece_t *pce = __v2_piece(dc, data, root, leaves);
+
+    __write(pce, 0, data, p1);
+    __write(pce, 2, data, p1);
+    data[(BT_BLOCK_SIZE)]++;
+    __write(pce, 1, data, p2);
+    data[(BT_BLOCK_SIZE)]--;
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_INVALID_PIECE ==
+                 bt_piece_validate(pce));
+
+    __suspect = p2;
+    CuAssertTrue(tc, 1 == bt_piece_drop_blocks(pce, __is_suspect, NULL));
+    CuAssertTrue(tc, 2 == __write(pce, 1, data, p3));
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_COMPLETE_PIECE ==
+                 bt_piece_validate(pce));
+    CuAssertTrue(tc, p2 == bt_piece_pop_culprit(pce));
+    CuAssertTrue(tc, NULL == bt_piece_pop_culprit(pce));
+    CuAssertTrue(tc, 0 == __nreads);
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
+
+void TestBTPiece_v2_unaligned_writes_fall_back_to_reading_piece(
+    CuTest * tc)
+{
+    void *dc = bt_diskmem_new(), *peer = malloc(1);
+    char *data = malloc(3 * BT_BLOCK_SIZE), root[32], leaves[96];
+    bt_piece_t *pce = __v2_piece(dc, data, root, leaves);
+    bt_block_t b = { .piece_idx = 0, .offset = (BT_BLOCK_SIZE),
+                     .len = (BT_BLOCK_SIZE) / 2 };
+
+    __write(pce, 0, data, peer);
+    __write(pce, 2, data, peer);
+    bt_piece_write_block(pce, NULL, &b, data + b.offset, peer);
+    b.offset += b.len;
+    bt_piece_write_block(pce, NULL, &b, data + b.offset, peer);
+    CuAssertTrue(tc, 0 == bt_piece_is_hashed(pce));
+    CuAssertTrue(tc, BT_PIECE_VALIDATE_COMPLETE_PIECE ==
+                 bt_piece_validate(pce));
+    CuAssertTrue(tc, 0 < __nreads);
+    bt_piece_free(pce);
+    bt_diskmem_free(dc);
+    free(data);
+}
@@ -130,6 +130,107 @@ void TestBTPieceDB_add_pieces(CuTest * tc)
     CuAssertTrue(tc, NULL != bt_piecedb_get(db, 1));
 }
 
+void TestBTPieceDB_add_from_info_references_hashes(CuTest * tc)
+{
+    void *db;
+    bt_piece_info_t info;
+    char hashes[60];
+
+    memset(hashes, 'a', 20);
+    memset(hashes + 20, 'b', 20);
+    memset(hashes + 40, 'c', 20);
+    memset(&info, 0, sizeof(info));
+    info.pieces_hash = hashes;
+    info.piece_len = 40;
+    info.npieces = 3;
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, 100);
+    CuAssertTrue(tc, 0 == bt_piecedb_add_from_info(db, &info));
+    CuAssertTrue(tc, 3 == bt_piecedb_count(db));
+    CuAssertTrue(tc, hashes + 20 == bt_piece_get_hash(bt_piecedb_get(db, 1)));
+    CuAssertTrue(tc, 40 == bt_piece_get_size(bt_piecedb_get(db, 1)));
+    CuAssertTrue(tc, 20 == bt_piece_get_size(bt_piecedb_get(db, 2)));
+    CuAssertTrue(tc, 2 == bt_piece_get_idx(bt_piecedb_get(db, 2)));
+    /* the pieces were allocated together */
+    CuAssertTrue(tc, bt_piecedb_get(db, 2) ==
+                 bt_piece_nth(bt_piecedb_get(db, 0), 2));
+}
+
+void TestBTPieceDB_last_piece_is_sized_past_4gb(CuTest * tc)
+{
+    void *db;
+    bt_piece_info_t info;
+
+    memset(&info, 0, sizeof(info));
+    info.piece_len = 1 << 22;
+    info.npieces = 1281;
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, (1280ull << 22) + 100);
+    CuAssertTrue(tc, 0 == bt_piecedb_add_from_info(db, &info));
+    CuAssertTrue(tc, 1 << 22 == bt_piece_get_size(bt_piecedb_get(db, 1279)));
+    CuAssertTrue(tc, 100 == bt_piece_get_size(bt_piecedb_get(db, 1280)));
+}
+
+void TestBTPieceDB_add_at_idx_leaves_gap_for_add(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    CuAssertTrue(tc, 100 == bt_piecedb_add_at_idx(db, 1, 100));
+    CuAssertTrue(tc, 100 == bt_piece_get_idx(bt_piecedb_get(db, 100)));
+    CuAssertTrue(tc, NULL == bt_piecedb_get(db, 99));
+    CuAssertTrue(tc, NULL == bt_piecedb_get(db, 1000));
+    CuAssertTrue(tc, -1 == bt_piecedb_add_at_idx(db, 2, 99));
+    CuAssertTrue(tc, 0 == bt_piecedb_add(db, 1));
+    bt_piecedb_remove(db, 0);
+    CuAssertTrue(tc, NULL == bt_piecedb_get(db, 0));
+    CuAssertTrue(tc, 1 == bt_piecedb_count(db));
+    CuAssertTrue(tc, 0 == bt_piecedb_add(db, 1));
+}
+
+void TestBTPieceDB_counts_follow_the_pieces(CuTest * tc)
+{
+    void *db;
+    unsigned char bits[1] = { 0x3 };
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, (BT_BLOCK_SIZE) * 6);
+    bt_piecedb_add_with_hash_and_size(db, "aaaaaaaaaaaaaaaaaaaa",
+                                      (BT_BLOCK_SIZE) * 2);
+    bt_piecedb_add_with_hash_and_size(db, "bbbbbbbbbbbbbbbbbbbb",
+                                      (BT_BLOCK_SIZE) * 2);
+    bt_piecedb_add_with_hash_and_size(db, "cccccccccccccccccccc",
+                                      (BT_BLOCK_SIZE) * 2);
+    CuAssertTrue(tc, 0 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 0 == bt_piecedb_get_num_downloaded(db));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 0), 1);
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_downloaded(db));
+
+    /* downloaded isn't complete until it's validated */
+    CuAssertTrue(tc, 1 == bt_piece_set_block_progress(bt_piecedb_get(db, 1),
+                                                      bits, 2));
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 2 == bt_piecedb_get_num_downloaded(db));
+
+    bt_piece_drop_download_progress(bt_piecedb_get(db, 1));
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_downloaded(db));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 1), 1);
+    bt_piece_set_complete(bt_piecedb_get(db, 2), 1);
+    CuAssertTrue(tc, 1 == bt_piecedb_all_pieces_are_complete(db));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 2), 0);
+    CuAssertTrue(tc, 0 == bt_piecedb_all_pieces_are_complete(db));
+
+    /* removed pieces aren't counted */
+    bt_piecedb_remove(db, 0);
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+}
+
 #if 0
 void T_estBTPieceDB_AddingPiece_LastPieceFitsTotalSize(
     CuTest * tc
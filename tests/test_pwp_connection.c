@@ -0,0 +1,1380 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bitfield.h"
+#include "chunkybar.h"
+#include "pwp_connection.h"
+#include "pwp_msghandler.h"
+
+typedef struct
+{
+    int sends;
+    int len;
+    char data[2048];
+} mocksend_t;
+
+static int __mock_send(
+    void *udata,
+    const void *peer,
+    const void *send_data,
+    const int len
+    )
+{
+    mocksend_t *ms = udata;
+
+    memcpy(ms->data + ms->len, send_data, len);
+    ms->len += len;
+    ms->sends++;
+    return 1;
+}
+
+static void* __conn_new(mocksend_t* ms)
+{
+    void *pc;
+
+    memset(ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send
+                           }), ms);
+    return pc;
+}
+
+void TestPWP_conn_uncorked_messages_are_sent_straight_away(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_send_have(pc, 1);
+    pwp_conn_send_have(pc, 2);
+    CuAssertTrue(tc, 2 == ms.sends);
+    CuAssertTrue(tc, 18 == ms.len);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_corked_messages_go_out_in_one_send(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_cork(pc);
+    pwp_conn_send_have(pc, 1);
+    pwp_conn_send_statechange(pc, PWP_MSGTYPE_INTERESTED);
+    pwp_conn_send_keepalive(pc);
+    CuAssertTrue(tc, 0 == ms.sends);
+    CuAssertTrue(tc, 1 == pwp_conn_uncork(pc));
+    CuAssertTrue(tc, 1 == ms.sends);
+    CuAssertTrue(tc, 9 + 5 + 4 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_HAVE == ms.data[4]);
+    CuAssertTrue(tc, PWP_MSGTYPE_INTERESTED == ms.data[9 + 4]);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_corks_nest(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_cork(pc);
+    pwp_conn_cork(pc);
+    pwp_conn_send_have(pc, 1);
+    pwp_conn_uncork(pc);
+    CuAssertTrue(tc, 0 == ms.sends);
+    pwp_conn_uncork(pc);
+    CuAssertTrue(tc, 1 == ms.sends);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_flush_sends_held_messages(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_cork(pc);
+    pwp_conn_send_have(pc, 1);
+    CuAssertTrue(tc, 1 == pwp_conn_flush(pc));
+    CuAssertTrue(tc, 1 == ms.sends);
+    pwp_conn_send_have(pc, 2);
+    CuAssertTrue(tc, 1 == ms.sends);
+    pwp_conn_uncork(pc);
+    CuAssertTrue(tc, 2 == ms.sends);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_full_cork_buffer_is_sent(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+    int i;
+
+    pwp_conn_cork(pc);
+    for (i = 0; i < 200; i++)
+        pwp_conn_send_keepalive(pc);
+    CuAssertTrue(tc, 1 == ms.sends);
+    pwp_conn_uncork(pc);
+    CuAssertTrue(tc, 2 == ms.sends);
+    CuAssertTrue(tc, 200 * 4 == ms.len);
+    pwp_conn_release(pc);
+}
+
+static int __givebacks = 0;
+
+static void __mock_giveback_block(void *udata, void *peer, bt_block_t * blk)
+{
+    __givebacks++;
+}
+
+static int __mock_pushblock(void *udata, void *peer, bt_block_t *block,
+                            const void *data)
+{
+    return 1;
+}
+
+static void* __conn_new_requesting(mocksend_t* ms)
+{
+    void *pc;
+
+    memset(ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .pushblock = __mock_pushblock,
+                           .peer_giveback_block = __mock_giveback_block
+                           }), ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    return pc;
+}
+
+static void __request(void* pc, int piece_idx, int offset, int len)
+{
+    bt_block_t b = { .piece_idx = piece_idx, .offset = offset, .len = len };
+
+    pwp_conn_request_block_from_peer(pc, &b);
+}
+
+static void __piece(void* pc, int piece_idx, int offset, int len)
+{
+    msg_piece_t p = {
+        .blk = { .piece_idx = piece_idx, .offset = offset, .len = len },
+        .data = NULL };
+
+    pwp_conn_piece(pc, &p);
+}
+
+static int __pending(void* pc, int piece_idx, int offset, int len)
+{
+    bt_block_t b = { .piece_idx = piece_idx, .offset = offset, .len = len };
+
+    return pwp_conn_block_request_is_pending(pc, &b);
+}
+
+void TestPWP_conn_requests_are_pending_until_received(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    int i;
+
+    /* more than fit in the initial table */
+    for (i = 0; i < 100; i++)
+        __request(pc, i, 0, 10);
+    CuAssertTrue(tc, 100 == pwp_conn_get_npending_requests(pc));
+    for (i = 0; i < 100; i++)
+        CuAssertTrue(tc, 1 == __pending(pc, i, 0, 10));
+    CuAssertTrue(tc, 0 == __pending(pc, 1, 10, 10));
+
+    for (i = 0; i < 100; i += 2)
+        __piece(pc, i, 0, 10);
+    CuAssertTrue(tc, 50 == pwp_conn_get_npending_requests(pc));
+    for (i = 0; i < 100; i++)
+        CuAssertTrue(tc, (i % 2) == __pending(pc, i, 0, 10));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_requests_outgrow_the_arena(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    int i;
+
+    /* the tables move out to the heap */
+    for (i = 0; i < 2000; i++)
+        __request(pc, i % 100, i / 100 * 10, 10);
+    CuAssertTrue(tc, 2000 == pwp_conn_get_npending_requests(pc));
+    for (i = 0; i < 2000; i++)
+        __piece(pc, i % 100, i / 100 * 10, 10);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_release(pc);
+}
+
+static void* __conn_new_requesting_and_sending(mocksend_t* ms)
+{
+    void *pc = __conn_new_requesting(ms);
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .pushblock = __mock_pushblock,
+                           .peer_giveback_block = __mock_giveback_block
+                           }), ms);
+    return pc;
+}
+
+void TestPWP_conn_block_is_only_requested_once(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting_and_sending(&ms);
+
+    __request(pc, 1, 0, 10);
+    ms.len = ms.sends = 0;
+    __request(pc, 1, 0, 10);
+    CuAssertTrue(tc, 0 == ms.sends);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_cancelled_request_is_no_longer_pending(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting_and_sending(&ms);
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    __request(pc, 1, 0, 10);
+    ms.len = ms.sends = 0;
+    CuAssertTrue(tc, 1 == pwp_conn_cancel_request(pc, &b));
+    CuAssertTrue(tc, 0 == __pending(pc, 1, 0, 10));
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 17 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_CANCEL == ms.data[4]);
+
+    /* nothing to cancel */
+    CuAssertTrue(tc, 0 == pwp_conn_cancel_request(pc, &b));
+    CuAssertTrue(tc, 17 == ms.len);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_partial_piece_splits_pending_request(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+
+    __request(pc, 1, 0, 30);
+    __piece(pc, 1, 10, 10);
+    CuAssertTrue(tc, 2 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 0, 10));
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 20, 10));
+
+    __piece(pc, 1, 0, 5);
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 5, 5));
+    __piece(pc, 1, 25, 5);
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 20, 5));
+    __piece(pc, 1, 0, 30);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_choke_gives_back_pending_requests(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    int i;
+
+    __givebacks = 0;
+    for (i = 0; i < 40; i++)
+        __request(pc, i / 4, (i % 4) * 10, 10);
+    pwp_conn_choke(pc);
+    CuAssertTrue(tc, 40 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 0 == __pending(pc, 0, 0, 10));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_old_requests_are_given_back(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    int i;
+
+    __givebacks = 0;
+    __request(pc, 1, 0, 10);
+    __request(pc, 1, 10, 10);
+    for (i = 0; i < 5; i++)
+        pwp_conn_tick(pc);
+    __request(pc, 2, 0, 10);
+    __piece(pc, 1, 10, 10);
+    for (i = 0; i < 6; i++)
+        pwp_conn_tick(pc);
+    CuAssertTrue(tc, 1 == __givebacks);
+    CuAssertTrue(tc, 0 == __pending(pc, 1, 0, 10));
+    CuAssertTrue(tc, 1 == __pending(pc, 2, 0, 10));
+    for (i = 0; i < 5; i++)
+        pwp_conn_tick(pc);
+    CuAssertTrue(tc, 2 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_what_is_left_of_split_request_times_out(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    int i;
+
+    __givebacks = 0;
+    __request(pc, 1, 0, 30);
+    __piece(pc, 1, 10, 10);
+    for (i = 0; i < 11; i++)
+        pwp_conn_tick(pc);
+    CuAssertTrue(tc, 2 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_rerequested_block_keeps_its_own_timeout(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    int i;
+
+    __givebacks = 0;
+    __request(pc, 1, 0, 10);
+    __piece(pc, 1, 0, 10);
+    for (i = 0; i < 5; i++)
+        pwp_conn_tick(pc);
+    __request(pc, 1, 0, 10);
+    for (i = 0; i < 6; i++)
+        pwp_conn_tick(pc);
+    CuAssertTrue(tc, 0 == __givebacks);
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 0, 10));
+    for (i = 0; i < 5; i++)
+        pwp_conn_tick(pc);
+    CuAssertTrue(tc, 1 == __givebacks);
+    pwp_conn_release(pc);
+}
+
+static bt_block_t __served[512];
+static int __nserved = 0;
+
+static int __mock_send_block_from_file(void *udata, const void *peer,
+                                       const void *hdr, const int hdr_len,
+                                       const bt_block_t *blk)
+{
+    __served[__nserved++] = *blk;
+    return 1;
+}
+
+static void __mock_write_block_to_stream(void *udata, bt_block_t *blk,
+                                         char **msg)
+{
+}
+
+static void* __conn_new_serving(mocksend_t* ms, chunkybar_t** have)
+{
+    void *pc;
+
+    memset(ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .send_block_from_file = __mock_send_block_from_file,
+                           .write_block_to_stream = __mock_write_block_to_stream
+                           }), ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    *have = chunky_new(100);
+    chunky_mark_complete(*have, 0, 100);
+    pwp_conn_set_progress(pc, *have);
+    pwp_conn_unchoke_peer(pc);
+    __nserved = 0;
+    return pc;
+}
+
+static int __peer_request(void* pc, int piece_idx, int offset, int len)
+{
+    bt_block_t b = { .piece_idx = piece_idx, .offset = offset, .len = len };
+
+    return pwp_conn_request(pc, &b);
+}
+
+static void __peer_cancel(void* pc, int piece_idx, int offset, int len)
+{
+    bt_block_t b = { .piece_idx = piece_idx, .offset = offset, .len = len };
+
+    pwp_conn_cancel(pc, &b);
+}
+
+void TestPWP_conn_peer_requests_are_served_in_order(CuTest * tc)
+{
+    mocksend_t ms;
+    chunkybar_t *have;
+    void *pc = __conn_new_serving(&ms, &have);
+    int i;
+
+    for (i = 0; i < 300; i++)
+        CuAssertTrue(tc, 1 == __peer_request(pc, i / 10, (i % 10) * 10, 10));
+
+    /* duplicates are dropped */
+    CuAssertTrue(tc, 1 == __peer_request(pc, 0, 0, 10));
+    CuAssertTrue(tc, 300 == pwp_conn_get_npending_peer_requests(pc));
+
+    for (i = 0; i < 300; i++)
+        pwp_conn_send_pending_piece(pc);
+    CuAssertTrue(tc, 300 == __nserved);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_peer_requests(pc));
+    for (i = 0; i < 300; i++)
+    {
+        CuAssertTrue(tc, i / 10 == __served[i].piece_idx);
+        CuAssertTrue(tc, (i % 10) * 10 == __served[i].offset);
+    }
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+void TestPWP_conn_cancelled_peer_requests_are_not_served(CuTest * tc)
+{
+    mocksend_t ms;
+    chunkybar_t *have;
+    void *pc = __conn_new_serving(&ms, &have);
+
+    __peer_request(pc, 1, 0, 10);
+    __peer_request(pc, 2, 0, 10);
+    __peer_request(pc, 3, 0, 10);
+    __peer_cancel(pc, 1, 0, 10);
+    __peer_cancel(pc, 3, 0, 10);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_peer_requests(pc));
+    pwp_conn_send_pending_piece(pc);
+    pwp_conn_send_pending_piece(pc);
+    CuAssertTrue(tc, 1 == __nserved);
+    CuAssertTrue(tc, 2 == __served[0].piece_idx);
+
+    /* requesting again after a cancel puts it at the back */
+    __peer_request(pc, 4, 0, 10);
+    __peer_request(pc, 5, 0, 10);
+    __peer_cancel(pc, 4, 0, 10);
+    __peer_request(pc, 4, 0, 10);
+    pwp_conn_send_pending_piece(pc);
+    pwp_conn_send_pending_piece(pc);
+    pwp_conn_send_pending_piece(pc);
+    CuAssertTrue(tc, 3 == __nserved);
+    CuAssertTrue(tc, 5 == __served[1].piece_idx);
+    CuAssertTrue(tc, 4 == __served[2].piece_idx);
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+void TestPWP_conn_cancel_and_rerequest_doesnt_grow_queue(CuTest * tc)
+{
+    mocksend_t ms;
+    chunkybar_t *have;
+    void *pc = __conn_new_serving(&ms, &have);
+    int i;
+
+    for (i = 0; i < 10000; i++)
+    {
+        __peer_request(pc, 1, 0, 10);
+        __peer_cancel(pc, 1, 0, 10);
+    }
+    __peer_request(pc, 1, 0, 10);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_peer_requests(pc));
+    CuAssertTrue(tc, 10 == pwp_conn_send_pending_piece(pc));
+    CuAssertTrue(tc, 1 == __nserved);
+    CuAssertTrue(tc, 0 == pwp_conn_send_pending_piece(pc));
+    CuAssertTrue(tc, 1 == __nserved);
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+static unsigned int __now = 0;
+
+static unsigned int __mock_get_time_ms(void *udata)
+{
+    return __now;
+}
+
+void TestPWP_conn_rtt_is_quickest_reply_of_last_period(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc;
+
+    memset(&ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .pushblock = __mock_pushblock,
+                           .get_time_ms = __mock_get_time_ms
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+
+    __now = 1000;
+    __request(pc, 1, 0, 10);
+    __request(pc, 1, 10, 10);
+    __now = 1050;
+    __piece(pc, 1, 10, 10);
+    __now = 1080;
+    __piece(pc, 1, 0, 10);
+    CuAssertTrue(tc, 0 == pwp_conn_get_rtt(pc));
+    pwp_conn_sample_rates(pc);
+    CuAssertTrue(tc, 50 == pwp_conn_get_rtt(pc));
+
+    /* no replies this period; keep what we had */
+    pwp_conn_sample_rates(pc);
+    CuAssertTrue(tc, 50 == pwp_conn_get_rtt(pc));
+
+    __request(pc, 2, 0, 10);
+    __now = 1280;
+    __piece(pc, 2, 0, 10);
+    pwp_conn_sample_rates(pc);
+    CuAssertTrue(tc, 200 == pwp_conn_get_rtt(pc));
+    pwp_conn_release(pc);
+}
+
+static int __polls = 0;
+
+static int __mock_pollblock(void *udata, void *peer)
+{
+    __polls++;
+    return 0;
+}
+
+void TestPWP_conn_pipeline_is_filled_to_max_pending_requests(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc;
+
+    memset(&ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .pollblock = __mock_pollblock
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_set_im_interested(pc);
+    pwp_conn_unchoke(pc);
+
+    __polls = 0;
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 10 == __polls);
+
+    pwp_conn_set_max_pending_requests(pc, 30);
+    __request(pc, 1, 0, 10);
+    __request(pc, 1, 10, 10);
+    __polls = 0;
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 28 == __polls);
+    pwp_conn_release(pc);
+}
+
+static void* __conn_new_timed(mocksend_t* ms)
+{
+    void *pc;
+
+    memset(ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .pushblock = __mock_pushblock,
+                           .peer_giveback_block = __mock_giveback_block,
+                           .get_time_ms = __mock_get_time_ms
+                           }), ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    return pc;
+}
+
+void TestPWP_conn_srtt_follows_reply_latency(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_timed(&ms);
+    int i;
+
+    CuAssertTrue(tc, 0 == pwp_conn_get_srtt(pc));
+    CuAssertTrue(tc, 10000 == pwp_conn_get_request_timeout(pc));
+
+    __now = 0;
+    __request(pc, 1, 0, 10);
+    __now = 800;
+    __piece(pc, 1, 0, 10);
+    CuAssertTrue(tc, 800 == pwp_conn_get_srtt(pc));
+    CuAssertTrue(tc, 400 == pwp_conn_get_rttvar(pc));
+    CuAssertTrue(tc, 800 + 4 * 400 == pwp_conn_get_request_timeout(pc));
+
+    /* steady replies shrink the variation; the timeout has a floor */
+    for (i = 0; i < 50; i++)
+    {
+        __request(pc, 1, 0, 10);
+        __now += 800;
+        __piece(pc, 1, 0, 10);
+    }
+    CuAssertTrue(tc, 800 == pwp_conn_get_srtt(pc));
+    CuAssertTrue(tc, 2000 == pwp_conn_get_request_timeout(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_requests_time_out_from_latency_estimate(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_timed(&ms);
+
+    __givebacks = 0;
+    __now = 0;
+    __request(pc, 1, 0, 10);
+    __now = 3000;
+    __piece(pc, 1, 0, 10);
+
+    /* timeout is now 3000 + 4 * 1500 */
+    __request(pc, 2, 0, 10);
+    __now = 3000 + 8000;
+    pwp_conn_tick(pc);
+    CuAssertTrue(tc, 0 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_is_snubbed(pc));
+    __now = 3000 + 9001;
+    pwp_conn_tick(pc);
+    CuAssertTrue(tc, 1 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+
+    /* until it sends us something */
+    CuAssertTrue(tc, 1 == pwp_conn_is_snubbed(pc));
+    __request(pc, 3, 0, 10);
+    __piece(pc, 3, 0, 10);
+    CuAssertTrue(tc, 0 == pwp_conn_is_snubbed(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_rate_is_per_second_however_often_sampled(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_timed(&ms);
+    void *pc2 = __conn_new_timed(&ms);
+    int i;
+
+    pwp_conn_set_rate_window(pc, 1000);
+    pwp_conn_set_rate_window(pc2, 1000);
+    __now = 0;
+    pwp_conn_sample_rates(pc);
+    pwp_conn_sample_rates(pc2);
+
+    /* 1000 bytes/s, sampled every 100ms and every 2s */
+    for (i = 0; i < 40; i++)
+    {
+        __request(pc, 1, 0, 100);
+        __piece(pc, 1, 0, 100);
+        __request(pc2, 1, 0, 100);
+        __piece(pc2, 1, 0, 100);
+        __now += 100;
+        pwp_conn_sample_rates(pc);
+        if (0 == __now % 2000)
+            pwp_conn_sample_rates(pc2);
+    }
+    CuAssertTrue(tc, 950 <= pwp_conn_get_download_rate(pc));
+    CuAssertTrue(tc, pwp_conn_get_download_rate(pc) <= 1000);
+    CuAssertTrue(tc, 1000 == pwp_conn_get_download_rate(pc2));
+    pwp_conn_release(pc);
+    pwp_conn_release(pc2);
+}
+
+void TestPWP_conn_sent_pieces_count_towards_upload_rate(CuTest * tc)
+{
+    mocksend_t ms;
+    chunkybar_t *have;
+    void *pc = __conn_new_serving(&ms, &have);
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .send_block_from_file = __mock_send_block_from_file,
+                           .write_block_to_stream = __mock_write_block_to_stream,
+                           .get_time_ms = __mock_get_time_ms
+                           }), &ms);
+    __now = 0;
+    pwp_conn_set_rate_window(pc, 1000);
+    pwp_conn_sample_rates(pc);
+    __peer_request(pc, 1, 0, 500);
+    __peer_request(pc, 1, 500, 500);
+    pwp_conn_send_pending_piece(pc);
+    pwp_conn_send_pending_piece(pc);
+    __now = 1000;
+    pwp_conn_sample_rates(pc);
+    CuAssertTrue(tc, 1000 == pwp_conn_get_upload_rate(pc));
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+static int __nbitfields = 0;
+static uint64_t __bitfield_words[2];
+static int __bitfield_npieces = 0;
+static int __npeerhaves = 0;
+
+static void __mock_peer_have_bitfield(void *udata, void *peer,
+                                      const uint64_t* words, int npieces)
+{
+    __nbitfields++;
+    memcpy(__bitfield_words, words, sizeof(__bitfield_words));
+    __bitfield_npieces = npieces;
+}
+
+static void __mock_peer_have_piece(void *udata, void *peer, int piece)
+{
+    __npeerhaves++;
+}
+
+static void __bitfield(void* pc, int npieces, int* pieces, int n)
+{
+    msg_bitfield_t msg;
+    int i;
+
+    msg.bf = bitfield_new(npieces);
+    for (i = 0; i < n; i++)
+        bitfield_mark(msg.bf, pieces[i]);
+    pwp_conn_bitfield(pc, &msg);
+    bitfield_free(msg.bf);
+}
+
+void TestPWP_conn_bitfield_is_passed_on_in_one_call(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+    int pieces[] = { 0, 9, 63, 64, 99 };
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .peer_have_piece = __mock_peer_have_piece,
+                           .peer_have_bitfield = __mock_peer_have_bitfield
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    __nbitfields = __npeerhaves = 0;
+    __bitfield(pc, 100, pieces, 5);
+    CuAssertTrue(tc, 1 == __nbitfields);
+    CuAssertTrue(tc, 0 == __npeerhaves);
+    CuAssertTrue(tc, 100 == __bitfield_npieces);
+    CuAssertTrue(tc, ((1ull << 63) | (1ull << 9) | 1ull) ==
+                 __bitfield_words[0]);
+    CuAssertTrue(tc, ((1ull << 35) | 1ull) == __bitfield_words[1]);
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 63));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 99));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 98));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_bitfield_falls_back_to_each_piece(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+    int pieces[] = { 1, 50, 99 };
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .peer_have_piece = __mock_peer_have_piece
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    __npeerhaves = 0;
+    __bitfield(pc, 100, pieces, 3);
+    CuAssertTrue(tc, 3 == __npeerhaves);
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 50));
+    pwp_conn_release(pc);
+}
+
+static int __disconnects = 0;
+
+static int __mock_disconnect(void *udata, void *peer, char *reason)
+{
+    __disconnects++;
+    return 1;
+}
+
+static void* __mock_call_exclusively(void* me, void* cb_ctx, void **lock,
+                                     void* udata,
+                                     void* (*cb)(void* me, void* udata))
+{
+    return cb(me, udata);
+}
+
+void TestPWP_conn_reject_gives_back_request_straight_away(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+    bt_block_t b = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    pwp_conn_enable_fast_extension(pc);
+    __givebacks = 0;
+    __request(pc, 1, 0, 10);
+    __request(pc, 1, 10, 10);
+    pwp_conn_reject(pc, &b);
+    CuAssertTrue(tc, 1 == __givebacks);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 0 == __pending(pc, 1, 0, 10));
+
+    /* rejecting it again doesn't give it back twice */
+    pwp_conn_reject(pc, &b);
+    CuAssertTrue(tc, 1 == __givebacks);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_fast_choke_leaves_requests_to_be_rejected(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms);
+
+    pwp_conn_enable_fast_extension(pc);
+    __givebacks = 0;
+    __request(pc, 1, 0, 10);
+    pwp_conn_choke(pc);
+    CuAssertTrue(tc, 0 == __givebacks);
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 0, 10));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_fast_messages_need_the_extension(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .disconnect = __mock_disconnect
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    __disconnects = 0;
+    pwp_conn_have_all(pc);
+    CuAssertTrue(tc, 1 == __disconnects);
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 0));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_have_all_marks_every_piece(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .peer_have_bitfield = __mock_peer_have_bitfield
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_enable_fast_extension(pc);
+    __nbitfields = 0;
+    pwp_conn_have_all(pc);
+    CuAssertTrue(tc, 1 == __nbitfields);
+    CuAssertTrue(tc, 100 == __bitfield_npieces);
+    CuAssertTrue(tc, ~0ull == __bitfield_words[0]);
+    CuAssertTrue(tc, ((1ull << 36) - 1) == __bitfield_words[1]);
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 99));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 100));
+    CuAssertTrue(tc, 1 == pwp_conn_flag_is_set(pc, PC_BITFIELD_RECEIVED));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_fast_choking_peer_rejects_their_requests(CuTest * tc)
+{
+    mocksend_t ms;
+    chunkybar_t *have;
+    void *pc = __conn_new_serving(&ms, &have);
+
+    pwp_conn_enable_fast_extension(pc);
+    __peer_request(pc, 1, 0, 10);
+    __peer_request(pc, 1, 10, 10);
+    __peer_cancel(pc, 1, 10, 10);
+    ms.len = 0;
+    pwp_conn_choke_peer(pc);
+
+    /* CHOKE, then a REJECT for what's still queued */
+    CuAssertTrue(tc, 5 + 17 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_CHOKE == ms.data[4]);
+    CuAssertTrue(tc, PWP_MSGTYPE_REJECT == ms.data[5 + 4]);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_peer_requests(pc));
+
+    /* a request that crossed the choke is answered, not fatal */
+    ms.len = 0;
+    CuAssertTrue(tc, 1 == __peer_request(pc, 1, 20, 10));
+    CuAssertTrue(tc, 17 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_REJECT == ms.data[4]);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_peer_requests(pc));
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+void TestPWP_conn_fast_cancel_is_answered_with_reject(CuTest * tc)
+{
+    mocksend_t ms;
+    chunkybar_t *have;
+    void *pc = __conn_new_serving(&ms, &have);
+
+    pwp_conn_enable_fast_extension(pc);
+    __peer_request(pc, 1, 0, 10);
+    ms.len = 0;
+    __peer_cancel(pc, 1, 0, 10);
+    CuAssertTrue(tc, 17 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_REJECT == ms.data[4]);
+
+    /* nothing to reject */
+    __peer_cancel(pc, 1, 0, 10);
+    CuAssertTrue(tc, 17 == ms.len);
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+static int __batch_max = 0;
+
+static int __mock_pollblocks(void *udata, void *peer, int max)
+{
+    __polls++;
+    __batch_max = max;
+    return 0;
+}
+
+void TestPWP_conn_pipeline_is_filled_with_one_batched_poll(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc;
+    bt_block_t b[3] = {
+        { .piece_idx = 1, .offset = 0, .len = 10 },
+        { .piece_idx = 1, .offset = 10, .len = 10 },
+        { .piece_idx = 2, .offset = 0, .len = 10 } };
+
+    memset(&ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .pollblock = __mock_pollblock,
+                           .pollblocks = __mock_pollblocks,
+                           .call_exclusively = __mock_call_exclusively
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_set_im_interested(pc);
+    pwp_conn_unchoke(pc);
+
+    __polls = 0;
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 1 == __polls);
+    CuAssertTrue(tc, 10 == __batch_max);
+
+    /* offered together, requested in order */
+    pwp_conn_offer_blocks(pc, b, 3);
+    CuAssertTrue(tc, 3 == pwp_conn_get_nqueued_requests(pc));
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_get_nqueued_requests(pc));
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 0, 10));
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 10, 10));
+    CuAssertTrue(tc, 1 == __pending(pc, 2, 0, 10));
+
+    /* the pipeline has three less slots */
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 7 == __batch_max);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_seed_mode_drops_the_download_side(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc;
+    int i;
+    unsigned long mem;
+    bt_block_t b = { .piece_idx = 3, .offset = 0, .len = 10 };
+
+    memset(&ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .pollblocks = __mock_pollblocks,
+                           .peer_giveback_block = __mock_giveback_block,
+                           .call_exclusively = __mock_call_exclusively
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_set_im_interested(pc);
+    pwp_conn_unchoke(pc);
+    for (i = 0; i < 40; i++)
+        __request(pc, i / 4, (i % 4) * 10, 10);
+    pwp_conn_offer_block(pc, &b);
+    mem = pwp_conn_get_memory(pc);
+
+    __givebacks = 0;
+    pwp_conn_set_seed_mode(pc);
+    CuAssertTrue(tc, 40 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 0 == pwp_conn_get_nqueued_requests(pc));
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, pwp_conn_get_memory(pc) < mem);
+
+    /* nothing is polled, offered or asked for */
+    __polls = 0;
+    pwp_conn_offer_block(pc, &b);
+    pwp_conn_offer_blocks(pc, &b, 1);
+    pwp_conn_set_im_interested(pc);
+    pwp_conn_periodic(pc);
+    CuAssertTrue(tc, 0 == __polls);
+    CuAssertTrue(tc, 0 == pwp_conn_get_nqueued_requests(pc));
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_only_allowed_fast_blocks_are_requested_while_choked(
+    CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc;
+    bt_block_t b1 = { .piece_idx = 1, .offset = 0, .len = 10 };
+    bt_block_t b2 = { .piece_idx = 2, .offset = 0, .len = 10 };
+    msg_have_t allowed = { .piece_idx = 2 };
+
+    memset(&ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .pollblock = __mock_pollblock,
+                           .call_exclusively = __mock_call_exclusively
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_enable_fast_extension(pc);
+    pwp_conn_set_im_interested(pc);
+    pwp_conn_offer_block(pc, &b1);
+    pwp_conn_offer_block(pc, &b2);
+
+    /* choked with nothing allowed */
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+
+    pwp_conn_allowed_fast(pc, &allowed);
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 1 == __pending(pc, 2, 0, 10));
+
+    /* the other block goes once we're unchoked */
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npending_requests(pc));
+    pwp_conn_unchoke(pc);
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 1 == __pending(pc, 1, 0, 10));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_offered_blocks_are_requested_oldest_first(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc;
+    int i;
+
+    memset(&ms, 0, sizeof(mocksend_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .pollblock = __mock_pollblock,
+                           .call_exclusively = __mock_call_exclusively
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_set_im_interested(pc);
+    for (i = 0; i < 100; i++)
+    {
+        bt_block_t b = { .piece_idx = i, .offset = 0, .len = 10 };
+
+        pwp_conn_offer_block(pc, &b);
+    }
+    CuAssertTrue(tc, 100 == pwp_conn_get_nqueued_requests(pc));
+
+    /* a service fills the pipeline, oldest first */
+    pwp_conn_unchoke(pc);
+    pwp_conn_set_max_pending_requests(pc, 10);
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 90 == pwp_conn_get_nqueued_requests(pc));
+    CuAssertTrue(tc, 10 == pwp_conn_get_npending_requests(pc));
+    for (i = 0; i < 10; i++)
+        CuAssertTrue(tc, 1 == __pending(pc, i, 0, 10));
+    CuAssertTrue(tc, 0 == __pending(pc, 10, 0, 10));
+
+    /* and a full one waits */
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 90 == pwp_conn_get_nqueued_requests(pc));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_fast_messages_are_dispatched_byte_by_byte(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new_requesting(&ms), *mh;
+    /* PORT (unhandled), REJECT piece 1 offset 0 len 10, HAVE_ALL */
+    const char msgs[] = {
+        0, 0, 0, 3, 9, 0x1a, 0xe1,
+        0, 0, 0, 13, PWP_MSGTYPE_REJECT, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 10,
+        0, 0, 0, 1, PWP_MSGTYPE_HAVE_ALL };
+    unsigned int i;
+
+    pwp_conn_enable_fast_extension(pc);
+    mh = pwp_msghandler_new(pc);
+    __givebacks = 0;
+    __request(pc, 1, 0, 10);
+    for (i = 0; i < sizeof(msgs); i++)
+        CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh,
+                                                                  msgs + i, 1));
+    CuAssertTrue(tc, 1 == __givebacks);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npending_requests(pc));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(pc, 50));
+
+    /* and in one go */
+    pwp_conn_set_state(pc, 0);
+    pwp_conn_enable_fast_extension(pc);
+    __request(pc, 1, 0, 10);
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, msgs,
+                                                              sizeof(msgs)));
+    CuAssertTrue(tc, 2 == __givebacks);
+    pwp_msghandler_release(mh);
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_peer_pieces_are_only_announced_once(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+    int pieces[] = { 1 };
+
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .peer_have_piece = __mock_peer_have_piece,
+                           .disconnect = __mock_disconnect
+                           }), &ms);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    __npeerhaves = __disconnects = 0;
+    pwp_conn_mark_peer_has_piece(pc, 70);
+    pwp_conn_mark_peer_has_piece(pc, 70);
+    CuAssertTrue(tc, 1 == __npeerhaves);
+    CuAssertTrue(tc, 1 == pwp_conn_get_npeer_pieces(pc));
+    CuAssertTrue(tc, (1ull << 6) == pwp_conn_get_peer_pieces(pc)[1]);
+
+    /* a bitfield is too late now */
+    __bitfield(pc, 100, pieces, 1);
+    CuAssertTrue(tc, 1 == __disconnects);
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(pc, 1));
+    pwp_conn_release(pc);
+}
+
+void TestPWP_conn_interest_follows_what_the_peer_has_that_we_dont(
+    CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+    chunkybar_t *have = chunky_new(100);
+    int pieces[] = { 1, 2 };
+
+    chunky_mark_complete(have, 0, 2);
+    pwp_conn_set_progress(pc, have);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+
+    /* nothing we need */
+    __bitfield(pc, 100, pieces, 1);
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, 0 == ms.len);
+
+    pwp_conn_mark_peer_has_piece(pc, 2);
+    pwp_conn_mark_peer_has_piece(pc, 3);
+    CuAssertTrue(tc, 1 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, 2 == pwp_conn_get_npieces_wanted(pc));
+    CuAssertTrue(tc, 5 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_INTERESTED == ms.data[4]);
+
+    /* we catch up with the peer */
+    pwp_conn_we_have_piece(pc, 2);
+    pwp_conn_we_have_piece(pc, 50);
+    CuAssertTrue(tc, 1 == pwp_conn_im_interested(pc));
+    pwp_conn_we_have_piece(pc, 3);
+    pwp_conn_we_have_piece(pc, 3);
+    CuAssertTrue(tc, 0 == pwp_conn_get_npieces_wanted(pc));
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, 10 == ms.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_UNINTERESTED == ms.data[5 + 4]);
+    pwp_conn_release(pc);
+    chunky_free(have);
+}
+
+void TestPWP_conn_service_doesnt_make_us_interested(CuTest * tc)
+{
+    mocksend_t ms;
+    void *pc = __conn_new(&ms);
+
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_service(pc);
+    CuAssertTrue(tc, 0 == pwp_conn_im_interested(pc));
+    CuAssertTrue(tc, 0 == ms.len);
+    pwp_conn_release(pc);
+}
+
+typedef struct
+{
+    unsigned char added[PWP_PEX_MAX * PWP_PEX_ADDR_LEN];
+    int nadded;
+    int ndropped;
+} __pex_t;
+
+static __pex_t __pex;
+
+static void __mock_peer_exchange(void *udata, void *peer,
+                                 const unsigned char* added, int nadded,
+                                 const unsigned char* dropped, int ndropped)
+{
+    memcpy(__pex.added, added, nadded * PWP_PEX_ADDR_LEN);
+    __pex.nadded = nadded;
+    __pex.ndropped = ndropped;
+}
+
+/**
+ * Connections a and b, each having read the other's extension handshake */
+static void __extended_pair(mocksend_t* msa, void** a, mocksend_t* msb,
+                            void** b)
+{
+    void* mh;
+
+    *a = __conn_new(msa);
+    *b = __conn_new(msb);
+    pwp_conn_set_cbs(*b, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .peer_exchange = __mock_peer_exchange
+                           }), msb);
+    pwp_conn_enable_extension_protocol(*a);
+    pwp_conn_enable_extension_protocol(*b);
+    pwp_conn_send_extended_handshake(*a, 6881);
+    pwp_conn_send_extended_handshake(*b, 0);
+
+    mh = pwp_msghandler_new(*a);
+    pwp_msghandler_dispatch_from_buffer(mh, msb->data, msb->len);
+    pwp_msghandler_release(mh);
+    mh = pwp_msghandler_new(*b);
+    pwp_msghandler_dispatch_from_buffer(mh, msa->data, msa->len);
+    pwp_msghandler_release(mh);
+    msa->len = msb->len = 0;
+}
+
+void TestPWP_conn_extended_handshake_says_pex_and_listen_port(CuTest * tc)
+{
+    mocksend_t msa, msb;
+    void *a, *b, *mh;
+    unsigned int i;
+
+    a = __conn_new(&msa);
+    b = __conn_new(&msb);
+    pwp_conn_enable_extension_protocol(a);
+    pwp_conn_enable_extension_protocol(b);
+    CuAssertTrue(tc, 1 == pwp_conn_send_extended_handshake(a, 6881));
+    CuAssertTrue(tc, PWP_MSGTYPE_EXTENDED == msa.data[4]);
+    CuAssertTrue(tc, PWP_EXTENDED_HANDSHAKE == msa.data[5]);
+
+    mh = pwp_msghandler_new(b);
+    for (i = 0; i < (unsigned int)msa.len; i++)
+        CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(
+                         mh, msa.data + i, 1));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_supports_pex(b));
+    CuAssertTrue(tc, 6881 == pwp_conn_get_peer_listen_port(b));
+    pwp_msghandler_release(mh);
+    pwp_conn_release(a);
+    pwp_conn_release(b);
+}
+
+void TestPWP_conn_extended_messages_need_the_extension(CuTest * tc)
+{
+    mocksend_t msa, msb;
+    void *a, *b, *mh;
+
+    a = __conn_new(&msa);
+    b = __conn_new(&msb);
+    CuAssertTrue(tc, 0 == pwp_conn_send_extended_handshake(b, 6881));
+    pwp_conn_enable_extension_protocol(a);
+    pwp_conn_send_extended_handshake(a, 6881);
+
+    /* b didn't set the handshake bit, so it doesn't know the message */
+    mh = pwp_msghandler_new(b);
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, msa.data,
+                                                              msa.len));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_supports_pex(b));
+    pwp_msghandler_release(mh);
+
+    /* a can't send PEX to a peer that hasn't said it takes it */
+    CuAssertTrue(tc, 0 == pwp_conn_send_pex(a, NULL, 0, NULL, 0));
+    pwp_conn_release(a);
+    pwp_conn_release(b);
+}
+
+void TestPWP_conn_pex_addresses_arrive_as_binary_keys(CuTest * tc)
+{
+    mocksend_t msa, msb;
+    void *a, *b, *mh;
+    unsigned char addrs[3 * PWP_PEX_ADDR_LEN];
+    unsigned int i;
+
+    memset(addrs, 0, sizeof(addrs));
+    /* 10.0.0.1:6881, ::1:6882 and 10.0.0.2:80 */
+    addrs[10] = addrs[11] = 0xff;
+    memcpy(addrs + 12, "\x0a\x00\x00\x01\x1a\xe1", 6);
+    memcpy(addrs + PWP_PEX_ADDR_LEN + 15, "\x01\x1a\xe2", 3);
+    addrs[2 * PWP_PEX_ADDR_LEN + 10] = addrs[2 * PWP_PEX_ADDR_LEN + 11] = 0xff;
+    memcpy(addrs + 2 * PWP_PEX_ADDR_LEN + 12, "\x0a\x00\x00\x02\x00\x50", 6);
+
+    __extended_pair(&msa, &a, &msb, &b);
+    CuAssertTrue(tc, 1 == pwp_conn_send_pex(a, addrs, 3,
+                                            addrs + PWP_PEX_ADDR_LEN, 1));
+
+    memset(&__pex, 0, sizeof(__pex));
+    mh = pwp_msghandler_new(b);
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, msa.data,
+                                                              msa.len));
+    /* IPv4 comes first */
+    CuAssertTrue(tc, 3 == __pex.nadded);
+    CuAssertTrue(tc, 1 == __pex.ndropped);
+    CuAssertTrue(tc, 0 == memcmp(__pex.added, addrs, PWP_PEX_ADDR_LEN));
+    CuAssertTrue(tc, 0 == memcmp(__pex.added + PWP_PEX_ADDR_LEN,
+                                 addrs + 2 * PWP_PEX_ADDR_LEN,
+                                 PWP_PEX_ADDR_LEN));
+    CuAssertTrue(tc, 0 == memcmp(__pex.added + 2 * PWP_PEX_ADDR_LEN,
+                                 addrs + PWP_PEX_ADDR_LEN, PWP_PEX_ADDR_LEN));
+
+    /* and a byte at a time */
+    memset(&__pex, 0, sizeof(__pex));
+    for (i = 0; i < (unsigned int)msa.len; i++)
+        CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(
+                         mh, msa.data + i, 1));
+    CuAssertTrue(tc, 3 == __pex.nadded);
+    pwp_msghandler_release(mh);
+    pwp_conn_release(a);
+    pwp_conn_release(b);
+}
+
+void TestPWP_conn_malformed_pex_is_ignored(CuTest * tc)
+{
+    mocksend_t msa, msb;
+    void *a, *b, *mh;
+    /* "added" says 12 bytes follow but there are 6 */
+    const char msg[] = "\0\0\0\x14\x14\x01" "d5:added12:\x0a\0\0\x01\x1a\xe1"
+                       "e";
+
+    __extended_pair(&msa, &a, &msb, &b);
+    memset(&__pex, 0, sizeof(__pex));
+    mh = pwp_msghandler_new(b);
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, msg,
+                                                              sizeof(msg) - 1));
+    CuAssertTrue(tc, 0 == __pex.nadded);
+    pwp_msghandler_release(mh);
+    pwp_conn_release(a);
+    pwp_conn_release(b);
+}
+
+void TestPWP_conn_kept_bitfield_message_is_read_back(CuTest * tc)
+{
+    mocksend_t msa, msb;
+    void *a = __conn_new(&msa), *b = __conn_new(&msb), *mh;
+    /* more than a small stack buffer would have held */
+    pwp_bitfield_msg_t bf;
+
+    pwp_bitfield_msg_init(&bf, 10001);
+    pwp_bitfield_msg_mark(&bf, 0);
+    pwp_bitfield_msg_mark(&bf, 9);
+    pwp_bitfield_msg_mark(&bf, 10000);
+    CuAssertTrue(tc, 5 + 1251 == pwp_bitfield_msg_len(&bf));
+    CuAssertTrue(tc, 1 == pwp_send_bitfield(&bf, __mock_send, &msa, NULL));
+    CuAssertTrue(tc, 5 + 1251 == msa.len);
+    CuAssertTrue(tc, PWP_MSGTYPE_BITFIELD == msa.data[4]);
+
+    pwp_conn_set_piece_info(b, 10001, 1000);
+    mh = pwp_msghandler_new(b);
+    CuAssertTrue(tc, 1 == pwp_msghandler_dispatch_from_buffer(mh, msa.data,
+                                                              msa.len));
+    CuAssertTrue(tc, 3 == pwp_conn_get_npeer_pieces(b));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(b, 9));
+    CuAssertTrue(tc, 1 == pwp_conn_peer_has_piece(b, 10000));
+    CuAssertTrue(tc, 0 == pwp_conn_peer_has_piece(b, 8));
+    pwp_msghandler_release(mh);
+    pwp_bitfield_msg_release(&bf);
+    pwp_conn_release(a);
+    pwp_conn_release(b);
+}
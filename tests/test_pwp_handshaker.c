@@ -0,0 +1,246 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "pwp_handshaker.h"
+
+#define INFOHASH "00000000000000000000"
+#define PEERID "11111111111111111111"
+
+/* protocol name length, protocol name, reserved, infohash, peer id */
+#define HANDSHAKE_LEN (1 + 19 + 8 + 20 + 20)
+
+typedef struct
+{
+    int len;
+    char data[128];
+} mocksend_t;
+
+static int __mock_send(
+    void *callee,
+    const void *udata,
+    const void *send_data,
+    const int len
+    )
+{
+    mocksend_t *ms = callee;
+
+    memcpy(ms->data + ms->len, send_data, len);
+    ms->len += len;
+    return 1;
+}
+
+/**
+ * Write the handshake a peer sends us for this infohash */
+static void __handshake(mocksend_t* ms, const char* infohash)
+{
+    memset(ms, 0, sizeof(mocksend_t));
+    pwp_send_handshake(ms, NULL, __mock_send, (char*)infohash, PEERID);
+}
+
+void TestPWP_handshaker_reads_whole_handshake(
+    CuTest * tc
+)
+{
+    mocksend_t ms;
+    pwp_handshake_t* hs;
+    const char* buf;
+    unsigned int len;
+    void *h;
+
+    __handshake(&ms, INFOHASH);
+    CuAssertTrue(tc, HANDSHAKE_LEN == ms.len);
+
+    h = pwp_handshaker_new(INFOHASH, PEERID);
+    buf = ms.data;
+    len = ms.len;
+    CuAssertTrue(tc, 1 == pwp_handshaker_dispatch_from_buffer(h, &buf, &len));
+    CuAssertTrue(tc, 0 == len);
+    CuAssertTrue(tc, buf == ms.data + HANDSHAKE_LEN);
+
+    hs = pwp_handshaker_get_handshake(h);
+    CuAssertTrue(tc, 19 == hs->pn_len);
+    CuAssertTrue(tc, 0 == memcmp(hs->pn, "BitTorrent protocol", 19));
+    CuAssertTrue(tc, 0 == memcmp(hs->infohash, INFOHASH, 20));
+    CuAssertTrue(tc, 0 == memcmp(hs->peerid, PEERID, 20));
+    CuAssertTrue(tc, PWP_HANDSHAKE_RESERVED_FAST ==
+                 pwp_handshaker_get_reserved(h)[
+                     PWP_HANDSHAKE_RESERVED_FAST_BYTE]);
+    CuAssertTrue(tc, NULL == pwp_handshaker_get_error(h));
+    pwp_handshaker_release(h);
+}
+
+void TestPWP_handshaker_leaves_bytes_after_handshake(
+    CuTest * tc
+)
+{
+    mocksend_t ms;
+    const char* buf;
+    unsigned int len;
+    void *h;
+
+    __handshake(&ms, INFOHASH);
+    memcpy(ms.data + ms.len, "\0\0\0\0", 4);
+
+    h = pwp_handshaker_new(INFOHASH, PEERID);
+    buf = ms.data;
+    len = ms.len + 4;
+    CuAssertTrue(tc, 1 == pwp_handshaker_dispatch_from_buffer(h, &buf, &len));
+    CuAssertTrue(tc, 4 == len);
+    CuAssertTrue(tc, buf == ms.data + HANDSHAKE_LEN);
+    pwp_handshaker_release(h);
+}
+
+void TestPWP_handshaker_reads_handshake_split_at_every_byte(
+    CuTest * tc
+)
+{
+    mocksend_t ms;
+    int split;
+
+    __handshake(&ms, INFOHASH);
+
+    for (split = 1; split < HANDSHAKE_LEN; split++)
+    {
+        pwp_handshake_t* hs;
+        const char* buf = ms.data;
+        unsigned int len = split;
+        void *h = pwp_handshaker_new(INFOHASH, PEERID);
+
+        CuAssertTrue(tc, 0 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                                  &len));
+        CuAssertTrue(tc, 0 == len);
+
+        len = HANDSHAKE_LEN - split;
+        CuAssertTrue(tc, 1 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                                  &len));
+        CuAssertTrue(tc, 0 == len);
+
+        hs = pwp_handshaker_get_handshake(h);
+        CuAssertTrue(tc, 0 == memcmp(hs->infohash, INFOHASH, 20));
+        CuAssertTrue(tc, 0 == memcmp(hs->peerid, PEERID, 20));
+        pwp_handshaker_release(h);
+    }
+}
+
+void TestPWP_handshaker_reads_handshake_a_byte_at_a_time(
+    CuTest * tc
+)
+{
+    mocksend_t ms;
+    const char* buf;
+    void *h;
+    int i;
+
+    __handshake(&ms, INFOHASH);
+
+    h = pwp_handshaker_new(INFOHASH, PEERID);
+    buf = ms.data;
+    for (i = 0; i < HANDSHAKE_LEN; i++)
+    {
+        unsigned int len = 1;
+
+        CuAssertTrue(tc, (i == HANDSHAKE_LEN - 1) ==
+                     pwp_handshaker_dispatch_from_buffer(h, &buf, &len));
+    }
+    CuAssertTrue(tc, 0 == memcmp(pwp_handshaker_get_handshake(h)->peerid,
+                                 PEERID, 20));
+    pwp_handshaker_release(h);
+}
+
+void TestPWP_handshaker_fails_on_wrong_infohash(
+    CuTest * tc
+)
+{
+    mocksend_t ms;
+    const char* buf;
+    unsigned int len;
+    void *h;
+
+    __handshake(&ms, "00000000000000000001");
+
+    h = pwp_handshaker_new(INFOHASH, PEERID);
+    buf = ms.data;
+    len = ms.len;
+    CuAssertTrue(tc, -1 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                               &len));
+    CuAssertTrue(tc, NULL != pwp_handshaker_get_error(h));
+    pwp_handshaker_release(h);
+
+    /* and when it comes in pieces */
+    h = pwp_handshaker_new(INFOHASH, PEERID);
+    buf = ms.data;
+    len = 30;
+    CuAssertTrue(tc, 0 == pwp_handshaker_dispatch_from_buffer(h, &buf, &len));
+    len = ms.len - 30;
+    CuAssertTrue(tc, -1 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                               &len));
+    CuAssertTrue(tc, NULL != pwp_handshaker_get_error(h));
+    pwp_handshaker_release(h);
+}
+
+void TestPWP_handshaker_compares_all_of_an_infohash_holding_nul(
+    CuTest * tc
+)
+{
+    char expected[20], theirs[20];
+    mocksend_t ms;
+    const char* buf;
+    unsigned int len;
+    void *h;
+
+    /* the two differ only after the NUL */
+    memcpy(expected, "abcd\0fghijklmnopqrst", 20);
+    memcpy(theirs, "abcd\0XXXXXXXXXXXXXXX", 20);
+
+    __handshake(&ms, theirs);
+    h = pwp_handshaker_new(expected, PEERID);
+    buf = ms.data;
+    len = ms.len;
+    CuAssertTrue(tc, -1 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                               &len));
+    pwp_handshaker_release(h);
+
+    h = pwp_handshaker_new(expected, PEERID);
+    buf = ms.data;
+    len = 40;
+    CuAssertTrue(tc, 0 == pwp_handshaker_dispatch_from_buffer(h, &buf, &len));
+    len = ms.len - 40;
+    CuAssertTrue(tc, -1 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                               &len));
+    pwp_handshaker_release(h);
+
+    /* the same infohash, NUL and all, is accepted */
+    __handshake(&ms, expected);
+    h = pwp_handshaker_new(expected, PEERID);
+    buf = ms.data;
+    len = ms.len;
+    CuAssertTrue(tc, 1 == pwp_handshaker_dispatch_from_buffer(h, &buf, &len));
+    pwp_handshaker_release(h);
+}
+
+void TestPWP_handshaker_fails_on_wrong_protocol_name(
+    CuTest * tc
+)
+{
+    mocksend_t ms;
+    const char* buf;
+    unsigned int len;
+    void *h;
+
+    __handshake(&ms, INFOHASH);
+    ms.data[1] = 'b';
+
+    h = pwp_handshaker_new(INFOHASH, PEERID);
+    buf = ms.data;
+    len = ms.len;
+    CuAssertTrue(tc, -1 == pwp_handshaker_dispatch_from_buffer(h, &buf,
+                                                               &len));
+    CuAssertTrue(tc, NULL != pwp_handshaker_get_error(h));
+    pwp_handshaker_release(h);
+}
@@ -0,0 +1,318 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bitfield.h"
+#include "pwp_connection.h"
+#include "pwp_msghandler.h"
+
+/* what the connection was told of a message we read */
+typedef struct
+{
+    int type;
+    unsigned int piece_idx;
+    unsigned int offset;
+    unsigned int len;
+    char data[16];
+} event_t;
+
+typedef struct
+{
+    event_t events[8];
+    int nevents;
+    int disconnects;
+} record_t;
+
+static int __mock_send(
+    void *udata,
+    const void *peer,
+    const void *send_data,
+    const int len
+    )
+{
+    return 1;
+}
+
+static event_t* __event(record_t* r, int type)
+{
+    event_t* e;
+
+    assert(r->nevents < 8);
+    e = &r->events[r->nevents++];
+    memset(e, 0, sizeof(event_t));
+    e->type = type;
+    return e;
+}
+
+static void __mock_trace(void *udata, void *peer, int sent, int msg_type,
+                         unsigned int piece_idx, unsigned int offset,
+                         unsigned int len)
+{
+    event_t* e;
+
+    /* PIECEs are recorded as they're pushed */
+    if (sent || PWP_MSGTYPE_PIECE == msg_type)
+        return;
+    e = __event(udata, msg_type);
+    e->piece_idx = piece_idx;
+    e->offset = offset;
+    e->len = len;
+}
+
+/**
+ * A PIECE split across buffers is pushed a part at a time. The parts are
+ * joined, so that it's recorded as it would be in one go */
+static int __mock_pushblock(void *udata, void *peer, bt_block_t *blk,
+                            const void *data)
+{
+    record_t* r = udata;
+    event_t* e = 0 < r->nevents ? &r->events[r->nevents - 1] : NULL;
+
+    if (!e || PWP_MSGTYPE_PIECE != e->type ||
+        e->piece_idx != blk->piece_idx || e->offset + e->len != blk->offset)
+    {
+        e = __event(r, PWP_MSGTYPE_PIECE);
+        e->piece_idx = blk->piece_idx;
+        e->offset = blk->offset;
+    }
+    assert(e->len + blk->len <= sizeof(e->data));
+    memcpy(e->data + e->len, data, blk->len);
+    e->len += blk->len;
+    return 1;
+}
+
+static void __mock_peer_have_bitfield(void *udata, void *peer,
+                                      const uint64_t* words, int npieces)
+{
+    event_t* e = __event(udata, PWP_MSGTYPE_BITFIELD);
+
+    e->len = npieces;
+    memcpy(e->data, words, 16);
+}
+
+static int __mock_disconnect(void *udata, void *peer, char *reason)
+{
+    record_t* r = udata;
+
+    r->disconnects++;
+    return 1;
+}
+
+/**
+ * Read the message through a new connection
+ * @param split Where the message is cut; 0 to read it in one go
+ * @return what the message handler returned */
+static int __read(record_t* r, const char* msg, unsigned int len,
+                  unsigned int split)
+{
+    void *pc, *mh;
+    int ret;
+
+    memset(r, 0, sizeof(record_t));
+    pc = pwp_conn_new(NULL);
+    pwp_conn_set_cbs(pc, &((pwp_conn_cbs_t) {
+                           .send = __mock_send,
+                           .trace = __mock_trace,
+                           .pushblock = __mock_pushblock,
+                           .peer_have_bitfield = __mock_peer_have_bitfield,
+                           .disconnect = __mock_disconnect
+                           }), r);
+    pwp_conn_set_piece_info(pc, 100, 1000);
+    pwp_conn_enable_fast_extension(pc);
+    pwp_conn_enable_extension_protocol(pc);
+
+    mh = pwp_msghandler_new(pc);
+    if (0 == split)
+        ret = pwp_msghandler_dispatch_from_buffer(mh, msg, len);
+    else
+        ret = pwp_msghandler_dispatch_from_buffer(mh, msg, split) &&
+            pwp_msghandler_dispatch_from_buffer(mh, msg + split, len - split);
+    pwp_msghandler_release(mh);
+    pwp_conn_release(pc);
+    return ret;
+}
+
+/**
+ * Is the message read the same whole, and split at every offset?
+ * @param whole Set to what was recorded reading it in one go
+ * @return what the message handler returned for the whole message */
+static int __read_every_way(CuTest * tc, record_t* whole, const char* msg,
+                            unsigned int len)
+{
+    unsigned int split;
+    int ret = __read(whole, msg, len, 0);
+
+    for (split = 1; split < len; split++)
+    {
+        record_t r;
+
+        CuAssertTrue(tc, ret == __read(&r, msg, len, split));
+        CuAssertTrue(tc, whole->nevents == r.nevents);
+        CuAssertTrue(tc, 0 == memcmp(whole->events, r.events,
+                                     r.nevents * sizeof(event_t)));
+        CuAssertTrue(tc, whole->disconnects == r.disconnects);
+    }
+    return ret;
+}
+
+/* a message of each type, with piece 1, offset 2 and length 3 where they
+ * have a block */
+static const struct
+{
+    int type;
+    unsigned int len;
+    const char* msg;
+} __msgs[] = {
+    { PWP_MSGTYPE_CHOKE, 5, "\0\0\0\x01\x00" },
+    { PWP_MSGTYPE_UNCHOKE, 5, "\0\0\0\x01\x01" },
+    { PWP_MSGTYPE_INTERESTED, 5, "\0\0\0\x01\x02" },
+    { PWP_MSGTYPE_UNINTERESTED, 5, "\0\0\0\x01\x03" },
+    { PWP_MSGTYPE_HAVE, 9, "\0\0\0\x05\x04\0\0\0\x01" },
+    { PWP_MSGTYPE_BITFIELD, 18,
+      "\0\0\0\x0e\x05\xa5\0\0\0\0\0\0\0\0\0\0\0\x10" },
+    { PWP_MSGTYPE_REQUEST, 17,
+      "\0\0\0\x0d\x06\0\0\0\x01\0\0\0\x02\0\0\0\x03" },
+    { PWP_MSGTYPE_PIECE, 16,
+      "\0\0\0\x0c\x07\0\0\0\x01\0\0\0\x02xyz" },
+    { PWP_MSGTYPE_CANCEL, 17,
+      "\0\0\0\x0d\x08\0\0\0\x01\0\0\0\x02\0\0\0\x03" },
+    { PWP_MSGTYPE_SUGGEST, 9, "\0\0\0\x05\x0d\0\0\0\x01" },
+    { PWP_MSGTYPE_HAVE_ALL, 5, "\0\0\0\x01\x0e" },
+    { PWP_MSGTYPE_HAVE_NONE, 5, "\0\0\0\x01\x0f" },
+    { PWP_MSGTYPE_REJECT, 17,
+      "\0\0\0\x0d\x10\0\0\0\x01\0\0\0\x02\0\0\0\x03" },
+    { PWP_MSGTYPE_ALLOWED_FAST, 9, "\0\0\0\x05\x11\0\0\0\x01" },
+    /* an extended handshake */
+    { PWP_MSGTYPE_EXTENDED, 17, "\0\0\0\x0d\x14\x00" "d1:pi6881ee" },
+};
+
+#define NMSGS (int)(sizeof(__msgs) / sizeof(__msgs[0]))
+
+void TestPWP_msghandler_reads_each_message_type_whole_or_split(
+    CuTest * tc
+)
+{
+    int i;
+
+    for (i = 0; i < NMSGS; i++)
+    {
+        record_t r;
+
+        CuAssertTrue(tc, 1 == __read_every_way(tc, &r, __msgs[i].msg,
+                                               __msgs[i].len));
+        /* HAVE_ALL is passed on as a bitfield too */
+        CuAssertTrue(tc, 1 + (PWP_MSGTYPE_HAVE_ALL == __msgs[i].type) ==
+                     r.nevents);
+        CuAssertTrue(tc, __msgs[i].type == r.events[0].type);
+        CuAssertTrue(tc, 0 == r.disconnects);
+    }
+}
+
+void TestPWP_msghandler_messages_carry_their_fields(
+    CuTest * tc
+)
+{
+    record_t r;
+
+    __read(&r, __msgs[PWP_MSGTYPE_HAVE].msg, 9, 0);
+    CuAssertTrue(tc, 1 == r.events[0].piece_idx);
+
+    __read(&r, __msgs[PWP_MSGTYPE_REQUEST].msg, 17, 0);
+    CuAssertTrue(tc, 1 == r.events[0].piece_idx);
+    CuAssertTrue(tc, 2 == r.events[0].offset);
+    CuAssertTrue(tc, 3 == r.events[0].len);
+
+    __read(&r, __msgs[PWP_MSGTYPE_PIECE].msg, 16, 0);
+    CuAssertTrue(tc, 1 == r.events[0].piece_idx);
+    CuAssertTrue(tc, 2 == r.events[0].offset);
+    CuAssertTrue(tc, 3 == r.events[0].len);
+    CuAssertTrue(tc, 0 == memcmp(r.events[0].data, "xyz", 3));
+
+    /* pieces 0, 2, 5, 7 and 99 */
+    __read(&r, __msgs[PWP_MSGTYPE_BITFIELD].msg, 18, 0);
+    CuAssertTrue(tc, 100 == r.events[0].len);
+    CuAssertTrue(tc, ((1ull << 0) | (1ull << 2) | (1ull << 5) | (1ull << 7))
+                 == ((uint64_t*)r.events[0].data)[0]);
+    CuAssertTrue(tc, (1ull << 35) == ((uint64_t*)r.events[0].data)[1]);
+}
+
+void TestPWP_msghandler_reads_messages_after_keepalive_and_unknown_type(
+    CuTest * tc
+)
+{
+    /* KEEPALIVE, PORT (which we don't handle), HAVE piece 1 */
+    const char msgs[] = "\0\0\0\0" "\0\0\0\x03\x09\x1a\xe1"
+                        "\0\0\0\x05\x04\0\0\0\x01";
+    record_t r;
+
+    CuAssertTrue(tc, 1 == __read_every_way(tc, &r, msgs, sizeof(msgs) - 1));
+    CuAssertTrue(tc, 1 == r.nevents);
+    CuAssertTrue(tc, PWP_MSGTYPE_HAVE == r.events[0].type);
+    CuAssertTrue(tc, 1 == r.events[0].piece_idx);
+}
+
+/**
+ * @return 1 if messages of this type are always the same length */
+static int __fixed_len(int type)
+{
+    return PWP_MSGTYPE_PIECE != type && PWP_MSGTYPE_BITFIELD != type &&
+           PWP_MSGTYPE_EXTENDED != type;
+}
+
+void TestPWP_msghandler_wrong_length_for_type_is_rejected(
+    CuTest * tc
+)
+{
+    int i;
+
+    for (i = 0; i < NMSGS; i++)
+    {
+        char msg[32];
+        record_t r;
+        unsigned int mlen = __msgs[i].len - 4;
+
+        if (!__fixed_len(__msgs[i].type))
+            continue;
+
+        /* a byte too many */
+        memcpy(msg, __msgs[i].msg, __msgs[i].len);
+        msg[__msgs[i].len] = 0;
+        msg[3] = mlen + 1;
+        CuAssertTrue(tc, 0 == __read_every_way(tc, &r, msg,
+                                               __msgs[i].len + 1));
+        CuAssertTrue(tc, 0 == r.nevents);
+
+        /* and, where there's a payload, a byte too few */
+        if (1 == mlen)
+            continue;
+        msg[3] = mlen - 1;
+        CuAssertTrue(tc, 0 == __read_every_way(tc, &r, msg,
+                                               __msgs[i].len - 1));
+        CuAssertTrue(tc, 0 == r.nevents);
+    }
+}
+
+void TestPWP_msghandler_too_short_for_type_is_rejected(
+    CuTest * tc
+)
+{
+    /* without a whole block header, with no bits, with no extended id */
+    const char piece[] = "\0\0\0\x08\x07\0\0\0\x01\0\0\0";
+    const char bitfield[] = "\0\0\0\x01\x05";
+    const char extended[] = "\0\0\0\x01\x14";
+    record_t r;
+
+    CuAssertTrue(tc, 0 == __read_every_way(tc, &r, piece, sizeof(piece) - 1));
+    CuAssertTrue(tc, 0 == r.nevents);
+    CuAssertTrue(tc, 0 == __read_every_way(tc, &r, bitfield,
+                                           sizeof(bitfield) - 1));
+    CuAssertTrue(tc, 0 == r.nevents);
+    CuAssertTrue(tc, 0 == __read_every_way(tc, &r, extended,
+                                           sizeof(extended) - 1));
+    CuAssertTrue(tc, 0 == r.nevents);
+}
@@ -0,0 +1,292 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_piece.h"
+#include "bt_piece_db.h"
+#include "bt_diskmem.h"
+#include "bt_diskcache.h"
+#include "config.h"
+#include "bt_resume.h"
+
+#define HASH_EXAMPLE "00000000000000000000"
+#define RESUME_PATH "test_resume.tmp"
+#define FILE_PATH "test_resume_file.tmp"
+
+static bt_piecedb_i __ipdb = { .get_piece = bt_piecedb_get };
+
+static void* __db_new()
+{
+    void *db = bt_piecedb_new();
+
+    bt_piecedb_increase_piece_space(db, 20);
+    bt_piecedb_add_with_hash_and_size(db, HASH_EXAMPLE, 10);
+    bt_piecedb_add_with_hash_and_size(db, HASH_EXAMPLE, 10);
+    return db;
+}
+
+static void __write_file(const char* path, const char* data)
+{
+    FILE* fp = fopen(path, "wb");
+    fwrite(data, strlen(data), 1, fp);
+    fclose(fp);
+}
+
+void TestBTResume_load_restores_completed_pieces(
+    CuTest * tc
+)
+{
+    void *r, *db;
+
+    r = bt_resume_new();
+    db = __db_new();
+    bt_piece_set_complete(bt_piecedb_get(db, 0), 1);
+    bt_piece_set_mtime(bt_piecedb_get(db, 0), 1234);
+    CuAssertTrue(tc, 1 == bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+
+    db = __db_new();
+    CuAssertTrue(tc, 1 == bt_resume_load(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+    CuAssertTrue(tc, 1 == bt_piece_is_complete(bt_piecedb_get(db, 0)));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 1)));
+    CuAssertTrue(tc, 1234 == bt_piece_get_mtime(bt_piecedb_get(db, 0)));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+}
+
+void TestBTResume_load_ignores_record_for_other_torrent(
+    CuTest * tc
+)
+{
+    void *r, *db;
+
+    r = bt_resume_new();
+    db = __db_new();
+    bt_piece_set_complete(bt_piecedb_get(db, 0), 1);
+    bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE, &__ipdb, db, 2, 10);
+
+    db = __db_new();
+    CuAssertTrue(tc, -1 == bt_resume_load(r, RESUME_PATH,
+                                          "11111111111111111111",
+                                          &__ipdb, db, 2, 10));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 0)));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+}
+
+void TestBTResume_changed_file_invalidates_its_pieces(
+    CuTest * tc
+)
+{
+    void *r, *db;
+
+    __write_file(FILE_PATH, "0123456789");
+
+    r = bt_resume_new();
+    /* piece 0 is backed by our file, piece 1 by a file that doesn't exist */
+    bt_resume_add_file(r, FILE_PATH, 10);
+    bt_resume_add_file(r, FILE_PATH ".missing", 10);
+    db = __db_new();
+    bt_piece_set_complete(bt_piecedb_get(db, 0), 1);
+    bt_piece_set_complete(bt_piecedb_get(db, 1), 1);
+    bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE, &__ipdb, db, 2, 10);
+
+    /* file shrinks */
+    __write_file(FILE_PATH, "01234");
+
+    db = __db_new();
+    CuAssertTrue(tc, 1 == bt_resume_load(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 0)));
+    CuAssertTrue(tc, 1 == bt_piece_is_complete(bt_piecedb_get(db, 1)));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+    remove(FILE_PATH);
+}
+
+static void* __big_db_new()
+{
+    void *db = bt_piecedb_new(), *dc = bt_diskmem_new();
+
+    bt_diskmem_set_size(dc, 3 * (BT_BLOCK_SIZE));
+    bt_piecedb_set_diskstorage(db, bt_diskmem_get_blockrw(dc), dc);
+    bt_piecedb_increase_piece_space(db, 6 * (BT_BLOCK_SIZE));
+    bt_piecedb_add_with_hash_and_size(db, HASH_EXAMPLE, 3 * (BT_BLOCK_SIZE));
+    bt_piecedb_add_with_hash_and_size(db, HASH_EXAMPLE, 3 * (BT_BLOCK_SIZE));
+    return db;
+}
+
+void TestBTResume_load_restores_blocks_of_partial_pieces(
+    CuTest * tc
+)
+{
+    static char data[BT_BLOCK_SIZE];
+    unsigned char bits[1];
+    bt_block_t blk = { .piece_idx = 1, .offset = 2 * (BT_BLOCK_SIZE),
+                       .len = BT_BLOCK_SIZE };
+    void *r, *db;
+
+    r = bt_resume_new();
+    db = __big_db_new();
+    CuAssertTrue(tc, 0 < bt_piece_write_block(bt_piecedb_get(db, 1), NULL,
+                                              &blk, data, NULL));
+    CuAssertTrue(tc, 1 == bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2,
+                                         3 * (BT_BLOCK_SIZE)));
+
+    db = __big_db_new();
+    CuAssertTrue(tc, 0 == bt_resume_load(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2,
+                                         3 * (BT_BLOCK_SIZE)));
+    CuAssertTrue(tc, 0 == bt_piece_get_block_progress(bt_piecedb_get(db, 0),
+                                                      NULL));
+    CuAssertTrue(tc, 1 == bt_piece_get_block_progress(bt_piecedb_get(db, 1),
+                                                      bits));
+    CuAssertTrue(tc, 0x4 == bits[0]);
+    CuAssertTrue(tc, 1 == bt_piece_have_block(bt_piecedb_get(db, 1), &blk));
+    CuAssertTrue(tc, 0 == bt_piece_is_downloaded(bt_piecedb_get(db, 1)));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+}
+
+void TestBTResume_changed_file_drops_partial_pieces(
+    CuTest * tc
+)
+{
+    static char data[BT_BLOCK_SIZE];
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = BT_BLOCK_SIZE };
+    void *r, *db;
+
+    __write_file(FILE_PATH, "0123456789");
+
+    r = bt_resume_new();
+    bt_resume_add_file(r, FILE_PATH, 6 * (BT_BLOCK_SIZE));
+    db = __big_db_new();
+    bt_piece_write_block(bt_piecedb_get(db, 0), NULL, &blk, data, NULL);
+    bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE, &__ipdb, db, 2,
+                   3 * (BT_BLOCK_SIZE));
+
+    __write_file(FILE_PATH, "01234");
+
+    db = __big_db_new();
+    bt_resume_load(r, RESUME_PATH, HASH_EXAMPLE, &__ipdb, db, 2,
+                   3 * (BT_BLOCK_SIZE));
+    CuAssertTrue(tc, 0 == bt_piece_get_block_progress(bt_piecedb_get(db, 0),
+                                                      NULL));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+    remove(FILE_PATH);
+}
+
+/* the disk under a write-back cache */
+typedef struct
+{
+    char data[20];
+    int writes;
+    int flush_fails;
+} __disk_t;
+
+static int __disk_write_block(void *udata, void *caller,
+                              const bt_block_t * blk, const void *blkdata)
+{
+    __disk_t *d = udata;
+
+    memcpy(d->data + blk->piece_idx * 10 + blk->offset, blkdata, blk->len);
+    d->writes++;
+    return 1;
+}
+
+static void *__disk_read_block(void *udata, void *caller,
+                               const bt_block_t * blk)
+{
+    __disk_t *d = udata;
+
+    return d->data + blk->piece_idx * 10 + blk->offset;
+}
+
+static int __disk_flush_block(void *udata, void *caller,
+                              const bt_block_t * blk)
+{
+    __disk_t *d = udata;
+
+    return !d->flush_fails;
+}
+
+static bt_blockrw_i __disk_rw = {
+    .read_block = __disk_read_block,
+    .write_block = __disk_write_block,
+    .flush_block = __disk_flush_block
+};
+
+/**
+ * Piece 0 is complete, but only in the cache */
+static void* __dirty_db_new(__disk_t* d)
+{
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 10 };
+    void *db = bt_piecedb_new(), *dc = bt_diskcache_new();
+
+    memset(d, 0, sizeof(__disk_t));
+    bt_diskcache_set_size(dc, 10);
+    bt_diskcache_set_disk_blockrw(dc, &__disk_rw, d);
+    config_set(bt_diskcache_get_config(dc), "diskcache_write_bytes", "1000");
+    bt_piecedb_set_diskstorage(db, bt_diskcache_get_blockrw(dc), dc);
+    bt_piecedb_increase_piece_space(db, 20);
+    bt_piecedb_add_with_hash_and_size(db, HASH_EXAMPLE, 10);
+    bt_piecedb_add_with_hash_and_size(db, HASH_EXAMPLE, 10);
+    bt_piece_write_block(bt_piecedb_get(db, 0), NULL, &blk, "0123456789",
+                         NULL);
+    bt_piece_set_complete(bt_piecedb_get(db, 0), 1);
+    return db;
+}
+
+void TestBTResume_save_flushes_completed_pieces(
+    CuTest * tc
+)
+{
+    __disk_t d;
+    void *r, *db;
+
+    r = bt_resume_new();
+    db = __dirty_db_new(&d);
+    CuAssertTrue(tc, 0 == d.writes);
+    CuAssertTrue(tc, 1 == bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+    CuAssertTrue(tc, 0 < d.writes);
+    CuAssertTrue(tc, 0 == memcmp(d.data, "0123456789", 10));
+
+    db = __db_new();
+    CuAssertTrue(tc, 1 == bt_resume_load(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+    CuAssertTrue(tc, 1 == bt_piece_is_complete(bt_piecedb_get(db, 0)));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+}
+
+void TestBTResume_save_leaves_out_completed_pieces_that_fail_to_flush(
+    CuTest * tc
+)
+{
+    __disk_t d;
+    void *r, *db;
+
+    r = bt_resume_new();
+    db = __dirty_db_new(&d);
+    d.flush_fails = 1;
+    CuAssertTrue(tc, 1 == bt_resume_save(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+
+    db = __db_new();
+    CuAssertTrue(tc, 0 == bt_resume_load(r, RESUME_PATH, HASH_EXAMPLE,
+                                         &__ipdb, db, 2, 10));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 0)));
+    bt_resume_free(r);
+    remove(RESUME_PATH);
+}
@@ -0,0 +1,94 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_ring.h"
+
+void TestBT_ring_after_new_is_empty(
+    CuTest * tc
+)
+{
+    void *r;
+    int i;
+
+    r = bt_ring_new(4, sizeof(int));
+    CuAssertTrue(tc, 0 == bt_ring_count(r));
+    CuAssertTrue(tc, 0 == bt_ring_poll(r, &i));
+}
+
+void TestBT_ring_poll_returns_items_in_order(
+    CuTest * tc
+)
+{
+    void *r;
+    int i;
+
+    r = bt_ring_new(4, sizeof(int));
+    i = 1;
+    CuAssertTrue(tc, 1 == bt_ring_offer(r, &i));
+    i = 2;
+    CuAssertTrue(tc, 1 == bt_ring_offer(r, &i));
+    CuAssertTrue(tc, 2 == bt_ring_count(r));
+    CuAssertTrue(tc, 1 == bt_ring_poll(r, &i));
+    CuAssertTrue(tc, 1 == i);
+    CuAssertTrue(tc, 1 == bt_ring_poll(r, &i));
+    CuAssertTrue(tc, 2 == i);
+    CuAssertTrue(tc, 0 == bt_ring_count(r));
+}
+
+void TestBT_ring_offer_fails_when_full(
+    CuTest * tc
+)
+{
+    void *r;
+    int i;
+
+    r = bt_ring_new(3, sizeof(int));
+    for (i = 0; i < 4; i++)
+        CuAssertTrue(tc, 1 == bt_ring_offer(r, &i));
+    CuAssertTrue(tc, 0 == bt_ring_offer(r, &i));
+    CuAssertTrue(tc, 1 == bt_ring_poll(r, &i));
+    CuAssertTrue(tc, 1 == bt_ring_offer(r, &i));
+}
+
+void TestBT_ring_wraps_around(
+    CuTest * tc
+)
+{
+    void *r;
+    int i, j;
+
+    r = bt_ring_new(2, sizeof(int));
+    for (i = 0; i < 10; i++)
+    {
+        CuAssertTrue(tc, 1 == bt_ring_offer(r, &i));
+        CuAssertTrue(tc, 1 == bt_ring_poll(r, &j));
+        CuAssertTrue(tc, i == j);
+    }
+}
+
+static void __sum(void* udata, void* item)
+{
+    *(int*)udata += *(int*)item;
+}
+
+void TestBT_ring_drain_consumes_all_items(
+    CuTest * tc
+)
+{
+    void *r;
+    int i, sum = 0;
+
+    r = bt_ring_new(8, sizeof(int));
+    for (i = 1; i <= 4; i++)
+        bt_ring_offer(r, &i);
+    CuAssertTrue(tc, 4 == bt_ring_drain(r, &sum, __sum));
+    CuAssertTrue(tc, 10 == sum);
+    CuAssertTrue(tc, 0 == bt_ring_count(r));
+}
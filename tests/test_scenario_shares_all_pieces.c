@@ -33,6 +33,146 @@
 #include <fcntl.h>
 #include <sys/time.h>
 
+/**
+ * A has the piece, and B connects to A
+ * @return the piece's mock torrent */
+static void* __setup_one_piece(client_t** a, client_t** b)
+{
+    hashmap_iterator_t iter;
+    void* mt;
+    char *addr;
+
+    clients_setup();
+    mt = mocktorrent_new(1, 5);
+    *a = mock_client_setup(5);
+    *b = mock_client_setup(5);
+
+    for (
+        hashmap_iterator(clients_get(), &iter);
+        hashmap_iterator_has_next(clients_get(), &iter);
+        )
+    {
+        char hash[21];
+
+        client_t* cli = hashmap_iterator_next_value(clients_get(), &iter);
+        void *cfg = bt_dm_get_config(cli->bt);
+
+        config_set(cfg, "npieces", "1");
+        config_set_va(cfg, "piece_length", "%d", 5);
+        config_set(cfg, "infohash", "00000000000000000000");
+        bt_piecedb_increase_piece_space(bt_dm_get_piecedb(cli->bt), 5);
+        bt_piecedb_add_with_hash_and_size(bt_dm_get_piecedb(cli->bt),
+                                          mocktorrent_get_piece_sha1(mt, hash,
+                                                                     0), 5);
+    }
+
+    {
+        bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 5 };
+
+        bt_diskmem_write_block(
+            bt_piecedb_get_diskstorage(bt_dm_get_piecedb((*a)->bt)),
+            NULL, &blk, mocktorrent_get_data(mt, 0));
+    }
+
+    bt_dm_check_pieces((*a)->bt);
+    bt_dm_check_pieces((*b)->bt);
+    bt_dm_periodic((*a)->bt, NULL);
+
+    asprintf(&addr, "%p", *a);
+    client_add_peer(*b, NULL, 0, addr, strlen(addr), 0);
+    return mt;
+}
+
+static void __steps(client_t* a, client_t* b, int n)
+{
+    int ii;
+
+    for (ii = 0; ii < n; ii++)
+    {
+        bt_dm_periodic(a->bt, NULL);
+        bt_dm_periodic(b->bt, NULL);
+        network_poll(a->bt, (void*)&a, 0, bt_dm_dispatch_from_buffer,
+                     mock_on_connect);
+        network_poll(b->bt, (void*)&b, 0, bt_dm_dispatch_from_buffer,
+                     mock_on_connect);
+    }
+
+    /* let validation jobs run */
+    bt_dm_periodic(a->bt, NULL);
+    bt_dm_periodic(b->bt, NULL);
+}
+
+void TestBT_Peer_doesnt_share_piece_while_send_queue_is_full(
+    CuTest * tc
+    )
+{
+    client_t* a, *b;
+    void* db;
+
+    __setup_one_piece(&a, &b);
+    db = bt_dm_get_piecedb(b->bt);
+
+    /* above the default send_high_watermark */
+    networkfuncs_mock_backlog = 2 * 1048576;
+    __steps(a, b, 10);
+    CuAssertTrue(tc, 0 == bt_piecedb_all_pieces_are_complete(db));
+
+    /* still above send_low_watermark */
+    networkfuncs_mock_backlog = 512 * 1024;
+    __steps(a, b, 10);
+    CuAssertTrue(tc, 0 == bt_piecedb_all_pieces_are_complete(db));
+
+    /* drained */
+    networkfuncs_mock_backlog = 0;
+    __steps(a, b, 10);
+    CuAssertTrue(tc, 1 == bt_piecedb_all_pieces_are_complete(db));
+}
+
+void TestBT_Peer_idle_connections_arent_serviced(
+    CuTest * tc
+    )
+{
+    client_t* a, *b;
+    bt_dm_stats_t stats;
+
+    __setup_one_piece(&a, &b);
+    __steps(a, b, 10);
+    CuAssertTrue(tc, 1 == bt_piecedb_all_pieces_are_complete(
+                     bt_dm_get_piecedb(b->bt)));
+
+    /* let the last HAVEs land */
+    __steps(a, b, 2);
+
+    memset(&stats, 0, sizeof(stats));
+    bt_dm_periodic(a->bt, &stats);
+    CuAssertTrue(tc, 1 == stats.npeers);
+    CuAssertTrue(tc, 0 == stats.nserviced);
+    bt_dm_periodic(b->bt, &stats);
+    CuAssertTrue(tc, 0 == stats.nserviced);
+    free(stats.peers);
+}
+
+void TestBT_Peer_stats_show_latencies(
+    CuTest * tc
+    )
+{
+    client_t* a, *b;
+    bt_dm_stats_t stats;
+
+    __setup_one_piece(&a, &b);
+    __steps(a, b, 10);
+
+    memset(&stats, 0, sizeof(stats));
+    bt_dm_periodic(b->bt, &stats);
+    CuAssertTrue(tc, 1 == stats.validate_us.count);
+    CuAssertTrue(tc, 0 < stats.block_ms.count);
+    CuAssertTrue(tc, 0 < stats.job_depth.count);
+    CuAssertTrue(tc, 0 == stats.hash_failures);
+    CuAssertTrue(tc, 0 == stats.njobs);
+    CuAssertTrue(tc, 0 == stats.peers[0].npending_requests);
+    free(stats.peers);
+}
+
 void TestBT_Peer_shares_one_piece(
     CuTest * tc
     )
@@ -42,6 +182,7 @@ void TestBT_Peer_shares_one_piece(
     hashmap_iterator_t iter;
     void* mt;
     char *addr;
+    bt_availability_t av;
 
     clients_setup();
     mt = mocktorrent_new(1, 5);
@@ -121,5 +262,11 @@ void TestBT_Peer_shares_one_piece(
 
     CuAssertTrue(tc, 1 ==
                  bt_piecedb_all_pieces_are_complete(bt_dm_get_piecedb(b->bt)));
+
+    /* the seed is the only copy b has heard of */
+    CuAssertTrue(tc, 1 == bt_dm_get_availability(b->bt, &av));
+    CuAssertTrue(tc, 1 == av.min);
+    CuAssertTrue(tc, av.npieces == av.nrare);
+    CuAssertTrue(tc, 1000 == av.distributed_copies);
 }
 
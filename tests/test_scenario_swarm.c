@@ -0,0 +1,259 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <CuTest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bt.h"
+#include "network_adapter.h"
+#include "network_adapter_mock.h"
+#include "bt_selector_sequential.h"
+#include "mock_swarm.h"
+
+void TestBT_swarm_every_client_completes(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 12,
+        .npieces = 8,
+        .piece_len = 2 * (BT_BLOCK_SIZE),
+        .seed_percent = 10,
+        .npeers = 4,
+        .latency = 2,
+        .bandwidth = 16 * 1024,
+        .seed = 1,
+        .max_ticks = 2000
+    };
+    mock_swarm_results_t r;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &r));
+    CuAssertTrue(tc, 12 == r.ncompleted);
+    CuAssertTrue(tc, 0 < r.ticks);
+    CuAssertTrue(tc, r.mean_ticks <= r.ticks);
+    CuAssertTrue(tc, 11ull * 8 * 2 * (BT_BLOCK_SIZE) == r.downloaded_bytes);
+    CuAssertTrue(tc, r.duplicate_bytes < r.downloaded_bytes);
+    CuAssertTrue(tc, 0 < r.peak_rss_kb);
+}
+
+void TestBT_swarm_latency_slows_completion(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 6,
+        .npieces = 4,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 20,
+        .npeers = 3,
+        .latency = 0,
+        .bandwidth = 0,
+        .seed = 1,
+        .max_ticks = 2000
+    };
+    mock_swarm_results_t fast, slow;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &fast));
+    p.latency = 5;
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &slow));
+    CuAssertTrue(tc, fast.ticks < slow.ticks);
+}
+
+void TestBT_swarm_on_virtual_time_is_repeatable(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 10,
+        .npieces = 8,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 10,
+        .npeers = 4,
+        .latency = 3,
+        .bandwidth = 8 * 1024,
+        .tick_ms = 10,
+        .seed = 7,
+        .max_ticks = 5000
+    };
+    mock_swarm_results_t a, b;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &a));
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &b));
+    CuAssertTrue(tc, a.ticks == b.ticks);
+    CuAssertTrue(tc, a.mean_ticks == b.mean_ticks);
+    CuAssertTrue(tc, a.duplicate_bytes == b.duplicate_bytes);
+    CuAssertTrue(tc, a.ticks * 10 / 1000.0 == a.sim_seconds);
+}
+
+void TestBT_swarm_download_rate_limit_holds(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 2,
+        .npieces = 8,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 50,
+        .npeers = 1,
+        .latency = 1,
+        .tick_ms = 10,
+        .seed = 1,
+        .max_ticks = 5000
+    };
+    mock_swarm_results_t fast, slow, cut;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &fast));
+    CuAssertTrue(tc, 0 == fast.download_deferred_bytes);
+
+    /* 8 blocks at 4 a second; the buckets start empty */
+    p.max_download_rate = 4 * (BT_BLOCK_SIZE);
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &slow));
+    CuAssertTrue(tc, fast.sim_seconds < 1);
+    CuAssertTrue(tc, 1.5 <= slow.sim_seconds);
+
+    /* stopped part way, the limit is holding requests back */
+    p.max_ticks = 150;
+    CuAssertTrue(tc, 0 == mock_swarm_run(&p, &cut));
+    CuAssertTrue(tc, 0 < cut.download_deferred_bytes);
+    CuAssertTrue(tc, 0 == cut.upload_deferred_bytes);
+}
+
+void TestBT_swarm_upload_rate_limit_holds(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 2,
+        .npieces = 8,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 50,
+        .npeers = 1,
+        .latency = 1,
+        .tick_ms = 10,
+        .seed = 1,
+        .max_upload_rate = 4 * (BT_BLOCK_SIZE),
+        .max_ticks = 5000
+    };
+    mock_swarm_results_t slow, cut;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &slow));
+    CuAssertTrue(tc, 1.5 <= slow.sim_seconds);
+
+    /* the seed has PIECEs waiting on its bucket */
+    p.max_ticks = 150;
+    CuAssertTrue(tc, 0 == mock_swarm_run(&p, &cut));
+    CuAssertTrue(tc, 0 < cut.upload_deferred_bytes);
+}
+
+void TestBT_swarm_local_peers_are_outside_the_rate_limits(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 2,
+        .npieces = 8,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 50,
+        .npeers = 1,
+        .latency = 1,
+        .tick_ms = 10,
+        .seed = 1,
+        .max_upload_rate = 4 * (BT_BLOCK_SIZE),
+        .max_download_rate = 4 * (BT_BLOCK_SIZE),
+        .max_ticks = 5000
+    };
+    mock_swarm_results_t wan, lan;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &wan));
+    CuAssertTrue(tc, 1.5 <= wan.sim_seconds);
+
+    /* the same swarm on the LAN runs at full speed */
+    p.local_peers = 1;
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &lan));
+    CuAssertTrue(tc, lan.sim_seconds < 1);
+}
+
+void TestBT_swarm_super_seed_uploads_less(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 8,
+        .npieces = 16,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 10,
+        .npeers = 7,
+        .latency = 2,
+        .bandwidth = 16 * 1024,
+        .tick_ms = 10,
+        .seed = 3,
+        .max_ticks = 20000
+    };
+    mock_swarm_results_t normal, super;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &normal));
+    p.super_seeding = 1;
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &super));
+
+    /* the seed sends each piece about once; the leechers do the rest */
+    CuAssertTrue(tc, super.seed_uploaded_bytes < normal.seed_uploaded_bytes);
+    CuAssertTrue(tc, super.seed_uploaded_bytes <=
+                 2ull * 16 * (BT_BLOCK_SIZE));
+}
+
+void TestBT_swarm_fast_peer_steals_from_slow_peer(CuTest * tc)
+{
+    mock_swarm_params_t p = {
+        .nclients = 4,
+        .npieces = 64,
+        .piece_len = 4 * (BT_BLOCK_SIZE),
+        .seed_percent = 50,
+        .npeers = 3,
+        .latency = 1,
+        .bandwidth = 4096,
+        .tick_ms = 10,
+        .seed = 1,
+        .slow_seed_upload_rate = 2 * (BT_BLOCK_SIZE),
+        .steal_ratio = -1,
+        .max_ticks = 50000
+    };
+    mock_swarm_results_t waited, stole;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &waited));
+    CuAssertTrue(tc, 0 == waited.stolen_blocks);
+
+    /* pieces stop waiting on the slow seed, so the leechers can share
+     * them sooner */
+    p.steal_ratio = 0;
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &stole));
+    CuAssertTrue(tc, 0 < stole.stolen_blocks);
+    CuAssertTrue(tc, stole.mean_ticks < waited.mean_ticks);
+}
+
+void TestBT_swarm_completes_on_the_given_selector(CuTest * tc)
+{
+    bt_pieceselector_i sequential = {
+        .new = bt_sequential_selector_new,
+        .peer_giveback_piece = bt_sequential_selector_giveback_piece,
+        .have_piece = bt_sequential_selector_have_piece,
+        .remove_peer = bt_sequential_selector_remove_peer,
+        .add_peer = bt_sequential_selector_add_peer,
+        .peer_have_piece = bt_sequential_selector_peer_have_piece,
+        .get_npeers = bt_sequential_selector_get_npeers,
+        .get_npieces = bt_sequential_selector_get_npieces,
+        .poll_piece = bt_sequential_selector_poll_best_piece
+    };
+    mock_swarm_params_t p = {
+        .nclients = 8,
+        .npieces = 8,
+        .piece_len = (BT_BLOCK_SIZE),
+        .seed_percent = 10,
+        .npeers = 4,
+        .latency = 2,
+        .bandwidth = 16 * 1024,
+        .tick_ms = 10,
+        .seed = 1,
+        .max_ticks = 5000,
+        .selector = &sequential
+    };
+    mock_swarm_results_t r;
+
+    CuAssertTrue(tc, 1 == mock_swarm_run(&p, &r));
+    CuAssertTrue(tc, 8 == r.ncompleted);
+}
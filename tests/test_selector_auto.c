@@ -0,0 +1,170 @@
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_auto.h"
+
+static bt_pieceselector_i iface = {
+    .new = bt_auto_selector_new,
+    .peer_giveback_piece = bt_auto_selector_giveback_piece,
+    .have_piece = bt_auto_selector_have_piece,
+    .remove_peer = bt_auto_selector_remove_peer,
+    .add_peer = bt_auto_selector_add_peer,
+    .peer_have_piece = bt_auto_selector_peer_have_piece,
+    .peer_have_bitfield = bt_auto_selector_peer_have_bitfield,
+    .get_npeers = bt_auto_selector_get_npeers,
+    .get_npieces = bt_auto_selector_get_npieces,
+    .poll_piece = bt_auto_selector_poll_best_piece
+};
+
+void TestAutoSelector_new_is_initialised_with_npieces(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    CuAssertTrue(tc, 10 == iface.get_npieces(cr));
+    CuAssertTrue(tc, 0 == bt_auto_selector_is_endgame(cr));
+    bt_auto_selector_free(cr);
+}
+
+void TestAutoSelector_polls_rarest_once_random_first_is_done(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    bt_auto_selector_set_random_first(cr, 1);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.have_piece(cr, 0);
+
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 1));
+    bt_auto_selector_free(cr);
+}
+
+void TestAutoSelector_random_first_piece_isnt_polled_again(
+    CuTest * tc
+)
+{
+    void *cr;
+    int a, b, c;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 3);
+    iface.peer_have_piece(cr, (void *) 1, 4);
+    iface.peer_have_piece(cr, (void *) 1, 5);
+
+    /*  random first; the rarest first selector mustn't hand it out too */
+    a = iface.poll_piece(cr, (void *) 1);
+    bt_auto_selector_set_random_first(cr, 0);
+    b = iface.poll_piece(cr, (void *) 1);
+    c = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 3 + 4 + 5 == a + b + c);
+    CuAssertTrue(tc, a != b && b != c && a != c);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_auto_selector_free(cr);
+}
+
+void TestAutoSelector_endgame_once_all_pieces_polled(
+    CuTest * tc
+)
+{
+    void *cr;
+    int a, b;
+
+    cr = iface.new(3);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.have_piece(cr, 0);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+    iface.peer_have_piece(cr, (void *) 2, 2);
+
+    a = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 0 == bt_auto_selector_is_endgame(cr));
+    b = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 1 == bt_auto_selector_is_endgame(cr));
+    CuAssertTrue(tc, 1 + 2 == a + b);
+
+    /*  both are handed out again, in turn */
+    a = iface.poll_piece(cr, (void *) 2);
+    b = iface.poll_piece(cr, (void *) 2);
+    CuAssertTrue(tc, 1 + 2 == a + b);
+
+    iface.have_piece(cr, 1);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 2));
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 2));
+
+    iface.have_piece(cr, 2);
+    CuAssertTrue(tc, 0 == bt_auto_selector_is_endgame(cr));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 2));
+    bt_auto_selector_free(cr);
+}
+
+void TestAutoSelector_endgame_only_polls_pieces_the_peer_has(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(2);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 0);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+    iface.poll_piece(cr, (void *) 1);
+    iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 1 == bt_auto_selector_is_endgame(cr));
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 2));
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 2));
+    bt_auto_selector_free(cr);
+}
+
+void TestAutoSelector_giveback_leaves_endgame(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(1);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 0);
+    CuAssertTrue(tc, 0 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 1 == bt_auto_selector_is_endgame(cr));
+    iface.peer_giveback_piece(cr, NULL, 0);
+    CuAssertTrue(tc, 0 == bt_auto_selector_is_endgame(cr));
+    CuAssertTrue(tc, 0 == iface.poll_piece(cr, (void *) 1));
+    bt_auto_selector_free(cr);
+}
+
+void TestAutoSelector_peer_have_bitfield_feeds_both_phases(
+    CuTest * tc
+)
+{
+    void *cr;
+    uint64_t words[2] = { (uint64_t)1 << 6, 0 };
+
+    cr = iface.new(100);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_bitfield(cr, (void *) 1, words, 100);
+    CuAssertTrue(tc, 6 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_auto_selector_free(cr);
+}
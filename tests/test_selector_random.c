@@ -142,3 +142,45 @@ void TestSelectorRandom_have_removes_piece_from_polling(
     CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 3));
     CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 3));
 }
+
+void TestSelectorRandom_polls_each_piece_of_bitfield_once(
+    CuTest * tc
+)
+{
+    uint64_t words[4] = { ~0ULL, ~0ULL, ~0ULL, 0xff };
+    char seen[200];
+    void *cr;
+    int i, idx;
+
+    memset(seen, 0, sizeof(seen));
+    cr = iface.new(200);
+    iface.add_peer(cr, (void *) 1);
+    bt_random_selector_peer_have_bitfield(cr, (void *) 1, words, 200);
+    iface.have_piece(cr, 7);
+
+    for (i = 0; i < 199; i++)
+    {
+        idx = iface.poll_piece(cr, (void *) 1);
+        CuAssertTrue(tc, 0 <= idx && idx < 200 && 7 != idx);
+        CuAssertTrue(tc, !seen[idx]);
+        seen[idx] = 1;
+    }
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_random_selector_free(cr);
+}
+
+void TestSelectorRandom_giveback_without_peer_is_polled_again(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(100);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 70);
+    CuAssertTrue(tc, 70 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    iface.peer_giveback_piece(cr, NULL, 70);
+    CuAssertTrue(tc, 70 == iface.poll_piece(cr, (void *) 1));
+    bt_random_selector_free(cr);
+}
@@ -161,3 +161,205 @@ void TestRarestFirst_have_removes_piece_from_polling(
     /*  ..which means we should poll it. */
     CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 3));
 }
+
+void TestRarestFirst_peer_have_bitfield_counts_each_piece_once(
+    CuTest * tc
+)
+{
+    void *cr;
+    uint64_t words[2] = { (1ull << 3) | (1ull << 5), 1ull << 2 };
+
+    cr = iface.new(100);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    bt_rarestfirst_selector_peer_have_bitfield(cr, (void *) 1, words, 100);
+    iface.peer_have_piece(cr, (void *) 1, 5);
+    iface.peer_have_piece(cr, (void *) 2, 3);
+    iface.peer_have_piece(cr, (void *) 2, 66);
+    /*  5 is the rarest; 3 and 66 tie */
+    CuAssertTrue(tc, 5 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 3 + 66 == iface.poll_piece(cr, (void *) 1) +
+                 iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+}
+
+void TestRarestFirst_removed_peer_makes_its_pieces_rarer(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.add_peer(cr, (void *) 3);
+    iface.add_peer(cr, (void *) 4);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+    iface.peer_have_piece(cr, (void *) 3, 1);
+    iface.peer_have_piece(cr, (void *) 4, 2);
+    iface.remove_peer(cr, (void *) 2);
+    iface.remove_peer(cr, (void *) 3);
+    /*  1 is now only with peer 1 */
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 1));
+}
+
+void TestRarestFirst_shared_pieces_are_read_in_place(
+    CuTest * tc
+)
+{
+    void *cr;
+    uint64_t words[2] = { 0, 0 };
+
+    cr = iface.new(100);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    bt_rarestfirst_selector_peer_share_pieces(cr, (void *) 1, words, 100);
+
+    /*  the owner marks the words, then tells us */
+    words[0] = (1ull << 4) | (1ull << 7);
+    bt_rarestfirst_selector_peer_have_bitfield(cr, (void *) 1, words, 100);
+    words[1] |= 1ull << 3;
+    iface.peer_have_piece(cr, (void *) 1, 67);
+    iface.peer_have_piece(cr, (void *) 2, 4);
+    iface.peer_have_piece(cr, (void *) 2, 67);
+
+    CuAssertTrue(tc, 7 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 4 + 67 == iface.poll_piece(cr, (void *) 1) +
+                 iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+
+    /*  letting go of the peer reads the words one last time */
+    iface.add_peer(cr, (void *) 3);
+    iface.peer_have_piece(cr, (void *) 2, 9);
+    iface.peer_have_piece(cr, (void *) 3, 9);
+    iface.remove_peer(cr, (void *) 1);
+    iface.peer_giveback_piece(cr, NULL, 4);
+    iface.peer_giveback_piece(cr, NULL, 67);
+    /*  4 and 67 are now only with peer 2 */
+    CuAssertTrue(tc, 4 + 67 == iface.poll_piece(cr, (void *) 2) +
+                 iface.poll_piece(cr, (void *) 2));
+    CuAssertTrue(tc, 9 == iface.poll_piece(cr, (void *) 2));
+}
+
+void TestRarestFirst_buckets_follow_haves_and_givebacks(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    cr = iface.new(200);
+    for (i = 1; i <= 5; i++)
+        iface.add_peer(cr, (void *) (long) i);
+
+    /*  piece i is had by 6 - i peers */
+    for (i = 1; i <= 5; i++)
+    {
+        int j;
+
+        for (j = 1; j <= 6 - i; j++)
+            iface.peer_have_piece(cr, (void *) (long) j, 100 + i);
+    }
+
+    CuAssertTrue(tc, 105 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 104 == iface.poll_piece(cr, (void *) 1));
+
+    /*  given back, it is the rarest again */
+    iface.peer_giveback_piece(cr, NULL, 105);
+    iface.peer_giveback_piece(cr, NULL, 105);
+    CuAssertTrue(tc, 105 == iface.poll_piece(cr, (void *) 1));
+
+    /*  we have it; it never comes back from a poll */
+    iface.have_piece(cr, 103);
+    CuAssertTrue(tc, 102 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 101 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+}
+
+void TestRarestFirst_availability_survives_peer_churn(
+    CuTest * tc
+)
+{
+    void *cr;
+    long i;
+
+    cr = iface.new(100);
+    iface.add_peer(cr, (void *) 1000);
+    iface.peer_have_piece(cr, (void *) 1000, 7);
+
+    /*  peers come and go, announcing twice; none of it sticks */
+    for (i = 1; i <= 50; i++)
+    {
+        iface.add_peer(cr, (void *) i);
+        iface.peer_have_piece(cr, (void *) i, 7);
+        iface.peer_have_piece(cr, (void *) i, 7);
+        iface.peer_have_piece(cr, (void *) i, i);
+    }
+    CuAssertTrue(tc, 51 == bt_rarestfirst_selector_get_availability(cr, 7));
+
+    for (i = 1; i <= 50; i++)
+        iface.remove_peer(cr, (void *) i);
+
+    CuAssertTrue(tc, 1 == bt_rarestfirst_selector_get_availability(cr, 7));
+    CuAssertTrue(tc, 0 == bt_rarestfirst_selector_get_availability(cr, 30));
+    CuAssertTrue(tc, 7 == iface.poll_piece(cr, (void *) 1000));
+}
+
+void TestRarestFirst_peers_are_counted_in_memory(
+    CuTest * tc
+)
+{
+    void *cr;
+    unsigned long empty;
+
+    cr = iface.new(100);
+    empty = bt_rarestfirst_selector_get_memory(cr);
+    CuAssertTrue(tc, 0 < empty);
+
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 99);
+    CuAssertTrue(tc, empty < bt_rarestfirst_selector_get_memory(cr));
+
+    iface.remove_peer(cr, (void *) 1);
+    bt_rarestfirst_selector_free(cr);
+}
+
+void TestRarestFirst_availability_follows_haves(
+    CuTest * tc
+)
+{
+    void *cr;
+    bt_availability_t a;
+    uint64_t all = 0xf;
+
+    cr = iface.new(4);
+    bt_rarestfirst_selector_get_availability_stats(cr, &a);
+    CuAssertTrue(tc, 4 == a.npieces);
+    CuAssertTrue(tc, 0 == a.min);
+    CuAssertTrue(tc, 4 == a.nunavailable);
+    CuAssertTrue(tc, 0 == a.distributed_copies);
+
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    bt_rarestfirst_selector_peer_have_bitfield(cr, (void *) 1, &all, 4);
+    iface.peer_have_piece(cr, (void *) 2, 0);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+
+    /* pieces we have are still counted */
+    iface.have_piece(cr, 1);
+    bt_rarestfirst_selector_get_availability_stats(cr, &a);
+    CuAssertTrue(tc, 1 == a.min);
+    CuAssertTrue(tc, 0 == a.nunavailable);
+    CuAssertTrue(tc, 2 == a.nrare);
+    CuAssertTrue(tc, 1500 == a.distributed_copies);
+
+    iface.remove_peer(cr, (void *) 1);
+    bt_rarestfirst_selector_get_availability_stats(cr, &a);
+    CuAssertTrue(tc, 0 == a.min);
+    CuAssertTrue(tc, 2 == a.nunavailable);
+    CuAssertTrue(tc, 2 == a.nrare);
+    CuAssertTrue(tc, 500 == a.distributed_copies);
+    bt_rarestfirst_selector_free(cr);
+}
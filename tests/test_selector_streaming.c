@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_streaming.h"
+
+static bt_pieceselector_i iface = {
+    .new = bt_streaming_selector_new,
+    .peer_giveback_piece = bt_streaming_selector_giveback_piece,
+    .have_piece = bt_streaming_selector_have_piece,
+    .remove_peer = bt_streaming_selector_remove_peer,
+    .add_peer = bt_streaming_selector_add_peer,
+    .peer_have_piece = bt_streaming_selector_peer_have_piece,
+    .get_npeers = bt_streaming_selector_get_npeers,
+    .get_npieces = bt_streaming_selector_get_npieces,
+    .poll_piece = bt_streaming_selector_poll_best_piece
+};
+
+void TestStreaming_new_is_initialised_with_npieces(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    CuAssertTrue(tc, 10 == iface.get_npieces(cr));
+    CuAssertTrue(tc, 0 == iface.get_npeers(cr));
+    bt_streaming_selector_free(cr);
+}
+
+void TestStreaming_window_goes_before_rarer_pieces(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 1, 5);
+    iface.peer_have_piece(cr, (void *) 1, 6);
+    iface.peer_have_piece(cr, (void *) 2, 5);
+    iface.peer_have_piece(cr, (void *) 2, 6);
+
+    bt_streaming_selector_set_cursor(cr, 5);
+    bt_streaming_selector_set_window(cr, 2);
+    CuAssertTrue(tc, 5 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 6 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_streaming_selector_free(cr);
+}
+
+void TestStreaming_fastest_peer_gets_the_window(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 0);
+    iface.peer_have_piece(cr, (void *) 1, 7);
+    iface.peer_have_piece(cr, (void *) 2, 0);
+    bt_streaming_selector_set_peer_rate(cr, (void *) 1, 100);
+    bt_streaming_selector_set_peer_rate(cr, (void *) 2, 1000);
+
+    /*  peer 2 is faster and can send piece 0 */
+    CuAssertTrue(tc, 7 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 0 == iface.poll_piece(cr, (void *) 2));
+    bt_streaming_selector_free(cr);
+}
+
+void TestStreaming_slow_peer_gets_window_piece_nobody_faster_has(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 0);
+    iface.peer_have_piece(cr, (void *) 2, 3);
+    bt_streaming_selector_set_peer_rate(cr, (void *) 1, 100);
+    bt_streaming_selector_set_peer_rate(cr, (void *) 2, 1000);
+    CuAssertTrue(tc, 0 == iface.poll_piece(cr, (void *) 1));
+    bt_streaming_selector_free(cr);
+}
+
+void TestStreaming_window_is_shared_by_as_many_fast_peers(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 0);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 2, 0);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+    bt_streaming_selector_set_peer_rate(cr, (void *) 1, 100);
+    bt_streaming_selector_set_peer_rate(cr, (void *) 2, 1000);
+    bt_streaming_selector_set_window(cr, 2);
+
+    /*  two pieces are wanted, so the second fastest peer gets one too */
+    CuAssertTrue(tc, 0 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 2));
+    bt_streaming_selector_free(cr);
+}
+
+void TestStreaming_giveback_returns_piece_to_window(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.peer_have_piece(cr, (void *) 1, 4);
+    bt_streaming_selector_set_cursor(cr, 2);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 1));
+    iface.peer_giveback_piece(cr, NULL, 2);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 4 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_streaming_selector_free(cr);
+}
+
+void TestStreaming_deadline_sizes_window(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 3);
+    iface.peer_have_piece(cr, (void *) 1, 4);
+    iface.peer_have_piece(cr, (void *) 1, 9);
+    iface.peer_have_piece(cr, (void *) 2, 3);
+    iface.peer_have_piece(cr, (void *) 2, 4);
+
+    /*  2 seconds at 1000 bytes/s over 1000 byte pieces */
+    bt_streaming_selector_set_cursor(cr, 3);
+    bt_streaming_selector_set_deadline(cr, 2000, 1000, 1000);
+    CuAssertTrue(tc, 3 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 4 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 9 == iface.poll_piece(cr, (void *) 1));
+    bt_streaming_selector_free(cr);
+}
@@ -0,0 +1,246 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "pwp_handshaker.h"
+
+#include "bt.h"
+#include "bt_diskcache.h"
+#include "bt_session.h"
+
+static int __sent;
+
+static int __mock_send(void* me, void **udata, void* conn_ctx,
+                       const char *send_data, const int len)
+{
+    __sent += len;
+    return 1;
+}
+
+static void* __torrent(const char* infohash)
+{
+    void *dm = bt_dm_new();
+
+    config_set(bt_dm_get_config(dm), "infohash", infohash);
+    bt_dm_set_cbs(dm, &((bt_dm_cbs_t) {
+                        .handshaker_new = pwp_handshaker_new,
+                        .handshaker_release = pwp_handshaker_release,
+                        .handshaker_dispatch_from_buffer =
+                            pwp_handshaker_dispatch_from_buffer,
+                        .peer_send = __mock_send
+                    }), NULL);
+    return dm;
+}
+
+static int __handshake(char* buf, const char* infohash)
+{
+    buf[0] = 19;
+    memcpy(buf + 1, "BitTorrent protocol", 19);
+    memset(buf + 20, 0, 8);
+    memcpy(buf + 28, infohash, 20);
+    memcpy(buf + 48, "-XX0001-000000000000", 20);
+    return 68;
+}
+
+void TestBT_session_torrents_are_found_by_infohash(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    void *a = __torrent("aaaaaaaaaaaaaaaaaaaa"),
+         *b = __torrent("bbbbbbbbbbbbbbbbbbbb");
+
+    CuAssertTrue(tc, 1 == bt_session_add_torrent(s, a));
+    CuAssertTrue(tc, 1 == bt_session_add_torrent(s, b));
+    CuAssertTrue(tc, 0 == bt_session_add_torrent(s, a));
+    CuAssertTrue(tc, 2 == bt_session_get_ntorrents(s));
+    CuAssertTrue(tc, b == bt_session_get_torrent(s, "bbbbbbbbbbbbbbbbbbbb"));
+    CuAssertTrue(tc, NULL ==
+                 bt_session_get_torrent(s, "cccccccccccccccccccc"));
+
+    CuAssertTrue(tc, 1 == bt_session_remove_torrent(s, a));
+    CuAssertTrue(tc, NULL ==
+                 bt_session_get_torrent(s, "aaaaaaaaaaaaaaaaaaaa"));
+    CuAssertTrue(tc, 1 == bt_session_get_ntorrents(s));
+    bt_session_free(s);
+}
+
+void TestBT_session_incoming_connection_goes_to_infohashs_torrent(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    void *a = __torrent("aaaaaaaaaaaaaaaaaaaa"),
+         *b = __torrent("bbbbbbbbbbbbbbbbbbbb");
+    char hs[68];
+    int len = __handshake(hs, "bbbbbbbbbbbbbbbbbbbb");
+
+    bt_session_add_torrent(s, a);
+    bt_session_add_torrent(s, b);
+    CuAssertTrue(tc, 1 == bt_session_peer_connect(s, (void*)1,
+                                                  "192.168.1.1", 4000));
+    CuAssertTrue(tc, 1 == bt_session_get_nconnections(s));
+
+    /* nothing is known until the handshake is in */
+    __sent = 0;
+    CuAssertTrue(tc, 1 == bt_session_dispatch_from_buffer(s, (void*)1, hs,
+                                                          30));
+    CuAssertTrue(tc, 0 == bt_dm_get_num_peers(b));
+    CuAssertTrue(tc, 1 == bt_session_dispatch_from_buffer(s, (void*)1,
+                                                          hs + 30,
+                                                          len - 30));
+    CuAssertTrue(tc, 0 == bt_dm_get_num_peers(a));
+    CuAssertTrue(tc, 1 == bt_dm_get_num_peers(b));
+
+    /* the torrent took it as handshaked, and sent its bitfield */
+    CuAssertTrue(tc, 0 < __sent);
+
+    /* the torrent counts the connection now */
+    CuAssertTrue(tc, 1 == bt_session_get_nconnections(s));
+    bt_session_free(s);
+}
+
+void TestBT_session_drops_connection_for_unknown_infohash(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    char hs[68];
+    int len = __handshake(hs, "cccccccccccccccccccc");
+
+    bt_session_add_torrent(s, __torrent("aaaaaaaaaaaaaaaaaaaa"));
+    bt_session_peer_connect(s, (void*)1, "192.168.1.1", 4000);
+    CuAssertTrue(tc, 0 == bt_session_dispatch_from_buffer(s, (void*)1, hs,
+                                                          len));
+    CuAssertTrue(tc, 0 == bt_session_get_nconnections(s));
+    bt_session_free(s);
+}
+
+void TestBT_session_drops_connection_that_isnt_bittorrent(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    char hs[68];
+
+    __handshake(hs, "aaaaaaaaaaaaaaaaaaaa");
+    memcpy(hs + 1, "GET / HTTP/1.1\r\n", 16);
+    bt_session_add_torrent(s, __torrent("aaaaaaaaaaaaaaaaaaaa"));
+    bt_session_peer_connect(s, (void*)1, "192.168.1.1", 4000);
+
+    /* there's no need to wait for the rest */
+    CuAssertTrue(tc, 0 == bt_session_dispatch_from_buffer(s, (void*)1, hs,
+                                                          20));
+    CuAssertTrue(tc, 0 == bt_session_get_nconnections(s));
+    bt_session_free(s);
+}
+
+void TestBT_session_max_connections_covers_every_torrent(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    void *a = __torrent("aaaaaaaaaaaaaaaaaaaa");
+
+    config_set(bt_session_get_config(s), "max_connections", "2");
+    bt_session_add_torrent(s, a);
+    CuAssertTrue(tc, NULL != bt_dm_add_peer(a, "", 0, "192.168.1.1",
+                                            strlen("192.168.1.1"), 4000,
+                                            (void*)1, NULL));
+    CuAssertTrue(tc, 1 == bt_session_peer_connect(s, (void*)2,
+                                                  "192.168.1.2", 4000));
+    CuAssertTrue(tc, 0 == bt_session_peer_connect(s, (void*)3,
+                                                  "192.168.1.3", 4000));
+    CuAssertTrue(tc, NULL == bt_dm_add_peer(a, "", 0, "192.168.1.4",
+                                            strlen("192.168.1.4"), 4000,
+                                            (void*)4, NULL));
+
+    /* a connection that goes makes room */
+    bt_session_peer_disconnect(s, (void*)2);
+    CuAssertTrue(tc, 1 == bt_session_peer_connect(s, (void*)3,
+                                                  "192.168.1.3", 4000));
+    bt_session_free(s);
+}
+
+void TestBT_session_rates_are_unlimited_by_default(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+
+    bt_session_spend_upload(s, 1000);
+    bt_session_spend_download(s, 1000);
+    CuAssertTrue(tc, 1 == bt_session_may_upload(s));
+    CuAssertTrue(tc, 1 == bt_session_may_download(s));
+
+    config_set(bt_session_get_config(s), "max_download_rate", "1000");
+    bt_session_spend_download(s, 1000);
+    CuAssertTrue(tc, 0 == bt_session_may_download(s));
+    CuAssertTrue(tc, 1 == bt_session_may_upload(s));
+    bt_session_free(s);
+}
+
+void TestBT_session_splits_diskcache_budget(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    void *dc1 = bt_diskcache_new(), *dc2 = bt_diskcache_new();
+
+    config_set(bt_session_get_config(s), "diskcache_write_bytes", "1000");
+    config_set(bt_session_get_config(s), "diskcache_read_bytes", "400");
+    bt_session_add_diskcache(s, dc1);
+    bt_session_add_diskcache(s, dc2);
+    bt_session_periodic(s);
+    CuAssertTrue(tc, 500 == config_get_int(bt_diskcache_get_config(dc1),
+                                           "diskcache_write_bytes"));
+    CuAssertTrue(tc, 200 == config_get_int(bt_diskcache_get_config(dc2),
+                                           "diskcache_read_bytes"));
+
+    bt_session_remove_diskcache(s, dc2);
+    bt_session_periodic(s);
+    CuAssertTrue(tc, 1000 == config_get_int(bt_diskcache_get_config(dc1),
+                                            "diskcache_write_bytes"));
+    bt_diskcache_free(dc1);
+    bt_diskcache_free(dc2);
+    bt_session_free(s);
+}
+
+void TestBT_session_splits_max_memory(
+    CuTest * tc
+)
+{
+    void *s = bt_session_new();
+    void *dm1 = __torrent("aaaaaaaaaaaaaaaaaaaa"),
+         *dm2 = __torrent("bbbbbbbbbbbbbbbbbbbb");
+    bt_memory_stats_t m;
+
+    config_set(bt_session_get_config(s), "max_memory", "1000");
+    bt_session_add_torrent(s, dm1);
+    bt_session_add_torrent(s, dm2);
+    bt_session_periodic(s);
+    bt_dm_get_memory(dm1, &m);
+    CuAssertTrue(tc, 500 == m.limit);
+
+    /* a torrent's own cap applies if it's lower */
+    config_set(bt_dm_get_config(dm2), "max_memory", "300");
+    bt_dm_get_memory(dm2, &m);
+    CuAssertTrue(tc, 300 == m.limit);
+
+    bt_session_remove_torrent(s, dm1);
+    bt_session_periodic(s);
+    bt_dm_get_memory(dm1, &m);
+    CuAssertTrue(tc, 0 == m.limit);
+    bt_dm_get_memory(dm2, &m);
+    CuAssertTrue(tc, 300 == m.limit);
+    bt_session_free(s);
+    bt_dm_release(dm1);
+}
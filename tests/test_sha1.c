@@ -0,0 +1,138 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "sha1.h"
+#include "bt_sha1.h"
+
+static void __compare_with_reference(CuTest * tc)
+{
+    char *data, ref[21], hash[20];
+    unsigned int len;
+
+    data = malloc(5000);
+    for (len = 0; len < 5000; len++)
+        data[len] = (char)(len * 7 + 3);
+
+    for (len = 0; len < 5000; len += 1 + len / 8)
+    {
+        SHA1(ref, data, len);
+        bt_sha1(hash, data, len);
+        CuAssertTrue(tc, 0 == memcmp(ref, hash, 20));
+    }
+
+    free(data);
+}
+
+void TestBTSha1_matches_known_digest(
+    CuTest * tc
+)
+{
+    char hash[20];
+
+    bt_sha1(hash, "abc", 3);
+    CuAssertTrue(tc, 0 == memcmp(hash,
+        "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e"
+        "\x25\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d", 20));
+}
+
+void TestBTSha1_scalar_kernel_matches_reference(
+    CuTest * tc
+)
+{
+    bt_sha1_set_acceleration(0);
+    __compare_with_reference(tc);
+    bt_sha1_set_acceleration(1);
+}
+
+void TestBTSha1_accelerated_kernel_matches_reference(
+    CuTest * tc
+)
+{
+    /* falls back to the scalar kernel if the CPU has no SHA extensions */
+    bt_sha1_set_acceleration(1);
+    __compare_with_reference(tc);
+}
+
+void TestBTSha1_update_in_pieces_matches_one_shot(
+    CuTest * tc
+)
+{
+    bt_sha1_ctx_t ctx;
+    char data[300], ref[20], hash[20];
+    int i;
+
+    for (i = 0; i < 300; i++)
+        data[i] = (char)i;
+    bt_sha1(ref, data, 300);
+
+    bt_sha1_init(&ctx);
+    for (i = 0; i < 300; i += 13)
+        bt_sha1_update(&ctx, data + i, 300 - i < 13 ? 300 - i : 13);
+    bt_sha1_final(&ctx, hash);
+    CuAssertTrue(tc, 0 == memcmp(ref, hash, 20));
+}
+
+void TestBTSha1_multi_hashes_each_buffer(
+    CuTest * tc
+)
+{
+    char h0[20], h1[20], r0[21], r1[21], *hashes[2];
+    const void* data[2];
+    unsigned int lens[2];
+
+    hashes[0] = h0;
+    hashes[1] = h1;
+    data[0] = "first buffer";
+    data[1] = "the second buffer is longer than the first";
+    lens[0] = strlen(data[0]);
+    lens[1] = strlen(data[1]);
+    bt_sha1_multi(2, hashes, data, lens);
+
+    SHA1(r0, data[0], lens[0]);
+    SHA1(r1, data[1], lens[1]);
+    CuAssertTrue(tc, 0 == memcmp(r0, h0, 20));
+    CuAssertTrue(tc, 0 == memcmp(r1, h1, 20));
+}
+
+void TestBTSha1_multi_lanes_match_reference_for_unequal_lengths(
+    CuTest * tc
+)
+{
+    char digests[6][20], *hashes[6], ref[21];
+    const void* data[6];
+    unsigned int lens[6] = { 1000, 4999, 1024, 999, 64, 0 };
+    unsigned char* buf;
+    int i, accel;
+
+    buf = malloc(6 * 5000);
+    for (i = 0; i < 6 * 5000; i++)
+        buf[i] = (unsigned char)(i * 13 + 5);
+    for (i = 0; i < 6; i++)
+    {
+        hashes[i] = digests[i];
+        data[i] = buf + i * 5000;
+    }
+
+    /* without the SHA extensions batches of 4 are hashed in lanes */
+    for (accel = 0; accel <= 1; accel++)
+    {
+        bt_sha1_set_acceleration(accel);
+        memset(digests, 0, sizeof(digests));
+        bt_sha1_multi(6, hashes, data, lens);
+        for (i = 0; i < 6; i++)
+        {
+            SHA1(ref, data[i], lens[i]);
+            CuAssertTrue(tc, 0 == memcmp(ref, hashes[i], 20));
+        }
+    }
+
+    bt_sha1_set_acceleration(1);
+    free(buf);
+}
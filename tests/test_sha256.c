@@ -0,0 +1,144 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_sha256.h"
+
+static void __known_digests(CuTest * tc)
+{
+    char hash[32], *data;
+
+    bt_sha256(hash, "", 0);
+    CuAssertTrue(tc, 0 == memcmp(hash,
+        "\xe3\xb0\xc4\x42\x98\xfc\x1c\x14\x9a\xfb\xf4\xc8\x99\x6f\xb9\x24"
+        "\x27\xae\x41\xe4\x64\x9b\x93\x4c\xa4\x95\x99\x1b\x78\x52\xb8\x55",
+        32));
+
+    bt_sha256(hash, "abc", 3);
+    CuAssertTrue(tc, 0 == memcmp(hash,
+        "\xba\x78\x16\xbf\x8f\x01\xcf\xea\x41\x41\x40\xde\x5d\xae\x22\x23"
+        "\xb0\x03\x61\xa3\x96\x17\x7a\x9c\xb4\x10\xff\x61\xf2\x00\x15\xad",
+        32));
+
+    /* the length spills into a second block */
+    bt_sha256(hash, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+              56);
+    CuAssertTrue(tc, 0 == memcmp(hash,
+        "\x24\x8d\x6a\x61\xd2\x06\x38\xb8\xe5\xc0\x26\x93\x0c\x3e\x60\x39"
+        "\xa3\x3c\xe4\x59\x64\xff\x21\x67\xf6\xec\xed\xd4\x19\xdb\x06\xc1",
+        32));
+
+    data = malloc(1000000);
+    memset(data, 'a', 1000000);
+    bt_sha256(hash, data, 1000000);
+    CuAssertTrue(tc, 0 == memcmp(hash,
+        "\xcd\xc7\x6e\x5c\x99\x14\xfb\x92\x81\xa1\xc7\xe2\x84\xd7\x3e\x67"
+        "\xf1\x80\x9a\x48\xa4\x97\x20\x0e\x04\x6d\x39\xcc\xc7\x11\x2c\xd0",
+        32));
+    free(data);
+}
+
+void TestBTSha256_scalar_kernel_matches_known_digests(
+    CuTest * tc
+)
+{
+    bt_sha256_set_acceleration(0);
+    __known_digests(tc);
+    bt_sha256_set_acceleration(1);
+}
+
+void TestBTSha256_accelerated_kernel_matches_known_digests(
+    CuTest * tc
+)
+{
+    /* falls back to the scalar kernel if the CPU has no SHA extensions */
+    bt_sha256_set_acceleration(1);
+    __known_digests(tc);
+}
+
+void TestBTSha256_kernels_agree(
+    CuTest * tc
+)
+{
+    char *data, ref[32], hash[32];
+    unsigned int len;
+
+    data = malloc(5000);
+    for (len = 0; len < 5000; len++)
+        data[len] = (char)(len * 7 + 3);
+
+    for (len = 0; len < 5000; len += 1 + len / 8)
+    {
+        bt_sha256_set_acceleration(0);
+        bt_sha256(ref, data, len);
+        bt_sha256_set_acceleration(1);
+        bt_sha256(hash, data, len);
+        CuAssertTrue(tc, 0 == memcmp(ref, hash, 32));
+    }
+
+    free(data);
+}
+
+void TestBTSha256_update_in_pieces_matches_one_shot(
+    CuTest * tc
+)
+{
+    bt_sha256_ctx_t ctx;
+    char data[300], ref[32], hash[32];
+    int i;
+
+    for (i = 0; i < 300; i++)
+        data[i] = (char)i;
+    bt_sha256(ref, data, 300);
+
+    bt_sha256_init(&ctx);
+    for (i = 0; i < 300; i += 13)
+        bt_sha256_update(&ctx, data + i, 300 - i < 13 ? 300 - i : 13);
+    bt_sha256_final(&ctx, hash);
+    CuAssertTrue(tc, 0 == memcmp(ref, hash, 32));
+}
+
+void TestBTSha256_merkle_root_pads_with_zero_leaves(
+    CuTest * tc
+)
+{
+    char leaves[96], pair[64], left[32], right[32], ref[32], root[32];
+
+    memset(leaves, 1, 32);
+    memset(leaves + 32, 2, 32);
+    memset(leaves + 64, 3, 32);
+
+    /* H(H(l0 | l1) | H(l2 | 0)) */
+    bt_sha256(left, leaves, 64);
+    memcpy(pair, leaves + 64, 32);
+    memset(pair + 32, 0, 32);
+    bt_sha256(right, pair, 64);
+    memcpy(pair, left, 32);
+    memcpy(pair + 32, right, 32);
+    bt_sha256(ref, pair, 64);
+
+    CuAssertTrue(tc, 1 == bt_sha256_merkle_root(root, leaves, 3, 4));
+    CuAssertTrue(tc, 0 == memcmp(ref, root, 32));
+
+    /* a single leaf is its own root */
+    CuAssertTrue(tc, 1 == bt_sha256_merkle_root(root, leaves, 1, 1));
+    CuAssertTrue(tc, 0 == memcmp(leaves, root, 32));
+}
+
+void TestBTSha256_merkle_root_needs_power_of_two_width(
+    CuTest * tc
+)
+{
+    char leaves[96], root[32];
+
+    memset(leaves, 0, sizeof(leaves));
+    CuAssertTrue(tc, 0 == bt_sha256_merkle_root(root, leaves, 3, 3));
+    CuAssertTrue(tc, 0 == bt_sha256_merkle_root(root, leaves, 3, 2));
+    CuAssertTrue(tc, 0 == bt_sha256_merkle_root(root, leaves, 0, 0));
+}
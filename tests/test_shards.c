@@ -0,0 +1,49 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_shards.h"
+
+static void __count_shard(void* udata, int shard, int nshards)
+{
+    int* runs = udata;
+
+    /* each shard has its own slot */
+    runs[shard] += nshards;
+}
+
+void TestShards_every_shard_runs_once_per_run(
+    CuTest * tc
+)
+{
+    void *s = bt_shards_new(4);
+    int i, runs[4];
+
+    memset(runs, 0, sizeof(runs));
+    CuAssertTrue(tc, 4 == bt_shards_count(s));
+    for (i = 0; i < 100; i++)
+        bt_shards_run(s, runs, __count_shard);
+    for (i = 0; i < 4; i++)
+        CuAssertTrue(tc, 400 == runs[i]);
+    bt_shards_free(s);
+}
+
+void TestShards_single_shard_runs_on_caller(
+    CuTest * tc
+)
+{
+    void *s = bt_shards_new(1);
+    int runs[1] = { 0 };
+
+    bt_shards_run(s, runs, __count_shard);
+    CuAssertTrue(tc, 1 == runs[0]);
+    bt_shards_free(s);
+    CuAssertTrue(tc, NULL == bt_shards_new(0));
+}
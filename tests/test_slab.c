@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_slab.h"
+
+void TestBT_slab_nothing_is_mapped_until_first_alloc(CuTest * tc)
+{
+    void *s;
+
+    s = bt_slab_new(128, 1024, 0);
+    CuAssertTrue(tc, 0 == bt_slab_get_mapped_bytes(s));
+    bt_slab_free(s);
+}
+
+void TestBT_slab_alloc_maps_up_to_budget(CuTest * tc)
+{
+    void *s, *a, *b;
+
+    s = bt_slab_new(128, 1024, 0);
+    a = bt_slab_alloc(s);
+    b = bt_slab_alloc(s);
+    CuAssertTrue(tc, NULL != a);
+    CuAssertTrue(tc, NULL != b);
+    CuAssertTrue(tc, a != b);
+    CuAssertTrue(tc, 1024 == bt_slab_get_mapped_bytes(s));
+    memset(a, 'a', 128);
+    memset(b, 'b', 128);
+    CuAssertTrue(tc, 'a' == ((char*)a)[127]);
+    bt_slab_release(s, a);
+    bt_slab_release(s, b);
+    bt_slab_free(s);
+}
+
+void TestBT_slab_released_buffers_are_reused(CuTest * tc)
+{
+    void *s, *a;
+
+    s = bt_slab_new(128, 1024, 0);
+    a = bt_slab_alloc(s);
+    bt_slab_release(s, a);
+    CuAssertTrue(tc, a == bt_slab_alloc(s));
+    bt_slab_free(s);
+}
+
+void TestBT_slab_alloc_beyond_budget_uses_heap(CuTest * tc)
+{
+    void *s, *bufs[9];
+    int i;
+
+    s = bt_slab_new(128, 1024, 0);
+    for (i = 0; i < 9; i++)
+        CuAssertTrue(tc, NULL != (bufs[i] = bt_slab_alloc(s)));
+    CuAssertTrue(tc, 1024 == bt_slab_get_mapped_bytes(s));
+    for (i = 0; i < 9; i++)
+        bt_slab_release(s, bufs[i]);
+    bt_slab_free(s);
+}
+
+void TestBT_slab_hugepages_fall_back_to_normal_pages(CuTest * tc)
+{
+    void *s, *a;
+
+    s = bt_slab_new(1 << 20, 1 << 22, 1);
+    CuAssertTrue(tc, NULL != (a = bt_slab_alloc(s)));
+    memset(a, 0, 1 << 20);
+    bt_slab_release(s, a);
+    bt_slab_free(s);
+}
+
+void TestBT_slab_reserve_maps_whole_budget(CuTest * tc)
+{
+    void *s, *a;
+    unsigned long long len;
+
+    s = bt_slab_new(128, 1024, 0);
+    CuAssertTrue(tc, 1 == bt_slab_reserve(s));
+    CuAssertTrue(tc, 1024 == bt_slab_get_mapped_bytes(s));
+    CuAssertTrue(tc, 1 == bt_slab_get_nslabs(s));
+    CuAssertTrue(tc, NULL != bt_slab_get_slab(s, 0, &len));
+    CuAssertTrue(tc, 1024 == len);
+    a = bt_slab_alloc(s);
+    CuAssertTrue(tc, 0 == bt_slab_find(s, a));
+    bt_slab_release(s, a);
+    bt_slab_free(s);
+}
+
+void TestBT_slab_find_doesnt_find_heap_buffers(CuTest * tc)
+{
+    void *s, *a;
+
+    s = bt_slab_new(128, 0, 0);
+    a = bt_slab_alloc(s);
+    CuAssertTrue(tc, -1 == bt_slab_find(s, a));
+    bt_slab_release(s, a);
+    bt_slab_free(s);
+}
@@ -0,0 +1,117 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt_timerwheel.h"
+
+static void __count(void* udata)
+{
+    (*(int*)udata)++;
+}
+
+void TestBT_timerwheel_after_new_is_empty(
+    CuTest * tc
+)
+{
+    void *w;
+
+    w = bt_timerwheel_new(0);
+    CuAssertTrue(tc, 0 == bt_timerwheel_count(w));
+    CuAssertTrue(tc, 0 == bt_timerwheel_step(w, 1000));
+    bt_timerwheel_free(w);
+}
+
+void TestBT_timerwheel_timer_fires_when_due(
+    CuTest * tc
+)
+{
+    void *w;
+    int fired = 0;
+
+    w = bt_timerwheel_new(0);
+    bt_timerwheel_add(w, 10, &fired, __count);
+    CuAssertTrue(tc, 1 == bt_timerwheel_count(w));
+    bt_timerwheel_step(w, 9);
+    CuAssertTrue(tc, 0 == fired);
+    bt_timerwheel_step(w, 10);
+    CuAssertTrue(tc, 1 == fired);
+    CuAssertTrue(tc, 0 == bt_timerwheel_count(w));
+    bt_timerwheel_free(w);
+}
+
+void TestBT_timerwheel_timers_on_upper_levels_fire_on_time(
+    CuTest * tc
+)
+{
+    void *w;
+    int fired = 0;
+
+    w = bt_timerwheel_new(12345);
+    bt_timerwheel_add(w, 100, &fired, __count);
+    bt_timerwheel_add(w, 30000, &fired, __count);
+    bt_timerwheel_add(w, 5000000, &fired, __count);
+    bt_timerwheel_step(w, 12345 + 99);
+    CuAssertTrue(tc, 0 == fired);
+    bt_timerwheel_step(w, 12345 + 100);
+    CuAssertTrue(tc, 1 == fired);
+    bt_timerwheel_step(w, 12345 + 29999);
+    CuAssertTrue(tc, 1 == fired);
+    bt_timerwheel_step(w, 12345 + 30000);
+    CuAssertTrue(tc, 2 == fired);
+    bt_timerwheel_step(w, 12345 + 4999999);
+    CuAssertTrue(tc, 2 == fired);
+    bt_timerwheel_step(w, 12345 + 5000000);
+    CuAssertTrue(tc, 3 == fired);
+    bt_timerwheel_free(w);
+}
+
+void TestBT_timerwheel_cancelled_timer_does_not_fire(
+    CuTest * tc
+)
+{
+    void *w, *t;
+    int fired = 0;
+
+    w = bt_timerwheel_new(0);
+    t = bt_timerwheel_add(w, 10, &fired, __count);
+    bt_timerwheel_cancel(w, t);
+    CuAssertTrue(tc, 0 == bt_timerwheel_count(w));
+    bt_timerwheel_step(w, 100);
+    CuAssertTrue(tc, 0 == fired);
+    bt_timerwheel_free(w);
+}
+
+typedef struct
+{
+    void* w;
+    int fired;
+} rearm_t;
+
+static void __rearm(void* udata)
+{
+    rearm_t* r = udata;
+
+    r->fired++;
+    bt_timerwheel_add(r->w, 1000, r, __rearm);
+}
+
+void TestBT_timerwheel_callback_can_rearm(
+    CuTest * tc
+)
+{
+    rearm_t r;
+
+    r.w = bt_timerwheel_new(0);
+    r.fired = 0;
+    bt_timerwheel_add(r.w, 1000, &r, __rearm);
+    bt_timerwheel_step(r.w, 10500);
+    CuAssertTrue(tc, 10 == r.fired);
+    CuAssertTrue(tc, 1 == bt_timerwheel_count(r.w));
+    bt_timerwheel_free(r.w);
+}
@@ -0,0 +1,124 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_trace.h"
+#include "bitfield.h"
+#include "pwp_connection.h"
+
+void TestBT_trace_nothing_is_recorded_outside_the_mask(CuTest * tc)
+{
+    bt_trace_event_t e[4];
+
+    bt_trace_clear();
+    bt_trace_set_mask(BT_TRACE_PEER);
+    BT_TRACE(BT_TRACE_WIRE, BT_TRACE_SEND + PWP_MSGTYPE_HAVE, NULL, 1, 0, 0);
+    CuAssertTrue(tc, 0 == bt_trace_snapshot(e, 4));
+
+    bt_trace_set_mask(0);
+    BT_TRACE(BT_TRACE_PEER, BT_TRACE_PEER_ADDED, NULL, 0, 0, 0);
+    CuAssertTrue(tc, 0 == bt_trace_snapshot(e, 4));
+}
+
+void TestBT_trace_events_come_back_oldest_first(CuTest * tc)
+{
+    bt_trace_event_t e[4];
+
+    bt_trace_clear();
+    bt_trace_set_mask(BT_TRACE_ALL);
+    BT_TRACE(BT_TRACE_PEER, BT_TRACE_PEER_ADDED, (void*)1, 0, 0, 0);
+    BT_TRACE(BT_TRACE_WIRE, BT_TRACE_READ + PWP_MSGTYPE_PIECE, (void*)1,
+             3, 0, 16384);
+    BT_TRACE(BT_TRACE_PIECE, BT_TRACE_PIECE_COMPLETED, NULL, 3, 0, 16384);
+    bt_trace_set_mask(0);
+
+    CuAssertTrue(tc, 3 == bt_trace_snapshot(e, 4));
+    CuAssertTrue(tc, BT_TRACE_PEER_ADDED == e[0].event);
+    CuAssertTrue(tc, BT_TRACE_READ + PWP_MSGTYPE_PIECE == e[1].event);
+    CuAssertTrue(tc, (void*)1 == e[1].peer);
+    CuAssertTrue(tc, 16384 == e[1].len);
+    CuAssertTrue(tc, BT_TRACE_PIECE_COMPLETED == e[2].event);
+    CuAssertTrue(tc, e[0].ns <= e[1].ns && e[1].ns <= e[2].ns);
+
+    /* only the newest are copied when there isn't room */
+    CuAssertTrue(tc, 1 == bt_trace_snapshot(e, 1));
+    CuAssertTrue(tc, BT_TRACE_PIECE_COMPLETED == e[0].event);
+}
+
+void TestBT_trace_format_is_readable(CuTest * tc)
+{
+    bt_trace_event_t e;
+    char buf[128];
+
+    memset(&e, 0, sizeof(e));
+    e.event = BT_TRACE_SEND + PWP_MSGTYPE_REQUEST;
+    e.piece_idx = 3;
+    e.offset = 16384;
+    e.len = 16384;
+    CuAssertStrEquals(tc, "send,REQUEST,piece_idx=3 offset=16384 len=16384",
+                      bt_trace_format(&e, buf, sizeof(buf)));
+
+    e.event = BT_TRACE_READ + PWP_MSGTYPE_CHOKE;
+    CuAssertStrEquals(tc, "read,CHOKE,piece_idx=3 offset=16384 len=16384",
+                      bt_trace_format(&e, buf, sizeof(buf)));
+
+    e.event = BT_TRACE_PIECE_FAILED;
+    CuAssertStrEquals(tc, "piece,failed,piece_idx=3 len=16384",
+                      bt_trace_format(&e, buf, sizeof(buf)));
+}
+
+static void* __trace_many(void* n)
+{
+    int i;
+
+    for (i = 0; i < *(int*)n; i++)
+        BT_TRACE(BT_TRACE_PEER, BT_TRACE_PEER_ADDED, NULL, i, 0, 0);
+    return NULL;
+}
+
+void TestBT_trace_ring_keeps_the_newest_events(CuTest * tc)
+{
+    bt_trace_event_t e[64];
+    pthread_t t;
+    int n = 20, i;
+
+    bt_trace_clear();
+    bt_trace_set_mask(BT_TRACE_ALL);
+
+    /* a new thread gets a ring of the new size */
+    bt_trace_set_ring_size(8);
+    pthread_create(&t, NULL, __trace_many, &n);
+    pthread_join(t, NULL);
+    bt_trace_set_ring_size(4096);
+    bt_trace_set_mask(0);
+
+    CuAssertTrue(tc, 8 == bt_trace_snapshot(e, 64));
+    for (i = 0; i < 8; i++)
+        CuAssertTrue(tc, 12 + i == e[i].piece_idx);
+}
+
+void TestBT_trace_rings_of_each_thread_are_merged(CuTest * tc)
+{
+    bt_trace_event_t e[64];
+    pthread_t t[2];
+    int n = 10, i;
+
+    bt_trace_clear();
+    bt_trace_set_mask(BT_TRACE_ALL);
+    pthread_create(&t[0], NULL, __trace_many, &n);
+    pthread_create(&t[1], NULL, __trace_many, &n);
+    pthread_join(t[0], NULL);
+    pthread_join(t[1], NULL);
+    bt_trace_set_mask(0);
+
+    CuAssertTrue(tc, 20 == bt_trace_snapshot(e, 64));
+    for (i = 1; i < 20; i++)
+        CuAssertTrue(tc, e[i - 1].ns <= e[i].ns);
+}
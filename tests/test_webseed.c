@@ -0,0 +1,416 @@
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "config.h"
+
+#include "bt.h"
+#include "bt_diskmem.h"
+#include "bt_piece_db.h"
+#include "bt_selector_auto.h"
+#include "bt_sha1.h"
+#include "bt_webseed.h"
+
+typedef struct
+{
+    /* what was sent, one after the other */
+    char sent[4096];
+    unsigned int nsent;
+
+    /* blocks pushed, and their first bytes */
+    bt_block_t pushed[8];
+    char first[8];
+    int npushed;
+} fetch_t;
+
+static int __send(void* udata, const char* buf, unsigned int len)
+{
+    fetch_t* f = udata;
+
+    memcpy(f->sent + f->nsent, buf, len);
+    f->nsent += len;
+    f->sent[f->nsent] = '\0';
+    return 1;
+}
+
+static void __pushblock(void* udata, bt_block_t* b, const void* data)
+{
+    fetch_t* f = udata;
+
+    f->first[f->npushed] = *(const char*)data;
+    f->pushed[f->npushed++] = *b;
+}
+
+static void __giveback(void* udata, bt_block_t* b)
+{
+    ((fetch_t*)udata)->npushed--;
+}
+
+static void* __webseed(fetch_t* f, const char* url, int piece_len)
+{
+    void* ws = bt_webseed_new(url);
+
+    memset(f, 0, sizeof(fetch_t));
+    bt_webseed_set_piece_length(ws, piece_len);
+    bt_webseed_set_cbs(ws, &((bt_webseed_cbs_t) {
+                             .send = __send,
+                             .pushblock = __pushblock
+                         }), f);
+    return ws;
+}
+
+static void __request(void* ws, int idx, int offset, int len)
+{
+    bt_block_t b = { .piece_idx = idx, .offset = offset, .len = len };
+
+    bt_webseed_request(ws, &b);
+}
+
+static int __count(const char* s, const char* what)
+{
+    int n = 0;
+
+    for (; (s = strstr(s, what)); s++)
+        n++;
+    return n;
+}
+
+void TestBT_webseed_url_is_parsed(
+    CuTest * tc
+)
+{
+    void* ws = bt_webseed_new("http://cdn.example.com:8080/files/a.iso");
+
+    CuAssertPtrNotNull(tc, ws);
+    CuAssertStrEquals(tc, "cdn.example.com", bt_webseed_get_host(ws));
+    CuAssertTrue(tc, 8080 == bt_webseed_get_port(ws));
+    bt_webseed_free(ws);
+
+    ws = bt_webseed_new("http://cdn.example.com");
+    CuAssertTrue(tc, 80 == bt_webseed_get_port(ws));
+    bt_webseed_free(ws);
+
+    CuAssertTrue(tc, NULL == bt_webseed_new("https://cdn.example.com/a"));
+    CuAssertTrue(tc, NULL == bt_webseed_new("http:///a"));
+    CuAssertTrue(tc, NULL == bt_webseed_new("http://cdn.example.com:0/a"));
+}
+
+void TestBT_webseed_contiguous_blocks_are_one_get(
+    CuTest * tc
+)
+{
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/a.iso", 32768);
+
+    __request(ws, 0, 0, 16384);
+    __request(ws, 0, 16384, 16384);
+    __request(ws, 1, 0, 16384);
+    CuAssertTrue(tc, 1 == bt_webseed_flush(ws));
+    CuAssertTrue(tc, 1 == __count(f.sent, "GET /a.iso HTTP/1.1\r\n"));
+    CuAssertTrue(tc, NULL != strstr(f.sent, "Host: cdn.example.com\r\n"));
+    CuAssertTrue(tc, NULL != strstr(f.sent, "Range: bytes=0-49151\r\n"));
+    CuAssertTrue(tc, 3 == bt_webseed_get_npending(ws));
+
+    /* nothing new to send */
+    CuAssertTrue(tc, 1 == bt_webseed_flush(ws));
+    CuAssertTrue(tc, 1 == __count(f.sent, "GET "));
+    bt_webseed_free(ws);
+}
+
+void TestBT_webseed_gap_is_another_get(
+    CuTest * tc
+)
+{
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com:8080/a.iso", 16384);
+
+    __request(ws, 0, 0, 16384);
+    __request(ws, 2, 0, 16384);
+    bt_webseed_flush(ws);
+    CuAssertTrue(tc, 2 == __count(f.sent, "GET "));
+    CuAssertTrue(tc, NULL != strstr(f.sent, "Host: cdn.example.com:8080\r\n"));
+    CuAssertTrue(tc, NULL != strstr(f.sent, "Range: bytes=32768-49151\r\n"));
+    bt_webseed_free(ws);
+}
+
+void TestBT_webseed_range_across_files_is_a_get_per_file(
+    CuTest * tc
+)
+{
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/t", 32768);
+
+    bt_webseed_add_file(ws, "a b", 20000);
+    bt_webseed_add_file(ws, "dir/c", 40000);
+    __request(ws, 0, 0, 32768);
+    bt_webseed_flush(ws);
+    CuAssertTrue(tc, NULL != strstr(f.sent, "GET /t/a%20b HTTP/1.1\r\n"
+                                    "Host: cdn.example.com\r\n"
+                                    "Range: bytes=0-19999\r\n"));
+    CuAssertTrue(tc, NULL != strstr(f.sent, "GET /t/dir/c HTTP/1.1\r\n"
+                                    "Host: cdn.example.com\r\n"
+                                    "Range: bytes=0-12767\r\n"));
+    bt_webseed_free(ws);
+}
+
+static int __response(char* buf, unsigned long long start,
+                      unsigned int len, char fill)
+{
+    int n = sprintf(buf, "HTTP/1.1 206 Partial Content\r\n"
+                    "Content-Range: bytes %llu-%llu/1000000\r\n"
+                    "content-length: %u\r\n"
+                    "\r\n", start, start + len - 1, len);
+
+    memset(buf + n, fill, len);
+    return n + len;
+}
+
+void TestBT_webseed_response_fills_the_blocks(
+    CuTest * tc
+)
+{
+    static char buf[40000];
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/a.iso", 16384);
+    int len, i;
+
+    __request(ws, 1, 0, 8192);
+    __request(ws, 1, 8192, 8192);
+    bt_webseed_flush(ws);
+    len = __response(buf, 16384, 16384, 'x');
+
+    /* a byte at a time */
+    for (i = 0; i < len; i++)
+        CuAssertTrue(tc, 1 == bt_webseed_dispatch_from_buffer(ws, buf + i, 1));
+
+    CuAssertTrue(tc, 2 == f.npushed);
+    CuAssertTrue(tc, 1 == f.pushed[0].piece_idx);
+    CuAssertTrue(tc, 0 == f.pushed[0].offset);
+    CuAssertTrue(tc, 8192 == f.pushed[1].offset);
+    CuAssertTrue(tc, 'x' == f.first[1]);
+    CuAssertTrue(tc, 0 == bt_webseed_get_npending(ws));
+
+    /* nothing more was asked for */
+    CuAssertTrue(tc, 0 == bt_webseed_dispatch_from_buffer(ws, buf, len));
+    bt_webseed_free(ws);
+}
+
+void TestBT_webseed_pipelined_responses_arrive_together(
+    CuTest * tc
+)
+{
+    static char buf[40000];
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/a.iso", 16384);
+    int len;
+
+    __request(ws, 0, 0, 16384);
+    __request(ws, 3, 0, 16384);
+    bt_webseed_flush(ws);
+    len = __response(buf, 0, 16384, 'a');
+    len += __response(buf + len, 49152, 16384, 'b');
+    CuAssertTrue(tc, 1 == bt_webseed_dispatch_from_buffer(ws, buf, len));
+    CuAssertTrue(tc, 2 == f.npushed);
+    CuAssertTrue(tc, 'a' == f.first[0]);
+    CuAssertTrue(tc, 3 == f.pushed[1].piece_idx);
+    CuAssertTrue(tc, 'b' == f.first[1]);
+    bt_webseed_free(ws);
+}
+
+void TestBT_webseed_wrong_range_is_refused(
+    CuTest * tc
+)
+{
+    static char buf[40000];
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/a.iso", 16384);
+    int len;
+
+    __request(ws, 0, 0, 16384);
+    bt_webseed_flush(ws);
+    len = __response(buf, 16384, 16384, 'a');
+    CuAssertTrue(tc, 0 == bt_webseed_dispatch_from_buffer(ws, buf, len));
+    CuAssertTrue(tc, 0 == f.npushed);
+    bt_webseed_free(ws);
+}
+
+void TestBT_webseed_whole_file_response_is_refused(
+    CuTest * tc
+)
+{
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/a.iso", 16384);
+    char* r = "HTTP/1.1 200 OK\r\nContent-Length: 16384\r\n\r\n";
+
+    __request(ws, 0, 0, 16384);
+    bt_webseed_flush(ws);
+    CuAssertTrue(tc, 0 == bt_webseed_dispatch_from_buffer(ws, r, strlen(r)));
+    bt_webseed_free(ws);
+}
+
+void TestBT_webseed_busy_server_says_when_to_retry(
+    CuTest * tc
+)
+{
+    fetch_t f;
+    void* ws = __webseed(&f, "http://cdn.example.com/a.iso", 16384);
+    char* r = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 120\r\n\r\n";
+
+    __request(ws, 0, 0, 16384);
+    bt_webseed_flush(ws);
+    CuAssertTrue(tc, 0 == bt_webseed_dispatch_from_buffer(ws, r, strlen(r)));
+    CuAssertTrue(tc, 120 == bt_webseed_get_retry_secs(ws));
+
+    /* what wasn't sent is given back, and we start again */
+    f.npushed = 1;
+    bt_webseed_giveback(ws, &f, __giveback);
+    CuAssertTrue(tc, 0 == f.npushed);
+    CuAssertTrue(tc, 0 == bt_webseed_get_npending(ws));
+    bt_webseed_free(ws);
+}
+
+/* the server: a torrent of NPIECES pieces, each byte its piece's index + 1
+ * so that none is complete on the empty disk */
+#define NPIECES 6
+#define PIECE_LEN (2 * (BT_BLOCK_SIZE))
+
+typedef struct
+{
+    void* dm;
+    void* conn_ctx;
+    int (*process_data)(void*, void*, const char*, unsigned int);
+    int nconnects;
+
+    /* the responses to what's been asked for */
+    char* out;
+    unsigned int nout;
+} server_t;
+
+static int __server_connect(void* me, void** udata, void** conn_ctx,
+                            const char* host, const int port,
+                            int (*process_data)(void*, void*, const char*,
+                                                unsigned int),
+                            int (*process_connection)(void*, void*, char*,
+                                                      int),
+                            void (*connection_failed)(void*, void*))
+{
+    server_t* s = *udata;
+
+    s->nconnects++;
+    *conn_ctx = s;
+    s->conn_ctx = s;
+    s->process_data = process_data;
+    return process_connection(me, s, "10.0.0.1", port);
+}
+
+static int __server_send(void* me, void** udata, void* conn_ctx,
+                         const char* buf, const int len)
+{
+    server_t* s = *udata;
+    unsigned long long start, end, i;
+    const char* r;
+
+    for (r = buf; (r = strstr(r, "Range: bytes=")); r++)
+    {
+        char hdr[128];
+        int n;
+
+        sscanf(r, "Range: bytes=%llu-%llu", &start, &end);
+        n = sprintf(hdr, "HTTP/1.1 206 Partial Content\r\n"
+                    "Content-Length: %llu\r\n\r\n", end - start + 1);
+        s->out = realloc(s->out, s->nout + n + end - start + 1);
+        memcpy(s->out + s->nout, hdr, n);
+        s->nout += n;
+        for (i = start; i <= end; i++)
+            s->out[s->nout++] = (char)(i / PIECE_LEN + 1);
+    }
+    return 1;
+}
+
+void TestBT_dm_webseed_downloads_the_torrent(
+    CuTest * tc
+)
+{
+    void *dm = bt_dm_new(), *cfg = bt_dm_get_config(dm), *dc, *db;
+    char data[PIECE_LEN], hash[20];
+    server_t s;
+    bt_dm_stats_t stats;
+    int i;
+
+    memset(&s, 0, sizeof(s));
+    config_set_va(cfg, "npieces", "%d", NPIECES);
+    config_set_va(cfg, "piece_length", "%d", PIECE_LEN);
+    config_set(cfg, "infohash", "00000000000000000000");
+    bt_dm_set_cbs(dm, &((bt_dm_cbs_t) {
+                        .peer_connect = __server_connect,
+                        .peer_send = __server_send
+                    }), &s);
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, PIECE_LEN);
+    db = bt_piecedb_new();
+    bt_piecedb_set_diskstorage(db, bt_diskmem_get_blockrw(dc), dc);
+    bt_dm_set_piece_db(dm, &((bt_piecedb_i){.get_piece = bt_piecedb_get }),
+                       db);
+    bt_piecedb_increase_piece_space(db, NPIECES);
+    for (i = 0; i < NPIECES; i++)
+    {
+        memset(data, i + 1, PIECE_LEN);
+        bt_sha1(hash, data, PIECE_LEN);
+        bt_piecedb_add_with_hash_and_size(db, hash, PIECE_LEN);
+    }
+    bt_dm_set_piece_selector(dm,
+                             &((bt_pieceselector_i) {
+                                   .new = bt_auto_selector_new,
+                                   .peer_giveback_piece =
+                                       bt_auto_selector_giveback_piece,
+                                   .have_piece = bt_auto_selector_have_piece,
+                                   .remove_peer =
+                                       bt_auto_selector_remove_peer,
+                                   .add_peer = bt_auto_selector_add_peer,
+                                   .peer_have_piece =
+                                       bt_auto_selector_peer_have_piece,
+                                   .peer_have_bitfield =
+                                       bt_auto_selector_peer_have_bitfield,
+                                   .get_npeers = bt_auto_selector_get_npeers,
+                                   .get_npieces =
+                                       bt_auto_selector_get_npieces,
+                                   .poll_piece =
+                                       bt_auto_selector_poll_best_piece
+                               }), NULL);
+
+    CuAssertTrue(tc, NULL == bt_dm_add_webseed(dm, "ftp://cdn/a"));
+    CuAssertPtrNotNull(tc, bt_dm_add_webseed(dm, "http://cdn/a.iso"));
+
+    /* the server answers between ticks, not all at once */
+    for (i = 0; i < 20 && !bt_piecedb_all_pieces_are_complete(db); i++)
+    {
+        unsigned int n = s.nout < 50000 ? s.nout : 50000;
+
+        bt_dm_periodic(dm, NULL);
+        if (0 == n)
+            continue;
+        CuAssertTrue(tc, 1 == s.process_data(dm, s.conn_ctx, s.out, n));
+        memmove(s.out, s.out + n, s.nout - n);
+        s.nout -= n;
+    }
+    bt_dm_periodic(dm, NULL);
+
+    CuAssertTrue(tc, 1 == bt_piecedb_all_pieces_are_complete(db));
+    CuAssertTrue(tc, 1 == s.nconnects);
+
+    memset(&stats, 0, sizeof(stats));
+    bt_dm_periodic(dm, &stats);
+    CuAssertTrue(tc, (unsigned long long)NPIECES * PIECE_LEN ==
+                 stats.webseed_bytes);
+    free(stats.peers);
+    free(s.out);
+    bt_dm_release(dm);
+}